@@ -110,6 +110,14 @@ typedef int (*key_compare_fn)(const data_config *cfg, slice key1, slice key2);
 
 typedef uint32 (*key_hash_fn)(const void *input, size_t length, uint32 seed);
 
+// Returns the length of the prefix of key, at most the length of key, or 0
+// if key has no prefix.
+//
+// The keys with a given prefix must be contiguous in key order, and none of
+// them may sort before the prefix itself. Returning the first (up to) N
+// bytes of the key satisfies this for the default (memcmp) sort order.
+typedef uint64 (*key_prefix_length_fn)(const data_config *cfg, slice key);
+
 // Given two messages, old_message and new_message, merge them
 // and return the result in new_message.
 //
@@ -151,6 +159,10 @@ typedef void (*message_to_str_fn)(const data_config *cfg,
  *
  *  1. The sorting order of keys - defined by the key_compare function
  *  2. How to hash keys - defined by the key_hash function
+ *     Optionally, how to extract key prefixes - defined by key_prefix_length.
+ *     The routing filters then also hold the prefixes of keys, which lets
+ *     prefix scans skip the branches holding no keys with their prefix.
+ *     It must not change over the lifetime of a database.
  *  3. How to merge update messages - defined by the pair of merge_tuples* fns.
  *  4. How to convert between messages and values (encode and decode functions)
  *  4. Few other debugging aids on how-to print & diagnose messages.
@@ -165,6 +177,7 @@ struct data_config {
 
    key_compare_fn       key_compare;
    key_hash_fn          key_hash;
+   key_prefix_length_fn key_prefix_length; // NULL disables prefix filters
    merge_tuple_fn       merge_tuples;
    merge_tuple_final_fn merge_tuples_final;
    key_to_str_fn        key_to_string;
@@ -46,6 +46,10 @@ typedef struct {
    int    io_flags;
    uint32 io_perms;
    uint64 io_async_queue_depth;
+   // Use io_uring instead of libaio for async IO, if the kernel supports it.
+   // io_uring_sqpoll additionally offloads submission to a kernel thread.
+   bool io_use_uring;
+   bool io_uring_sqpoll;
 
    // cache
    bool        cache_use_stats;
@@ -60,13 +64,47 @@ typedef struct {
 
    // log
    bool use_log;
+   // How long (in microseconds) a splinterdb_sync call waits for other
+   // concurrent syncs to join its group commit. 0 disables the wait; syncs
+   // which arrive while a flush is in progress are still coalesced.
+   uint64 log_group_commit_window_us;
+   // How many threads splinterdb_open uses to replay the log after a crash,
+   // each replaying a range of the keys. 0 uses one per normal background
+   // thread, or the opening thread alone if there are none.
+   uint64 log_replay_threads;
+   // How many memtables are incorporated between background checkpoints,
+   // each of which lets the log written before it be freed and bounds the
+   // log replayed after a crash. 0 uses a default.
+   uint64 log_checkpoint_interval;
 
    // splinter
    uint64 memtable_capacity;
+   // Keep memtables in a lock-free skiplist in heap memory, rather than in a
+   // btree in the cache. Scales better with many concurrent writers.
+   bool memtable_use_skiplist;
+   // Split each memtable into this many shards, by key hash, each with its
+   // own insert lock. Defaults to 1, at most 16.
+   uint64 memtable_num_shards;
    uint64 fanout;
    uint64 max_branches_per_node;
    uint64 use_stats;
    uint64 reclaim_threshold;
+   // By default, inserts are gradually slowed down as the backlog of
+   // compactions and memtables awaiting incorporation grows, rather than
+   // stalling outright once every memtable is full. Set to disable that.
+   bool disable_write_throttle;
+   // How many compactions may be queued before inserts are slowed down, and
+   // how many slow them down the most. 0 uses a default.
+   uint64 write_throttle_soft_tasks;
+   uint64 write_throttle_hard_tasks;
+
+   // background threads
+   // By default, memtable incorporation and compactions are run by the
+   // threads calling into the database, a step at a time after each insert.
+   // Setting both starts threads which run them instead, in which case the
+   // backlog the write throttle reacts to can build up.
+   uint64 num_memtable_bg_threads;
+   uint64 num_normal_bg_threads;
 } splinterdb_config;
 
 // Opaque handle to an opened instance of SplinterDB
@@ -85,6 +123,11 @@ splinterdb_create(const splinterdb_config *cfg, splinterdb **kvs);
 
 // Open an existing splinterdb from a file/device on disk
 //
+// With use_log, a database which was not closed, e.g. because the process
+// crashed, is recovered: the writes made durable by the log since it was last
+// opened are replayed, see splinterdb_sync, range deletes included. A bulk
+// load is durable once it returns.
+//
 // The library will allocate and own the memory for splinterdb
 // and will free it on splinterdb_close().
 //
@@ -133,11 +176,69 @@ splinterdb_insert(const splinterdb *kvsb, slice key, slice value);
 int
 splinterdb_delete(const splinterdb *kvsb, slice key);
 
+// Delete all the keys in [start_key, end_key) and any associated values /
+// messages, in time independent of the number of keys in the range.
+//
+// A NULL_SLICE start_key (end_key) extends the range to the smallest (largest)
+// key. With use_log, a range delete is written to the write-ahead log like
+// an insert, and is durable once a later splinterdb_sync returns.
+int
+splinterdb_delete_range(const splinterdb *kvsb, slice start_key, slice end_key);
+
+// Produces the next key and value for splinterdb_bulk_load, returning FALSE
+// once there are none left. The slices must stay valid until the next call.
+typedef bool (*splinterdb_bulk_load_next_fn)(void  *arg,
+                                             slice *key,
+                                             slice *value);
+
+// Load the keys and values produced by next into an empty database, writing
+// each of them only once: they are packed straight into the on-disk trees
+// instead of going through the write-ahead log, the memtable and compaction.
+// Keys must be produced in strictly increasing order.
+//
+// Inserts block for the duration of the load, and lookups see an empty
+// database until it completes. With use_log, the loaded data is durable once
+// the load returns. Returns EINVAL, without loading anything, if the database
+// has ever held data or the keys are out of order.
+int
+splinterdb_bulk_load(const splinterdb            *kvs,
+                     splinterdb_bulk_load_next_fn next,
+                     void                        *arg);
+
+// Bulk load num_runs runs of keys and values in parallel, as if they were
+// concatenated into a single splinterdb_bulk_load. Run i is produced by
+// next(run_args[i], ...); its keys must be strictly increasing and smaller
+// than those of run i + 1.
+//
+// The first run is consumed on the calling thread, the others on background
+// threads, each by a single thread at a time.
+int
+splinterdb_bulk_load_runs(const splinterdb            *kvs,
+                          uint64                       num_runs,
+                          splinterdb_bulk_load_next_fn next,
+                          void                        *run_args[]);
+
 // Insert a key and value.
 // Relies on data_config->encode_message
 int
 splinterdb_update(const splinterdb *kvsb, slice key, slice delta);
 
+// Wait until all inserts, deletes, range deletes and updates which completed
+// before the call are durable in the write-ahead log.
+//
+// Concurrent callers are coalesced into a single batched write of every
+// thread's log pages plus one fdatasync (group commit), see
+// splinterdb_config.log_group_commit_window_us.
+//
+// Requires splinterdb_config.use_log, returns EINVAL otherwise.
+int
+splinterdb_sync(const splinterdb *kvs);
+
+// Insert a key and value, and wait until it is durable. Same as
+// splinterdb_insert followed by splinterdb_sync.
+int
+splinterdb_insert_sync(const splinterdb *kvsb, slice key, slice value);
+
 // Lookups
 
 // Size of opaque data required to hold a lookup result
@@ -203,6 +304,125 @@ splinterdb_lookup(const splinterdb         *kvs,   // IN
                   splinterdb_lookup_result *result // IN/OUT
 );
 
+// Lookup the messages for a batch of keys
+//
+// Equivalent to calling splinterdb_lookup(kvs, keys[i], &results[i]) for
+// each i < num_keys, but the keys are sorted and looked up together, so that
+// keys that share trunk nodes and filter pages only fetch them once.
+//
+// Each result must have first been initialized using
+// splinterdb_lookup_result_init. Keys may appear in any order and may repeat.
+int
+splinterdb_lookup_batch(const splinterdb         *kvs,      // IN
+                        uint64                    num_keys, // IN
+                        const slice              *keys,     // IN
+                        splinterdb_lookup_result *results   // IN/OUT
+);
+
+
+/*
+Asynchronous lookup API
+
+Async lookups allow a single thread to keep many lookups in flight, so that
+the IO needed by one lookup overlaps with the IO and CPU work of the others.
+
+A thread creates an async lookup handle, which owns a fixed number of lookup
+contexts (max_inflight). Each call to splinterdb_lookup_async() claims one
+context. If the lookup can be answered entirely from the cache, it completes
+immediately and the callback is invoked before splinterdb_lookup_async()
+returns. Otherwise, the lookup is parked until its IO completes.
+
+Parked lookups make progress only when the owning thread calls
+splinterdb_lookup_async_poll(), which reaps completed IO and resumes any
+lookups that are ready. Completion callbacks are always invoked on the
+thread that owns the handle, from within splinterdb_lookup_async() or
+splinterdb_lookup_async_poll().
+
+A handle is not thread-safe: it must only be used by the thread that
+created it. That thread must be registered with the splinterdb. In-flight
+lookups hold read references on pages in the cache, so a thread should not
+insert, update or delete while it has async lookups in flight.
+
+Sample application code:
+
+   splinterdb_lookup_async_handle *h;
+   int rc = splinterdb_lookup_async_handle_create(kvs, 64, &h);
+
+   for (i = 0; i < n; i++) {
+      while (splinterdb_lookup_async(h, keys[i], &results[i], my_cb, &arg)
+             == EAGAIN)
+      {
+         splinterdb_lookup_async_poll(h);
+      }
+   }
+   splinterdb_lookup_async_wait(h);
+   splinterdb_lookup_async_handle_destroy(h);
+*/
+
+typedef struct splinterdb_lookup_async_handle splinterdb_lookup_async_handle;
+
+// Invoked once for every async lookup when it completes.
+//
+// rc is 0 on success (including key not found), otherwise an error number.
+// result is the result passed to splinterdb_lookup_async(), now filled in.
+typedef void (*splinterdb_lookup_async_cb)(int                       rc,
+                                           splinterdb_lookup_result *result,
+                                           void                     *arg);
+
+// The most async lookups a thread may have in flight, over all its handles
+// on one splinterdb. Each parked lookup holds a read reference on a hot page,
+// such as the trunk root, and the cache bounds the references a group of
+// threads may hold on a page together.
+#define SPLINTERDB_LOOKUP_ASYNC_MAX_INFLIGHT 64
+
+// Create a per-thread handle that can have up to max_inflight async lookups
+// outstanding at once. Returns EINVAL if max_inflight is 0, or if it would
+// take the max_inflight of the calling thread's handles on kvs together past
+// SPLINTERDB_LOOKUP_ASYNC_MAX_INFLIGHT.
+int
+splinterdb_lookup_async_handle_create(
+   const splinterdb                *kvs,          // IN
+   uint32                           max_inflight, // IN
+   splinterdb_lookup_async_handle **handle        // OUT
+);
+
+// Destroy an async lookup handle.
+//
+// All lookups issued on the handle must have completed, e.g. by calling
+// splinterdb_lookup_async_wait() first.
+void
+splinterdb_lookup_async_handle_destroy(splinterdb_lookup_async_handle *handle);
+
+// Start an async lookup of key.
+//
+// The key is copied, so the caller may reuse its memory as soon as this
+// returns. result must have been initialized with
+// splinterdb_lookup_result_init() and must remain valid, and must not be
+// used for anything else, until callback has been invoked for it.
+//
+// Returns 0 if the lookup was started (and possibly already completed),
+// EAGAIN if all of the handle's contexts are in use, in which case the caller
+// should call splinterdb_lookup_async_poll() and retry, or another error
+// number on failure.
+int
+splinterdb_lookup_async(splinterdb_lookup_async_handle *handle,   // IN
+                        slice                           key,      // IN
+                        splinterdb_lookup_result       *result,   // IN/OUT
+                        splinterdb_lookup_async_cb      callback, // IN
+                        void                           *arg       // IN
+);
+
+// Make progress on in-flight async lookups: reap completed IO and resume
+// lookups that are ready, invoking the callbacks of those that complete.
+//
+// Does not block. Returns the number of lookups still in flight.
+uint32
+splinterdb_lookup_async_poll(splinterdb_lookup_async_handle *handle);
+
+// Poll until all async lookups issued on the handle have completed.
+void
+splinterdb_lookup_async_wait(splinterdb_lookup_async_handle *handle);
+
 
 /*
 Iterator API (range query)
@@ -213,9 +433,20 @@ replacement for most scenarios.
 This documentation is heavily inspired by
   https://github.com/facebook/rocksdb/wiki/Iterator
 
-The biggest difference is that RocksDB's Iterator exposes a Seek(key) method,
-while SplinterDB expects the starting key to be provided at the time the
-iterator is initialized.
+The starting key is provided when the iterator is initialized, and the
+iterator can later be repositioned with seek(), which reuses its resources
+and is much cheaper than a new iterator for short scans.  prev() moves back
+one key, at about the cost of a seek.
+
+Reverse iterators, created with splinterdb_iterator_init_reverse, return
+the keys in descending order: next() moves to the next smaller key.  Use
+them rather than prev() to scan backwards, e.g. for the last N keys before
+a given key.
+
+Prefix iterators, created with splinterdb_iterator_init_prefix, return the
+keys with a given prefix, as defined by data_config.key_prefix_length.  The
+prefixes of keys are kept in the routing filters too, so these scans skip
+the on-disk branches holding no keys with the prefix.
 
 Similar to RocksDB, if there is no error, then status()==0.  If status() != 0,
 then valid() == false.  In other words, valid()==true implies status()== 0,
@@ -267,6 +498,27 @@ splinterdb_iterator_init(const splinterdb     *kvs,      // IN
                          slice                 start_key // IN
 );
 
+// Initialize a new reverse iterator, which returns the keys in descending
+// order, starting at the largest key < end_key
+//
+// If end_key is NULL_SLICE, the iterator will start at the maximum key
+int
+splinterdb_iterator_init_reverse(const splinterdb     *kvs,    // IN
+                                 splinterdb_iterator **iter,   // OUT
+                                 slice                 end_key // IN
+);
+
+// Initialize a new prefix iterator, which returns the keys whose prefix
+// (see data_config.key_prefix_length) is prefix, in ascending order
+//
+// Requires a data_config with key_prefix_length, and prefix must be its own
+// prefix.  Seeking before prefix positions the iterator at prefix.
+int
+splinterdb_iterator_init_prefix(const splinterdb     *kvs,   // IN
+                                splinterdb_iterator **iter,  // OUT
+                                slice                 prefix // IN
+);
+
 // Deinitialize an iterator
 //
 // Failing to do this may cause hangs.
@@ -285,6 +537,25 @@ splinterdb_iterator_valid(splinterdb_iterator *iter);
 void
 splinterdb_iterator_next(splinterdb_iterator *iter);
 
+// Repositions the iterator at the first key >= key, which may be before or
+// after the current position.  If key is NULL_SLICE, the iterator is
+// positioned before the minimum key.
+// Reverse iterators are positioned at the largest key < key instead, or at
+// the maximum key if key is NULL_SLICE.
+// Any error will cause valid() == false and be visible with status()
+void
+splinterdb_iterator_seek(splinterdb_iterator *iter, // IN
+                         slice                key   // IN
+);
+
+// Moves the iterator back to the previous item.  Moving back from the first
+// item makes valid() == false.  Not supported by reverse or prefix
+// iterators.
+// If valid() == false, then behavior is undefined.
+// Any error will cause valid() == false and be visible with status()
+void
+splinterdb_iterator_prev(splinterdb_iterator *iter);
+
 // Sets *key and *value to the locations of the current item
 // Callers must not modify that memory pointed to by the slice
 //
@@ -302,6 +573,52 @@ splinterdb_iterator_get_current(splinterdb_iterator *iter, // IN
 int
 splinterdb_iterator_status(const splinterdb_iterator *iter);
 
+/*
+ * Snapshots
+
+A snapshot is a consistent, read-only view of the database as of the call to
+splinterdb_snapshot_create: lookups and iterators on a snapshot see all the
+inserts, updates and deletes made before that call, and none made after it,
+however long the snapshot is kept.
+
+Taking a snapshot copies no data and does not block writers, beyond a short
+pause while the current memtable is retired. Instead, the space of the data
+in the snapshot is not reclaimed until it is released.
+
+Snapshots must be released before the database is closed, and iterators on a
+snapshot must be deinitialized before it is released.
+*/
+
+typedef struct splinterdb_snapshot splinterdb_snapshot;
+
+// Take a snapshot of the database
+int
+splinterdb_snapshot_create(const splinterdb     *kvs,     // IN
+                           splinterdb_snapshot **snapshot // OUT
+);
+
+// Release a snapshot
+void
+splinterdb_snapshot_release(splinterdb_snapshot *snapshot);
+
+// Lookup the message for a given key in a snapshot
+//
+// result must have first been initialized using splinterdb_lookup_result_init
+int
+splinterdb_snapshot_lookup(const splinterdb_snapshot *snapshot, // IN
+                           slice                      key,      // IN
+                           splinterdb_lookup_result  *result    // IN/OUT
+);
+
+// Initialize a new iterator over a snapshot, starting at the given key
+//
+// The iterator is used and deinitialized like any other iterator.
+int
+splinterdb_snapshot_iterator_init(const splinterdb_snapshot *snapshot, // IN
+                                  splinterdb_iterator      **iter,     // OUT
+                                  slice start_key                      // IN
+);
+
 /*
  * Statistics Printing
  *
@@ -321,4 +638,18 @@ splinterdb_stats_print_lookup(const splinterdb *kvs);
 void
 splinterdb_stats_reset(splinterdb *kvs);
 
+// Counters of a database since it was opened. The throttle counters need the
+// use_stats config option, and splinterdb_stats_reset clears them.
+typedef struct splinterdb_stats {
+   uint64 checkpoints;          // completed, each dropping the log before it
+   uint64 log_extents_freed;    // by those checkpoints
+   uint64 log_entries_replayed; // by recovery when the database was opened
+   bool   io_uring;             // async IO goes through io_uring, not libaio
+   uint64 throttled_inserts;    // inserts the write throttle delayed
+   uint64 throttle_wait_ns;     // total time those inserts were delayed
+} splinterdb_stats;
+
+void
+splinterdb_stats_get(const splinterdb *kvs, splinterdb_stats *stats);
+
 #endif // _SPLINTERDB_H_
@@ -79,6 +79,10 @@ typedef struct allocator allocator;
 typedef platform_status (*alloc_fn)(allocator *al,
                                     uint64    *addr,
                                     page_type  type);
+typedef platform_status (*alloc_near_fn)(allocator *al,
+                                         uint64     hint,
+                                         uint64    *addr,
+                                         page_type  type);
 
 typedef uint8 (*dec_ref_fn)(allocator *al, uint64 addr, page_type type);
 typedef uint8 (*generic_ref_fn)(allocator *al, uint64 addr);
@@ -90,6 +94,16 @@ typedef platform_status (*alloc_super_addr_fn)(allocator        *al,
                                                allocator_root_id spl_id,
                                                uint64           *addr);
 typedef void (*remove_super_addr_fn)(allocator *al, allocator_root_id spl_id);
+typedef platform_status (*checkpoint_fn)(allocator *al);
+typedef bool (*claim_fn)(allocator *al, uint64 addr, page_type type);
+typedef platform_status (*capture_fn)(allocator   *al,
+                                      const void **image,
+                                      uint64      *size);
+typedef void (*capture_exclude_fn)(allocator *al, uint64 addr);
+typedef void (*capture_commit_fn)(allocator *al);
+typedef platform_status (*restore_fn)(allocator  *al,
+                                      const void *image,
+                                      uint64      size);
 typedef uint64 (*get_size_fn)(allocator *al);
 
 typedef void (*print_fn)(allocator *al);
@@ -100,7 +114,8 @@ typedef void (*assert_fn)(allocator *al);
  * function pointers.
  */
 typedef struct allocator_ops {
-   alloc_fn alloc;
+   alloc_fn      alloc;
+   alloc_near_fn alloc_near;
 
    generic_ref_fn inc_ref;
    dec_ref_fn     dec_ref;
@@ -110,6 +125,13 @@ typedef struct allocator_ops {
    get_super_addr_fn    get_super_addr;
    remove_super_addr_fn remove_super_addr;
 
+   checkpoint_fn      checkpoint;
+   claim_fn           claim;
+   capture_fn         capture;
+   capture_exclude_fn capture_exclude;
+   capture_commit_fn  capture_commit;
+   restore_fn         restore;
+
    get_size_fn in_use;
 
    get_size_fn get_capacity;
@@ -131,6 +153,18 @@ allocator_alloc(allocator *al, uint64 *addr, page_type type)
    return al->ops->alloc(al, addr, type);
 }
 
+/*
+ * Like allocator_alloc, but prefers the free extent which follows hint, the
+ * address of an extent of the same structure, e.g. the last one it was
+ * given, so that the extents of a structure are laid out contiguously and
+ * can be read sequentially. A hint of 0 means no preference.
+ */
+static inline platform_status
+allocator_alloc_near(allocator *al, uint64 hint, uint64 *addr, page_type type)
+{
+   return al->ops->alloc_near(al, hint, addr, type);
+}
+
 static inline uint8
 allocator_inc_ref(allocator *al, uint64 addr)
 {
@@ -169,6 +203,75 @@ allocator_remove_super_addr(allocator *al, allocator_root_id spl_id)
    return al->ops->remove_super_addr(al, spl_id);
 }
 
+/*
+ * Persists the ref counts, so that they can be mounted again after a crash,
+ * and keeps the extents which are in use from being reallocated until the
+ * next checkpoint or unmount, so that the data they hold stays intact on disk
+ * even if it is freed in the meantime. Must not race with allocations.
+ */
+static inline platform_status
+allocator_checkpoint(allocator *al)
+{
+   return al->ops->checkpoint(al);
+}
+
+/*
+ * Allocates the given extent if it is free, e.g. an extent written after the
+ * last checkpoint, which is free again in the ref counts mounted after a
+ * crash. Returns FALSE if the extent is in use or not a valid extent.
+ */
+static inline bool
+allocator_claim(allocator *al, uint64 addr, page_type type)
+{
+   return al->ops->claim(al, addr, type);
+}
+
+/*
+ * Copies the ref counts into an image, of size bytes, for the caller to make
+ * durable elsewhere, e.g. as part of a checkpoint which must not overwrite the
+ * ref counts of the last one. Like allocator_checkpoint, the extents in use
+ * in the image are kept from being reallocated, until allocator_capture_commit
+ * and on top of those already kept. Must not race with ref count changes of
+ * the extents the image is for. The image stays valid until the next capture.
+ */
+static inline platform_status
+allocator_capture(allocator *al, const void **image, uint64 *size)
+{
+   return al->ops->capture(al, image, size);
+}
+
+/*
+ * Frees the extent at addr in the captured image, for an extent which is in
+ * use but should be free when the image is restored, e.g. one that recovery
+ * claims with allocator_claim.
+ */
+static inline void
+allocator_capture_exclude(allocator *al, uint64 addr)
+{
+   al->ops->capture_exclude(al, addr);
+}
+
+/*
+ * Called once the captured image is durable, so the extents kept for the
+ * previous one need not be: from now on only the extents in use in the image
+ * are kept from being reallocated.
+ */
+static inline void
+allocator_capture_commit(allocator *al)
+{
+   al->ops->capture_commit(al);
+}
+
+/*
+ * Replaces the ref counts with an image from allocator_capture, in recovery
+ * before anything is allocated.
+ */
+static inline platform_status
+allocator_restore(allocator *al, const void *image, uint64 size)
+{
+   return al->ops->restore(al, image, size);
+}
+
 static inline uint64
 allocator_in_use(allocator *al)
 {
@@ -2555,11 +2555,25 @@ btree_iterator_print(iterator *itor)
                     &btree_itor->curr);
 }
 
+static void
+btree_iterator_start(btree_iterator *itor, key start_key);
+
+static platform_status
+btree_iterator_seek(iterator *base_itor, key target);
+
+static platform_status
+btree_iterator_prev_key(iterator   *base_itor,
+                        key         target,
+                        key_buffer *prev,
+                        bool       *found);
+
 const static iterator_ops btree_iterator_ops = {
    .get_curr = btree_iterator_get_curr,
    .at_end   = btree_iterator_at_end,
    .advance  = btree_iterator_advance,
    .print    = btree_iterator_print,
+   .seek     = btree_iterator_seek,
+   .prev_key = btree_iterator_prev_key,
 };
 
 
@@ -2601,10 +2615,22 @@ btree_iterator_init(cache          *cc,
    itor->page_type   = page_type;
    itor->super.ops   = &btree_iterator_ops;
 
+   btree_iterator_start(itor, min_key);
+}
+
+/*
+ * Positions itor at the first key >= start_key, recomputing the end node.
+ */
+static void
+btree_iterator_start(btree_iterator *itor, key start_key)
+{
+   cache        *cc  = itor->cc;
+   btree_config *cfg = itor->cfg;
+
    btree_lookup_node(itor->cc,
                      itor->cfg,
                      itor->root_addr,
-                     min_key,
+                     start_key,
                      itor->height,
                      itor->page_type,
                      &itor->curr,
@@ -2632,7 +2658,7 @@ btree_iterator_init(cache          *cc,
       btree_lookup_node(itor->cc,
                         itor->cfg,
                         itor->root_addr,
-                        min_key,
+                        start_key,
                         itor->height,
                         itor->page_type,
                         &itor->curr,
@@ -2647,14 +2673,14 @@ btree_iterator_init(cache          *cc,
    bool  found;
    int64 tmp;
    if (itor->height == 0) {
-      tmp = btree_find_tuple(itor->cfg, itor->curr.hdr, min_key, &found);
+      tmp = btree_find_tuple(itor->cfg, itor->curr.hdr, start_key, &found);
       if (!found) {
          tmp++;
       }
    } else if (itor->height > itor->curr.hdr->height) {
       tmp = 0;
    } else {
-      tmp = btree_find_pivot(itor->cfg, itor->curr.hdr, min_key, &found);
+      tmp = btree_find_pivot(itor->cfg, itor->curr.hdr, start_key, &found);
       if (!found) {
          tmp++;
       }
@@ -2679,6 +2705,249 @@ btree_iterator_init(cache          *cc,
                 || itor->idx < btree_num_entries(itor->curr.hdr));
 }
 
+/*
+ * Repositions itor at the first key >= target, which may be below the min_key
+ * it was initialized with.
+ */
+static platform_status
+btree_iterator_seek(iterator *base_itor, key target)
+{
+   debug_assert(base_itor != NULL);
+   btree_iterator *itor = (btree_iterator *)base_itor;
+
+   if (btree_key_compare(itor->cfg, target, itor->max_key) > 0) {
+      target = itor->max_key;
+   }
+   btree_node_unget(itor->cc, itor->cfg, &itor->curr);
+   btree_iterator_start(itor, target);
+   return STATUS_OK;
+}
+
+/*
+ * Gets the leaf holding the largest key < target into *node and sets *idx to
+ * the index of that key, or to -1 if there is none. Descends along the
+ * largest pivots < target: every leaf but the leftmost has its pivot as its
+ * 0th key, so the leaf we reach holds the answer if there is one.
+ */
+static void
+btree_lookup_leaf_before(cache        *cc,
+                         btree_config *cfg,
+                         uint64        root_addr,
+                         page_type     type,
+                         key           target,
+                         btree_node   *node,
+                         int64        *idx)
+{
+   btree_node child_node;
+   node->addr = root_addr;
+   btree_node_get(cc, cfg, node, type);
+   for (uint32 h = btree_height(node->hdr); h > 0; h--) {
+      int64 child_idx;
+      if (key_is_positive_infinity(target)) {
+         child_idx = btree_num_entries(node->hdr) - 1;
+      } else {
+         bool pivot_found;
+         child_idx = btree_find_pivot(cfg, node->hdr, target, &pivot_found);
+         if (pivot_found) {
+            child_idx--;
+         }
+      }
+      if (child_idx < 0) {
+         child_idx = 0;
+      }
+      index_entry *entry = btree_get_index_entry(cfg, node->hdr, child_idx);
+      child_node.addr    = index_entry_child_addr(entry);
+      btree_node_get(cc, cfg, &child_node, type);
+      btree_node_unget(cc, cfg, node);
+      *node = child_node;
+   }
+
+   if (key_is_positive_infinity(target)) {
+      *idx = btree_num_entries(node->hdr) - 1;
+   } else {
+      bool tuple_found;
+      *idx = btree_find_tuple(cfg, node->hdr, target, &tuple_found);
+      if (tuple_found) {
+         (*idx)--;
+      }
+   }
+}
+
+/*
+ * Finds the largest key < target, see btree_lookup_leaf_before.
+ */
+static platform_status
+btree_iterator_prev_key(iterator   *base_itor,
+                        key         target,
+                        key_buffer *prev,
+                        bool       *found)
+{
+   debug_assert(base_itor != NULL);
+   btree_iterator *itor = (btree_iterator *)base_itor;
+   cache          *cc   = itor->cc;
+   btree_config   *cfg  = itor->cfg;
+   debug_assert(itor->height == 0);
+
+   *found = FALSE;
+   if (key_is_negative_infinity(target)) {
+      return STATUS_OK;
+   }
+
+   btree_node node;
+   int64      idx;
+   btree_lookup_leaf_before(
+      cc, cfg, itor->root_addr, itor->page_type, target, &node, &idx);
+   platform_status rc = STATUS_OK;
+   if (0 <= idx) {
+      rc = key_buffer_copy_key(prev, btree_get_tuple_key(cfg, node.hdr, idx));
+      *found = SUCCESS(rc);
+   }
+   btree_node_unget(cc, cfg, &node);
+   return rc;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Reverse btree iterators
+ *
+ *      Return the keys of the leaves in [min_key, max_key) in descending
+ *      order. Leaves are only linked forwards, so when the iterator runs off
+ *      the start of a leaf it looks the leaf before it up from the root, at
+ *      the cost of a lookup per leaf.
+ *
+ *      A reverse iterator is at end when it pins end_addr and end_idx at
+ *      its current position, so btree_iterator_is_at_end and get_curr are
+ *      shared with forward iterators.
+ *-----------------------------------------------------------------------------
+ */
+static void
+btree_iterator_set_reverse_idx(btree_iterator *itor, int64 idx)
+{
+   if (idx < 0
+       || btree_key_compare(itor->cfg,
+                            btree_get_tuple_key(itor->cfg, itor->curr.hdr, idx),
+                            itor->min_key)
+             < 0)
+   {
+      itor->idx      = btree_num_entries(itor->curr.hdr);
+      itor->end_addr = itor->curr.addr;
+      itor->end_idx  = itor->idx;
+      return;
+   }
+   itor->idx      = idx;
+   itor->end_addr = 0;
+}
+
+/*
+ * Positions itor at the largest key < start_key.
+ */
+static void
+btree_iterator_start_reverse(btree_iterator *itor, key start_key)
+{
+   int64 idx;
+   btree_lookup_leaf_before(itor->cc,
+                            itor->cfg,
+                            itor->root_addr,
+                            itor->page_type,
+                            start_key,
+                            &itor->curr,
+                            &idx);
+   btree_iterator_set_reverse_idx(itor, idx);
+}
+
+static platform_status
+btree_iterator_advance_reverse(iterator *base_itor)
+{
+   debug_assert(base_itor != NULL);
+   btree_iterator *itor = (btree_iterator *)base_itor;
+   debug_assert(!btree_iterator_is_at_end(itor));
+
+   if (0 < itor->idx) {
+      btree_iterator_set_reverse_idx(itor, itor->idx - 1);
+      return STATUS_OK;
+   }
+
+   /*
+    * Continue below the 0th key of curr. As in btree_iterator_advance_leaf,
+    * we must not hold curr while descending from the root, and keys smaller
+    * than the 0th key of a leaf can only be inserted into the leaves before
+    * it, so it is safe to release curr here.
+    */
+   platform_status rc;
+   KEY_CREATE_LOCAL_COPY(rc,
+                         pivot,
+                         platform_get_heap_id(),
+                         btree_get_tuple_key(itor->cfg, itor->curr.hdr, 0));
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   btree_node_unget(itor->cc, itor->cfg, &itor->curr);
+   btree_iterator_start_reverse(itor, pivot);
+   return STATUS_OK;
+}
+
+/*
+ * Repositions itor at the largest key < target, which may be above the
+ * max_key it was initialized with.
+ */
+static platform_status
+btree_iterator_seek_reverse(iterator *base_itor, key target)
+{
+   debug_assert(base_itor != NULL);
+   btree_iterator *itor = (btree_iterator *)base_itor;
+
+   btree_node_unget(itor->cc, itor->cfg, &itor->curr);
+   btree_iterator_start_reverse(itor, target);
+   return STATUS_OK;
+}
+
+const static iterator_ops btree_reverse_iterator_ops = {
+   .get_curr = btree_iterator_get_curr,
+   .at_end   = btree_iterator_at_end,
+   .advance  = btree_iterator_advance_reverse,
+   .print    = btree_iterator_print,
+   .seek     = btree_iterator_seek_reverse,
+   .prev_key = btree_iterator_prev_key,
+};
+
+/*
+ * Initializes a reverse iterator over the leaves of the tree, starting at
+ * the largest key < max_key.
+ *
+ * Caller must guarantee:
+ *    min_key needs to be valid until at_end() returns true
+ */
+void
+btree_iterator_init_reverse(cache          *cc,
+                            btree_config   *cfg,
+                            btree_iterator *itor,
+                            uint64          root_addr,
+                            page_type       page_type,
+                            key             min_key,
+                            key             max_key)
+{
+   platform_assert(root_addr != 0);
+   debug_assert(page_type == PAGE_TYPE_MEMTABLE
+                || page_type == PAGE_TYPE_BRANCH);
+
+   debug_assert(!key_is_null(min_key) && !key_is_null(max_key));
+
+   if (btree_key_compare(cfg, min_key, max_key) > 0) {
+      min_key = max_key;
+   }
+
+   ZERO_CONTENTS(itor);
+   itor->cc        = cc;
+   itor->cfg       = cfg;
+   itor->root_addr = root_addr;
+   itor->min_key   = min_key;
+   itor->max_key   = max_key;
+   itor->page_type = page_type;
+   itor->super.ops = &btree_reverse_iterator_ops;
+
+   btree_iterator_start_reverse(itor, max_key);
+}
+
 void
 btree_iterator_deinit(btree_iterator *itor)
 {
@@ -2857,8 +3126,18 @@ btree_pack_loop(btree_pack_req *req,       // IN/OUT
 
    if (req->hash) {
       platform_assert(req->num_tuples < req->max_tuples);
-      req->fingerprint_arr[req->num_tuples] =
+      uint32 fp =
          req->hash(key_data(tuple_key), key_length(tuple_key), req->seed);
+      req->fingerprint_arr[req->num_tuples] = fp;
+      if (req->prefix_fingerprint_arr) {
+         // a key which is its own prefix (or has none) reuses its hash
+         uint64 prefix_length =
+            data_key_prefix_length(req->cfg->data_cfg, tuple_key);
+         if (prefix_length != 0 && prefix_length != key_length(tuple_key)) {
+            fp = req->hash(key_data(tuple_key), prefix_length, req->seed);
+         }
+         req->prefix_fingerprint_arr[req->num_tuples] = fp;
+      }
    }
 
    req->num_tuples++;
@@ -155,6 +155,7 @@ typedef struct btree_pack_req {
    hash_fn       hash; // hash function used for calculating filter_hash
    unsigned int  seed; // seed used for calculating filter_hash
    uint32       *fingerprint_arr; // IN/OUT: hashes of the keys in the tree
+   uint32       *prefix_fingerprint_arr; // IN/OUT: hashes of their prefixes
 
    // internal data
    uint16            height;
@@ -321,6 +322,15 @@ btree_iterator_init(cache          *cc,
                     bool            do_prefetch,
                     uint32          height);
 
+void
+btree_iterator_init_reverse(cache          *cc,
+                            btree_config   *cfg,
+                            btree_iterator *iterator,
+                            uint64          root_addr,
+                            page_type       page_type,
+                            key             min_key,
+                            key             max_key);
+
 void
 btree_iterator_deinit(btree_iterator *itor);
 
@@ -344,6 +354,10 @@ btree_pack_req_init(btree_pack_req  *req,
    if (hash != NULL && max_tuples > 0) {
       req->fingerprint_arr =
          TYPED_ARRAY_MALLOC(hid, req->fingerprint_arr, max_tuples);
+      if (cfg->data_cfg->key_prefix_length != NULL) {
+         req->prefix_fingerprint_arr =
+            TYPED_ARRAY_MALLOC(hid, req->prefix_fingerprint_arr, max_tuples);
+      }
    }
 }
 
@@ -353,6 +367,9 @@ btree_pack_req_deinit(btree_pack_req *req, platform_heap_id hid)
    if (req->fingerprint_arr) {
       platform_free(hid, req->fingerprint_arr);
    }
+   if (req->prefix_fingerprint_arr) {
+      platform_free(hid, req->prefix_fingerprint_arr);
+   }
 }
 
 platform_status
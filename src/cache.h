@@ -49,8 +49,8 @@ typedef struct cache_stats {
 #define MAX_PAGES_PER_EXTENT 32lu
 
 /*
- * The Maximum ref count on a single page that a thread is allowed to
- * have. The sum of all threads' ref counts is MAX_THREADS times this.
+ * The Maximum ref count on a single page that the threads sharing a stripe
+ * of its ref count may have together, see CC_RC_WIDTH.
  * See cache_get_read_ref() below.
  */
 #define MAX_READ_REFCOUNT UINT16_MAX
@@ -173,6 +173,10 @@ typedef void (*page_sync_fn)(cache       *cc,
 typedef void (*extent_sync_fn)(cache  *cc,
                                uint64  addr,
                                uint64 *pages_outstanding);
+typedef platform_status (*pages_sync_fn)(cache        *cc,
+                                         page_handle **pages,
+                                         uint64        num_pages,
+                                         page_type     type);
 typedef void (*page_prefetch_fn)(cache *cc, uint64 addr, page_type type);
 typedef int (*evict_fn)(cache *cc, bool ignore_pinned);
 typedef void (*assert_ungot_fn)(cache *cc, uint64 addr);
@@ -183,6 +187,13 @@ typedef uint32 (*count_dirty_fn)(cache *cc);
 typedef uint16 (*page_get_read_ref_fn)(cache *cc, page_handle *page);
 typedef bool (*cache_present_fn)(cache *cc, page_handle *page);
 typedef void (*enable_sync_get_fn)(cache *cc, bool enabled);
+typedef void (*defer_writeback_fn)(cache *cc, page_type type, bool defer);
+typedef bool (*page_dirty_fn)(void *arg, uint64 addr, const char *data);
+typedef void (*for_each_dirty_fn)(cache        *cc,
+                                  page_type     type,
+                                  page_dirty_fn func,
+                                  void         *arg);
+typedef platform_status (*cache_sync_fn)(cache *cc);
 typedef allocator *(*cache_allocator_fn)(const cache *cc);
 typedef cache_config *(*cache_config_fn)(const cache *cc);
 typedef void (*cache_print_fn)(platform_log_handle *log_handle, cache *cc);
@@ -210,6 +221,7 @@ typedef struct cache_ops {
    page_generic_fn      page_unpin;
    page_sync_fn         page_sync;
    extent_sync_fn       extent_sync;
+   pages_sync_fn        pages_sync;
    cache_generic_fn     flush;
    evict_fn             evict;
    cache_generic_fn     cleanup;
@@ -225,6 +237,9 @@ typedef struct cache_ops {
    count_dirty_fn       count_dirty;
    page_get_read_ref_fn page_get_read_ref;
    enable_sync_get_fn   enable_sync_get;
+   defer_writeback_fn   defer_writeback;
+   for_each_dirty_fn    for_each_dirty;
+   cache_sync_fn        sync;
    cache_allocator_fn   cache_allocator;
    cache_config_fn      get_config;
 } cache_ops;
@@ -348,6 +363,20 @@ cache_extent_sync(cache *cc, uint64 addr, uint64 *pages_outstanding)
    cc->ops->extent_sync(cc, addr, pages_outstanding);
 }
 
+/*
+ * Writes back a set of pages which the caller holds write locks on,
+ * coalescing pages which are contiguous on disk into single IOs, and returns
+ * once those pages and any writeback already in flight are durable.
+ */
+static inline platform_status
+cache_pages_sync(cache        *cc,
+                 page_handle **pages,
+                 uint64        num_pages,
+                 page_type     type)
+{
+   return cc->ops->pages_sync(cc, pages, num_pages, type);
+}
+
 static inline void
 cache_flush(cache *cc)
 {
@@ -438,6 +467,43 @@ cache_enable_sync_get(cache *cc, bool enabled)
    cc->ops->enable_sync_get(cc, enabled);
 }
 
+/*
+ * While writeback of a page type is deferred, dirty pages of that type are
+ * not written back by the cache to make room; they are written only by
+ * explicit syncs of the pages and by cache_flush. Deferrals nest, each call
+ * with defer set must be matched by one with it clear.
+ */
+static inline void
+cache_defer_writeback(cache *cc, page_type type, bool defer)
+{
+   cc->ops->defer_writeback(cc, type, defer);
+}
+
+/*
+ * Calls func on each dirty page of the given type which is not already being
+ * written back, with its address and contents, and writes back the pages for
+ * which func returns TRUE unless they have been locked in the meantime.
+ * Returns once those writes are complete. Pages of the type must not be freed
+ * during the call, and the caller must hold off their writers if it needs
+ * their contents to be stable.
+ */
+static inline void
+cache_for_each_dirty(cache *cc, page_type type, page_dirty_fn func, void *arg)
+{
+   cc->ops->for_each_dirty(cc, type, func, arg);
+}
+
+/*
+ * Writes back every dirty page whose writeback is not deferred and which is
+ * not locked, and returns once those writes, and all the writes completed
+ * before the call, are durable.
+ */
+static inline platform_status
+cache_sync(cache *cc)
+{
+   return cc->ops->sync(cc);
+}
+
 static inline allocator *
 cache_allocator(const cache *cc)
 {
@@ -38,6 +38,9 @@
 // Number of batches that the cleaner hand is ahead of the evictor hand
 #define CC_CLEANER_GAP 512
 
+// Minimum number of batches in each clock region
+#define CC_MIN_BATCHES_PER_REGION 64
+
 /* number of events to poll for during clockcache_wait */
 #define CC_DEFAULT_MAX_IO_EVENTS 32
 
@@ -192,6 +195,12 @@ clockcache_page_sync(clockcache  *cc,
 void
 clockcache_extent_sync(clockcache *cc, uint64 addr, uint64 *pages_outstanding);
 
+platform_status
+clockcache_pages_sync(clockcache   *cc,
+                      page_handle **pages,
+                      uint64        num_pages,
+                      page_type     type);
+
 void
 clockcache_flush(clockcache *cc);
 
@@ -243,6 +252,18 @@ clockcache_present(clockcache *cc, page_handle *page);
 static void
 clockcache_enable_sync_get(clockcache *cc, bool enabled);
 
+static void
+clockcache_defer_writeback(clockcache *cc, page_type type, bool defer);
+
+void
+clockcache_for_each_dirty(clockcache   *cc,
+                          page_type     type,
+                          page_dirty_fn func,
+                          void         *arg);
+
+platform_status
+clockcache_sync(clockcache *cc);
+
 allocator *
 clockcache_allocator(const clockcache *cc);
 
@@ -411,6 +432,16 @@ clockcache_extent_sync_virtual(cache *c, uint64 addr, uint64 *pages_outstanding)
    clockcache_extent_sync(cc, addr, pages_outstanding);
 }
 
+platform_status
+clockcache_pages_sync_virtual(cache        *c,
+                              page_handle **pages,
+                              uint64        num_pages,
+                              page_type     type)
+{
+   clockcache *cc = (clockcache *)c;
+   return clockcache_pages_sync(cc, pages, num_pages, type);
+}
+
 void
 clockcache_flush_virtual(cache *c)
 {
@@ -516,6 +547,30 @@ clockcache_enable_sync_get_virtual(cache *c, bool enabled)
    clockcache_enable_sync_get(cc, enabled);
 }
 
+void
+clockcache_defer_writeback_virtual(cache *c, page_type type, bool defer)
+{
+   clockcache *cc = (clockcache *)c;
+   clockcache_defer_writeback(cc, type, defer);
+}
+
+void
+clockcache_for_each_dirty_virtual(cache        *c,
+                                  page_type     type,
+                                  page_dirty_fn func,
+                                  void         *arg)
+{
+   clockcache *cc = (clockcache *)c;
+   clockcache_for_each_dirty(cc, type, func, arg);
+}
+
+platform_status
+clockcache_sync_virtual(cache *c)
+{
+   clockcache *cc = (clockcache *)c;
+   return clockcache_sync(cc);
+}
+
 allocator *
 clockcache_allocator_virtual(const cache *c)
 {
@@ -555,6 +610,7 @@ static cache_ops clockcache_ops = {
    .page_unpin        = clockcache_unpin_virtual,
    .page_sync         = clockcache_page_sync_virtual,
    .extent_sync       = clockcache_extent_sync_virtual,
+   .pages_sync        = clockcache_pages_sync_virtual,
    .flush             = clockcache_flush_virtual,
    .evict             = clockcache_evict_all_virtual,
    .cleanup           = clockcache_wait_virtual,
@@ -570,6 +626,9 @@ static cache_ops clockcache_ops = {
    .page_get_read_ref = clockcache_get_read_ref_virtual,
    .cache_present     = clockcache_present_virtual,
    .enable_sync_get   = clockcache_enable_sync_get_virtual,
+   .defer_writeback   = clockcache_defer_writeback_virtual,
+   .for_each_dirty    = clockcache_for_each_dirty_virtual,
+   .sync              = clockcache_sync_virtual,
    .cache_allocator   = clockcache_allocator_virtual,
    .get_config        = clockcache_get_config_virtual,
 };
@@ -1240,6 +1299,24 @@ clockcache_ok_to_writeback(clockcache *cc,
            || (with_access && status == CC_CLEANABLE2_STATUS));
 }
 
+/*
+ *----------------------------------------------------------------------
+ * clockcache_writeback_deferred
+ *
+ *      Is writeback of the entry's page type deferred (see
+ *      cache_defer_writeback)? Flushes write back every page regardless.
+ *----------------------------------------------------------------------
+ */
+static inline bool
+clockcache_writeback_deferred(clockcache *cc,
+                              uint32      entry_number,
+                              bool        is_flush)
+{
+   return !is_flush
+          && cc->defer_writeback[clockcache_get_entry(cc, entry_number)->type]
+                != 0;
+}
+
 /*
  *----------------------------------------------------------------------
  * clockcache_try_set_writeback
@@ -1339,11 +1416,15 @@ clockcache_write_callback(void           *metadata,
  *      outside the batch.
  *
  *      If is_urgent is set, pages with CC_ACCESSED are written back, otherwise
- *      they are not.
+ *      they are not. Unless is_flush is set, pages whose writeback is deferred
+ *      are skipped.
  *----------------------------------------------------------------------
  */
 void
-clockcache_batch_start_writeback(clockcache *cc, uint64 batch, bool is_urgent)
+clockcache_batch_start_writeback(clockcache *cc,
+                                 uint64      batch,
+                                 bool        is_urgent,
+                                 bool        is_flush)
 {
    uint32          entry_no, next_entry_no;
    uint64          addr, first_addr, end_addr, i;
@@ -1367,11 +1448,14 @@ clockcache_batch_start_writeback(clockcache *cc, uint64 batch, bool is_urgent)
                          end_entry_no - 1);
 
    // Iterate through the entries in the batch and try to write out the extents.
+   // The writes are submitted to the device together.
+   io_begin_batch(cc->io);
    for (entry_no = start_entry_no; entry_no < end_entry_no; entry_no++) {
       entry = &cc->entry[entry_no];
       addr  = entry->page.disk_addr;
       // test and test and set in the if condition
-      if (clockcache_ok_to_writeback(cc, entry_no, is_urgent)
+      if (!clockcache_writeback_deferred(cc, entry_no, is_flush)
+          && clockcache_ok_to_writeback(cc, entry_no, is_urgent)
           && clockcache_try_set_writeback(cc, entry_no, is_urgent))
       {
          debug_assert(clockcache_lookup(cc, addr) == entry_no);
@@ -1385,6 +1469,7 @@ clockcache_batch_start_writeback(clockcache *cc, uint64 batch, bool is_urgent)
                next_entry_no = CC_UNMAPPED_ENTRY;
          } while (
             next_entry_no != CC_UNMAPPED_ENTRY
+            && !clockcache_writeback_deferred(cc, next_entry_no, is_flush)
             && clockcache_try_set_writeback(cc, next_entry_no, is_urgent));
          first_addr += clockcache_page_size(cc);
          end_addr = entry->page.disk_addr;
@@ -1397,6 +1482,7 @@ clockcache_batch_start_writeback(clockcache *cc, uint64 batch, bool is_urgent)
                next_entry_no = CC_UNMAPPED_ENTRY;
          } while (
             next_entry_no != CC_UNMAPPED_ENTRY
+            && !clockcache_writeback_deferred(cc, next_entry_no, is_flush)
             && clockcache_try_set_writeback(cc, next_entry_no, is_urgent));
 
          io_async_req *req            = io_get_async_req(cc->io, TRUE);
@@ -1430,6 +1516,7 @@ clockcache_batch_start_writeback(clockcache *cc, uint64 batch, bool is_urgent)
          platform_assert_status_ok(status);
       }
    }
+   io_flush_batch(cc->io);
    clockcache_close_log_stream();
 }
 
@@ -1581,9 +1668,11 @@ clockcache_evict_batch(clockcache *cc, uint32 batch)
  *----------------------------------------------------------------------
  * clockcache_move_hand --
  *
- *      Moves the clock hand forward cleaning and evicting a batch. Cleans
- *      "accessed" pages if is_urgent is set, for example when get_free_page
- *      has cycled through the cache already.
+ *      Moves a clock hand forward cleaning and evicting a batch. Normally
+ *      this is the hand of the calling thread's home region. When is_urgent
+ *      is set, for example when get_free_page has cycled through the home
+ *      region already, the thread instead steals from the other regions in
+ *      turn and cleans "accessed" pages as well.
  *----------------------------------------------------------------------
  */
 void
@@ -1593,6 +1682,12 @@ clockcache_move_hand(clockcache *cc, bool is_urgent)
    volatile bool *evict_batch_busy;
    volatile bool *clean_batch_busy;
    uint64         cleaner_hand;
+   uint64         region_no = tid % cc->num_regions;
+
+   if (is_urgent) {
+      region_no = (cc->per_thread[tid].steal_region + 1) % cc->num_regions;
+   }
+   cc->per_thread[tid].steal_region = region_no;
 
    /* move the hand a batch forward */
    uint64          evict_hand = cc->per_thread[tid].free_hand;
@@ -1602,22 +1697,26 @@ clockcache_move_hand(clockcache *cc, bool is_urgent)
       was_busy = __sync_bool_compare_and_swap(evict_batch_busy, TRUE, FALSE);
       debug_assert(was_busy);
    }
+   uint64 start_batch = cc->region[region_no].start_batch;
+   uint64 num_batches = cc->region[region_no].num_batches;
+   uint64 cleaner_gap = cc->region[region_no].cleaner_gap;
    do {
-      evict_hand =
-         __sync_add_and_fetch(&cc->evict_hand, 1) % cc->cfg->batch_capacity;
+      uint64 hand =
+         __sync_add_and_fetch(&cc->region[region_no].evict_hand, 1);
+      evict_hand       = start_batch + hand % num_batches;
       evict_batch_busy = &cc->batch_busy[evict_hand];
       // clean the batch ahead
-      cleaner_hand = (evict_hand + cc->cleaner_gap) % cc->cfg->batch_capacity;
+      cleaner_hand     = start_batch + (hand + cleaner_gap) % num_batches;
       clean_batch_busy = &cc->batch_busy[cleaner_hand];
       if (__sync_bool_compare_and_swap(clean_batch_busy, FALSE, TRUE)) {
-         clockcache_batch_start_writeback(cc, cleaner_hand, is_urgent);
+         clockcache_batch_start_writeback(cc, cleaner_hand, is_urgent, FALSE);
          was_busy = __sync_bool_compare_and_swap(clean_batch_busy, TRUE, FALSE);
          debug_assert(was_busy);
       }
    } while (!__sync_bool_compare_and_swap(evict_batch_busy, FALSE, TRUE));
 
-   clockcache_evict_batch(cc, evict_hand % cc->cfg->batch_capacity);
-   cc->per_thread[tid].free_hand = evict_hand % cc->cfg->batch_capacity;
+   clockcache_evict_batch(cc, evict_hand);
+   cc->per_thread[tid].free_hand = evict_hand;
 }
 
 
@@ -1635,9 +1734,9 @@ clockcache_get_free_page(clockcache *cc,
                          bool        blocking)
 {
    uint32            entry_no;
-   uint64            num_passes = 0;
-   const threadid    tid        = platform_get_tid();
-   uint64            max_hand   = cc->per_thread[tid].free_hand;
+   uint64            num_passes   = 0;
+   uint64            pass_batches = 0;
+   const threadid    tid          = platform_get_tid();
    clockcache_entry *entry;
    timestamp         wait_start;
 
@@ -1672,7 +1771,15 @@ clockcache_get_free_page(clockcache *cc,
       }
 
       clockcache_move_hand(cc, num_passes != 0);
-      if (cc->per_thread[tid].free_hand < max_hand) {
+      /*
+       * The first pass only covers the home region; once it is exhausted
+       * move_hand steals round robin, so later passes cover the whole cache.
+       */
+      uint64 pass_len = num_passes == 0
+                           ? cc->region[tid % cc->num_regions].num_batches
+                           : cc->cfg->batch_capacity;
+      if (++pass_batches >= pass_len) {
+         pass_batches = 0;
          num_passes++;
          /*
           * The first pass doesn't really have a fair chance at having
@@ -1688,7 +1795,6 @@ clockcache_get_free_page(clockcache *cc,
          }
          clockcache_wait(cc);
       }
-      max_hand = cc->per_thread[tid].free_hand;
    }
    if (blocking) {
       platform_default_log("cache locked (num_passes=%lu time=%lu nsecs)\n",
@@ -1722,7 +1828,7 @@ clockcache_flush(clockcache *cc)
    for (uint32 flush_hand = 0;
         flush_hand < cc->cfg->page_capacity / CC_ENTRIES_PER_BATCH;
         flush_hand++)
-      clockcache_batch_start_writeback(cc, flush_hand, TRUE);
+      clockcache_batch_start_writeback(cc, flush_hand, TRUE, TRUE);
 
    // make sure all aio is complete again
    io_cleanup_all(cc->io);
@@ -1730,6 +1836,81 @@ clockcache_flush(clockcache *cc)
    clockcache_assert_clean(cc);
 }
 
+/*
+ *-----------------------------------------------------------------------------
+ * clockcache_sync --
+ *
+ *      Issues writeback for every dirty page whose writeback is not deferred,
+ *      as the cleaner would, and waits for all writes to complete and become
+ *      durable. Unlike clockcache_flush, locked pages are skipped rather than
+ *      asserted on.
+ *-----------------------------------------------------------------------------
+ */
+platform_status
+clockcache_sync(clockcache *cc)
+{
+   for (uint32 batch = 0;
+        batch < cc->cfg->page_capacity / CC_ENTRIES_PER_BATCH;
+        batch++)
+   {
+      clockcache_batch_start_writeback(cc, batch, TRUE, FALSE);
+   }
+   io_cleanup_all(cc->io);
+   return io_sync(cc->io);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * clockcache_for_each_dirty --
+ *
+ *      Calls func on each dirty page of the given type which is not in
+ *      writeback, and writes back those for which func returns TRUE if they
+ *      are still cleanable. See cache_for_each_dirty.
+ *-----------------------------------------------------------------------------
+ */
+void
+clockcache_for_each_dirty(clockcache   *cc,
+                          page_type     type,
+                          page_dirty_fn func,
+                          void         *arg)
+{
+   const threadid tid        = platform_get_tid();
+   const uint32   not_dirty  = CC_FREE | CC_CLEAN | CC_LOADING | CC_WRITEBACK;
+   uint64         num_writes = 0;
+
+   io_begin_batch(cc->io);
+   for (uint32 entry_no = 0; entry_no < cc->cfg->page_capacity; entry_no++) {
+      clockcache_entry *entry = clockcache_get_entry(cc, entry_no);
+      if ((entry->status & not_dirty) != 0 || entry->type != type) {
+         continue;
+      }
+      uint64 addr = entry->page.disk_addr;
+      if (!func(arg, addr, entry->page.data)
+          || !clockcache_try_set_writeback(cc, entry_no, TRUE))
+      {
+         continue;
+      }
+
+      io_async_req *req            = io_get_async_req(cc->io, TRUE);
+      void         *req_metadata   = io_get_metadata(cc->io, req);
+      *(clockcache **)req_metadata = cc;
+      struct iovec *iovec          = io_get_iovec(cc->io, req);
+      iovec[0].iov_base            = entry->page.data;
+      req->bytes                   = clockcache_page_size(cc);
+      platform_status rc           = io_write_async(
+         cc->io, req, clockcache_write_callback, 1, addr);
+      platform_assert_status_ok(rc);
+      num_writes++;
+   }
+   io_flush_batch(cc->io);
+
+   if (cc->cfg->use_stats) {
+      cc->stats[tid].page_writes[type] += num_writes;
+      cc->stats[tid].writes_issued += num_writes;
+   }
+   io_cleanup_all(cc->io);
+}
+
 /*
  *-----------------------------------------------------------------------------
  * clockcache_evict_all --
@@ -1830,7 +2011,22 @@ clockcache_init(clockcache          *cc,   // OUT
    platform_assert(cc->cfg->capacity == debug_capacity);
    platform_assert(cc->cfg->page_capacity % CC_ENTRIES_PER_BATCH == 0);
 
-   cc->cleaner_gap = CC_CLEANER_GAP;
+   /*
+    * Split the batches into regions, each with its own hand. The cleaner gap
+    * is divided among the regions so that the total amount of cleaning ahead
+    * of eviction matches a single global hand.
+    */
+   cc->num_regions = cc->cfg->batch_capacity / CC_MIN_BATCHES_PER_REGION;
+   cc->num_regions = MIN(cc->num_regions, CC_MAX_REGIONS);
+   cc->num_regions = MAX(cc->num_regions, 1);
+   for (i = 0; i < cc->num_regions; i++) {
+      uint64 start = cc->cfg->batch_capacity * i / cc->num_regions;
+      uint64 end   = cc->cfg->batch_capacity * (i + 1) / cc->num_regions;
+      cc->region[i].evict_hand  = 0;
+      cc->region[i].start_batch = start;
+      cc->region[i].num_batches = end - start;
+      cc->region[i].cleaner_gap = MAX(CC_CLEANER_GAP / cc->num_regions, 1);
+   }
 
 #if defined(CC_LOG) || defined(ADDR_TRACING)
    cc->logfile = platform_open_log_file(cfg->logfile, "w");
@@ -1867,6 +2063,8 @@ clockcache_init(clockcache          *cc,   // OUT
       goto alloc_error;
    }
    cc->data = platform_buffer_getaddr(cc->bh);
+   // Best effort: lets the IO system pre-register the page memory
+   io_register_buffer(cc->io, cc->data, cc->cfg->capacity);
 
    /* Set up the entries */
    for (i = 0; i < cc->cfg->page_capacity; i++) {
@@ -1877,7 +2075,8 @@ clockcache_init(clockcache          *cc,   // OUT
    }
 
    /* Entry per-thread ref counts */
-   size_t refcount_size = cc->cfg->page_capacity * CC_RC_WIDTH * sizeof(uint8);
+   size_t refcount_size =
+      cc->cfg->page_capacity * CC_RC_WIDTH * sizeof(uint16);
    cc->rc_bh = platform_buffer_create(refcount_size, cc->heap_handle, mid);
    if (!cc->rc_bh) {
       goto alloc_error;
@@ -1888,10 +2087,9 @@ clockcache_init(clockcache          *cc,   // OUT
       TYPED_ARRAY_ZALLOC(cc->heap_id, cc->pincount, cc->cfg->page_capacity);
 
    /* The hands and associated page */
-   cc->free_hand  = 0;
-   cc->evict_hand = 1;
    for (thr_i = 0; thr_i < MAX_THREADS; thr_i++) {
       cc->per_thread[thr_i].free_hand       = CC_UNMAPPED_ENTRY;
+      cc->per_thread[thr_i].steal_region    = thr_i % cc->num_regions;
       cc->per_thread[thr_i].enable_sync_get = TRUE;
    }
    cc->batch_busy =
@@ -1932,6 +2130,7 @@ clockcache_deinit(clockcache *cc) // IN/OUT
    platform_free(cc->heap_id, cc->entry);
    platform_free(cc->heap_id, cc->lookup);
    if (cc->bh) {
+      io_unregister_buffer(cc->io);
       platform_buffer_destroy(cc->bh);
    }
    cc->data = NULL;
@@ -2243,6 +2442,7 @@ clockcache_get_internal(clockcache   *cc,       // IN
 
    /* Set up the page */
    entry->page.disk_addr = addr;
+   entry->type           = type;
    if (cc->cfg->use_stats) {
       start = platform_get_timestamp();
    }
@@ -2807,6 +3007,7 @@ clockcache_extent_sync(clockcache *cc, uint64 addr, uint64 *pages_outstanding)
    struct iovec   *iovec;
    platform_status status;
 
+   io_begin_batch(cc->io);
    for (i = 0; i < cc->cfg->pages_per_extent; i++) {
       page_addr    = addr + clockcache_multiply_by_page_size(cc, i);
       entry_number = clockcache_lookup(cc, page_addr);
@@ -2844,6 +3045,132 @@ clockcache_extent_sync(clockcache *cc, uint64 addr, uint64 *pages_outstanding)
          cc->io, io_req, clockcache_sync_callback, req_count, req_addr);
       platform_assert_status_ok(status);
    }
+   io_flush_batch(cc->io);
+}
+
+/*
+ *----------------------------------------------------------------------
+ * clockcache_pages_sync_callback --
+ *
+ *      Internal callback for clockcache_pages_sync. The pages are write
+ *      locked by the caller, so only the outstanding count is touched here.
+ *----------------------------------------------------------------------
+ */
+#if defined(__has_feature)
+#   if __has_feature(memory_sanitizer)
+__attribute__((no_sanitize("memory")))
+#   endif
+#endif
+void
+clockcache_pages_sync_callback(void           *arg,
+                               struct iovec   *iovec,
+                               uint64          count,
+                               platform_status status)
+{
+   clockcache_sync_callback_req *req = (clockcache_sync_callback_req *)arg;
+   platform_assert_status_ok(status);
+   __sync_fetch_and_sub(req->pages_outstanding, count);
+}
+
+static int
+clockcache_page_addr_compare(const void *a, const void *b, void *unused)
+{
+   const page_handle *pa = *(const page_handle **)a;
+   const page_handle *pb = *(const page_handle **)b;
+   return pa->disk_addr < pb->disk_addr ? -1 : pa->disk_addr > pb->disk_addr;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * clockcache_pages_sync --
+ *
+ *      Synchronously writes back a set of write-locked pages and makes them
+ *      durable. Pages which are adjacent on disk within an extent are
+ *      written with a single IO. Before the device is flushed, all other
+ *      in-flight IO is reaped, so that writeback which was issued before the
+ *      call (e.g. by clockcache_page_sync) is durable on return as well.
+ *
+ *      On return the pages are clean and still write locked. Sorts pages.
+ *-----------------------------------------------------------------------------
+ */
+platform_status
+clockcache_pages_sync(clockcache   *cc,
+                      page_handle **pages,
+                      uint64        num_pages,
+                      page_type     type)
+{
+   uint64          pages_outstanding = 0;
+   uint64          req_count         = 0;
+   uint64          req_addr          = 0;
+   io_async_req   *io_req            = NULL;
+   struct iovec   *iovec             = NULL;
+   const threadid  tid               = platform_get_tid();
+   platform_status status;
+   page_handle    *tmp;
+
+   platform_sort_slow(pages,
+                      num_pages,
+                      sizeof(page_handle *),
+                      clockcache_page_addr_compare,
+                      NULL,
+                      &tmp);
+
+   io_begin_batch(cc->io);
+   for (uint64 i = 0; i < num_pages; i++) {
+      uint64 page_addr = pages[i]->disk_addr;
+      debug_assert(clockcache_test_flag(
+         cc, clockcache_page_to_entry_number(cc, pages[i]), CC_WRITELOCKED));
+      if (req_count != 0
+          && (page_addr
+                 != req_addr + clockcache_multiply_by_page_size(cc, req_count)
+              || clockcache_extent_base_addr(cc, page_addr)
+                    != clockcache_extent_base_addr(cc, req_addr)))
+      {
+         __sync_fetch_and_add(&pages_outstanding, req_count);
+         io_req->bytes = clockcache_multiply_by_page_size(cc, req_count);
+         status        = io_write_async(cc->io,
+                                 io_req,
+                                 clockcache_pages_sync_callback,
+                                 req_count,
+                                 req_addr);
+         platform_assert_status_ok(status);
+         req_count = 0;
+      }
+      if (req_count == 0) {
+         req_addr = page_addr;
+         io_req   = io_get_async_req(cc->io, TRUE);
+         clockcache_sync_callback_req *cc_req =
+            (clockcache_sync_callback_req *)io_get_metadata(cc->io, io_req);
+         cc_req->cc                = cc;
+         cc_req->pages_outstanding = &pages_outstanding;
+         iovec                     = io_get_iovec(cc->io, io_req);
+      }
+      iovec[req_count++].iov_base = pages[i]->data;
+   }
+   if (req_count != 0) {
+      __sync_fetch_and_add(&pages_outstanding, req_count);
+      io_req->bytes = clockcache_multiply_by_page_size(cc, req_count);
+      status        = io_write_async(
+         cc->io, io_req, clockcache_pages_sync_callback, req_count, req_addr);
+      platform_assert_status_ok(status);
+   }
+   io_flush_batch(cc->io);
+
+   while (__sync_fetch_and_add(&pages_outstanding, 0) != 0) {
+      clockcache_wait(cc);
+   }
+   for (uint64 i = 0; i < num_pages; i++) {
+      clockcache_set_flag(
+         cc, clockcache_page_to_entry_number(cc, pages[i]), CC_CLEAN);
+   }
+
+   if (cc->cfg->use_stats) {
+      cc->stats[tid].page_writes[type] += num_pages;
+      cc->stats[tid].syncs_issued++;
+   }
+
+   io_cleanup_all(cc->io);
+   return io_sync(cc->io);
 }
 
 /*
@@ -2920,6 +3247,7 @@ clockcache_prefetch(clockcache *cc, uint64 base_addr, page_type type)
 
    debug_assert(base_addr % clockcache_extent_size(cc) == 0);
 
+   io_begin_batch(cc->io);
    for (uint64 page_off = 0; page_off < pages_per_extent; page_off++) {
       uint64 addr = base_addr + clockcache_multiply_by_page_size(cc, page_off);
       uint32 entry_no = clockcache_lookup(cc, addr);
@@ -3008,6 +3336,7 @@ clockcache_prefetch(clockcache *cc, uint64 base_addr, page_type type)
       req_start_addr     = CC_UNMAPPED_ADDR;
       platform_assert_status_ok(rc);
    }
+   io_flush_batch(cc->io);
 }
 
 /*
@@ -3022,7 +3351,7 @@ clockcache_print(platform_log_handle *log_handle, clockcache *cc)
 {
    uint64   i;
    uint32   status;
-   uint16   refcount;
+   uint32   refcount;
    threadid thr_i;
 
    platform_log(log_handle,
@@ -3274,6 +3603,19 @@ clockcache_enable_sync_get(clockcache *cc, bool enabled)
    cc->per_thread[platform_get_tid()].enable_sync_get = enabled;
 }
 
+static void
+clockcache_defer_writeback(clockcache *cc, page_type type, bool defer)
+{
+   debug_assert(type < NUM_PAGE_TYPES);
+   if (defer) {
+      __sync_fetch_and_add(&cc->defer_writeback[type], 1);
+   } else {
+      debug_only uint32 deferrals =
+         __sync_fetch_and_sub(&cc->defer_writeback[type], 1);
+      debug_assert(deferrals != 0);
+   }
+}
+
 allocator *
 clockcache_allocator(const clockcache *cc)
 {
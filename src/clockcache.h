@@ -21,8 +21,16 @@
 
 // #define RECORD_ACQUISITION_STACKS
 
-/* how distributed the rw locks are */
-#define CC_RC_WIDTH 4
+/*
+ * how distributed the rw locks are: MAX_THREADS / CC_RC_WIDTH threads share
+ * each ref count of a page, and the refs they hold on the page together must
+ * stay below MAX_READ_REFCOUNT. A thread holds a ref for every async lookup
+ * it has parked on a page, so the counts are 16 bits.
+ */
+#define CC_RC_WIDTH (MAX_THREADS / 16)
+
+/* max number of independently-handed regions the batches are split into */
+#define CC_MAX_REGIONS 16
 
 /*
  * Configuration struct to setup the clock cache sub-system.
@@ -101,13 +109,22 @@ struct clockcache_entry {
  *         count before checking the write lock bit, so the ref count should
  *         generally be treated as a lower bound.
  *
- *      Each thread has a batch of pages indicated by cc->thread_free_hand[tid]
- *      from which it draws free pages. When a thread doesn't find a free page
- *      in its batch, it obtains a pair of new batches: one to evict
- *      (from cc->free_hand) and one to clean. The batch to clean is
- *      cc->cleaner_gap batches ahead of the current evictor head, so that
- *      cleaned pages have time to flush before eviction. Both cleaning and
- *      eviction use cc->batch_busy to avoid conflicts and contention.
+ *      The batches are partitioned into cc->num_regions contiguous regions,
+ *      each with its own clock hand (cc->region[r].evict_hand), so that
+ *      threads do not all contend on a single hand. Each thread has a home
+ *      region (tid % cc->num_regions).
+ *
+ *      Each thread has a batch of pages indicated by
+ *      cc->per_thread[tid].free_hand from which it draws free pages. When a
+ *      thread doesn't find a free page in its batch, it obtains a pair of new
+ *      batches from its home region: one to evict (from the region's hand)
+ *      and one to clean. The batch to clean is cc->region[r].cleaner_gap
+ *      batches ahead of the region's evictor hand, so that cleaned pages have
+ *      time to flush before eviction. Only once a thread has made a full pass
+ *      of its home region without finding a free page does it steal batches
+ *      from the neighbouring regions, visiting them round robin. Both
+ *      cleaning and eviction use cc->batch_busy to avoid conflicts and
+ *      contention.
  *----------------------------------------------------------------------
  */
 struct clockcache {
@@ -126,20 +143,29 @@ struct clockcache {
 
    // Distributed locks (the write bit is in the status uint32 of the entry)
    buffer_handle  *rc_bh;
-   volatile uint8 *refcount;
-   volatile uint8 *pincount;
+   volatile uint16 *refcount;
+   volatile uint8  *pincount;
 
    // Clock hands and related metadata
-   volatile uint32 evict_hand;
-   volatile uint32 free_hand;
-   volatile bool  *batch_busy;
-   uint64          cleaner_gap;
+   volatile bool *batch_busy;
+   uint64         num_regions;
+
+   struct {
+      volatile uint32 evict_hand;  // relative to start_batch
+      uint32          start_batch;
+      uint32          num_batches;
+      uint32          cleaner_gap; // in batches, within the region
+   } PLATFORM_CACHELINE_ALIGNED region[CC_MAX_REGIONS];
 
    volatile struct {
       volatile uint32 free_hand;
+      uint32          steal_region;
       bool            enable_sync_get;
    } PLATFORM_CACHELINE_ALIGNED per_thread[MAX_THREADS];
 
+   // see cache_defer_writeback
+   volatile uint32 defer_writeback[NUM_PAGE_TYPES];
+
    // Stats
    cache_stats stats[MAX_THREADS];
 };
@@ -552,6 +552,40 @@ data_key_compare(const data_config *cfg, key key1, key key2)
    }
 }
 
+/*
+ * Returns TRUE if cfg orders user keys as memcmp does, byte by byte and then
+ * by length, i.e. it uses the key_compare of default_data_config. Such keys
+ * can be ordered by their leading bytes alone when those differ.
+ */
+bool
+data_key_compare_is_lexicographic(const data_config *cfg);
+
+/*
+ * Returns the length of the prefix of k, which is 0 if k has no prefix or
+ * cfg has no prefix extractor.
+ */
+static inline uint64
+data_key_prefix_length(const data_config *cfg, key k)
+{
+   if (cfg->key_prefix_length == NULL || !key_is_user_key(k)) {
+      return 0;
+   }
+   uint64 prefix_length = cfg->key_prefix_length(cfg, k.user_slice);
+   debug_assert(prefix_length <= key_length(k));
+   return prefix_length;
+}
+
+/*
+ * Returns TRUE if prefix is the (non-empty) prefix of k.
+ */
+static inline bool
+data_key_has_prefix(const data_config *cfg, key k, key prefix)
+{
+   uint64 prefix_length = data_key_prefix_length(cfg, k);
+   return prefix_length != 0 && prefix_length == key_length(prefix)
+          && memcmp(key_data(k), key_data(prefix), prefix_length) == 0;
+}
+
 static inline int
 data_merge_tuples(const data_config *cfg,
                   key                tuple_key,
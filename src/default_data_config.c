@@ -10,6 +10,7 @@
 
 #include "splinterdb/default_data_config.h"
 #include "splinterdb/splinterdb.h"
+#include "data_internal.h"
 #include "util.h"
 
 #include "poison.h"
@@ -29,6 +30,11 @@ key_compare(const data_config *cfg, slice key1, slice key2)
    return slice_lex_cmp(key1, key2);
 }
 
+bool
+data_key_compare_is_lexicographic(const data_config *cfg)
+{
+   return cfg->key_compare == key_compare;
+}
 
 static int
 merge_tuples(const data_config *cfg,
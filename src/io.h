@@ -27,6 +27,8 @@ typedef struct io_config {
    char   filename[MAX_STRING_LENGTH];
    int    flags;
    uint32 perms;
+   bool   use_uring;    // use the io_uring engine where available
+   bool   uring_sqpoll; // let a kernel thread poll the io_uring SQ
 } io_config;
 
 typedef void (*io_callback_fn)(void           *metadata,
@@ -57,6 +59,12 @@ typedef platform_status (*io_write_async_fn)(io_handle     *io,
                                              uint64         addr);
 typedef void (*io_cleanup_fn)(io_handle *io, uint64 count);
 typedef void (*io_cleanup_all_fn)(io_handle *io);
+typedef platform_status (*io_sync_fn)(io_handle *io);
+typedef platform_status (*io_register_buffer_fn)(io_handle *io,
+                                                 void      *addr,
+                                                 uint64     bytes);
+typedef void (*io_unregister_buffer_fn)(io_handle *io);
+typedef void (*io_batch_fn)(io_handle *io);
 typedef void (*io_thread_register_fn)(io_handle *io);
 typedef bool (*io_max_latency_elapsed_fn)(io_handle *io, timestamp ts);
 
@@ -73,8 +81,13 @@ typedef struct io_ops {
    io_write_async_fn         write_async;
    io_cleanup_fn             cleanup;
    io_cleanup_all_fn         cleanup_all;
+   io_sync_fn                sync;
    io_thread_register_fn     thread_register;
    io_max_latency_elapsed_fn max_latency_elapsed;
+   io_register_buffer_fn     register_buffer;
+   io_unregister_buffer_fn   unregister_buffer;
+   io_batch_fn               begin_batch;
+   io_batch_fn               flush_batch;
 } io_ops;
 
 // to sub-class io, make an io your first field;
@@ -91,6 +104,14 @@ io_handle_init(platform_io_handle  *ioh,
 void
 io_handle_deinit(platform_io_handle *ioh);
 
+// Whether ioh does async IO through io_uring, rather than libaio
+bool
+io_handle_uses_uring(platform_io_handle *ioh);
+
+// Whether the kernel lets this process set up an io_uring
+bool
+io_uring_available(void);
+
 static inline platform_status
 io_read(io_handle *io, void *buf, uint64 bytes, uint64 addr)
 {
@@ -154,6 +175,35 @@ io_cleanup_all(io_handle *io)
    return io->ops->cleanup_all(io);
 }
 
+// Makes all completed writes durable on the underlying device
+static inline platform_status
+io_sync(io_handle *io)
+{
+   return io->ops->sync(io);
+}
+
+/*
+ * Between io_begin_batch and io_flush_batch, async IOs issued by the calling
+ * thread may be queued and submitted together, either when enough have
+ * accumulated or at io_flush_batch. io_cleanup from the same thread also
+ * submits them, so waiting on a queued IO cannot deadlock. Optional.
+ */
+static inline void
+io_begin_batch(io_handle *io)
+{
+   if (io->ops->begin_batch) {
+      io->ops->begin_batch(io);
+   }
+}
+
+static inline void
+io_flush_batch(io_handle *io)
+{
+   if (io->ops->flush_batch) {
+      io->ops->flush_batch(io);
+   }
+}
+
 static inline void
 io_thread_register(io_handle *io)
 {
@@ -171,6 +221,27 @@ io_max_latency_elapsed(io_handle *io, timestamp ts)
    return TRUE;
 }
 
+/*
+ * Tells the IO system that most IO will be to/from [addr, addr + bytes), so
+ * it may pre-register that memory with the kernel. Optional.
+ */
+static inline platform_status
+io_register_buffer(io_handle *io, void *addr, uint64 bytes)
+{
+   if (io->ops->register_buffer) {
+      return io->ops->register_buffer(io, addr, bytes);
+   }
+   return STATUS_OK;
+}
+
+static inline void
+io_unregister_buffer(io_handle *io)
+{
+   if (io->ops->unregister_buffer) {
+      io->ops->unregister_buffer(io);
+   }
+}
+
 /*
  *-----------------------------------------------------------------------------
  * io_config_init --
@@ -15,6 +15,11 @@ typedef void (*iterator_get_curr_fn)(iterator *itor,
 typedef platform_status (*iterator_at_end_fn)(iterator *itor, bool *at_end);
 typedef platform_status (*iterator_advance_fn)(iterator *itor);
 typedef void (*iterator_print_fn)(iterator *itor);
+typedef platform_status (*iterator_seek_fn)(iterator *itor, key target);
+typedef platform_status (*iterator_prev_key_fn)(iterator   *itor,
+                                               key         target,
+                                               key_buffer *prev,
+                                               bool       *found);
 
 typedef struct iterator_ops {
    /* Callers should not modify data pointed to by *key or *data */
@@ -22,6 +27,17 @@ typedef struct iterator_ops {
    iterator_at_end_fn   at_end;
    iterator_advance_fn  advance;
    iterator_print_fn    print;
+
+   /*
+    * Optional. seek repositions the iterator at the first key >= target (and
+    * below its max key) without reinitializing it, or at the largest key
+    * < target (and not below its min key) for iterators returning their
+    * keys in descending order. prev_key copies the largest key < target
+    * into prev without moving the iterator, ignoring its bounds, and sets
+    * *found to FALSE if there is none.
+    */
+   iterator_seek_fn     seek;
+   iterator_prev_key_fn prev_key;
 } iterator_ops;
 
 // To sub-class iterator, make an iterator your first field
@@ -53,4 +69,18 @@ iterator_print(iterator *itor)
    return itor->ops->print(itor);
 }
 
+static inline platform_status
+iterator_seek(iterator *itor, key target)
+{
+   debug_assert(itor->ops->seek != NULL);
+   return itor->ops->seek(itor, target);
+}
+
+static inline platform_status
+iterator_prev_key(iterator *itor, key target, key_buffer *prev, bool *found)
+{
+   debug_assert(itor->ops->prev_key != NULL);
+   return itor->ops->prev_key(itor, target, prev, found);
+}
+
 #endif // __ITERATOR_H
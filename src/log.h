@@ -24,15 +24,23 @@ typedef int (*log_write_fn)(log_handle *log,
                             message     data,
                             uint64      generation);
 typedef void (*log_release_fn)(log_handle *log);
+typedef platform_status (*log_sync_fn)(log_handle *log);
 typedef uint64 (*log_addr_fn)(log_handle *log);
 typedef uint64 (*log_magic_fn)(log_handle *log);
+typedef void (*log_extent_fn)(void *arg, uint64 base_addr);
+typedef void (*log_for_each_extent_fn)(log_handle   *log,
+                                       log_extent_fn func,
+                                       void         *arg);
 
 typedef struct log_ops {
    log_write_fn   write;
    log_release_fn release;
+   log_sync_fn    sync;
    log_addr_fn    addr;
    log_addr_fn    meta_addr;
    log_magic_fn   magic;
+
+   log_for_each_extent_fn for_each_extent;
 } log_ops;
 
 // to sub-class log, make a log_handle your first field
@@ -46,12 +54,23 @@ log_write(log_handle *log, key tuple_key, message data, uint64 generation)
    return log->ops->write(log, tuple_key, data, generation);
 }
 
+/*
+ * Frees the extents of the log, which must no longer be written or synced.
+ * The handle itself is freed by the caller.
+ */
 static inline void
 log_release(log_handle *log)
 {
    log->ops->release(log);
 }
 
+// Returns once all log writes which completed before the call are durable
+static inline platform_status
+log_sync(log_handle *log)
+{
+   return log->ops->sync(log);
+}
+
 static inline uint64
 log_addr(log_handle *log)
 {
@@ -70,6 +89,16 @@ log_magic(log_handle *log)
    return log->ops->magic(log);
 }
 
+/*
+ * Calls func on each extent of the log. Writes may continue during the call,
+ * in which case the extents they add may be missed.
+ */
+static inline void
+log_for_each_extent(log_handle *log, log_extent_fn func, void *arg)
+{
+   log->ops->for_each_extent(log, func, arg);
+}
+
 log_handle *
 log_create(cache *cc, log_config *cfg, platform_heap_id hid);
 
@@ -16,10 +16,29 @@
 
 #define MEMTABLE_COUNT_GRANULARITY 128
 
-bool
-memtable_is_full(const memtable_config *cfg, memtable *mt)
+/*
+ * Each shard gets an equal part of the memtable's capacity, so the memtable
+ * is rotated as soon as any one of its shards is full. An empty btree
+ * already takes an extent per mini allocator batch, so only the extents
+ * beyond that are split between the shards.
+ */
+static bool
+memtable_shard_is_full(const memtable_config *cfg,
+                       memtable              *mt,
+                       uint64                 shard_no)
 {
-   return cfg->max_extents_per_memtable <= mini_num_extents(&mt->mini);
+   memtable_shard *shard = &mt->shard[shard_no];
+   if (mt->type == MEMTABLE_TYPE_SKIPLIST) {
+      uint64 max_bytes = cfg->max_bytes_per_memtable / cfg->num_shards;
+      return max_bytes <= skiplist_bytes(shard->sl);
+   }
+   uint64 data_extents = 0;
+   if (shard->empty_extents < cfg->max_extents_per_memtable) {
+      data_extents = cfg->max_extents_per_memtable - shard->empty_extents;
+   }
+   data_extents = MAX(data_extents / cfg->num_shards, 1);
+   return shard->empty_extents + data_extents
+          <= mini_num_extents(&shard->mini);
 }
 
 bool
@@ -41,16 +60,80 @@ memtable_process(memtable_context *ctxt, uint64 generation)
 }
 
 
+static inline page_handle *
+memtable_get_insert_lock(memtable_context *ctxt, uint64 shard_no)
+{
+   return cache_get(ctxt->cc,
+                    ctxt->insert_lock_addr[shard_no],
+                    TRUE,
+                    PAGE_TYPE_LOCK_NO_DATA);
+}
+
+/*
+ * Claims and write-locks the insert locks of all shards, in shard order.
+ * Returns FALSE, holding none of them, if another thread has a claim on one.
+ */
+static bool
+memtable_try_claim_lock_all_insert_locks(memtable_context *ctxt,
+                                         page_handle     **lock_page)
+{
+   cache *cc = ctxt->cc;
+   for (uint64 shard_no = 0; shard_no < ctxt->cfg.num_shards; shard_no++) {
+      lock_page[shard_no] = memtable_get_insert_lock(ctxt, shard_no);
+      if (!cache_claim(cc, lock_page[shard_no])) {
+         cache_unget(cc, lock_page[shard_no]);
+         while (shard_no-- > 0) {
+            cache_unclaim(cc, lock_page[shard_no]);
+            cache_unget(cc, lock_page[shard_no]);
+         }
+         return FALSE;
+      }
+   }
+   for (uint64 shard_no = 0; shard_no < ctxt->cfg.num_shards; shard_no++) {
+      cache_lock(cc, lock_page[shard_no]);
+   }
+   return TRUE;
+}
+
+static void
+memtable_unlock_unclaim_unget_all_insert_locks(memtable_context *ctxt,
+                                               page_handle     **lock_page)
+{
+   cache *cc = ctxt->cc;
+   for (uint64 shard_no = 0; shard_no < ctxt->cfg.num_shards; shard_no++) {
+      cache_unlock(cc, lock_page[shard_no]);
+      cache_unclaim(cc, lock_page[shard_no]);
+      cache_unget(cc, lock_page[shard_no]);
+   }
+}
+
+/*
+ * Must hold all the insert locks. Retires the current memtable and returns
+ * its generation.
+ */
+static uint64
+memtable_finalize(memtable_context *ctxt)
+{
+   uint64    generation = ctxt->generation;
+   uint64    mt_no      = generation % ctxt->cfg.max_memtables;
+   memtable *mt         = &ctxt->mt[mt_no];
+   memtable_transition(mt, MEMTABLE_STATE_READY, MEMTABLE_STATE_FINALIZED);
+   ctxt->generation++;
+   memtable_mark_empty(ctxt);
+   return generation;
+}
+
 platform_status
 memtable_maybe_rotate_and_get_insert_lock(memtable_context *ctxt,
+                                          uint64            shard_no,
                                           uint64           *generation,
                                           page_handle     **lock_page)
 {
-   cache *cc        = ctxt->cc;
-   uint64 lock_addr = ctxt->insert_lock_addr;
-   uint64 wait      = 100;
+   cache *cc   = ctxt->cc;
+   uint64 wait = 100;
+   debug_assert(shard_no < ctxt->cfg.num_shards);
    while (TRUE) {
-      *lock_page      = cache_get(cc, lock_addr, TRUE, PAGE_TYPE_LOCK_NO_DATA);
+      *lock_page      = memtable_get_insert_lock(ctxt, shard_no);
       *generation     = ctxt->generation;
       uint64    mt_no = *generation % ctxt->cfg.max_memtables;
       memtable *mt    = &ctxt->mt[mt_no];
@@ -62,24 +145,28 @@ memtable_maybe_rotate_and_get_insert_lock(memtable_context *ctxt,
          continue;
       }
 
-      if (memtable_is_full(&ctxt->cfg, &ctxt->mt[mt_no])) {
-         // If the current memtable is full, try to retire it.
-         if (cache_claim(cc, *lock_page)) {
-            // We successfully got the claim, so we do the finalization
-            cache_lock(cc, *lock_page);
-            memtable_transition(
-               mt, MEMTABLE_STATE_READY, MEMTABLE_STATE_FINALIZED);
-
-            uint64 process_generation = ctxt->generation++;
-            memtable_mark_empty(ctxt);
-            cache_unlock(cc, *lock_page);
-            cache_unclaim(cc, *lock_page);
-            cache_unget(cc, *lock_page);
-            memtable_process(ctxt, process_generation);
+      if (memtable_shard_is_full(&ctxt->cfg, mt, shard_no)) {
+         // If our shard of the current memtable is full, try to retire it.
+         // That takes the insert locks of all the shards, so drop ours.
+         cache_unget(cc, *lock_page);
+         page_handle *all_lock_pages[MEMTABLE_MAX_SHARDS];
+         if (memtable_try_claim_lock_all_insert_locks(ctxt, all_lock_pages)) {
+            // We got all the claims, so we do the finalization, unless
+            // another thread beat us to it while we were unlocked.
+            bool   rotated            = FALSE;
+            uint64 process_generation = 0;
+            if (ctxt->generation == *generation) {
+               process_generation = memtable_finalize(ctxt);
+               rotated            = TRUE;
+            }
+            memtable_unlock_unclaim_unget_all_insert_locks(ctxt,
+                                                           all_lock_pages);
+            if (rotated) {
+               memtable_process(ctxt, process_generation);
+            }
          } else {
-            cache_unget(cc, *lock_page);
             platform_sleep(wait);
-            wait *= 2;
+            wait = wait > 2048 ? wait : 2 * wait;
          }
          continue;
       }
@@ -89,50 +176,54 @@ memtable_maybe_rotate_and_get_insert_lock(memtable_context *ctxt,
 }
 
 /*
- *-----------------------------------------------------------------------------
- * Increments the distributed tuple counter.  Must hold a read lock on
- * insert_lock.
- *
- * Add to local num_tuple counter. If at granularity, then increment the
- * global counter.
- *
- * There is no race because thread_num_tuples is never accessed by another
- * thread, it is only used by the current thread to determine when to change
- * the global counter.
- *
- * each thread pads num_tuples by MEMTABLE_COUNT_GRANULARITY whenever it
- * adds a tuple which takes its local count to
- * k * MEMTABLE_COUNT_GRANULARITY + 1. Therefore, num_tuples is an upper
- * bound except that each thread may still add 1 more tuple.
- *-----------------------------------------------------------------------------
+ * Marks the memtable non-empty. Must hold the insert lock of a shard. The
+ * flag is shared by the inserts into all the shards, so it is only stored
+ * once per memtable, rather than bouncing its cache line between writers.
  */
 static inline void
 memtable_add_tuple(memtable_context *ctxt)
 {
-   ctxt->is_empty = FALSE;
+   if (ctxt->is_empty) {
+      ctxt->is_empty = FALSE;
+   }
 }
 
 platform_status
 memtable_insert(memtable_context *ctxt,
                 memtable         *mt,
+                uint64            shard_no,
                 platform_heap_id  heap_id,
                 key               tuple_key,
                 message           msg,
                 uint64           *leaf_generation)
 {
-   const threadid tid = platform_get_tid();
-   bool           was_unique;
+   const threadid  tid   = platform_get_tid();
+   memtable_shard *shard = &mt->shard[shard_no];
+   bool            was_unique;
+
+   if (mt->type == MEMTABLE_TYPE_BTREE && ctxt->scratch[tid] == NULL) {
+      ctxt->scratch[tid] = TYPED_MALLOC(heap_id, ctxt->scratch[tid]);
+      if (ctxt->scratch[tid] == NULL) {
+         return STATUS_NO_MEMORY;
+      }
+   }
 
-   platform_status rc = btree_insert(ctxt->cc,
-                                     ctxt->cfg.btree_cfg,
-                                     heap_id,
-                                     &ctxt->scratch[tid],
-                                     mt->root_addr,
-                                     &mt->mini,
-                                     tuple_key,
-                                     msg,
-                                     leaf_generation,
-                                     &was_unique);
+   platform_status rc;
+   if (mt->type == MEMTABLE_TYPE_SKIPLIST) {
+      rc = skiplist_insert(
+         shard->sl, tid, tuple_key, msg, leaf_generation, &was_unique);
+   } else {
+      rc = btree_insert(ctxt->cc,
+                        ctxt->cfg.btree_cfg,
+                        heap_id,
+                        ctxt->scratch[tid],
+                        shard->root_addr,
+                        &shard->mini,
+                        tuple_key,
+                        msg,
+                        leaf_generation,
+                        &was_unique);
+   }
    if (!SUCCESS(rc)) {
       return rc;
    }
@@ -144,6 +235,352 @@ memtable_insert(memtable_context *ctxt,
    return rc;
 }
 
+/*
+ * Merges the memtable's message for target, if any, into data.
+ */
+platform_status
+memtable_lookup_and_merge(memtable_context  *ctxt,
+                          memtable          *mt,
+                          key                target,
+                          merge_accumulator *data,
+                          bool              *local_found)
+{
+   memtable_shard *shard = &mt->shard[memtable_shard_for_key(ctxt, target)];
+   if (mt->type == MEMTABLE_TYPE_SKIPLIST) {
+      return skiplist_lookup_and_merge(shard->sl, target, data, local_found);
+   }
+   return btree_lookup_and_merge(ctxt->cc,
+                                 ctxt->cfg.btree_cfg,
+                                 shard->root_addr,
+                                 PAGE_TYPE_MEMTABLE,
+                                 target,
+                                 data,
+                                 local_found);
+}
+
+/*
+ * Sharded memtable iterator: the shards hold disjoint keys, so the iterator
+ * just tracks which shard iterator is positioned at the smallest key (the
+ * largest for reverse iterators).
+ */
+static platform_status
+memtable_iterator_find_curr(memtable_iterator *itor)
+{
+   key curr_key = NULL_KEY;
+   itor->curr   = itor->num_shards;
+   for (uint64 shard_no = 0; shard_no < itor->num_shards; shard_no++) {
+      iterator       *shard_itor = memtable_shard_iterator_get(itor, shard_no);
+      bool            at_end;
+      platform_status rc = iterator_at_end(shard_itor, &at_end);
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+      if (at_end) {
+         continue;
+      }
+      key     shard_key;
+      message shard_msg;
+      iterator_get_curr(shard_itor, &shard_key, &shard_msg);
+      if (itor->curr < itor->num_shards) {
+         int cmp = data_key_compare(itor->data_cfg, shard_key, curr_key);
+         if (itor->reverse ? cmp <= 0 : cmp >= 0) {
+            continue;
+         }
+      }
+      itor->curr = shard_no;
+      curr_key   = shard_key;
+   }
+   return STATUS_OK;
+}
+
+static void
+memtable_iterator_get_curr(iterator *base_itor, key *curr_key, message *msg)
+{
+   memtable_iterator *itor = (memtable_iterator *)base_itor;
+   debug_assert(itor->curr < itor->num_shards);
+   iterator_get_curr(
+      memtable_shard_iterator_get(itor, itor->curr), curr_key, msg);
+}
+
+static platform_status
+memtable_iterator_at_end(iterator *base_itor, bool *at_end)
+{
+   memtable_iterator *itor = (memtable_iterator *)base_itor;
+   *at_end                 = itor->curr == itor->num_shards;
+   return STATUS_OK;
+}
+
+static platform_status
+memtable_iterator_advance(iterator *base_itor)
+{
+   memtable_iterator *itor = (memtable_iterator *)base_itor;
+   debug_assert(itor->curr < itor->num_shards);
+   platform_status rc =
+      iterator_advance(memtable_shard_iterator_get(itor, itor->curr));
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   return memtable_iterator_find_curr(itor);
+}
+
+static platform_status
+memtable_iterator_seek(iterator *base_itor, key target)
+{
+   memtable_iterator *itor = (memtable_iterator *)base_itor;
+   for (uint64 shard_no = 0; shard_no < itor->num_shards; shard_no++) {
+      platform_status rc =
+         iterator_seek(memtable_shard_iterator_get(itor, shard_no), target);
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+   }
+   return memtable_iterator_find_curr(itor);
+}
+
+/*
+ * The largest key < target is the largest of the shards' answers.
+ */
+static platform_status
+memtable_iterator_prev_key(iterator   *base_itor,
+                           key         target,
+                           key_buffer *prev,
+                           bool       *found)
+{
+   memtable_iterator *itor = (memtable_iterator *)base_itor;
+   DECLARE_AUTO_KEY_BUFFER(shard_prev, itor->heap_id);
+   *found = FALSE;
+   for (uint64 shard_no = 0; shard_no < itor->num_shards; shard_no++) {
+      bool            shard_found;
+      platform_status rc =
+         iterator_prev_key(memtable_shard_iterator_get(itor, shard_no),
+                           target,
+                           &shard_prev,
+                           &shard_found);
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+      if (shard_found
+          && (!*found
+              || data_key_compare(itor->data_cfg,
+                                  key_buffer_key(&shard_prev),
+                                  key_buffer_key(prev))
+                    > 0))
+      {
+         rc = key_buffer_copy_key(prev, key_buffer_key(&shard_prev));
+         if (!SUCCESS(rc)) {
+            return rc;
+         }
+         *found = TRUE;
+      }
+   }
+   return STATUS_OK;
+}
+
+static void
+memtable_iterator_print(iterator *base_itor)
+{
+   memtable_iterator *itor = (memtable_iterator *)base_itor;
+   platform_default_log("memtable iterator: %lu shards, curr shard %lu\n",
+                        itor->num_shards,
+                        itor->curr);
+   if (itor->curr < itor->num_shards) {
+      iterator_print(memtable_shard_iterator_get(itor, itor->curr));
+   }
+}
+
+const static iterator_ops memtable_iterator_ops = {
+   .get_curr = memtable_iterator_get_curr,
+   .at_end   = memtable_iterator_at_end,
+   .advance  = memtable_iterator_advance,
+   .print    = memtable_iterator_print,
+   .seek     = memtable_iterator_seek,
+   .prev_key = memtable_iterator_prev_key,
+};
+
+/*
+ * Caller must hold a reference to the memtable, or otherwise keep it from
+ * being recycled, until the iterator is deinitialized.
+ */
+platform_status
+memtable_iterator_init(memtable_context  *ctxt,
+                       memtable          *mt,
+                       memtable_iterator *itor,
+                       key                min_key,
+                       key                max_key,
+                       bool               reverse)
+{
+   itor->super.ops  = &memtable_iterator_ops;
+   itor->type       = mt->type;
+   itor->reverse    = reverse;
+   itor->heap_id    = ctxt->heap_id;
+   itor->data_cfg   = ctxt->cfg.btree_cfg->data_cfg;
+   itor->num_shards = 0;
+   for (uint64 shard_no = 0; shard_no < mt->num_shards; shard_no++) {
+      memtable_shard          *shard      = &mt->shard[shard_no];
+      memtable_shard_iterator *shard_itor = &itor->shard[shard_no];
+      if (mt->type == MEMTABLE_TYPE_SKIPLIST) {
+         platform_status rc;
+         if (reverse) {
+            rc = skiplist_iterator_init_reverse(
+               shard->sl, &shard_itor->skiplist_itor, min_key, max_key);
+         } else {
+            rc = skiplist_iterator_init(
+               shard->sl, &shard_itor->skiplist_itor, min_key, max_key);
+         }
+         if (!SUCCESS(rc)) {
+            memtable_iterator_deinit(itor);
+            return rc;
+         }
+      } else if (reverse) {
+         btree_iterator_init_reverse(ctxt->cc,
+                                     ctxt->cfg.btree_cfg,
+                                     &shard_itor->btree_itor,
+                                     shard->root_addr,
+                                     PAGE_TYPE_MEMTABLE,
+                                     min_key,
+                                     max_key);
+      } else {
+         btree_iterator_init(ctxt->cc,
+                             ctxt->cfg.btree_cfg,
+                             &shard_itor->btree_itor,
+                             shard->root_addr,
+                             PAGE_TYPE_MEMTABLE,
+                             min_key,
+                             max_key,
+                             FALSE,
+                             0);
+      }
+      itor->num_shards++;
+   }
+   if (itor->num_shards == 1) {
+      return STATUS_OK;
+   }
+   platform_status rc = memtable_iterator_find_curr(itor);
+   if (!SUCCESS(rc)) {
+      memtable_iterator_deinit(itor);
+   }
+   return rc;
+}
+
+void
+memtable_iterator_deinit(memtable_iterator *itor)
+{
+   for (uint64 shard_no = 0; shard_no < itor->num_shards; shard_no++) {
+      memtable_shard_iterator *shard_itor = &itor->shard[shard_no];
+      if (itor->type == MEMTABLE_TYPE_SKIPLIST) {
+         skiplist_iterator_deinit(&shard_itor->skiplist_itor);
+      } else {
+         btree_iterator_deinit(&shard_itor->btree_itor);
+      }
+   }
+   itor->num_shards = 0;
+}
+
+/*
+ * The shards of a memtable are recycled together, so a single reference
+ * count covers all of them.
+ */
+void
+memtable_inc_ref(memtable_context *ctxt, memtable *mt)
+{
+   __sync_fetch_and_add(&mt->ref_count, 1);
+}
+
+uint64
+memtable_get_ref(memtable_context *ctxt, memtable *mt)
+{
+   return mt->ref_count;
+}
+
+/*
+ * Frees the contents of all the shards.
+ */
+static void
+memtable_free_contents(memtable *mt, cache *cc)
+{
+   for (uint64 shard_no = 0; shard_no < mt->num_shards; shard_no++) {
+      memtable_shard *shard = &mt->shard[shard_no];
+      if (mt->type == MEMTABLE_TYPE_SKIPLIST) {
+         skiplist_reset(shard->sl);
+      } else {
+         debug_only bool freed = btree_dec_ref(
+            cc, mt->cfg, shard->root_addr, PAGE_TYPE_MEMTABLE);
+         debug_assert(freed);
+      }
+   }
+}
+
+/*
+ * Sets up empty shards of the configured type, after memtable_init or once
+ * the previous contents have been freed.
+ */
+static void
+memtable_create_contents(memtable *mt, cache *cc)
+{
+   if (mt->type == MEMTABLE_TYPE_BTREE) {
+      for (uint64 shard_no = 0; shard_no < mt->num_shards; shard_no++) {
+         memtable_shard *shard = &mt->shard[shard_no];
+         shard->root_addr =
+            btree_create(cc, mt->cfg, &shard->mini, PAGE_TYPE_MEMTABLE);
+         shard->empty_extents = mini_num_extents(&shard->mini);
+      }
+   }
+   mt->ref_count = 1;
+}
+
+bool
+memtable_verify(cache *cc, memtable *mt)
+{
+   for (uint64 shard_no = 0; shard_no < mt->num_shards; shard_no++) {
+      memtable_shard *shard = &mt->shard[shard_no];
+      bool            ok;
+      if (mt->type == MEMTABLE_TYPE_SKIPLIST) {
+         ok = skiplist_verify(shard->sl);
+      } else {
+         ok = btree_verify_tree(
+            cc, mt->cfg, shard->root_addr, PAGE_TYPE_MEMTABLE);
+      }
+      if (!ok) {
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+void
+memtable_print(platform_log_handle *log_handle, cache *cc, memtable *mt)
+{
+   for (uint64 shard_no = 0; shard_no < mt->num_shards; shard_no++) {
+      memtable_shard *shard = &mt->shard[shard_no];
+      if (mt->num_shards > 1) {
+         platform_log(log_handle, "memtable shard %lu:\n", shard_no);
+      }
+      if (mt->type == MEMTABLE_TYPE_SKIPLIST) {
+         skiplist_print(log_handle, shard->sl);
+      } else {
+         btree_print_tree(log_handle, cc, mt->cfg, shard->root_addr);
+      }
+   }
+}
+
+void
+memtable_print_stats(platform_log_handle *log_handle, cache *cc, memtable *mt)
+{
+   for (uint64 shard_no = 0; shard_no < mt->num_shards; shard_no++) {
+      memtable_shard *shard = &mt->shard[shard_no];
+      if (mt->num_shards > 1) {
+         platform_log(log_handle, "memtable shard %lu:\n", shard_no);
+      }
+      if (mt->type == MEMTABLE_TYPE_SKIPLIST) {
+         platform_log(log_handle,
+                      "skiplist memtable: %lu bytes\n",
+                      skiplist_bytes(shard->sl));
+      } else {
+         btree_print_tree_stats(log_handle, cc, mt->cfg, shard->root_addr);
+      }
+   }
+}
+
 void
 memtable_unget_insert_lock(memtable_context *ctxt, page_handle *lock_page)
 {
@@ -191,12 +628,11 @@ memtable_unlock_unclaim_unget_lookup_lock(memtable_context *ctxt,
 bool
 memtable_dec_ref_maybe_recycle(memtable_context *ctxt, memtable *mt)
 {
-   cache *cc = ctxt->cc;
-
-   bool freed = btree_dec_ref(cc, mt->cfg, mt->root_addr, PAGE_TYPE_MEMTABLE);
+   bool freed = __sync_sub_and_fetch(&mt->ref_count, 1) == 0;
    if (freed) {
       platform_assert(mt->state == MEMTABLE_STATE_INCORPORATED);
-      mt->root_addr = btree_create(cc, mt->cfg, &mt->mini, PAGE_TYPE_MEMTABLE);
+      memtable_free_contents(mt, ctxt->cc);
+      memtable_create_contents(mt, ctxt->cc);
       memtable_lock_incorporation_lock(ctxt);
       mt->generation += ctxt->cfg.max_memtables;
       memtable_unlock_incorporation_lock(ctxt);
@@ -209,40 +645,94 @@ memtable_dec_ref_maybe_recycle(memtable_context *ctxt, memtable *mt)
 uint64
 memtable_force_finalize(memtable_context *ctxt)
 {
-   uint64       lock_addr = ctxt->insert_lock_addr;
-   cache       *cc        = ctxt->cc;
-   page_handle *lock_page =
-      cache_get(cc, lock_addr, TRUE, PAGE_TYPE_LOCK_NO_DATA);
-   uint64 wait = 100;
-   while (!cache_claim(cc, lock_page)) {
-      cache_unget(cc, lock_page);
+   page_handle *lock_page[MEMTABLE_MAX_SHARDS];
+   uint64       wait = 100;
+   while (!memtable_try_claim_lock_all_insert_locks(ctxt, lock_page)) {
       platform_sleep(wait);
-      wait *= 2;
-      lock_page = cache_get(cc, lock_addr, TRUE, PAGE_TYPE_LOCK_NO_DATA);
+      wait = wait > 2048 ? wait : 2 * wait;
    }
-   cache_lock(cc, lock_page);
 
-   uint64    generation = ctxt->generation;
-   uint64    mt_no      = generation % ctxt->cfg.max_memtables;
-   memtable *mt         = &ctxt->mt[mt_no];
-   memtable_transition(mt, MEMTABLE_STATE_READY, MEMTABLE_STATE_FINALIZED);
-   uint64 process_generation = ctxt->generation++;
-   memtable_mark_empty(ctxt);
+   uint64 process_generation = memtable_finalize(ctxt);
 
-   cache_unlock(cc, lock_page);
-   cache_unclaim(cc, lock_page);
-   cache_unget(cc, lock_page);
+   memtable_unlock_unclaim_unget_all_insert_locks(ctxt, lock_page);
 
    return process_generation;
 }
 
+/*
+ *-----------------------------------------------------------------------------
+ * memtable_begin_barrier --
+ *
+ *      Holds off all inserts until memtable_end_barrier. The current memtable
+ *      is retired first unless it is empty, so every tuple inserted before
+ *      the barrier is in a memtable older than the returned generation, and
+ *      every tuple inserted after it is in that generation or a newer one.
+ *
+ *      The retired memtable is processed by memtable_end_barrier.
+ *-----------------------------------------------------------------------------
+ */
+uint64
+memtable_begin_barrier(memtable_context *ctxt, memtable_barrier *barrier)
+{
+   uint64 generation;
+   uint64 wait = 100;
+   while (!memtable_try_begin_barrier(ctxt, barrier, &generation)) {
+      platform_sleep(wait);
+      wait = wait > 2048 ? wait : 2 * wait;
+   }
+   return generation;
+}
+
+/*
+ * Like memtable_begin_barrier, but returns FALSE rather than waiting if
+ * another thread is rotating the memtable or holds a barrier.
+ */
+bool
+memtable_try_begin_barrier(memtable_context *ctxt,
+                           memtable_barrier *barrier,
+                           uint64           *generation)
+{
+   if (!memtable_try_claim_lock_all_insert_locks(ctxt, barrier->lock_page)) {
+      return FALSE;
+   }
+
+   barrier->finalized = !memtable_is_empty(ctxt);
+   if (barrier->finalized) {
+      barrier->process_generation = memtable_finalize(ctxt);
+   }
+   *generation = ctxt->generation;
+   return TRUE;
+}
+
+void
+memtable_end_barrier(memtable_context *ctxt, memtable_barrier *barrier)
+{
+   memtable_unlock_unclaim_unget_all_insert_locks(ctxt, barrier->lock_page);
+   if (barrier->finalized) {
+      memtable_process(ctxt, barrier->process_generation);
+   }
+}
+
 void
-memtable_init(memtable *mt, cache *cc, memtable_config *cfg, uint64 generation)
+memtable_init(memtable        *mt,
+              platform_heap_id hid,
+              cache           *cc,
+              memtable_config *cfg,
+              uint64           generation)
 {
    ZERO_CONTENTS(mt);
-   mt->cfg       = cfg->btree_cfg;
-   mt->root_addr = btree_create(cc, mt->cfg, &mt->mini, PAGE_TYPE_MEMTABLE);
-   mt->state     = MEMTABLE_STATE_READY;
+   mt->type       = cfg->type;
+   mt->cfg        = cfg->btree_cfg;
+   mt->num_shards = cfg->num_shards;
+   if (mt->type == MEMTABLE_TYPE_SKIPLIST) {
+      for (uint64 shard_no = 0; shard_no < mt->num_shards; shard_no++) {
+         platform_status rc = skiplist_create(
+            hid, cfg->btree_cfg->data_cfg, &mt->shard[shard_no].sl);
+         platform_assert_status_ok(rc);
+      }
+   }
+   memtable_create_contents(mt, cc);
+   mt->state = MEMTABLE_STATE_READY;
    platform_assert(generation < UINT64_MAX);
    mt->generation = generation;
 }
@@ -250,10 +740,17 @@ memtable_init(memtable *mt, cache *cc, memtable_config *cfg, uint64 generation)
 void
 memtable_deinit(cache *cc, memtable *mt)
 {
-   mini_release(&mt->mini, NULL_KEY);
-   debug_only bool freed =
-      btree_dec_ref(cc, mt->cfg, mt->root_addr, PAGE_TYPE_MEMTABLE);
-   debug_assert(freed);
+   for (uint64 shard_no = 0; shard_no < mt->num_shards; shard_no++) {
+      memtable_shard *shard = &mt->shard[shard_no];
+      if (mt->type == MEMTABLE_TYPE_SKIPLIST) {
+         skiplist_destroy(&shard->sl);
+         continue;
+      }
+      mini_release(&shard->mini, NULL_KEY);
+      debug_only bool freed =
+         btree_dec_ref(cc, mt->cfg, shard->root_addr, PAGE_TYPE_MEMTABLE);
+      debug_assert(freed);
+   }
 }
 
 memtable_context *
@@ -265,36 +762,41 @@ memtable_context_create(platform_heap_id hid,
 {
    memtable_context *ctxt =
       TYPED_FLEXIBLE_STRUCT_ZALLOC(hid, ctxt, mt, cfg->max_memtables);
-   ctxt->cc = cc;
+   ctxt->heap_id = hid;
+   ctxt->cc      = cc;
    memmove(&ctxt->cfg, cfg, sizeof(ctxt->cfg));
+   platform_assert(0 < cfg->num_shards);
+   platform_assert(cfg->num_shards <= MEMTABLE_MAX_SHARDS);
 
    uint64          base_addr;
    allocator      *al = cache_allocator(cc);
    platform_status rc = allocator_alloc(al, &base_addr, PAGE_TYPE_LOCK_NO_DATA);
    platform_assert_status_ok(rc);
 
-   ctxt->insert_lock_addr = base_addr;
-   ctxt->lookup_lock_addr = base_addr + cache_page_size(cc);
-
-   page_handle *lock_page =
-      cache_alloc(cc, ctxt->insert_lock_addr, PAGE_TYPE_LOCK_NO_DATA);
-   cache_pin(cc, lock_page);
-   cache_unlock(cc, lock_page);
-   cache_unclaim(cc, lock_page);
-   cache_unget(cc, lock_page);
+   // The lookup lock and the insert locks of all the shards are on separate
+   // pages of a single extent.
+   uint64 page_size = cache_page_size(cc);
+   platform_assert((cfg->num_shards + 1) * page_size <= cache_extent_size(cc));
+   ctxt->lookup_lock_addr = base_addr;
+   for (uint64 shard_no = 0; shard_no < cfg->num_shards; shard_no++) {
+      ctxt->insert_lock_addr[shard_no] = base_addr + (shard_no + 1) * page_size;
+   }
 
-   lock_page = cache_alloc(cc, ctxt->lookup_lock_addr, PAGE_TYPE_LOCK_NO_DATA);
-   cache_pin(cc, lock_page);
-   cache_unlock(cc, lock_page);
-   cache_unclaim(cc, lock_page);
-   cache_unget(cc, lock_page);
+   for (uint64 page_no = 0; page_no < cfg->num_shards + 1; page_no++) {
+      uint64       addr      = base_addr + page_no * page_size;
+      page_handle *lock_page = cache_alloc(cc, addr, PAGE_TYPE_LOCK_NO_DATA);
+      cache_pin(cc, lock_page);
+      cache_unlock(cc, lock_page);
+      cache_unclaim(cc, lock_page);
+      cache_unget(cc, lock_page);
+   }
 
    platform_spinlock_init(
       &ctxt->incorporation_lock, platform_get_module_id(), hid);
 
    for (uint64 mt_no = 0; mt_no < cfg->max_memtables; mt_no++) {
       uint64 generation = mt_no;
-      memtable_init(&ctxt->mt[mt_no], cc, cfg, generation);
+      memtable_init(&ctxt->mt[mt_no], hid, cc, cfg, generation);
    }
 
    ctxt->generation                = 0;
@@ -319,16 +821,22 @@ memtable_context_destroy(platform_heap_id hid, memtable_context *ctxt)
 
    platform_spinlock_destroy(&ctxt->incorporation_lock);
 
+   for (threadid tid = 0; tid < MAX_THREADS; tid++) {
+      if (ctxt->scratch[tid] != NULL) {
+         platform_free(hid, ctxt->scratch[tid]);
+      }
+   }
+
    /*
-    * lookup lock and insert lock share extents but not pages.
-    * this deallocs both.
+    * lookup lock and insert locks share an extent but not pages, which
+    * starts at the lookup lock. this deallocs all of them.
     */
    allocator *al = cache_allocator(cc);
    uint8      ref =
-      allocator_dec_ref(al, ctxt->insert_lock_addr, PAGE_TYPE_LOCK_NO_DATA);
+      allocator_dec_ref(al, ctxt->lookup_lock_addr, PAGE_TYPE_LOCK_NO_DATA);
    platform_assert(ref == AL_NO_REFS);
-   cache_hard_evict_extent(cc, ctxt->insert_lock_addr, PAGE_TYPE_LOCK_NO_DATA);
-   ref = allocator_dec_ref(al, ctxt->insert_lock_addr, PAGE_TYPE_LOCK_NO_DATA);
+   cache_hard_evict_extent(cc, ctxt->lookup_lock_addr, PAGE_TYPE_LOCK_NO_DATA);
+   ref = allocator_dec_ref(al, ctxt->lookup_lock_addr, PAGE_TYPE_LOCK_NO_DATA);
    platform_assert(ref == AL_FREE);
 
    platform_free(hid, ctxt);
@@ -341,9 +849,12 @@ memtable_config_init(memtable_config *cfg,
                      uint64           memtable_capacity)
 {
    ZERO_CONTENTS(cfg);
+   cfg->type          = MEMTABLE_TYPE_BTREE;
+   cfg->num_shards    = 1;
    cfg->btree_cfg     = btree_cfg;
    cfg->max_memtables = max_memtables;
    cfg->max_extents_per_memtable =
       MEMTABLE_SPACE_OVERHEAD_FACTOR * memtable_capacity
       / cache_config_extent_size(btree_cfg->cache_cfg);
+   cfg->max_bytes_per_memtable = memtable_capacity;
 }
@@ -14,9 +14,33 @@
 #include "task.h"
 #include "cache.h"
 #include "btree.h"
+#include "skiplist.h"
 
 #define MEMTABLE_SPACE_OVERHEAD_FACTOR (2)
 
+/*
+ * A memtable can be split into shards, partitioned by key hash. Each shard is
+ * a separate btree or skiplist with its own insert lock, so that concurrent
+ * writers neither share a lock page nor contend within one tree. The shards
+ * of a memtable share its generation: they are rotated, compacted into a
+ * single branch and incorporated together. The log, checkpoints and range
+ * deletes order writes by memtable generation, so a shard cannot move on to
+ * a generation of its own. Rotation takes all the insert locks, but only
+ * once per memtable.
+ */
+#define MEMTABLE_MAX_SHARDS      (16)
+#define MEMTABLE_SHARD_HASH_SEED (0x5eed)
+
+/*
+ * Memtable backends. Btree memtables live in cache pages allocated from
+ * extents, skiplist memtables live in heap memory. Either way, a finalized
+ * memtable is packed into a branch before it is incorporated.
+ */
+typedef enum memtable_type {
+   MEMTABLE_TYPE_BTREE = 0,
+   MEMTABLE_TYPE_SKIPLIST,
+} memtable_type;
+
 typedef enum memtable_state {
    MEMTABLE_STATE_INVALID = 0,
    MEMTABLE_STATE_READY, // if it's the correct one, go ahead and insert
@@ -29,12 +53,24 @@ typedef enum memtable_state {
    NUM_MEMTABLE_STATES,
 } memtable_state;
 
+typedef struct memtable_shard {
+   // MEMTABLE_TYPE_BTREE
+   uint64         root_addr;
+   mini_allocator mini;
+   uint64         empty_extents; // taken by the tree when it was created
+
+   // MEMTABLE_TYPE_SKIPLIST
+   skiplist *sl;
+} memtable_shard;
+
 typedef struct memtable {
    volatile memtable_state state;
    uint64                  generation;
-   uint64                  root_addr;
-   mini_allocator          mini;
+   memtable_type           type;
    btree_config           *cfg;
+   volatile uint64         ref_count;
+   uint64                  num_shards;
+   memtable_shard          shard[MEMTABLE_MAX_SHARDS];
 } PLATFORM_CACHELINE_ALIGNED memtable;
 
 static inline bool
@@ -103,22 +139,48 @@ memtable_transition(memtable      *mt,
 typedef void (*process_fn)(void *arg, uint64 generation);
 
 typedef struct memtable_config {
-   uint64        max_extents_per_memtable;
+   memtable_type type;
+   uint64        num_shards;
+   uint64        max_extents_per_memtable; // btree memtables
+   uint64        max_bytes_per_memtable;   // skiplist memtables
    uint64        max_memtables;
    btree_config *btree_cfg;
 } memtable_config;
 
+typedef union memtable_shard_iterator {
+   btree_iterator    btree_itor;
+   skiplist_iterator skiplist_itor;
+} memtable_shard_iterator;
+
+/*
+ * Iterator over a btree or skiplist memtable. The shards hold disjoint sets
+ * of keys, so their iterators are merged by just picking the smallest key,
+ * or the largest one for reverse iterators.
+ */
+typedef struct memtable_iterator {
+   iterator                super;
+   memtable_type           type;
+   bool                    reverse;
+   platform_heap_id        heap_id;
+   data_config            *data_cfg;
+   uint64                  num_shards;
+   uint64                  curr; // shard with the next key, or num_shards
+   memtable_shard_iterator shard[MEMTABLE_MAX_SHARDS];
+} memtable_iterator;
+
 typedef struct memtable_context {
-   cache          *cc;
-   memtable_config cfg;
-   task_system    *ts;
+   platform_heap_id heap_id;
+   cache           *cc;
+   memtable_config  cfg;
+   task_system     *ts;
 
    process_fn process;
    void      *process_ctxt;
 
-   // Protected by insert_lock. Can read without lock. Must get read lock to
-   // freeze and write lock to modify.
-   uint64          insert_lock_addr;
+   // Protected by the insert locks, one per shard. Can read without lock.
+   // Must get a read lock on any shard to freeze and write locks on all
+   // shards to modify.
+   uint64          insert_lock_addr[MEMTABLE_MAX_SHARDS];
    volatile uint64 generation;
 
    // Protected by incorporation_lock. Must hold to read or modify.
@@ -132,14 +194,25 @@ typedef struct memtable_context {
 
    bool is_empty;
 
-   // Effectively thread local, no locking at all:
-   btree_scratch scratch[MAX_THREADS];
+   // Effectively thread local, no locking at all. Allocated by each thread
+   // on its first insert:
+   btree_scratch *scratch[MAX_THREADS];
 
    memtable mt[];
 } memtable_context;
 
+/*
+ * State held between memtable_begin_barrier and memtable_end_barrier.
+ */
+typedef struct memtable_barrier {
+   page_handle *lock_page[MEMTABLE_MAX_SHARDS];
+   bool         finalized;
+   uint64       process_generation;
+} memtable_barrier;
+
 platform_status
 memtable_maybe_rotate_and_get_insert_lock(memtable_context *ctxt,
+                                          uint64            shard_no,
                                           uint64           *generation,
                                           page_handle     **lock_page);
 
@@ -149,11 +222,55 @@ memtable_unget_insert_lock(memtable_context *ctxt, page_handle *lock_page);
 platform_status
 memtable_insert(memtable_context *ctxt,
                 memtable         *mt,
+                uint64            shard_no,
                 platform_heap_id  heap_id,
                 key               tuple_key,
                 message           msg,
                 uint64           *generation);
 
+platform_status
+memtable_lookup_and_merge(memtable_context  *ctxt,
+                          memtable          *mt,
+                          key                target,
+                          merge_accumulator *data,
+                          bool              *local_found);
+
+platform_status
+memtable_iterator_init(memtable_context  *ctxt,
+                       memtable          *mt,
+                       memtable_iterator *itor,
+                       key                min_key,
+                       key                max_key,
+                       bool               reverse);
+
+void
+memtable_iterator_deinit(memtable_iterator *itor);
+
+static inline iterator *
+memtable_shard_iterator_get(memtable_iterator *itor, uint64 shard_no)
+{
+   memtable_shard_iterator *shard_itor = &itor->shard[shard_no];
+   return itor->type == MEMTABLE_TYPE_SKIPLIST
+             ? &shard_itor->skiplist_itor.super
+             : &shard_itor->btree_itor.super;
+}
+
+/*
+ * Unsharded memtables are iterated directly.
+ */
+static inline iterator *
+memtable_iterator_get(memtable_iterator *itor)
+{
+   return itor->num_shards == 1 ? memtable_shard_iterator_get(itor, 0)
+                                : &itor->super;
+}
+
+void
+memtable_inc_ref(memtable_context *ctxt, memtable *mt);
+
+uint64
+memtable_get_ref(memtable_context *ctxt, memtable *mt);
+
 page_handle *
 memtable_get_lookup_lock(memtable_context *ctxt);
 
@@ -173,8 +290,23 @@ memtable_dec_ref_maybe_recycle(memtable_context *ctxt, memtable *mt);
 uint64
 memtable_force_finalize(memtable_context *ctxt);
 
+uint64
+memtable_begin_barrier(memtable_context *ctxt, memtable_barrier *barrier);
+
+bool
+memtable_try_begin_barrier(memtable_context *ctxt,
+                           memtable_barrier *barrier,
+                           uint64           *generation);
+
 void
-memtable_init(memtable *mt, cache *cc, memtable_config *cfg, uint64 generation);
+memtable_end_barrier(memtable_context *ctxt, memtable_barrier *barrier);
+
+void
+memtable_init(memtable        *mt,
+              platform_heap_id hid,
+              cache           *cc,
+              memtable_config *cfg,
+              uint64           generation);
 
 void
 memtable_deinit(cache *cc, memtable *mt);
@@ -195,10 +327,32 @@ memtable_config_init(memtable_config *cfg,
                      uint64           max_memtables,
                      uint64           memtable_capacity);
 
+/*
+ * The shard a key is inserted into.
+ */
 static inline uint64
-memtable_root_addr(memtable *mt)
+memtable_shard_for_key(memtable_context *ctxt, key tuple_key)
 {
-   return mt->root_addr;
+   if (ctxt->cfg.num_shards == 1) {
+      return 0;
+   }
+   const data_config *data_cfg = ctxt->cfg.btree_cfg->data_cfg;
+   uint32             hash = data_cfg->key_hash(
+      key_data(tuple_key), key_length(tuple_key), MEMTABLE_SHARD_HASH_SEED);
+   return hash % ctxt->cfg.num_shards;
+}
+
+/*
+ * Called once a finalized memtable receives no more inserts.
+ */
+static inline void
+memtable_release_allocator(memtable *mt)
+{
+   if (mt->type == MEMTABLE_TYPE_BTREE) {
+      for (uint64 shard_no = 0; shard_no < mt->num_shards; shard_no++) {
+         mini_release(&mt->shard[shard_no].mini, NULL_KEY);
+      }
+   }
 }
 
 static inline uint64
@@ -219,6 +373,15 @@ memtable_generation_retired(memtable_context *ctxt)
    return ctxt->generation_retired;
 }
 
+/*
+ * Number of finalized memtables which have not been incorporated yet.
+ */
+static inline uint64
+memtable_backlog(memtable_context *ctxt)
+{
+   return ctxt->generation - ctxt->generation_to_incorporate;
+}
+
 /*
  * Must hold write lock on insert_lock
  */
@@ -255,11 +418,6 @@ memtable_unlock_incorporation_lock(memtable_context *ctxt)
    platform_spin_unlock(&ctxt->incorporation_lock);
 }
 
-static inline void
-memtable_zap(cache *cc, memtable *mt)
-{
-   btree_dec_ref(cc, mt->cfg, mt->root_addr, PAGE_TYPE_MEMTABLE);
-}
 
 static inline bool
 memtable_ok_to_lookup(memtable *mt)
@@ -278,22 +436,24 @@ memtable_ok_to_lookup_compacted(memtable *mt)
 bool
 memtable_is_empty(memtable_context *mt_ctxt);
 
-static inline bool
-memtable_verify(cache *cc, memtable *mt)
+/*
+ * Root of an unsharded btree memtable.
+ */
+static inline uint64
+memtable_root_addr(memtable *mt)
 {
-   return btree_verify_tree(cc, mt->cfg, mt->root_addr, PAGE_TYPE_MEMTABLE);
+   debug_assert(mt->type == MEMTABLE_TYPE_BTREE);
+   debug_assert(mt->num_shards == 1);
+   return mt->shard[0].root_addr;
 }
 
-static inline void
-memtable_print(platform_log_handle *log_handle, cache *cc, memtable *mt)
-{
-   btree_print_tree(log_handle, cc, mt->cfg, mt->root_addr);
-}
+bool
+memtable_verify(cache *cc, memtable *mt);
 
-static inline void
-memtable_print_stats(platform_log_handle *log_handle, cache *cc, memtable *mt)
-{
-   btree_print_tree_stats(log_handle, cc, mt->cfg, mt->root_addr);
-};
+void
+memtable_print(platform_log_handle *log_handle, cache *cc, memtable *mt);
+
+void
+memtable_print_stats(platform_log_handle *log_handle, cache *cc, memtable *mt);
 
 #endif // __MEMTABLE_H
@@ -26,28 +26,74 @@ merge_at_end(iterator *itor, bool *at_end);
 platform_status
 merge_advance(iterator *itor);
 
+static platform_status
+merge_seek(iterator *itor, key target);
+
+static platform_status
+merge_prev_key(iterator *itor, key target, key_buffer *prev, bool *found);
+
 static iterator_ops merge_ops = {
    .get_curr = merge_get_curr,
    .at_end   = merge_at_end,
    .advance  = merge_advance,
+   .seek     = merge_seek,
+   .prev_key = merge_prev_key,
 };
 
 /*
- * bsearch which returns insertion position
- *
- * *(prev|next)_equal is set to TRUE if we compared to previous(next) index and
- * first attempt comparison matched
- **/
+ * Compares keys in the order the merge iterator emits them, which is
+ * descending for reverse merge iterators.
+ */
+static inline int
+merge_key_compare(const merge_iterator *merge_itor, key key1, key key2)
+{
+   int cmp = data_key_compare(merge_itor->cfg, key1, key2);
+   return merge_itor->reverse ? -cmp : cmp;
+}
+
+/*
+ * Returns the first 8 bytes of k as a big-endian integer, padded with zeroes.
+ * When the key order is lexicographic, keys whose prefixes differ are ordered
+ * as their prefixes are.
+ */
+static inline uint64
+merge_key_prefix(key k)
+{
+   const uint8 *data   = key_data(k);
+   uint64       length = key_length(k);
+   uint64       prefix = 0;
+   for (uint64 i = 0; i < sizeof(prefix); i++) {
+      prefix = (prefix << 8) | (i < length ? data[i] : 0);
+   }
+   return prefix;
+}
 
-/* Comparison function for bsearch of the min ritor array */
+/*
+ * Compares two inputs in merge order: by key, then newest (highest seq)
+ * first, with the inputs at end after all others. Sets *keys_equal if both
+ * have the same key.
+ */
 static inline int
-bsearch_comp(const ordered_iterator *itor_one,
-             const ordered_iterator *itor_two,
-             const data_config      *cfg,
-             bool                   *keys_equal)
+merge_ordered_compare(const merge_iterator   *merge_itor,
+                      const ordered_iterator *itor_one,
+                      const ordered_iterator *itor_two,
+                      bool                   *keys_equal)
 {
-   int cmp     = data_key_compare(cfg, itor_one->curr_key, itor_two->curr_key);
-   *keys_equal = (cmp == 0);
+   int cmp;
+   if (UNLIKELY(itor_one->at_end || itor_two->at_end)) {
+      *keys_equal = FALSE;
+      cmp         = (int)itor_one->at_end - (int)itor_two->at_end;
+   } else if (merge_itor->cache_prefixes
+              && itor_one->key_prefix != itor_two->key_prefix)
+   {
+      *keys_equal = FALSE;
+      cmp         = itor_one->key_prefix < itor_two->key_prefix ? -1 : 1;
+      cmp         = merge_itor->reverse ? -cmp : cmp;
+   } else {
+      cmp =
+         merge_key_compare(merge_itor, itor_one->curr_key, itor_two->curr_key);
+      *keys_equal = (cmp == 0);
+   }
    if (cmp == 0) {
       cmp = itor_two->seq - itor_one->seq;
    }
@@ -57,58 +103,21 @@ bsearch_comp(const ordered_iterator *itor_one,
    return cmp;
 }
 
-/* Comparison function for sort of the min ritor array */
-static int
-merge_comp(const void *one, const void *two, void *ctxt)
-{
-   const ordered_iterator *itor_one = *(ordered_iterator **)one;
-   const ordered_iterator *itor_two = *(ordered_iterator **)two;
-   data_config            *cfg      = (data_config *)ctxt;
-   bool                    ignore_keys_equal;
-   return bsearch_comp(itor_one, itor_two, cfg, &ignore_keys_equal);
-}
-
-// Returns index (from base0) where key belongs
-static inline int
-bsearch_insert(register const ordered_iterator *key,
-               ordered_iterator               **base0,
-               const size_t                     nmemb,
-               const data_config               *cfg,
-               bool                            *prev_equal_out,
-               bool                            *next_equal_out)
-{
-   register ordered_iterator **base = base0;
-   register int                lim, cmp;
-   register ordered_iterator **p;
-   bool                        prev_equal = FALSE;
-   bool                        next_equal = FALSE;
-
-
-   for (lim = nmemb; lim != 0; lim >>= 1) {
-      p = base + (lim >> 1);
-      bool keys_equal;
-      cmp = bsearch_comp(key, *p, cfg, &keys_equal);
-      debug_assert(cmp != 0);
-
-      if (cmp > 0) { /* key > p: move right */
-         base = p + 1;
-         lim--;
-         // We can skip the redundant cmp > 0 check here:
-         prev_equal |= keys_equal;
-      } /* else move left */
-      next_equal |= (cmp < 0) & keys_equal;
-   }
-   p -= (cmp < 0);
-   *prev_equal_out = prev_equal;
-   *next_equal_out = next_equal;
-   return p - base0;
-}
-
 static inline void
-set_curr_ordered_iterator(const data_config *cfg, ordered_iterator *itor)
+set_curr_ordered_iterator(const merge_iterator *merge_itor,
+                          ordered_iterator     *itor)
 {
    iterator_get_curr(itor->itor, &itor->curr_key, &itor->curr_data);
    debug_assert(key_is_user_key(itor->curr_key));
+   if (merge_itor->cache_prefixes) {
+      itor->key_prefix = merge_key_prefix(itor->curr_key);
+   }
+}
+
+static inline ordered_iterator *
+merge_winner(merge_iterator *merge_itor)
+{
+   return &merge_itor->ordered_iterator_stored[merge_itor->loser[0]];
 }
 
 static inline void
@@ -123,123 +132,192 @@ debug_assert_message_type_valid(debug_only merge_iterator *merge_itor)
 #endif
 }
 
+/*
+ * Sets winner_next_equal from the matches on the path of the winner, which
+ * are between the winner and the other input with the least key in each
+ * subtree, so one of them has the key of the winner if any input does. If
+ * the winner has won again, also keeps the runner-up, the least of them.
+ */
 static void
-debug_verify_sorted(debug_only merge_iterator *merge_itor,
-                    debug_only const int       index)
+merge_update_winner(merge_iterator *merge_itor, bool won_again)
 {
-#if SPLINTER_DEBUG
-   if (index < 0 || index + 1 >= merge_itor->num_remaining) {
-      return;
-   }
-   const int cmp =
-      data_key_compare(merge_itor->cfg,
-                       merge_itor->ordered_iterators[index]->curr_key,
-                       merge_itor->ordered_iterators[index + 1]->curr_key);
-   if (merge_itor->ordered_iterators[index]->next_key_equal) {
-      debug_assert(cmp == 0);
-   } else {
-      debug_assert(cmp < 0);
+   ordered_iterator *stored         = merge_itor->ordered_iterator_stored;
+   uint16            winner         = merge_itor->loser[0];
+   bool              equal          = FALSE;
+   uint16            runner_up      = 0;
+   bool              have_runner_up = FALSE;
+
+   for (int node = (merge_itor->num_trees + winner) / 2; node > 0; node /= 2)
+   {
+      uint16 loser = merge_itor->loser[node];
+      equal |= merge_itor->keys_equal[node];
+      if (won_again) {
+         bool ignore_keys_equal;
+         if (!have_runner_up
+             || merge_ordered_compare(merge_itor,
+                                      &stored[loser],
+                                      &stored[runner_up],
+                                      &ignore_keys_equal)
+                   < 0)
+         {
+            runner_up      = loser;
+            have_runner_up = TRUE;
+         }
+      }
+   }
+   merge_itor->winner_next_equal = equal;
+   merge_itor->have_runner_up    = have_runner_up;
+   if (have_runner_up) {
+      merge_itor->runner_up = runner_up;
    }
-#endif
 }
 
+/*
+ * Replays the matches on the path of input, whose key has changed, from its
+ * leaf up to the root.
+ */
+static void
+merge_replay(merge_iterator *merge_itor, uint16 input)
+{
+   ordered_iterator *stored = merge_itor->ordered_iterator_stored;
+   uint16            winner = input;
+   for (int node = (merge_itor->num_trees + input) / 2; node > 0; node /= 2) {
+      uint16 loser = merge_itor->loser[node];
+      bool   keys_equal;
+      if (merge_ordered_compare(
+             merge_itor, &stored[loser], &stored[winner], &keys_equal)
+          < 0)
+      {
+         merge_itor->loser[node] = winner;
+         winner                  = loser;
+      }
+      merge_itor->keys_equal[node] = keys_equal;
+   }
+   merge_itor->loser[0] = winner;
+   merge_update_winner(merge_itor, winner == input);
+}
+
+/*
+ * Plays all the matches of the loser tree, bottom up.
+ */
+static void
+merge_build_tree(merge_iterator *merge_itor)
+{
+   ordered_iterator *stored    = merge_itor->ordered_iterator_stored;
+   int               num_trees = merge_itor->num_trees;
+   uint16            winner[MAX_MERGE_ARITY];
+
+   for (int node = num_trees - 1; node > 0; node--) {
+      int    left     = 2 * node;
+      int    right    = 2 * node + 1;
+      uint16 left_in  = left >= num_trees ? left - num_trees : winner[left];
+      uint16 right_in = right >= num_trees ? right - num_trees : winner[right];
+      bool   keys_equal;
+      if (merge_ordered_compare(
+             merge_itor, &stored[left_in], &stored[right_in], &keys_equal)
+          < 0)
+      {
+         winner[node]            = left_in;
+         merge_itor->loser[node] = right_in;
+      } else {
+         winner[node]            = right_in;
+         merge_itor->loser[node] = left_in;
+      }
+      merge_itor->keys_equal[node] = keys_equal;
+   }
+   merge_itor->loser[0] = num_trees > 1 ? winner[1] : 0;
+   merge_update_winner(merge_itor, FALSE);
+}
+
+/*
+ * Advances the winner and finds the new one.
+ */
 static inline platform_status
-advance_and_resort_min_ritor(merge_iterator *merge_itor)
+merge_advance_winner(merge_iterator *merge_itor)
 {
-   platform_status rc;
+   platform_status   rc;
+   uint16            input = merge_itor->loser[0];
+   ordered_iterator *itor  = &merge_itor->ordered_iterator_stored[input];
 
-   debug_assert(!key_equals(merge_itor->curr_key,
-                            merge_itor->ordered_iterators[0]->curr_key));
+   debug_assert(!key_equals(merge_itor->curr_key, itor->curr_key));
 
-   merge_itor->ordered_iterators[0]->next_key_equal = FALSE;
-   merge_itor->ordered_iterators[0]->curr_key       = NULL_KEY;
-   merge_itor->ordered_iterators[0]->curr_data      = NULL_MESSAGE;
-   rc = iterator_advance(merge_itor->ordered_iterators[0]->itor);
+   itor->curr_key  = NULL_KEY;
+   itor->curr_data = NULL_MESSAGE;
+   rc              = iterator_advance(itor->itor);
    if (!SUCCESS(rc)) {
       return rc;
    }
 
    bool at_end;
-   // if it's exhausted, kill it and move the ritors up the queue.
-   rc = iterator_at_end(merge_itor->ordered_iterators[0]->itor, &at_end);
+   rc = iterator_at_end(itor->itor, &at_end);
    if (!SUCCESS(rc)) {
       return rc;
    }
 
    if (UNLIKELY(at_end)) {
+      itor->at_end = TRUE;
       merge_itor->num_remaining--;
-      ordered_iterator *tmp = merge_itor->ordered_iterators[0];
-      for (int i = 0; i < merge_itor->num_remaining; ++i) {
-         merge_itor->ordered_iterators[i] =
-            merge_itor->ordered_iterators[i + 1];
+   } else {
+      // Pull out key and data (now that we know we aren't at end)
+      set_curr_ordered_iterator(merge_itor, itor);
+      if (merge_itor->have_runner_up) {
+         ordered_iterator *runner_up =
+            &merge_itor->ordered_iterator_stored[merge_itor->runner_up];
+         bool keys_equal;
+         if (merge_ordered_compare(merge_itor, itor, runner_up, &keys_equal)
+                < 0
+             && !keys_equal)
+         {
+            // still ahead of every other input, so no match changes
+            merge_itor->winner_next_equal = FALSE;
+            return STATUS_OK;
+         }
       }
-      merge_itor->ordered_iterators[merge_itor->num_remaining] = tmp;
-      goto out;
-   }
-
-   // Pull out key and data (now that we know we aren't at end)
-   set_curr_ordered_iterator(merge_itor->cfg, merge_itor->ordered_iterators[0]);
-   if (merge_itor->num_remaining == 1) {
-      goto out;
-   }
-
-   bool prev_equal;
-   bool next_equal;
-   // otherwise, find its position in the array
-   // Add 1 to return value since it gives offset from [1]
-   int index = 1
-               + bsearch_insert(*merge_itor->ordered_iterators,
-                                merge_itor->ordered_iterators + 1,
-                                merge_itor->num_remaining - 1,
-                                merge_itor->cfg,
-                                &prev_equal,
-                                &next_equal);
-   debug_assert(index >= 0);
-   debug_assert(index < merge_itor->num_remaining);
-
-   if (index != 0) {
-      ordered_iterator *old_min_itor = merge_itor->ordered_iterators[0];
-      memmove(&merge_itor->ordered_iterators[0],
-              &merge_itor->ordered_iterators[1],
-              index * sizeof(ordered_iterator *));
-      // move the other pointers to make room
-      // for (int i = 0; i < index; ++i) {
-      //   merge_itor->ordered_iterators[i] =
-      //      merge_itor->ordered_iterators[i + 1];
-      //}
-      merge_itor->ordered_iterators[index] = old_min_itor;
-   }
-   // This may access index -1 but that's fine.  See
-   // ordered_iterator_stored_pad and ordered_iterators_pad
-   merge_itor->ordered_iterators[index - 1]->next_key_equal = prev_equal;
-   merge_itor->ordered_iterators[index]->next_key_equal     = next_equal;
-
-   debug_verify_sorted(merge_itor, index - 1);
-   debug_verify_sorted(merge_itor, index);
+   }
 
-out:
+   merge_replay(merge_itor, input);
    return STATUS_OK;
 }
 
 /*
- * In the case where the two minimum iterators of the merge iterator have equal
- * keys, resolve_equal_keys will merge the data as necessary
+ * Returns the newest input, other than the winner, with the key of the
+ * winner. It lost to the winner on the path of the winner.
+ */
+static ordered_iterator *
+merge_next_equal(merge_iterator *merge_itor)
+{
+   ordered_iterator *stored = merge_itor->ordered_iterator_stored;
+   ordered_iterator *next   = NULL;
+   for (int node = (merge_itor->num_trees + merge_itor->loser[0]) / 2;
+        node > 0;
+        node /= 2)
+   {
+      ordered_iterator *loser = &stored[merge_itor->loser[node]];
+      if (merge_itor->keys_equal[node]
+          && (next == NULL || loser->seq > next->seq))
+      {
+         next = loser;
+      }
+   }
+   debug_assert(next != NULL);
+   return next;
+}
+
+/*
+ * In the case where the winner of the merge iterator has the same key as
+ * other inputs, resolve_equal_keys will merge the data as necessary
  */
 static platform_status
 merge_resolve_equal_keys(merge_iterator *merge_itor)
 {
-   debug_assert(merge_itor->ordered_iterators[0]->next_key_equal);
+   debug_assert(merge_itor->winner_next_equal);
    debug_assert(message_data(merge_itor->curr_data)
                 != merge_accumulator_data(&merge_itor->merge_buffer));
-   debug_assert(key_equals(merge_itor->curr_key,
-                           merge_itor->ordered_iterators[0]->curr_key));
+   debug_assert(
+      key_equals(merge_itor->curr_key, merge_winner(merge_itor)->curr_key));
 
    data_config *cfg = merge_itor->cfg;
 
-#if SPLINTER_DEBUG
-   ordered_iterator *expected_itor = merge_itor->ordered_iterators[1];
-#endif
-
    // there is more than one copy of the current key
    bool success = merge_accumulator_copy_message(&merge_itor->merge_buffer,
                                                  merge_itor->curr_data);
@@ -248,17 +326,14 @@ merge_resolve_equal_keys(merge_iterator *merge_itor)
    }
 
    do {
-      // Verify we don't fall off the end
-      debug_assert(merge_itor->num_remaining >= 2);
+      ordered_iterator *next_itor = merge_next_equal(merge_itor);
       // Verify keys match
       debug_assert(
-         !data_key_compare(cfg,
-                           merge_itor->curr_key,
-                           merge_itor->ordered_iterators[1]->curr_key));
+         !data_key_compare(cfg, merge_itor->curr_key, next_itor->curr_key));
 
       if (data_merge_tuples(cfg,
                             merge_itor->curr_key,
-                            merge_itor->ordered_iterators[1]->curr_data,
+                            next_itor->curr_data,
                             &merge_itor->merge_buffer))
       {
          return STATUS_NO_MEMORY;
@@ -266,27 +341,21 @@ merge_resolve_equal_keys(merge_iterator *merge_itor)
 
       /*
        * Need to maintain invariant that merge_itor->curr_key points to a valid
-       * page; this means that this pointer must be updated before the 0th
-       * iterator is advanced
+       * page; this means that this pointer must be updated before the winner
+       * is advanced
        */
-      merge_itor->curr_key = merge_itor->ordered_iterators[1]->curr_key;
+      merge_itor->curr_key = next_itor->curr_key;
       debug_assert(key_is_user_key(merge_itor->curr_key));
-      platform_status rc = advance_and_resort_min_ritor(merge_itor);
+      platform_status rc = merge_advance_winner(merge_itor);
       if (!SUCCESS(rc)) {
          return rc;
       }
-#if SPLINTER_DEBUG
-      debug_assert(expected_itor == merge_itor->ordered_iterators[0]);
-      expected_itor = merge_itor->ordered_iterators[1];
-#endif
-   } while (merge_itor->ordered_iterators[0]->next_key_equal);
+      debug_assert(next_itor == merge_winner(merge_itor));
+   } while (merge_itor->winner_next_equal);
 
    merge_itor->curr_data =
       merge_accumulator_to_message(&merge_itor->merge_buffer);
 
-   // Dealt with all duplicates, now pointing to last copy.
-   debug_assert(!merge_itor->ordered_iterators[0]->next_key_equal);
-
    return STATUS_OK;
 }
 
@@ -345,10 +414,11 @@ advance_one_loop(merge_iterator *merge_itor, bool *retry)
       return STATUS_OK;
    }
 
-   // set the next key/data from the min ritor
-   merge_itor->curr_key = merge_itor->ordered_iterators[0]->curr_key;
+   // set the next key/data from the winner
+   ordered_iterator *winner = merge_winner(merge_itor);
+   merge_itor->curr_key     = winner->curr_key;
    debug_assert(key_is_user_key(merge_itor->curr_key));
-   merge_itor->curr_data = merge_itor->ordered_iterators[0]->curr_data;
+   merge_itor->curr_data = winner->curr_data;
    if (!merge_itor->merge_messages) {
       /*
        * We only have keys.  We COULD still merge (skip duplicates) the keys
@@ -359,7 +429,7 @@ advance_one_loop(merge_iterator *merge_itor, bool *retry)
    }
 
    platform_status rc;
-   if (merge_itor->ordered_iterators[0]->next_key_equal) {
+   if (merge_itor->winner_next_equal) {
       rc = merge_resolve_equal_keys(merge_itor);
       if (!SUCCESS(rc)) {
          return rc;
@@ -379,31 +449,73 @@ advance_one_loop(merge_iterator *merge_itor, bool *retry)
    return STATUS_OK;
 }
 
+/*
+ * Builds the loser tree over the input iterators, which may have been
+ * repositioned since the last call, and sets the current key and data from
+ * them.
+ */
+static platform_status
+merge_iterator_load(merge_iterator *merge_itor)
+{
+   platform_status rc;
+
+   merge_itor->at_end        = FALSE;
+   merge_itor->curr_key      = NULL_KEY;
+   merge_itor->curr_data     = NULL_MESSAGE;
+   merge_itor->num_remaining = 0;
+   for (int i = 0; i < merge_itor->num_trees; i++) {
+      ordered_iterator *itor = &merge_itor->ordered_iterator_stored[i];
+      itor->curr_key         = NULL_KEY;
+      itor->curr_data        = NULL_MESSAGE;
+      rc                     = iterator_at_end(itor->itor, &itor->at_end);
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+      if (!itor->at_end) {
+         set_curr_ordered_iterator(merge_itor, itor);
+         merge_itor->num_remaining++;
+      }
+   }
+   merge_build_tree(merge_itor);
+
+   bool retry;
+   rc = advance_one_loop(merge_itor, &retry);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+
+   if (retry) {
+      rc = merge_advance((iterator *)merge_itor);
+   }
+   return rc;
+}
+
 /*
  *-----------------------------------------------------------------------------
- * merge_iterator_create --
+ * merge_iterator_create_internal --
  *
  *      Initialize a merge iterator for a forest of B-trees.
  *
  *      Prerequisite:
- *         All input iterators must be homogeneous for data_type
+ *         All input iterators must be homogeneous for data_type, and must
+ *         return their keys in descending order if reverse is TRUE.
  *
  * Results:
  *      0 if successful, error otherwise
  *-----------------------------------------------------------------------------
  */
-platform_status
-merge_iterator_create(platform_heap_id hid,
-                      data_config     *cfg,
-                      int              num_trees,
-                      iterator       **itor_arr,
-                      merge_behavior   merge_mode,
-                      merge_iterator **out_itor)
+static platform_status
+merge_iterator_create_internal(platform_heap_id hid,
+                               data_config     *cfg,
+                               int              num_trees,
+                               iterator       **itor_arr,
+                               merge_behavior   merge_mode,
+                               bool             reverse,
+                               merge_iterator **out_itor)
 {
-   int               i;
-   platform_status   rc = STATUS_OK, merge_iterator_rc;
-   merge_iterator   *merge_itor;
-   ordered_iterator *temp;
+   int             i;
+   platform_status rc = STATUS_OK, merge_iterator_rc;
+   merge_iterator *merge_itor;
 
    if (!out_itor || !itor_arr || !cfg || num_trees < 0
        || num_trees >= ARRAY_SIZE(merge_itor->ordered_iterator_stored))
@@ -418,8 +530,9 @@ merge_iterator_create(platform_heap_id hid,
    }
 
    _Static_assert(ARRAY_SIZE(merge_itor->ordered_iterator_stored)
-                     == ARRAY_SIZE(merge_itor->ordered_iterators),
+                     == ARRAY_SIZE(merge_itor->loser),
                   "size mismatch");
+   _Static_assert(MAX_MERGE_ARITY <= UINT16_MAX + 1, "loser tree overflow");
 
    merge_itor = TYPED_ZALLOC(hid, merge_itor);
    if (merge_itor == NULL) {
@@ -428,7 +541,9 @@ merge_iterator_create(platform_heap_id hid,
    merge_accumulator_init(&merge_itor->merge_buffer, hid);
 
    merge_itor->super.ops = &merge_ops;
+   merge_itor->heap_id   = hid;
    merge_itor->num_trees = num_trees;
+   merge_itor->reverse   = reverse;
 
    debug_assert(merge_mode == MERGE_RAW || merge_mode == MERGE_INTERMEDIATE
                 || merge_mode == MERGE_FULL);
@@ -436,68 +551,24 @@ merge_iterator_create(platform_heap_id hid,
    merge_itor->finalize_updates = merge_mode == MERGE_FULL;
    merge_itor->emit_deletes     = merge_mode != MERGE_FULL;
 
+   merge_itor->cache_prefixes = data_key_compare_is_lexicographic(cfg);
+
    merge_itor->at_end   = FALSE;
    merge_itor->cfg      = cfg;
    merge_itor->curr_key = NULL_KEY;
 
-   // index -1 initializes the pad variable
-   for (i = -1; i < num_trees; i++) {
+   for (i = 0; i < num_trees; i++) {
       merge_itor->ordered_iterator_stored[i] = (ordered_iterator){
-         .seq            = i,
-         .itor           = i == -1 ? NULL : itor_arr[i],
-         .curr_key       = NULL_KEY,
-         .curr_data      = NULL_MESSAGE,
-         .next_key_equal = FALSE,
+         .seq       = i,
+         .itor      = itor_arr[i],
+         .curr_key  = NULL_KEY,
+         .curr_data = NULL_MESSAGE,
       };
-      merge_itor->ordered_iterators[i] =
-         &merge_itor->ordered_iterator_stored[i];
    }
 
-   // Move all the dead iterators to the end and count how many are still alive.
-   merge_itor->num_remaining = num_trees;
-   i                         = 0;
-   while (i < merge_itor->num_remaining) {
-      bool at_end;
-      rc = iterator_at_end(merge_itor->ordered_iterators[i]->itor, &at_end);
-      if (!SUCCESS(rc)) {
-         goto destroy;
-      }
-      if (at_end) {
-         ordered_iterator *tmp =
-            merge_itor->ordered_iterators[merge_itor->num_remaining - 1];
-         merge_itor->ordered_iterators[merge_itor->num_remaining - 1] =
-            merge_itor->ordered_iterators[i];
-         merge_itor->ordered_iterators[i] = tmp;
-         merge_itor->num_remaining--;
-      } else {
-         set_curr_ordered_iterator(cfg, merge_itor->ordered_iterators[i]);
-         i++;
-      }
-   }
-   platform_sort_slow(merge_itor->ordered_iterators,
-                      merge_itor->num_remaining,
-                      sizeof(*merge_itor->ordered_iterators),
-                      merge_comp,
-                      merge_itor->cfg,
-                      &temp);
-   // Generate initial value for next_key_equal bits
-   for (i = 0; i + 1 < merge_itor->num_remaining; ++i) {
-      int cmp =
-         data_key_compare(merge_itor->cfg,
-                          merge_itor->ordered_iterators[i]->curr_key,
-                          merge_itor->ordered_iterators[i + 1]->curr_key);
-      debug_assert(cmp <= 0);
-      merge_itor->ordered_iterators[i]->next_key_equal = (cmp == 0);
-   }
-
-   bool retry;
-   rc = advance_one_loop(merge_itor, &retry);
+   rc = merge_iterator_load(merge_itor);
    if (!SUCCESS(rc)) {
-      goto out;
-   }
-
-   if (retry) {
-      rc = merge_advance((iterator *)merge_itor);
+      goto destroy;
    }
 
    goto out;
@@ -525,6 +596,34 @@ out:
    return rc;
 }
 
+platform_status
+merge_iterator_create(platform_heap_id hid,
+                      data_config     *cfg,
+                      int              num_trees,
+                      iterator       **itor_arr,
+                      merge_behavior   merge_mode,
+                      merge_iterator **out_itor)
+{
+   return merge_iterator_create_internal(
+      hid, cfg, num_trees, itor_arr, merge_mode, FALSE, out_itor);
+}
+
+/*
+ * Creates a merge iterator which returns the merged keys of reverse input
+ * iterators in descending order.
+ */
+platform_status
+merge_iterator_create_reverse(platform_heap_id hid,
+                              data_config     *cfg,
+                              int              num_trees,
+                              iterator       **itor_arr,
+                              merge_behavior   merge_mode,
+                              merge_iterator **out_itor)
+{
+   return merge_iterator_create_internal(
+      hid, cfg, num_trees, itor_arr, merge_mode, TRUE, out_itor);
+}
+
 
 /*
  *-----------------------------------------------------------------------------
@@ -611,7 +710,7 @@ merge_advance(iterator *itor)
       merge_itor->curr_key  = NULL_KEY;
       merge_itor->curr_data = NULL_MESSAGE;
       // Advance one iterator
-      rc = advance_and_resort_min_ritor(merge_itor);
+      rc = merge_advance_winner(merge_itor);
       if (!SUCCESS(rc)) {
          return rc;
       }
@@ -625,6 +724,76 @@ merge_advance(iterator *itor)
    return STATUS_OK;
 }
 
+/*
+ *-----------------------------------------------------------------------------
+ * merge_seek --
+ *
+ *      Repositions all the input iterators at the first key >= target, or
+ *      at the largest key < target if they are reverse iterators, and
+ *      re-sorts them, reusing the merge iterator.
+ *
+ * Results:
+ *      0 if successful, error otherwise
+ *-----------------------------------------------------------------------------
+ */
+static platform_status
+merge_seek(iterator *itor, key target)
+{
+   merge_iterator *merge_itor = (merge_iterator *)itor;
+   for (int i = 0; i < merge_itor->num_trees; i++) {
+      platform_status rc =
+         iterator_seek(merge_itor->ordered_iterator_stored[i].itor, target);
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+   }
+   return merge_iterator_load(merge_itor);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * merge_prev_key --
+ *
+ *      Finds the largest key < target in any of the input iterators. The
+ *      merged messages of that key may still be a delete.
+ *
+ * Results:
+ *      0 if successful, error otherwise
+ *-----------------------------------------------------------------------------
+ */
+static platform_status
+merge_prev_key(iterator *itor, key target, key_buffer *prev, bool *found)
+{
+   merge_iterator *merge_itor = (merge_iterator *)itor;
+   DECLARE_AUTO_KEY_BUFFER(input_prev, merge_itor->heap_id);
+   *found = FALSE;
+   for (int i = 0; i < merge_itor->num_trees; i++) {
+      bool            input_found;
+      platform_status rc =
+         iterator_prev_key(merge_itor->ordered_iterator_stored[i].itor,
+                           target,
+                           &input_prev,
+                           &input_found);
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+      if (input_found
+          && (!*found
+              || data_key_compare(merge_itor->cfg,
+                                  key_buffer_key(&input_prev),
+                                  key_buffer_key(prev))
+                    > 0))
+      {
+         rc = key_buffer_copy_key(prev, key_buffer_key(&input_prev));
+         if (!SUCCESS(rc)) {
+            return rc;
+         }
+         *found = TRUE;
+      }
+   }
+   return STATUS_OK;
+}
+
 void
 merge_iterator_print(merge_iterator *merge_itor)
 {
@@ -642,20 +811,14 @@ merge_iterator_print(merge_iterator *merge_itor)
    platform_default_log("** curr: %s\n", key_string(data_cfg, curr_key));
    platform_default_log("----------------------------------------\n");
    for (i = 0; i < merge_itor->num_trees; i++) {
-      bool at_end;
-      iterator_at_end(merge_itor->ordered_iterators[i]->itor, &at_end);
-      platform_default_log("%u: ", merge_itor->ordered_iterators[i]->seq);
-      if (at_end) {
-         platform_default_log("# : ");
+      ordered_iterator *itor = &merge_itor->ordered_iterator_stored[i];
+      platform_default_log("%u: ", itor->seq);
+      if (itor->at_end) {
+         platform_default_log("# : \n");
       } else {
-         platform_default_log("_ : ");
-      }
-      if (i < merge_itor->num_remaining) {
-         iterator_get_curr(
-            merge_itor->ordered_iterators[i]->itor, &curr_key, &data);
+         platform_default_log("%s: ", i == merge_itor->loser[0] ? "*" : "_");
+         iterator_get_curr(itor->itor, &curr_key, &data);
          platform_default_log("%s\n", key_string(data_cfg, curr_key));
-      } else {
-         platform_default_log("\n");
       }
    }
    platform_default_log("\n");
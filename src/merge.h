@@ -20,9 +20,10 @@
 typedef struct ordered_iterator {
    iterator *itor;
    int       seq;
+   bool      at_end;
+   uint64    key_prefix; // leading bytes of curr_key, see merge_key_prefix
    key       curr_key;
    message   curr_data;
-   bool      next_key_equal;
 } ordered_iterator;
 
 /*
@@ -57,25 +58,40 @@ extern struct merge_behavior   merge_full, merge_intermediate, merge_raw;
 #define MERGE_FULL         (&merge_full)
 
 
+/*
+ * The inputs are merged through a loser tree: node i has children 2i and
+ * 2i + 1, and the leaf of input j is node num_trees + j. loser[i] is the
+ * input which lost the match at node i, between the least inputs of its two
+ * subtrees, and keys_equal[i] is whether their keys were equal. loser[0] is
+ * the winner, the input with the least key, so advancing it replays only the
+ * matches on its path, with no reordering of the other inputs.
+ *
+ * While the winner keeps winning, the runner-up, the next input in order, is
+ * kept, and the winner advances with a single compare against it as long as
+ * its keys stay below the runner-up's.
+ */
 typedef struct merge_iterator {
-   iterator     super;     // handle for iterator.h API
-   int          num_trees; // number of trees in the forest
-   bool         merge_messages;
-   bool         finalize_updates;
-   bool         emit_deletes;
-   bool         at_end;
-   int          num_remaining; // number of ritors not at end
-   data_config *cfg;           // point message tree data config
-   key          curr_key;      // current key
-   message      curr_data;     // current data
-
-   // Padding so ordered_iterators[-1] is valid
-   ordered_iterator ordered_iterator_stored_pad;
+   iterator         super;     // handle for iterator.h API
+   platform_heap_id heap_id;
+   int              num_trees; // number of trees in the forest
+   bool             reverse;   // keys are returned in descending order
+   bool             merge_messages;
+   bool             finalize_updates;
+   bool             emit_deletes;
+   bool             cache_prefixes; // compare key_prefix before the keys
+   bool             at_end;
+   int              num_remaining; // number of ritors not at end
+   data_config     *cfg;           // point message tree data config
+   key              curr_key;      // current key
+   message          curr_data;     // current data
+
    ordered_iterator ordered_iterator_stored[MAX_MERGE_ARITY];
-   // Padding so ordered_iterator_ptr_arr[-1] is valid
-   // Must be immediately before ordered_iterator_ptr_arr
-   ordered_iterator *ordered_iterators_pad;
-   ordered_iterator *ordered_iterators[MAX_MERGE_ARITY];
+
+   uint16 loser[MAX_MERGE_ARITY];
+   bool   keys_equal[MAX_MERGE_ARITY];
+   bool   winner_next_equal; // another input has the key of the winner
+   bool   have_runner_up;
+   uint16 runner_up;
 
    // Stats
    uint64 discarded_deletes;
@@ -84,14 +100,6 @@ typedef struct merge_iterator {
    merge_accumulator merge_buffer;
 } merge_iterator;
 
-// Statically enforce that the padding variables act as index -1 for both arrays
-_Static_assert(offsetof(merge_iterator, ordered_iterator_stored_pad)
-                  == offsetof(merge_iterator, ordered_iterator_stored[-1]),
-               "");
-_Static_assert(offsetof(merge_iterator, ordered_iterators_pad)
-                  == offsetof(merge_iterator, ordered_iterators[-1]),
-               "");
-
 platform_status
 merge_iterator_create(platform_heap_id hid,
                       data_config     *cfg,
@@ -100,6 +108,14 @@ merge_iterator_create(platform_heap_id hid,
                       merge_behavior   merge_mode,
                       merge_iterator **out_itor);
 
+platform_status
+merge_iterator_create_reverse(platform_heap_id hid,
+                              data_config     *cfg,
+                              int              num_trees,
+                              iterator       **itor_arr,
+                              merge_behavior   merge_mode,
+                              merge_iterator **out_itor);
+
 platform_status
 merge_iterator_destroy(platform_heap_id hid, merge_iterator **merge_itor);
 
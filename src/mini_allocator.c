@@ -225,12 +225,14 @@ mini_unget_unclaim_meta_page(cache *cc, page_handle *meta_page)
 
 /*
  * Allocate a new extent from the underlying extent allocator and
- * update our bookkeeping.
+ * update our bookkeeping. The extent is allocated near hint, the previous
+ * extent of the batch or of the meta pages, so that the extents of a
+ * mini allocator are laid out contiguously where there is room.
  */
 static platform_status
-mini_allocator_get_new_extent(mini_allocator *mini, uint64 *addr)
+mini_allocator_get_new_extent(mini_allocator *mini, uint64 hint, uint64 *addr)
 {
-   platform_status rc = allocator_alloc(mini->al, addr, mini->type);
+   platform_status rc = allocator_alloc_near(mini->al, hint, addr, mini->type);
    if (SUCCESS(rc)) {
       __sync_fetch_and_add(&mini->num_extents, 1);
    }
@@ -308,12 +310,14 @@ mini_init(mini_allocator *mini,
       mini->meta_tail = meta_tail;
    }
 
+   uint64 hint = meta_head;
    for (uint64 batch = 0; batch < num_batches; batch++) {
       // because we recover ref counts from the mini allocators on recovery, we
       // don't need to store these in the mini allocator until we consume them.
       platform_status rc =
-         mini_allocator_get_new_extent(mini, &mini->next_extent[batch]);
+         mini_allocator_get_new_extent(mini, hint, &mini->next_extent[batch]);
       platform_assert_status_ok(rc);
+      hint = mini->next_extent[batch];
    }
 
    return mini->next_extent[0];
@@ -519,8 +523,8 @@ mini_append_entry(mini_allocator *mini,
       uint64 new_meta_tail = mini->meta_tail + cache_page_size(mini->cc);
       if (new_meta_tail % cache_extent_size(mini->cc) == 0) {
          // need to allocate the next meta extent
-         platform_status rc =
-            mini_allocator_get_new_extent(mini, &new_meta_tail);
+         platform_status rc = mini_allocator_get_new_extent(
+            mini, mini->meta_tail, &new_meta_tail);
          platform_assert_status_ok(rc);
       }
 
@@ -584,8 +588,8 @@ mini_alloc(mini_allocator *mini,
       // need to allocate the next extent
 
       uint64          extent_addr = mini->next_extent[batch];
-      platform_status rc =
-         mini_allocator_get_new_extent(mini, &mini->next_extent[batch]);
+      platform_status rc = mini_allocator_get_new_extent(
+         mini, extent_addr, &mini->next_extent[batch]);
       platform_assert_status_ok(rc);
       next_addr = extent_addr;
 
@@ -775,6 +779,54 @@ mini_unkeyed_for_each(cache           *cc,
    } while (meta_addr != 0);
 }
 
+/*
+ *-----------------------------------------------------------------------------
+ * mini_unkeyed_for_each_extent --
+ *
+ *      Calls func on the base address of every extent the unkeyed mini
+ *      allocator holds: its data extents, its meta extents and the next
+ *      extents of its batches, which may be reported twice.
+ *
+ *      Allocations may continue during the call, in which case the extents
+ *      they add may be missed, but every extent held when the call was made
+ *      is reported.
+ *-----------------------------------------------------------------------------
+ */
+void
+mini_unkeyed_for_each_extent(mini_allocator *mini,
+                             mini_extent_fn  func,
+                             void           *arg)
+{
+   debug_assert(!mini->keyed);
+   cache *cc = mini->cc;
+
+   // before the meta pages, which a next extent may move to meanwhile
+   for (uint64 batch = 0; batch < mini->num_batches; batch++) {
+      func(arg, mini->next_extent[batch]);
+   }
+
+   uint64 meta_addr = mini->meta_head;
+   func(arg, cache_extent_base_addr(cc, meta_addr));
+   do {
+      page_handle *meta_page = cache_get(cc, meta_addr, TRUE, mini->type);
+
+      uint64              num_meta_entries = mini_num_entries(meta_page);
+      unkeyed_meta_entry *entry            = unkeyed_first_entry(meta_page);
+      for (uint64 i = 0; i < num_meta_entries; i++) {
+         func(arg, entry->extent_addr);
+         entry = unkeyed_next_entry(entry);
+      }
+      uint64 last_meta_addr = meta_addr;
+      meta_addr             = mini_get_next_meta_addr(meta_page);
+      cache_unget(cc, meta_page);
+
+      if (meta_addr != 0
+          && !cache_pages_share_extent(cc, last_meta_addr, meta_addr)) {
+         func(arg, cache_extent_base_addr(cc, meta_addr));
+      }
+   } while (meta_addr != 0);
+}
+
 /*
  * NOTE: The exact values of these enums is *** important *** to
  * interval_intersects_range(). See its implementation and comments.
@@ -75,6 +75,13 @@ mini_alloc(mini_allocator *mini,
            uint64         *next_extent);
 
 
+typedef void (*mini_extent_fn)(void *arg, uint64 base_addr);
+
+void
+mini_unkeyed_for_each_extent(mini_allocator *mini,
+                             mini_extent_fn  func,
+                             void           *arg);
+
 uint8
 mini_unkeyed_inc_ref(cache *cc, uint64 meta_head);
 uint8
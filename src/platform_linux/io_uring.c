@@ -0,0 +1,501 @@
+// Copyright 2018-2021 VMware, Inc.
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * io_uring.c --
+ *
+ *     This file contains an io_uring engine for the laio io_handle.
+ *
+ *     It shares the request pool, synchronous IO and request management with
+ *     laio.c and only replaces async submission and completion reaping.
+ *     The ring is driven through the raw system calls, so it does not depend
+ *     on liburing.
+ *
+ *     - The device fd is registered, so submissions skip the fd lookup.
+ *     - Memory registered with io_register_buffer (the clockcache pages) is
+ *       used for single page IOs via IORING_OP_{READ,WRITE}_FIXED, which
+ *       skips pinning the user pages on every request.
+ *     - Submitters append their SQE under a short spinlock and then submit
+ *       every SQE that is still pending, so concurrent requests share a
+ *       system call. With SQPOLL, a kernel thread picks up SQEs and no
+ *       system call is needed unless it went to sleep.
+ *     - Completions are reaped many at a time.
+ */
+
+#define POISON_FROM_PLATFORM_IMPLEMENTATION
+#include "platform.h"
+
+#include "laio.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+
+// completions reaped per pass of laio_uring_cleanup
+#define LAIO_URING_REAP_BATCH 32
+
+// idle time before the SQPOLL thread sleeps
+#define LAIO_URING_SQPOLL_IDLE_MS 10
+
+// registered buffers are limited to 1GiB each
+#define LAIO_URING_BUFFER_SHIFT 30
+#define LAIO_URING_MAX_BUFFERS  1024
+
+struct laio_uring {
+   int  ring_fd;
+   bool sqpoll;
+
+   // submission queue
+   platform_spinlock    sq_lock;
+   uint32              *sq_head;
+   uint32              *sq_tail;
+   uint32              *sq_mask;
+   uint32              *sq_entries;
+   uint32              *sq_flags;
+   uint32              *sq_array;
+   struct io_uring_sqe *sqes;
+
+   // completion queue
+   bool                 cq_lock;
+   uint32              *cq_head;
+   uint32              *cq_tail;
+   uint32              *cq_mask;
+   struct io_uring_cqe *cqes;
+
+   void  *sq_ring;
+   uint64 sq_ring_size;
+   void  *cq_ring;
+   uint64 cq_ring_size;
+   uint64 sqes_size;
+
+   // memory registered for fixed-buffer IO, see laio_uring_register_buffer
+   char  *buf_base;
+   uint64 buf_len;
+};
+
+platform_status
+laio_uring_read_async(io_handle     *ioh,
+                      io_async_req  *req,
+                      io_callback_fn callback,
+                      uint64         count,
+                      uint64         addr);
+platform_status
+laio_uring_write_async(io_handle     *ioh,
+                       io_async_req  *req,
+                       io_callback_fn callback,
+                       uint64         count,
+                       uint64         addr);
+void
+laio_uring_cleanup(io_handle *ioh, uint64 count);
+platform_status
+laio_uring_register_buffer(io_handle *ioh, void *addr, uint64 bytes);
+void
+laio_uring_unregister_buffer(io_handle *ioh);
+
+static io_ops laio_uring_ops = {
+   .read              = laio_read,
+   .write             = laio_write,
+   .get_iovec         = laio_get_iovec,
+   .get_async_req     = laio_get_async_req,
+   .get_metadata      = laio_get_metadata,
+   .read_async        = laio_uring_read_async,
+   .write_async       = laio_uring_write_async,
+   .cleanup           = laio_uring_cleanup,
+   .cleanup_all       = laio_cleanup_all,
+   .sync              = laio_sync,
+   .register_buffer   = laio_uring_register_buffer,
+   .unregister_buffer = laio_uring_unregister_buffer,
+};
+
+static inline int
+laio_uring_setup(uint32 entries, struct io_uring_params *params)
+{
+   return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int
+laio_uring_enter(int fd, uint32 to_submit, uint32 min_complete, uint32 flags)
+{
+   return syscall(
+      __NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline int
+laio_uring_register(int fd, uint32 opcode, void *arg, uint32 nr_args)
+{
+   return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * io_uring_available --
+ *
+ * Probes for io_uring support by setting up, and closing, a one entry ring.
+ */
+bool
+io_uring_available(void)
+{
+   struct io_uring_params params;
+   ZERO_CONTENTS(&params);
+   int ring_fd = laio_uring_setup(1, &params);
+   if (ring_fd < 0) {
+      return FALSE;
+   }
+   close(ring_fd);
+   return TRUE;
+}
+
+/*
+ * laio_uring_init --
+ *
+ * Sets up a ring large enough that the completion queue can hold every
+ * request in the pool, maps it and registers io->fd. On success, switches
+ * io to the io_uring ops. On failure, io is left untouched.
+ */
+platform_status
+laio_uring_init(laio_handle *io)
+{
+   struct io_uring_params params;
+   laio_uring            *ring;
+   uint32                 entries = 1;
+
+   while (entries < io->cfg->async_queue_size) {
+      entries *= 2;
+   }
+
+   ring = TYPED_ZALLOC(io->heap_id, ring);
+   if (ring == NULL) {
+      return STATUS_NO_MEMORY;
+   }
+
+   ZERO_CONTENTS(&params);
+   if (io->cfg->uring_sqpoll) {
+      params.flags |= IORING_SETUP_SQPOLL;
+      params.sq_thread_idle = LAIO_URING_SQPOLL_IDLE_MS;
+   }
+   ring->ring_fd = laio_uring_setup(entries, &params);
+   if (ring->ring_fd < 0 && io->cfg->uring_sqpoll) {
+      platform_error_log("io_uring SQPOLL setup failed: %s, "
+                         "continuing without SQPOLL\n",
+                         strerror(errno));
+      ZERO_CONTENTS(&params);
+      ring->ring_fd = laio_uring_setup(entries, &params);
+   }
+   if (ring->ring_fd < 0) {
+      platform_error_log("io_uring_setup failed: %s\n", strerror(errno));
+      platform_free(io->heap_id, ring);
+      return STATUS_IO_ERROR;
+   }
+   ring->sqpoll = (params.flags & IORING_SETUP_SQPOLL) != 0;
+
+   ring->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(uint32);
+   ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+   ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+   ring->sq_ring = mmap(NULL,
+                        ring->sq_ring_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        ring->ring_fd,
+                        IORING_OFF_SQ_RING);
+   ring->cq_ring = mmap(NULL,
+                        ring->cq_ring_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        ring->ring_fd,
+                        IORING_OFF_CQ_RING);
+   ring->sqes    = mmap(NULL,
+                        ring->sqes_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        ring->ring_fd,
+                        IORING_OFF_SQES);
+   if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED
+       || ring->sqes == MAP_FAILED)
+   {
+      platform_error_log("io_uring mmap failed: %s\n", strerror(errno));
+      goto unmap;
+   }
+
+   char *sq         = ring->sq_ring;
+   ring->sq_head    = (uint32 *)(sq + params.sq_off.head);
+   ring->sq_tail    = (uint32 *)(sq + params.sq_off.tail);
+   ring->sq_mask    = (uint32 *)(sq + params.sq_off.ring_mask);
+   ring->sq_entries = (uint32 *)(sq + params.sq_off.ring_entries);
+   ring->sq_flags   = (uint32 *)(sq + params.sq_off.flags);
+   ring->sq_array   = (uint32 *)(sq + params.sq_off.array);
+   char *cq         = ring->cq_ring;
+   ring->cq_head    = (uint32 *)(cq + params.cq_off.head);
+   ring->cq_tail    = (uint32 *)(cq + params.cq_off.tail);
+   ring->cq_mask    = (uint32 *)(cq + params.cq_off.ring_mask);
+   ring->cqes       = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+   if (laio_uring_register(ring->ring_fd, IORING_REGISTER_FILES, &io->fd, 1)
+       != 0)
+   {
+      platform_error_log("io_uring file registration failed: %s\n",
+                         strerror(errno));
+      goto unmap;
+   }
+
+   platform_status rc = platform_spinlock_init(
+      &ring->sq_lock, platform_get_module_id(), io->heap_id);
+   if (!SUCCESS(rc)) {
+      goto unmap;
+   }
+
+   io->uring     = ring;
+   io->super.ops = &laio_uring_ops;
+   return STATUS_OK;
+
+unmap:
+   if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+   }
+   if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED) {
+      munmap(ring->cq_ring, ring->cq_ring_size);
+   }
+   if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+      munmap(ring->sqes, ring->sqes_size);
+   }
+   close(ring->ring_fd);
+   platform_free(io->heap_id, ring);
+   return STATUS_IO_ERROR;
+}
+
+void
+laio_uring_deinit(laio_handle *io)
+{
+   laio_uring *ring = io->uring;
+
+   platform_spinlock_destroy(&ring->sq_lock);
+   munmap(ring->sq_ring, ring->sq_ring_size);
+   munmap(ring->cq_ring, ring->cq_ring_size);
+   munmap(ring->sqes, ring->sqes_size);
+   int status = close(ring->ring_fd);
+   if (status != 0) {
+      platform_error_log("close failed with error: %s\n", strerror(errno));
+   }
+   platform_assert(status == 0);
+   platform_free(io->heap_id, ring);
+   io->uring = NULL;
+}
+
+/*
+ * laio_uring_register_buffer --
+ *
+ * Registers [addr, addr + bytes) as fixed buffers, in 1GiB pieces. Only one
+ * range is registered at a time. Failure (e.g. RLIMIT_MEMLOCK) is not fatal,
+ * IO to the range just does not use the fixed-buffer opcodes.
+ */
+platform_status
+laio_uring_register_buffer(io_handle *ioh, void *addr, uint64 bytes)
+{
+   laio_handle *io   = (laio_handle *)ioh;
+   laio_uring  *ring = io->uring;
+   struct iovec iovecs[LAIO_URING_MAX_BUFFERS];
+   uint64       piece = 1ULL << LAIO_URING_BUFFER_SHIFT;
+   uint32       num_pieces;
+
+   if (ring->buf_base != NULL) {
+      return STATUS_BUSY;
+   }
+   num_pieces = (bytes + piece - 1) >> LAIO_URING_BUFFER_SHIFT;
+   if (num_pieces == 0 || num_pieces > LAIO_URING_MAX_BUFFERS) {
+      return STATUS_BAD_PARAM;
+   }
+   for (uint32 i = 0; i < num_pieces; i++) {
+      uint64 offset      = (uint64)i << LAIO_URING_BUFFER_SHIFT;
+      iovecs[i].iov_base = (char *)addr + offset;
+      iovecs[i].iov_len  = bytes - offset < piece ? bytes - offset : piece;
+   }
+   if (laio_uring_register(
+          ring->ring_fd, IORING_REGISTER_BUFFERS, iovecs, num_pieces)
+       != 0)
+   {
+      platform_error_log("io_uring buffer registration failed: %s, "
+                         "continuing without fixed buffers\n",
+                         strerror(errno));
+      return STATUS_IO_ERROR;
+   }
+   ring->buf_len = bytes;
+   __atomic_store_n(&ring->buf_base, (char *)addr, __ATOMIC_RELEASE);
+   return STATUS_OK;
+}
+
+void
+laio_uring_unregister_buffer(io_handle *ioh)
+{
+   laio_handle *io   = (laio_handle *)ioh;
+   laio_uring  *ring = io->uring;
+
+   if (ring->buf_base == NULL) {
+      return;
+   }
+   __atomic_store_n(&ring->buf_base, NULL, __ATOMIC_RELEASE);
+   laio_uring_register(ring->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+   ring->buf_len = 0;
+}
+
+/*
+ * Submits all SQEs which the kernel has not consumed yet, on behalf of every
+ * thread which queued one.
+ */
+static void
+laio_uring_submit(laio_uring *ring)
+{
+   if (ring->sqpoll) {
+      if (__atomic_load_n(ring->sq_flags, __ATOMIC_ACQUIRE)
+          & IORING_SQ_NEED_WAKEUP)
+      {
+         laio_uring_enter(ring->ring_fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+      }
+      return;
+   }
+   uint32 pending = __atomic_load_n(ring->sq_tail, __ATOMIC_ACQUIRE)
+                    - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+   if (pending == 0) {
+      return;
+   }
+   int status = laio_uring_enter(ring->ring_fd, pending, 0, 0);
+   if (status < 0 && errno != EAGAIN && errno != EBUSY && errno != EINTR) {
+      platform_error_log("io_uring_enter error %s\n", strerror(errno));
+   }
+}
+
+static platform_status
+laio_uring_queue(io_handle     *ioh,
+                 io_async_req  *req,
+                 io_callback_fn callback,
+                 uint64         count,
+                 uint64         addr,
+                 bool           is_write)
+{
+   laio_handle *io   = (laio_handle *)ioh;
+   laio_uring  *ring = io->uring;
+
+   req->callback = callback;
+   req->count    = count;
+
+   char *buf_base = __atomic_load_n(&ring->buf_base, __ATOMIC_ACQUIRE);
+   char *data     = req->iovec[0].iov_base;
+   bool  fixed    = count == 1 && buf_base != NULL && data >= buf_base
+                && data + req->iovec[0].iov_len <= buf_base + ring->buf_len;
+
+   while (1) {
+      platform_spin_lock(&ring->sq_lock);
+      uint32 tail = *ring->sq_tail;
+      uint32 head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+      if (tail - head < *ring->sq_entries) {
+         uint32               idx = tail & *ring->sq_mask;
+         struct io_uring_sqe *sqe = &ring->sqes[idx];
+         memset(sqe, 0, sizeof(*sqe));
+         sqe->flags     = IOSQE_FIXED_FILE;
+         sqe->fd        = 0;
+         sqe->off       = addr;
+         sqe->user_data = (uint64)req;
+         if (fixed) {
+            sqe->opcode =
+               is_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->addr      = (uint64)data;
+            sqe->len       = req->iovec[0].iov_len;
+            sqe->buf_index = (data - buf_base) >> LAIO_URING_BUFFER_SHIFT;
+         } else {
+            sqe->opcode = is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->addr   = (uint64)req->iovec;
+            sqe->len    = count;
+         }
+         ring->sq_array[idx] = idx;
+         __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+         platform_spin_unlock(&ring->sq_lock);
+         break;
+      }
+      platform_spin_unlock(&ring->sq_lock);
+      // the ring is full, push it along and make room
+      laio_uring_submit(ring);
+      io_cleanup(ioh, 0);
+   }
+
+   laio_uring_submit(ring);
+   return STATUS_OK;
+}
+
+platform_status
+laio_uring_read_async(io_handle     *ioh,
+                      io_async_req  *req,
+                      io_callback_fn callback,
+                      uint64         count,
+                      uint64         addr)
+{
+   return laio_uring_queue(ioh, req, callback, count, addr, FALSE);
+}
+
+platform_status
+laio_uring_write_async(io_handle     *ioh,
+                       io_async_req  *req,
+                       io_callback_fn callback,
+                       uint64         count,
+                       uint64         addr)
+{
+   return laio_uring_queue(ioh, req, callback, count, addr, TRUE);
+}
+
+/*
+ * laio_uring_cleanup --
+ *
+ * Reaps up to count completions (all available ones if count is 0),
+ * LAIO_URING_REAP_BATCH at a time. Callbacks run after the completion queue
+ * has been released, so they may issue more IO. If another thread is
+ * reaping, returns right away, since it will run the callbacks.
+ */
+void
+laio_uring_cleanup(io_handle *ioh, uint64 count)
+{
+   laio_handle  *io   = (laio_handle *)ioh;
+   laio_uring   *ring = io->uring;
+   io_async_req *reqs[LAIO_URING_REAP_BATCH];
+   int32         res[LAIO_URING_REAP_BATCH];
+   uint64        reaped = 0;
+
+   laio_uring_submit(ring);
+
+   while (count == 0 || reaped < count) {
+      if (__sync_lock_test_and_set(&ring->cq_lock, TRUE)) {
+         return;
+      }
+      uint32 head  = *ring->cq_head;
+      uint32 tail  = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+      uint32 batch = tail - head;
+      if (batch > LAIO_URING_REAP_BATCH) {
+         batch = LAIO_URING_REAP_BATCH;
+      }
+      if (count != 0 && batch > count - reaped) {
+         batch = count - reaped;
+      }
+      for (uint32 i = 0; i < batch; i++) {
+         struct io_uring_cqe *cqe = &ring->cqes[(head + i) & *ring->cq_mask];
+         reqs[i]                  = (io_async_req *)cqe->user_data;
+         res[i]                   = cqe->res;
+      }
+      __atomic_store_n(ring->cq_head, head + batch, __ATOMIC_RELEASE);
+      __sync_lock_release(&ring->cq_lock);
+
+      if (batch == 0) {
+         return;
+      }
+      for (uint32 i = 0; i < batch; i++) {
+         io_async_req   *req    = reqs[i];
+         platform_status status = STATUS_OK;
+         if (res[i] < 0) {
+            platform_error_log("io_uring request failed: %s\n",
+                               strerror(-res[i]));
+            status = STATUS_IO_ERROR;
+         }
+         req->callback(req->metadata, req->iovec, req->count, status);
+         req->busy = FALSE;
+      }
+      reaped += batch;
+   }
+}
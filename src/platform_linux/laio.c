@@ -19,6 +19,9 @@
 
 #define LAIO_HAND_BATCH_SIZE 32
 
+// completions reaped per io_getevents call
+#define LAIO_REAP_BATCH 32
+
 platform_status
 laio_read(io_handle *ioh, void *buf, uint64 bytes, uint64 addr);
 platform_status
@@ -45,6 +48,12 @@ void
 laio_cleanup(io_handle *ioh, uint64 count);
 void
 laio_cleanup_all(io_handle *ioh);
+platform_status
+laio_sync(io_handle *ioh);
+void
+laio_begin_batch(io_handle *ioh);
+void
+laio_flush_batch(io_handle *ioh);
 
 io_async_req *
 laio_get_kth_req(laio_handle *io, uint64 k);
@@ -59,6 +68,9 @@ static io_ops laio_ops = {
    .write_async   = laio_write_async,
    .cleanup       = laio_cleanup,
    .cleanup_all   = laio_cleanup_all,
+   .sync          = laio_sync,
+   .begin_batch   = laio_begin_batch,
+   .flush_batch   = laio_flush_batch,
 };
 
 /*
@@ -89,8 +101,6 @@ io_handle_init(laio_handle         *io,
    io->cfg       = cfg;
    io->heap_id   = hid;
 
-   status = io_setup(cfg->kernel_queue_size, &io->ctx);
-   platform_assert(status == 0);
    if (cfg->flags & O_CREAT) {
       io->fd = open(cfg->filename, cfg->flags, cfg->perms);
       fallocate(io->fd, 0, 0, 128 * 1024);
@@ -99,6 +109,17 @@ io_handle_init(laio_handle         *io,
    }
    platform_assert(io->fd != -1);
 
+   if (cfg->use_uring) {
+      rc = laio_uring_init(io);
+      if (!SUCCESS(rc)) {
+         platform_error_log("io_uring unavailable, falling back to libaio\n");
+      }
+   }
+   if (io->uring == NULL) {
+      status = io_setup(cfg->kernel_queue_size, &io->ctx);
+      platform_assert(status == 0);
+   }
+
    req_size =
       sizeof(io_async_req) + cfg->async_max_pages * sizeof(struct iovec);
    total_req_size = req_size * cfg->async_queue_size;
@@ -119,16 +140,26 @@ io_handle_init(laio_handle         *io,
    return STATUS_OK;
 }
 
+bool
+io_handle_uses_uring(laio_handle *io)
+{
+   return io->uring != NULL;
+}
+
 void
 io_handle_deinit(laio_handle *io)
 {
    int status;
 
-   status = io_destroy(io->ctx);
-   if (status != 0)
-      platform_error_log("io_destroy failed with error: %s\n",
-                         strerror(-status));
-   platform_assert(status == 0);
+   if (io->uring != NULL) {
+      laio_uring_deinit(io);
+   } else {
+      status = io_destroy(io->ctx);
+      if (status != 0)
+         platform_error_log("io_destroy failed with error: %s\n",
+                            strerror(-status));
+      platform_assert(status == 0);
+   }
 
    status = close(io->fd);
    if (status != 0) {
@@ -196,7 +227,7 @@ laio_get_async_req(io_handle *ioh, bool blocking)
          }
          io->req_hand[tid] = __sync_fetch_and_add(&io->req_hand_base, 32)
                              % io->cfg->async_queue_size;
-         laio_cleanup(ioh, 0);
+         io_cleanup(ioh, 0);
       }
       req = laio_get_kth_req(io, io->req_hand[tid]++);
       if (__sync_bool_compare_and_swap(&req->busy, FALSE, TRUE))
@@ -231,6 +262,65 @@ laio_callback(io_context_t ctx, struct iocb *iocb, long res, long res2)
    req->busy = FALSE;
 }
 
+/*
+ * Submits n iocbs, retrying until the kernel has accepted all of them.
+ */
+static void
+laio_submit(io_handle *ioh, struct iocb **iocbs, uint64 n)
+{
+   laio_handle *io        = (laio_handle *)ioh;
+   uint64       submitted = 0;
+   int          status;
+
+   while (submitted < n) {
+      status = io_submit(io->ctx, n - submitted, iocbs + submitted);
+      if (status < 0) {
+         platform_error_log("io_submit error %s\n", strerror(-status));
+      } else {
+         submitted += status;
+      }
+      if (submitted < n) {
+         io_cleanup(ioh, 0);
+      }
+   }
+}
+
+/*
+ * Submits the iocbs queued in the calling thread's batch, if any.
+ */
+static void
+laio_submit_batch(io_handle *ioh)
+{
+   laio_handle *io    = (laio_handle *)ioh;
+   laio_batch  *batch = &io->batch[platform_get_tid()];
+
+   if (batch->count != 0) {
+      uint64 count = batch->count;
+      batch->count = 0;
+      laio_submit(ioh, batch->iocbs, count);
+   }
+}
+
+/*
+ * Queues the request's iocb in the calling thread's batch, or submits it
+ * directly when no batch is open.
+ */
+static void
+laio_enqueue(io_handle *ioh, io_async_req *req)
+{
+   laio_handle *io    = (laio_handle *)ioh;
+   laio_batch  *batch = &io->batch[platform_get_tid()];
+
+   if (!batch->active) {
+      laio_submit(ioh, &req->iocb_p, 1);
+      return;
+   }
+   batch->iocbs[batch->count++] = req->iocb_p;
+   if (batch->count == LAIO_SUBMIT_BATCH_SIZE) {
+      laio_submit_batch(ioh);
+   }
+}
+
 platform_status
 laio_read_async(io_handle     *ioh,
                 io_async_req  *req,
@@ -239,20 +329,13 @@ laio_read_async(io_handle     *ioh,
                 uint64         addr)
 {
    laio_handle *io;
-   int          status;
 
    io = (laio_handle *)ioh;
    io_prep_preadv(&req->iocb, io->fd, req->iovec, count, addr);
    req->callback = callback;
    req->count    = count;
    io_set_callback(&req->iocb, laio_callback);
-   do {
-      status = io_submit(io->ctx, 1, &req->iocb_p);
-      if (status < 0) {
-         platform_error_log("io_submit error %s\n", strerror(-status));
-      }
-      io_cleanup(ioh, 0);
-   } while (status != 1);
+   laio_enqueue(ioh, req);
 
    return STATUS_OK;
 }
@@ -265,44 +348,69 @@ laio_write_async(io_handle     *ioh,
                  uint64         addr)
 {
    laio_handle *io;
-   int          status;
 
    io = (laio_handle *)ioh;
    io_prep_pwritev(&req->iocb, io->fd, req->iovec, count, addr);
    req->callback = callback;
    req->count    = count;
    io_set_callback(&req->iocb, laio_callback);
-   do {
-      status = io_submit(io->ctx, 1, &req->iocb_p);
-      if (status < 0) {
-         platform_error_log("io_submit error %s\n", strerror(-status));
-      }
-      io_cleanup(ioh, 0);
-   } while (status != 1);
+   laio_enqueue(ioh, req);
 
    return STATUS_OK;
 }
 
+void
+laio_begin_batch(io_handle *ioh)
+{
+   laio_handle *io = (laio_handle *)ioh;
+
+   io->batch[platform_get_tid()].active = TRUE;
+}
+
+void
+laio_flush_batch(io_handle *ioh)
+{
+   laio_handle *io = (laio_handle *)ioh;
+
+   laio_submit_batch(ioh);
+   io->batch[platform_get_tid()].active = FALSE;
+}
+
+/*
+ * laio_cleanup --
+ *
+ * Reaps up to count completions (all available ones if count is 0), up to
+ * LAIO_REAP_BATCH per io_getevents call. Submits the calling thread's
+ * queued batch first, since the caller may be waiting on it.
+ */
 void
 laio_cleanup(io_handle *ioh, uint64 count)
 {
    laio_handle    *io;
-   struct io_event event = {0};
-   uint64          i;
+   struct io_event events[LAIO_REAP_BATCH];
+   uint64          reaped = 0;
    int             status;
 
    io = (laio_handle *)ioh;
-   for (i = 0; ((count == 0) || (i < count)); i++) {
-      status = io_getevents(io->ctx, 0, 1, &event, NULL);
+   laio_submit_batch(ioh);
+   while (count == 0 || reaped < count) {
+      uint64 max_events = LAIO_REAP_BATCH;
+      if (count != 0 && count - reaped < max_events) {
+         max_events = count - reaped;
+      }
+      status = io_getevents(io->ctx, 0, max_events, events, NULL);
       if (status < 0) {
          platform_error_log("io_getevents failed with error: %s\n",
                             strerror(-status));
-         i--;
          continue;
       }
-      if (status == 0)
+      if (status == 0) {
          break;
-      laio_callback(io->ctx, event.obj, event.res, 0);
+      }
+      for (int i = 0; i < status; i++) {
+         laio_callback(io->ctx, events[i].obj, events[i].res, 0);
+      }
+      reaped += status;
    }
 }
 
@@ -321,6 +429,24 @@ laio_cleanup_all(io_handle *ioh)
    }
 }
 
+/*
+ * laio_sync --
+ *
+ * Flushes completed writes (but not unrelated file metadata) to the device.
+ */
+platform_status
+laio_sync(io_handle *ioh)
+{
+   laio_handle *io;
+
+   io = (laio_handle *)ioh;
+   if (fdatasync(io->fd) != 0) {
+      platform_error_log("fdatasync failed with error: %s\n", strerror(errno));
+      return STATUS_IO_ERROR;
+   }
+   return STATUS_OK;
+}
+
 static inline bool
 laio_config_valid_page_size(io_config *cfg)
 {
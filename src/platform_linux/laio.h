@@ -39,6 +39,21 @@ struct io_async_req {
    struct iovec   iovec[];      // vector with IO offsets and size
 };
 
+// io_uring engine state, see io_uring.c
+typedef struct laio_uring laio_uring;
+
+// max iocbs a thread queues between io_begin_batch and io_flush_batch
+#define LAIO_SUBMIT_BATCH_SIZE 32
+
+/*
+ * Per-thread submission batch, see io_begin_batch.
+ */
+typedef struct laio_batch {
+   bool         active;
+   uint64       count;
+   struct iocb *iocbs[LAIO_SUBMIT_BATCH_SIZE];
+} PLATFORM_CACHELINE_ALIGNED laio_batch;
+
 typedef struct laio_handle {
    io_handle        super;
    io_config       *cfg;
@@ -48,10 +63,36 @@ typedef struct laio_handle {
    uint64           max_batches_nonblocking_get;
    uint64           req_hand_base;
    uint64           req_hand[MAX_THREADS];
+   laio_batch       batch[MAX_THREADS];
    platform_heap_id heap_id;
+   laio_uring      *uring; // NULL unless the io_uring engine is in use
 } laio_handle;
 
 platform_status
 laio_config_valid(io_config *cfg);
 
+/*
+ * Operations shared by the libaio and io_uring engines.
+ */
+platform_status
+laio_read(io_handle *ioh, void *buf, uint64 bytes, uint64 addr);
+platform_status
+laio_write(io_handle *ioh, void *buf, uint64 bytes, uint64 addr);
+io_async_req *
+laio_get_async_req(io_handle *ioh, bool blocking);
+struct iovec *
+laio_get_iovec(io_handle *ioh, io_async_req *req);
+void *
+laio_get_metadata(io_handle *ioh, io_async_req *req);
+void
+laio_cleanup_all(io_handle *ioh);
+platform_status
+laio_sync(io_handle *ioh);
+
+platform_status
+laio_uring_init(laio_handle *io);
+
+void
+laio_uring_deinit(laio_handle *io);
+
 #endif //__LAIO_H
@@ -62,13 +62,15 @@
 #define ARRAY_SIZE(x) ASSERT_EXPR(IS_ARRAY(x), (sizeof(x) / sizeof((x)[0])))
 
 /*
- * MAX_THREADS is used primarily for convenience, where allocations made on a
- * per-thread basis create an array with MAX_THREADS items, e.g. the
- * trunk_stats field in trunk_handle. The task subsystem also uses a 64-bit
- * bit-array to track thread IDs in use. This could be changed relatively
- * easily if needed.
+ * MAX_THREADS is the upper bound on the number of concurrently registered
+ * threads. Per-thread state is indexed by thread ID; small per-thread state
+ * is kept in arrays of MAX_THREADS items, while larger state (scratch
+ * space, btree scratch, task stats) is kept in per-thread slots which are
+ * only allocated once a thread with that ID first needs them. The task
+ * subsystem tracks thread IDs in use in a multi-word bit-array, so this
+ * must be a multiple of 64.
  */
-#define MAX_THREADS (64)
+#define MAX_THREADS (256)
 #define INVALID_TID (MAX_THREADS)
 
 #define HASH_SEED (42)
@@ -51,6 +51,22 @@ rc_allocator_alloc_virtual(allocator *a, uint64 *addr, page_type type)
    return rc_allocator_alloc(al, addr, type);
 }
 
+platform_status
+rc_allocator_alloc_near(rc_allocator *al,
+                        uint64        hint,
+                        uint64       *addr,
+                        page_type     type);
+
+platform_status
+rc_allocator_alloc_near_virtual(allocator *a,
+                                uint64     hint,
+                                uint64    *addr,
+                                page_type  type)
+{
+   rc_allocator *al = (rc_allocator *)a;
+   return rc_allocator_alloc_near(al, hint, addr, type);
+}
+
 uint8
 rc_allocator_inc_ref(rc_allocator *al, uint64 addr);
 
@@ -119,6 +135,66 @@ rc_allocator_remove_super_addr_virtual(allocator *a, allocator_root_id spl_id)
    rc_allocator_remove_super_addr(al, spl_id);
 }
 
+platform_status
+rc_allocator_checkpoint(rc_allocator *al);
+
+platform_status
+rc_allocator_checkpoint_virtual(allocator *a)
+{
+   rc_allocator *al = (rc_allocator *)a;
+   return rc_allocator_checkpoint(al);
+}
+
+bool
+rc_allocator_claim(rc_allocator *al, uint64 addr, page_type type);
+
+bool
+rc_allocator_claim_virtual(allocator *a, uint64 addr, page_type type)
+{
+   rc_allocator *al = (rc_allocator *)a;
+   return rc_allocator_claim(al, addr, type);
+}
+
+platform_status
+rc_allocator_capture(rc_allocator *al, const void **image, uint64 *size);
+
+platform_status
+rc_allocator_capture_virtual(allocator *a, const void **image, uint64 *size)
+{
+   rc_allocator *al = (rc_allocator *)a;
+   return rc_allocator_capture(al, image, size);
+}
+
+void
+rc_allocator_capture_exclude(rc_allocator *al, uint64 addr);
+
+void
+rc_allocator_capture_exclude_virtual(allocator *a, uint64 addr)
+{
+   rc_allocator *al = (rc_allocator *)a;
+   rc_allocator_capture_exclude(al, addr);
+}
+
+void
+rc_allocator_capture_commit(rc_allocator *al);
+
+void
+rc_allocator_capture_commit_virtual(allocator *a)
+{
+   rc_allocator *al = (rc_allocator *)a;
+   rc_allocator_capture_commit(al);
+}
+
+platform_status
+rc_allocator_restore(rc_allocator *al, const void *image, uint64 size);
+
+platform_status
+rc_allocator_restore_virtual(allocator *a, const void *image, uint64 size)
+{
+   rc_allocator *al = (rc_allocator *)a;
+   return rc_allocator_restore(al, image, size);
+}
+
 uint64
 rc_allocator_in_use(rc_allocator *al);
 
@@ -171,12 +247,19 @@ rc_allocator_print_allocated_virtual(allocator *a)
 
 const static allocator_ops rc_allocator_ops = {
    .alloc             = rc_allocator_alloc_virtual,
+   .alloc_near        = rc_allocator_alloc_near_virtual,
    .inc_ref           = rc_allocator_inc_ref_virtual,
    .dec_ref           = rc_allocator_dec_ref_virtual,
    .get_ref           = rc_allocator_get_ref_virtual,
    .get_super_addr    = rc_allocator_get_super_addr_virtual,
    .alloc_super_addr  = rc_allocator_alloc_super_addr_virtual,
    .remove_super_addr = rc_allocator_remove_super_addr_virtual,
+   .checkpoint        = rc_allocator_checkpoint_virtual,
+   .claim             = rc_allocator_claim_virtual,
+   .capture           = rc_allocator_capture_virtual,
+   .capture_exclude   = rc_allocator_capture_exclude_virtual,
+   .capture_commit    = rc_allocator_capture_commit_virtual,
+   .restore           = rc_allocator_restore_virtual,
    .in_use            = rc_allocator_in_use_virtual,
    .get_capacity      = rc_allocator_get_capacity_virtual,
    .assert_noleaks    = rc_allocator_assert_noleaks_virtual,
@@ -210,6 +293,130 @@ rc_allocator_extent_number(rc_allocator *al, uint64 addr)
    return (addr / al->cfg->io_cfg->extent_size);
 }
 
+/*
+ * Returns the number of words of a bitmap with a bit per extent.
+ */
+static inline uint64
+rc_allocator_num_map_words(rc_allocator *al)
+{
+   return (al->cfg->extent_capacity + 63) / 64;
+}
+
+static inline uint64
+rc_allocator_num_summary_words(rc_allocator *al)
+{
+   return (rc_allocator_num_map_words(al) + 63) / 64;
+}
+
+/*
+ * Is the extent pinned by the last checkpoint? See rc_allocator_checkpoint.
+ */
+static inline bool
+rc_allocator_is_pinned(rc_allocator *al, uint64 extent_no)
+{
+   return al->pinned != NULL
+          && (al->pinned[extent_no / 64] & (1ULL << (extent_no % 64))) != 0;
+}
+
+/*
+ * Sets the bit of a free extent in the free map, see rc_allocator.
+ */
+static inline void
+rc_allocator_mark_free(rc_allocator *al, uint64 extent_no)
+{
+   uint64 word_no = extent_no / 64;
+   __sync_fetch_and_or(&al->free_map[word_no], 1ULL << (extent_no % 64));
+   __sync_fetch_and_or(&al->free_summary[word_no / 64], 1ULL << (word_no % 64));
+}
+
+/*
+ * Clears the bit of the extent in the free map, and returns TRUE if this
+ * call cleared it.
+ */
+static inline bool
+rc_allocator_mark_used(rc_allocator *al, uint64 extent_no)
+{
+   uint64 mask = 1ULL << (extent_no % 64);
+   return (__sync_fetch_and_and(&al->free_map[extent_no / 64], ~mask) & mask)
+          != 0;
+}
+
+/*
+ * Sets the bits of the free map of the extents which are free and not
+ * pinned, and the summary bits of their words. Other bits are left alone.
+ */
+static void
+rc_allocator_update_free_map(rc_allocator *al)
+{
+   uint64 num_words = rc_allocator_num_map_words(al);
+   for (uint64 word_no = 0; word_no < num_words; word_no++) {
+      uint64 word = 0;
+      for (uint64 bit = 0; bit < 64; bit++) {
+         uint64 extent_no = 64 * word_no + bit;
+         if (extent_no < al->cfg->extent_capacity
+             && al->ref_count[extent_no] == AL_FREE
+             && !rc_allocator_is_pinned(al, extent_no))
+         {
+            word |= 1ULL << bit;
+         }
+      }
+      if (word != 0) {
+         __sync_fetch_and_or(&al->free_map[word_no], word);
+         __sync_fetch_and_or(&al->free_summary[word_no / 64],
+                             1ULL << (word_no % 64));
+      }
+   }
+}
+
+/*
+ * Allocates the free map, which rc_allocator_update_free_map fills.
+ */
+static platform_status
+rc_allocator_init_free_map(rc_allocator *al)
+{
+   uint64 num_words         = rc_allocator_num_map_words(al);
+   uint64 num_summary_words = rc_allocator_num_summary_words(al);
+   al->free_map = TYPED_ARRAY_ZALLOC(al->heap_id, al->free_map, num_words);
+   if (al->free_map == NULL) {
+      return STATUS_NO_MEMORY;
+   }
+   al->free_summary =
+      TYPED_ARRAY_ZALLOC(al->heap_id, al->free_summary, num_summary_words);
+   if (al->free_summary == NULL) {
+      platform_free(al->heap_id, al->free_map);
+      return STATUS_NO_MEMORY;
+   }
+   return STATUS_OK;
+}
+
+/*
+ * Spreads the cursors of the threads evenly over the disk.
+ */
+static void
+rc_allocator_spread_cursors(rc_allocator *al)
+{
+   uint64 num_extents = al->cfg->extent_capacity;
+   for (uint64 thr_i = 0; thr_i < MAX_THREADS; thr_i++) {
+      al->per_thread[thr_i].cursor = thr_i * num_extents / MAX_THREADS;
+   }
+}
+
+/*
+ * Updates the stats for an extent allocated by alloc or claim.
+ */
+static inline void
+rc_allocator_count_alloc(rc_allocator *al, page_type type)
+{
+   int64 curr_allocated = __sync_add_and_fetch(&al->stats.curr_allocated, 1);
+   int64 max_allocated  = al->stats.max_allocated;
+   while (curr_allocated > max_allocated) {
+      __sync_bool_compare_and_swap(
+         &al->stats.max_allocated, max_allocated, curr_allocated);
+      max_allocated = al->stats.max_allocated;
+   }
+   __sync_add_and_fetch(&al->stats.extent_allocs[type], 1);
+}
+
 static platform_status
 rc_allocator_init_meta_page(rc_allocator *al)
 {
@@ -371,6 +578,16 @@ rc_allocator_init(rc_allocator        *al,
    al->ref_count = platform_buffer_getaddr(al->bh);
    memset(al->ref_count, 0, buffer_size);
 
+   rc = rc_allocator_init_free_map(al);
+   if (!SUCCESS(rc)) {
+      platform_error_log("Failed to init free map for rc allocator\n");
+      platform_buffer_destroy(al->bh);
+      platform_mutex_destroy(&al->lock);
+      platform_free(al->heap_id, al->meta_page);
+      return rc;
+   }
+   rc_allocator_update_free_map(al);
+
    // allocate the super block
    allocator_alloc(&al->super, &addr, PAGE_TYPE_SUPERBLOCK);
    // super block extent should always start from address 0.
@@ -386,6 +603,7 @@ rc_allocator_init(rc_allocator        *al,
       allocator_alloc(&al->super, &addr, PAGE_TYPE_SUPERBLOCK);
       platform_assert(addr == cfg->io_cfg->extent_size * (i + 1));
    }
+   rc_allocator_spread_cursors(al);
 
    return STATUS_OK;
 }
@@ -395,6 +613,14 @@ rc_allocator_deinit(rc_allocator *al)
 {
    platform_buffer_destroy(al->bh);
    al->ref_count = NULL;
+   if (al->pinned != NULL) {
+      platform_free(al->heap_id, al->pinned);
+   }
+   if (al->captured != NULL) {
+      platform_free(al->heap_id, al->captured);
+   }
+   platform_free(al->heap_id, al->free_map);
+   platform_free(al->heap_id, al->free_summary);
    platform_mutex_destroy(&al->lock);
    platform_free(al->heap_id, al->meta_page);
 }
@@ -473,6 +699,11 @@ rc_allocator_mount(rc_allocator        *al,
          al->stats.curr_allocated++;
       }
    }
+
+   status = rc_allocator_init_free_map(al);
+   platform_assert_status_ok(status);
+   rc_allocator_update_free_map(al);
+   rc_allocator_spread_cursors(al);
    return STATUS_OK;
 }
 
@@ -534,6 +765,9 @@ rc_allocator_dec_ref(rc_allocator *al, uint64 addr, page_type type)
       platform_assert(type != PAGE_TYPE_INVALID);
       __sync_sub_and_fetch(&al->stats.curr_allocated, 1);
       __sync_add_and_fetch(&al->stats.extent_deallocs[type], 1);
+      if (!rc_allocator_is_pinned(al, extent_no)) {
+         rc_allocator_mark_free(al, extent_no);
+      }
    }
    if (SHOULD_TRACE(addr)) {
       platform_default_log("rc_allocator_dec_ref(%lu): %d -> %d\n",
@@ -672,23 +906,86 @@ rc_allocator_page_size(rc_allocator *al)
  *      Allocate an extent
  *----------------------------------------------------------------------
  */
-platform_status
-rc_allocator_alloc(rc_allocator *al,   // IN
-                   uint64       *addr, // OUT
-                   page_type     type)     // IN
+
+/*
+ * Takes a free extent among the bits of mask in the word of the free map, and
+ * returns TRUE if it found one. A bit is only a hint, so the extent is taken
+ * by a CAS on its ref count once the bit is cleared.
+ */
+static bool
+rc_allocator_alloc_from_word(rc_allocator *al,
+                             uint64        word_no,
+                             uint64        mask,
+                             uint64       *extent)
 {
-   uint64 first_hand = al->hand % al->cfg->extent_capacity;
-   uint64 hand;
-   bool   extent_is_free = FALSE;
-
-   do {
-      hand = __sync_fetch_and_add(&al->hand, 1) % al->cfg->extent_capacity;
-      if (al->ref_count[hand] == 0)
-         extent_is_free =
-            __sync_bool_compare_and_swap(&al->ref_count[hand], 0, 2);
-   } while (!extent_is_free
-            && (hand + 1) % al->cfg->extent_capacity != first_hand);
-   if (!extent_is_free) {
+   uint64 word = al->free_map[word_no] & mask;
+   while (word != 0) {
+      uint64 extent_no = 64 * word_no + __builtin_ctzll(word);
+      word &= word - 1;
+      if (rc_allocator_mark_used(al, extent_no)
+          && !rc_allocator_is_pinned(al, extent_no)
+          && __sync_bool_compare_and_swap(
+             &al->ref_count[extent_no], AL_FREE, AL_ONE_REF))
+      {
+         *extent = extent_no;
+         return TRUE;
+      }
+      word &= al->free_map[word_no];
+   }
+   return FALSE;
+}
+
+/*
+ * Searches the free map for a free extent, preferring the first one at or
+ * after start_extent. The rest of the word of start_extent is tried first,
+ * then the words from there on, wrapping around. The words are found through
+ * the summary bits, and a summary bit is cleared when its word is found
+ * empty, unless an extent of the word was freed meanwhile.
+ */
+static bool
+rc_allocator_find_free(rc_allocator *al, uint64 start_extent, uint64 *extent)
+{
+   uint64 num_words         = rc_allocator_num_map_words(al);
+   uint64 num_summary_words = rc_allocator_num_summary_words(al);
+   uint64 start_word        = start_extent / 64 % num_words;
+   uint64 summary_no        = start_word / 64;
+
+   uint64 start_mask = ~0ULL << (start_extent % 64);
+   if (rc_allocator_alloc_from_word(al, start_word, start_mask, extent)) {
+      return TRUE;
+   }
+
+   // the first summary word is visited twice, for the words before the start
+   for (uint64 i = 0; i <= num_summary_words; i++) {
+      uint64 summary = al->free_summary[summary_no];
+      if (i == 0) {
+         summary &= ~0ULL << (start_word % 64);
+      }
+      while (summary != 0) {
+         uint64 bit     = __builtin_ctzll(summary);
+         uint64 word_no = 64 * summary_no + bit;
+         summary &= summary - 1;
+         if (rc_allocator_alloc_from_word(al, word_no, ~0ULL, extent)) {
+            return TRUE;
+         }
+         __sync_fetch_and_and(&al->free_summary[summary_no], ~(1ULL << bit));
+         if (al->free_map[word_no] != 0) {
+            __sync_fetch_and_or(&al->free_summary[summary_no], 1ULL << bit);
+            summary |= 1ULL << bit;
+         }
+      }
+      summary_no = (summary_no + 1) % num_summary_words;
+   }
+   return FALSE;
+}
+
+static platform_status
+rc_allocator_alloc_from(rc_allocator *al,
+                        uint64        start_extent,
+                        uint64       *extent_no,
+                        page_type     type)
+{
+   if (!rc_allocator_find_free(al, start_extent, extent_no)) {
       platform_default_log(
          "Out of Space, while allocating an extent of type=%d (%s):"
          " allocated %lu out of %lu extents.\n",
@@ -698,20 +995,233 @@ rc_allocator_alloc(rc_allocator *al,   // IN
          al->cfg->extent_capacity);
       return STATUS_NO_SPACE;
    }
-   int64 curr_allocated = __sync_add_and_fetch(&al->stats.curr_allocated, 1);
-   int64 max_allocated  = al->stats.max_allocated;
-   while (curr_allocated > max_allocated) {
-      __sync_bool_compare_and_swap(
-         &al->stats.max_allocated, max_allocated, curr_allocated);
-      max_allocated = al->stats.max_allocated;
+   rc_allocator_count_alloc(al, type);
+   uint64 addr = *extent_no * al->cfg->io_cfg->extent_size;
+   if (SHOULD_TRACE(addr)) {
+      platform_default_log(
+         "rc_allocator_alloc_extent %12lu (%s)\n", addr, page_type_str[type]);
    }
-   __sync_add_and_fetch(&al->stats.extent_allocs[type], 1);
-   *addr = hand * al->cfg->io_cfg->extent_size;
-   if (SHOULD_TRACE(*addr)) {
+   return STATUS_OK;
+}
+
+/*
+ * Allocates from the thread's cursor, which then moves past the extent, so
+ * the extents a thread allocates are laid out in order where there is room.
+ */
+platform_status
+rc_allocator_alloc(rc_allocator *al,   // IN
+                   uint64       *addr, // OUT
+                   page_type     type)     // IN
+{
+   const threadid  tid = platform_get_tid();
+   uint64          extent_no;
+   platform_status rc =
+      rc_allocator_alloc_from(al, al->per_thread[tid].cursor, &extent_no, type);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   al->per_thread[tid].cursor = extent_no + 1;
+   *addr                      = extent_no * al->cfg->io_cfg->extent_size;
+   return STATUS_OK;
+}
+
+/*
+ * Allocates the first free extent after hint, if any, leaving the thread's
+ * cursor where it is.
+ */
+platform_status
+rc_allocator_alloc_near(rc_allocator *al,   // IN
+                        uint64        hint, // IN
+                        uint64       *addr, // OUT
+                        page_type     type)     // IN
+{
+   if (hint == 0) {
+      return rc_allocator_alloc(al, addr, type);
+   }
+   uint64          extent_size = al->cfg->io_cfg->extent_size;
+   uint64          extent_no;
+   platform_status rc =
+      rc_allocator_alloc_from(al, hint / extent_size + 1, &extent_no, type);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   *addr = extent_no * extent_size;
+   return STATUS_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ * rc_allocator_claim --
+ *
+ *      Allocates the extent at addr if it is free. Used in crash recovery
+ *      for the extents of the log, which was written after the ref counts
+ *      were last persisted. addr may come from a torn or stale page, so it
+ *      is validated rather than asserted on.
+ *----------------------------------------------------------------------
+ */
+bool
+rc_allocator_claim(rc_allocator *al, uint64 addr, page_type type)
+{
+   if (addr % al->cfg->io_cfg->extent_size != 0) {
+      return FALSE;
+   }
+   uint64 extent_no = rc_allocator_extent_number(al, addr);
+   if (extent_no >= al->cfg->extent_capacity
+       || rc_allocator_is_pinned(al, extent_no)
+       || !__sync_bool_compare_and_swap(
+          &al->ref_count[extent_no], AL_FREE, AL_ONE_REF))
+   {
+      return FALSE;
+   }
+   rc_allocator_mark_used(al, extent_no);
+   rc_allocator_count_alloc(al, type);
+   if (SHOULD_TRACE(addr)) {
       platform_default_log(
-         "rc_allocator_alloc_extent %12lu (%s)\n", *addr, page_type_str[type]);
+         "rc_allocator_claim %12lu (%s)\n", addr, page_type_str[type]);
    }
+   return TRUE;
+}
 
+/*
+ *----------------------------------------------------------------------
+ * rc_allocator_checkpoint --
+ *
+ *      Writes the ref counts to disk, as on unmount, and pins every extent
+ *      in use, so that alloc skips them until the next checkpoint even once
+ *      they are freed: a crash rolls the ref counts back to this point, and
+ *      the data they refer to must still be there.
+ *
+ *      The caller must keep allocations and ref count changes from racing
+ *      with the checkpoint.
+ *----------------------------------------------------------------------
+ */
+static platform_status
+rc_allocator_alloc_pinned(rc_allocator *al)
+{
+   if (al->pinned == NULL) {
+      uint64 num_words = rc_allocator_num_map_words(al);
+      al->pinned = TYPED_ARRAY_ZALLOC(al->heap_id, al->pinned, num_words);
+      if (al->pinned == NULL) {
+         return STATUS_NO_MEMORY;
+      }
+   }
+   return STATUS_OK;
+}
+
+/*
+ * Returns the word of the pinned bitmap with the bits of the extents in use
+ * in ref_count set.
+ */
+static uint64
+rc_allocator_in_use_word(rc_allocator *al, uint8 *ref_count, uint64 word_no)
+{
+   uint64 word = 0;
+   for (uint64 bit = 0; bit < 64; bit++) {
+      uint64 extent_no = 64 * word_no + bit;
+      if (extent_no < al->cfg->extent_capacity
+          && ref_count[extent_no] != AL_FREE)
+      {
+         word |= 1ULL << bit;
+      }
+   }
+   return word;
+}
+
+platform_status
+rc_allocator_checkpoint(rc_allocator *al)
+{
+   platform_status rc = rc_allocator_alloc_pinned(al);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   uint64 num_words = rc_allocator_num_map_words(al);
+   for (uint64 word_no = 0; word_no < num_words; word_no++) {
+      al->pinned[word_no] =
+         rc_allocator_in_use_word(al, al->ref_count, word_no);
+   }
+   rc_allocator_update_free_map(al);
+
+   uint32 io_size =
+      ROUNDUP(al->cfg->extent_capacity, al->cfg->io_cfg->page_size);
+   return io_write(
+      al->io, al->ref_count, io_size, al->cfg->io_cfg->extent_size);
+}
+
+/*
+ *----------------------------------------------------------------------
+ * rc_allocator_{capture,capture_exclude,capture_commit,restore} --
+ *
+ *      Checkpoints which cannot overwrite the persisted ref counts capture
+ *      a copy of them instead, see allocator_capture. The copy has the
+ *      layout of the persisted ref counts. Until the copy is committed, the
+ *      extents in use in it are pinned in addition to those pinned by the
+ *      last checkpoint, since either may be the one recovered from.
+ *----------------------------------------------------------------------
+ */
+platform_status
+rc_allocator_capture(rc_allocator *al, const void **image, uint64 *size)
+{
+   uint64 buffer_size =
+      ROUNDUP(al->cfg->extent_capacity, al->cfg->io_cfg->page_size);
+   platform_status rc = rc_allocator_alloc_pinned(al);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   if (al->captured == NULL) {
+      al->captured = TYPED_ARRAY_MALLOC(al->heap_id, al->captured, buffer_size);
+      if (al->captured == NULL) {
+         return STATUS_NO_MEMORY;
+      }
+   }
+
+   memcpy(al->captured, al->ref_count, buffer_size);
+   uint64 num_words = rc_allocator_num_map_words(al);
+   for (uint64 word_no = 0; word_no < num_words; word_no++) {
+      uint64 word = rc_allocator_in_use_word(al, al->captured, word_no);
+      __sync_fetch_and_or(&al->pinned[word_no], word);
+   }
+   *image = al->captured;
+   *size  = buffer_size;
+   return STATUS_OK;
+}
+
+void
+rc_allocator_capture_exclude(rc_allocator *al, uint64 addr)
+{
+   platform_assert(al->captured != NULL);
+   uint64 extent_no = rc_allocator_extent_number(al, addr);
+   debug_assert(extent_no < al->cfg->extent_capacity);
+   al->captured[extent_no] = AL_FREE;
+}
+
+void
+rc_allocator_capture_commit(rc_allocator *al)
+{
+   platform_assert(al->captured != NULL);
+   uint64 num_words = rc_allocator_num_map_words(al);
+   for (uint64 word_no = 0; word_no < num_words; word_no++) {
+      al->pinned[word_no] = rc_allocator_in_use_word(al, al->captured, word_no);
+   }
+   // the extents pinned for the previous image alone may be free by now
+   rc_allocator_update_free_map(al);
+}
+
+platform_status
+rc_allocator_restore(rc_allocator *al, const void *image, uint64 size)
+{
+   uint64 buffer_size =
+      ROUNDUP(al->cfg->extent_capacity, al->cfg->io_cfg->page_size);
+   if (size != buffer_size) {
+      return STATUS_BAD_PARAM;
+   }
+   memcpy(al->ref_count, image, buffer_size);
+   al->stats.curr_allocated = 0;
+   for (uint64 i = 0; i < al->cfg->extent_capacity; i++) {
+      if (al->ref_count[i] != 0) {
+         al->stats.curr_allocated++;
+      }
+   }
+   rc_allocator_update_free_map(al);
    return STATUS_OK;
 }
 
@@ -64,6 +64,20 @@ typedef struct rc_allocator_stats {
 /*
  *----------------------------------------------------------------------
  * rc_allocator -- Ref Count allocator context structure.
+ *
+ *      Alloc finds free extents in al->free_map, a bitmap with a bit per
+ *      extent which is set when the extent is free and not pinned, rather
+ *      than by probing al->ref_count. A bit is only a hint, since the
+ *      extent is taken by a CAS on its ref count, but every free extent
+ *      which is not pinned has its bit set. al->free_summary has a bit per
+ *      word of al->free_map which may be nonzero, so a search skips 4096
+ *      extents in use per summary word.
+ *
+ *      Each thread searches from its own cursor, al->per_thread[tid].cursor,
+ *      the extent after the one it last allocated, so that its extents are
+ *      laid out in order. The cursors start spread over the disk, so that
+ *      threads do not all contend on the same words. alloc_near searches
+ *      from the extent after its hint instead.
  *----------------------------------------------------------------------
  */
 typedef struct rc_allocator {
@@ -71,10 +85,17 @@ typedef struct rc_allocator {
    rc_allocator_config    *cfg;
    buffer_handle          *bh;
    uint8                  *ref_count;
-   uint64                  hand;
+   uint64                 *pinned; // bitmap of extents kept by checkpoints
+   uint8                  *captured; // see rc_allocator_capture
+   uint64                 *free_map;
+   uint64                 *free_summary;
    io_handle              *io;
    rc_allocator_meta_page *meta_page;
 
+   struct {
+      uint64 cursor;
+   } PLATFORM_CACHELINE_ALIGNED per_thread[MAX_THREADS];
+
    /*
     * mutex to synchronize updates to super block addresses of the splinter
     * tables in the meta page.
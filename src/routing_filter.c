@@ -11,6 +11,13 @@
 
 #include "platform.h"
 #include "routing_filter.h"
+
+// Must precede PackedArray.h, which poisons the malloc that mm_malloc.h uses
+#if defined(__x86_64__)
+#   include <immintrin.h>
+#   define ROUTING_X86_KERNELS 1
+#endif
+
 #include "PackedArray.h"
 #include "mini_allocator.h"
 #include "iterator.h"
@@ -206,61 +213,317 @@ routing_unlock_and_unget_page(cache *cc, page_handle *page)
 
 /*
  *----------------------------------------------------------------------
- * routing_get_bucket_bounds
+ * Bucket decode and remainder scan kernels
  *
- *      parses the encoding to return the start and end indices for the
- *      bucket_offset
+ *      A probe finds the bounds of its bucket in the unary encoding and then
+ *      compares every remainder in the bucket against the target. Both
+ *      steps have an x86 variant (POPCNT/BMI2 for the select, AVX2 and
+ *      AVX-512 for the compare) and a portable fallback. The variants are
+ *      picked once, at load time, from the features of the running CPU, so
+ *      a binary built without -march=native still gets them.
  *----------------------------------------------------------------------
  */
-static inline void
-routing_get_bucket_bounds(char   *encoding,
-                          uint64  len,
-                          uint64  bucket_offset,
-                          uint64 *start,
-                          uint64 *end)
+// Remainders unpacked per compare pass; buckets rarely hold more than a few
+#define ROUTING_SCAN_CHUNK 64
+
+typedef uint32 (*routing_select_fn)(uint64 word, uint32 rank);
+
+typedef struct routing_kernels {
+   routing_bucket_bounds_fn get_bucket_bounds;
+   routing_scan_fn          scan;
+} routing_kernels;
+
+/*
+ * Returns the 64-bit word at index word of the encoding. The encoding is
+ * not word aligned, and its tail is zero-filled rather than read past.
+ */
+static inline uint64
+routing_encoding_word(const char *encoding, uint64 encoding_size, uint64 word)
 {
-   uint32 word          = 0;
-   uint32 encoding_word = 0;
-   uint64 bucket        = 0;
-   uint64 bucket_pop    = 0;
-   uint64 bit_offset    = 0;
+   uint64 w   = 0;
+   uint64 off = word * sizeof(uint64);
+   debug_assert(off < encoding_size);
+   uint64 len = encoding_size - off;
+   memcpy(&w, encoding + off, len < sizeof(w) ? len : sizeof(w));
+   return w;
+}
+
+// Position of the set bit of the given rank (0-based) in word
+static inline uint32
+routing_select_generic(uint64 word, uint32 rank)
+{
+   while (rank-- > 0) {
+      word &= word - 1;
+   }
+   return __builtin_ctzll(word);
+}
+
+/*
+ * Bucket i ends at the i-th set bit of the encoding, so its entries are the
+ * zeros between the (i-1)-th and i-th set bits. Whole words are skipped by
+ * popcount, and the set bit is then picked out of its word by select.
+ */
+static inline __attribute__((always_inline)) void
+routing_get_bucket_bounds_impl(const char       *encoding,
+                               uint64            encoding_size,
+                               uint64            bucket_offset,
+                               uint64           *start,
+                               uint64           *end,
+                               routing_select_fn select)
+{
+   uint64 rank = bucket_offset == 0 ? 0 : bucket_offset - 1;
+   uint64 seen = 0;
+   uint64 word = 0;
+   uint64 w    = routing_encoding_word(encoding, encoding_size, word);
+   uint64 pop  = __builtin_popcountll(w);
+   while (seen + pop <= rank) {
+      seen += pop;
+      word++;
+      w   = routing_encoding_word(encoding, encoding_size, word);
+      pop = __builtin_popcountll(w);
+   }
+   uint64 bit = select(w, rank - seen);
 
    if (bucket_offset == 0) {
-      *start        = 0;
-      word          = 0;
-      encoding_word = *((uint32 *)encoding + word);
-      while (encoding_word == 0) {
-         word++;
-         encoding_word = *((uint32 *)encoding + word);
-      }
+      *start = 0;
+      *end   = 64 * word + bit;
+      return;
+   }
+   *start = 64 * word + bit - bucket_offset + 1;
 
-      // ffs returns the index + 1 ALEX: I think that's what we want though.
-      bit_offset = __builtin_ffs(encoding_word) - 1;
-      *end       = 32 * word + bit_offset;
-   } else {
-      bucket_pop = __builtin_popcount(*((uint32 *)encoding));
-      while (4 * word < len && bucket + bucket_pop < bucket_offset) {
-         bucket += bucket_pop;
-         word++;
-         bucket_pop = __builtin_popcount(*((uint32 *)encoding + word));
+   // clear the bits up to and including the one just found
+   w &= ~((2ULL << bit) - 1);
+   while (w == 0) {
+      word++;
+      w = routing_encoding_word(encoding, encoding_size, word);
+   }
+   *end = 64 * word + __builtin_ctzll(w) - bucket_offset;
+}
+
+static void
+routing_get_bucket_bounds_generic(const char *encoding,
+                                  uint64      encoding_size,
+                                  uint64      bucket_offset,
+                                  uint64     *start,
+                                  uint64     *end)
+{
+   routing_get_bucket_bounds_impl(encoding,
+                                  encoding_size,
+                                  bucket_offset,
+                                  start,
+                                  end,
+                                  routing_select_generic);
+}
+
+static inline uint64
+routing_scan_match(uint64 found_values, uint32 remainder_and_value, uint32 mask)
+{
+   uint32 found_value = remainder_and_value & mask;
+   platform_assert(found_value < 64);
+   return found_values | (1ULL << found_value);
+}
+
+static uint64
+routing_scan_generic(const uint32 *remainders_and_values,
+                     uint32        count,
+                     uint32        remainder,
+                     uint32        value_size)
+{
+   uint32 value_mask   = (1UL << value_size) - 1;
+   uint64 found_values = 0;
+   for (uint32 i = 0; i < count; i++) {
+      if (remainders_and_values[i] >> value_size == remainder) {
+         found_values = routing_scan_match(
+            found_values, remainders_and_values[i], value_mask);
       }
+   }
+   return found_values;
+}
+
+#ifdef ROUTING_X86_KERNELS
+__attribute__((target("bmi2"))) static inline uint32
+routing_select_bmi2(uint64 word, uint32 rank)
+{
+   return __builtin_ctzll(_pdep_u64(1ULL << rank, word));
+}
 
-      encoding_word = *((uint32 *)encoding + word);
-      while (bucket < bucket_offset - 1) {
-         encoding_word &= encoding_word - 1;
-         bucket++;
+__attribute__((target("popcnt,bmi2"))) static void
+routing_get_bucket_bounds_bmi2(const char *encoding,
+                               uint64      encoding_size,
+                               uint64      bucket_offset,
+                               uint64     *start,
+                               uint64     *end)
+{
+   routing_get_bucket_bounds_impl(
+      encoding, encoding_size, bucket_offset, start, end, routing_select_bmi2);
+}
+
+__attribute__((target("avx2"))) static uint64
+routing_scan_avx2(const uint32 *remainders_and_values,
+                  uint32        count,
+                  uint32        remainder,
+                  uint32        value_size)
+{
+   uint32  value_mask   = (1UL << value_size) - 1;
+   uint64  found_values = 0;
+   __m256i target       = _mm256_set1_epi32(remainder);
+   __m128i shift        = _mm_cvtsi32_si128(value_size);
+   uint32  i            = 0;
+   for (; i + 8 <= count; i += 8) {
+      __m256i rv =
+         _mm256_loadu_si256((const __m256i *)(remainders_and_values + i));
+      __m256i eq  = _mm256_cmpeq_epi32(_mm256_srl_epi32(rv, shift), target);
+      uint32  hit = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+      while (hit != 0) {
+         uint32 j = __builtin_ctz(hit);
+         found_values = routing_scan_match(
+            found_values, remainders_and_values[i + j], value_mask);
+         hit &= hit - 1;
       }
-      bit_offset = __builtin_ffs(encoding_word) - 1;
-      *start     = 32 * word + bit_offset - bucket_offset + 1;
+   }
+   return found_values
+          | routing_scan_generic(
+             remainders_and_values + i, count - i, remainder, value_size);
+}
 
-      encoding_word &= encoding_word - 1;
-      while (encoding_word == 0) {
-         word++;
-         encoding_word = *((uint32 *)encoding + word);
+__attribute__((target("avx512f"))) static uint64
+routing_scan_avx512(const uint32 *remainders_and_values,
+                    uint32        count,
+                    uint32        remainder,
+                    uint32        value_size)
+{
+   uint32  value_mask   = (1UL << value_size) - 1;
+   uint64  found_values = 0;
+   __m512i target       = _mm512_set1_epi32(remainder);
+   __m128i shift        = _mm_cvtsi32_si128(value_size);
+   uint32  i            = 0;
+   for (; i + 16 <= count; i += 16) {
+      __m512i   rv  = _mm512_loadu_si512(remainders_and_values + i);
+      __mmask16 hit = _mm512_cmpeq_epi32_mask(_mm512_srl_epi32(rv, shift),
+                                              target);
+      while (hit != 0) {
+         uint32 j = __builtin_ctz(hit);
+         found_values = routing_scan_match(
+            found_values, remainders_and_values[i + j], value_mask);
+         hit &= hit - 1;
       }
-      bit_offset = __builtin_ffs(encoding_word) - 1; // ffs returns index + 1
-      *end       = 32 * word + bit_offset - bucket_offset;
    }
+   return found_values
+          | routing_scan_avx2(
+             remainders_and_values + i, count - i, remainder, value_size);
+}
+#endif // ROUTING_X86_KERNELS
+
+static routing_kernels routing_kernels_in_use = {
+   .get_bucket_bounds = routing_get_bucket_bounds_generic,
+   .scan              = routing_scan_generic,
+};
+
+/*
+ * Runs at load time, before any filter can be probed, so the kernels never
+ * change under a running lookup.
+ */
+static void __attribute__((constructor))
+routing_kernels_init(void)
+{
+#ifdef ROUTING_X86_KERNELS
+   __builtin_cpu_init();
+   // PDEP is microcoded, and slower than the generic select, before Zen 3
+   if (__builtin_cpu_supports("popcnt") && __builtin_cpu_supports("bmi2")
+       && !__builtin_cpu_is("bdver4") && !__builtin_cpu_is("znver1")
+       && !__builtin_cpu_is("znver2"))
+   {
+      routing_kernels_in_use.get_bucket_bounds =
+         routing_get_bucket_bounds_bmi2;
+   }
+   if (__builtin_cpu_supports("avx512f")) {
+      routing_kernels_in_use.scan = routing_scan_avx512;
+   } else if (__builtin_cpu_supports("avx2")) {
+      routing_kernels_in_use.scan = routing_scan_avx2;
+   }
+#endif
+}
+
+/*
+ * Every kernel the running CPU can execute, whether or not it is the one in
+ * use, so that tests can check each of them against the generic ones.
+ */
+void
+routing_get_kernels(routing_kernel_list *list)
+{
+   ZERO_CONTENTS(list);
+   list->bucket_bounds[list->num_bucket_bounds]        =
+      routing_get_bucket_bounds_generic;
+   list->bucket_bounds_name[list->num_bucket_bounds++] = "generic";
+   list->scan[list->num_scans]                         = routing_scan_generic;
+   list->scan_name[list->num_scans++]                  = "generic";
+#ifdef ROUTING_X86_KERNELS
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("popcnt") && __builtin_cpu_supports("bmi2")) {
+      list->bucket_bounds[list->num_bucket_bounds] =
+         routing_get_bucket_bounds_bmi2;
+      list->bucket_bounds_name[list->num_bucket_bounds++] = "bmi2";
+   }
+   if (__builtin_cpu_supports("avx2")) {
+      list->scan[list->num_scans]        = routing_scan_avx2;
+      list->scan_name[list->num_scans++] = "avx2";
+   }
+   if (__builtin_cpu_supports("avx512f")) {
+      list->scan[list->num_scans]        = routing_scan_avx512;
+      list->scan_name[list->num_scans++] = "avx512";
+   }
+#endif
+}
+
+/*
+ *----------------------------------------------------------------------
+ * routing_get_bucket_bounds
+ *
+ *      parses the encoding to return the start and end indices for the
+ *      bucket_offset
+ *----------------------------------------------------------------------
+ */
+static inline void
+routing_get_bucket_bounds(const char *encoding,
+                          uint64      encoding_size,
+                          uint64      bucket_offset,
+                          uint64     *start,
+                          uint64     *end)
+{
+   routing_kernels_in_use.get_bucket_bounds(
+      encoding, encoding_size, bucket_offset, start, end);
+}
+
+/*
+ *----------------------------------------------------------------------
+ * routing_scan_bucket
+ *
+ *      Returns the bit-vector of values whose remainder matches among the
+ *      remainders in [start, end) of the remainder block. They are unpacked
+ *      in bulk and compared a vector at a time.
+ *----------------------------------------------------------------------
+ */
+static inline uint64
+routing_scan_bucket(const uint32 *remainder_block,
+                    uint64        start,
+                    uint64        end,
+                    uint32        remainder_and_value_size,
+                    uint32        remainder,
+                    uint32        value_size)
+{
+   uint32 buffer[ROUTING_SCAN_CHUNK];
+   uint64 found_values = 0;
+   debug_assert(remainder_and_value_size != 0);
+   while (start < end) {
+      uint32 count =
+         end - start < ROUTING_SCAN_CHUNK ? end - start : ROUTING_SCAN_CHUNK;
+      PackedArray_unpack(
+         remainder_block, start, buffer, count, remainder_and_value_size);
+      found_values |=
+         routing_kernels_in_use.scan(buffer, count, remainder, value_size);
+      start += count;
+   }
+   return found_values;
 }
 
 void
@@ -796,6 +1059,91 @@ routing_filter_estimate_unique_fp(cache           *cc,
    return num_unique * 16;
 }
 
+/*
+ *----------------------------------------------------------------------
+ * routing_filter_probe --
+ *
+ *      Per-filter quantities needed to probe for a fingerprint, computed
+ *      once per filter so that a batch of lookups can share them.
+ *----------------------------------------------------------------------
+ */
+typedef struct routing_probe_params {
+   uint32 value_size;
+   uint32 remainder_size;
+   uint32 remainder_and_value_size;
+   uint32 index_remainder_and_value_size;
+   uint32 remainder_mask;
+} routing_probe_params;
+
+static inline void
+routing_probe_params_init(routing_config       *cfg,
+                          routing_filter       *filter,
+                          routing_probe_params *params)
+{
+   uint32 log_num_buckets = 31 - __builtin_clz(filter->num_fingerprints);
+   if (log_num_buckets < cfg->log_index_size) {
+      log_num_buckets = cfg->log_index_size;
+   }
+   params->value_size               = filter->value_size;
+   params->remainder_size           = cfg->fingerprint_size - log_num_buckets;
+   params->remainder_and_value_size = params->remainder_size + filter->value_size;
+   params->index_remainder_and_value_size =
+      params->remainder_and_value_size + cfg->log_index_size;
+   params->remainder_mask = (1UL << params->remainder_size) - 1;
+}
+
+static inline uint32
+routing_key_fingerprint(routing_config *cfg, key target)
+{
+   uint32 fp = cfg->hash(key_data(target), key_length(target), cfg->seed);
+   return fp >> (32 - cfg->fingerprint_size);
+}
+
+static inline uint32
+routing_fingerprint_index(routing_probe_params *params, uint32 fp)
+{
+   return routing_get_index(fp << params->value_size,
+                            params->index_remainder_and_value_size);
+}
+
+/*
+ * Scans the bucket for fp in the remainders covered by hdr, and returns the
+ * bit-vector of values whose remainder matches.
+ */
+static inline uint64
+routing_filter_probe(routing_config       *cfg,
+                     routing_probe_params *params,
+                     routing_hdr          *hdr,
+                     uint32                fp)
+{
+   uint64 index_size = cfg->index_size;
+   uint32 bucket     = routing_get_bucket(fp << params->value_size,
+                                      params->remainder_and_value_size);
+   uint32 bucket_off = bucket % index_size;
+   uint32 remainder  = fp & params->remainder_mask;
+
+   uint64 encoding_size = (hdr->num_remainders + index_size - 1) / 8 + 4;
+   uint64 header_length = encoding_size + sizeof(routing_hdr);
+
+   uint64 start, end;
+   routing_get_bucket_bounds(
+      hdr->encoding, encoding_size, bucket_off, &start, &end);
+   char *remainder_block_start = (char *)hdr + header_length;
+
+   // platform_default_log("routing_filter_lookup: "
+   //      "bucket 0x%lx (0x%lx) remainder 0x%x start %lu end %lu\n",
+   //      bucket, bucket % index_size, remainder, start, end);
+
+   uint64 found_values =
+      routing_scan_bucket((uint32 *)remainder_block_start,
+                          start,
+                          end,
+                          params->remainder_and_value_size,
+                          remainder,
+                          params->value_size);
+   return found_values;
+}
+
 /*
  *----------------------------------------------------------------------
  * routing_filter_lookup
@@ -821,70 +1169,120 @@ routing_filter_lookup(cache          *cc,
       return STATUS_OK;
    }
 
-   hash_fn hash       = cfg->hash;
-   uint64  seed       = cfg->seed;
-   uint64  index_size = cfg->index_size;
-
-   uint32 fp = hash(key_data(target), key_length(target), seed);
-   fp >>= 32 - cfg->fingerprint_size;
-   size_t value_size      = filter->value_size;
-   uint32 log_num_buckets = 31 - __builtin_clz(filter->num_fingerprints);
-   if (log_num_buckets < cfg->log_index_size) {
-      log_num_buckets = cfg->log_index_size;
-   }
-   uint32 remainder_size           = cfg->fingerprint_size - log_num_buckets;
-   size_t remainder_and_value_size = remainder_size + value_size;
-   uint32 bucket =
-      routing_get_bucket(fp << value_size, remainder_and_value_size);
-   uint32 bucket_off = bucket % index_size;
-   size_t index_remainder_and_value_size =
-      remainder_size + value_size + cfg->log_index_size;
-   uint32 remainder_mask = (1UL << remainder_size) - 1;
-   uint32 index =
-      routing_get_index(fp << value_size, index_remainder_and_value_size);
-   uint32 remainder = fp & remainder_mask;
+   routing_probe_params params;
+   routing_probe_params_init(cfg, filter, &params);
+   uint32 fp    = routing_key_fingerprint(cfg, target);
+   uint32 index = routing_fingerprint_index(&params, fp);
 
    page_handle *filter_node;
    routing_hdr *hdr =
       routing_get_header(cc, cfg, filter->addr, index, &filter_node);
-   uint64 encoding_size = (hdr->num_remainders + index_size - 1) / 8 + 4;
-   uint64 header_length = encoding_size + sizeof(routing_hdr);
-
-   uint64 start, end;
-   routing_get_bucket_bounds(
-      hdr->encoding, header_length, bucket_off, &start, &end);
-   char *remainder_block_start = (char *)hdr + header_length;
+   *found_values = routing_filter_probe(cfg, &params, hdr, fp);
+   routing_unget_header(cc, filter_node);
+   return STATUS_OK;
+}
 
-   // platform_default_log("routing_filter_lookup: "
-   //      "index 0x%lx bucket 0x%lx (0x%lx) remainder 0x%x start %lu end
-   //      %lu\n", index, bucket, bucket % index_size, remainder, start, end);
+static int
+routing_probe_compare(const void *a, const void *b, void *arg)
+{
+   uint64 probe_a = *(const uint64 *)a;
+   uint64 probe_b = *(const uint64 *)b;
+   return probe_a < probe_b ? -1 : (probe_a > probe_b ? 1 : 0);
+}
 
-   if (start == end) {
-      routing_unget_header(cc, filter_node);
-      *found_values = 0;
+/*
+ *----------------------------------------------------------------------
+ * routing_filter_lookup_batch
+ *
+ *      Looks up num_keys keys in the filter, setting found_values[i] as
+ *      routing_filter_lookup would for keys[i].
+ *
+ *      The index of a fingerprint is its high-order bits, so the probes are
+ *      sorted by fingerprint. Keys that land on the same index then share a
+ *      single get of the index page and of the header page, instead of each
+ *      key getting (and rehashing into) both pages.
+ *
+ *      probes is caller-provided scratch space for num_keys entries.
+ *----------------------------------------------------------------------
+ */
+platform_status
+routing_filter_lookup_batch(cache          *cc,
+                            routing_config *cfg,
+                            routing_filter *filter,
+                            uint64          num_keys,
+                            key            *keys,
+                            uint64         *found_values,
+                            uint64         *probes)
+{
+   if (filter->addr == 0) {
+      memset(found_values, 0, num_keys * sizeof(*found_values));
       return STATUS_OK;
    }
+   debug_assert(num_keys <= UINT32_MAX);
+
+   routing_probe_params params;
+   routing_probe_params_init(cfg, filter, &params);
+   for (uint64 i = 0; i < num_keys; i++) {
+      debug_assert(key_is_user_key(keys[i]));
+      uint64 fp = routing_key_fingerprint(cfg, keys[i]);
+      probes[i] = (fp << 32) | i;
+   }
+   uint64 tmp;
+   platform_sort_slow(
+      probes, num_keys, sizeof(*probes), routing_probe_compare, NULL, &tmp);
 
-   uint64 found_values_int = 0;
-   for (uint32 i = 0; i < end - start; i++) {
-      uint32 pos = end - i - 1;
-      uint32 found_remainder_and_value;
-      routing_filter_get_remainder_and_value(cfg,
-                                             (uint32 *)remainder_block_start,
-                                             pos,
-                                             &found_remainder_and_value,
-                                             remainder_and_value_size);
-      uint32 found_remainder = found_remainder_and_value >> value_size;
-      if (found_remainder == remainder) {
-         uint32 value_mask  = (1UL << value_size) - 1;
-         uint16 found_value = found_remainder_and_value & value_mask;
-         platform_assert(found_value < 64);
-         found_values_int |= (1UL << found_value);
+   uint64 addrs_per_page =
+      cache_config_page_size(cfg->cache_cfg) / sizeof(uint64);
+   page_handle *index_page    = NULL;
+   uint64       index_page_no = UINT64_MAX;
+   page_handle *header_page   = NULL;
+   uint64       header_addr   = 0;
+   uint32       hdr_index     = UINT32_MAX;
+   routing_hdr *hdr           = NULL;
+
+   for (uint64 i = 0; i < num_keys; i++) {
+      uint32 fp     = probes[i] >> 32;
+      uint32 key_no = probes[i] & UINT32_MAX;
+      uint32 index  = routing_fingerprint_index(&params, fp);
+
+      if (index != hdr_index) {
+         if (index / addrs_per_page != index_page_no) {
+            if (index_page != NULL) {
+               cache_unget(cc, index_page);
+            }
+            index_page_no = index / addrs_per_page;
+            debug_assert(index_page_no < 32);
+            uint64 index_addr =
+               filter->addr
+               + cache_config_page_size(cfg->cache_cfg) * index_page_no;
+            index_page = cache_get(cc, index_addr, TRUE, PAGE_TYPE_FILTER);
+         }
+         uint64 hdr_raw_addr =
+            ((uint64 *)index_page->data)[index % addrs_per_page];
+         platform_assert(hdr_raw_addr != 0);
+         uint64 new_header_addr =
+            hdr_raw_addr
+            - (hdr_raw_addr % cache_config_page_size(cfg->cache_cfg));
+         if (header_page == NULL || new_header_addr != header_addr) {
+            if (header_page != NULL) {
+               routing_unget_header(cc, header_page);
+            }
+            header_addr = new_header_addr;
+            header_page = cache_get(cc, header_addr, TRUE, PAGE_TYPE_FILTER);
+         }
+         hdr = (routing_hdr *)(header_page->data + hdr_raw_addr - header_addr);
+         hdr_index = index;
       }
+
+      found_values[key_no] = routing_filter_probe(cfg, &params, hdr, fp);
    }
 
-   routing_unget_header(cc, filter_node);
-   *found_values = found_values_int;
+   if (header_page != NULL) {
+      routing_unget_header(cc, header_page);
+   }
+   if (index_page != NULL) {
+      cache_unget(cc, index_page);
+   }
    return STATUS_OK;
 }
 
@@ -1109,30 +1507,17 @@ routing_filter_lookup_async(cache              *cc,
             uint64 start, end;
             uint32 bucket_off = ctxt->bucket % cfg->index_size;
             routing_get_bucket_bounds(
-               hdr->encoding, header_length, bucket_off, &start, &end);
+               hdr->encoding, encoding_size, bucket_off, &start, &end);
             char *remainder_block_start = (char *)hdr + header_length;
 
-            uint64 found_values_int = 0;
-            for (uint32 i = 0; i < end - start; i++) {
-               uint32 pos = end - i - 1;
-               uint32 found_remainder_and_value;
-               size_t value_size = filter->value_size;
-               size_t remainder_and_value_size =
-                  ctxt->remainder_size + value_size;
-               routing_filter_get_remainder_and_value(
-                  cfg,
-                  (uint32 *)remainder_block_start,
-                  pos,
-                  &found_remainder_and_value,
-                  remainder_and_value_size);
-               uint32 found_remainder = found_remainder_and_value >> value_size;
-               if (found_remainder == ctxt->remainder) {
-                  uint32 value_mask  = (1UL << value_size) - 1;
-                  uint16 found_value = found_remainder_and_value & value_mask;
-                  platform_assert(found_value < 64);
-                  found_values_int |= (1UL << found_value);
-               }
-            }
+            size_t value_size = filter->value_size;
+            uint64 found_values_int =
+               routing_scan_bucket((uint32 *)remainder_block_start,
+                                   start,
+                                   end,
+                                   ctxt->remainder_size + value_size,
+                                   ctxt->remainder,
+                                   value_size);
             *found_values = found_values_int;
             cache_unget(cc, cache_ctxt->page);
             res  = async_success;
@@ -1289,7 +1674,7 @@ routing_filter_print_remainders(routing_config *cfg,
    platform_default_log("--- Remainders\n");
    size_t remainder_and_value_size = value_size + remainder_size;
    for (i = 0; i < cfg->index_size; i++) {
-      routing_get_bucket_bounds(hdr->encoding, header_length, i, &start, &end);
+      routing_get_bucket_bounds(hdr->encoding, encoding_size, i, &start, &end);
       platform_default_log("0x%lx remainders:", i);
       for (j = start; j < end; j++) {
          uint32 remainder, value, remainder_and_value;
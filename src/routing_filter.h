@@ -107,6 +107,15 @@ routing_filter_lookup(cache          *cc,
                       key             target,
                       uint64         *found_values);
 
+platform_status
+routing_filter_lookup_batch(cache          *cc,
+                            routing_config *cfg,
+                            routing_filter *filter,
+                            uint64          num_keys,
+                            key            *keys,
+                            uint64         *found_values,
+                            uint64         *probes);
+
 static inline uint16
 routing_filter_get_next_value(uint64 found_values, uint16 last_value)
 {
@@ -176,6 +185,36 @@ routing_filter_estimate_unique_fp(cache           *cc,
                                   routing_filter  *filter,
                                   uint64           num_filters);
 
+/*
+ * Bucket decode and remainder scan kernels, see routing_filter.c.
+ * routing_get_kernels lists those the running CPU supports, the generic one
+ * of each kind first.
+ */
+typedef void (*routing_bucket_bounds_fn)(const char *encoding,
+                                         uint64      encoding_size,
+                                         uint64      bucket_offset,
+                                         uint64     *start,
+                                         uint64     *end);
+
+typedef uint64 (*routing_scan_fn)(const uint32 *remainders_and_values,
+                                  uint32        count,
+                                  uint32        remainder,
+                                  uint32        value_size);
+
+#define ROUTING_MAX_KERNELS 3
+
+typedef struct routing_kernel_list {
+   uint32                   num_bucket_bounds;
+   routing_bucket_bounds_fn bucket_bounds[ROUTING_MAX_KERNELS];
+   const char              *bucket_bounds_name[ROUTING_MAX_KERNELS];
+   uint32                   num_scans;
+   routing_scan_fn          scan[ROUTING_MAX_KERNELS];
+   const char              *scan_name[ROUTING_MAX_KERNELS];
+} routing_kernel_list;
+
+void
+routing_get_kernels(routing_kernel_list *list);
+
 // Debug functions
 
 void
@@ -29,12 +29,19 @@ uint64
 shard_log_meta_addr(log_handle *log);
 uint64
 shard_log_magic(log_handle *log);
+void
+shard_log_release(log_handle *log);
+void
+shard_log_for_each_extent(log_handle *log, log_extent_fn func, void *arg);
 
 static log_ops shard_log_ops = {
-   .write     = shard_log_write,
-   .addr      = shard_log_addr,
-   .meta_addr = shard_log_meta_addr,
-   .magic     = shard_log_magic,
+   .write           = shard_log_write,
+   .release         = shard_log_release,
+   .sync            = shard_log_sync,
+   .addr            = shard_log_addr,
+   .meta_addr       = shard_log_meta_addr,
+   .magic           = shard_log_magic,
+   .for_each_extent = shard_log_for_each_extent,
 };
 
 void
@@ -76,6 +83,22 @@ shard_log_get_thread_data(shard_log *log, threadid thr_id)
    return &log->thread_data[thr_id];
 }
 
+static inline void
+shard_log_thread_data_lock(shard_log_thread_data *thread_data)
+{
+   uint64 wait = 1;
+   while (__sync_lock_test_and_set(&thread_data->lock, TRUE)) {
+      platform_sleep(wait);
+      wait = wait > 1024 ? wait : 2 * wait;
+   }
+}
+
+static inline void
+shard_log_thread_data_unlock(shard_log_thread_data *thread_data)
+{
+   __sync_lock_release(&thread_data->lock);
+}
+
 page_handle *
 shard_log_alloc(shard_log *log, uint64 *next_extent)
 {
@@ -91,8 +114,11 @@ shard_log_init(shard_log *log, cache *cc, shard_log_config *cfg)
    log->cfg       = cfg;
    log->super.ops = &shard_log_ops;
 
-   uint64 magic_idx = __sync_fetch_and_add(&shard_log_magic_idx, 1);
-   log->magic = platform_checksum64(&magic_idx, sizeof(uint64), cfg->seed);
+   // pages left in reused extents by the logs of earlier runs must not pass
+   // for pages of this one, so the magic also depends on the time
+   uint64 magic_seed[2] = {__sync_fetch_and_add(&shard_log_magic_idx, 1),
+                           platform_get_real_time()};
+   log->magic = platform_checksum64(magic_seed, sizeof(magic_seed), cfg->seed);
 
    allocator      *al = cache_allocator(cc);
    platform_status rc = allocator_alloc(al, &log->meta_head, PAGE_TYPE_LOG);
@@ -131,9 +157,23 @@ shard_log_zap(shard_log *log)
       thread_data->offset                = 0;
    }
 
+   mini_release(&log->mini, NULL_KEY);
    mini_unkeyed_dec_ref(cc, log->meta_head, PAGE_TYPE_LOG, FALSE);
 }
 
+void
+shard_log_release(log_handle *logh)
+{
+   shard_log_zap((shard_log *)logh);
+}
+
+void
+shard_log_for_each_extent(log_handle *logh, log_extent_fn func, void *arg)
+{
+   shard_log *log = (shard_log *)logh;
+   mini_unkeyed_for_each_extent(&log->mini, func, arg);
+}
+
 /*
  * -------------------------------------------------------------------------
  * Header for a key/message pair stored in the sharded log: Disk-resident
@@ -219,9 +259,12 @@ shard_log_write(log_handle *logh, key tuple_key, message msg, uint64 generation)
    shard_log_thread_data *thread_data =
       shard_log_get_thread_data(log, platform_get_tid());
 
+   shard_log_thread_data_lock(thread_data);
+
    page_handle *page;
    if (thread_data->addr == SHARD_UNMAPPED) {
       if (get_new_page_for_thread(log, thread_data, &page)) {
+         shard_log_thread_data_unlock(thread_data);
          return -1;
       }
    } else {
@@ -232,6 +275,8 @@ shard_log_write(log_handle *logh, key tuple_key, message msg, uint64 generation)
          wait = wait > 1024 ? wait : 2 * wait;
       }
       cache_lock(cc, page);
+      // the page may have been cleaned by shard_log_sync or the cleaner
+      cache_mark_dirty(cc, page);
    }
 
    shard_log_hdr *hdr    = (shard_log_hdr *)page->data;
@@ -253,6 +298,7 @@ shard_log_write(log_handle *logh, key tuple_key, message msg, uint64 generation)
       cache_unget(cc, page);
 
       if (get_new_page_for_thread(log, thread_data, &page)) {
+         shard_log_thread_data_unlock(thread_data);
          return -1;
       }
       cursor = (log_entry *)(page->data + thread_data->offset);
@@ -271,9 +317,124 @@ shard_log_write(log_handle *logh, key tuple_key, message msg, uint64 generation)
    cache_unclaim(cc, page);
    cache_unget(cc, page);
 
+   shard_log_thread_data_unlock(thread_data);
    return 0;
 }
 
+/*
+ *-----------------------------------------------------------------------------
+ * shard_log_flush --
+ *
+ *      Seals the current page of every thread (terminator and checksum, so
+ *      that the partial page is valid for replay) and writes all of them back
+ *      with a single batched cache_pages_sync, which also waits for any
+ *      earlier writeback of full pages and flushes the device.
+ *
+ *      Writers to a thread's page are held off by its thread_data lock for
+ *      the duration of the flush.
+ *-----------------------------------------------------------------------------
+ */
+static platform_status
+shard_log_flush(shard_log *log)
+{
+   cache        *cc = log->cc;
+   page_handle  *pages[MAX_THREADS];
+   threadid      tids[MAX_THREADS];
+   uint64        num_pages = 0;
+
+   for (threadid thr_i = 0; thr_i < MAX_THREADS; thr_i++) {
+      shard_log_thread_data *thread_data =
+         shard_log_get_thread_data(log, thr_i);
+      if (thread_data->addr == SHARD_UNMAPPED) {
+         continue;
+      }
+      shard_log_thread_data_lock(thread_data);
+      if (thread_data->addr == SHARD_UNMAPPED) {
+         shard_log_thread_data_unlock(thread_data);
+         continue;
+      }
+
+      page_handle *page =
+         cache_get(cc, thread_data->addr, TRUE, PAGE_TYPE_LOG);
+      uint64 wait = 1;
+      while (!cache_claim(cc, page)) {
+         platform_sleep(wait);
+         wait = wait > 1024 ? wait : 2 * wait;
+      }
+      cache_lock(cc, page);
+
+      shard_log_hdr *hdr    = (shard_log_hdr *)page->data;
+      log_entry     *cursor = (log_entry *)(page->data + thread_data->offset);
+      uint64 free_space = shard_log_page_size(log->cfg) - thread_data->offset;
+      if (sizeof(log_entry) <= free_space) {
+         cursor->generation = INVALID_GENERATION;
+      }
+      hdr->checksum = shard_log_checksum(log->cfg, page);
+
+      pages[num_pages] = page;
+      tids[num_pages]  = thr_i;
+      num_pages++;
+   }
+
+   platform_status rc = cache_pages_sync(cc, pages, num_pages, PAGE_TYPE_LOG);
+
+   // cache_pages_sync sorts pages, so release the thread locks separately
+   for (uint64 i = 0; i < num_pages; i++) {
+      cache_unlock(cc, pages[i]);
+      cache_unclaim(cc, pages[i]);
+      cache_unget(cc, pages[i]);
+   }
+   for (uint64 i = 0; i < num_pages; i++) {
+      shard_log_thread_data_unlock(shard_log_get_thread_data(log, tids[i]));
+   }
+   return rc;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * shard_log_sync --
+ *
+ *      Returns once every log write which completed before the call is
+ *      durable.
+ *
+ *      Concurrent callers are coalesced into group commits: each caller takes
+ *      a ticket, and one of them becomes the leader, optionally waits for the
+ *      group commit window so that more callers can join, and then flushes
+ *      the log on behalf of every ticket issued so far. The others wait for a
+ *      leader to complete their ticket.
+ *-----------------------------------------------------------------------------
+ */
+platform_status
+shard_log_sync(log_handle *logh)
+{
+   shard_log *log    = (shard_log *)logh;
+   uint64     ticket = __sync_add_and_fetch(&log->sync_requested, 1);
+   uint64     wait   = 1;
+
+   while (__sync_fetch_and_add(&log->sync_completed, 0) < ticket) {
+      if (!__sync_bool_compare_and_swap(&log->sync_leader, FALSE, TRUE)) {
+         platform_sleep(wait);
+         wait = wait > 1024 ? wait : 2 * wait;
+         continue;
+      }
+      if (log->sync_completed < ticket) {
+         if (log->cfg->group_commit_window_ns != 0) {
+            platform_sleep(log->cfg->group_commit_window_ns);
+         }
+         uint64          target = __sync_fetch_and_add(&log->sync_requested, 0);
+         platform_status rc     = shard_log_flush(log);
+         if (!SUCCESS(rc)) {
+            __sync_lock_release(&log->sync_leader);
+            return rc;
+         }
+         __atomic_store_n(&log->sync_completed, target, __ATOMIC_RELEASE);
+      }
+      __sync_lock_release(&log->sync_leader);
+   }
+
+   return STATUS_OK;
+}
+
 uint64
 shard_log_addr(log_handle *logh)
 {
@@ -316,7 +477,10 @@ shard_log_compare(const void *p1, const void *p2, void *unused)
 {
    log_entry **le1 = (log_entry **)p1;
    log_entry **le2 = (log_entry **)p2;
-   return (*le1)->generation - (*le2)->generation;
+   if ((*le1)->generation == (*le2)->generation) {
+      return 0;
+   }
+   return (*le1)->generation < (*le2)->generation ? -1 : 1;
 }
 
 log_handle *
@@ -329,13 +493,20 @@ log_create(cache *cc, log_config *lcfg, platform_heap_id hid)
    return (log_handle *)slog;
 }
 
-platform_status
-shard_log_iterator_init(cache              *cc,
-                        shard_log_config   *cfg,
-                        platform_heap_id    hid,
-                        uint64              addr,
-                        uint64              magic,
-                        shard_log_iterator *itor)
+/*
+ * Reads the valid pages of the log into itor, see shard_log_iterator_init and
+ * shard_log_iterator_init_recovered. With claim, each extent is claimed from
+ * the allocator before it is read, and the extents claimed are recorded in
+ * itor so that they can be released by shard_log_iterator_deinit.
+ */
+static platform_status
+shard_log_iterator_init_internal(cache              *cc,
+                                 shard_log_config   *cfg,
+                                 platform_heap_id    hid,
+                                 uint64              addr,
+                                 uint64              magic,
+                                 bool                claim,
+                                 shard_log_iterator *itor)
 {
    page_handle *page;
    uint64       i;
@@ -344,14 +515,25 @@ shard_log_iterator_init(cache              *cc,
    uint64       num_valid_pages = 0;
    uint64       extent_addr;
    uint64       next_extent_addr;
+   allocator   *al          = cache_allocator(cc);
+   uint64       num_extents = 0;
 
    memset(itor, 0, sizeof(shard_log_iterator));
    itor->super.ops = &shard_log_iterator_ops;
+   itor->cc        = cc;
    itor->cfg       = cfg;
 
    // traverse the log extents and calculate the required space
    extent_addr = addr;
-   while (extent_addr != 0 && cache_get_ref(cc, extent_addr) > 0) {
+   while (extent_addr != 0) {
+      if (claim) {
+         if (!allocator_claim(al, extent_addr, PAGE_TYPE_LOG)) {
+            break;
+         }
+         num_extents++;
+      } else if (cache_get_ref(cc, extent_addr) == 0) {
+         break;
+      }
       cache_prefetch(cc, extent_addr, PAGE_TYPE_LOG);
       next_extent_addr = 0;
       for (i = 0; i < pages_per_extent; i++) {
@@ -371,15 +553,31 @@ shard_log_iterator_init(cache              *cc,
 
 finished_first_pass:
 
-   itor->contents = TYPED_ARRAY_MALLOC(
-      hid, itor->contents, num_valid_pages * shard_log_page_size(cfg));
-   itor->entries = TYPED_ARRAY_MALLOC(hid, itor->entries, itor->num_entries);
+   // a log which was created but never written to has no valid pages
+   if (num_valid_pages != 0) {
+      itor->contents = TYPED_ARRAY_MALLOC(
+         hid, itor->contents, num_valid_pages * shard_log_page_size(cfg));
+   }
+   if (itor->num_entries != 0) {
+      itor->entries =
+         TYPED_ARRAY_MALLOC(hid, itor->entries, itor->num_entries);
+   }
+   if (claim && num_extents != 0) {
+      itor->extent = TYPED_ARRAY_MALLOC(hid, itor->extent, num_extents);
+   }
 
-   // traverse the log extents again and copy the kv pairs
+   // traverse the log extents again and copy the kv pairs, the second pass
+   // visits exactly the extents of the first one
    log_entry *cursor    = (log_entry *)itor->contents;
    uint64     entry_idx = 0;
    extent_addr          = addr;
    while (extent_addr != 0 && cache_get_ref(cc, extent_addr) > 0) {
+      if (claim) {
+         if (itor->num_extents == num_extents) {
+            break;
+         }
+         itor->extent[itor->num_extents++] = extent_addr;
+      }
       cache_prefetch(cc, extent_addr, PAGE_TYPE_LOG);
       next_extent_addr = 0;
       for (i = 0; i < pages_per_extent; i++) {
@@ -419,11 +617,77 @@ finished_second_pass:
    return STATUS_OK;
 }
 
+platform_status
+shard_log_iterator_init(cache              *cc,
+                        shard_log_config   *cfg,
+                        platform_heap_id    hid,
+                        uint64              addr,
+                        uint64              magic,
+                        shard_log_iterator *itor)
+{
+   return shard_log_iterator_init_internal(
+      cc, cfg, hid, addr, magic, FALSE, itor);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * shard_log_iterator_init_recovered --
+ *
+ *      Like shard_log_iterator_init, for the log of an instance which
+ *      crashed. Its extents were allocated after the allocator's last
+ *      checkpoint, so they are free in the ref counts mounted after the
+ *      crash: each one is claimed before it is read, which keeps it from
+ *      being reallocated while the entries are in use. The log ends at the
+ *      first extent which can't be claimed or page which isn't valid.
+ *
+ *      shard_log_iterator_deinit frees the claimed extents.
+ *-----------------------------------------------------------------------------
+ */
+platform_status
+shard_log_iterator_init_recovered(cache              *cc,
+                                  shard_log_config   *cfg,
+                                  platform_heap_id    hid,
+                                  uint64              addr,
+                                  uint64              magic,
+                                  shard_log_iterator *itor)
+{
+   return shard_log_iterator_init_internal(
+      cc, cfg, hid, addr, magic, TRUE, itor);
+}
+
 void
 shard_log_iterator_deinit(platform_heap_id hid, shard_log_iterator *itor)
 {
    platform_free(hid, itor->contents);
    platform_free(hid, itor->entries);
+   if (itor->extent == NULL) {
+      return;
+   }
+   allocator *al = cache_allocator(itor->cc);
+   for (uint64 i = 0; i < itor->num_extents; i++) {
+      uint8 ref = allocator_dec_ref(al, itor->extent[i], PAGE_TYPE_LOG);
+      platform_assert(ref == AL_NO_REFS);
+      cache_hard_evict_extent(itor->cc, itor->extent[i], PAGE_TYPE_LOG);
+      ref = allocator_dec_ref(al, itor->extent[i], PAGE_TYPE_LOG);
+      platform_assert(ref == AL_FREE);
+   }
+   platform_free(hid, itor->extent);
+}
+
+/*
+ * Returns the generation of the idx-th entry, in generation order, and its key
+ * and message.
+ */
+uint64
+shard_log_iterator_get_entry(shard_log_iterator *itor,
+                             uint64              idx,
+                             key                *curr_key,
+                             message            *msg)
+{
+   debug_assert(idx < itor->num_entries);
+   *curr_key = log_entry_key(itor->entries[idx]);
+   *msg      = log_entry_message(itor->entries[idx]);
+   return itor->entries[idx]->generation;
 }
 
 void
@@ -24,12 +24,15 @@ typedef struct shard_log_config {
    cache_config *cache_cfg;
    data_config  *data_cfg;
    uint64        seed;
+   // how long a sync leader waits for other syncs to join its group commit
+   uint64 group_commit_window_ns;
    // data config of point message tree
 } shard_log_config;
 
 typedef struct shard_log_thread_data {
    uint64 addr;
    uint64 offset;
+   bool   lock; // held while the page at addr is written or synced
 } PLATFORM_CACHELINE_ALIGNED shard_log_thread_data;
 
 /*
@@ -44,17 +47,25 @@ typedef struct shard_log {
    uint64                addr;
    uint64                meta_head;
    uint64                magic;
+
+   // group commit state, see shard_log_sync
+   bool   sync_leader;
+   uint64 sync_requested;
+   uint64 sync_completed;
 } shard_log;
 
 typedef struct log_entry log_entry;
 
 typedef struct shard_log_iterator {
    iterator          super;
+   cache            *cc;
    shard_log_config *cfg;
    char             *contents;
    log_entry       **entries;
    uint64            num_entries;
    uint64            pos;
+   uint64           *extent; // claimed, see shard_log_iterator_init_recovered
+   uint64            num_extents;
 } shard_log_iterator;
 
 /*
@@ -76,6 +87,9 @@ shard_log_init(shard_log *log, cache *cc, shard_log_config *cfg);
 void
 shard_log_zap(shard_log *log);
 
+platform_status
+shard_log_sync(log_handle *logh);
+
 platform_status
 shard_log_iterator_init(cache              *cc,
                         shard_log_config   *cfg,
@@ -84,9 +98,23 @@ shard_log_iterator_init(cache              *cc,
                         uint64              magic,
                         shard_log_iterator *itor);
 
+platform_status
+shard_log_iterator_init_recovered(cache              *cc,
+                                  shard_log_config   *cfg,
+                                  platform_heap_id    hid,
+                                  uint64              addr,
+                                  uint64              magic,
+                                  shard_log_iterator *itor);
+
 void
 shard_log_iterator_deinit(platform_heap_id hid, shard_log_iterator *itor);
 
+uint64
+shard_log_iterator_get_entry(shard_log_iterator *itor,
+                             uint64              idx,
+                             key                *curr_key,
+                             message            *msg);
+
 void
 shard_log_config_init(shard_log_config *log_cfg,
                       cache_config     *cache_cfg,
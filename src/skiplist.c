@@ -0,0 +1,657 @@
+// Copyright 2018-2021 VMware, Inc.
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ *-----------------------------------------------------------------------------
+ * skiplist.c --
+ *
+ *     This file contains the implementation of the lock-free skiplist used
+ *     by skiplist memtables.
+ *
+ *     There are no deletions, so a node, once linked, stays where it is and
+ *     every predecessor found during a search remains a valid place to
+ *     resume the search from. An insert links the bottom level first, which
+ *     is what makes the key visible; if it loses a race with an insert of
+ *     the same key, the node it built is abandoned (it is freed with the
+ *     rest of the skiplist) and the message is pushed onto the winner.
+ *-----------------------------------------------------------------------------
+ */
+
+#include "platform.h"
+#include "skiplist.h"
+
+#include "poison.h"
+
+/*
+ * Granularity of the per-thread allocation blocks. Larger allocations get a
+ * block of their own.
+ */
+#define SKIPLIST_BLOCK_SIZE (64 * KiB)
+
+/*
+ * A message version. Versions of a key form a stack, newest first.
+ */
+typedef struct skiplist_version {
+   struct skiplist_version *next; // next older version
+   uint64                   generation;
+   uint32                   length;
+   message_type             type;
+   char                     data[];
+} skiplist_version;
+
+struct skiplist_node {
+   skiplist_version *volatile versions;
+   uint16                     key_length;
+   uint8                      height;
+   skiplist_node *volatile    next[]; // followed by the key bytes
+};
+
+struct skiplist_block {
+   skiplist_block *next;
+   uint64          size;
+   char            data[];
+};
+
+static inline key
+skiplist_node_key(const skiplist_node *node)
+{
+   return key_create(node->key_length, (const char *)&node->next[node->height]);
+}
+
+static inline message
+skiplist_version_message(const skiplist_version *version)
+{
+   return message_create(version->type,
+                         slice_create(version->length, version->data));
+}
+
+static inline int
+skiplist_compare(const skiplist *sl, const skiplist_node *node, key target)
+{
+   return data_key_compare(sl->cfg, skiplist_node_key(node), target);
+}
+
+static inline bool
+skiplist_node_has_key(const skiplist *sl, const skiplist_node *node, key k)
+{
+   return node != NULL && skiplist_compare(sl, node, k) == 0;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Allocation
+ *-----------------------------------------------------------------------------
+ */
+static void *
+skiplist_alloc(skiplist *sl, threadid tid, uint64 size)
+{
+   skiplist_cursor *cursor = &sl->cursor[tid];
+   size                    = ROUNDUP(size, sizeof(void *));
+   if (cursor->next + size > cursor->end) {
+      uint64 block_size =
+         MAX(SKIPLIST_BLOCK_SIZE, sizeof(skiplist_block) + size);
+      skiplist_block *block =
+         TYPED_MANUAL_MALLOC(sl->heap_id, block, block_size);
+      if (block == NULL) {
+         return NULL;
+      }
+      block->size = block_size;
+      skiplist_block *head;
+      do {
+         head        = sl->blocks;
+         block->next = head;
+      } while (!__sync_bool_compare_and_swap(&sl->blocks, head, block));
+      __sync_fetch_and_add(&sl->bytes, block_size);
+      cursor->next = block->data;
+      cursor->end  = (char *)block + block_size;
+   }
+   void *ptr = cursor->next;
+   cursor->next += size;
+   return ptr;
+}
+
+static void
+skiplist_free_blocks(skiplist *sl)
+{
+   skiplist_block *block = sl->blocks;
+   while (block != NULL) {
+      skiplist_block *next = block->next;
+      platform_free(sl->heap_id, block);
+      block = next;
+   }
+   sl->blocks = NULL;
+   sl->bytes  = 0;
+}
+
+/*
+ * Node heights are geometrically distributed with p = 1/4.
+ */
+static uint64
+skiplist_random_height(skiplist *sl, threadid tid)
+{
+   skiplist_cursor *cursor = &sl->cursor[tid];
+   if (cursor->rand == 0) {
+      cursor->rand = (tid + 1) * 0x9e3779b97f4a7c15UL;
+   }
+   uint64 x = cursor->rand;
+   x ^= x << 13;
+   x ^= x >> 7;
+   x ^= x << 17;
+   cursor->rand = x;
+
+   uint64 height = 1;
+   while (height < SKIPLIST_MAX_HEIGHT && (x & 3) == 0) {
+      height++;
+      x >>= 2;
+   }
+   return height;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Search
+ *-----------------------------------------------------------------------------
+ */
+
+/*
+ * Starting from prev, moves forward at the given level to the last node with
+ * a key smaller than target. Returns that node, and its successor in *succ.
+ */
+static inline skiplist_node *
+skiplist_find_at_level(skiplist       *sl,
+                       skiplist_node  *prev,
+                       key             target,
+                       uint64          level,
+                       skiplist_node **succ)
+{
+   skiplist_node *next = prev->next[level];
+   while (next != NULL && skiplist_compare(sl, next, target) < 0) {
+      prev = next;
+      next = prev->next[level];
+   }
+   *succ = next;
+   return prev;
+}
+
+static void
+skiplist_find_splice(skiplist      *sl,
+                     key            target,
+                     skiplist_node *prev[],
+                     skiplist_node *succ[])
+{
+   skiplist_node *node = sl->head;
+   for (int64 level = SKIPLIST_MAX_HEIGHT - 1; level >= 0; level--) {
+      node = skiplist_find_at_level(sl, node, target, level, &succ[level]);
+      prev[level] = node;
+   }
+}
+
+/*
+ * Returns the first node with a key greater than or equal to target.
+ */
+static skiplist_node *
+skiplist_find_greater_or_equal(skiplist *sl, key target)
+{
+   skiplist_node *node = sl->head;
+   skiplist_node *succ = NULL;
+   for (int64 level = SKIPLIST_MAX_HEIGHT - 1; level >= 0; level--) {
+      node = skiplist_find_at_level(sl, node, target, level, &succ);
+   }
+   return succ;
+}
+
+/*
+ * Returns the last node with a key smaller than target, or NULL if there is
+ * none.
+ */
+static skiplist_node *
+skiplist_find_less_than(skiplist *sl, key target)
+{
+   skiplist_node *node = sl->head;
+   skiplist_node *succ = NULL;
+   for (int64 level = SKIPLIST_MAX_HEIGHT - 1; level >= 0; level--) {
+      node = skiplist_find_at_level(sl, node, target, level, &succ);
+   }
+   return node == sl->head ? NULL : node;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Insertion
+ *-----------------------------------------------------------------------------
+ */
+
+/*
+ * Pushes a new version of an existing key. Returns its generation, which
+ * orders the versions of the key.
+ */
+static uint64
+skiplist_push_version(skiplist_node *node, skiplist_version *version)
+{
+   skiplist_version *newest;
+   do {
+      newest              = node->versions;
+      version->next       = newest;
+      version->generation = newest->generation + 1;
+   } while (!__sync_bool_compare_and_swap(&node->versions, newest, version));
+   return version->generation;
+}
+
+platform_status
+skiplist_insert(skiplist *sl,
+                threadid  tid,
+                key       tuple_key,
+                message   msg,
+                uint64   *generation,
+                bool     *was_unique)
+{
+   debug_assert(key_is_user_key(tuple_key));
+
+   skiplist_version *version =
+      skiplist_alloc(sl, tid, sizeof(*version) + message_length(msg));
+   if (version == NULL) {
+      return STATUS_NO_MEMORY;
+   }
+   version->type   = message_class(msg);
+   version->length = message_length(msg);
+   memcpy(version->data, message_data(msg), message_length(msg));
+
+   skiplist_node *prev[SKIPLIST_MAX_HEIGHT];
+   skiplist_node *succ[SKIPLIST_MAX_HEIGHT];
+   skiplist_find_splice(sl, tuple_key, prev, succ);
+   if (skiplist_node_has_key(sl, succ[0], tuple_key)) {
+      *generation = skiplist_push_version(succ[0], version);
+      *was_unique = FALSE;
+      return STATUS_OK;
+   }
+
+   uint64         height = skiplist_random_height(sl, tid);
+   uint64         length = key_length(tuple_key);
+   skiplist_node *node   = skiplist_alloc(
+      sl, tid, sizeof(*node) + height * sizeof(node->next[0]) + length);
+   if (node == NULL) {
+      return STATUS_NO_MEMORY;
+   }
+   node->height     = height;
+   node->key_length = length;
+   memcpy((char *)&node->next[height], key_data(tuple_key), length);
+   version->next       = NULL;
+   version->generation = 0;
+   node->versions      = version;
+
+   // Linking the bottom level makes the node visible
+   while (TRUE) {
+      node->next[0] = succ[0];
+      if (__sync_bool_compare_and_swap(&prev[0]->next[0], succ[0], node)) {
+         break;
+      }
+      prev[0] = skiplist_find_at_level(sl, prev[0], tuple_key, 0, &succ[0]);
+      if (skiplist_node_has_key(sl, succ[0], tuple_key)) {
+         // Lost a race with an insert of the same key, abandon node
+         *generation = skiplist_push_version(succ[0], version);
+         *was_unique = FALSE;
+         return STATUS_OK;
+      }
+   }
+
+   for (uint64 level = 1; level < height; level++) {
+      while (TRUE) {
+         node->next[level] = succ[level];
+         if (__sync_bool_compare_and_swap(
+                &prev[level]->next[level], succ[level], node))
+         {
+            break;
+         }
+         prev[level] = skiplist_find_at_level(
+            sl, prev[level], tuple_key, level, &succ[level]);
+      }
+   }
+
+   *generation = 0;
+   *was_unique = TRUE;
+   return STATUS_OK;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Lookups
+ *-----------------------------------------------------------------------------
+ */
+
+/*
+ * Merges the versions of node, newest first, into data, which holds any
+ * newer message for the key. Stops at the first definitive message.
+ */
+static platform_status
+skiplist_merge_versions(skiplist          *sl,
+                        skiplist_node     *node,
+                        merge_accumulator *data)
+{
+   key node_key = skiplist_node_key(node);
+   for (skiplist_version *version = node->versions;
+        version != NULL && !merge_accumulator_is_definitive(data);
+        version = version->next)
+   {
+      message msg = skiplist_version_message(version);
+      if (merge_accumulator_is_null(data)) {
+         if (!merge_accumulator_copy_message(data, msg)) {
+            return STATUS_NO_MEMORY;
+         }
+      } else if (data_merge_tuples(sl->cfg, node_key, msg, data)) {
+         return STATUS_NO_MEMORY;
+      }
+   }
+   return STATUS_OK;
+}
+
+platform_status
+skiplist_lookup_and_merge(skiplist          *sl,
+                          key                target,
+                          merge_accumulator *data,
+                          bool              *local_found)
+{
+   skiplist_node *node = skiplist_find_greater_or_equal(sl, target);
+   *local_found        = skiplist_node_has_key(sl, node, target);
+   if (!*local_found) {
+      return STATUS_OK;
+   }
+   return skiplist_merge_versions(sl, node, data);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Iterator
+ *
+ *      Walks the bottom level. Keys inserted concurrently behind the
+ *      iterator are missed, those ahead of it are returned.
+ *-----------------------------------------------------------------------------
+ */
+
+/*
+ * Sets curr_msg to the merged message of curr, or curr to NULL if it is past
+ * max_key, or below min_key for reverse iterators.
+ */
+static platform_status
+skiplist_iterator_load(skiplist_iterator *itor)
+{
+   skiplist *sl = itor->sl;
+   if (itor->curr != NULL
+       && (itor->reverse
+              ? skiplist_compare(sl, itor->curr, itor->min_key) < 0
+              : skiplist_compare(sl, itor->curr, itor->max_key) >= 0))
+   {
+      itor->curr = NULL;
+   }
+   if (itor->curr == NULL) {
+      return STATUS_OK;
+   }
+
+   skiplist_version *newest = itor->curr->versions;
+   if (newest->next == NULL || newest->type != MESSAGE_TYPE_UPDATE) {
+      itor->curr_msg = skiplist_version_message(newest);
+      return STATUS_OK;
+   }
+
+   merge_accumulator_set_to_null(&itor->merged);
+   platform_status rc = skiplist_merge_versions(sl, itor->curr, &itor->merged);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   itor->curr_msg = merge_accumulator_to_message(&itor->merged);
+   return STATUS_OK;
+}
+
+static void
+skiplist_iterator_get_curr(iterator *base_itor, key *curr_key, message *msg)
+{
+   skiplist_iterator *itor = (skiplist_iterator *)base_itor;
+   debug_assert(itor->curr != NULL);
+   *curr_key = skiplist_node_key(itor->curr);
+   *msg      = itor->curr_msg;
+}
+
+static platform_status
+skiplist_iterator_at_end(iterator *base_itor, bool *at_end)
+{
+   skiplist_iterator *itor = (skiplist_iterator *)base_itor;
+   *at_end                 = itor->curr == NULL;
+   return STATUS_OK;
+}
+
+static platform_status
+skiplist_iterator_advance(iterator *base_itor)
+{
+   skiplist_iterator *itor = (skiplist_iterator *)base_itor;
+   debug_assert(itor->curr != NULL);
+   if (itor->reverse) {
+      // there are no back links, so search for the predecessor
+      itor->curr =
+         skiplist_find_less_than(itor->sl, skiplist_node_key(itor->curr));
+   } else {
+      itor->curr = itor->curr->next[0];
+   }
+   return skiplist_iterator_load(itor);
+}
+
+/*
+ * Repositions the iterator at the first key >= target, or at the largest key
+ * < target for reverse iterators.
+ */
+static platform_status
+skiplist_iterator_seek(iterator *base_itor, key target)
+{
+   skiplist_iterator *itor = (skiplist_iterator *)base_itor;
+   if (itor->reverse) {
+      itor->curr = skiplist_find_less_than(itor->sl, target);
+   } else {
+      itor->curr = skiplist_find_greater_or_equal(itor->sl, target);
+   }
+   return skiplist_iterator_load(itor);
+}
+
+static platform_status
+skiplist_iterator_prev_key(iterator   *base_itor,
+                           key         target,
+                           key_buffer *prev,
+                           bool       *found)
+{
+   skiplist_iterator *itor = (skiplist_iterator *)base_itor;
+   skiplist_node     *node = skiplist_find_less_than(itor->sl, target);
+   *found                  = FALSE;
+   if (node == NULL) {
+      return STATUS_OK;
+   }
+   platform_status rc = key_buffer_copy_key(prev, skiplist_node_key(node));
+   *found             = SUCCESS(rc);
+   return rc;
+}
+
+static void
+skiplist_iterator_print(iterator *base_itor)
+{
+   skiplist_iterator *itor = (skiplist_iterator *)base_itor;
+   platform_default_log("########################################\n");
+   platform_default_log("## skiplist_itor: %p\n", itor);
+   platform_default_log("## skiplist: %p curr: %p\n", itor->sl, itor->curr);
+   if (itor->curr != NULL) {
+      char key_str[128];
+      data_key_to_string(itor->sl->cfg,
+                         skiplist_node_key(itor->curr),
+                         key_str,
+                         sizeof(key_str));
+      platform_default_log("## key: %s\n", key_str);
+   }
+}
+
+const static iterator_ops skiplist_iterator_ops = {
+   .get_curr = skiplist_iterator_get_curr,
+   .at_end   = skiplist_iterator_at_end,
+   .advance  = skiplist_iterator_advance,
+   .print    = skiplist_iterator_print,
+   .seek     = skiplist_iterator_seek,
+   .prev_key = skiplist_iterator_prev_key,
+};
+
+/*
+ * Caller must guarantee that max_key remains valid until the iterator is
+ * deinitialized.
+ */
+platform_status
+skiplist_iterator_init(skiplist          *sl,
+                       skiplist_iterator *itor,
+                       key                min_key,
+                       key                max_key)
+{
+   debug_assert(!key_is_null(min_key) && !key_is_null(max_key));
+
+   ZERO_CONTENTS(itor);
+   itor->super.ops = &skiplist_iterator_ops;
+   itor->sl        = sl;
+   itor->max_key   = max_key;
+   merge_accumulator_init(&itor->merged, sl->heap_id);
+   itor->curr = skiplist_find_greater_or_equal(sl, min_key);
+   return skiplist_iterator_load(itor);
+}
+
+/*
+ * Initializes an iterator returning the keys in [min_key, max_key) in
+ * descending order. Caller must guarantee that min_key remains valid until
+ * the iterator is deinitialized.
+ */
+platform_status
+skiplist_iterator_init_reverse(skiplist          *sl,
+                               skiplist_iterator *itor,
+                               key                min_key,
+                               key                max_key)
+{
+   debug_assert(!key_is_null(min_key) && !key_is_null(max_key));
+
+   ZERO_CONTENTS(itor);
+   itor->super.ops = &skiplist_iterator_ops;
+   itor->sl        = sl;
+   itor->reverse   = TRUE;
+   itor->min_key   = min_key;
+   itor->max_key   = max_key;
+   merge_accumulator_init(&itor->merged, sl->heap_id);
+   itor->curr = skiplist_find_less_than(sl, max_key);
+   return skiplist_iterator_load(itor);
+}
+
+void
+skiplist_iterator_deinit(skiplist_iterator *itor)
+{
+   merge_accumulator_deinit(&itor->merged);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Create, destroy, reset
+ *-----------------------------------------------------------------------------
+ */
+platform_status
+skiplist_create(platform_heap_id   hid,
+                const data_config *cfg,
+                skiplist         **out_sl)
+{
+   skiplist *sl = TYPED_ZALLOC(hid, sl);
+   if (sl == NULL) {
+      return STATUS_NO_MEMORY;
+   }
+   sl->head =
+      TYPED_FLEXIBLE_STRUCT_ZALLOC(hid, sl->head, next, SKIPLIST_MAX_HEIGHT);
+   if (sl->head == NULL) {
+      platform_free(hid, sl);
+      return STATUS_NO_MEMORY;
+   }
+   sl->head->height = SKIPLIST_MAX_HEIGHT;
+   sl->heap_id      = hid;
+   sl->cfg          = cfg;
+   *out_sl          = sl;
+   return STATUS_OK;
+}
+
+/*
+ * Empties the skiplist. Caller must guarantee there are no concurrent
+ * accesses.
+ */
+void
+skiplist_reset(skiplist *sl)
+{
+   skiplist_free_blocks(sl);
+   for (uint64 level = 0; level < SKIPLIST_MAX_HEIGHT; level++) {
+      sl->head->next[level] = NULL;
+   }
+   for (threadid tid = 0; tid < MAX_THREADS; tid++) {
+      sl->cursor[tid].next = NULL;
+      sl->cursor[tid].end  = NULL;
+   }
+}
+
+void
+skiplist_destroy(skiplist **sl)
+{
+   platform_heap_id hid = (*sl)->heap_id;
+   skiplist_free_blocks(*sl);
+   platform_free(hid, (*sl)->head);
+   platform_free(hid, *sl);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Debugging
+ *-----------------------------------------------------------------------------
+ */
+
+/*
+ * Checks that every level is sorted and only links nodes which are tall
+ * enough.
+ */
+bool
+skiplist_verify(skiplist *sl)
+{
+   for (uint64 level = 0; level < SKIPLIST_MAX_HEIGHT; level++) {
+      skiplist_node *node = sl->head->next[level];
+      while (node != NULL) {
+         if (node->height <= level || node->versions == NULL) {
+            platform_error_log("skiplist_verify: bad node %p at level %lu\n",
+                               node,
+                               level);
+            return FALSE;
+         }
+         skiplist_node *next = node->next[level];
+         if (next != NULL
+             && skiplist_compare(sl, node, skiplist_node_key(next)) >= 0)
+         {
+            platform_error_log("skiplist_verify: out of order at level %lu\n",
+                               level);
+            return FALSE;
+         }
+         node = next;
+      }
+   }
+   return TRUE;
+}
+
+void
+skiplist_print(platform_log_handle *log_handle, skiplist *sl)
+{
+   platform_log(log_handle, "skiplist %p: %lu bytes\n", sl, sl->bytes);
+   for (skiplist_node *node = sl->head->next[0]; node != NULL;
+        node                = node->next[0])
+   {
+      char key_str[128];
+      char message_str[128];
+      data_key_to_string(
+         sl->cfg, skiplist_node_key(node), key_str, sizeof(key_str));
+      data_message_to_string(sl->cfg,
+                             skiplist_version_message(node->versions),
+                             message_str,
+                             sizeof(message_str));
+      platform_log(log_handle,
+                   "   %s -- %s (height %u, generation %lu)\n",
+                   key_str,
+                   message_str,
+                   node->height,
+                   node->versions->generation);
+   }
+}
@@ -0,0 +1,116 @@
+// Copyright 2018-2021 VMware, Inc.
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * skiplist.h --
+ *
+ *     This file contains the interface for a lock-free, insert-only skiplist
+ *     in heap memory, used as an alternative memtable backend (see
+ *     memtable.h).
+ *
+ *     Inserts link new nodes with compare-and-swap, one level at a time from
+ *     the bottom up, so writers never block each other or readers. Each key
+ *     has a single node holding a stack of message versions, newest first;
+ *     updates push a new version instead of merging in place, and readers
+ *     merge the versions of a key as they go.
+ *
+ *     Nodes and versions are bump-allocated from per-thread blocks of heap
+ *     memory which are only released all at once, by skiplist_reset or
+ *     skiplist_destroy, so there is no reclamation while the skiplist is in
+ *     use.
+ */
+
+#ifndef __SKIPLIST_H
+#define __SKIPLIST_H
+
+#include "platform.h"
+#include "data_internal.h"
+#include "iterator.h"
+
+#define SKIPLIST_MAX_HEIGHT (12)
+
+typedef struct skiplist_node  skiplist_node;
+typedef struct skiplist_block skiplist_block;
+
+/*
+ * Per-thread allocation state, indexed by threadid.
+ */
+typedef struct skiplist_cursor {
+   char  *next;
+   char  *end;
+   uint64 rand; // random state for node heights
+} PLATFORM_CACHELINE_ALIGNED skiplist_cursor;
+
+typedef struct skiplist {
+   platform_heap_id          heap_id;
+   const data_config        *cfg;
+   skiplist_node            *head;
+   skiplist_block *volatile  blocks;
+   volatile uint64           bytes; // heap memory taken by blocks
+   skiplist_cursor           cursor[MAX_THREADS];
+} skiplist;
+
+typedef struct skiplist_iterator {
+   iterator          super;
+   skiplist         *sl;
+   bool              reverse; // returns keys in descending order
+   key               min_key;
+   key               max_key;
+   skiplist_node    *curr;
+   message           curr_msg;
+   merge_accumulator merged; // holds curr_msg when versions had to be merged
+} skiplist_iterator;
+
+platform_status
+skiplist_create(platform_heap_id   hid,
+                const data_config *cfg,
+                skiplist         **out_sl);
+
+void
+skiplist_destroy(skiplist **sl);
+
+void
+skiplist_reset(skiplist *sl);
+
+platform_status
+skiplist_insert(skiplist *sl,
+                threadid  tid,
+                key       tuple_key,
+                message   msg,
+                uint64   *generation,
+                bool     *was_unique);
+
+platform_status
+skiplist_lookup_and_merge(skiplist          *sl,
+                          key                target,
+                          merge_accumulator *data,
+                          bool              *local_found);
+
+platform_status
+skiplist_iterator_init(skiplist          *sl,
+                       skiplist_iterator *itor,
+                       key                min_key,
+                       key                max_key);
+
+platform_status
+skiplist_iterator_init_reverse(skiplist          *sl,
+                               skiplist_iterator *itor,
+                               key                min_key,
+                               key                max_key);
+
+void
+skiplist_iterator_deinit(skiplist_iterator *itor);
+
+bool
+skiplist_verify(skiplist *sl);
+
+void
+skiplist_print(platform_log_handle *log_handle, skiplist *sl);
+
+static inline uint64
+skiplist_bytes(skiplist *sl)
+{
+   return sl->bytes;
+}
+
+#endif // __SKIPLIST_H
@@ -20,6 +20,7 @@
 #include "trunk.h"
 #include "btree_private.h"
 #include "shard_log.h"
+#include "pcq.h"
 #include "poison.h"
 
 const char *BUILD_VERSION = "splinterdb_build_version " GIT_VERSION;
@@ -41,6 +42,9 @@ typedef struct splinterdb {
    allocator_root_id    trunk_id;
    trunk_config         trunk_cfg;
    trunk_handle        *spl;
+   uint8                num_bg_threads[NUM_TASK_TYPES];
+   // max_inflight of each thread's async lookup handles, summed
+   uint32              *lookup_async_reserved;
    platform_heap_handle heap_handle; // for platform_buffer_create
    platform_heap_id     heap_id;
    data_config         *data_cfg;
@@ -94,6 +98,9 @@ splinterdb_config_set_defaults(splinterdb_config *cfg)
    if (!cfg->memtable_capacity) {
       cfg->memtable_capacity = MiB_TO_B(24);
    }
+   if (!cfg->memtable_num_shards) {
+      cfg->memtable_num_shards = 1;
+   }
    if (!cfg->fanout) {
       cfg->fanout = 8;
    }
@@ -161,6 +168,28 @@ splinterdb_init_config(const splinterdb_config *kvs_cfg, // IN
    memcpy(&cfg, kvs_cfg, sizeof(cfg));
    splinterdb_config_set_defaults(&cfg);
 
+   if (cfg.memtable_num_shards > MEMTABLE_MAX_SHARDS) {
+      platform_error_log("memtable_num_shards (%lu) must be at most %d.\n",
+                         cfg.memtable_num_shards,
+                         MEMTABLE_MAX_SHARDS);
+      return STATUS_BAD_PARAM;
+   }
+
+   if ((cfg.num_memtable_bg_threads == 0) != (cfg.num_normal_bg_threads == 0)
+       || cfg.num_memtable_bg_threads + cfg.num_normal_bg_threads
+             >= MAX_THREADS / 2)
+   {
+      platform_error_log("num_memtable_bg_threads (%lu) and "
+                         "num_normal_bg_threads (%lu) must both be 0, or "
+                         "both be set and add up to less than %d.\n",
+                         cfg.num_memtable_bg_threads,
+                         cfg.num_normal_bg_threads,
+                         MAX_THREADS / 2);
+      return STATUS_BAD_PARAM;
+   }
+   kvs->num_bg_threads[TASK_TYPE_MEMTABLE] = cfg.num_memtable_bg_threads;
+   kvs->num_bg_threads[TASK_TYPE_NORMAL]   = cfg.num_normal_bg_threads;
+
    kvs->heap_handle = cfg.heap_handle;
    kvs->heap_id     = cfg.heap_id;
 
@@ -171,6 +200,8 @@ splinterdb_init_config(const splinterdb_config *kvs_cfg, // IN
                   cfg.io_perms,
                   cfg.io_async_queue_depth,
                   cfg.filename);
+   kvs->io_cfg.use_uring    = cfg.io_use_uring;
+   kvs->io_cfg.uring_sqpoll = cfg.io_uring_sqpoll;
 
    // Validate IO-configuration parameters
    rc = laio_config_valid(&kvs->io_cfg);
@@ -187,6 +218,8 @@ splinterdb_init_config(const splinterdb_config *kvs_cfg, // IN
                           cfg.use_stats);
 
    shard_log_config_init(&kvs->log_cfg, &kvs->cache_cfg.super, kvs->data_cfg);
+   kvs->log_cfg.group_commit_window_ns =
+      USEC_TO_NSEC(cfg.log_group_commit_window_us);
 
    trunk_config_init(&kvs->trunk_cfg,
                      &kvs->cache_cfg.super,
@@ -203,6 +236,19 @@ splinterdb_init_config(const splinterdb_config *kvs_cfg, // IN
                      cfg.use_stats,
                      FALSE,
                      NULL);
+   kvs->trunk_cfg.use_write_throttle  = !cfg.disable_write_throttle;
+   if (cfg.write_throttle_soft_tasks) {
+      kvs->trunk_cfg.throttle_soft_tasks = cfg.write_throttle_soft_tasks;
+   }
+   if (cfg.write_throttle_hard_tasks) {
+      kvs->trunk_cfg.throttle_hard_tasks = cfg.write_throttle_hard_tasks;
+   }
+   kvs->trunk_cfg.num_replay_threads  = cfg.log_replay_threads;
+   kvs->trunk_cfg.checkpoint_interval = cfg.log_checkpoint_interval;
+   if (cfg.memtable_use_skiplist) {
+      kvs->trunk_cfg.mt_cfg.type = MEMTABLE_TYPE_SKIPLIST;
+   }
+   kvs->trunk_cfg.mt_cfg.num_shards = cfg.memtable_num_shards;
    return STATUS_OK;
 }
 
@@ -226,6 +272,12 @@ splinterdb_create_or_open(const splinterdb_config *kvs_cfg,      // IN
       status = STATUS_NO_MEMORY;
       return platform_status_to_int(status);
    }
+   kvs->lookup_async_reserved = TYPED_ARRAY_ZALLOC(
+      kvs_cfg->heap_id, kvs->lookup_async_reserved, MAX_THREADS);
+   if (kvs->lookup_async_reserved == NULL) {
+      status = STATUS_NO_MEMORY;
+      goto deinit_kvhandle;
+   }
 
    status = splinterdb_init_config(kvs_cfg, kvs);
    if (!SUCCESS(status)) {
@@ -245,14 +297,14 @@ splinterdb_create_or_open(const splinterdb_config *kvs_cfg,      // IN
       goto deinit_kvhandle;
    }
 
-   uint8 num_bg_threads[NUM_TASK_TYPES] = {0}; // no bg threads
+   bool use_bg_threads = kvs->num_bg_threads[TASK_TYPE_NORMAL] != 0;
 
    status = task_system_create(kvs->heap_id,
                                &kvs->io_handle,
                                &kvs->task_sys,
                                TRUE,
-                               FALSE,
-                               num_bg_threads,
+                               use_bg_threads,
+                               kvs->num_bg_threads,
                                trunk_get_scratch_size());
    if (!SUCCESS(status)) {
       platform_error_log(
@@ -333,6 +385,9 @@ deinit_system:
 deinit_iohandle:
    io_handle_deinit(&kvs->io_handle);
 deinit_kvhandle:
+   if (kvs->lookup_async_reserved != NULL) {
+      platform_free(kvs_cfg->heap_id, kvs->lookup_async_reserved);
+   }
    platform_free(kvs_cfg->heap_id, kvs);
 
    return platform_status_to_int(status);
@@ -379,6 +434,7 @@ splinterdb_close(splinterdb **kvs_in) // IN
    io_handle_deinit(&kvs->io_handle);
    task_system_destroy(kvs->heap_id, &kvs->task_sys);
 
+   platform_free(kvs->heap_id, kvs->lookup_async_reserved);
    platform_free(kvs->heap_id, kvs);
    *kvs_in = (splinterdb *)NULL;
 }
@@ -473,6 +529,110 @@ splinterdb_delete(const splinterdb *kvsb, slice user_key)
    return splinterdb_insert_message(kvsb, user_key, DELETE_MESSAGE);
 }
 
+int
+splinterdb_delete_range(const splinterdb *kvsb,
+                        slice             user_start_key,
+                        slice             user_end_key)
+{
+   platform_assert(kvsb != NULL);
+   key start_key = slice_is_null(user_start_key)
+                      ? NEGATIVE_INFINITY_KEY
+                      : key_create_from_slice(user_start_key);
+   key end_key   = slice_is_null(user_end_key)
+                      ? POSITIVE_INFINITY_KEY
+                      : key_create_from_slice(user_end_key);
+   platform_status status = trunk_delete_range(kvsb->spl, start_key, end_key);
+   return platform_status_to_int(status);
+}
+
+/*
+ * Adapts the caller's splinterdb_bulk_load_next_fn to an iterator for
+ * trunk_bulk_load.
+ */
+typedef struct splinterdb_bulk_load_iterator {
+   iterator                     super;
+   splinterdb_bulk_load_next_fn next;
+   void                        *arg;
+   bool                         at_end;
+   slice                        key;
+   slice                        value;
+} splinterdb_bulk_load_iterator;
+
+static void
+splinterdb_bulk_load_iterator_get_curr(iterator *itor,
+                                       key      *curr_key,
+                                       message  *msg)
+{
+   splinterdb_bulk_load_iterator *bl_itor =
+      (splinterdb_bulk_load_iterator *)itor;
+   *curr_key = key_create_from_slice(bl_itor->key);
+   *msg      = message_create(MESSAGE_TYPE_INSERT, bl_itor->value);
+}
+
+static platform_status
+splinterdb_bulk_load_iterator_at_end(iterator *itor, bool *at_end)
+{
+   splinterdb_bulk_load_iterator *bl_itor =
+      (splinterdb_bulk_load_iterator *)itor;
+   *at_end = bl_itor->at_end;
+   return STATUS_OK;
+}
+
+static platform_status
+splinterdb_bulk_load_iterator_advance(iterator *itor)
+{
+   splinterdb_bulk_load_iterator *bl_itor =
+      (splinterdb_bulk_load_iterator *)itor;
+   bl_itor->at_end =
+      !bl_itor->next(bl_itor->arg, &bl_itor->key, &bl_itor->value);
+   return STATUS_OK;
+}
+
+const static iterator_ops splinterdb_bulk_load_iterator_ops = {
+   .get_curr = splinterdb_bulk_load_iterator_get_curr,
+   .at_end   = splinterdb_bulk_load_iterator_at_end,
+   .advance  = splinterdb_bulk_load_iterator_advance,
+};
+
+int
+splinterdb_bulk_load(const splinterdb            *kvs,
+                     splinterdb_bulk_load_next_fn next,
+                     void                        *arg)
+{
+   return splinterdb_bulk_load_runs(kvs, 1, next, &arg);
+}
+
+int
+splinterdb_bulk_load_runs(const splinterdb            *kvs,
+                          uint64                       num_runs,
+                          splinterdb_bulk_load_next_fn next,
+                          void                        *run_args[])
+{
+   platform_assert(kvs != NULL);
+   platform_heap_id               hid = kvs->spl->heap_id;
+   splinterdb_bulk_load_iterator *bl_itor =
+      TYPED_ARRAY_MALLOC(hid, bl_itor, num_runs);
+   iterator **runs = TYPED_ARRAY_MALLOC(hid, runs, num_runs);
+   if (bl_itor == NULL || runs == NULL) {
+      platform_free(hid, bl_itor);
+      platform_free(hid, runs);
+      return platform_status_to_int(STATUS_NO_MEMORY);
+   }
+   for (uint64 run_no = 0; run_no < num_runs; run_no++) {
+      bl_itor[run_no] = (splinterdb_bulk_load_iterator){
+         .super.ops = &splinterdb_bulk_load_iterator_ops,
+         .next      = next,
+         .arg       = run_args[run_no],
+      };
+      splinterdb_bulk_load_iterator_advance(&bl_itor[run_no].super);
+      runs[run_no] = &bl_itor[run_no].super;
+   }
+   platform_status status = trunk_bulk_load_runs(kvs->spl, num_runs, runs);
+   platform_free(hid, runs);
+   platform_free(hid, bl_itor);
+   return platform_status_to_int(status);
+}
+
 int
 splinterdb_update(const splinterdb *kvsb, slice user_key, slice update)
 {
@@ -480,6 +640,24 @@ splinterdb_update(const splinterdb *kvsb, slice user_key, slice update)
    return splinterdb_insert_message(kvsb, user_key, msg);
 }
 
+int
+splinterdb_sync(const splinterdb *kvs)
+{
+   platform_assert(kvs != NULL);
+   platform_status status = trunk_sync(kvs->spl);
+   return platform_status_to_int(status);
+}
+
+int
+splinterdb_insert_sync(const splinterdb *kvsb, slice user_key, slice value)
+{
+   int rc = splinterdb_insert(kvsb, user_key, value);
+   if (rc != 0) {
+      return rc;
+   }
+   return splinterdb_sync(kvsb);
+}
+
 /*
  *-----------------------------------------------------------------------------
  * _splinterdb_lookup_result structure --
@@ -576,16 +754,287 @@ splinterdb_lookup(const splinterdb         *kvs, // IN
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ * splinterdb_lookup_batch --
+ *
+ *      Lookup a batch of tuples, TRUNK_LOOKUP_BATCH_MAX keys at a time.
+ *
+ * Results:
+ *      0 on success (including keys not found), otherwise an error number.
+ *
+ * Side effects:
+ *      None.
+ *-----------------------------------------------------------------------------
+ */
+int
+splinterdb_lookup_batch(const splinterdb         *kvs,      // IN
+                        uint64                    num_keys, // IN
+                        const slice              *keys,     // IN
+                        splinterdb_lookup_result *results)  // IN/OUT
+{
+   key                targets[TRUNK_LOOKUP_BATCH_MAX];
+   merge_accumulator *values[TRUNK_LOOKUP_BATCH_MAX];
+
+   platform_assert(kvs != NULL);
+   for (uint64 start = 0; start < num_keys; start += TRUNK_LOOKUP_BATCH_MAX) {
+      uint64 count = MIN(num_keys - start, TRUNK_LOOKUP_BATCH_MAX);
+      for (uint64 i = 0; i < count; i++) {
+         _splinterdb_lookup_result *_result =
+            (_splinterdb_lookup_result *)&results[start + i];
+         targets[i] = key_create_from_slice(keys[start + i]);
+         values[i]  = &_result->value;
+      }
+      platform_status status =
+         trunk_lookup_batch(kvs->spl, count, targets, values);
+      if (!SUCCESS(status)) {
+         return platform_status_to_int(status);
+      }
+   }
+   return 0;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Async lookups
+ *
+ *      An async lookup handle is a per-thread pool of trunk_async_ctxts. Free
+ *      contexts live on avail_q. When an IO issued on behalf of a context
+ *      completes, the IO completion callback (which may run on any thread
+ *      that reaps IO) enqueues the context on ready_q. The owning thread is
+ *      the single consumer of ready_q and resumes those lookups from
+ *      splinterdb_lookup_async_poll().
+ *-----------------------------------------------------------------------------
+ */
+typedef struct splinterdb_lookup_async_ctxt {
+   trunk_async_ctxt           ctxt;
+   pcq                       *ready_q;
+   key_buffer                 key;
+   splinterdb_lookup_result  *result;
+   splinterdb_lookup_async_cb cb;
+   void                      *cb_arg;
+} splinterdb_lookup_async_ctxt;
+
+struct splinterdb_lookup_async_handle {
+   const splinterdb            *kvs;
+   threadid                     tid;
+   uint32                       max_inflight;
+   uint32                       num_inflight;
+   pcq                         *ready_q;
+   pcq                         *avail_q;
+   splinterdb_lookup_async_ctxt ctxt[];
+};
+
+_Static_assert(MAX_THREADS / CC_RC_WIDTH * SPLINTERDB_LOOKUP_ASYNC_MAX_INFLIGHT
+                  < MAX_READ_REFCOUNT,
+               "parked async lookups may overflow page ref counts");
+
+/*
+ * Called from IO completion context when a page needed by a parked lookup
+ * has been loaded. This is the producer end of ready_q.
+ */
+static void
+splinterdb_lookup_async_callback(trunk_async_ctxt *trunk_ctxt)
+{
+   splinterdb_lookup_async_ctxt *ctxt =
+      container_of(trunk_ctxt, splinterdb_lookup_async_ctxt, ctxt);
+   pcq_enqueue(ctxt->ready_q, ctxt);
+}
+
+int
+splinterdb_lookup_async_handle_create(
+   const splinterdb                *kvs,          // IN
+   uint32                           max_inflight, // IN
+   splinterdb_lookup_async_handle **handle        // OUT
+)
+{
+   platform_assert(kvs != NULL);
+   threadid tid = platform_get_tid();
+   if (max_inflight == 0
+       || max_inflight > SPLINTERDB_LOOKUP_ASYNC_MAX_INFLIGHT
+                            - kvs->lookup_async_reserved[tid])
+   {
+      return platform_status_to_int(STATUS_BAD_PARAM);
+   }
+
+   splinterdb_lookup_async_handle *h =
+      TYPED_FLEXIBLE_STRUCT_ZALLOC(kvs->heap_id, h, ctxt, max_inflight);
+   if (h == NULL) {
+      return platform_status_to_int(STATUS_NO_MEMORY);
+   }
+   h->kvs          = kvs;
+   h->tid          = tid;
+   h->max_inflight = max_inflight;
+   h->avail_q      = pcq_alloc(kvs->heap_id, max_inflight);
+   h->ready_q      = pcq_alloc(kvs->heap_id, max_inflight);
+   if (h->avail_q == NULL || h->ready_q == NULL) {
+      if (h->avail_q != NULL) {
+         pcq_free(kvs->heap_id, h->avail_q);
+      }
+      if (h->ready_q != NULL) {
+         pcq_free(kvs->heap_id, h->ready_q);
+      }
+      platform_free(kvs->heap_id, h);
+      return platform_status_to_int(STATUS_NO_MEMORY);
+   }
+
+   for (uint32 i = 0; i < max_inflight; i++) {
+      key_buffer_init(&h->ctxt[i].key, kvs->heap_id);
+      h->ctxt[i].ready_q = h->ready_q;
+      pcq_enqueue(h->avail_q, &h->ctxt[i]);
+   }
+   kvs->lookup_async_reserved[tid] += max_inflight;
+
+   *handle = h;
+   return 0;
+}
+
+void
+splinterdb_lookup_async_handle_destroy(splinterdb_lookup_async_handle *h)
+{
+   platform_assert(h->num_inflight == 0);
+   platform_assert(pcq_is_empty(h->ready_q));
+
+   h->kvs->lookup_async_reserved[h->tid] -= h->max_inflight;
+   platform_heap_id hid = h->kvs->heap_id;
+   for (uint32 i = 0; i < h->max_inflight; i++) {
+      key_buffer_deinit(&h->ctxt[i].key);
+   }
+   pcq_free(hid, h->avail_q);
+   pcq_free(hid, h->ready_q);
+   platform_free(hid, h);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * splinterdb_lookup_async_process_one --
+ *
+ *      (Re)invoke the trunk async lookup state machine on ctxt.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      If the lookup completes, ctxt is returned to avail_q and the user's
+ *      callback is invoked. If it needs to be retried, ctxt is put back on
+ *      ready_q.
+ *-----------------------------------------------------------------------------
+ */
+static void
+splinterdb_lookup_async_process_one(splinterdb_lookup_async_handle *h,
+                                    splinterdb_lookup_async_ctxt   *ctxt)
+{
+   _splinterdb_lookup_result *_result =
+      (_splinterdb_lookup_result *)ctxt->result;
+   cache_async_result res = trunk_lookup_async(
+      h->kvs->spl, key_buffer_key(&ctxt->key), &_result->value, &ctxt->ctxt);
+
+   switch (res) {
+      case async_locked:
+      case async_no_reqs:
+         pcq_enqueue(h->ready_q, ctxt);
+         break;
+      case async_io_started:
+         break;
+      case async_success:
+      {
+         /*
+          * Release the context before calling back, so that the callback
+          * may issue a new lookup on this handle.
+          */
+         splinterdb_lookup_result  *result = ctxt->result;
+         splinterdb_lookup_async_cb cb     = ctxt->cb;
+         void                      *cb_arg = ctxt->cb_arg;
+         h->num_inflight--;
+         pcq_enqueue(h->avail_q, ctxt);
+         cb(0, result, cb_arg);
+         break;
+      }
+      default:
+         platform_assert(0);
+   }
+}
+
+int
+splinterdb_lookup_async(splinterdb_lookup_async_handle *h,        // IN
+                        slice                           user_key, // IN
+                        splinterdb_lookup_result       *result,   // IN/OUT
+                        splinterdb_lookup_async_cb      callback, // IN
+                        void                           *arg       // IN
+)
+{
+   splinterdb_lookup_async_ctxt *ctxt;
+   platform_status               rc;
+
+   rc = pcq_dequeue(h->avail_q, (void **)&ctxt);
+   if (!SUCCESS(rc)) {
+      return EAGAIN;
+   }
+
+   rc = key_buffer_copy_slice(&ctxt->key, user_key);
+   if (!SUCCESS(rc)) {
+      pcq_enqueue(h->avail_q, ctxt);
+      return platform_status_to_int(rc);
+   }
+   trunk_async_ctxt_init(&ctxt->ctxt, splinterdb_lookup_async_callback);
+   ctxt->result = result;
+   ctxt->cb     = callback;
+   ctxt->cb_arg = arg;
+   h->num_inflight++;
+
+   splinterdb_lookup_async_process_one(h, ctxt);
+   return 0;
+}
+
+uint32
+splinterdb_lookup_async_poll(splinterdb_lookup_async_handle *h)
+{
+   if (h->num_inflight == 0) {
+      return 0;
+   }
+
+   cache_cleanup(h->kvs->spl->cc);
+
+   uint32 count = pcq_count(h->ready_q);
+   while (count-- > 0) {
+      splinterdb_lookup_async_ctxt *ctxt;
+      platform_status               rc;
+
+      rc = pcq_dequeue(h->ready_q, (void **)&ctxt);
+      if (!SUCCESS(rc)) {
+         // Something is ready, just can't be dequeued yet.
+         break;
+      }
+      splinterdb_lookup_async_process_one(h, ctxt);
+   }
+
+   return h->num_inflight;
+}
+
+void
+splinterdb_lookup_async_wait(splinterdb_lookup_async_handle *h)
+{
+   while (splinterdb_lookup_async_poll(h) != 0) {
+      platform_yield();
+   }
+}
+
+
 struct splinterdb_iterator {
    trunk_range_iterator sri;
    platform_status      last_rc;
    const splinterdb    *parent;
 };
 
-int
-splinterdb_iterator_init(const splinterdb     *kvs,           // IN
-                         splinterdb_iterator **iter,          // OUT
-                         slice                 user_start_key // IN
+/*
+ * Initializes an iterator over snapshot, or over the current data if snapshot
+ * is NULL.
+ */
+static int
+splinterdb_iterator_init_internal(const splinterdb     *kvs,           // IN
+                                  trunk_snapshot       *snapshot,      // IN
+                                  splinterdb_iterator **iter,          // OUT
+                                  slice                 user_start_key // IN
 )
 {
    splinterdb_iterator *it = TYPED_MALLOC(kvs->spl->heap_id, it);
@@ -604,10 +1053,85 @@ splinterdb_iterator_init(const splinterdb     *kvs,           // IN
       start_key = key_create_from_slice(user_start_key);
    }
 
-   platform_status rc = trunk_range_iterator_init(
-      kvs->spl, range_itor, start_key, POSITIVE_INFINITY_KEY, UINT64_MAX);
+   platform_status rc;
+   if (snapshot == NULL) {
+      rc = trunk_range_iterator_init(
+         kvs->spl, range_itor, start_key, POSITIVE_INFINITY_KEY, UINT64_MAX);
+   } else {
+      rc = trunk_snapshot_range_iterator_init(
+         snapshot, range_itor, start_key, POSITIVE_INFINITY_KEY, UINT64_MAX);
+   }
+   if (!SUCCESS(rc)) {
+      platform_free(kvs->spl->heap_id, it);
+      return platform_status_to_int(rc);
+   }
+   it->parent = kvs;
+
+   *iter = it;
+   return EXIT_SUCCESS;
+}
+
+int
+splinterdb_iterator_init(const splinterdb     *kvs,           // IN
+                         splinterdb_iterator **iter,          // OUT
+                         slice                 user_start_key // IN
+)
+{
+   return splinterdb_iterator_init_internal(kvs, NULL, iter, user_start_key);
+}
+
+int
+splinterdb_iterator_init_reverse(const splinterdb     *kvs,         // IN
+                                 splinterdb_iterator **iter,        // OUT
+                                 slice                 user_end_key // IN
+)
+{
+   splinterdb_iterator *it = TYPED_MALLOC(kvs->spl->heap_id, it);
+   if (it == NULL) {
+      platform_error_log("TYPED_MALLOC error\n");
+      return platform_status_to_int(STATUS_NO_MEMORY);
+   }
+   it->last_rc = STATUS_OK;
+
+   key end_key;
+   if (slice_is_null(user_end_key)) {
+      end_key = POSITIVE_INFINITY_KEY;
+   } else {
+      end_key = key_create_from_slice(user_end_key);
+   }
+
+   platform_status rc = trunk_range_iterator_init_reverse(
+      kvs->spl, &it->sri, NEGATIVE_INFINITY_KEY, end_key, UINT64_MAX);
+   if (!SUCCESS(rc)) {
+      platform_free(kvs->spl->heap_id, it);
+      return platform_status_to_int(rc);
+   }
+   it->parent = kvs;
+
+   *iter = it;
+   return EXIT_SUCCESS;
+}
+
+int
+splinterdb_iterator_init_prefix(const splinterdb     *kvs,   // IN
+                                splinterdb_iterator **iter,  // OUT
+                                slice                 prefix // IN
+)
+{
+   if (slice_is_null(prefix)) {
+      return EINVAL;
+   }
+   splinterdb_iterator *it = TYPED_MALLOC(kvs->spl->heap_id, it);
+   if (it == NULL) {
+      platform_error_log("TYPED_MALLOC error\n");
+      return platform_status_to_int(STATUS_NO_MEMORY);
+   }
+   it->last_rc = STATUS_OK;
+
+   platform_status rc = trunk_range_iterator_init_prefix(
+      kvs->spl, &it->sri, key_create_from_slice(prefix), UINT64_MAX);
    if (!SUCCESS(rc)) {
-      platform_free(kvs->spl->heap_id, *iter);
+      platform_free(kvs->spl->heap_id, it);
       return platform_status_to_int(rc);
    }
    it->parent = kvs;
@@ -648,6 +1172,31 @@ splinterdb_iterator_next(splinterdb_iterator *kvi)
    kvi->last_rc   = iterator_advance(itor);
 }
 
+void
+splinterdb_iterator_seek(splinterdb_iterator *iter,    // IN
+                         slice                user_key // IN
+)
+{
+   if (!SUCCESS(iter->last_rc)) {
+      return;
+   }
+   key target;
+   if (slice_is_null(user_key) && iter->sri.reverse) {
+      target = POSITIVE_INFINITY_KEY;
+   } else if (slice_is_null(user_key)) {
+      target = NEGATIVE_INFINITY_KEY;
+   } else {
+      target = key_create_from_slice(user_key);
+   }
+   iter->last_rc = trunk_range_iterator_seek(&iter->sri.super, target);
+}
+
+void
+splinterdb_iterator_prev(splinterdb_iterator *iter)
+{
+   iter->last_rc = trunk_range_iterator_prev(&iter->sri);
+}
+
 int
 splinterdb_iterator_status(const splinterdb_iterator *iter)
 {
@@ -669,6 +1218,76 @@ splinterdb_iterator_get_current(splinterdb_iterator *iter,   // IN
    *outkey = key_slice(result_key);
 }
 
+struct splinterdb_snapshot {
+   trunk_snapshot   *snapshot;
+   const splinterdb *parent;
+};
+
+/*
+ *-----------------------------------------------------------------------------
+ * splinterdb_snapshot_create --
+ *
+ *      Takes a consistent snapshot of the data written so far.
+ *
+ * Results:
+ *      0 on success, otherwise an error number.
+ *
+ * Side effects:
+ *      The space of the data in the snapshot is not reclaimed until the
+ *      snapshot is released.
+ *-----------------------------------------------------------------------------
+ */
+int
+splinterdb_snapshot_create(const splinterdb     *kvs,     // IN
+                           splinterdb_snapshot **snapshot // OUT
+)
+{
+   splinterdb_snapshot *snap = TYPED_MALLOC(kvs->spl->heap_id, snap);
+   if (snap == NULL) {
+      platform_error_log("TYPED_MALLOC error\n");
+      return platform_status_to_int(STATUS_NO_MEMORY);
+   }
+   platform_status rc = trunk_snapshot_create(kvs->spl, &snap->snapshot);
+   if (!SUCCESS(rc)) {
+      platform_free(kvs->spl->heap_id, snap);
+      return platform_status_to_int(rc);
+   }
+   snap->parent = kvs;
+
+   *snapshot = snap;
+   return EXIT_SUCCESS;
+}
+
+void
+splinterdb_snapshot_release(splinterdb_snapshot *snapshot)
+{
+   trunk_snapshot_release(snapshot->snapshot);
+   platform_free(snapshot->parent->spl->heap_id, snapshot);
+}
+
+int
+splinterdb_snapshot_lookup(const splinterdb_snapshot *snapshot, // IN
+                           slice                      user_key,
+                           splinterdb_lookup_result  *result) // IN/OUT
+{
+   _splinterdb_lookup_result *_result = (_splinterdb_lookup_result *)result;
+   key                        target  = key_create_from_slice(user_key);
+
+   platform_status status =
+      trunk_snapshot_lookup(snapshot->snapshot, target, &_result->value);
+   return platform_status_to_int(status);
+}
+
+int
+splinterdb_snapshot_iterator_init(const splinterdb_snapshot *snapshot, // IN
+                                  splinterdb_iterator      **iter,     // OUT
+                                  slice start_key                      // IN
+)
+{
+   return splinterdb_iterator_init_internal(
+      snapshot->parent, snapshot->snapshot, iter, start_key);
+}
+
 void
 splinterdb_stats_print_insertion(const splinterdb *kvs)
 {
@@ -686,3 +1305,23 @@ splinterdb_stats_reset(splinterdb *kvs)
 {
    trunk_reset_stats(kvs->spl);
 }
+
+void
+splinterdb_stats_get(const splinterdb *kvs, splinterdb_stats *stats)
+{
+   ZERO_CONTENTS(stats);
+   stats->checkpoints          = kvs->spl->checkpoints_written;
+   stats->log_extents_freed    = kvs->spl->log_extents_freed;
+   stats->log_entries_replayed = kvs->spl->log_entries_replayed;
+
+   stats->io_uring =
+      io_handle_uses_uring((platform_io_handle *)&kvs->io_handle);
+
+   if (kvs->spl->cfg.use_stats) {
+      for (threadid tid = 0; tid < MAX_THREADS; tid++) {
+         trunk_stats *thread_stats = &kvs->spl->stats[tid];
+         stats->throttled_inserts += thread_stats->throttled_inserts;
+         stats->throttle_wait_ns  += thread_stats->throttle_wait_time_ns;
+      }
+   }
+}
@@ -33,14 +33,14 @@ task_system_io_register_thread(task_system *ts);
 static void
 task_init_tid_bitmask(uint64 *tid_bitmask)
 {
-   // We use a 64 bit word to act as the thread bitmap.
-   _Static_assert(MAX_THREADS == 64, "Max threads should be 64");
+   _Static_assert(MAX_THREADS % 64 == 0,
+                  "Max threads should be a multiple of 64");
    /*
     * This is a special bitmask where 1 indicates free and 0 indicates
     * allocated. So, we set all bits to 1 during init.
     */
-   for (int i = 0; i < MAX_THREADS; i++) {
-      *tid_bitmask |= (1ULL << i);
+   for (int i = 0; i < TASK_TID_BITMASK_WORDS; i++) {
+      tid_bitmask[i] = ~0ULL;
    }
 }
 
@@ -60,24 +60,28 @@ task_init_threadid(task_system *ts)
    uint64   *tid_bitmask = task_system_get_tid_bitmask(ts);
    threadid *max_tid     = task_system_get_max_tid(ts);
 
-   while (1) {
-      uint64 tmp_bitmask = *tid_bitmask;
-      // first bit set to 1 starting from LSB.
-      uint64 pos = __builtin_ffsl(tmp_bitmask);
-      // builtin_ffsl returns the position plus 1.
-      tid = pos - 1;
-      // set bit at that position to 0, indicating in use.
-      uint64 new_val = (tmp_bitmask & ~(1ULL << (pos - 1)));
-      if (__sync_bool_compare_and_swap(tid_bitmask, tmp_bitmask, new_val)) {
-         // atomically update the max_tid.
-         for (threadid tmp = *max_tid; tid > tmp; tmp = *max_tid) {
-            if (__sync_bool_compare_and_swap(max_tid, tmp, tid)) {
-               goto out;
+   for (uint64 word = 0; word < TASK_TID_BITMASK_WORDS; word++) {
+      uint64 tmp_bitmask;
+      while ((tmp_bitmask = tid_bitmask[word]) != 0) {
+         // first bit set to 1 starting from LSB.
+         uint64 pos = __builtin_ffsl(tmp_bitmask);
+         // set bit at that position to 0, indicating in use.
+         uint64 new_val = (tmp_bitmask & ~(1ULL << (pos - 1)));
+         if (__sync_bool_compare_and_swap(
+                &tid_bitmask[word], tmp_bitmask, new_val)) {
+            // builtin_ffsl returns the position plus 1.
+            tid = word * 64 + pos - 1;
+            // atomically update the max_tid.
+            for (threadid tmp = *max_tid; tid > tmp; tmp = *max_tid) {
+               if (__sync_bool_compare_and_swap(max_tid, tmp, tid)) {
+                  goto out;
+               }
             }
+            goto out;
          }
-         goto out;
       }
    }
+   platform_assert(FALSE, "All %d thread ids are in use.\n", MAX_THREADS);
 
 out:
    debug_assert(tid != INVALID_TID);
@@ -131,12 +135,13 @@ task_run_thread_hooks(task_system *ts)
 static void
 task_clear_threadid(task_system *ts, threadid tid)
 {
-   uint64 *tid_bitmask = task_system_get_tid_bitmask(ts);
+   uint64 *tid_bitmask = &task_system_get_tid_bitmask(ts)[tid / 64];
+   uint64  tid_bit     = 1ULL << (tid % 64);
 
    uint64 bitmask_val = *tid_bitmask;
 
    // Ensure that caller is only clearing for a thread that's in-use.
-   platform_assert(!(bitmask_val & (1ULL << tid)),
+   platform_assert(!(bitmask_val & tid_bit),
                    "Thread [%lu] is expected to be in-use. Bitmap: 0x%lx",
                    tid,
                    bitmask_val);
@@ -144,7 +149,7 @@ task_clear_threadid(task_system *ts, threadid tid)
    // set bit back to 1 to indicate a free slot.
    while (1) {
       uint64 tmp_bitmask = *tid_bitmask;
-      uint64 new_value   = tmp_bitmask | (1ULL << tid);
+      uint64 new_value   = tmp_bitmask | tid_bit;
       if (__sync_bool_compare_and_swap(tid_bitmask, tmp_bitmask, new_value)) {
 
          // This is the reverse of registration, where tid is allocated by
@@ -366,67 +371,250 @@ task_thread_create(const char            *name,
    return STATUS_OK;
 }
 
+/*
+ * task_group_get_stats() - Returns the calling thread's stats slot in the
+ * group, allocating it on first use, or NULL if stats are disabled.
+ *
+ * Only thread tid writes to its slot, so no synchronization is needed.
+ */
+static task_stats *
+task_group_get_stats(task_group *group, threadid tid)
+{
+   if (!group->use_stats) {
+      return NULL;
+   }
+   if (group->stats[tid] == NULL) {
+      group->stats[tid] = TYPED_ZALLOC(group->ts->heap_id, group->stats[tid]);
+   }
+   return group->stats[tid];
+}
+
+/*
+ * How long a task of each priority class may wait before it is run ahead of
+ * tasks of higher classes.
+ */
+static const timestamp task_priority_deadline_ns[NUM_TASK_PRIORITIES] = {
+   [TASK_PRIORITY_CRITICAL] = 1000 * 1000,
+   [TASK_PRIORITY_HIGH]     = 20 * 1000 * 1000,
+   [TASK_PRIORITY_NORMAL]   = 200 * 1000 * 1000,
+   [TASK_PRIORITY_LOW]      = 2000 * 1000 * 1000UL,
+};
+
+static const char *task_priority_name[NUM_TASK_PRIORITIES] = {
+   [TASK_PRIORITY_CRITICAL] = "critical",
+   [TASK_PRIORITY_HIGH]     = "high",
+   [TASK_PRIORITY_NORMAL]   = "normal",
+   [TASK_PRIORITY_LOW]      = "low",
+};
+
+/*
+ * task_queue_push() - Adds a task to the list of its priority class.
+ */
+static void
+task_queue_push(task_queue *tq, task *new_task, bool at_head)
+{
+   task_list *tl = &tq->list[new_task->priority];
+   if (tl->tail) {
+      if (at_head) {
+         tl->head->prev = new_task;
+         new_task->next = tl->head;
+         tl->head       = new_task;
+      } else {
+         tl->tail->next = new_task;
+         new_task->prev = tl->tail;
+         tl->tail       = new_task;
+      }
+   } else {
+      platform_assert(tl->head == NULL);
+      tl->head = tl->tail = new_task;
+   }
+   tq->num_tasks++;
+}
+
+/*
+ * task_queue_pop() - Removes and returns the next task to run, or NULL if the
+ * queue is empty.
+ *
+ * This is the head of the most urgent non-empty class, unless the head of
+ * some class has passed its deadline, in which case it is the head with the
+ * earliest expired deadline.
+ */
+static task *
+task_queue_pop(task_queue *tq)
+{
+   if (tq->num_tasks == 0) {
+      return NULL;
+   }
+
+   timestamp now    = platform_get_timestamp();
+   task     *popped = NULL;
+   for (task_priority prio = 0; prio < NUM_TASK_PRIORITIES; prio++) {
+      task *head = tq->list[prio].head;
+      if (head == NULL) {
+         continue;
+      }
+      if (popped == NULL
+          || (head->deadline <= now && head->deadline < popped->deadline))
+      {
+         popped = head;
+      }
+   }
+   platform_assert(popped != NULL);
+
+   task_list *tl = &tq->list[popped->priority];
+   tl->head      = popped->next;
+   if (tl->head == NULL) {
+      platform_assert(tl->tail == popped);
+      tl->tail = NULL;
+   } else {
+      tl->head->prev = NULL;
+   }
+   popped->next = popped->prev = NULL;
+   tq->num_tasks--;
+   return popped;
+}
+
+/*
+ * task_bg_worker_take() - Takes the next task from a worker's queue; used
+ * both by the owner and by thieves.
+ */
+static task *
+task_bg_worker_take(task_bg_worker *worker)
+{
+   if (worker->tq.num_tasks == 0) {
+      return NULL;
+   }
+   platform_spin_lock(&worker->lock);
+   task *taken = task_queue_pop(&worker->tq);
+   platform_spin_unlock(&worker->lock);
+   return taken;
+}
+
+/*
+ * task_bg_worker_push() - Adds a task to the worker's queue.
+ */
+static void
+task_bg_worker_push(task_bg_worker *worker, task *new_task, bool at_head)
+{
+   platform_spin_lock(&worker->lock);
+   task_queue_push(&worker->tq, new_task, at_head);
+   platform_spin_unlock(&worker->lock);
+}
+
+/*
+ * task_stats_record_start() - Records the queueing latency of a task which
+ * is about to run.
+ */
+static void
+task_stats_record_start(task_stats *stats, task *t, timestamp now)
+{
+   task_priority_stats *pstats  = &stats->priority[t->priority];
+   timestamp            latency = now - t->enqueue_time;
+
+   stats->total_latency_ns += latency;
+   stats->total_tasks++;
+   if (latency > stats->max_latency_ns) {
+      stats->max_latency_ns = latency;
+   }
+
+   pstats->total_latency_ns += latency;
+   pstats->total_tasks++;
+   if (latency > pstats->max_latency_ns) {
+      pstats->max_latency_ns = latency;
+   }
+   if (now > t->deadline) {
+      pstats->missed_deadlines++;
+   }
+}
+
+/*
+ * task_bg_worker_get_task() - Returns the next task for the worker to run:
+ * from its own deque if possible, otherwise stolen from another worker in
+ * the group. Returns NULL if every deque is empty.
+ */
+static task *
+task_bg_worker_get_task(task_bg_worker *worker)
+{
+   task_group *group       = worker->group;
+   uint64      num_threads = group->bg.num_threads;
+
+   task *next = task_bg_worker_take(worker);
+   for (uint64 i = 1; next == NULL && i < num_threads; i++) {
+      task_bg_worker *victim =
+         &group->bg.workers[(worker->idx + i) % num_threads];
+      next = task_bg_worker_take(victim);
+   }
+   if (next != NULL) {
+      __sync_fetch_and_sub(&group->bg.num_queued, 1);
+   }
+   return next;
+}
+
+/*
+ * task_bg_worker_wait() - Blocks until some task is queued in the group.
+ * Returns FALSE if the group has been asked to stop and has no tasks left.
+ *
+ * num_idle is raised before num_queued is checked and task_enqueue raises
+ * num_queued before it checks num_idle, so either the worker sees the new
+ * task or the enqueuer sees the idle worker and signals it.
+ */
+static bool
+task_bg_worker_wait(task_group *group)
+{
+   platform_status rc = platform_condvar_lock(&group->bg.cv);
+   platform_assert(SUCCESS(rc));
+   __sync_fetch_and_add(&group->bg.num_idle, 1);
+   while (group->bg.num_queued == 0 && !group->bg.stop) {
+      rc = platform_condvar_wait(&group->bg.cv);
+      platform_assert(SUCCESS(rc));
+   }
+   __sync_fetch_and_sub(&group->bg.num_idle, 1);
+   bool keep_running = group->bg.num_queued != 0 || !group->bg.stop;
+   platform_condvar_unlock(&group->bg.cv);
+   return keep_running;
+}
+
 /* Worker function for the background task pool. */
 static void
 task_worker_thread(void *arg)
 {
-   task_group    *group = (task_group *)arg;
-   const threadid tid   = platform_get_tid();
-   task_queue    *tq    = &group->tq;
-   task_system   *ts    = group->ts;
+   task_bg_worker *worker = (task_bg_worker *)arg;
+   task_group     *group  = worker->group;
+   const threadid  tid    = platform_get_tid();
+   task_system    *ts     = group->ts;
+
+   ts->worker[tid] = worker;
 
    while (TRUE) {
-      task           *task_to_run = NULL;
-      platform_status rc          = platform_condvar_lock(&group->bg.cv);
-      platform_assert(SUCCESS(rc));
-      if (tq->head == NULL) {
-         // Queue is empty.
-         if (group->bg.stop == TRUE) {
+      task *task_to_run = task_bg_worker_get_task(worker);
+      if (task_to_run == NULL) {
+         if (!task_bg_worker_wait(group)) {
             // asked to exit.
-            platform_condvar_unlock(&group->bg.cv);
+            ts->worker[tid] = NULL;
             return;
          }
-         // wait for tasks to be generated in the queue.
-         rc = platform_condvar_wait(&group->bg.cv);
-         platform_assert(SUCCESS(rc));
+         continue;
       }
 
-      if (tq->head != NULL) {
-         task_to_run = tq->head;
-         tq->head    = tq->head->next;
-         if (tq->head == NULL) {
-            platform_assert(tq->tail == task_to_run);
-            tq->tail = NULL;
-         }
+      task_stats *stats   = task_group_get_stats(group, tid);
+      timestamp   current = platform_get_timestamp();
+      if (stats != NULL) {
+         task_stats_record_start(stats, task_to_run, current);
       }
-      platform_condvar_unlock(&group->bg.cv);
 
-      if (task_to_run != NULL) {
-         task_stats *stats   = &group->stats[tid];
-         timestamp   current = platform_get_timestamp();
-         if (stats != NULL) {
-            timestamp latency = current - task_to_run->enqueue_time;
-            stats[tid].total_latency_ns += latency;
-            stats[tid].total_tasks++;
-            if (latency > stats[tid].max_latency_ns) {
-               stats[tid].max_latency_ns = latency;
-            }
-         }
-
-         // Run the task.
-         task_to_run->func(task_to_run->arg,
-                           task_system_get_thread_scratch(ts, tid));
+      // Run the task.
+      task_to_run->func(task_to_run->arg,
+                        task_system_get_thread_scratch(ts, tid));
 
-         __sync_fetch_and_sub(&group->current_outstanding_tasks, 1);
-         if (group->use_stats) {
-            timestamp task_run_time = platform_timestamp_elapsed(current);
-            if (task_run_time > stats[tid].max_runtime_ns) {
-               stats[tid].max_runtime_ns   = task_run_time;
-               stats[tid].max_runtime_func = task_to_run->func;
-            }
+      __sync_fetch_and_sub(&group->current_outstanding_tasks, 1);
+      if (stats != NULL) {
+         timestamp task_run_time = platform_timestamp_elapsed(current);
+         if (task_run_time > stats->max_runtime_ns) {
+            stats->max_runtime_ns   = task_run_time;
+            stats->max_runtime_func = task_to_run->func;
          }
-         platform_free(ts->heap_id, task_to_run);
       }
+      platform_free(ts->heap_id, task_to_run);
    }
 }
 
@@ -436,39 +624,59 @@ task_group_stop_and_wait_for_threads(task_group *group)
    bool use_bg_threads = task_system_use_bg_threads(group->ts);
    if (use_bg_threads) {
       platform_condvar_lock(&group->bg.cv);
+      platform_assert(group->bg.num_queued == 0);
    } else {
       platform_mutex_lock(&group->fg.mutex);
+      platform_assert(group->tq.num_tasks == 0);
    }
 
-   platform_assert(group->tq.head == NULL);
-   platform_assert(group->tq.tail == NULL);
    platform_assert(group->current_outstanding_tasks == 0);
 
    if (!use_bg_threads) {
       return;
    }
 
-   uint8 num_threads = group->bg.num_threads;
+   uint64 num_threads = group->bg.num_threads;
 
    group->bg.stop = TRUE;
    platform_condvar_broadcast(&group->bg.cv);
    platform_condvar_unlock(&group->bg.cv);
 
-   for (uint8 i = 0; i < num_threads; i++) {
-      platform_thread_join(group->bg.threads[i]);
+   for (uint64 i = 0; i < num_threads; i++) {
+      platform_thread_join(group->bg.workers[i].thread);
    }
 }
 
+static void
+task_group_free_workers(task_group *group)
+{
+   if (group->bg.workers == NULL) {
+      return;
+   }
+   for (uint64 i = 0; i < group->bg.num_threads; i++) {
+      platform_spinlock_destroy(&group->bg.workers[i].lock);
+   }
+   platform_free(group->ts->heap_id, group->bg.workers);
+   group->bg.workers = NULL;
+}
+
 static void
 task_group_deinit(task_group *group)
 {
    task_group_stop_and_wait_for_threads(group);
    if (task_system_use_bg_threads(group->ts)) {
       platform_condvar_destroy(&group->bg.cv);
+      task_group_free_workers(group);
    } else {
       platform_mutex_unlock(&group->fg.mutex);
       platform_mutex_destroy(&group->fg.mutex);
    }
+   for (threadid i = 0; i < MAX_THREADS; i++) {
+      if (group->stats[i] != NULL) {
+         platform_free(group->ts->heap_id, group->stats[i]);
+         group->stats[i] = NULL;
+      }
+   }
 }
 
 static platform_status
@@ -485,25 +693,37 @@ task_group_init(task_group  *group,
    platform_heap_id hid = group->ts->heap_id;
    platform_status  rc;
    if (use_bg_threads) {
-      group->bg.num_threads = num_bg_threads;
-
       rc = platform_condvar_init(&group->bg.cv, hid);
       if (!SUCCESS(rc)) {
          return rc;
       }
 
-      for (uint8 i = 0; i < num_bg_threads; i++) {
+      group->bg.workers =
+         TYPED_ARRAY_ZALLOC(hid, group->bg.workers, MAX(num_bg_threads, 1));
+      if (group->bg.workers == NULL) {
+         rc = STATUS_NO_MEMORY;
+         goto out;
+      }
+      for (uint64 i = 0; i < num_bg_threads; i++) {
+         task_bg_worker *worker = &group->bg.workers[i];
+         worker->group          = group;
+         worker->idx            = i;
+         platform_spinlock_init(&worker->lock, platform_get_module_id(), hid);
+      }
+
+      for (uint64 i = 0; i < num_bg_threads; i++) {
          rc = task_thread_create("splinter-bg-thread",
                                  task_worker_thread,
-                                 (void *)group,
+                                 (void *)&group->bg.workers[i],
                                  scratch_size,
                                  ts,
                                  hid,
-                                 &group->bg.threads[i]);
+                                 &group->bg.workers[i].thread);
          if (!SUCCESS(rc)) {
             task_group_stop_and_wait_for_threads(group);
             goto out;
          }
+         group->bg.num_threads++;
       }
    } else {
       rc = platform_mutex_init(&group->fg.mutex, 0, hid);
@@ -516,91 +736,97 @@ task_group_init(task_group  *group,
 out:
    debug_assert(!SUCCESS(rc));
    if (use_bg_threads) {
+      task_group_free_workers(group);
       platform_condvar_destroy(&group->bg.cv);
    }
    return rc;
 }
 
 /*
- * task_lock_task_queue(), task_unlock_task_queue():
+ * task_enqueue_bg() - Adds one task to a background group.
  *
- * Primitives to lock / unlock task queues depending on whether we
- * are dealing with foreground or background threads.
+ * A task enqueued by one of the group's own workers goes on that worker's
+ * deque, so that follow-on work stays local; other tasks are spread round
+ * robin. An idle worker is woken if there is one; busy workers will find the
+ * task when they next look for work, possibly by stealing it.
  */
-static inline platform_status
-task_lock_task_queue(task_group *group)
+static platform_status
+task_enqueue_bg(task_group *group, task *new_task, bool at_head)
 {
-   task_system *ts = group->ts;
-   return task_system_use_bg_threads(ts)
-             ? platform_condvar_lock(&group->bg.cv)
-             : platform_mutex_lock(&group->fg.mutex);
-}
+   task_system *ts          = group->ts;
+   uint64       num_threads = group->bg.num_threads;
+   platform_assert(num_threads != 0,
+                   "task enqueued to a group with no background threads\n");
+   platform_assert(!group->bg.stop);
+
+   task_bg_worker *worker = ts->worker[platform_get_tid()];
+   if (worker == NULL || worker->group != group) {
+      uint64 idx = __sync_fetch_and_add(&group->bg.next_worker, 1);
+      worker     = &group->bg.workers[idx % num_threads];
+   }
 
-static inline platform_status
-task_unlock_task_queue(task_group *group)
-{
-   task_system *ts = group->ts;
-   if (task_system_use_bg_threads(ts)) {
-      // signal to the bg thread to pick up a task and unlock.
+   uint64 outstanding =
+      __sync_add_and_fetch(&group->current_outstanding_tasks, 1);
+   if (outstanding > group->max_outstanding_tasks) {
+      group->max_outstanding_tasks = outstanding;
+   }
+   task_bg_worker_push(worker, new_task, at_head);
+   __sync_fetch_and_add(&group->bg.num_queued, 1);
+
+   if (group->bg.num_idle != 0) {
+      platform_status rc = platform_condvar_lock(&group->bg.cv);
+      platform_assert(SUCCESS(rc));
       platform_condvar_signal(&group->bg.cv);
-      return platform_condvar_unlock(&group->bg.cv);
-   } else {
-      return platform_mutex_unlock(&group->fg.mutex);
+      platform_condvar_unlock(&group->bg.cv);
    }
+   return STATUS_OK;
 }
 
 /*
- * task_enqueue() - Adds one task to the task queue.
+ * task_enqueue_priority() - Adds one task of the given priority class to the
+ * task queue. at_head puts it ahead of the other tasks of its class.
  */
 platform_status
-task_enqueue(task_system *ts,
-             task_type    type,
-             task_fn      func,
-             void        *arg,
-             bool         at_head)
+task_enqueue_priority(task_system  *ts,
+                      task_type     type,
+                      task_priority priority,
+                      task_fn       func,
+                      void         *arg,
+                      bool          at_head)
 {
+   debug_assert(priority < NUM_TASK_PRIORITIES);
    task *new_task = TYPED_ZALLOC(ts->heap_id, new_task);
    if (new_task == NULL) {
       return STATUS_NO_MEMORY;
    }
-   new_task->func = func;
-   new_task->arg  = arg;
-   new_task->ts   = ts;
-
-   task_group     *group = &ts->group[type];
-   task_queue     *tq    = &group->tq;
-   platform_status rc;
+   new_task->func         = func;
+   new_task->arg          = arg;
+   new_task->ts           = ts;
+   new_task->priority     = priority;
+   new_task->enqueue_time = platform_get_timestamp();
+   new_task->deadline =
+      new_task->enqueue_time + task_priority_deadline_ns[priority];
+
+   task_group *group = &ts->group[type];
+
+   if (ts->use_bg_threads) {
+      return task_enqueue_bg(group, new_task, at_head);
+   }
 
-   rc = task_lock_task_queue(group);
+   task_queue     *tq = &group->tq;
+   platform_status rc = platform_mutex_lock(&group->fg.mutex);
    if (!SUCCESS(rc)) {
       platform_free(ts->heap_id, new_task);
-      platform_assert(!ts->use_bg_threads || !group->bg.stop);
       return rc;
    }
-   if (tq->tail) {
-      if (at_head) {
-         tq->head->prev = new_task;
-         new_task->next = tq->head;
-         tq->head       = new_task;
-      } else {
-         tq->tail->next = new_task;
-         new_task->prev = tq->tail;
-         tq->tail       = new_task;
-      }
-   } else {
-      platform_assert(tq->head == NULL);
-      tq->head = tq->tail = new_task;
-   }
+   task_queue_push(tq, new_task, at_head);
 
    __sync_fetch_and_add(&group->current_outstanding_tasks, 1);
 
-   if (group->use_stats) {
-      new_task->enqueue_time = platform_get_timestamp();
-   }
    if (group->current_outstanding_tasks > group->max_outstanding_tasks) {
       group->max_outstanding_tasks = group->current_outstanding_tasks;
    }
-   return task_unlock_task_queue(group);
+   return platform_mutex_unlock(&group->fg.mutex);
 }
 
 /*
@@ -658,18 +884,13 @@ task_group_perform_one(task_group *group)
       goto out;
    }
 
-   platform_assert(tq->head != NULL);
-   platform_assert(tq->tail != NULL);
-
    uint64 outstanding_tasks =
       __sync_fetch_and_sub(&group->current_outstanding_tasks, 1);
    platform_assert(outstanding_tasks != 0);
 
-   assigned_task = tq->head;
-   tq->head      = tq->head->next;
-   if (tq->head == NULL) {
-      platform_assert(tq->tail == assigned_task);
-      tq->tail = NULL;
+   assigned_task = task_queue_pop(tq);
+   platform_assert(assigned_task != NULL);
+   if (tq->num_tasks == 0) {
       platform_assert(outstanding_tasks == 1);
    }
 
@@ -678,19 +899,21 @@ out:
    platform_thread_cleanup_pop(0);
 
    if (assigned_task) {
-      const threadid tid = platform_get_tid();
+      const threadid tid   = platform_get_tid();
+      task_stats    *stats = task_group_get_stats(group, tid);
       timestamp      current;
 
-      if (group->use_stats) {
+      if (stats != NULL) {
          current = platform_get_timestamp();
+         task_stats_record_start(stats, assigned_task, current);
       }
       assigned_task->func(assigned_task->arg,
                           task_system_get_thread_scratch(group->ts, tid));
-      if (group->use_stats) {
+      if (stats != NULL) {
          current = platform_timestamp_elapsed(current);
-         if (current > group->stats[tid].max_runtime_ns) {
-            group->stats[tid].max_runtime_ns   = current;
-            group->stats[tid].max_runtime_func = assigned_task->func;
+         if (current > stats->max_runtime_ns) {
+            stats->max_runtime_ns   = current;
+            stats->max_runtime_func = assigned_task->func;
          }
       }
       platform_free(group->ts->heap_id, assigned_task);
@@ -744,7 +967,7 @@ task_system_create(platform_heap_id    hid,
       return STATUS_NO_MEMORY;
    }
    ts->ioh = ioh;
-   task_init_tid_bitmask(&ts->tid_bitmask);
+   task_init_tid_bitmask(ts->tid_bitmask);
    // task initialization
    register_init_tid_hook();
 
@@ -753,6 +976,12 @@ task_system_create(platform_heap_id    hid,
    ts->scratch_size   = scratch_size;
    ts->init_tid       = INVALID_TID;
 
+   // Register the calling thread before any background thread is started, so
+   // that it is assigned the first thread id.
+   task_run_thread_hooks(ts);
+   const threadid tid      = platform_get_tid();
+   ts->thread_scratch[tid] = ts->init_task_scratch;
+
    for (task_type type = TASK_TYPE_FIRST; type != NUM_TASK_TYPES; type++) {
       platform_status rc = task_group_init(&ts->group[type],
                                            ts,
@@ -767,10 +996,6 @@ task_system_create(platform_heap_id    hid,
       }
    }
 
-   task_run_thread_hooks(ts);
-   const threadid tid      = platform_get_tid();
-   ts->thread_scratch[tid] = ts->init_task_scratch;
-
    *system = ts;
    return STATUS_OK;
 }
@@ -782,6 +1007,13 @@ task_system_use_bg_threads(task_system *ts)
    return ts->use_bg_threads;
 }
 
+/* The number of background threads running tasks of the given type */
+uint64
+task_system_num_bg_threads(task_system *ts, task_type type)
+{
+   return ts->use_bg_threads ? ts->group[type].bg.num_threads : 0;
+}
+
 static void
 task_system_io_register_thread(task_system *ts)
 {
@@ -809,16 +1041,17 @@ task_system_destroy(platform_heap_id hid, task_system **ts_in)
 static inline uint64 *
 task_system_get_tid_bitmask(task_system *ts)
 {
-   return &ts->tid_bitmask;
+   return ts->tid_bitmask;
 }
 
 /*
- * Return the bitmasks of tasks active. Mainly intended as a testing hook.
+ * Return the bitmask of active tasks among thread ids 0..63. Mainly intended
+ * as a testing hook.
  */
 uint64
 task_active_tasks_mask(task_system *ts)
 {
-   return *task_system_get_tid_bitmask(ts);
+   return task_system_get_tid_bitmask(ts)[0];
 }
 
 static threadid *
@@ -852,6 +1085,15 @@ task_wait_for_completion(task_system *ts)
    }
 }
 
+/*
+ * Return the number of tasks of the given type which are queued or running.
+ */
+uint64
+task_outstanding_tasks(task_system *ts, task_type type)
+{
+   return ts->group[type].current_outstanding_tasks;
+}
+
 static void
 task_group_print_stats(task_group *group, task_type type)
 {
@@ -863,14 +1105,28 @@ task_group_print_stats(task_group *group, task_type type)
    task_stats global = {0};
 
    for (threadid i = 0; i < MAX_THREADS; i++) {
-      global.total_tasks += group->stats[i].total_tasks;
-      global.total_latency_ns += group->stats[i].total_latency_ns;
-      if (group->stats[i].max_runtime_ns > global.max_runtime_ns) {
-         global.max_runtime_ns   = group->stats[i].max_runtime_ns;
-         global.max_runtime_func = group->stats[i].max_runtime_func;
+      task_stats *stats = group->stats[i];
+      if (stats == NULL) {
+         continue;
+      }
+      global.total_tasks += stats->total_tasks;
+      global.total_latency_ns += stats->total_latency_ns;
+      if (stats->max_runtime_ns > global.max_runtime_ns) {
+         global.max_runtime_ns   = stats->max_runtime_ns;
+         global.max_runtime_func = stats->max_runtime_func;
+      }
+      if (stats->max_latency_ns > global.max_latency_ns)
+         global.max_latency_ns = stats->max_latency_ns;
+      for (task_priority prio = 0; prio < NUM_TASK_PRIORITIES; prio++) {
+         task_priority_stats *pstats = &stats->priority[prio];
+         task_priority_stats *gstats = &global.priority[prio];
+         gstats->total_latency_ns += pstats->total_latency_ns;
+         gstats->total_tasks += pstats->total_tasks;
+         gstats->missed_deadlines += pstats->missed_deadlines;
+         if (pstats->max_latency_ns > gstats->max_latency_ns) {
+            gstats->max_latency_ns = pstats->max_latency_ns;
+         }
       }
-      if (group->stats[i].max_latency_ns > global.max_latency_ns)
-         global.max_latency_ns = group->stats[i].max_latency_ns;
    }
 
    switch (type) {
@@ -898,6 +1154,19 @@ task_group_print_stats(task_group *group, task_type type)
                         group->current_outstanding_tasks);
    platform_default_log("| max outstanding tasks : %lu\n",
                         group->max_outstanding_tasks);
+   platform_default_log("| priority | tasks run | avg latency (ns) "
+                        "| max latency (ns) | missed deadlines\n");
+   for (task_priority prio = 0; prio < NUM_TASK_PRIORITIES; prio++) {
+      task_priority_stats *gstats = &global.priority[prio];
+      platform_default_log("| %8s | %9lu | %16lu | %16lu | %16lu\n",
+                           task_priority_name[prio],
+                           gstats->total_tasks,
+                           gstats->total_tasks == 0
+                              ? 0
+                              : gstats->total_latency_ns / gstats->total_tasks,
+                           gstats->max_latency_ns,
+                           gstats->missed_deadlines);
+   }
    platform_default_log("\n");
 }
 
@@ -8,39 +8,93 @@
 
 typedef struct task_system task_system;
 
+// Number of 64-bit words in the thread ID bitmask
+#define TASK_TID_BITMASK_WORDS (MAX_THREADS / 64)
+
 typedef void (*task_hook)(task_system *arg);
 typedef void (*task_fn)(void *arg, void *scratch);
 
+/*
+ * Priority classes of tasks within a task group, from most to least urgent.
+ * Each class also has a deadline (see task.c): a task which has waited past
+ * its deadline is run ahead of higher classes, earliest deadline first, so
+ * that lower classes are not starved.
+ */
+typedef enum task_priority {
+   TASK_PRIORITY_CRITICAL = 0, // e.g. work that unblocks incorporation
+   TASK_PRIORITY_HIGH,
+   TASK_PRIORITY_NORMAL,
+   TASK_PRIORITY_LOW,
+   NUM_TASK_PRIORITIES
+} task_priority;
+
 typedef struct task {
-   struct task *next;
-   struct task *prev;
-   task_fn      func;
-   void        *arg;
-   task_system *ts;
-   timestamp    enqueue_time;
+   struct task  *next;
+   struct task  *prev;
+   task_fn       func;
+   void         *arg;
+   task_system  *ts;
+   task_priority priority;
+   timestamp     enqueue_time;
+   timestamp     deadline;
 } task;
 
+/*
+ * Per priority class execution metrics.
+ */
+typedef struct task_priority_stats {
+   uint64 total_latency_ns;
+   uint64 total_tasks;
+   uint64 max_latency_ns;
+   uint64 missed_deadlines;
+} task_priority_stats;
+
 /*
  * Run-time task-specific execution metrics structure.
  */
 typedef struct {
-   timestamp max_runtime_ns;
-   void     *max_runtime_func;
-   uint64    total_latency_ns;
-   uint64    total_tasks;
-   uint64    max_latency_ns;
+   timestamp           max_runtime_ns;
+   void               *max_runtime_func;
+   uint64              total_latency_ns;
+   uint64              total_tasks;
+   uint64              max_latency_ns;
+   task_priority_stats priority[NUM_TASK_PRIORITIES];
 } PLATFORM_CACHELINE_ALIGNED task_stats;
 
-typedef struct task_queue {
+typedef struct task_list {
    task *head;
    task *tail;
+} task_list;
+
+// A queue of tasks, with one FIFO list per priority class
+typedef struct task_queue {
+   task_list list[NUM_TASK_PRIORITIES];
+   uint64    num_tasks;
 } task_queue;
 
+/*
+ * Each background thread owns a queue of tasks. The owner takes tasks from
+ * its own queue and, when that is empty, steals from the other workers'
+ * queues in the same group. Both pick the next task by priority class and
+ * deadline.
+ */
+typedef struct task_bg_worker {
+   struct task_group *group;
+   uint64             idx;
+   platform_thread    thread;
+   platform_spinlock  lock;
+   task_queue         tq;
+} PLATFORM_CACHELINE_ALIGNED task_bg_worker;
+
 typedef struct task_bg_thread_group {
-   platform_condvar cv;
+   platform_condvar cv; // idle workers wait here
    bool             stop;
-   uint8            num_threads;
-   platform_thread  threads[MAX_THREADS];
+   uint64           num_threads;
+   task_bg_worker  *workers;
+
+   volatile uint64 num_queued;  // tasks in all the workers' deques
+   volatile uint64 num_idle;    // workers waiting on cv
+   volatile uint64 next_worker; // round robin for enqueues from outside
 } task_bg_thread_group;
 
 typedef struct task_fg_thread_group {
@@ -65,9 +119,9 @@ typedef struct task_group {
       task_fg_thread_group fg;
    };
 
-   // Per thread stats.
-   bool       use_stats;
-   task_stats stats[MAX_THREADS];
+   // Per thread stats, allocated on first use by each thread.
+   bool        use_stats;
+   task_stats *stats[MAX_THREADS];
 } task_group;
 
 typedef enum task_type {
@@ -94,15 +148,18 @@ typedef enum task_type {
 struct task_system {
    // array of scratch space pointers for this system.
    void *thread_scratch[MAX_THREADS];
+   // the background worker running as each thread, if any
+   task_bg_worker *worker[MAX_THREADS];
    // IO handle (currently one splinter system has just one)
    platform_io_handle *ioh;
    /*
-    * bitmask used for generating and clearing thread id's.
+    * bitmask used for generating and clearing thread id's, thread id tid is
+    * bit (tid % 64) of word (tid / 64).
     * If a bit is set to 0, it means we have an in use thread id for that
     * particular position, 1 means it is unset and that thread id is available
     * for use.
     */
-   uint64 tid_bitmask;
+   uint64 tid_bitmask[TASK_TID_BITMASK_WORDS];
    // max thread id so far.
    threadid max_tid;
    // task groups
@@ -167,12 +224,27 @@ task_system_get_thread_scratch(task_system *ts, threadid tid);
 bool
 task_system_use_bg_threads(task_system *ts);
 
+uint64
+task_system_num_bg_threads(task_system *ts, task_type type);
+
 platform_status
+task_enqueue_priority(task_system  *ts,
+                      task_type     type,
+                      task_priority priority,
+                      task_fn       func,
+                      void         *arg,
+                      bool          at_head);
+
+static inline platform_status
 task_enqueue(task_system *ts,
              task_type    type,
              task_fn      func,
              void        *arg,
-             bool         at_head);
+             bool         at_head)
+{
+   return task_enqueue_priority(
+      ts, type, TASK_PRIORITY_NORMAL, func, arg, at_head);
+}
 
 platform_status
 task_perform_one(task_system *ts);
@@ -183,6 +255,9 @@ task_perform_all(task_system *ts);
 void
 task_wait_for_completion(task_system *ts);
 
+uint64
+task_outstanding_tasks(task_system *ts, task_type type);
+
 threadid
 task_get_max_tid(task_system *ts);
 
@@ -41,13 +41,34 @@ static const int64 latency_histo_buckets[LATENCYHISTO_SIZE] = {
    10000000000 // 10  s
 };
 
+
+/*
+ * Write throttle parameters, see trunk_throttle_insert(). Throttling starts
+ * once more than TRUNK_THROTTLE_MEMTABLE_SOFT memtables await incorporation
+ * and is at its maximum when all but the active one do.
+ */
+#define TRUNK_THROTTLE_SCALE          (1024)
+#define TRUNK_THROTTLE_INTERVAL_NS    (1000 * 1000) // refill every 1ms
+#define TRUNK_THROTTLE_SLEEP_NS       (100 * 1000)
+#define TRUNK_THROTTLE_MIN_RATE       (1000) // inserts per second
+#define TRUNK_THROTTLE_MEMTABLE_SOFT  (1)
+#define TRUNK_THROTTLE_DEFAULT_SOFT_TASKS (64)
+#define TRUNK_THROTTLE_DEFAULT_HARD_TASKS (512)
+
 /*
- * At any time, one Memtable is "active" for inserts / updates.
- * At any time, the most # of Memtables that can be active or in one of these
- * states, such as, compaction, incorporation, reclamation, is given by this
- * limit.
+ * Crash recovery parameters, see "Crash recovery" below.
  */
-#define TRUNK_NUM_MEMTABLES (4)
+#define TRUNK_LOG_MEMTABLE_SHIFT (32) // memtable bits of a log generation
+#define TRUNK_LOG_RANGE_DELETE   ((1ULL << TRUNK_LOG_MEMTABLE_SHIFT) - 1)
+#define TRUNK_MAX_REPLAY_THREADS (32)
+#define TRUNK_REPLAY_SAMPLES     (64) // sampled keys per replay range
+
+/*
+ * Checkpoint parameters, see "Checkpoints" below.
+ */
+#define TRUNK_DEFAULT_CHECKPOINT_INTERVAL (8) // memtables
+#define TRUNK_QUIESCED               (1ULL << 63) // flag in spl->modifiers
+#define TRUNK_QUIESCE_MAX_WAIT_NS    (10 * 1000 * 1000)
 
 /*
  * These are hard-coded to values so that statically allocated
@@ -81,6 +102,9 @@ static const int64 latency_histo_buckets[LATENCYHISTO_SIZE] = {
 /* Some randomly chosen Splinter super-block checksum seed. */
 #define TRUNK_SUPER_CSUM_SEED (42)
 
+/* And of the checkpoint journal, see trunk_journal_hdr. */
+#define TRUNK_JOURNAL_CSUM_SEED (43)
+
 /*
  * When a leaf becomes full, Splinter estimates the amount of data in the leaf.
  * If the 'estimated' amount of data is > this threshold, Splinter will split
@@ -447,12 +471,45 @@ typedef struct ONDISK trunk_super_block {
    uint64      meta_tail;
    uint64      log_addr;
    uint64      log_meta_addr;
+   uint64      log_magic;
+   uint64      log_generation;      // first log generation to replay
+   uint64      log_generation_base; // generation_base of the logged data
+   uint64      prev_log_addr;       // log replayed first, if any
+   uint64      prev_log_magic;
+   uint64      journal_addr; // redone before replaying, see "Checkpoints"
    uint64      timestamp;
-   bool        checkpointed;
+   bool        checkpointed; // recoverable from the log, see trunk_mount
    bool        unmounted;
+   uint64      generation_base;      // of the next mount
+   uint64      range_tombstone_addr; // first page of the range tombstones
    checksum128 checksum;
 } trunk_super_block;
 
+/*
+ * The range tombstones are written out at unmount to a chain of pages, each
+ * holding a header followed by packed entries. An entry is the generation of
+ * the tombstone followed by its start and end keys as ondisk_keys.
+ * Disk-resident structure.
+ */
+typedef struct ONDISK trunk_range_tombstone_page_hdr {
+   uint64 next_addr;
+   uint64 num_tombstones;
+} trunk_range_tombstone_page_hdr;
+
+/*
+ * The redo journal of a background checkpoint holds copies of the trunk pages
+ * of its image which are not at their homes, followed by the allocator ref
+ * counts of the image, see "Checkpoints". It is a chain of extents, each
+ * starting with this header, which gives the homes of the pages after it in
+ * the extent, 0 for ref count pages. Disk-resident structure.
+ */
+typedef struct ONDISK trunk_journal_hdr {
+   checksum128 checksum; // of the rest of the page
+   uint64      next_addr;
+   uint64      num_pages;
+   uint64      home_addr[];
+} trunk_journal_hdr;
+
 /*
  * A subbundle is a collection of branches which originated in the same node.
  * It is used to organize branches with their routing filters when they are
@@ -602,6 +659,7 @@ struct trunk_compact_bundle_req {
    uint64                tuples_reclaimed;
    uint64                kv_bytes_reclaimed;
    uint32               *fp_arr;
+   uint32               *prefix_fp_arr; // NULL without a prefix extractor
 };
 
 // an iterator which skips masked pivots
@@ -631,6 +689,10 @@ typedef struct {
    iterator              *itor_arr[TRUNK_RANGE_ITOR_MAX_BRANCHES];
    uint64                 num_saved_pivot_keys;
    key_buffer             saved_pivot_keys[TRUNK_MAX_PIVOTS];
+
+   // range tombstones intersecting the node, and their iterators
+   trunk_range_tombstone_set      range_tombstones;
+   trunk_range_tombstone_iterator tombstone_itor[TRUNK_RANGE_ITOR_MAX_BRANCHES];
 } compact_bundle_scratch;
 
 // Used by trunk_split_leaf()
@@ -728,7 +790,7 @@ void                               trunk_print                     (platform_log
 void                               trunk_print_node                (platform_log_handle *log_handle, trunk_handle *spl, uint64 addr);
 static void                        trunk_print_pivots              (platform_log_handle *log_handle, trunk_handle *spl, page_handle *node);
 static void                        trunk_print_branches_and_bundles(platform_log_handle *log_handle, trunk_handle *spl, page_handle *node);
-static void                        trunk_btree_skiperator_init     (trunk_handle *spl, trunk_btree_skiperator *skip_itor, page_handle *node, uint16 branch_idx, key_buffer pivots[static TRUNK_MAX_PIVOTS]);
+static void                        trunk_btree_skiperator_init     (trunk_handle *spl, trunk_btree_skiperator *skip_itor, page_handle *node, uint16 branch_idx, key_buffer pivots[static TRUNK_MAX_PIVOTS], trunk_range_tombstone_set *range_tombstones);
 void                               trunk_btree_skiperator_get_curr (iterator *itor, key *curr_key, message *data);
 platform_status                    trunk_btree_skiperator_advance  (iterator *itor);
 platform_status                    trunk_btree_skiperator_at_end   (iterator *itor, bool *at_end);
@@ -736,6 +798,10 @@ void                               trunk_btree_skiperator_print    (iterator *it
 void                               trunk_btree_skiperator_deinit   (trunk_handle *spl, trunk_btree_skiperator *skip_itor);
 bool                               trunk_verify_node               (trunk_handle *spl, page_handle *node);
 void                               trunk_maybe_reclaim_space       (trunk_handle *spl);
+static void                        trunk_checkpoint_maybe_start    (trunk_handle *spl);
+static void                        trunk_checkpoint_now            (trunk_handle *spl, uint64 generation);
+static platform_status             trunk_range_tombstone_snapshot  (trunk_handle *spl, trunk_range_tombstone_set *snapshot, key min_key, key max_key);
+static void                        trunk_range_tombstone_set_deinit(trunk_handle *spl, trunk_range_tombstone_set *set);
 const static iterator_ops trunk_btree_skiperator_ops = {
    .get_curr = trunk_btree_skiperator_get_curr,
    .at_end   = trunk_btree_skiperator_at_end,
@@ -768,6 +834,88 @@ trunk_pages_per_extent(const trunk_config *cfg)
  * Super block functions
  *-----------------------------------------------------------------------------
  */
+
+static uint64
+trunk_range_tombstone_ondisk_size(trunk_range_tombstone *tombstone)
+{
+   key start_key = key_buffer_key(&tombstone->start_key);
+   key end_key   = key_buffer_key(&tombstone->end_key);
+   return sizeof(uint64) + 2 * sizeof(ondisk_key)
+          + ondisk_key_required_data_capacity(start_key)
+          + ondisk_key_required_data_capacity(end_key);
+}
+
+static void
+trunk_range_tombstone_page_release(trunk_handle *spl, page_handle *page)
+{
+   cache_mark_dirty(spl->cc, page);
+   cache_unlock(spl->cc, page);
+   cache_unclaim(spl->cc, page);
+   cache_unget(spl->cc, page);
+}
+
+/*
+ * Writes out the range tombstones in set, see trunk_range_tombstone_page_hdr.
+ * Returns the address of the first page, or 0 if there are none.
+ */
+static uint64
+trunk_range_tombstones_write(trunk_handle *spl, trunk_range_tombstone_set *set)
+{
+   uint64       page_size = trunk_page_size(&spl->cfg);
+   uint64       head_addr = 0;
+   uint64       addr      = 0;
+   uint64       offset    = 0;
+   page_handle *page      = NULL;
+   for (uint64 i = 0; i < set->num_tombstones; i++) {
+      trunk_range_tombstone *tombstone = &set->tombstone[i];
+      uint64 size = trunk_range_tombstone_ondisk_size(tombstone);
+      platform_assert(sizeof(trunk_range_tombstone_page_hdr) + size
+                      <= page_size);
+      if (page == NULL || offset + size > page_size) {
+         uint64 next_addr = addr + page_size;
+         if (page == NULL
+             || cache_extent_base_addr(spl->cc, next_addr)
+                   != cache_extent_base_addr(spl->cc, addr))
+         {
+            platform_status rc =
+               allocator_alloc(spl->al, &next_addr, PAGE_TYPE_MISC);
+            platform_assert_status_ok(rc);
+         }
+         page_handle *next_page =
+            cache_alloc(spl->cc, next_addr, PAGE_TYPE_MISC);
+         memset(next_page->data, 0, page_size);
+         if (page == NULL) {
+            head_addr = next_addr;
+         } else {
+            trunk_range_tombstone_page_hdr *hdr =
+               (trunk_range_tombstone_page_hdr *)page->data;
+            hdr->next_addr = next_addr;
+            trunk_range_tombstone_page_release(spl, page);
+         }
+         page   = next_page;
+         addr   = next_addr;
+         offset = sizeof(trunk_range_tombstone_page_hdr);
+      }
+
+      trunk_range_tombstone_page_hdr *hdr =
+         (trunk_range_tombstone_page_hdr *)page->data;
+      char *entry = page->data + offset;
+      memcpy(entry, &tombstone->generation, sizeof(uint64));
+      ondisk_key *start_key = (ondisk_key *)(entry + sizeof(uint64));
+      copy_key_to_ondisk_key(start_key, key_buffer_key(&tombstone->start_key));
+      ondisk_key *end_key =
+         (ondisk_key *)((char *)start_key + sizeof(ondisk_key)
+                        + sizeof_ondisk_key_data(start_key));
+      copy_key_to_ondisk_key(end_key, key_buffer_key(&tombstone->end_key));
+      hdr->num_tombstones++;
+      offset += size;
+   }
+   if (page != NULL) {
+      trunk_range_tombstone_page_release(spl, page);
+   }
+   return head_addr;
+}
+
 void
 trunk_set_super_block(trunk_handle *spl,
                       bool          is_checkpoint,
@@ -780,6 +928,29 @@ trunk_set_super_block(trunk_handle *spl,
    uint64             wait = 1;
    platform_status    rc;
 
+   uint64 meta_tail            = mini_meta_tail(&spl->mini);
+   uint64 generation_base      = spl->generation_base;
+   uint64 range_tombstone_addr = 0;
+   if (is_checkpoint) {
+      // the image is that of the checkpoint, see "Crash recovery"
+      meta_tail            = spl->checkpoint.meta_tail;
+      range_tombstone_addr = spl->checkpoint.range_tombstone_addr;
+      generation_base      = spl->checkpoint.generation_base;
+   }
+   if (is_unmount) {
+      // the data of this mount is older than any data of the next one
+      generation_base += memtable_generation(spl->mt_ctxt) + 1;
+      trunk_range_tombstone_set range_tombstones;
+      rc = trunk_range_tombstone_snapshot(spl,
+                                          &range_tombstones,
+                                          NEGATIVE_INFINITY_KEY,
+                                          POSITIVE_INFINITY_KEY);
+      platform_assert_status_ok(rc);
+      range_tombstone_addr =
+         trunk_range_tombstones_write(spl, &range_tombstones);
+      trunk_range_tombstone_set_deinit(spl, &range_tombstones);
+   }
+
    if (is_create) {
       rc = allocator_alloc_super_addr(spl->al, spl->id, &super_addr);
    } else {
@@ -796,14 +967,29 @@ trunk_set_super_block(trunk_handle *spl,
 
    super            = (trunk_super_block *)super_page->data;
    super->root_addr = spl->root_addr;
-   super->meta_tail = mini_meta_tail(&spl->mini);
+   super->meta_tail = meta_tail;
    if (spl->cfg.use_log) {
-      super->log_addr      = log_addr(spl->log);
-      super->log_meta_addr = log_meta_addr(spl->log);
+      super->log_addr            = log_addr(spl->log);
+      super->log_meta_addr       = log_meta_addr(spl->log);
+      super->log_magic           = log_magic(spl->log);
+      super->log_generation      = spl->checkpoint.log_generation;
+      super->log_generation_base = spl->generation_base;
+      super->prev_log_addr       = 0;
+      super->prev_log_magic      = 0;
+      super->journal_addr        = 0;
+      if (spl->prev_log != NULL) {
+         super->prev_log_addr  = log_addr(spl->prev_log);
+         super->prev_log_magic = log_magic(spl->prev_log);
+      }
+      if (is_checkpoint) {
+         super->journal_addr = spl->checkpoint.journal.head_addr;
+      }
    }
    super->timestamp    = platform_get_real_time();
    super->checkpointed = is_checkpoint;
    super->unmounted    = is_unmount;
+   super->generation_base      = generation_base;
+   super->range_tombstone_addr = range_tombstone_addr;
    super->checksum =
       platform_checksum128(super,
                            sizeof(trunk_super_block) - sizeof(checksum128),
@@ -1002,11 +1188,65 @@ trunk_node_unget(trunk_handle *spl, page_handle **node)
    *node = NULL;
 }
 
+/*
+ * Trunk pages are updated in place, so a checkpoint copies the dirty ones out
+ * while no thread holds a claim on one, see trunk_quiesce. A thread taking its
+ * first claim counts itself in spl->modifiers, unless a checkpoint is
+ * quiescing the trunk, in which case it must drop its references and retry.
+ */
+static inline bool
+trunk_modify_try_begin(trunk_handle *spl)
+{
+   const threadid tid = platform_get_tid();
+   if (spl->modifier[tid].claims++ != 0) {
+      return TRUE;
+   }
+   if ((__sync_add_and_fetch(&spl->modifiers, 1) & TRUNK_QUIESCED) == 0) {
+      return TRUE;
+   }
+   __sync_fetch_and_sub(&spl->modifiers, 1);
+   spl->modifier[tid].claims--;
+   return FALSE;
+}
+
+static inline void
+trunk_modify_begin(trunk_handle *spl)
+{
+   uint64 wait = 1;
+   while (!trunk_modify_try_begin(spl)) {
+      platform_sleep(wait);
+      wait = wait > 2048 ? wait : 2 * wait;
+   }
+}
+
+static inline void
+trunk_modify_end(trunk_handle *spl)
+{
+   const threadid tid = platform_get_tid();
+   platform_assert(spl->modifier[tid].claims != 0);
+   if (--spl->modifier[tid].claims == 0) {
+      __sync_fetch_and_sub(&spl->modifiers, 1);
+   }
+}
+
+static inline bool
+trunk_node_try_claim(trunk_handle *spl, page_handle *node)
+{
+   if (!trunk_modify_try_begin(spl)) {
+      return FALSE;
+   }
+   if (cache_claim(spl->cc, node)) {
+      return TRUE;
+   }
+   trunk_modify_end(spl);
+   return FALSE;
+}
+
 static inline void
 trunk_node_claim(trunk_handle *spl, page_handle **node)
 {
    uint64 wait = 1;
-   while (!cache_claim(spl->cc, *node)) {
+   while (!trunk_node_try_claim(spl, *node)) {
       uint64 addr = (*node)->disk_addr;
       trunk_node_unget(spl, node);
       platform_sleep(wait);
@@ -1019,6 +1259,7 @@ static inline void
 trunk_node_unclaim(trunk_handle *spl, page_handle *node)
 {
    cache_unclaim(spl->cc, node);
+   trunk_modify_end(spl);
 }
 
 static inline void
@@ -1037,10 +1278,27 @@ trunk_node_unlock(trunk_handle *spl, page_handle *node)
 page_handle *
 trunk_alloc(trunk_handle *spl, uint64 height)
 {
+   trunk_modify_begin(spl);
    uint64 addr = mini_alloc(&spl->mini, height, NULL_KEY, NULL);
    return cache_alloc(spl->cc, addr, PAGE_TYPE_TRUNK);
 }
 
+typedef void (*trunk_extent_fn)(trunk_handle *spl, uint64 extent_addr);
+
+/*
+ * Frees an extent of miscellaneous pages with a single reference, which is
+ * allocated directly from the allocator, dropping its pages from the cache.
+ */
+static void
+trunk_free_misc_extent(trunk_handle *spl, uint64 extent_addr)
+{
+   uint8 ref = allocator_dec_ref(spl->al, extent_addr, PAGE_TYPE_MISC);
+   platform_assert(ref == AL_NO_REFS);
+   cache_hard_evict_extent(spl->cc, extent_addr, PAGE_TYPE_MISC);
+   ref = allocator_dec_ref(spl->al, extent_addr, PAGE_TYPE_MISC);
+   platform_assert(ref == AL_FREE);
+}
+
 /*
  *-----------------------------------------------------------------------------
  * Circular Buffer Arithmetic
@@ -2232,7 +2490,6 @@ trunk_leaf_rebundle_all_branches(trunk_handle *spl,
       routing_filter   *filter = trunk_subbundle_filter(spl, node, sb, 0);
       trunk_pivot_data *pdata  = trunk_get_pivot_data(spl, node, 0);
       *filter                  = pdata->filter;
-      debug_assert(filter->addr != 0);
       ZERO_STRUCT(pdata->filter);
       debug_assert(trunk_subbundle_branch_count(spl, node, sb) != 0);
    }
@@ -2880,2699 +3137,5658 @@ trunk_inc_intersection(trunk_handle *spl,
 }
 
 /*
- * trunk_btree_lookup performs a lookup for key in branch.
+ *-----------------------------------------------------------------------------
+ * Range tombstones
  *
- * Pre-conditions:
- *    If *data is not the null write_buffer, then
- *       `data` has the most recent answer.
- *       the current memtable is older than the most recent answer
+ *      trunk_delete_range deletes a key range with a single range tombstone
+ *      rather than a delete message per key. Each memtable and branch has a
+ *      data generation, generation_base plus the generation of its newest
+ *      memtable, and a tombstone deletes its range from all the data with a
+ *      smaller generation:
+ *         -- lookups treat an older branch or memtable as a definitive delete
+ *            of the key,
+ *         -- range iterators skip the covered tuples of older branches and
+ *            memtables,
+ *         -- compact_bundle does not read the pivots of a branch which are
+ *            entirely covered, and drops the covered tuples of the rest, so
+ *            the deleted data is reclaimed as it is compacted.
  *
- * Post-conditions:
- *    if *local_found, then data can be found in `data`.
+ *      The tombstones are kept in spl->range_tombstones, which writers
+ *      replace as a whole under range_tombstone_lock. Readers take no lock:
+ *      they bracket their use of the set with trunk_range_tombstones_enter
+ *      and _exit, and a replaced set is only freed once every reader which
+ *      may have seen it has exited. The tombstones are written out with each
+ *      checkpoint and at unmount.
+ *
+ *      A tombstone is discarded when a newer one covers its range, and is
+ *      retired once it no longer deletes anything: when the memtables older
+ *      than it are all incorporated and no older branch holds a tuple in its
+ *      range, see trunk_retire_range_tombstones.
+ *-----------------------------------------------------------------------------
  */
-static inline platform_status
-trunk_btree_lookup_and_merge(trunk_handle      *spl,
-                             trunk_branch      *branch,
-                             key                target,
-                             merge_accumulator *data,
-                             bool              *local_found)
+static inline uint64
+trunk_data_generation(trunk_handle *spl, uint64 mt_gen)
 {
-   cache          *cc  = spl->cc;
-   btree_config   *cfg = &spl->cfg.btree_cfg;
-   platform_status rc;
-
-   rc = btree_lookup_and_merge(
-      cc, cfg, branch->root_addr, PAGE_TYPE_BRANCH, target, data, local_found);
-   return rc;
+   return spl->generation_base + mt_gen;
 }
 
-
 /*
- *-----------------------------------------------------------------------------
- * trunk_btree_lookup_async
- *
- * Pre-conditions:
- *    The ctxt should've been initialized using
- *    btree_ctxt_init(). If *found `data` has the most
- *    recent answer. the current memtable is older than the most
- *    recent answer
- *
- *    The return value can be either of:
- *      async_locked: A page needed by lookup is locked. User should retry
- *      request.
- *      async_no_reqs: A page needed by lookup is not in cache and the IO
- *      subsystem is out of requests. User should throttle.
- *      async_io_started: Async IO was started to read a page needed by the
- *      lookup into the cache. When the read is done, caller will be notified
- *      using ctxt->cb, that won't run on the thread context. It can be used
- *      to requeue the async lookup request for dispatch in thread context.
- *      When it's requeued, it must use the same function params except found.
- *      success: *found is TRUE if found, FALSE otherwise, data is stored in
- *      *data_out
- *-----------------------------------------------------------------------------
+ * Returns spl->range_tombstones, which the caller may read until it calls
+ * trunk_range_tombstones_exit. Must not be nested.
  */
-static cache_async_result
-trunk_btree_lookup_and_merge_async(trunk_handle      *spl,    // IN
-                                   trunk_branch      *branch, // IN
-                                   key                target, // IN
-                                   merge_accumulator *data,   // OUT
-                                   btree_async_ctxt  *ctxt)    // IN
+static inline trunk_range_tombstone_set *
+trunk_range_tombstones_enter(trunk_handle *spl)
 {
-   cache             *cc  = spl->cc;
-   btree_config      *cfg = &spl->cfg.btree_cfg;
-   cache_async_result res;
-   bool               local_found;
+   threadid tid = platform_get_tid();
+   __sync_fetch_and_add(&spl->range_tombstone_reader[tid].seq, 1);
+   return spl->range_tombstones;
+}
 
-   res = btree_lookup_and_merge_async(
-      cc, cfg, branch->root_addr, target, data, &local_found, ctxt);
-   return res;
+static inline void
+trunk_range_tombstones_exit(trunk_handle *spl)
+{
+   threadid tid = platform_get_tid();
+   __sync_fetch_and_add(&spl->range_tombstone_reader[tid].seq, 1);
 }
 
+static inline bool
+trunk_range_tombstone_contains(trunk_handle          *spl,
+                               trunk_range_tombstone *tombstone,
+                               key                    target)
+{
+   return trunk_key_compare(spl, key_buffer_key(&tombstone->start_key), target)
+             <= 0
+          && trunk_key_compare(spl, target, key_buffer_key(&tombstone->end_key))
+                < 0;
+}
 
 /*
- *-----------------------------------------------------------------------------
- * Memtable Functions
- *-----------------------------------------------------------------------------
+ * Returns a tombstone in set deleting target from data of the given
+ * generation, or NULL if there is none.
  */
-
-memtable *
-trunk_try_get_memtable(trunk_handle *spl, uint64 generation)
+static inline trunk_range_tombstone *
+trunk_range_tombstone_set_find(trunk_handle              *spl,
+                               trunk_range_tombstone_set *set,
+                               key                        target,
+                               uint64                     generation)
 {
-   uint64    memtable_idx = generation % TRUNK_NUM_MEMTABLES;
-   memtable *mt           = &spl->mt_ctxt->mt[memtable_idx];
-   if (mt->generation != generation) {
-      mt = NULL;
+   for (uint64 i = 0; i < set->num_tombstones; i++) {
+      trunk_range_tombstone *tombstone = &set->tombstone[i];
+      if (generation < tombstone->generation
+          && trunk_range_tombstone_contains(spl, tombstone, target))
+      {
+         return tombstone;
+      }
    }
-   return mt;
+   return NULL;
 }
 
 /*
- * returns the memtable with generation number generation. Caller must ensure
- * that there exists a memtable with the appropriate generation.
+ * Returns TRUE if all of [start_key, end_key) is deleted from data of the
+ * given generation by a single tombstone in set.
  */
-memtable *
-trunk_get_memtable(trunk_handle *spl, uint64 generation)
+static bool
+trunk_range_tombstone_set_deletes_range(trunk_handle              *spl,
+                                        trunk_range_tombstone_set *set,
+                                        key                        start_key,
+                                        key                        end_key,
+                                        uint64                     generation)
 {
-   uint64    memtable_idx = generation % TRUNK_NUM_MEMTABLES;
-   memtable *mt           = &spl->mt_ctxt->mt[memtable_idx];
-   platform_assert(mt->generation == generation);
-   return mt;
+   for (uint64 i = 0; i < set->num_tombstones; i++) {
+      trunk_range_tombstone *tombstone = &set->tombstone[i];
+      if (generation < tombstone->generation
+          && trunk_key_compare(
+                spl, key_buffer_key(&tombstone->start_key), start_key)
+                <= 0
+          && trunk_key_compare(
+                spl, end_key, key_buffer_key(&tombstone->end_key))
+                <= 0)
+      {
+         return TRUE;
+      }
+   }
+   return FALSE;
 }
 
-trunk_compacted_memtable *
-trunk_get_compacted_memtable(trunk_handle *spl, uint64 generation)
+static void
+trunk_range_tombstone_set_deinit(trunk_handle              *spl,
+                                 trunk_range_tombstone_set *set)
 {
-   uint64 memtable_idx = generation % TRUNK_NUM_MEMTABLES;
-
-   // this call asserts the generation is correct
-   memtable *mt = trunk_get_memtable(spl, generation);
-   platform_assert(mt->state != MEMTABLE_STATE_READY);
-
-   return &spl->compacted_memtable[memtable_idx];
+   for (uint64 i = 0; i < set->num_tombstones; i++) {
+      key_buffer_deinit(&set->tombstone[i].start_key);
+      key_buffer_deinit(&set->tombstone[i].end_key);
+   }
+   if (set->tombstone != NULL) {
+      platform_free(spl->heap_id, set->tombstone);
+   }
+   ZERO_CONTENTS(set);
 }
 
-static inline void
-trunk_memtable_inc_ref(trunk_handle *spl, uint64 mt_gen)
+static platform_status
+trunk_range_tombstone_init(trunk_handle          *spl,
+                           trunk_range_tombstone *tombstone,
+                           uint64                 generation,
+                           key                    start_key,
+                           key                    end_key)
 {
-   memtable *mt = trunk_get_memtable(spl, mt_gen);
-   allocator_inc_ref(spl->al, mt->root_addr);
+   tombstone->generation = generation;
+   platform_status rc =
+      key_buffer_init_from_key(&tombstone->start_key, spl->heap_id, start_key);
+   if (!SUCCESS(rc)) {
+      key_buffer_init(&tombstone->end_key, spl->heap_id);
+      return rc;
+   }
+   return key_buffer_init_from_key(
+      &tombstone->end_key, spl->heap_id, end_key);
 }
 
-
-void
-trunk_memtable_dec_ref(trunk_handle *spl, uint64 generation)
+/*
+ * Returns TRUE if a tombstone in set deletes all that tombstone does, i.e. is
+ * at least as new and covers its range.
+ */
+static bool
+trunk_range_tombstone_set_covers(trunk_handle              *spl,
+                                 trunk_range_tombstone_set *set,
+                                 trunk_range_tombstone     *tombstone)
 {
-   memtable *mt = trunk_get_memtable(spl, generation);
-   memtable_dec_ref_maybe_recycle(spl->mt_ctxt, mt);
+   return trunk_range_tombstone_set_deletes_range(
+      spl,
+      set,
+      key_buffer_key(&tombstone->start_key),
+      key_buffer_key(&tombstone->end_key),
+      tombstone->generation - 1);
+}
 
-   // the branch in the compacted memtable is now in the tree, so don't zap it,
-   // we don't try to zero out the cmt because that would introduce a race.
+/*
+ * Copies the tombstones of src (which may be NULL) which intersect [min_key,
+ * max_key) and are not covered by skip (which may be NULL) into dst, followed
+ * by those of extra (which may be NULL).
+ */
+static platform_status
+trunk_range_tombstone_set_copy(trunk_handle              *spl,
+                               trunk_range_tombstone_set *dst,
+                               trunk_range_tombstone_set *src,
+                               key                        min_key,
+                               key                        max_key,
+                               trunk_range_tombstone_set *skip,
+                               trunk_range_tombstone_set *extra)
+{
+   ZERO_CONTENTS(dst);
+   uint64 num_src_tombstones = src == NULL ? 0 : src->num_tombstones;
+   uint64 num_tombstones     = extra == NULL ? 0 : extra->num_tombstones;
+   for (uint64 pass = 0; pass < 2; pass++) {
+      for (uint64 i = 0; i < num_src_tombstones; i++) {
+         trunk_range_tombstone *tombstone = &src->tombstone[i];
+         key start_key = key_buffer_key(&tombstone->start_key);
+         key end_key   = key_buffer_key(&tombstone->end_key);
+         if (trunk_key_compare(spl, start_key, max_key) >= 0
+             || trunk_key_compare(spl, min_key, end_key) >= 0)
+         {
+            continue;
+         }
+         if (skip != NULL
+             && trunk_range_tombstone_set_covers(spl, skip, tombstone))
+         {
+            continue;
+         }
+         if (pass == 0) {
+            num_tombstones++;
+            continue;
+         }
+         platform_status rc =
+            trunk_range_tombstone_init(spl,
+                                       &dst->tombstone[dst->num_tombstones++],
+                                       tombstone->generation,
+                                       start_key,
+                                       end_key);
+         if (!SUCCESS(rc)) {
+            trunk_range_tombstone_set_deinit(spl, dst);
+            return rc;
+         }
+      }
+      if (pass == 0) {
+         if (num_tombstones == 0) {
+            return STATUS_OK;
+         }
+         dst->tombstone =
+            TYPED_ARRAY_MALLOC(spl->heap_id, dst->tombstone, num_tombstones);
+         if (dst->tombstone == NULL) {
+            return STATUS_NO_MEMORY;
+         }
+      }
+   }
+   for (uint64 i = 0; extra != NULL && i < extra->num_tombstones; i++) {
+      trunk_range_tombstone *tombstone = &extra->tombstone[i];
+      platform_status        rc =
+         trunk_range_tombstone_init(spl,
+                                    &dst->tombstone[dst->num_tombstones++],
+                                    tombstone->generation,
+                                    key_buffer_key(&tombstone->start_key),
+                                    key_buffer_key(&tombstone->end_key));
+      if (!SUCCESS(rc)) {
+         trunk_range_tombstone_set_deinit(spl, dst);
+         return rc;
+      }
+   }
+   return STATUS_OK;
 }
 
+/*
+ * Copies the tombstones intersecting [min_key, max_key) into snapshot.
+ */
+static platform_status
+trunk_range_tombstone_snapshot(trunk_handle              *spl,
+                               trunk_range_tombstone_set *snapshot,
+                               key                        min_key,
+                               key                        max_key)
+{
+   if (spl->range_tombstones == NULL) {
+      ZERO_CONTENTS(snapshot);
+      return STATUS_OK;
+   }
+   trunk_range_tombstone_set *set = trunk_range_tombstones_enter(spl);
+   platform_status            rc  = trunk_range_tombstone_set_copy(
+      spl, snapshot, set, min_key, max_key, NULL, NULL);
+   trunk_range_tombstones_exit(spl);
+   return rc;
+}
 
 /*
- * Wrappers for creating/destroying memtable iterators. Increments/decrements
- * the memtable ref count and cleans up if ref count == 0
+ * Returns the generation of the newest tombstone in set deleting target, or 0
+ * if there is none. Data older than the returned generation is deleted.
  */
-static void
-trunk_memtable_iterator_init(trunk_handle   *spl,
-                             btree_iterator *itor,
-                             uint64          root_addr,
-                             key             min_key,
-                             key             max_key,
-                             bool            is_live,
-                             bool            inc_ref)
+static uint64
+trunk_range_tombstone_set_generation(trunk_handle              *spl,
+                                     trunk_range_tombstone_set *set,
+                                     key                        target)
 {
-   if (inc_ref) {
-      allocator_inc_ref(spl->al, root_addr);
+   uint64 generation = 0;
+   for (uint64 i = 0; i < set->num_tombstones; i++) {
+      trunk_range_tombstone *tombstone = &set->tombstone[i];
+      if (generation < tombstone->generation
+          && trunk_range_tombstone_contains(spl, tombstone, target))
+      {
+         generation = tombstone->generation;
+      }
    }
-   btree_iterator_init(spl->cc,
-                       &spl->cfg.btree_cfg,
-                       itor,
-                       root_addr,
-                       PAGE_TYPE_MEMTABLE,
-                       min_key,
-                       max_key,
-                       FALSE,
-                       0);
+   return generation;
 }
 
-static void
-trunk_memtable_iterator_deinit(trunk_handle   *spl,
-                               btree_iterator *itor,
-                               uint64          mt_gen,
-                               bool            dec_ref)
+static uint64
+trunk_range_tombstone_generation(trunk_handle *spl, key target)
 {
-   btree_iterator_deinit(itor);
-   if (dec_ref) {
-      trunk_memtable_dec_ref(spl, mt_gen);
+   if (spl->range_tombstones == NULL) {
+      return 0;
    }
+   trunk_range_tombstone_set *set        = trunk_range_tombstones_enter(spl);
+   uint64                     generation = 0;
+   if (set != NULL) {
+      generation = trunk_range_tombstone_set_generation(spl, set, target);
+   }
+   trunk_range_tombstones_exit(spl);
+   return generation;
 }
 
 /*
- * Attempts to insert (key, data) into the current memtable.
- *
- * Returns:
- *    success if succeeded
- *    locked if the current memtable is full
- *    lock_acquired if the current memtable is full and this thread is
- *       responsible for flushing it.
+ * Merges the deletion of target into data, which then holds the definitive
+ * answer of the lookup.
  */
-platform_status
-trunk_memtable_insert(trunk_handle *spl, key tuple_key, message msg)
+static inline void
+trunk_apply_range_tombstone(trunk_handle      *spl,
+                            key                target,
+                            merge_accumulator *data)
 {
-   page_handle    *lock_page;
-   uint64          generation;
-   platform_status rc = memtable_maybe_rotate_and_get_insert_lock(
-      spl->mt_ctxt, &generation, &lock_page);
-   if (!SUCCESS(rc)) {
-      goto out;
+   if (merge_accumulator_is_null(data)) {
+      bool success = merge_accumulator_copy_message(data, DELETE_MESSAGE);
+      platform_assert(success);
+   } else if (!merge_accumulator_is_definitive(data)) {
+      data_merge_tuples_final(spl->cfg.data_cfg, target, data);
    }
+}
 
-   // this call is safe because we hold the insert lock
-   memtable *mt = trunk_get_memtable(spl, generation);
-   uint64    leaf_generation; // used for ordering the log
-   rc = memtable_insert(
-      spl->mt_ctxt, mt, spl->heap_id, tuple_key, msg, &leaf_generation);
-   if (!SUCCESS(rc)) {
-      goto unlock_insert_lock;
+/*
+ * Frees set, which has been replaced in spl->range_tombstones, once every
+ * reader which may have seen it has exited.
+ */
+static void
+trunk_range_tombstones_free(trunk_handle *spl, trunk_range_tombstone_set *set)
+{
+   if (set == NULL) {
+      return;
    }
-
-   if (spl->cfg.use_log) {
-      int crappy_rc = log_write(spl->log, tuple_key, msg, leaf_generation);
-      if (crappy_rc != 0) {
-         goto unlock_insert_lock;
+   __sync_synchronize();
+   for (threadid tid = 0; tid < MAX_THREADS; tid++) {
+      uint64 seq  = spl->range_tombstone_reader[tid].seq;
+      uint64 wait = 1;
+      while (seq % 2 == 1 && spl->range_tombstone_reader[tid].seq == seq) {
+         platform_sleep(wait);
+         wait = wait > 2048 ? wait : 2 * wait;
       }
    }
-
-unlock_insert_lock:
-   memtable_unget_insert_lock(spl->mt_ctxt, lock_page);
-out:
-   return rc;
+   trunk_range_tombstone_set_deinit(spl, set);
+   platform_free(spl->heap_id, set);
 }
 
 /*
- * Compacts the memtable with generation generation and builds its filter.
- * Returns a pointer to the memtable.
+ * Replaces spl->range_tombstones with a copy which leaves out the tombstones
+ * covered by skip and adds those of extra (either may be NULL).
  */
-static memtable *
-trunk_memtable_compact_and_build_filter(trunk_handle  *spl,
-                                        uint64         generation,
-                                        const threadid tid)
-{
-   timestamp comp_start = platform_get_timestamp();
-
-   memtable *mt = trunk_get_memtable(spl, generation);
+static platform_status
+trunk_range_tombstones_replace(trunk_handle              *spl,
+                               trunk_range_tombstone_set *skip,
+                               trunk_range_tombstone_set *extra)
+{
+   trunk_range_tombstone_set *new_set = TYPED_MALLOC(spl->heap_id, new_set);
+   if (new_set == NULL) {
+      return STATUS_NO_MEMORY;
+   }
+   platform_spin_lock(&spl->range_tombstone_lock);
+   trunk_range_tombstone_set *old_set = spl->range_tombstones;
+   platform_status            rc      = trunk_range_tombstone_set_copy(spl,
+                                                       new_set,
+                                                       old_set,
+                                                       NEGATIVE_INFINITY_KEY,
+                                                       POSITIVE_INFINITY_KEY,
+                                                       skip,
+                                                       extra);
+   if (SUCCESS(rc)) {
+      if (new_set->num_tombstones == 0) {
+         platform_free(spl->heap_id, new_set);
+         new_set = NULL;
+      }
+      // the contents of the new set must be visible before it is
+      __sync_synchronize();
+      spl->range_tombstones = new_set;
+   }
+   platform_spin_unlock(&spl->range_tombstone_lock);
 
-   memtable_transition(mt, MEMTABLE_STATE_FINALIZED, MEMTABLE_STATE_COMPACTING);
-   mini_release(&mt->mini, NULL_KEY);
+   if (!SUCCESS(rc)) {
+      platform_free(spl->heap_id, new_set);
+      return rc;
+   }
+   trunk_range_tombstones_free(spl, old_set);
+   return STATUS_OK;
+}
 
-   trunk_compacted_memtable *cmt =
-      trunk_get_compacted_memtable(spl, generation);
-   trunk_branch *new_branch = &cmt->branch;
-   ZERO_CONTENTS(new_branch);
+/*
+ * Adds a tombstone to spl->range_tombstones, dropping the tombstones it
+ * covers.
+ */
+static platform_status
+trunk_add_range_tombstone(trunk_handle *spl,
+                          uint64        generation,
+                          key           start_key,
+                          key           end_key)
+{
+   trunk_range_tombstone tombstone;
+   platform_status       rc = trunk_range_tombstone_init(
+      spl, &tombstone, generation, start_key, end_key);
+   if (SUCCESS(rc)) {
+      trunk_range_tombstone_set set = {.num_tombstones = 1,
+                                       .tombstone      = &tombstone};
+      rc = trunk_range_tombstones_replace(spl, &set, &set);
+   }
+   if (SUCCESS(rc)) {
+      spl->range_tombstones_dirty = TRUE;
+   }
+   key_buffer_deinit(&tombstone.start_key);
+   key_buffer_deinit(&tombstone.end_key);
+   return rc;
+}
 
-   uint64         memtable_root_addr = mt->root_addr;
-   btree_iterator btree_itor;
-   iterator      *itor = &btree_itor.super;
-
-   trunk_memtable_iterator_init(spl,
-                                &btree_itor,
-                                memtable_root_addr,
-                                NEGATIVE_INFINITY_KEY,
-                                POSITIVE_INFINITY_KEY,
-                                FALSE,
-                                FALSE);
-   btree_pack_req req;
-   btree_pack_req_init(&req,
-                       spl->cc,
-                       &spl->cfg.btree_cfg,
-                       itor,
-                       spl->cfg.max_tuples_per_node,
-                       spl->cfg.filter_cfg.hash,
-                       spl->cfg.filter_cfg.seed,
-                       spl->heap_id);
-   uint64 pack_start;
-   if (spl->cfg.use_stats) {
-      spl->stats[tid].root_compactions++;
-      pack_start = platform_get_timestamp();
+/*
+ * Returns TRUE if a branch of node live for the pivot containing min_key and
+ * older than generation has a tuple in [min_key, max_key).
+ */
+static bool
+trunk_pivot_has_older_tuples(trunk_handle *spl,
+                             page_handle  *node,
+                             key           min_key,
+                             key           max_key,
+                             uint64        generation)
+{
+   uint16 pivot_no = trunk_find_pivot(spl, node, min_key, less_than_or_equal);
+   uint16 start_branch = trunk_start_branch(spl, node);
+   if (trunk_height(spl, node) != 0) {
+      start_branch = trunk_get_pivot_data(spl, node, pivot_no)->start_branch;
+   }
+   key pivot_max_key = trunk_get_pivot(spl, node, pivot_no + 1);
+   if (trunk_key_compare(spl, pivot_max_key, max_key) < 0) {
+      max_key = pivot_max_key;
    }
 
-   platform_status pack_status = btree_pack(&req);
-   platform_assert(SUCCESS(pack_status),
-                   "platform_status of btree_pack: %d\n",
-                   pack_status.r);
-
-   platform_assert(req.num_tuples <= spl->cfg.max_tuples_per_node);
-   if (spl->cfg.use_stats) {
-      spl->stats[tid].root_compaction_pack_time_ns +=
-         platform_timestamp_elapsed(pack_start);
-      spl->stats[tid].root_compaction_tuples += req.num_tuples;
-      if (req.num_tuples > spl->stats[tid].root_compaction_max_tuples) {
-         spl->stats[tid].root_compaction_max_tuples = req.num_tuples;
+   uint16 end_branch = trunk_end_branch(spl, node);
+   for (uint16 branch_no = start_branch; branch_no != end_branch;
+        branch_no        = trunk_add_branch_number(spl, branch_no, 1))
+   {
+      trunk_branch *branch = trunk_get_branch(spl, node, branch_no);
+      if (branch->generation >= generation) {
+         continue;
+      }
+      btree_iterator itor;
+      btree_iterator_init(spl->cc,
+                          trunk_btree_config(spl),
+                          &itor,
+                          branch->root_addr,
+                          PAGE_TYPE_BRANCH,
+                          min_key,
+                          max_key,
+                          FALSE,
+                          0);
+      bool            at_end;
+      platform_status rc = iterator_at_end(&itor.super, &at_end);
+      btree_iterator_deinit(&itor);
+      if (!SUCCESS(rc) || !at_end) {
+         return TRUE;
       }
    }
-   trunk_memtable_iterator_deinit(spl, &btree_itor, FALSE, FALSE);
+   return FALSE;
+}
 
-   new_branch->root_addr = req.root_addr;
+/*
+ * Returns TRUE if a branch of the trunk older than generation has a tuple in
+ * [start_key, end_key). The leaves are visited in key order, each from the
+ * root, getting each child before ungetting its parent as lookups do, so a
+ * branch which is flushed down meanwhile is seen before or after it moves.
+ */
+static bool
+trunk_has_older_tuples(trunk_handle *spl,
+                       key           start_key,
+                       key           end_key,
+                       uint64        generation)
+{
+   key_buffer      curr_key;
+   platform_status rc =
+      key_buffer_init_from_key(&curr_key, spl->heap_id, start_key);
+   bool found = !SUCCESS(rc);
+   while (!found
+          && trunk_key_compare(spl, key_buffer_key(&curr_key), end_key) < 0)
+   {
+      key          min_key = key_buffer_key(&curr_key);
+      page_handle *node    = trunk_node_get(spl, spl->root_addr);
+      found =
+         trunk_pivot_has_older_tuples(spl, node, min_key, end_key, generation);
+      while (!found && trunk_height(spl, node) != 0) {
+         uint16 pivot_no =
+            trunk_find_pivot(spl, node, min_key, less_than_or_equal);
+         trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
+         page_handle      *child = trunk_node_get(spl, pdata->addr);
+         trunk_node_unget(spl, &node);
+         node  = child;
+         found = trunk_pivot_has_older_tuples(
+            spl, node, min_key, end_key, generation);
+      }
+      if (!found) {
+         rc    = key_buffer_copy_key(&curr_key, trunk_max_key(spl, node));
+         found = !SUCCESS(rc);
+      }
+      trunk_node_unget(spl, &node);
+   }
+   key_buffer_deinit(&curr_key);
+   return found;
+}
 
-   platform_assert(req.num_tuples > 0);
-   uint64 filter_build_start;
-   if (spl->cfg.use_stats) {
-      filter_build_start = platform_get_timestamp();
+/*
+ * Drops the range tombstones which no longer delete anything: those newer
+ * than all the memtables still to be incorporated whose range holds no
+ * tuple of an older branch, compaction having dropped the deleted tuples.
+ *
+ * Runs after memtables are incorporated when a tombstone has been added or
+ * applied by a compaction since the last run, see range_tombstones_dirty.
+ * Only one thread retires tombstones at a time, and none do during mount,
+ * while the log replay still needs them.
+ */
+static void
+trunk_retire_range_tombstones(trunk_handle *spl)
+{
+   if (!spl->range_tombstones_dirty
+       || !__sync_bool_compare_and_swap(
+          &spl->retiring_range_tombstones, FALSE, TRUE))
+   {
+      return;
    }
+   spl->range_tombstones_dirty = FALSE;
 
-   cmt->req         = TYPED_ZALLOC(spl->heap_id, cmt->req);
-   cmt->req->spl    = spl;
-   cmt->req->fp_arr = req.fingerprint_arr;
-   cmt->req->type   = TRUNK_COMPACTION_TYPE_MEMTABLE;
-   uint32 *dup_fp_arr =
-      TYPED_ARRAY_MALLOC(spl->heap_id, dup_fp_arr, req.num_tuples);
-   memmove(dup_fp_arr, cmt->req->fp_arr, req.num_tuples * sizeof(uint32));
-   routing_filter empty_filter = {0};
+   trunk_range_tombstone_set snapshot, retired;
+   ZERO_CONTENTS(&retired);
+   platform_status rc = trunk_range_tombstone_snapshot(
+      spl, &snapshot, NEGATIVE_INFINITY_KEY, POSITIVE_INFINITY_KEY);
+   if (SUCCESS(rc) && snapshot.num_tombstones != 0) {
+      retired.tombstone = TYPED_ARRAY_MALLOC(
+         spl->heap_id, retired.tombstone, snapshot.num_tombstones);
+      rc = retired.tombstone == NULL ? STATUS_NO_MEMORY : STATUS_OK;
+   }
 
-   platform_status rc = routing_filter_add(spl->cc,
-                                           &spl->cfg.filter_cfg,
-                                           spl->heap_id,
-                                           &empty_filter,
-                                           &cmt->filter,
-                                           cmt->req->fp_arr,
-                                           req.num_tuples,
-                                           0);
+   /*
+    * The memtables up to generation_retired are in the trunk once the root
+    * can be got after it, as in trunk_lookup.
+    */
+   page_handle *mt_lookup_lock_page = memtable_get_lookup_lock(spl->mt_ctxt);
+   uint64       incorporated_generation = trunk_data_generation(
+      spl, memtable_generation_retired(spl->mt_ctxt) + 1);
+   page_handle *root = trunk_node_get(spl, spl->root_addr);
+   memtable_unget_lookup_lock(spl->mt_ctxt, mt_lookup_lock_page);
+   trunk_node_unget(spl, &root);
 
-   platform_assert(SUCCESS(rc));
-   if (spl->cfg.use_stats) {
-      spl->stats[tid].root_filter_time_ns +=
-         platform_timestamp_elapsed(filter_build_start);
-      spl->stats[tid].root_filters_built++;
-      spl->stats[tid].root_filter_tuples += req.num_tuples;
+   for (uint64 i = 0; SUCCESS(rc) && i < snapshot.num_tombstones; i++) {
+      trunk_range_tombstone *tombstone = &snapshot.tombstone[i];
+      key start_key = key_buffer_key(&tombstone->start_key);
+      key end_key   = key_buffer_key(&tombstone->end_key);
+      if (incorporated_generation < tombstone->generation) {
+         // try again once the older memtables are incorporated
+         spl->range_tombstones_dirty = TRUE;
+         continue;
+      }
+      if (trunk_has_older_tuples(
+             spl, start_key, end_key, tombstone->generation))
+      {
+         continue;
+      }
+      rc = trunk_range_tombstone_init(
+         spl,
+         &retired.tombstone[retired.num_tombstones++],
+         tombstone->generation,
+         start_key,
+         end_key);
+   }
+   if (SUCCESS(rc) && retired.num_tombstones != 0) {
+      rc = trunk_range_tombstones_replace(spl, &retired, NULL);
    }
+   if (!SUCCESS(rc)) {
+      spl->range_tombstones_dirty = TRUE;
+   }
+   trunk_range_tombstone_set_deinit(spl, &retired);
+   trunk_range_tombstone_set_deinit(spl, &snapshot);
+   spl->retiring_range_tombstones = FALSE;
+}
 
-   btree_pack_req_deinit(&req, spl->heap_id);
-   cmt->req->fp_arr = dup_fp_arr;
-   if (spl->cfg.use_stats) {
-      uint64 comp_time = platform_timestamp_elapsed(comp_start);
-      spl->stats[tid].root_compaction_time_ns += comp_time;
-      if (comp_start > spl->stats[tid].root_compaction_time_max_ns) {
-         spl->stats[tid].root_compaction_time_max_ns = comp_time;
+/*
+ * Reads back the range tombstones written by trunk_range_tombstones_write.
+ */
+static void
+trunk_range_tombstones_read(trunk_handle *spl, uint64 addr)
+{
+   while (addr != 0) {
+      page_handle *page = cache_get(spl->cc, addr, TRUE, PAGE_TYPE_MISC);
+      trunk_range_tombstone_page_hdr *hdr =
+         (trunk_range_tombstone_page_hdr *)page->data;
+      char *entry = page->data + sizeof(trunk_range_tombstone_page_hdr);
+      for (uint64 i = 0; i < hdr->num_tombstones; i++) {
+         uint64 generation;
+         memcpy(&generation, entry, sizeof(uint64));
+         ondisk_key *start_key = (ondisk_key *)(entry + sizeof(uint64));
+         ondisk_key *end_key =
+            (ondisk_key *)((char *)start_key + sizeof(ondisk_key)
+                           + sizeof_ondisk_key_data(start_key));
+         platform_status rc =
+            trunk_add_range_tombstone(spl,
+                                      generation,
+                                      ondisk_key_to_key(start_key),
+                                      ondisk_key_to_key(end_key));
+         platform_assert_status_ok(rc);
+         entry = (char *)end_key + sizeof(ondisk_key)
+                 + sizeof_ondisk_key_data(end_key);
       }
-      cmt->wait_start = platform_get_timestamp();
+      addr = hdr->next_addr;
+      cache_unget(spl->cc, page);
    }
+}
 
-   memtable_transition(mt, MEMTABLE_STATE_COMPACTING, MEMTABLE_STATE_COMPACTED);
-   return mt;
+/*
+ * Calls func on each extent of the pages written by
+ * trunk_range_tombstones_write, after reading the pages in it.
+ */
+static void
+trunk_range_tombstones_for_each_extent(trunk_handle   *spl,
+                                       uint64          addr,
+                                       trunk_extent_fn func)
+{
+   while (addr != 0) {
+      page_handle *page = cache_get(spl->cc, addr, TRUE, PAGE_TYPE_MISC);
+      trunk_range_tombstone_page_hdr *hdr =
+         (trunk_range_tombstone_page_hdr *)page->data;
+      uint64 next_addr = hdr->next_addr;
+      cache_unget(spl->cc, page);
+
+      uint64 extent_addr = cache_extent_base_addr(spl->cc, addr);
+      if (next_addr == 0
+          || cache_extent_base_addr(spl->cc, next_addr) != extent_addr)
+      {
+         func(spl, extent_addr);
+      }
+      addr = next_addr;
+   }
 }
 
 /*
- * Cases:
- * 1. memtable set to COMP before try_continue tries to set it to incorp
- *       try_continue will successfully assign itself to incorp the memtable
- * 2. memtable set to COMP after try_continue tries to set it to incorp
- *       should_wait will be set to generation, so try_start will incorp
+ * The range tombstone iterator skips the tuples of the wrapped iterator
+ * which are deleted by a tombstone in set. Reverse iterators skip straight
+ * below the start of the tombstone.
  */
-static inline bool
-trunk_try_start_incorporate(trunk_handle *spl, uint64 generation)
+static platform_status
+trunk_range_tombstone_iterator_skip_deleted(
+   trunk_range_tombstone_iterator *itor)
 {
-   bool should_start = FALSE;
-
-   memtable_lock_incorporation_lock(spl->mt_ctxt);
-   memtable *mt = trunk_try_get_memtable(spl, generation);
-   if ((mt == NULL)
-       || (generation != memtable_generation_to_incorporate(spl->mt_ctxt)))
-   {
-      should_start = FALSE;
-      goto unlock_incorp_lock;
+   bool at_end;
+   iterator_at_end(itor->itor, &at_end);
+   while (!at_end) {
+      key     curr_key;
+      message msg;
+      iterator_get_curr(itor->itor, &curr_key, &msg);
+      trunk_range_tombstone *tombstone = trunk_range_tombstone_set_find(
+         itor->spl, itor->set, curr_key, itor->generation);
+      if (tombstone == NULL) {
+         break;
+      }
+      platform_status rc;
+      if (itor->reverse) {
+         rc = iterator_seek(itor->itor, key_buffer_key(&tombstone->start_key));
+      } else {
+         rc = iterator_advance(itor->itor);
+      }
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+      iterator_at_end(itor->itor, &at_end);
    }
-   should_start = memtable_try_transition(
-      mt, MEMTABLE_STATE_COMPACTED, MEMTABLE_STATE_INCORPORATION_ASSIGNED);
+   return STATUS_OK;
+}
 
-unlock_incorp_lock:
-   memtable_unlock_incorporation_lock(spl->mt_ctxt);
-   return should_start;
+static void
+trunk_range_tombstone_iterator_get_curr(iterator *base_itor,
+                                        key      *curr_key,
+                                        message  *msg)
+{
+   trunk_range_tombstone_iterator *itor =
+      (trunk_range_tombstone_iterator *)base_itor;
+   iterator_get_curr(itor->itor, curr_key, msg);
 }
 
-static inline bool
-trunk_try_continue_incorporate(trunk_handle *spl, uint64 next_generation)
+static platform_status
+trunk_range_tombstone_iterator_at_end(iterator *base_itor, bool *at_end)
 {
-   bool should_continue = FALSE;
+   trunk_range_tombstone_iterator *itor =
+      (trunk_range_tombstone_iterator *)base_itor;
+   return iterator_at_end(itor->itor, at_end);
+}
 
-   memtable_lock_incorporation_lock(spl->mt_ctxt);
-   memtable *mt = trunk_try_get_memtable(spl, next_generation);
-   if (mt == NULL) {
-      should_continue = FALSE;
-      goto unlock_incorp_lock;
+static platform_status
+trunk_range_tombstone_iterator_advance(iterator *base_itor)
+{
+   trunk_range_tombstone_iterator *itor =
+      (trunk_range_tombstone_iterator *)base_itor;
+   platform_status rc = iterator_advance(itor->itor);
+   if (!SUCCESS(rc)) {
+      return rc;
    }
-   should_continue = memtable_try_transition(
-      mt, MEMTABLE_STATE_COMPACTED, MEMTABLE_STATE_INCORPORATION_ASSIGNED);
-   memtable_increment_to_generation_to_incorporate(spl->mt_ctxt,
-                                                   next_generation);
+   return trunk_range_tombstone_iterator_skip_deleted(itor);
+}
 
-unlock_incorp_lock:
-   memtable_unlock_incorporation_lock(spl->mt_ctxt);
-   return should_continue;
+static platform_status
+trunk_range_tombstone_iterator_seek(iterator *base_itor, key target)
+{
+   trunk_range_tombstone_iterator *itor =
+      (trunk_range_tombstone_iterator *)base_itor;
+   platform_status rc = iterator_seek(itor->itor, target);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   return trunk_range_tombstone_iterator_skip_deleted(itor);
 }
 
 /*
- * Function to incorporate the memtable to the root.
- * Carries out the following steps :
- *  4. Lock root (block lookups -- lookups obtain a read lock on the root
- *     before performing lookup on memtable)
- *  5. Add the memtable to the root as a new compacted bundle
- *  6. If root is full, flush until it is no longer full
- *  7. If necessary, split the root
- *  8. Create a new empty memtable in the memtable array at position
- *     curr_memtable.
- *  9. Unlock the root
- *
- * This functions has some preconditions prior to being called.
- *  --> Trunk root node should be write locked.
- *  --> The memtable should have inserts blocked (can_insert == FALSE)
+ * When the largest key < target is deleted, continues below the start of the
+ * tombstone deleting it.
  */
-static void
-trunk_memtable_incorporate(trunk_handle  *spl,
-                           uint64         generation,
-                           const threadid tid)
-{
-   // X. Get, claim and lock the lookup lock
-   page_handle *mt_lookup_lock_page =
-      memtable_uncontended_get_claim_lock_lookup_lock(spl->mt_ctxt);
-
-   memtable_increment_to_generation_retired(spl->mt_ctxt, generation);
-
-   // X. Get, claim and lock the root
-   page_handle *root = trunk_node_get(spl, spl->root_addr);
-   trunk_node_claim(spl, &root);
-   platform_assert(trunk_has_vacancy(spl, root, 1));
-   trunk_node_lock(spl, root);
-
-   platform_stream_handle stream;
-   platform_status        rc = trunk_open_log_stream_if_enabled(spl, &stream);
-   platform_assert_status_ok(rc);
-   trunk_log_stream_if_enabled(spl,
-                               &stream,
-                               "incorporate memtable gen %lu into root %lu\n",
-                               generation,
-                               spl->root_addr);
-   trunk_log_node_if_enabled(&stream, spl, root);
-   trunk_log_stream_if_enabled(
-      spl, &stream, "----------------------------------------\n");
-
-   // X. Release lookup lock
-   memtable_unlock_unclaim_unget_lookup_lock(spl->mt_ctxt, mt_lookup_lock_page);
-
-   /*
-    * X. Get a new branch in a bundle for the memtable
-    */
-   trunk_compacted_memtable *cmt =
-      trunk_get_compacted_memtable(spl, generation);
-   trunk_compact_bundle_req *req = cmt->req;
-   req->bundle_no                = trunk_get_new_bundle(spl, root);
-   trunk_bundle    *bundle       = trunk_get_bundle(spl, root, req->bundle_no);
-   trunk_subbundle *sb           = trunk_get_new_subbundle(spl, root, 1);
-   trunk_branch    *branch       = trunk_get_new_branch(spl, root);
-   *branch                       = cmt->branch;
-   bundle->start_subbundle       = trunk_subbundle_no(spl, root, sb);
-   bundle->end_subbundle         = trunk_end_subbundle(spl, root);
-   sb->start_branch              = trunk_branch_no(spl, root, branch);
-   sb->end_branch                = trunk_end_branch(spl, root);
-   sb->state                     = SB_STATE_COMPACTED;
-   routing_filter *filter        = trunk_subbundle_filter(spl, root, sb, 0);
-   *filter                       = cmt->filter;
-   req->spl                      = spl;
-   req->addr                     = spl->root_addr;
-   req->height                   = trunk_height(spl, root);
-   req->generation               = trunk_generation(spl, root);
-   req->max_pivot_generation     = trunk_pivot_generation(spl, root);
-   trunk_tuples_in_bundle(spl,
-                          root,
-                          bundle,
-                          req->output_pivot_tuple_count,
-                          req->output_pivot_kv_byte_count);
-   memmove(req->input_pivot_tuple_count,
-           req->output_pivot_tuple_count,
-           sizeof(req->input_pivot_tuple_count));
-   memmove(req->input_pivot_kv_byte_count,
-           req->output_pivot_kv_byte_count,
-           sizeof(req->input_pivot_kv_byte_count));
-   trunk_pivot_add_bundle_tuple_counts(spl,
-                                       root,
-                                       bundle,
-                                       req->output_pivot_tuple_count,
-                                       req->output_pivot_kv_byte_count);
-   uint16 num_children = trunk_num_children(spl, root);
-   for (uint16 pivot_no = 0; pivot_no < num_children; pivot_no++) {
-      if (pivot_no != 0) {
-         key pivot_key = trunk_get_pivot(spl, root, pivot_no);
-         trunk_inc_intersection(spl, branch, pivot_key, FALSE);
-      }
-      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, root, pivot_no);
-      req->pivot_generation[pivot_no] = pdata->generation;
-   }
-   debug_assert(trunk_subbundle_branch_count(spl, root, sb) != 0);
-   trunk_log_stream_if_enabled(spl,
-                               &stream,
-                               "enqueuing build filter %lu-%u\n",
-                               req->addr,
-                               req->bundle_no);
-   task_enqueue(
-      spl->ts, TASK_TYPE_NORMAL, trunk_bundle_build_filters, req, TRUE);
-
-   // X. Incorporate new memtable into the bundle
-   memtable *mt = trunk_get_memtable(spl, generation);
-   // Normally need to hold incorp_mutex, but debug code and also guaranteed no
-   // one is changing gen_to_incorp (we are the only thread that would try)
-   debug_assert(generation == memtable_generation_to_incorporate(spl->mt_ctxt));
-   memtable_transition(
-      mt, MEMTABLE_STATE_INCORPORATION_ASSIGNED, MEMTABLE_STATE_INCORPORATING);
-   *branch = cmt->branch;
-   *filter = cmt->filter;
-   if (spl->cfg.use_stats) {
-      spl->stats[tid].memtable_flush_wait_time_ns +=
-         platform_timestamp_elapsed(cmt->wait_start);
-   }
-
-   memtable_transition(
-      mt, MEMTABLE_STATE_INCORPORATING, MEMTABLE_STATE_INCORPORATED);
-   trunk_log_node_if_enabled(&stream, spl, root);
-   trunk_log_stream_if_enabled(
-      spl, &stream, "----------------------------------------\n");
-   trunk_log_stream_if_enabled(spl, &stream, "\n");
-   trunk_close_log_stream_if_enabled(spl, &stream);
-
-   // X. If root is full, flush until it is no longer full
-   uint64 flush_start;
-   if (spl->cfg.use_stats) {
-      flush_start = platform_get_timestamp();
-   }
-
-   uint64 wait = 1;
-   while (trunk_node_is_full(spl, root)) {
-      platform_status rc = trunk_flush_fullest(spl, root);
-      if (!SUCCESS(rc)) {
-         trunk_node_unlock(spl, root);
-         platform_sleep(wait);
-         wait = wait > 2048 ? 2048 : 2 * wait;
-         trunk_node_lock(spl, root);
-      }
-   }
-
-   // X. If necessary, split the root
-   if (trunk_needs_split(spl, root)) {
-      trunk_split_root(spl, root);
-   }
-
-   // X. Unlock the root
-   trunk_node_unlock(spl, root);
-   trunk_node_unclaim(spl, root);
-   trunk_node_unget(spl, &root);
-
-   // X. Dec-ref the now-incorporated memtable
-   memtable_dec_ref_maybe_recycle(spl->mt_ctxt, mt);
-
-   if (spl->cfg.use_stats) {
-      const threadid tid = platform_get_tid();
-      flush_start        = platform_timestamp_elapsed(flush_start);
-      spl->stats[tid].memtable_flush_time_ns += flush_start;
-      spl->stats[tid].memtable_flushes++;
-      if (flush_start > spl->stats[tid].memtable_flush_time_max_ns) {
-         spl->stats[tid].memtable_flush_time_max_ns = flush_start;
+static platform_status
+trunk_range_tombstone_iterator_prev_key(iterator   *base_itor,
+                                        key         target,
+                                        key_buffer *prev,
+                                        bool       *found)
+{
+   trunk_range_tombstone_iterator *itor =
+      (trunk_range_tombstone_iterator *)base_itor;
+   platform_status rc = iterator_prev_key(itor->itor, target, prev, found);
+   while (SUCCESS(rc) && *found) {
+      trunk_range_tombstone *tombstone = trunk_range_tombstone_set_find(
+         itor->spl, itor->set, key_buffer_key(prev), itor->generation);
+      if (tombstone == NULL) {
+         break;
       }
+      rc = iterator_prev_key(
+         itor->itor, key_buffer_key(&tombstone->start_key), prev, found);
    }
-}
-
-/*
- * Main wrapper function to carry out incorporation of a memtable.
- *
- * If background threads are disabled this function is called inline in the
- * context of the foreground thread.  If background threads are enabled, this
- * function is called in the context of the memtable worker thread.
- */
-static void
-trunk_memtable_flush_internal(trunk_handle *spl, uint64 generation)
-{
-   const threadid tid = platform_get_tid();
-   // pack and build filter.
-   trunk_memtable_compact_and_build_filter(spl, generation, tid);
-
-   // If we are assigned to do so, incorporate the memtable onto the root node.
-   if (!trunk_try_start_incorporate(spl, generation)) {
-      goto out;
-   }
-   do {
-      trunk_memtable_incorporate(spl, generation, tid);
-      generation++;
-   } while (trunk_try_continue_incorporate(spl, generation));
-out:
-   return;
+   return rc;
 }
 
 static void
-trunk_memtable_flush_internal_virtual(void *arg, void *scratch)
-{
-   trunk_memtable_args *mt_args = arg;
-   trunk_memtable_flush_internal(mt_args->spl, mt_args->generation);
-}
+trunk_range_tombstone_iterator_print(iterator *base_itor)
+{
+   trunk_range_tombstone_iterator *itor =
+      (trunk_range_tombstone_iterator *)base_itor;
+   platform_default_log("range tombstone iterator: generation %lu, "
+                        "%lu tombstones\n",
+                        itor->generation,
+                        itor->set->num_tombstones);
+   iterator_print(itor->itor);
+}
+
+const static iterator_ops trunk_range_tombstone_iterator_ops = {
+   .get_curr = trunk_range_tombstone_iterator_get_curr,
+   .at_end   = trunk_range_tombstone_iterator_at_end,
+   .advance  = trunk_range_tombstone_iterator_advance,
+   .print    = trunk_range_tombstone_iterator_print,
+   .seek     = trunk_range_tombstone_iterator_seek,
+   .prev_key = trunk_range_tombstone_iterator_prev_key,
+};
 
 /*
- * Function to trigger a memtable incorporation. Called in the context of
- * the foreground doing insertions.
- * If background threads are not enabled, this function does the entire memtable
- * incorporation inline.
- * If background threads are enabled, this function just queues up the task to
- * carry out the incorporation, swaps the curr_memtable pointer, claims the
- * root and returns.
+ * Returns itor wrapped in tombstone_itor if set has a tombstone deleting
+ * from data of the given generation, or itor itself if not.
  */
-void
-trunk_memtable_flush(trunk_handle *spl, uint64 generation)
+static iterator *
+trunk_range_tombstone_iterator_init(
+   trunk_handle                   *spl,
+   trunk_range_tombstone_iterator *tombstone_itor,
+   iterator                       *itor,
+   trunk_range_tombstone_set      *set,
+   uint64                          generation,
+   bool                            reverse)
 {
-   trunk_compacted_memtable *cmt =
-      trunk_get_compacted_memtable(spl, generation);
-   cmt->mt_args.spl        = spl;
-   cmt->mt_args.generation = generation;
-   task_enqueue(spl->ts,
-                TASK_TYPE_MEMTABLE,
-                trunk_memtable_flush_internal_virtual,
-                &cmt->mt_args,
-                FALSE);
-}
-
-void
-trunk_memtable_flush_virtual(void *arg, uint64 generation)
-{
-   trunk_handle *spl = arg;
-   trunk_memtable_flush(spl, generation);
-}
-
-static inline uint64
-trunk_memtable_root_addr_for_lookup(trunk_handle *spl,
-                                    uint64        generation,
-                                    bool         *is_compacted)
-{
-   memtable *mt = trunk_get_memtable(spl, generation);
-   platform_assert(memtable_ok_to_lookup(mt));
-
-   if (memtable_ok_to_lookup_compacted(mt)) {
-      // lookup in packed tree
-      *is_compacted = TRUE;
-      trunk_compacted_memtable *cmt =
-         trunk_get_compacted_memtable(spl, generation);
-      return cmt->branch.root_addr;
-   } else {
-      *is_compacted = FALSE;
-      return mt->root_addr;
+   bool applies = FALSE;
+   for (uint64 i = 0; i < set->num_tombstones; i++) {
+      applies = applies || generation < set->tombstone[i].generation;
    }
+   if (!applies) {
+      return itor;
+   }
+   tombstone_itor->super.ops  = &trunk_range_tombstone_iterator_ops;
+   tombstone_itor->spl        = spl;
+   tombstone_itor->itor       = itor;
+   tombstone_itor->set        = set;
+   tombstone_itor->generation = generation;
+   tombstone_itor->reverse    = reverse;
+   platform_status rc =
+      trunk_range_tombstone_iterator_skip_deleted(tombstone_itor);
+   platform_assert_status_ok(rc);
+   return &tombstone_itor->super;
 }
 
 /*
- * trunk_memtable_lookup
+ * trunk_btree_lookup performs a lookup for key in branch.
  *
  * Pre-conditions:
- *    If *found
+ *    If *data is not the null write_buffer, then
  *       `data` has the most recent answer.
  *       the current memtable is older than the most recent answer
  *
  * Post-conditions:
- *    if *found, the data can be found in `data`.
+ *    if *local_found, then data can be found in `data`.
+ *
+ * If the branch is older than tombstone_gen, target is range deleted from it
+ * and the deletion is merged into `data` without reading the branch.
  */
-static platform_status
-trunk_memtable_lookup(trunk_handle      *spl,
-                      uint64             generation,
-                      key                target,
-                      merge_accumulator *data)
+static inline platform_status
+trunk_btree_lookup_and_merge(trunk_handle      *spl,
+                             trunk_branch      *branch,
+                             uint64             tombstone_gen,
+                             key                target,
+                             merge_accumulator *data,
+                             bool              *local_found)
 {
-   cache *const        cc  = spl->cc;
-   btree_config *const cfg = &spl->cfg.btree_cfg;
-   bool                memtable_is_compacted;
-   uint64              root_addr = trunk_memtable_root_addr_for_lookup(
-      spl, generation, &memtable_is_compacted);
-   page_type type =
-      memtable_is_compacted ? PAGE_TYPE_BRANCH : PAGE_TYPE_MEMTABLE;
+   cache          *cc  = spl->cc;
+   btree_config   *cfg = &spl->cfg.btree_cfg;
    platform_status rc;
-   bool            local_found;
+
+   if (branch->generation < tombstone_gen) {
+      trunk_apply_range_tombstone(spl, target, data);
+      *local_found = TRUE;
+      return STATUS_OK;
+   }
 
    rc = btree_lookup_and_merge(
-      cc, cfg, root_addr, type, target, data, &local_found);
+      cc, cfg, branch->root_addr, PAGE_TYPE_BRANCH, target, data, local_found);
    return rc;
 }
 
+
 /*
  *-----------------------------------------------------------------------------
- * Filter functions
+ * trunk_btree_lookup_async
+ *
+ * Pre-conditions:
+ *    The ctxt should've been initialized using
+ *    btree_ctxt_init(). If *found `data` has the most
+ *    recent answer. the current memtable is older than the most
+ *    recent answer
+ *
+ *    The return value can be either of:
+ *      async_locked: A page needed by lookup is locked. User should retry
+ *      request.
+ *      async_no_reqs: A page needed by lookup is not in cache and the IO
+ *      subsystem is out of requests. User should throttle.
+ *      async_io_started: Async IO was started to read a page needed by the
+ *      lookup into the cache. When the read is done, caller will be notified
+ *      using ctxt->cb, that won't run on the thread context. It can be used
+ *      to requeue the async lookup request for dispatch in thread context.
+ *      When it's requeued, it must use the same function params except found.
+ *      success: *found is TRUE if found, FALSE otherwise, data is stored in
+ *      *data_out
  *-----------------------------------------------------------------------------
  */
-
-static inline routing_config *
-trunk_routing_cfg(trunk_handle *spl)
+static cache_async_result
+trunk_btree_lookup_and_merge_async(trunk_handle      *spl,    // IN
+                                   trunk_branch      *branch, // IN
+                                   key                target, // IN
+                                   merge_accumulator *data,   // OUT
+                                   btree_async_ctxt  *ctxt)    // IN
 {
-   return &spl->cfg.filter_cfg;
-}
+   cache             *cc  = spl->cc;
+   btree_config      *cfg = &spl->cfg.btree_cfg;
+   cache_async_result res;
+   bool               local_found;
 
-static inline void
-trunk_inc_filter(trunk_handle *spl, routing_filter *filter)
-{
-   debug_assert(filter->addr != 0);
-   mini_unkeyed_inc_ref(spl->cc, filter->meta_head);
+   res = btree_lookup_and_merge_async(
+      cc, cfg, branch->root_addr, target, data, &local_found, ctxt);
+   return res;
 }
 
-static inline void
-trunk_dec_filter(trunk_handle *spl, routing_filter *filter)
+
+/*
+ *-----------------------------------------------------------------------------
+ * Memtable Functions
+ *-----------------------------------------------------------------------------
+ */
+
+memtable *
+trunk_try_get_memtable(trunk_handle *spl, uint64 generation)
 {
-   if (filter->addr == 0) {
-      return;
+   uint64    memtable_idx = generation % TRUNK_NUM_MEMTABLES;
+   memtable *mt           = &spl->mt_ctxt->mt[memtable_idx];
+   if (mt->generation != generation) {
+      mt = NULL;
    }
-   cache *cc = spl->cc;
-   routing_filter_zap(cc, filter);
+   return mt;
 }
 
 /*
- * Scratch space used for filter building.
+ * returns the memtable with generation number generation. Caller must ensure
+ * that there exists a memtable with the appropriate generation.
  */
-typedef struct trunk_filter_scratch {
-   bool           should_build[TRUNK_MAX_PIVOTS];
-   routing_filter old_filter[TRUNK_MAX_PIVOTS];
-   uint16         value[TRUNK_MAX_PIVOTS];
-   routing_filter filter[TRUNK_MAX_PIVOTS];
-   uint32        *fp_arr;
-} trunk_filter_req;
-
-static inline void
-trunk_filter_req_init(trunk_compact_bundle_req *compact_req,
-                      trunk_filter_req         *filter_req)
+memtable *
+trunk_get_memtable(trunk_handle *spl, uint64 generation)
 {
-   ZERO_CONTENTS(filter_req);
-   filter_req->fp_arr = compact_req->fp_arr;
+   uint64    memtable_idx = generation % TRUNK_NUM_MEMTABLES;
+   memtable *mt           = &spl->mt_ctxt->mt[memtable_idx];
+   platform_assert(mt->generation == generation);
+   return mt;
 }
 
-static inline page_handle *
-trunk_node_get_maybe_descend(trunk_handle *spl, trunk_compact_bundle_req *req)
+trunk_compacted_memtable *
+trunk_get_compacted_memtable(trunk_handle *spl, uint64 generation)
 {
-   page_handle *node = trunk_node_get(spl, req->addr);
-   while (trunk_height(spl, node) != req->height) {
-      debug_assert(trunk_height(spl, node) > req->height);
-      debug_assert(req->height != 0);
-      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, 0);
-      req->addr               = pdata->addr;
-      platform_stream_handle stream;
-      platform_status rc = trunk_open_log_stream_if_enabled(spl, &stream);
-      platform_assert_status_ok(rc);
-      trunk_log_stream_if_enabled(
-         spl, &stream, "build_filter descending from root\n");
-      trunk_log_stream_if_enabled(spl,
-                                  &stream,
-                                  "enqueuing build filter %lu-%u\n",
-                                  req->addr,
-                                  req->bundle_no);
-      trunk_log_node_if_enabled(&stream, spl, node);
-      trunk_node_unget(spl, &node);
-      node = trunk_node_get(spl, req->addr);
-   }
-   return node;
+   uint64 memtable_idx = generation % TRUNK_NUM_MEMTABLES;
+
+   // this call asserts the generation is correct
+   memtable *mt = trunk_get_memtable(spl, generation);
+   platform_assert(mt->state != MEMTABLE_STATE_READY);
+
+   return &spl->compacted_memtable[memtable_idx];
 }
 
-static inline page_handle *
-trunk_node_get_claim_maybe_descend(trunk_handle             *spl,
-                                   trunk_compact_bundle_req *req)
+static inline void
+trunk_memtable_inc_ref(trunk_handle *spl, uint64 mt_gen)
 {
-   page_handle *node;
-   uint64       wait = 1;
-   while (1) {
-      node = trunk_node_get_maybe_descend(spl, req);
-      if (cache_claim(spl->cc, node)) {
-         break;
-      }
-      trunk_node_unget(spl, &node);
-      platform_sleep(wait);
-      wait = wait > 2048 ? wait : 2 * wait;
-   }
-   return node;
+   memtable *mt = trunk_get_memtable(spl, mt_gen);
+   memtable_inc_ref(spl->mt_ctxt, mt);
 }
 
-static inline bool
-trunk_build_filter_should_abort(trunk_compact_bundle_req *req,
-                                page_handle              *node)
+
+void
+trunk_memtable_dec_ref(trunk_handle *spl, uint64 generation)
 {
-   trunk_handle *spl    = req->spl;
-   uint16        height = trunk_height(spl, node);
-   if (height == 0 && req->generation < trunk_generation(spl, node)) {
-      platform_stream_handle stream;
-      platform_status rc = trunk_open_log_stream_if_enabled(spl, &stream);
-      platform_assert_status_ok(rc);
-      trunk_log_stream_if_enabled(spl,
-                                  &stream,
-                                  "build_filter leaf abort %lu-%u\n",
-                                  req->addr,
-                                  req->bundle_no);
-      trunk_log_node_if_enabled(&stream, spl, node);
-      trunk_close_log_stream_if_enabled(spl, &stream);
-      return TRUE;
-   }
-   return FALSE;
+   memtable *mt = trunk_get_memtable(spl, generation);
+   memtable_dec_ref_maybe_recycle(spl->mt_ctxt, mt);
+
+   // the branch in the compacted memtable is now in the tree, so don't zap it,
+   // we don't try to zero out the cmt because that would introduce a race.
 }
 
-static inline bool
-trunk_build_filter_should_skip(trunk_compact_bundle_req *req, page_handle *node)
+
+/*
+ * Wrappers for creating/destroying memtable iterators. Increments/decrements
+ * the memtable ref count and cleans up if ref count == 0
+ */
+static platform_status
+trunk_memtable_iterator_init(trunk_handle      *spl,
+                             memtable_iterator *itor,
+                             uint64             mt_gen,
+                             key                min_key,
+                             key                max_key,
+                             bool               reverse,
+                             bool               inc_ref)
 {
-   trunk_handle *spl = req->spl;
-   if (!trunk_bundle_live(spl, node, req->bundle_no)) {
-      platform_stream_handle stream;
-      platform_status rc = trunk_open_log_stream_if_enabled(spl, &stream);
-      platform_assert_status_ok(rc);
-      trunk_log_stream_if_enabled(spl,
-                                  &stream,
-                                  "build_filter flush abort %lu-%u (%u)\n",
-                                  req->addr,
-                                  req->bundle_no,
-                                  req->height);
-      trunk_log_node_if_enabled(&stream, spl, node);
-      trunk_close_log_stream_if_enabled(spl, &stream);
-      return TRUE;
+   if (inc_ref) {
+      trunk_memtable_inc_ref(spl, mt_gen);
    }
-   return FALSE;
+   memtable *mt = trunk_get_memtable(spl, mt_gen);
+   return memtable_iterator_init(
+      spl->mt_ctxt, mt, itor, min_key, max_key, reverse);
 }
 
-static inline bool
-trunk_build_filter_should_reenqueue(trunk_compact_bundle_req *req,
-                                    page_handle              *node)
+static void
+trunk_memtable_iterator_deinit(trunk_handle      *spl,
+                               memtable_iterator *itor,
+                               uint64             mt_gen,
+                               bool               dec_ref)
 {
-   trunk_handle *spl = req->spl;
-   if (req->bundle_no != trunk_start_bundle(spl, node)) {
-      platform_stream_handle stream;
-      platform_status rc = trunk_open_log_stream_if_enabled(spl, &stream);
-      platform_assert_status_ok(rc);
-      trunk_log_stream_if_enabled(spl,
-                                  &stream,
-                                  "build filter for %lu bundle %u\n",
-                                  req->addr,
-                                  req->bundle_no);
-      trunk_log_node_if_enabled(&stream, spl, node);
-      trunk_log_stream_if_enabled(spl,
-                                  &stream,
-                                  "reenqueuing build filter %lu-%u\n",
-                                  req->addr,
-                                  req->bundle_no);
-      trunk_close_log_stream_if_enabled(spl, &stream);
-      return TRUE;
+   memtable_iterator_deinit(itor);
+   if (dec_ref) {
+      trunk_memtable_dec_ref(spl, mt_gen);
    }
-   return FALSE;
 }
 
-static inline void
-trunk_prepare_build_filter(trunk_handle             *spl,
-                           trunk_compact_bundle_req *compact_req,
-                           trunk_filter_req         *filter_req,
-                           page_handle              *node)
+/*
+ * The generation of a log entry is that of its memtable followed by its
+ * generation within the memtable (of its leaf or skiplist version), so that
+ * replaying the log in generation order applies the updates to each key in
+ * order, and recovery can skip the memtables already in the checkpoint.
+ */
+static inline uint64
+trunk_log_generation(uint64 mt_gen, uint64 leaf_generation)
 {
-   uint16 height = trunk_height(spl, node);
-   platform_assert(compact_req->height == height);
-   platform_assert(compact_req->bundle_no == trunk_start_bundle(spl, node));
+   debug_assert(leaf_generation < (1ULL << TRUNK_LOG_MEMTABLE_SHIFT));
+   return (mt_gen << TRUNK_LOG_MEMTABLE_SHIFT) | leaf_generation;
+}
 
-   trunk_filter_req_init(compact_req, filter_req);
+static inline uint64
+trunk_log_memtable_generation(uint64 log_generation)
+{
+   return log_generation >> TRUNK_LOG_MEMTABLE_SHIFT;
+}
 
-   uint16 num_children = trunk_num_children(spl, node);
-   for (uint16 pivot_no = 0; pivot_no < num_children; pivot_no++) {
-      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
-      if (trunk_bundle_live_for_pivot(
-             spl, node, compact_req->bundle_no, pivot_no)) {
-         uint64 pos = trunk_process_generation_to_pos(
-            spl, compact_req, pdata->generation);
-         platform_assert(pos != TRUNK_MAX_PIVOTS);
-         filter_req->old_filter[pos] = pdata->filter;
-         filter_req->value[pos] =
-            trunk_pivot_whole_branch_count(spl, node, pdata);
-         filter_req->should_build[pos] = TRUE;
-      }
+/*
+ * A range delete is logged as an entry with an empty key, whose message holds
+ * its start and end keys, and whose generation within its memtable is
+ * TRUNK_LOG_RANGE_DELETE, which no memtable gives out, see trunk_replay_log.
+ */
+static platform_status
+trunk_log_range_delete(trunk_handle *spl,
+                       uint64        mt_gen,
+                       key           start_key,
+                       key           end_key)
+{
+   uint64 start_size =
+      sizeof(ondisk_key) + ondisk_key_required_data_capacity(start_key);
+   uint64 end_size =
+      sizeof(ondisk_key) + ondisk_key_required_data_capacity(end_key);
+   DECLARE_AUTO_WRITABLE_BUFFER(keys, spl->heap_id);
+   platform_status rc = writable_buffer_resize(&keys, start_size + end_size);
+   if (!SUCCESS(rc)) {
+      return rc;
    }
+   char *data = writable_buffer_data(&keys);
+   copy_key_to_ondisk_key((ondisk_key *)data, start_key);
+   copy_key_to_ondisk_key((ondisk_key *)(data + start_size), end_key);
+
+   message msg =
+      message_create(MESSAGE_TYPE_INSERT, writable_buffer_to_slice(&keys));
+   uint64 log_generation = trunk_log_generation(mt_gen, TRUNK_LOG_RANGE_DELETE);
+   int    crappy_rc =
+      log_write(spl->log, key_create(0, ""), msg, log_generation);
+   return crappy_rc == 0 ? STATUS_OK : STATUS_IO_ERROR;
 }
 
-static inline void
-trunk_process_generation_to_fp_bounds(trunk_handle             *spl,
-                                      trunk_compact_bundle_req *req,
-                                      uint64                    generation,
-                                      uint32                   *fp_start,
-                                      uint32                   *fp_end)
+static inline bool
+trunk_log_is_range_delete(uint64 log_generation)
 {
-   uint64 pos          = 0;
-   uint64 fp_start_int = 0;
-   while (pos != TRUNK_MAX_PIVOTS && req->pivot_generation[pos] != generation) {
-      fp_start_int += req->output_pivot_tuple_count[pos];
-      pos++;
-   }
-   platform_assert(pos + 1 != TRUNK_MAX_PIVOTS);
-   uint64 fp_end_int = fp_start_int + req->output_pivot_tuple_count[pos];
-   *fp_start         = fp_start_int;
-   *fp_end           = fp_end_int;
+   return (log_generation & TRUNK_LOG_RANGE_DELETE) == TRUNK_LOG_RANGE_DELETE;
 }
 
-static inline void
-trunk_build_filters(trunk_handle             *spl,
-                    trunk_compact_bundle_req *compact_req,
-                    trunk_filter_req         *filter_req)
+static void
+trunk_log_range_delete_keys(message msg, key *start_key, key *end_key)
 {
-   threadid tid;
-   uint64   filter_build_start;
-   uint16   height;
-   if (spl->cfg.use_stats) {
-      tid                = platform_get_tid();
-      height             = compact_req->height;
-      filter_build_start = platform_get_timestamp();
-   }
-
-   for (uint64 pos = 0; pos < TRUNK_MAX_PIVOTS; pos++) {
-      if (!filter_req->should_build[pos]) {
-         continue;
-      }
-      routing_filter old_filter = filter_req->old_filter[pos];
-      uint32         fp_start, fp_end;
-      uint64         generation = compact_req->pivot_generation[pos];
-      trunk_process_generation_to_fp_bounds(
-         spl, compact_req, generation, &fp_start, &fp_end);
-      uint32 *fp_arr           = filter_req->fp_arr + fp_start;
-      uint32  num_fingerprints = fp_end - fp_start;
-      if (num_fingerprints == 0) {
-         if (old_filter.addr != 0) {
-            trunk_inc_filter(spl, &old_filter);
-         }
-         filter_req->filter[pos] = old_filter;
-         continue;
-      }
-      routing_filter  new_filter;
-      routing_config *filter_cfg = &spl->cfg.filter_cfg;
-      uint16          value      = filter_req->value[pos];
-      platform_status rc         = routing_filter_add(spl->cc,
-                                              filter_cfg,
-                                              spl->heap_id,
-                                              &old_filter,
-                                              &new_filter,
-                                              fp_arr,
-                                              num_fingerprints,
-                                              value);
-      platform_assert(SUCCESS(rc));
+   const ondisk_key *start = (const ondisk_key *)message_data(msg);
+   const ondisk_key *end =
+      (const ondisk_key *)((const char *)start + sizeof(ondisk_key)
+                           + sizeof_ondisk_key_data(start));
+   *start_key = ondisk_key_to_key(start);
+   *end_key   = ondisk_key_to_key(end);
+}
 
-      filter_req->filter[pos]       = new_filter;
-      filter_req->should_build[pos] = FALSE;
-      if (spl->cfg.use_stats) {
-         spl->stats[tid].filters_built[height]++;
-         spl->stats[tid].filter_tuples[height] += num_fingerprints;
-      }
+/*
+ * Attempts to insert (key, data) into the current memtable.
+ *
+ * Returns:
+ *    success if succeeded
+ *    locked if the current memtable is full
+ *    lock_acquired if the current memtable is full and this thread is
+ *       responsible for flushing it.
+ */
+platform_status
+trunk_memtable_insert(trunk_handle *spl, key tuple_key, message msg)
+{
+   page_handle    *lock_page;
+   uint64          generation;
+   uint64          shard_no = memtable_shard_for_key(spl->mt_ctxt, tuple_key);
+   platform_status rc       = memtable_maybe_rotate_and_get_insert_lock(
+      spl->mt_ctxt, shard_no, &generation, &lock_page);
+   if (!SUCCESS(rc)) {
+      goto out;
    }
 
-   if (spl->cfg.use_stats) {
-      spl->stats[tid].filter_time_ns[height] +=
-         platform_timestamp_elapsed(filter_build_start);
+   // this call is safe because we hold the insert lock
+   memtable *mt = trunk_get_memtable(spl, generation);
+   uint64    leaf_generation; // used for ordering the log
+   rc = memtable_insert(spl->mt_ctxt,
+                        mt,
+                        shard_no,
+                        spl->heap_id,
+                        tuple_key,
+                        msg,
+                        &leaf_generation);
+   if (!SUCCESS(rc)) {
+      goto unlock_insert_lock;
    }
-}
 
-static inline void
-trunk_replace_routing_filter(trunk_handle             *spl,
-                             trunk_compact_bundle_req *compact_req,
-                             trunk_filter_req         *filter_req,
-                             page_handle              *node)
-{
-   uint16 num_children = trunk_num_children(spl, node);
-   for (uint16 pivot_no = 0; pivot_no < num_children; pivot_no++) {
-      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
-      uint64            pos =
-         trunk_process_generation_to_pos(spl, compact_req, pdata->generation);
-      if (!trunk_bundle_live_for_pivot(
-             spl, node, compact_req->bundle_no, pivot_no)) {
-         if (pos != TRUNK_MAX_PIVOTS && filter_req->filter[pos].addr != 0) {
-            trunk_dec_filter(spl, &filter_req->filter[pos]);
-            ZERO_CONTENTS(&filter_req->filter[pos]);
-         }
-         continue;
+   if (spl->cfg.use_log) {
+      debug_assert(leaf_generation < TRUNK_LOG_RANGE_DELETE);
+      uint64 log_generation = trunk_log_generation(generation, leaf_generation);
+      int crappy_rc = log_write(spl->log, tuple_key, msg, log_generation);
+      if (crappy_rc != 0) {
+         goto unlock_insert_lock;
       }
-      platform_assert(pos != TRUNK_MAX_PIVOTS);
-      debug_assert(pdata->generation < compact_req->max_pivot_generation);
-      trunk_dec_filter(spl, &pdata->filter);
-      pdata->filter = filter_req->filter[pos];
-      ZERO_CONTENTS(&filter_req->filter[pos]);
-
-      // Move the tuples count from the bundle to whole branch
-      uint64 bundle_num_tuples = compact_req->output_pivot_tuple_count[pos];
-      debug_assert(pdata->num_tuples_bundle >= bundle_num_tuples);
-      pdata->num_tuples_bundle -= bundle_num_tuples;
-      pdata->num_tuples_whole += bundle_num_tuples;
+   }
 
-      // Move the kv_bytes count from the bundle to whole branch
-      uint64 bundle_num_kv_bytes = compact_req->output_pivot_kv_byte_count[pos];
-      debug_assert(pdata->num_kv_bytes_bundle >= bundle_num_kv_bytes);
-      pdata->num_kv_bytes_bundle -= bundle_num_kv_bytes;
-      pdata->num_kv_bytes_whole += bundle_num_kv_bytes;
+unlock_insert_lock:
+   memtable_unget_insert_lock(spl->mt_ctxt, lock_page);
+out:
+   return rc;
+}
 
-      uint64 num_tuples_to_reclaim = trunk_pivot_tuples_to_reclaim(spl, pdata);
-      if (pdata->srq_idx != -1 && spl->cfg.reclaim_threshold != UINT64_MAX) {
-         srq_update(&spl->srq, pdata->srq_idx, num_tuples_to_reclaim);
-         srq_print(&spl->srq);
-      } else if ((num_tuples_to_reclaim > TRUNK_MIN_SPACE_RECL)
-                 && (spl->cfg.reclaim_threshold != UINT64_MAX))
+/*
+ * Builds filter from old_filter and the fingerprints of num_tuples keys.
+ *
+ * With a prefix extractor, the fingerprints of the prefixes of the keys
+ * (prefix_fp_arr, positionally aligned with fp_arr) are added too, so that
+ * looking up a prefix as a key finds the branches holding keys with that
+ * prefix. Keys are sorted, so a run of keys with the same prefix adds its
+ * fingerprint once.
+ */
+static platform_status
+trunk_filter_add(trunk_handle   *spl,
+                 routing_filter *old_filter,
+                 routing_filter *filter,
+                 uint32         *fp_arr,
+                 uint32         *prefix_fp_arr,
+                 uint64          num_tuples,
+                 uint16          value)
+{
+   if (prefix_fp_arr == NULL) {
+      return routing_filter_add(spl->cc,
+                                &spl->cfg.filter_cfg,
+                                spl->heap_id,
+                                old_filter,
+                                filter,
+                                fp_arr,
+                                num_tuples,
+                                value);
+   }
+
+   uint32 *all_fp_arr =
+      TYPED_ARRAY_MALLOC(spl->heap_id, all_fp_arr, 2 * num_tuples);
+   if (all_fp_arr == NULL) {
+      return STATUS_NO_MEMORY;
+   }
+   memmove(all_fp_arr, fp_arr, num_tuples * sizeof(uint32));
+   uint64 num_fp = num_tuples;
+   for (uint64 i = 0; i < num_tuples; i++) {
+      // keys which are their own prefix already have its fingerprint
+      if (prefix_fp_arr[i] == fp_arr[i]
+          || (i != 0 && prefix_fp_arr[i] == prefix_fp_arr[i - 1]))
       {
-         srq_data data  = {.addr             = node->disk_addr,
-                           .pivot_generation = pdata->generation,
-                           .priority         = num_tuples_to_reclaim};
-         pdata->srq_idx = srq_insert(&spl->srq, data);
-         srq_print(&spl->srq);
+         continue;
       }
+      all_fp_arr[num_fp++] = prefix_fp_arr[i];
    }
+   platform_status rc = routing_filter_add(spl->cc,
+                                           &spl->cfg.filter_cfg,
+                                           spl->heap_id,
+                                           old_filter,
+                                           filter,
+                                           all_fp_arr,
+                                           num_fp,
+                                           value);
+   platform_free(spl->heap_id, all_fp_arr);
+   return rc;
 }
 
-
 /*
- * Asynchronous task function which builds routing filters for a compacted
- * bundle
+ * Compacts the memtable with generation generation and builds its filter.
+ * Returns a pointer to the memtable.
  */
-void
-trunk_bundle_build_filters(void *arg, void *scratch)
+static memtable *
+trunk_memtable_compact_and_build_filter(trunk_handle  *spl,
+                                        uint64         generation,
+                                        const threadid tid)
 {
-   trunk_compact_bundle_req *compact_req = (trunk_compact_bundle_req *)arg;
-   trunk_handle             *spl         = compact_req->spl;
+   timestamp comp_start = platform_get_timestamp();
 
-   uint64 generation;
-   do {
-      page_handle *node = trunk_node_get_maybe_descend(spl, compact_req);
-      platform_assert(node != NULL);
+   memtable *mt = trunk_get_memtable(spl, generation);
 
-      platform_stream_handle stream;
-      trunk_open_log_stream_if_enabled(spl, &stream);
-      trunk_log_stream_if_enabled(
-         spl,
-         &stream,
-         "build filter for %lu bundle %u pivot_gen %lu\n",
-         compact_req->addr,
-         compact_req->bundle_no,
-         compact_req->max_pivot_generation);
-      trunk_log_node_if_enabled(&stream, spl, node);
-      if (trunk_build_filter_should_abort(compact_req, node)) {
-         trunk_log_stream_if_enabled(spl, &stream, "leaf split, aborting\n");
-         trunk_node_unget(spl, &node);
-         goto out;
-      }
-      if (trunk_build_filter_should_skip(compact_req, node)) {
-         trunk_log_stream_if_enabled(
-            spl, &stream, "bundle flushed, skipping\n");
-         goto next_node;
-      }
+   memtable_transition(mt, MEMTABLE_STATE_FINALIZED, MEMTABLE_STATE_COMPACTING);
+   memtable_release_allocator(mt);
 
-      if (trunk_build_filter_should_reenqueue(compact_req, node)) {
-         task_enqueue(spl->ts,
-                      TASK_TYPE_NORMAL,
-                      trunk_bundle_build_filters,
-                      compact_req,
-                      FALSE);
-         trunk_log_stream_if_enabled(
-            spl, &stream, "out of order, reequeuing\n");
-         trunk_close_log_stream_if_enabled(spl, &stream);
-         trunk_node_unget(spl, &node);
-         return;
+   trunk_compacted_memtable *cmt =
+      trunk_get_compacted_memtable(spl, generation);
+   trunk_branch *new_branch = &cmt->branch;
+   ZERO_CONTENTS(new_branch);
+
+   memtable_iterator mt_itor;
+   platform_status   itor_rc = trunk_memtable_iterator_init(spl,
+                                                          &mt_itor,
+                                                          generation,
+                                                          NEGATIVE_INFINITY_KEY,
+                                                          POSITIVE_INFINITY_KEY,
+                                                          FALSE,
+                                                          FALSE);
+   platform_assert_status_ok(itor_rc);
+   iterator *itor = memtable_iterator_get(&mt_itor);
+   btree_pack_req req;
+   btree_pack_req_init(&req,
+                       spl->cc,
+                       &spl->cfg.btree_cfg,
+                       itor,
+                       spl->cfg.max_tuples_per_node,
+                       spl->cfg.filter_cfg.hash,
+                       spl->cfg.filter_cfg.seed,
+                       spl->heap_id);
+   uint64 pack_start;
+   if (spl->cfg.use_stats) {
+      spl->stats[tid].root_compactions++;
+      pack_start = platform_get_timestamp();
+   }
+
+   platform_status pack_status = btree_pack(&req);
+   platform_assert(SUCCESS(pack_status),
+                   "platform_status of btree_pack: %d\n",
+                   pack_status.r);
+
+   platform_assert(req.num_tuples <= spl->cfg.max_tuples_per_node);
+   if (spl->cfg.use_stats) {
+      spl->stats[tid].root_compaction_pack_time_ns +=
+         platform_timestamp_elapsed(pack_start);
+      spl->stats[tid].root_compaction_tuples += req.num_tuples;
+      if (req.num_tuples > spl->stats[tid].root_compaction_max_tuples) {
+         spl->stats[tid].root_compaction_max_tuples = req.num_tuples;
       }
+   }
+   trunk_memtable_iterator_deinit(spl, &mt_itor, generation, FALSE);
 
-      debug_assert(trunk_verify_node(spl, node));
-      trunk_filter_req filter_req = {0};
-      trunk_prepare_build_filter(spl, compact_req, &filter_req, node);
-      uint64 filter_generation = trunk_generation(spl, node);
-      trunk_node_unget(spl, &node);
+   new_branch->root_addr  = req.root_addr;
+   new_branch->generation = trunk_data_generation(spl, generation);
 
-      trunk_build_filters(spl, compact_req, &filter_req);
+   platform_assert(req.num_tuples > 0);
+   uint64 filter_build_start;
+   if (spl->cfg.use_stats) {
+      filter_build_start = platform_get_timestamp();
+   }
 
-      trunk_log_stream_if_enabled(
-         spl, &stream, "----------------------------------------\n");
+   cmt->req         = TYPED_ZALLOC(spl->heap_id, cmt->req);
+   cmt->req->spl    = spl;
+   cmt->req->fp_arr = req.fingerprint_arr;
+   cmt->req->type   = TRUNK_COMPACTION_TYPE_MEMTABLE;
+   uint32 *dup_fp_arr =
+      TYPED_ARRAY_MALLOC(spl->heap_id, dup_fp_arr, req.num_tuples);
+   memmove(dup_fp_arr, cmt->req->fp_arr, req.num_tuples * sizeof(uint32));
+   if (req.prefix_fingerprint_arr != NULL) {
+      cmt->req->prefix_fp_arr    = req.prefix_fingerprint_arr;
+      req.prefix_fingerprint_arr = NULL;
+   }
+   routing_filter empty_filter = {0};
 
-      do {
-         node = trunk_node_get_claim_maybe_descend(spl, compact_req);
-         if (trunk_build_filter_should_abort(compact_req, node)) {
-            trunk_log_stream_if_enabled(
-               spl,
-               &stream,
-               "replace_filter abort leaf split (%lu)\n",
-               compact_req->addr);
-            trunk_node_unclaim(spl, node);
-            trunk_node_unget(spl, &node);
-            for (uint64 pos = 0; pos < TRUNK_MAX_PIVOTS; pos++) {
-               trunk_dec_filter(spl, &filter_req.filter[pos]);
-            }
-            goto out;
-         }
-         trunk_node_lock(spl, node);
-         trunk_replace_routing_filter(spl, compact_req, &filter_req, node);
-         if (trunk_bundle_live(spl, node, compact_req->bundle_no)) {
-            trunk_clear_bundle(spl, node, compact_req->bundle_no);
-         }
-         trunk_node_unlock(spl, node);
-         trunk_node_unclaim(spl, node);
-         compact_req->addr = trunk_next_addr(spl, node);
-         generation        = trunk_generation(spl, node);
-         debug_assert(trunk_verify_node(spl, node));
-         if (generation != filter_generation) {
-            trunk_log_stream_if_enabled(spl,
-                                        &stream,
-                                        "replace_filter split to %lu\n",
-                                        compact_req->addr);
-            debug_assert(compact_req->height != 0);
-            debug_assert(compact_req->addr != 0);
-            trunk_node_unget(spl, &node);
-         }
-      } while (generation != filter_generation);
+   platform_status rc = trunk_filter_add(spl,
+                                         &empty_filter,
+                                         &cmt->filter,
+                                         cmt->req->fp_arr,
+                                         cmt->req->prefix_fp_arr,
+                                         req.num_tuples,
+                                         0);
 
-      for (uint64 pos = 0; pos < TRUNK_MAX_PIVOTS; pos++) {
-         trunk_dec_filter(spl, &filter_req.filter[pos]);
+   platform_assert(SUCCESS(rc));
+   if (spl->cfg.use_stats) {
+      spl->stats[tid].root_filter_time_ns +=
+         platform_timestamp_elapsed(filter_build_start);
+      spl->stats[tid].root_filters_built++;
+      spl->stats[tid].root_filter_tuples += req.num_tuples;
+   }
+
+   btree_pack_req_deinit(&req, spl->heap_id);
+   cmt->req->fp_arr = dup_fp_arr;
+   if (spl->cfg.use_stats) {
+      uint64 comp_time = platform_timestamp_elapsed(comp_start);
+      spl->stats[tid].root_compaction_time_ns += comp_time;
+      if (comp_start > spl->stats[tid].root_compaction_time_max_ns) {
+         spl->stats[tid].root_compaction_time_max_ns = comp_time;
       }
+      cmt->wait_start = platform_get_timestamp();
+   }
 
-      trunk_log_node_if_enabled(&stream, spl, node);
-      trunk_log_stream_if_enabled(
-         spl, &stream, "----------------------------------------\n");
-      trunk_log_stream_if_enabled(spl, &stream, "\n");
+   memtable_transition(mt, MEMTABLE_STATE_COMPACTING, MEMTABLE_STATE_COMPACTED);
+   return mt;
+}
 
-   next_node:
-      compact_req->addr = trunk_next_addr(spl, node);
-      generation        = trunk_generation(spl, node);
-      debug_assert(trunk_verify_node(spl, node));
-      trunk_node_unget(spl, &node);
-      if (compact_req->generation != generation) {
-         trunk_log_stream_if_enabled(
-            spl, &stream, "build_filter split to %lu\n", compact_req->addr);
-         debug_assert(compact_req->height != 0);
-         debug_assert(compact_req->addr != 0);
-      }
-      trunk_close_log_stream_if_enabled(spl, &stream);
-   } while (compact_req->generation != generation);
+/*
+ * Cases:
+ * 1. memtable set to COMP before try_continue tries to set it to incorp
+ *       try_continue will successfully assign itself to incorp the memtable
+ * 2. memtable set to COMP after try_continue tries to set it to incorp
+ *       should_wait will be set to generation, so try_start will incorp
+ */
+static inline bool
+trunk_try_start_incorporate(trunk_handle *spl, uint64 generation)
+{
+   bool should_start = FALSE;
 
-out:
-   platform_free(spl->heap_id, compact_req->fp_arr);
-   platform_free(spl->heap_id, compact_req);
-   trunk_maybe_reclaim_space(spl);
-   return;
+   memtable_lock_incorporation_lock(spl->mt_ctxt);
+   memtable *mt = trunk_try_get_memtable(spl, generation);
+   if ((mt == NULL)
+       || (generation != memtable_generation_to_incorporate(spl->mt_ctxt)))
+   {
+      should_start = FALSE;
+      goto unlock_incorp_lock;
+   }
+   should_start = memtable_try_transition(
+      mt, MEMTABLE_STATE_COMPACTED, MEMTABLE_STATE_INCORPORATION_ASSIGNED);
+
+unlock_incorp_lock:
+   memtable_unlock_incorporation_lock(spl->mt_ctxt);
+   return should_start;
 }
 
-static cache_async_result
-trunk_filter_lookup_async(trunk_handle       *spl,
-                          routing_config     *cfg,
-                          routing_filter     *filter,
-                          key                 target,
-                          uint64             *found_values,
-                          routing_async_ctxt *ctxt)
+static inline bool
+trunk_try_continue_incorporate(trunk_handle *spl, uint64 next_generation)
 {
-   return routing_filter_lookup_async(
-      spl->cc, cfg, filter, target, found_values, ctxt);
+   bool should_continue = FALSE;
+
+   memtable_lock_incorporation_lock(spl->mt_ctxt);
+   memtable *mt = trunk_try_get_memtable(spl, next_generation);
+   if (mt == NULL) {
+      should_continue = FALSE;
+      goto unlock_incorp_lock;
+   }
+   should_continue = memtable_try_transition(
+      mt, MEMTABLE_STATE_COMPACTED, MEMTABLE_STATE_INCORPORATION_ASSIGNED);
+   memtable_increment_to_generation_to_incorporate(spl->mt_ctxt,
+                                                   next_generation);
+
+unlock_incorp_lock:
+   memtable_unlock_incorporation_lock(spl->mt_ctxt);
+   return should_continue;
 }
 
 /*
- *-----------------------------------------------------------------------------
- * Flush Functions
- *-----------------------------------------------------------------------------
+ * trunk_enqueue_compact_req --
+ *
+ *      Enqueues a compact_bundle or build_filters task for req, with a
+ *      priority class based on where in the trunk the work is:
+ *       -- work on the root is critical, since it is what memtable
+ *          incorporation waits on when the root fills up
+ *       -- work on other internal nodes is high priority
+ *       -- leaf work is normal priority
+ *       -- space reclamation is low priority
  */
+static inline platform_status
+trunk_enqueue_compact_req(trunk_handle             *spl,
+                          task_fn                   func,
+                          trunk_compact_bundle_req *req,
+                          bool                      at_head)
+{
+   task_priority priority;
+   if (req->addr == spl->root_addr) {
+      priority = TASK_PRIORITY_CRITICAL;
+   } else if (req->type == TRUNK_COMPACTION_TYPE_SPACE_REC) {
+      priority = TASK_PRIORITY_LOW;
+   } else if (req->height != 0) {
+      priority = TASK_PRIORITY_HIGH;
+   } else {
+      priority = TASK_PRIORITY_NORMAL;
+   }
+   return task_enqueue_priority(
+      spl->ts, TASK_TYPE_NORMAL, priority, func, req, at_head);
+}
 
 /*
- * flush_into_bundle flushes all live branches (including fractional branches)
- * for the pivot from parent to a new bundle in child and initializes the
- * compact_bundle_req.
+ * Function to incorporate the memtable to the root.
+ * Carries out the following steps :
+ *  4. Lock root (block lookups -- lookups obtain a read lock on the root
+ *     before performing lookup on memtable)
+ *  5. Add the memtable to the root as a new compacted bundle
+ *  6. If root is full, flush until it is no longer full
+ *  7. If necessary, split the root
+ *  8. Create a new empty memtable in the memtable array at position
+ *     curr_memtable.
+ *  9. Unlock the root
  *
- * NOTE: parent and child must be write locked.
+ * This functions has some preconditions prior to being called.
+ *  --> Trunk root node should be write locked.
+ *  --> The memtable should have inserts blocked (can_insert == FALSE)
  */
-trunk_bundle *
-trunk_flush_into_bundle(trunk_handle             *spl,    // IN
-                        page_handle              *parent, // IN (modified)
-                        page_handle              *child,  // IN (modified)
-                        trunk_pivot_data         *pdata,  // IN
-                        trunk_compact_bundle_req *req)    // IN/OUT
+static void
+trunk_memtable_incorporate(trunk_handle  *spl,
+                           uint64         generation,
+                           const threadid tid)
 {
+   // X. Get, claim and lock the lookup lock
+   page_handle *mt_lookup_lock_page =
+      memtable_uncontended_get_claim_lock_lookup_lock(spl->mt_ctxt);
+
+   memtable_increment_to_generation_retired(spl->mt_ctxt, generation);
+
+   // X. Get, claim and lock the root
+   page_handle *root = trunk_node_get(spl, spl->root_addr);
+   trunk_node_claim(spl, &root);
+   platform_assert(trunk_has_vacancy(spl, root, 1));
+   trunk_node_lock(spl, root);
+
    platform_stream_handle stream;
    platform_status        rc = trunk_open_log_stream_if_enabled(spl, &stream);
    platform_assert_status_ok(rc);
    trunk_log_stream_if_enabled(spl,
                                &stream,
-                               "flush from %lu to %lu\n",
-                               parent->disk_addr,
-                               child->disk_addr);
-   trunk_log_node_if_enabled(&stream, spl, parent);
-   trunk_log_node_if_enabled(&stream, spl, child);
+                               "incorporate memtable gen %lu into root %lu\n",
+                               generation,
+                               spl->root_addr);
+   trunk_log_node_if_enabled(&stream, spl, root);
    trunk_log_stream_if_enabled(
       spl, &stream, "----------------------------------------\n");
 
-   req->spl    = spl;
-   req->addr   = child->disk_addr;
-   req->height = trunk_height(spl, child);
-   debug_assert(req->addr != 0);
-   req->bundle_no            = trunk_get_new_bundle(spl, child);
-   req->generation           = trunk_generation(spl, child);
-   req->max_pivot_generation = trunk_pivot_generation(spl, child);
+   // X. Release lookup lock
+   memtable_unlock_unclaim_unget_lookup_lock(spl->mt_ctxt, mt_lookup_lock_page);
 
-   uint16 num_children = trunk_num_children(spl, child);
+   /*
+    * X. Get a new branch in a bundle for the memtable
+    */
+   trunk_compacted_memtable *cmt =
+      trunk_get_compacted_memtable(spl, generation);
+   trunk_compact_bundle_req *req = cmt->req;
+   req->bundle_no                = trunk_get_new_bundle(spl, root);
+   trunk_bundle    *bundle       = trunk_get_bundle(spl, root, req->bundle_no);
+   trunk_subbundle *sb           = trunk_get_new_subbundle(spl, root, 1);
+   trunk_branch    *branch       = trunk_get_new_branch(spl, root);
+   *branch                       = cmt->branch;
+   bundle->start_subbundle       = trunk_subbundle_no(spl, root, sb);
+   bundle->end_subbundle         = trunk_end_subbundle(spl, root);
+   sb->start_branch              = trunk_branch_no(spl, root, branch);
+   sb->end_branch                = trunk_end_branch(spl, root);
+   sb->state                     = SB_STATE_COMPACTED;
+   routing_filter *filter        = trunk_subbundle_filter(spl, root, sb, 0);
+   *filter                       = cmt->filter;
+   req->spl                      = spl;
+   req->addr                     = spl->root_addr;
+   req->height                   = trunk_height(spl, root);
+   req->generation               = trunk_generation(spl, root);
+   req->max_pivot_generation     = trunk_pivot_generation(spl, root);
+   trunk_tuples_in_bundle(spl,
+                          root,
+                          bundle,
+                          req->output_pivot_tuple_count,
+                          req->output_pivot_kv_byte_count);
+   memmove(req->input_pivot_tuple_count,
+           req->output_pivot_tuple_count,
+           sizeof(req->input_pivot_tuple_count));
+   memmove(req->input_pivot_kv_byte_count,
+           req->output_pivot_kv_byte_count,
+           sizeof(req->input_pivot_kv_byte_count));
+   trunk_pivot_add_bundle_tuple_counts(spl,
+                                       root,
+                                       bundle,
+                                       req->output_pivot_tuple_count,
+                                       req->output_pivot_kv_byte_count);
+   uint16 num_children = trunk_num_children(spl, root);
    for (uint16 pivot_no = 0; pivot_no < num_children; pivot_no++) {
-      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, child, pivot_no);
+      if (pivot_no != 0) {
+         key pivot_key = trunk_get_pivot(spl, root, pivot_no);
+         trunk_inc_intersection(spl, branch, pivot_key, FALSE);
+      }
+      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, root, pivot_no);
       req->pivot_generation[pivot_no] = pdata->generation;
    }
+   debug_assert(trunk_subbundle_branch_count(spl, root, sb) != 0);
+   trunk_log_stream_if_enabled(spl,
+                               &stream,
+                               "enqueuing build filter %lu-%u\n",
+                               req->addr,
+                               req->bundle_no);
+   trunk_enqueue_compact_req(spl, trunk_bundle_build_filters, req, TRUE);
 
-   trunk_bundle *bundle = trunk_get_bundle(spl, child, req->bundle_no);
-
-   // if there are whole branches, flush them into a subbundle
-   if (trunk_branch_is_whole(spl, parent, pdata->start_branch)) {
-      trunk_subbundle *child_sb = trunk_get_new_subbundle(spl, child, 1);
-      bundle->start_subbundle   = trunk_subbundle_no(spl, child, child_sb);
-      child_sb->state           = SB_STATE_UNCOMPACTED_INDEX;
+   // X. Incorporate new memtable into the bundle
+   memtable *mt = trunk_get_memtable(spl, generation);
+   // Normally need to hold incorp_mutex, but debug code and also guaranteed no
+   // one is changing gen_to_incorp (we are the only thread that would try)
+   debug_assert(generation == memtable_generation_to_incorporate(spl->mt_ctxt));
+   memtable_transition(
+      mt, MEMTABLE_STATE_INCORPORATION_ASSIGNED, MEMTABLE_STATE_INCORPORATING);
+   *branch = cmt->branch;
+   *filter = cmt->filter;
+   if (spl->cfg.use_stats) {
+      spl->stats[tid].memtable_flush_wait_time_ns +=
+         platform_timestamp_elapsed(cmt->wait_start);
+   }
 
-      // create a subbundle from the whole branches of the parent
-      child_sb->start_branch = trunk_end_branch(spl, child);
-      trunk_log_stream_if_enabled(
-         spl, &stream, "subbundle %hu\n", bundle->start_subbundle);
-      for (uint16 branch_no = pdata->start_branch;
-           trunk_branch_is_whole(spl, parent, branch_no);
-           branch_no = trunk_add_branch_number(spl, branch_no, 1))
-      {
-         trunk_branch *parent_branch = trunk_get_branch(spl, parent, branch_no);
-         trunk_log_stream_if_enabled(
-            spl, &stream, "%lu\n", parent_branch->root_addr);
-         trunk_branch *new_branch = trunk_get_new_branch(spl, child);
-         *new_branch              = *parent_branch;
-      }
-      child_sb->end_branch = trunk_end_branch(spl, child);
-      routing_filter *child_filter =
-         trunk_subbundle_filter(spl, child, child_sb, 0);
-      *child_filter = pdata->filter;
-      ZERO_STRUCT(pdata->filter);
-      debug_assert(trunk_subbundle_branch_count(spl, child, child_sb) != 0);
-   } else {
-      bundle->start_subbundle = trunk_end_subbundle(spl, child);
+   memtable_transition(
+      mt, MEMTABLE_STATE_INCORPORATING, MEMTABLE_STATE_INCORPORATED);
+   spl->memtables_incorporated = generation + 1;
+   trunk_log_node_if_enabled(&stream, spl, root);
+   trunk_log_stream_if_enabled(
+      spl, &stream, "----------------------------------------\n");
+   trunk_log_stream_if_enabled(spl, &stream, "\n");
+   trunk_close_log_stream_if_enabled(spl, &stream);
+
+   // X. If root is full, flush until it is no longer full
+   uint64 flush_start;
+   if (spl->cfg.use_stats) {
+      flush_start = platform_get_timestamp();
    }
 
-   // for each subbundle in the parent, create a subbundle in the child
-   if (trunk_pivot_bundle_count(spl, parent, pdata) != 0) {
-      uint16 pivot_start_sb_no =
-         trunk_pivot_start_subbundle(spl, parent, pdata);
-      for (uint16 parent_sb_no = pivot_start_sb_no;
-           parent_sb_no != trunk_end_subbundle(spl, parent);
-           parent_sb_no = trunk_add_subbundle_number(spl, parent_sb_no, 1))
-      {
-         trunk_subbundle *parent_sb =
-            trunk_get_subbundle(spl, parent, parent_sb_no);
-         uint16 filter_count =
-            trunk_subbundle_filter_count(spl, parent, parent_sb);
-         trunk_subbundle *child_sb =
-            trunk_get_new_subbundle(spl, child, filter_count);
-         child_sb->state        = parent_sb->state;
-         child_sb->start_branch = trunk_end_branch(spl, child);
-         trunk_log_stream_if_enabled(spl,
-                                     &stream,
-                                     "subbundle %hu from subbundle %hu\n",
-                                     trunk_subbundle_no(spl, child, child_sb),
-                                     parent_sb_no);
-         for (uint16 branch_no = parent_sb->start_branch;
-              branch_no != parent_sb->end_branch;
-              branch_no = trunk_add_branch_number(spl, branch_no, 1))
-         {
-            trunk_branch *parent_branch =
-               trunk_get_branch(spl, parent, branch_no);
-            trunk_log_stream_if_enabled(
-               spl, &stream, "%lu\n", parent_branch->root_addr);
-            trunk_branch *new_branch = trunk_get_new_branch(spl, child);
-            *new_branch              = *parent_branch;
-         }
-         child_sb->end_branch = trunk_end_branch(spl, child);
-         for (uint16 i = 0; i < filter_count; i++) {
-            routing_filter *child_filter =
-               trunk_subbundle_filter(spl, child, child_sb, i);
-            routing_filter *parent_filter =
-               trunk_subbundle_filter(spl, parent, parent_sb, i);
-            *child_filter = *parent_filter;
-            trunk_inc_filter(spl, child_filter);
-         }
-         debug_assert(trunk_subbundle_branch_count(spl, child, child_sb) != 0);
+   uint64 wait = 1;
+   while (trunk_node_is_full(spl, root)) {
+      platform_status rc = trunk_flush_fullest(spl, root);
+      if (!SUCCESS(rc)) {
+         trunk_node_unlock(spl, root);
+         platform_sleep(wait);
+         wait = wait > 2048 ? 2048 : 2 * wait;
+         trunk_node_lock(spl, root);
       }
    }
-   bundle->end_subbundle = trunk_end_subbundle(spl, child);
 
-   // clear the branches in the parent's pivot
-   trunk_pivot_clear(spl, parent, pdata);
+   // X. If necessary, split the root
+   if (trunk_needs_split(spl, root)) {
+      trunk_split_root(spl, root);
+   }
 
-   trunk_log_stream_if_enabled(
-      spl, &stream, "----------------------------------------\n");
-   trunk_log_node_if_enabled(&stream, spl, parent);
-   trunk_log_node_if_enabled(&stream, spl, child);
-   trunk_log_stream_if_enabled(spl, &stream, "flush done\n");
-   trunk_log_stream_if_enabled(spl, &stream, "\n");
-   trunk_close_log_stream_if_enabled(spl, &stream);
+   // X. Unlock the root
+   trunk_node_unlock(spl, root);
+   trunk_node_unclaim(spl, root);
+   trunk_node_unget(spl, &root);
 
-   platform_assert(bundle->start_subbundle != bundle->end_subbundle,
-                   "Flush into empty bundle.\n");
+   // X. Dec-ref the now-incorporated memtable
+   memtable_dec_ref_maybe_recycle(spl->mt_ctxt, mt);
 
-   return bundle;
+   if (spl->cfg.use_stats) {
+      const threadid tid = platform_get_tid();
+      flush_start        = platform_timestamp_elapsed(flush_start);
+      spl->stats[tid].memtable_flush_time_ns += flush_start;
+      spl->stats[tid].memtable_flushes++;
+      if (flush_start > spl->stats[tid].memtable_flush_time_max_ns) {
+         spl->stats[tid].memtable_flush_time_max_ns = flush_start;
+      }
+   }
 }
 
 /*
- * room_to_flush checks that there is enough physical space in child to flush
- * from parent.
+ * Main wrapper function to carry out incorporation of a memtable.
  *
- * NOTE: parent and child must have at least read locks
+ * If background threads are disabled this function is called inline in the
+ * context of the foreground thread.  If background threads are enabled, this
+ * function is called in the context of the memtable worker thread.
  */
-static inline bool
-trunk_room_to_flush(trunk_handle     *spl,
-                    page_handle      *parent,
-                    page_handle      *child,
-                    trunk_pivot_data *pdata)
+static void
+trunk_memtable_flush_internal(trunk_handle *spl, uint64 generation)
 {
-   uint16 child_branches   = trunk_branch_count(spl, child);
-   uint16 flush_branches   = trunk_pivot_branch_count(spl, parent, pdata);
-   uint16 child_bundles    = trunk_bundle_count(spl, child);
-   uint16 child_subbundles = trunk_subbundle_count(spl, child);
-   uint16 flush_subbundles =
-      trunk_pivot_subbundle_count(spl, parent, pdata) + 1;
-   return child_branches + flush_branches < spl->cfg.hard_max_branches_per_node
-          && child_bundles + 2 <= TRUNK_MAX_BUNDLES
-          && child_subbundles + flush_subbundles + 1 < TRUNK_MAX_SUBBUNDLES;
+   const threadid tid = platform_get_tid();
+   // pack and build filter.
+   trunk_memtable_compact_and_build_filter(spl, generation, tid);
+
+   // If we are assigned to do so, incorporate the memtable onto the root node.
+   if (!trunk_try_start_incorporate(spl, generation)) {
+      goto out;
+   }
+   do {
+      trunk_memtable_incorporate(spl, generation, tid);
+      generation++;
+   } while (trunk_try_continue_incorporate(spl, generation));
+   trunk_retire_range_tombstones(spl);
+   trunk_checkpoint_maybe_start(spl);
+out:
+   return;
+}
+
+static void
+trunk_memtable_flush_internal_virtual(void *arg, void *scratch)
+{
+   trunk_memtable_args *mt_args = arg;
+   trunk_memtable_flush_internal(mt_args->spl, mt_args->generation);
 }
 
 /*
- * flush flushes from parent to the child indicated by pdata.
+ * Function to trigger a memtable incorporation. Called in the context of
+ * the foreground doing insertions.
+ * If background threads are not enabled, this function does the entire memtable
+ * incorporation inline.
+ * If background threads are enabled, this function just queues up the task to
+ * carry out the incorporation, swaps the curr_memtable pointer, claims the
+ * root and returns.
+ */
+void
+trunk_memtable_flush(trunk_handle *spl, uint64 generation)
+{
+   trunk_compacted_memtable *cmt =
+      trunk_get_compacted_memtable(spl, generation);
+   cmt->mt_args.spl        = spl;
+   cmt->mt_args.generation = generation;
+   task_enqueue(spl->ts,
+                TASK_TYPE_MEMTABLE,
+                trunk_memtable_flush_internal_virtual,
+                &cmt->mt_args,
+                FALSE);
+}
+
+void
+trunk_memtable_flush_virtual(void *arg, uint64 generation)
+{
+   trunk_handle *spl = arg;
+   trunk_memtable_flush(spl, generation);
+}
+
+static inline uint64
+trunk_memtable_root_addr_for_lookup(trunk_handle *spl,
+                                    uint64        generation,
+                                    bool         *is_compacted)
+{
+   memtable *mt = trunk_get_memtable(spl, generation);
+   platform_assert(memtable_ok_to_lookup(mt));
+
+   if (memtable_ok_to_lookup_compacted(mt)) {
+      // lookup in packed tree
+      *is_compacted = TRUE;
+      trunk_compacted_memtable *cmt =
+         trunk_get_compacted_memtable(spl, generation);
+      return cmt->branch.root_addr;
+   } else {
+      // unpacked memtables are looked up through memtable.h
+      *is_compacted = FALSE;
+      return 0;
+   }
+}
+
+/*
+ * trunk_memtable_lookup
  *
- * Failure can occur if there is not enough space in the child.
+ * Pre-conditions:
+ *    If *found
+ *       `data` has the most recent answer.
+ *       the current memtable is older than the most recent answer
  *
- * NOTE: parent must be write locked
+ * Post-conditions:
+ *    if *found, the data can be found in `data`.
  */
-platform_status
-trunk_flush(trunk_handle     *spl,
-            page_handle      *parent,
-            trunk_pivot_data *pdata,
-            bool              is_space_rec)
+static platform_status
+trunk_memtable_lookup(trunk_handle      *spl,
+                      uint64             generation,
+                      uint64             tombstone_gen,
+                      key                target,
+                      merge_accumulator *data)
 {
-   platform_status rc;
-
-   uint64   wait_start, flush_start;
-   threadid tid;
-   if (spl->cfg.use_stats) {
-      tid        = platform_get_tid();
-      wait_start = platform_get_timestamp();
+   if (trunk_data_generation(spl, generation) < tombstone_gen) {
+      trunk_apply_range_tombstone(spl, target, data);
+      return STATUS_OK;
    }
 
-   page_handle *child = trunk_node_get(spl, pdata->addr);
-   trunk_node_claim(spl, &child);
+   bool   memtable_is_compacted;
+   bool   local_found;
+   uint64 root_addr = trunk_memtable_root_addr_for_lookup(
+      spl, generation, &memtable_is_compacted);
 
-   if (!trunk_room_to_flush(spl, parent, child, pdata)) {
-      platform_error_log(
-         "Flush failed: %lu %lu\n", parent->disk_addr, child->disk_addr);
-      if (spl->cfg.use_stats) {
-         if (parent->disk_addr == spl->root_addr) {
-            spl->stats[tid].root_failed_flushes++;
-         } else {
-            spl->stats[tid].failed_flushes[trunk_height(spl, parent)]++;
-         }
-      }
-      trunk_node_unclaim(spl, child);
-      trunk_node_unget(spl, &child);
-      return STATUS_INVALID_STATE;
+   if (!memtable_is_compacted) {
+      memtable *mt = trunk_get_memtable(spl, generation);
+      return memtable_lookup_and_merge(
+         spl->mt_ctxt, mt, target, data, &local_found);
    }
+   return btree_lookup_and_merge(spl->cc,
+                                 &spl->cfg.btree_cfg,
+                                 root_addr,
+                                 PAGE_TYPE_BRANCH,
+                                 target,
+                                 data,
+                                 &local_found);
+}
 
-   if ((!is_space_rec && pdata->srq_idx != -1)
-       && spl->cfg.reclaim_threshold != UINT64_MAX)
-   {
-      // platform_default_log("Deleting %12lu-%lu (index %lu) from SRQ\n",
-      //       parent->disk_addr, pdata->generation, pdata->srq_idx);
-      srq_delete(&spl->srq, pdata->srq_idx);
-      srq_print(&spl->srq);
-      pdata->srq_idx = -1;
-   }
-   trunk_node_lock(spl, child);
-
-   if (spl->cfg.use_stats) {
-      if (parent->disk_addr == spl->root_addr) {
-         spl->stats[tid].root_flush_wait_time_ns +=
-            platform_timestamp_elapsed(wait_start);
-      } else {
-         spl->stats[tid].flush_wait_time_ns[trunk_height(spl, parent)] +=
-            platform_timestamp_elapsed(wait_start);
-      }
-      flush_start = platform_get_timestamp();
-   }
+/*
+ *-----------------------------------------------------------------------------
+ * Filter functions
+ *-----------------------------------------------------------------------------
+ */
 
-   // flush the branch references into a new bundle in the child
-   trunk_compact_bundle_req *req = TYPED_ZALLOC(spl->heap_id, req);
-   trunk_bundle             *bundle =
-      trunk_flush_into_bundle(spl, parent, child, pdata, req);
-   trunk_tuples_in_bundle(spl,
-                          child,
-                          bundle,
-                          req->input_pivot_tuple_count,
-                          req->input_pivot_kv_byte_count);
-   trunk_pivot_add_bundle_tuple_counts(spl,
-                                       child,
-                                       bundle,
-                                       req->input_pivot_tuple_count,
-                                       req->input_pivot_kv_byte_count);
-   trunk_bundle_inc_pivot_rc(spl, child, bundle);
-   debug_assert(cache_page_valid(spl->cc, req->addr));
-   req->type = is_space_rec ? TRUNK_COMPACTION_TYPE_FLUSH
-                            : TRUNK_COMPACTION_TYPE_SPACE_REC;
+static inline routing_config *
+trunk_routing_cfg(trunk_handle *spl)
+{
+   return &spl->cfg.filter_cfg;
+}
 
-   // split child if necessary
-   if (trunk_needs_split(spl, child)) {
-      if (trunk_is_leaf(spl, child)) {
-         platform_free(spl->heap_id, req);
-         uint16 child_idx = trunk_pdata_to_pivot_index(spl, parent, pdata);
-         trunk_split_leaf(spl, parent, child, child_idx);
-         debug_assert(trunk_verify_node(spl, child));
-         return STATUS_OK;
-      } else {
-         uint64 child_idx = trunk_pdata_to_pivot_index(spl, parent, pdata);
-         trunk_split_index(spl, parent, child, child_idx);
-      }
+static inline void
+trunk_inc_filter(trunk_handle *spl, routing_filter *filter)
+{
+   if (filter->addr == 0) {
+      return;
    }
+   mini_unkeyed_inc_ref(spl->cc, filter->meta_head);
+}
 
-   debug_assert(trunk_verify_node(spl, child));
-   trunk_node_unlock(spl, child);
-   trunk_node_unclaim(spl, child);
-   trunk_node_unget(spl, &child);
-
-   trunk_default_log_if_enabled(
-      spl, "enqueuing compact_bundle %lu-%u\n", req->addr, req->bundle_no);
-   rc =
-      task_enqueue(spl->ts, TASK_TYPE_NORMAL, trunk_compact_bundle, req, FALSE);
-   platform_assert_status_ok(rc);
-   if (spl->cfg.use_stats) {
-      flush_start = platform_timestamp_elapsed(flush_start);
-      if (parent->disk_addr == spl->root_addr) {
-         spl->stats[tid].root_flush_time_ns += flush_start;
-         if (flush_start > spl->stats[tid].root_flush_time_max_ns) {
-            spl->stats[tid].root_flush_time_max_ns = flush_start;
-         }
-      } else {
-         const uint32 h = trunk_height(spl, parent);
-         spl->stats[tid].flush_time_ns[h] += flush_start;
-         if (flush_start > spl->stats[tid].flush_time_max_ns[h]) {
-            spl->stats[tid].flush_time_max_ns[h] = flush_start;
-         }
-      }
+static inline void
+trunk_dec_filter(trunk_handle *spl, routing_filter *filter)
+{
+   if (filter->addr == 0) {
+      return;
    }
-   return rc;
+   cache *cc = spl->cc;
+   routing_filter_zap(cc, filter);
 }
 
 /*
- * flush_fullest first flushes any pivots with too many live logical branches.
- * If the node is still full, it then flushes the pivot with the most tuples.
+ * Scratch space used for filter building.
  */
-platform_status
-trunk_flush_fullest(trunk_handle *spl, page_handle *node)
+typedef struct trunk_filter_scratch {
+   bool           should_build[TRUNK_MAX_PIVOTS];
+   routing_filter old_filter[TRUNK_MAX_PIVOTS];
+   uint16         value[TRUNK_MAX_PIVOTS];
+   routing_filter filter[TRUNK_MAX_PIVOTS];
+   uint32        *fp_arr;
+   uint32        *prefix_fp_arr;
+} trunk_filter_req;
+
+static inline void
+trunk_filter_req_init(trunk_compact_bundle_req *compact_req,
+                      trunk_filter_req         *filter_req)
 {
-   platform_status rc               = STATUS_OK;
-   uint16          fullest_pivot_no = TRUNK_INVALID_PIVOT_NO;
+   ZERO_CONTENTS(filter_req);
+   filter_req->fp_arr        = compact_req->fp_arr;
+   filter_req->prefix_fp_arr = compact_req->prefix_fp_arr;
+}
 
-   threadid tid;
-   if (spl->cfg.use_stats) {
-      tid = platform_get_tid();
-   }
-   /*
-    * Note that trunk_num_children *must* be called at every loop iteration,
-    * since flushes may cause splits, which in turn will change the number of
-    * children
-    */
-   for (uint16 pivot_no = 0; pivot_no < trunk_num_children(spl, node);
-        pivot_no++) {
-      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
-      // if a pivot has too many branches, just flush it here
-      if (trunk_pivot_needs_flush(spl, node, pdata)) {
-         rc = trunk_flush(spl, node, pdata, FALSE);
-         if (!SUCCESS(rc)) {
-            return rc;
-         }
-         if (spl->cfg.use_stats) {
-            if (node->disk_addr == spl->root_addr) {
-               spl->stats[tid].root_count_flushes++;
-            } else {
-               spl->stats[tid].count_flushes[trunk_height(spl, node)]++;
-            }
-         }
-      } else if (fullest_pivot_no == TRUNK_INVALID_PIVOT_NO
-                 || (trunk_pivot_num_tuples(spl, node, pivot_no)
-                     > trunk_pivot_num_tuples(spl, node, fullest_pivot_no)))
-      {
-         fullest_pivot_no = pivot_no;
-      }
+static inline page_handle *
+trunk_node_get_maybe_descend(trunk_handle *spl, trunk_compact_bundle_req *req)
+{
+   page_handle *node = trunk_node_get(spl, req->addr);
+   while (trunk_height(spl, node) != req->height) {
+      debug_assert(trunk_height(spl, node) > req->height);
+      debug_assert(req->height != 0);
+      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, 0);
+      req->addr               = pdata->addr;
+      platform_stream_handle stream;
+      platform_status rc = trunk_open_log_stream_if_enabled(spl, &stream);
+      platform_assert_status_ok(rc);
+      trunk_log_stream_if_enabled(
+         spl, &stream, "build_filter descending from root\n");
+      trunk_log_stream_if_enabled(spl,
+                                  &stream,
+                                  "enqueuing build filter %lu-%u\n",
+                                  req->addr,
+                                  req->bundle_no);
+      trunk_log_node_if_enabled(&stream, spl, node);
+      trunk_node_unget(spl, &node);
+      node = trunk_node_get(spl, req->addr);
    }
-   if (trunk_node_is_full(spl, node)) {
-      if (spl->cfg.use_stats) {
-         if (node->disk_addr == spl->root_addr) {
-            spl->stats[tid].root_full_flushes++;
-         } else {
-            spl->stats[tid].full_flushes[trunk_height(spl, node)]++;
-         }
+   return node;
+}
+
+static inline page_handle *
+trunk_node_get_claim_maybe_descend(trunk_handle             *spl,
+                                   trunk_compact_bundle_req *req)
+{
+   page_handle *node;
+   uint64       wait = 1;
+   while (1) {
+      node = trunk_node_get_maybe_descend(spl, req);
+      if (trunk_node_try_claim(spl, node)) {
+         break;
       }
-      platform_assert(fullest_pivot_no != TRUNK_INVALID_PIVOT_NO);
-      trunk_pivot_data *pdata =
-         trunk_get_pivot_data(spl, node, fullest_pivot_no);
-      return trunk_flush(spl, node, pdata, FALSE);
+      trunk_node_unget(spl, &node);
+      platform_sleep(wait);
+      wait = wait > 2048 ? wait : 2 * wait;
    }
-   return rc;
+   return node;
 }
 
-static void
-save_pivots_to_compact_bundle_scratch(trunk_handle           *spl,     // IN
-                                      page_handle            *node,    // IN
-                                      compact_bundle_scratch *scratch) // IN/OUT
+static inline bool
+trunk_build_filter_should_abort(trunk_compact_bundle_req *req,
+                                page_handle              *node)
 {
-   platform_status rc;
-   uint32          num_pivot_keys = trunk_num_pivot_keys(spl, node);
-
-   debug_assert(num_pivot_keys < ARRAY_SIZE(scratch->saved_pivot_keys));
-
-   // Save all num_pivots regular pivots and the upper bound pivot
-   for (uint32 i = 0; i < num_pivot_keys; i++) {
-      key pivot = trunk_get_pivot(spl, node, i);
-      rc        = key_buffer_init_from_key(
-         &scratch->saved_pivot_keys[i], spl->heap_id, pivot);
+   trunk_handle *spl    = req->spl;
+   uint16        height = trunk_height(spl, node);
+   if (height == 0 && req->generation < trunk_generation(spl, node)) {
+      platform_stream_handle stream;
+      platform_status rc = trunk_open_log_stream_if_enabled(spl, &stream);
       platform_assert_status_ok(rc);
+      trunk_log_stream_if_enabled(spl,
+                                  &stream,
+                                  "build_filter leaf abort %lu-%u\n",
+                                  req->addr,
+                                  req->bundle_no);
+      trunk_log_node_if_enabled(&stream, spl, node);
+      trunk_close_log_stream_if_enabled(spl, &stream);
+      return TRUE;
    }
-   scratch->num_saved_pivot_keys = num_pivot_keys;
+   return FALSE;
 }
 
-static void
-deinit_saved_pivots_in_scratch(compact_bundle_scratch *scratch)
+static inline bool
+trunk_build_filter_should_skip(trunk_compact_bundle_req *req, page_handle *node)
 {
-   for (uint32 i = 0; i < scratch->num_saved_pivot_keys; i++) {
-      key_buffer_deinit(&scratch->saved_pivot_keys[i]);
+   trunk_handle *spl = req->spl;
+   if (!trunk_bundle_live(spl, node, req->bundle_no)) {
+      platform_stream_handle stream;
+      platform_status rc = trunk_open_log_stream_if_enabled(spl, &stream);
+      platform_assert_status_ok(rc);
+      trunk_log_stream_if_enabled(spl,
+                                  &stream,
+                                  "build_filter flush abort %lu-%u (%u)\n",
+                                  req->addr,
+                                  req->bundle_no,
+                                  req->height);
+      trunk_log_node_if_enabled(&stream, spl, node);
+      trunk_close_log_stream_if_enabled(spl, &stream);
+      return TRUE;
    }
+   return FALSE;
 }
 
-/*
- * Branch iterator wrapper functions
- */
-
-void
-trunk_branch_iterator_init(trunk_handle   *spl,
-                           btree_iterator *itor,
-                           trunk_branch   *branch,
-                           key             min_key,
-                           key             max_key,
-                           bool            do_prefetch,
-                           bool            should_inc_ref)
-{
-   cache        *cc        = spl->cc;
-   btree_config *btree_cfg = &spl->cfg.btree_cfg;
-   uint64        root_addr = branch->root_addr;
-   if (root_addr != 0 && should_inc_ref) {
-      btree_inc_ref_range(cc, btree_cfg, root_addr, min_key, max_key);
-   }
-   btree_iterator_init(cc,
-                       btree_cfg,
-                       itor,
-                       root_addr,
-                       PAGE_TYPE_BRANCH,
-                       min_key,
-                       max_key,
-                       do_prefetch,
-                       0);
-}
-
-void
-trunk_branch_iterator_deinit(trunk_handle   *spl,
-                             btree_iterator *itor,
-                             bool            should_dec_ref)
+static inline bool
+trunk_build_filter_should_reenqueue(trunk_compact_bundle_req *req,
+                                    page_handle              *node)
 {
-   if (itor->root_addr == 0) {
-      return;
-   }
-   cache        *cc        = spl->cc;
-   btree_config *btree_cfg = &spl->cfg.btree_cfg;
-   key           min_key   = itor->min_key;
-   key           max_key   = itor->max_key;
-   btree_iterator_deinit(itor);
-   if (should_dec_ref) {
-      btree_dec_ref_range(cc, btree_cfg, itor->root_addr, min_key, max_key);
+   trunk_handle *spl = req->spl;
+   if (req->bundle_no != trunk_start_bundle(spl, node)) {
+      platform_stream_handle stream;
+      platform_status rc = trunk_open_log_stream_if_enabled(spl, &stream);
+      platform_assert_status_ok(rc);
+      trunk_log_stream_if_enabled(spl,
+                                  &stream,
+                                  "build filter for %lu bundle %u\n",
+                                  req->addr,
+                                  req->bundle_no);
+      trunk_log_node_if_enabled(&stream, spl, node);
+      trunk_log_stream_if_enabled(spl,
+                                  &stream,
+                                  "reenqueuing build filter %lu-%u\n",
+                                  req->addr,
+                                  req->bundle_no);
+      trunk_close_log_stream_if_enabled(spl, &stream);
+      return TRUE;
    }
+   return FALSE;
 }
 
-/*
- *-----------------------------------------------------------------------------
- * btree skiperator
- *
- *       an iterator which can skip over tuples in branches which aren't live
- *-----------------------------------------------------------------------------
- */
-static void
-trunk_btree_skiperator_init(trunk_handle           *spl,
-                            trunk_btree_skiperator *skip_itor,
-                            page_handle            *node,
-                            uint16                  branch_idx,
-                            key_buffer pivots[static TRUNK_MAX_PIVOTS])
+static inline void
+trunk_prepare_build_filter(trunk_handle             *spl,
+                           trunk_compact_bundle_req *compact_req,
+                           trunk_filter_req         *filter_req,
+                           page_handle              *node)
 {
-   ZERO_CONTENTS(skip_itor);
-   skip_itor->super.ops = &trunk_btree_skiperator_ops;
-   uint16 min_pivot_no  = 0;
-   uint16 max_pivot_no  = trunk_num_children(spl, node);
-   debug_assert(
-      (max_pivot_no < TRUNK_MAX_PIVOTS), "max_pivot_no = %d", max_pivot_no);
-
-   key min_key       = key_buffer_key(&pivots[min_pivot_no]);
-   key max_key       = key_buffer_key(&pivots[max_pivot_no]);
-   skip_itor->branch = *trunk_get_branch(spl, node, branch_idx);
-
-   uint16 first_pivot      = 0;
-   bool   iterator_started = FALSE;
-
-   for (uint16 i = min_pivot_no; i < max_pivot_no + 1; i++) {
-      bool branch_valid =
-         i == max_pivot_no
-            ? FALSE
-            : trunk_branch_live_for_pivot(spl, node, branch_idx, i);
-      if (branch_valid && !iterator_started) {
-         first_pivot      = i;
-         iterator_started = TRUE;
-      }
-      if (!branch_valid && iterator_started) {
-         // create a new btree iterator
-         key pivot_min_key = first_pivot == min_pivot_no
-                                ? min_key
-                                : key_buffer_key(&pivots[first_pivot]);
-         key pivot_max_key =
-            i == max_pivot_no ? max_key : key_buffer_key(&pivots[i]);
-         btree_iterator *btree_itor = &skip_itor->itor[skip_itor->end++];
-         trunk_branch_iterator_init(spl,
-                                    btree_itor,
-                                    &skip_itor->branch,
-                                    pivot_min_key,
-                                    pivot_max_key,
-                                    TRUE,
-                                    TRUE);
-         iterator_started = FALSE;
-      }
-   }
+   uint16 height = trunk_height(spl, node);
+   platform_assert(compact_req->height == height);
+   platform_assert(compact_req->bundle_no == trunk_start_bundle(spl, node));
 
-   bool at_end;
-   if (skip_itor->curr != skip_itor->end) {
-      iterator_at_end(&skip_itor->itor[skip_itor->curr].super, &at_end);
-   } else {
-      at_end = TRUE;
-   }
+   trunk_filter_req_init(compact_req, filter_req);
 
-   while (skip_itor->curr != skip_itor->end && at_end) {
-      iterator_at_end(&skip_itor->itor[skip_itor->curr].super, &at_end);
-      if (!at_end) {
-         break;
+   uint16 num_children = trunk_num_children(spl, node);
+   for (uint16 pivot_no = 0; pivot_no < num_children; pivot_no++) {
+      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
+      if (trunk_bundle_live_for_pivot(
+             spl, node, compact_req->bundle_no, pivot_no)) {
+         uint64 pos = trunk_process_generation_to_pos(
+            spl, compact_req, pdata->generation);
+         platform_assert(pos != TRUNK_MAX_PIVOTS);
+         filter_req->old_filter[pos] = pdata->filter;
+         filter_req->value[pos] =
+            trunk_pivot_whole_branch_count(spl, node, pdata);
+         filter_req->should_build[pos] = TRUE;
       }
-      skip_itor->curr++;
    }
 }
 
-void
-trunk_btree_skiperator_get_curr(iterator *itor, key *curr_key, message *data)
-{
-   debug_assert(itor != NULL);
-   trunk_btree_skiperator *skip_itor = (trunk_btree_skiperator *)itor;
-   iterator_get_curr(&skip_itor->itor[skip_itor->curr].super, curr_key, data);
-}
-
-platform_status
-trunk_btree_skiperator_advance(iterator *itor)
+static inline void
+trunk_process_generation_to_fp_bounds(trunk_handle             *spl,
+                                      trunk_compact_bundle_req *req,
+                                      uint64                    generation,
+                                      uint32                   *fp_start,
+                                      uint32                   *fp_end)
 {
-   debug_assert(itor != NULL);
-   trunk_btree_skiperator *skip_itor = (trunk_btree_skiperator *)itor;
-   platform_status         rc =
-      iterator_advance(&skip_itor->itor[skip_itor->curr].super);
-   if (!SUCCESS(rc)) {
-      return rc;
-   }
-
-   bool at_end;
-   iterator_at_end(&skip_itor->itor[skip_itor->curr].super, &at_end);
-   while (skip_itor->curr != skip_itor->end && at_end) {
-      iterator_at_end(&skip_itor->itor[skip_itor->curr].super, &at_end);
-      if (!at_end)
-         break;
-      skip_itor->curr++;
+   uint64 pos          = 0;
+   uint64 fp_start_int = 0;
+   while (pos != TRUNK_MAX_PIVOTS && req->pivot_generation[pos] != generation) {
+      fp_start_int += req->output_pivot_tuple_count[pos];
+      pos++;
    }
-
-   return STATUS_OK;
+   platform_assert(pos + 1 != TRUNK_MAX_PIVOTS);
+   uint64 fp_end_int = fp_start_int + req->output_pivot_tuple_count[pos];
+   *fp_start         = fp_start_int;
+   *fp_end           = fp_end_int;
 }
 
-platform_status
-trunk_btree_skiperator_at_end(iterator *itor, bool *at_end)
+static inline void
+trunk_build_filters(trunk_handle             *spl,
+                    trunk_compact_bundle_req *compact_req,
+                    trunk_filter_req         *filter_req)
 {
-   trunk_btree_skiperator *skip_itor = (trunk_btree_skiperator *)itor;
-   if (skip_itor->curr == skip_itor->end) {
-      *at_end = TRUE;
-      return STATUS_OK;
+   threadid tid;
+   uint64   filter_build_start;
+   uint16   height;
+   if (spl->cfg.use_stats) {
+      tid                = platform_get_tid();
+      height             = compact_req->height;
+      filter_build_start = platform_get_timestamp();
    }
 
-   iterator_at_end(&skip_itor->itor[skip_itor->curr].super, at_end);
-   return STATUS_OK;
-}
+   for (uint64 pos = 0; pos < TRUNK_MAX_PIVOTS; pos++) {
+      if (!filter_req->should_build[pos]) {
+         continue;
+      }
+      routing_filter old_filter = filter_req->old_filter[pos];
+      uint32         fp_start, fp_end;
+      uint64         generation = compact_req->pivot_generation[pos];
+      trunk_process_generation_to_fp_bounds(
+         spl, compact_req, generation, &fp_start, &fp_end);
+      uint32 *fp_arr           = filter_req->fp_arr + fp_start;
+      uint32 *prefix_fp_arr    = filter_req->prefix_fp_arr == NULL
+                                    ? NULL
+                                    : filter_req->prefix_fp_arr + fp_start;
+      uint32  num_fingerprints = fp_end - fp_start;
+      /*
+       * None of the bundle's keys are in the pivot. If the pivot had no
+       * filter either, it is left with whole branches and an empty filter
+       * (addr 0), in which lookups find nothing.
+       */
+      if (num_fingerprints == 0) {
+         if (old_filter.addr != 0) {
+            trunk_inc_filter(spl, &old_filter);
+         }
+         filter_req->filter[pos] = old_filter;
+         continue;
+      }
+      routing_filter  new_filter;
+      uint16          value = filter_req->value[pos];
+      platform_status rc    = trunk_filter_add(spl,
+                                            &old_filter,
+                                            &new_filter,
+                                            fp_arr,
+                                            prefix_fp_arr,
+                                            num_fingerprints,
+                                            value);
+      platform_assert(SUCCESS(rc));
 
-void
-trunk_btree_skiperator_print(iterator *itor)
-{
-   trunk_btree_skiperator *skip_itor = (trunk_btree_skiperator *)itor;
-   platform_default_log("$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$\n");
-   platform_default_log("$$ skiperator: %p\n", skip_itor);
-   platform_default_log("$$ curr: %lu\n", skip_itor->curr);
-   iterator_print(&skip_itor->itor[skip_itor->curr].super);
-}
+      filter_req->filter[pos]       = new_filter;
+      filter_req->should_build[pos] = FALSE;
+      if (spl->cfg.use_stats) {
+         spl->stats[tid].filters_built[height]++;
+         spl->stats[tid].filter_tuples[height] += num_fingerprints;
+      }
+   }
 
-void
-trunk_btree_skiperator_deinit(trunk_handle           *spl,
-                              trunk_btree_skiperator *skip_itor)
-{
-   for (uint64 i = 0; i < skip_itor->end; i++) {
-      trunk_branch_iterator_deinit(spl, &skip_itor->itor[i], TRUE);
+   if (spl->cfg.use_stats) {
+      spl->stats[tid].filter_time_ns[height] +=
+         platform_timestamp_elapsed(filter_build_start);
    }
 }
 
-/*
- *-----------------------------------------------------------------------------
- * Compaction Functions
- *-----------------------------------------------------------------------------
- */
-
 static inline void
-trunk_btree_pack_req_init(trunk_handle   *spl,
-                          iterator       *itor,
-                          btree_pack_req *req)
+trunk_replace_routing_filter(trunk_handle             *spl,
+                             trunk_compact_bundle_req *compact_req,
+                             trunk_filter_req         *filter_req,
+                             page_handle              *node)
 {
-   btree_pack_req_init(req,
-                       spl->cc,
-                       &spl->cfg.btree_cfg,
-                       itor,
-                       spl->cfg.max_tuples_per_node,
-                       spl->cfg.filter_cfg.hash,
-                       spl->cfg.filter_cfg.seed,
-                       spl->heap_id);
-}
+   uint16 num_children = trunk_num_children(spl, node);
+   for (uint16 pivot_no = 0; pivot_no < num_children; pivot_no++) {
+      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
+      uint64            pos =
+         trunk_process_generation_to_pos(spl, compact_req, pdata->generation);
+      if (!trunk_bundle_live_for_pivot(
+             spl, node, compact_req->bundle_no, pivot_no)) {
+         if (pos != TRUNK_MAX_PIVOTS && filter_req->filter[pos].addr != 0) {
+            trunk_dec_filter(spl, &filter_req->filter[pos]);
+            ZERO_CONTENTS(&filter_req->filter[pos]);
+         }
+         continue;
+      }
+      platform_assert(pos != TRUNK_MAX_PIVOTS);
+      debug_assert(pdata->generation < compact_req->max_pivot_generation);
+      trunk_dec_filter(spl, &pdata->filter);
+      pdata->filter = filter_req->filter[pos];
+      ZERO_CONTENTS(&filter_req->filter[pos]);
 
-static void
-trunk_compact_bundle_cleanup_iterators(trunk_handle           *spl,
-                                       merge_iterator        **merge_itor,
-                                       uint64                  num_branches,
-                                       trunk_btree_skiperator *skip_itor_arr)
-{
-   platform_status rc = merge_iterator_destroy(spl->heap_id, merge_itor);
-   platform_assert_status_ok(rc);
-   for (uint64 i = 0; i < num_branches; i++) {
-      trunk_btree_skiperator_deinit(spl, &skip_itor_arr[i]);
+      // Move the tuples count from the bundle to whole branch
+      uint64 bundle_num_tuples = compact_req->output_pivot_tuple_count[pos];
+      debug_assert(pdata->num_tuples_bundle >= bundle_num_tuples);
+      pdata->num_tuples_bundle -= bundle_num_tuples;
+      pdata->num_tuples_whole += bundle_num_tuples;
+
+      // Move the kv_bytes count from the bundle to whole branch
+      uint64 bundle_num_kv_bytes = compact_req->output_pivot_kv_byte_count[pos];
+      debug_assert(pdata->num_kv_bytes_bundle >= bundle_num_kv_bytes);
+      pdata->num_kv_bytes_bundle -= bundle_num_kv_bytes;
+      pdata->num_kv_bytes_whole += bundle_num_kv_bytes;
+
+      uint64 num_tuples_to_reclaim = trunk_pivot_tuples_to_reclaim(spl, pdata);
+      if (pdata->srq_idx != -1 && spl->cfg.reclaim_threshold != UINT64_MAX) {
+         srq_update(&spl->srq, pdata->srq_idx, num_tuples_to_reclaim);
+         srq_print(&spl->srq);
+      } else if ((num_tuples_to_reclaim > TRUNK_MIN_SPACE_RECL)
+                 && (spl->cfg.reclaim_threshold != UINT64_MAX))
+      {
+         srq_data data  = {.addr             = node->disk_addr,
+                           .pivot_generation = pdata->generation,
+                           .priority         = num_tuples_to_reclaim};
+         pdata->srq_idx = srq_insert(&spl->srq, data);
+         srq_print(&spl->srq);
+      }
    }
-   debug_code(memset(skip_itor_arr, 0, num_branches * sizeof(*skip_itor_arr)));
 }
 
+
 /*
- * compact_bundle compacts a bundle of flushed branches into a single branch
- *
- * See "Interactions between Concurrent Processes"
- * (numbering here mirrors that section)
- *
- * Interacts with splitting in two ways:
- * 4. Internal node split occurs between job issue and this compact_bundle call:
- *    the bundle was split too, issue compact_bundle on the new siblings
- * 6. Leaf split occurs before this call or during compaction:
- *    the bundle will be compacted as part of the split, so this compaction is
- *    aborted if split occurred before this call or discarded if it occurred
- *    during compaction.
- *
- * Node splits are determined using generation numbers (in trunk_hdr)
- *   internal: generation number of left node is incremented on split
- *      -- given generation number g of a node, all the nodes it split
- *         into can be found by searching right until a node with
- *         generation number g is found
- *   leaf: generation numbers of all leaves affected by split are
- *         incremented
- *      -- can tell if a leaf has split by checking if generation number
- *         has changed
- *
- * Algorithm:
- * 1.  Acquire node read lock
- * 2.  Flush if node is full (acquires write lock)
- * 3.  If the node has split before this call (interaction 4), this
- *     bundle exists in the new split siblings, so issue compact_bundles
- *     for those nodes
- * 4.  Abort if node is a leaf and started splitting (interaction 6)
- * 5.  The bundle may have been completely flushed by step 2, if so abort
- * 6.  Build iterators
- * 7.  Release read lock
- * 8.  Perform compaction
- * 9.  Build filter
- * 10. Clean up
- * 11. Reacquire read lock
- * 12. For each newly split sibling replace bundle with new branch unless
- *        a. node if leaf which has split, in which case discard (interaction 6)
- *        b. node is internal and bundle has been flushed
+ * Asynchronous task function which builds routing filters for a compacted
+ * bundle
  */
 void
-trunk_compact_bundle(void *arg, void *scratch_buf)
+trunk_bundle_build_filters(void *arg, void *scratch)
 {
-   platform_status           rc;
-   trunk_compact_bundle_req *req          = arg;
-   trunk_task_scratch       *task_scratch = scratch_buf;
-   compact_bundle_scratch   *scratch      = &task_scratch->compact_bundle;
-   trunk_handle             *spl          = req->spl;
-   threadid                  tid;
+   trunk_compact_bundle_req *compact_req = (trunk_compact_bundle_req *)arg;
+   trunk_handle             *spl         = compact_req->spl;
 
-   /*
-    * 1. Acquire node read lock
-    */
-   page_handle *node = trunk_node_get(spl, req->addr);
+   uint64 generation;
+   do {
+      page_handle *node = trunk_node_get_maybe_descend(spl, compact_req);
+      platform_assert(node != NULL);
 
-   /*
-    * 2. Flush if node is full (acquires write lock)
-    */
-   uint16 height = trunk_height(spl, node);
-   if (height != 0 && trunk_node_is_full(spl, node)) {
-      trunk_node_claim(spl, &node);
-      trunk_node_lock(spl, node);
-      rc = STATUS_OK;
-      while (SUCCESS(rc) && trunk_node_is_full(spl, node)) {
-         rc = trunk_flush_fullest(spl, node);
+      platform_stream_handle stream;
+      trunk_open_log_stream_if_enabled(spl, &stream);
+      trunk_log_stream_if_enabled(
+         spl,
+         &stream,
+         "build filter for %lu bundle %u pivot_gen %lu\n",
+         compact_req->addr,
+         compact_req->bundle_no,
+         compact_req->max_pivot_generation);
+      trunk_log_node_if_enabled(&stream, spl, node);
+      if (trunk_build_filter_should_abort(compact_req, node)) {
+         trunk_log_stream_if_enabled(spl, &stream, "leaf split, aborting\n");
+         trunk_node_unget(spl, &node);
+         goto out;
+      }
+      if (trunk_build_filter_should_skip(compact_req, node)) {
+         trunk_log_stream_if_enabled(
+            spl, &stream, "bundle flushed, skipping\n");
+         goto next_node;
       }
-      trunk_node_unlock(spl, node);
-      trunk_node_unclaim(spl, node);
-   }
-
-   // timers for stats if enabled
-   uint64 compaction_start, pack_start;
-
-   if (spl->cfg.use_stats) {
-      tid              = platform_get_tid();
-      compaction_start = platform_get_timestamp();
-      spl->stats[tid].compactions[height]++;
-   }
-
-   /*
-    * 3. If the node has split before this call (interaction 4), this
-    *    bundle was copied to the new sibling[s], so issue compact_bundles for
-    *    those nodes
-    */
-   if (req->generation < trunk_generation(spl, node)) {
-      if (height != 0) {
-         debug_assert(trunk_next_addr(spl, node) != 0);
-         trunk_compact_bundle_req *next_req =
-            TYPED_MALLOC(spl->heap_id, next_req);
-         memmove(next_req, req, sizeof(trunk_compact_bundle_req));
-         next_req->addr = trunk_next_addr(spl, node);
-         debug_assert(next_req->addr != 0);
-
-         req->generation = trunk_generation(spl, node);
 
-         trunk_default_log_if_enabled(spl,
-                                      "compact_bundle split from %lu to %lu\n",
-                                      req->addr,
-                                      next_req->addr);
-         rc = task_enqueue(
-            spl->ts, TASK_TYPE_NORMAL, trunk_compact_bundle, next_req, FALSE);
-         platform_assert_status_ok(rc);
-      } else {
-         /*
-          * 4. Abort if node is a splitting leaf (interaction 6)
-          */
+      if (trunk_build_filter_should_reenqueue(compact_req, node)) {
+         trunk_enqueue_compact_req(
+            spl, trunk_bundle_build_filters, compact_req, FALSE);
+         trunk_log_stream_if_enabled(
+            spl, &stream, "out of order, reequeuing\n");
+         trunk_close_log_stream_if_enabled(spl, &stream);
          trunk_node_unget(spl, &node);
-         trunk_default_log_if_enabled(
-            spl, "compact_bundle abort leaf split %lu\n", req->addr);
-         platform_free(spl->heap_id, req);
-         if (spl->cfg.use_stats) {
-            spl->stats[tid].compactions_aborted_leaf_split[height]++;
-            spl->stats[tid].compaction_time_wasted_ns[height] +=
-               platform_timestamp_elapsed(compaction_start);
-         }
          return;
       }
-   }
-
-   // store the generation of the node so we can detect splits after compaction
-   uint64 start_generation = trunk_generation(spl, node);
 
-   /*
-    * 5. The bundle may have been completely flushed by 2., if so abort
-    *       -- note this cannot happen in leaves (if the bundle isn't live, the
-    *          generation number would change and it would be caught by step 4
-    *          above).
-    */
-   if (!trunk_bundle_live(spl, node, req->bundle_no)) {
-      debug_assert(height != 0);
+      debug_assert(trunk_verify_node(spl, node));
+      trunk_filter_req filter_req = {0};
+      trunk_prepare_build_filter(spl, compact_req, &filter_req, node);
+      uint64 filter_generation = trunk_generation(spl, node);
       trunk_node_unget(spl, &node);
-      trunk_default_log_if_enabled(
-         spl, "compact_bundle abort flushed %lu\n", req->addr);
-      platform_free(spl->heap_id, req);
-      if (spl->cfg.use_stats) {
-         spl->stats[tid].compactions_aborted_flushed[height]++;
-         spl->stats[tid].compaction_time_wasted_ns[height] +=
-            platform_timestamp_elapsed(compaction_start);
-      }
-      return;
-   }
 
-   trunk_bundle *bundle       = trunk_get_bundle(spl, node, req->bundle_no);
-   uint16 bundle_start_branch = trunk_bundle_start_branch(spl, node, bundle);
-   uint16 bundle_end_branch   = trunk_bundle_end_branch(spl, node, bundle);
-   uint16 num_branches        = trunk_bundle_branch_count(spl, node, bundle);
+      trunk_build_filters(spl, compact_req, &filter_req);
 
-   /*
-    * Update and delete messages need to be kept around until/unless they have
-    * been applied all the way down to the very last branch tree.  Even once it
-    * reaches the leaf, it isn't going to be applied to the last branch tree
-    * unless the compaction includes the oldest B-tree in the leaf (the start
-    * branch).
-    */
-   merge_behavior merge_mode;
-   if (height == 0 && bundle_start_branch == trunk_start_branch(spl, node)) {
-      merge_mode = MERGE_FULL;
-   } else {
-      merge_mode = MERGE_INTERMEDIATE;
-   }
+      trunk_log_stream_if_enabled(
+         spl, &stream, "----------------------------------------\n");
 
-   platform_stream_handle stream;
-   rc = trunk_open_log_stream_if_enabled(spl, &stream);
-   platform_assert_status_ok(rc);
-   trunk_log_stream_if_enabled(spl,
+      do {
+         node = trunk_node_get_claim_maybe_descend(spl, compact_req);
+         if (trunk_build_filter_should_abort(compact_req, node)) {
+            trunk_log_stream_if_enabled(
+               spl,
+               &stream,
+               "replace_filter abort leaf split (%lu)\n",
+               compact_req->addr);
+            trunk_node_unclaim(spl, node);
+            trunk_node_unget(spl, &node);
+            for (uint64 pos = 0; pos < TRUNK_MAX_PIVOTS; pos++) {
+               trunk_dec_filter(spl, &filter_req.filter[pos]);
+            }
+            goto out;
+         }
+         trunk_node_lock(spl, node);
+         trunk_replace_routing_filter(spl, compact_req, &filter_req, node);
+         if (trunk_bundle_live(spl, node, compact_req->bundle_no)) {
+            trunk_clear_bundle(spl, node, compact_req->bundle_no);
+         }
+         trunk_node_unlock(spl, node);
+         trunk_node_unclaim(spl, node);
+         compact_req->addr = trunk_next_addr(spl, node);
+         generation        = trunk_generation(spl, node);
+         debug_assert(trunk_verify_node(spl, node));
+         if (generation != filter_generation) {
+            trunk_log_stream_if_enabled(spl,
+                                        &stream,
+                                        "replace_filter split to %lu\n",
+                                        compact_req->addr);
+            debug_assert(compact_req->height != 0);
+            debug_assert(compact_req->addr != 0);
+            trunk_node_unget(spl, &node);
+         }
+      } while (generation != filter_generation);
+
+      for (uint64 pos = 0; pos < TRUNK_MAX_PIVOTS; pos++) {
+         trunk_dec_filter(spl, &filter_req.filter[pos]);
+      }
+
+      trunk_log_node_if_enabled(&stream, spl, node);
+      trunk_log_stream_if_enabled(
+         spl, &stream, "----------------------------------------\n");
+      trunk_log_stream_if_enabled(spl, &stream, "\n");
+
+   next_node:
+      compact_req->addr = trunk_next_addr(spl, node);
+      generation        = trunk_generation(spl, node);
+      debug_assert(trunk_verify_node(spl, node));
+      trunk_node_unget(spl, &node);
+      if (compact_req->generation != generation) {
+         trunk_log_stream_if_enabled(
+            spl, &stream, "build_filter split to %lu\n", compact_req->addr);
+         debug_assert(compact_req->height != 0);
+         debug_assert(compact_req->addr != 0);
+      }
+      trunk_close_log_stream_if_enabled(spl, &stream);
+   } while (compact_req->generation != generation);
+
+out:
+   platform_free(spl->heap_id, compact_req->fp_arr);
+   if (compact_req->prefix_fp_arr != NULL) {
+      platform_free(spl->heap_id, compact_req->prefix_fp_arr);
+   }
+   platform_free(spl->heap_id, compact_req);
+   trunk_maybe_reclaim_space(spl);
+   return;
+}
+
+static cache_async_result
+trunk_filter_lookup_async(trunk_handle       *spl,
+                          routing_config     *cfg,
+                          routing_filter     *filter,
+                          key                 target,
+                          uint64             *found_values,
+                          routing_async_ctxt *ctxt)
+{
+   return routing_filter_lookup_async(
+      spl->cc, cfg, filter, target, found_values, ctxt);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Flush Functions
+ *-----------------------------------------------------------------------------
+ */
+
+/*
+ * flush_into_bundle flushes all live branches (including fractional branches)
+ * for the pivot from parent to a new bundle in child and initializes the
+ * compact_bundle_req.
+ *
+ * NOTE: parent and child must be write locked.
+ */
+trunk_bundle *
+trunk_flush_into_bundle(trunk_handle             *spl,    // IN
+                        page_handle              *parent, // IN (modified)
+                        page_handle              *child,  // IN (modified)
+                        trunk_pivot_data         *pdata,  // IN
+                        trunk_compact_bundle_req *req)    // IN/OUT
+{
+   platform_stream_handle stream;
+   platform_status        rc = trunk_open_log_stream_if_enabled(spl, &stream);
+   platform_assert_status_ok(rc);
+   trunk_log_stream_if_enabled(spl,
                                &stream,
-                               "compact_bundle addr %lu bundle %hu\n",
-                               req->addr,
-                               req->bundle_no);
+                               "flush from %lu to %lu\n",
+                               parent->disk_addr,
+                               child->disk_addr);
+   trunk_log_node_if_enabled(&stream, spl, parent);
+   trunk_log_node_if_enabled(&stream, spl, child);
+   trunk_log_stream_if_enabled(
+      spl, &stream, "----------------------------------------\n");
+
+   req->spl    = spl;
+   req->addr   = child->disk_addr;
+   req->height = trunk_height(spl, child);
+   debug_assert(req->addr != 0);
+   req->bundle_no            = trunk_get_new_bundle(spl, child);
+   req->generation           = trunk_generation(spl, child);
+   req->max_pivot_generation = trunk_pivot_generation(spl, child);
+
+   uint16 num_children = trunk_num_children(spl, child);
+   for (uint16 pivot_no = 0; pivot_no < num_children; pivot_no++) {
+      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, child, pivot_no);
+      req->pivot_generation[pivot_no] = pdata->generation;
+   }
+
+   trunk_bundle *bundle = trunk_get_bundle(spl, child, req->bundle_no);
+
+   // if there are whole branches, flush them into a subbundle
+   if (trunk_branch_is_whole(spl, parent, pdata->start_branch)) {
+      trunk_subbundle *child_sb = trunk_get_new_subbundle(spl, child, 1);
+      bundle->start_subbundle   = trunk_subbundle_no(spl, child, child_sb);
+      child_sb->state           = SB_STATE_UNCOMPACTED_INDEX;
+
+      // create a subbundle from the whole branches of the parent
+      child_sb->start_branch = trunk_end_branch(spl, child);
+      trunk_log_stream_if_enabled(
+         spl, &stream, "subbundle %hu\n", bundle->start_subbundle);
+      for (uint16 branch_no = pdata->start_branch;
+           trunk_branch_is_whole(spl, parent, branch_no);
+           branch_no = trunk_add_branch_number(spl, branch_no, 1))
+      {
+         trunk_branch *parent_branch = trunk_get_branch(spl, parent, branch_no);
+         trunk_log_stream_if_enabled(
+            spl, &stream, "%lu\n", parent_branch->root_addr);
+         trunk_branch *new_branch = trunk_get_new_branch(spl, child);
+         *new_branch              = *parent_branch;
+      }
+      child_sb->end_branch = trunk_end_branch(spl, child);
+      routing_filter *child_filter =
+         trunk_subbundle_filter(spl, child, child_sb, 0);
+      *child_filter = pdata->filter;
+      ZERO_STRUCT(pdata->filter);
+      debug_assert(trunk_subbundle_branch_count(spl, child, child_sb) != 0);
+   } else {
+      bundle->start_subbundle = trunk_end_subbundle(spl, child);
+   }
+
+   // for each subbundle in the parent, create a subbundle in the child
+   if (trunk_pivot_bundle_count(spl, parent, pdata) != 0) {
+      uint16 pivot_start_sb_no =
+         trunk_pivot_start_subbundle(spl, parent, pdata);
+      for (uint16 parent_sb_no = pivot_start_sb_no;
+           parent_sb_no != trunk_end_subbundle(spl, parent);
+           parent_sb_no = trunk_add_subbundle_number(spl, parent_sb_no, 1))
+      {
+         trunk_subbundle *parent_sb =
+            trunk_get_subbundle(spl, parent, parent_sb_no);
+         uint16 filter_count =
+            trunk_subbundle_filter_count(spl, parent, parent_sb);
+         trunk_subbundle *child_sb =
+            trunk_get_new_subbundle(spl, child, filter_count);
+         child_sb->state        = parent_sb->state;
+         child_sb->start_branch = trunk_end_branch(spl, child);
+         trunk_log_stream_if_enabled(spl,
+                                     &stream,
+                                     "subbundle %hu from subbundle %hu\n",
+                                     trunk_subbundle_no(spl, child, child_sb),
+                                     parent_sb_no);
+         for (uint16 branch_no = parent_sb->start_branch;
+              branch_no != parent_sb->end_branch;
+              branch_no = trunk_add_branch_number(spl, branch_no, 1))
+         {
+            trunk_branch *parent_branch =
+               trunk_get_branch(spl, parent, branch_no);
+            trunk_log_stream_if_enabled(
+               spl, &stream, "%lu\n", parent_branch->root_addr);
+            trunk_branch *new_branch = trunk_get_new_branch(spl, child);
+            *new_branch              = *parent_branch;
+         }
+         child_sb->end_branch = trunk_end_branch(spl, child);
+         for (uint16 i = 0; i < filter_count; i++) {
+            routing_filter *child_filter =
+               trunk_subbundle_filter(spl, child, child_sb, i);
+            routing_filter *parent_filter =
+               trunk_subbundle_filter(spl, parent, parent_sb, i);
+            *child_filter = *parent_filter;
+            trunk_inc_filter(spl, child_filter);
+         }
+         debug_assert(trunk_subbundle_branch_count(spl, child, child_sb) != 0);
+      }
+   }
+   bundle->end_subbundle = trunk_end_subbundle(spl, child);
+
+   // clear the branches in the parent's pivot
+   trunk_pivot_clear(spl, parent, pdata);
+
+   trunk_log_stream_if_enabled(
+      spl, &stream, "----------------------------------------\n");
+   trunk_log_node_if_enabled(&stream, spl, parent);
+   trunk_log_node_if_enabled(&stream, spl, child);
+   trunk_log_stream_if_enabled(spl, &stream, "flush done\n");
+   trunk_log_stream_if_enabled(spl, &stream, "\n");
+   trunk_close_log_stream_if_enabled(spl, &stream);
+
+   platform_assert(bundle->start_subbundle != bundle->end_subbundle,
+                   "Flush into empty bundle.\n");
+
+   return bundle;
+}
+
+/*
+ * room_to_flush checks that there is enough physical space in child to flush
+ * from parent.
+ *
+ * NOTE: parent and child must have at least read locks
+ */
+static inline bool
+trunk_room_to_flush(trunk_handle     *spl,
+                    page_handle      *parent,
+                    page_handle      *child,
+                    trunk_pivot_data *pdata)
+{
+   uint16 child_branches   = trunk_branch_count(spl, child);
+   uint16 flush_branches   = trunk_pivot_branch_count(spl, parent, pdata);
+   uint16 child_bundles    = trunk_bundle_count(spl, child);
+   uint16 child_subbundles = trunk_subbundle_count(spl, child);
+   uint16 flush_subbundles =
+      trunk_pivot_subbundle_count(spl, parent, pdata) + 1;
+   return child_branches + flush_branches < spl->cfg.hard_max_branches_per_node
+          && child_bundles + 2 <= TRUNK_MAX_BUNDLES
+          && child_subbundles + flush_subbundles + 1 < TRUNK_MAX_SUBBUNDLES;
+}
+
+/*
+ * flush flushes from parent to the child indicated by pdata.
+ *
+ * Failure can occur if there is not enough space in the child.
+ *
+ * NOTE: parent must be write locked
+ */
+platform_status
+trunk_flush(trunk_handle     *spl,
+            page_handle      *parent,
+            trunk_pivot_data *pdata,
+            bool              is_space_rec)
+{
+   platform_status rc;
+
+   uint64   wait_start, flush_start;
+   threadid tid;
+   if (spl->cfg.use_stats) {
+      tid        = platform_get_tid();
+      wait_start = platform_get_timestamp();
+   }
+
+   page_handle *child = trunk_node_get(spl, pdata->addr);
+   trunk_node_claim(spl, &child);
+
+   if (!trunk_room_to_flush(spl, parent, child, pdata)) {
+      platform_error_log(
+         "Flush failed: %lu %lu\n", parent->disk_addr, child->disk_addr);
+      if (spl->cfg.use_stats) {
+         if (parent->disk_addr == spl->root_addr) {
+            spl->stats[tid].root_failed_flushes++;
+         } else {
+            spl->stats[tid].failed_flushes[trunk_height(spl, parent)]++;
+         }
+      }
+      trunk_node_unclaim(spl, child);
+      trunk_node_unget(spl, &child);
+      return STATUS_INVALID_STATE;
+   }
+
+   if ((!is_space_rec && pdata->srq_idx != -1)
+       && spl->cfg.reclaim_threshold != UINT64_MAX)
+   {
+      // platform_default_log("Deleting %12lu-%lu (index %lu) from SRQ\n",
+      //       parent->disk_addr, pdata->generation, pdata->srq_idx);
+      srq_delete(&spl->srq, pdata->srq_idx);
+      srq_print(&spl->srq);
+      pdata->srq_idx = -1;
+   }
+   trunk_node_lock(spl, child);
+
+   if (spl->cfg.use_stats) {
+      if (parent->disk_addr == spl->root_addr) {
+         spl->stats[tid].root_flush_wait_time_ns +=
+            platform_timestamp_elapsed(wait_start);
+      } else {
+         spl->stats[tid].flush_wait_time_ns[trunk_height(spl, parent)] +=
+            platform_timestamp_elapsed(wait_start);
+      }
+      flush_start = platform_get_timestamp();
+   }
+
+   // flush the branch references into a new bundle in the child
+   trunk_compact_bundle_req *req = TYPED_ZALLOC(spl->heap_id, req);
+   trunk_bundle             *bundle =
+      trunk_flush_into_bundle(spl, parent, child, pdata, req);
+   trunk_tuples_in_bundle(spl,
+                          child,
+                          bundle,
+                          req->input_pivot_tuple_count,
+                          req->input_pivot_kv_byte_count);
+   trunk_pivot_add_bundle_tuple_counts(spl,
+                                       child,
+                                       bundle,
+                                       req->input_pivot_tuple_count,
+                                       req->input_pivot_kv_byte_count);
+   trunk_bundle_inc_pivot_rc(spl, child, bundle);
+   debug_assert(cache_page_valid(spl->cc, req->addr));
+   req->type = is_space_rec ? TRUNK_COMPACTION_TYPE_FLUSH
+                            : TRUNK_COMPACTION_TYPE_SPACE_REC;
+
+   // split child if necessary
+   if (trunk_needs_split(spl, child)) {
+      if (trunk_is_leaf(spl, child)) {
+         platform_free(spl->heap_id, req);
+         uint16 child_idx = trunk_pdata_to_pivot_index(spl, parent, pdata);
+         trunk_split_leaf(spl, parent, child, child_idx);
+         debug_assert(trunk_verify_node(spl, child));
+         return STATUS_OK;
+      } else {
+         uint64 child_idx = trunk_pdata_to_pivot_index(spl, parent, pdata);
+         trunk_split_index(spl, parent, child, child_idx);
+      }
+   }
+
+   debug_assert(trunk_verify_node(spl, child));
+   trunk_node_unlock(spl, child);
+   trunk_node_unclaim(spl, child);
+   trunk_node_unget(spl, &child);
+
+   trunk_default_log_if_enabled(
+      spl, "enqueuing compact_bundle %lu-%u\n", req->addr, req->bundle_no);
+   rc = trunk_enqueue_compact_req(spl, trunk_compact_bundle, req, FALSE);
+   platform_assert_status_ok(rc);
+   if (spl->cfg.use_stats) {
+      flush_start = platform_timestamp_elapsed(flush_start);
+      if (parent->disk_addr == spl->root_addr) {
+         spl->stats[tid].root_flush_time_ns += flush_start;
+         if (flush_start > spl->stats[tid].root_flush_time_max_ns) {
+            spl->stats[tid].root_flush_time_max_ns = flush_start;
+         }
+      } else {
+         const uint32 h = trunk_height(spl, parent);
+         spl->stats[tid].flush_time_ns[h] += flush_start;
+         if (flush_start > spl->stats[tid].flush_time_max_ns[h]) {
+            spl->stats[tid].flush_time_max_ns[h] = flush_start;
+         }
+      }
+   }
+   return rc;
+}
+
+/*
+ * flush_fullest first flushes any pivots with too many live logical branches.
+ * If the node is still full, it then flushes the pivot with the most tuples.
+ */
+platform_status
+trunk_flush_fullest(trunk_handle *spl, page_handle *node)
+{
+   platform_status rc               = STATUS_OK;
+   uint16          fullest_pivot_no = TRUNK_INVALID_PIVOT_NO;
+
+   threadid tid;
+   if (spl->cfg.use_stats) {
+      tid = platform_get_tid();
+   }
+   /*
+    * Note that trunk_num_children *must* be called at every loop iteration,
+    * since flushes may cause splits, which in turn will change the number of
+    * children
+    */
+   for (uint16 pivot_no = 0; pivot_no < trunk_num_children(spl, node);
+        pivot_no++) {
+      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
+      // if a pivot has too many branches, just flush it here
+      if (trunk_pivot_needs_flush(spl, node, pdata)) {
+         rc = trunk_flush(spl, node, pdata, FALSE);
+         if (!SUCCESS(rc)) {
+            return rc;
+         }
+         if (spl->cfg.use_stats) {
+            if (node->disk_addr == spl->root_addr) {
+               spl->stats[tid].root_count_flushes++;
+            } else {
+               spl->stats[tid].count_flushes[trunk_height(spl, node)]++;
+            }
+         }
+      } else if (fullest_pivot_no == TRUNK_INVALID_PIVOT_NO
+                 || (trunk_pivot_num_tuples(spl, node, pivot_no)
+                     > trunk_pivot_num_tuples(spl, node, fullest_pivot_no)))
+      {
+         fullest_pivot_no = pivot_no;
+      }
+   }
+   if (trunk_node_is_full(spl, node)) {
+      if (spl->cfg.use_stats) {
+         if (node->disk_addr == spl->root_addr) {
+            spl->stats[tid].root_full_flushes++;
+         } else {
+            spl->stats[tid].full_flushes[trunk_height(spl, node)]++;
+         }
+      }
+      platform_assert(fullest_pivot_no != TRUNK_INVALID_PIVOT_NO);
+      trunk_pivot_data *pdata =
+         trunk_get_pivot_data(spl, node, fullest_pivot_no);
+      return trunk_flush(spl, node, pdata, FALSE);
+   }
+   return rc;
+}
+
+static void
+save_pivots_to_compact_bundle_scratch(trunk_handle           *spl,     // IN
+                                      page_handle            *node,    // IN
+                                      compact_bundle_scratch *scratch) // IN/OUT
+{
+   platform_status rc;
+   uint32          num_pivot_keys = trunk_num_pivot_keys(spl, node);
+
+   debug_assert(num_pivot_keys < ARRAY_SIZE(scratch->saved_pivot_keys));
+
+   // Save all num_pivots regular pivots and the upper bound pivot
+   for (uint32 i = 0; i < num_pivot_keys; i++) {
+      key pivot = trunk_get_pivot(spl, node, i);
+      rc        = key_buffer_init_from_key(
+         &scratch->saved_pivot_keys[i], spl->heap_id, pivot);
+      platform_assert_status_ok(rc);
+   }
+   scratch->num_saved_pivot_keys = num_pivot_keys;
+}
+
+static void
+deinit_saved_pivots_in_scratch(compact_bundle_scratch *scratch)
+{
+   for (uint32 i = 0; i < scratch->num_saved_pivot_keys; i++) {
+      key_buffer_deinit(&scratch->saved_pivot_keys[i]);
+   }
+}
+
+/*
+ * Branch iterator wrapper functions
+ */
+
+void
+trunk_branch_iterator_init(trunk_handle   *spl,
+                           btree_iterator *itor,
+                           trunk_branch   *branch,
+                           key             min_key,
+                           key             max_key,
+                           bool            do_prefetch,
+                           bool            should_inc_ref)
+{
+   cache        *cc        = spl->cc;
+   btree_config *btree_cfg = &spl->cfg.btree_cfg;
+   uint64        root_addr = branch->root_addr;
+   if (root_addr != 0 && should_inc_ref) {
+      btree_inc_ref_range(cc, btree_cfg, root_addr, min_key, max_key);
+   }
+   btree_iterator_init(cc,
+                       btree_cfg,
+                       itor,
+                       root_addr,
+                       PAGE_TYPE_BRANCH,
+                       min_key,
+                       max_key,
+                       do_prefetch,
+                       0);
+}
+
+/*
+ * Reverse branch iterators are only used by range iterators, which hold
+ * their own references to the branches.
+ */
+static void
+trunk_branch_iterator_init_reverse(trunk_handle   *spl,
+                                   btree_iterator *itor,
+                                   trunk_branch   *branch,
+                                   key             min_key,
+                                   key             max_key)
+{
+   btree_iterator_init_reverse(spl->cc,
+                               &spl->cfg.btree_cfg,
+                               itor,
+                               branch->root_addr,
+                               PAGE_TYPE_BRANCH,
+                               min_key,
+                               max_key);
+}
+
+void
+trunk_branch_iterator_deinit(trunk_handle   *spl,
+                             btree_iterator *itor,
+                             bool            should_dec_ref)
+{
+   if (itor->root_addr == 0) {
+      return;
+   }
+   cache        *cc        = spl->cc;
+   btree_config *btree_cfg = &spl->cfg.btree_cfg;
+   key           min_key   = itor->min_key;
+   key           max_key   = itor->max_key;
+   btree_iterator_deinit(itor);
+   if (should_dec_ref) {
+      btree_dec_ref_range(cc, btree_cfg, itor->root_addr, min_key, max_key);
+   }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * btree skiperator
+ *
+ *       an iterator which can skip over tuples in branches which aren't live,
+ *       or which are entirely range deleted by range_tombstones
+ *-----------------------------------------------------------------------------
+ */
+static void
+trunk_btree_skiperator_init(trunk_handle              *spl,
+                            trunk_btree_skiperator    *skip_itor,
+                            page_handle               *node,
+                            uint16                     branch_idx,
+                            key_buffer pivots[static TRUNK_MAX_PIVOTS],
+                            trunk_range_tombstone_set *range_tombstones)
+{
+   ZERO_CONTENTS(skip_itor);
+   skip_itor->super.ops = &trunk_btree_skiperator_ops;
+   uint16 min_pivot_no  = 0;
+   uint16 max_pivot_no  = trunk_num_children(spl, node);
+   debug_assert(
+      (max_pivot_no < TRUNK_MAX_PIVOTS), "max_pivot_no = %d", max_pivot_no);
+
+   key min_key       = key_buffer_key(&pivots[min_pivot_no]);
+   key max_key       = key_buffer_key(&pivots[max_pivot_no]);
+   skip_itor->branch = *trunk_get_branch(spl, node, branch_idx);
+
+   uint16 first_pivot      = 0;
+   bool   iterator_started = FALSE;
+
+   for (uint16 i = min_pivot_no; i < max_pivot_no + 1; i++) {
+      bool branch_valid =
+         i == max_pivot_no
+            ? FALSE
+            : trunk_branch_live_for_pivot(spl, node, branch_idx, i);
+      if (branch_valid
+          && trunk_range_tombstone_set_deletes_range(
+             spl,
+             range_tombstones,
+             key_buffer_key(&pivots[i]),
+             key_buffer_key(&pivots[i + 1]),
+             skip_itor->branch.generation))
+      {
+         branch_valid = FALSE;
+      }
+      if (branch_valid && !iterator_started) {
+         first_pivot      = i;
+         iterator_started = TRUE;
+      }
+      if (!branch_valid && iterator_started) {
+         // create a new btree iterator
+         key pivot_min_key = first_pivot == min_pivot_no
+                                ? min_key
+                                : key_buffer_key(&pivots[first_pivot]);
+         key pivot_max_key =
+            i == max_pivot_no ? max_key : key_buffer_key(&pivots[i]);
+         btree_iterator *btree_itor = &skip_itor->itor[skip_itor->end++];
+         trunk_branch_iterator_init(spl,
+                                    btree_itor,
+                                    &skip_itor->branch,
+                                    pivot_min_key,
+                                    pivot_max_key,
+                                    TRUE,
+                                    TRUE);
+         iterator_started = FALSE;
+      }
+   }
+
+   bool at_end;
+   if (skip_itor->curr != skip_itor->end) {
+      iterator_at_end(&skip_itor->itor[skip_itor->curr].super, &at_end);
+   } else {
+      at_end = TRUE;
+   }
+
+   while (skip_itor->curr != skip_itor->end && at_end) {
+      iterator_at_end(&skip_itor->itor[skip_itor->curr].super, &at_end);
+      if (!at_end) {
+         break;
+      }
+      skip_itor->curr++;
+   }
+}
+
+void
+trunk_btree_skiperator_get_curr(iterator *itor, key *curr_key, message *data)
+{
+   debug_assert(itor != NULL);
+   trunk_btree_skiperator *skip_itor = (trunk_btree_skiperator *)itor;
+   iterator_get_curr(&skip_itor->itor[skip_itor->curr].super, curr_key, data);
+}
+
+platform_status
+trunk_btree_skiperator_advance(iterator *itor)
+{
+   debug_assert(itor != NULL);
+   trunk_btree_skiperator *skip_itor = (trunk_btree_skiperator *)itor;
+   platform_status         rc =
+      iterator_advance(&skip_itor->itor[skip_itor->curr].super);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+
+   bool at_end;
+   iterator_at_end(&skip_itor->itor[skip_itor->curr].super, &at_end);
+   while (skip_itor->curr != skip_itor->end && at_end) {
+      iterator_at_end(&skip_itor->itor[skip_itor->curr].super, &at_end);
+      if (!at_end)
+         break;
+      skip_itor->curr++;
+   }
+
+   return STATUS_OK;
+}
+
+platform_status
+trunk_btree_skiperator_at_end(iterator *itor, bool *at_end)
+{
+   trunk_btree_skiperator *skip_itor = (trunk_btree_skiperator *)itor;
+   if (skip_itor->curr == skip_itor->end) {
+      *at_end = TRUE;
+      return STATUS_OK;
+   }
+
+   iterator_at_end(&skip_itor->itor[skip_itor->curr].super, at_end);
+   return STATUS_OK;
+}
+
+void
+trunk_btree_skiperator_print(iterator *itor)
+{
+   trunk_btree_skiperator *skip_itor = (trunk_btree_skiperator *)itor;
+   platform_default_log("$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$\n");
+   platform_default_log("$$ skiperator: %p\n", skip_itor);
+   platform_default_log("$$ curr: %lu\n", skip_itor->curr);
+   iterator_print(&skip_itor->itor[skip_itor->curr].super);
+}
+
+void
+trunk_btree_skiperator_deinit(trunk_handle           *spl,
+                              trunk_btree_skiperator *skip_itor)
+{
+   for (uint64 i = 0; i < skip_itor->end; i++) {
+      trunk_branch_iterator_deinit(spl, &skip_itor->itor[i], TRUE);
+   }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Compaction Functions
+ *-----------------------------------------------------------------------------
+ */
+
+static inline void
+trunk_btree_pack_req_init(trunk_handle   *spl,
+                          iterator       *itor,
+                          btree_pack_req *req)
+{
+   btree_pack_req_init(req,
+                       spl->cc,
+                       &spl->cfg.btree_cfg,
+                       itor,
+                       spl->cfg.max_tuples_per_node,
+                       spl->cfg.filter_cfg.hash,
+                       spl->cfg.filter_cfg.seed,
+                       spl->heap_id);
+}
+
+static void
+trunk_compact_bundle_cleanup_iterators(trunk_handle           *spl,
+                                       merge_iterator        **merge_itor,
+                                       uint64                  num_branches,
+                                       trunk_btree_skiperator *skip_itor_arr)
+{
+   platform_status rc = merge_iterator_destroy(spl->heap_id, merge_itor);
+   platform_assert_status_ok(rc);
+   for (uint64 i = 0; i < num_branches; i++) {
+      trunk_btree_skiperator_deinit(spl, &skip_itor_arr[i]);
+   }
+   debug_code(memset(skip_itor_arr, 0, num_branches * sizeof(*skip_itor_arr)));
+}
+
+/*
+ * compact_bundle compacts a bundle of flushed branches into a single branch
+ *
+ * See "Interactions between Concurrent Processes"
+ * (numbering here mirrors that section)
+ *
+ * Interacts with splitting in two ways:
+ * 4. Internal node split occurs between job issue and this compact_bundle call:
+ *    the bundle was split too, issue compact_bundle on the new siblings
+ * 6. Leaf split occurs before this call or during compaction:
+ *    the bundle will be compacted as part of the split, so this compaction is
+ *    aborted if split occurred before this call or discarded if it occurred
+ *    during compaction.
+ *
+ * Node splits are determined using generation numbers (in trunk_hdr)
+ *   internal: generation number of left node is incremented on split
+ *      -- given generation number g of a node, all the nodes it split
+ *         into can be found by searching right until a node with
+ *         generation number g is found
+ *   leaf: generation numbers of all leaves affected by split are
+ *         incremented
+ *      -- can tell if a leaf has split by checking if generation number
+ *         has changed
+ *
+ * Algorithm:
+ * 1.  Acquire node read lock
+ * 2.  Flush if node is full (acquires write lock)
+ * 3.  If the node has split before this call (interaction 4), this
+ *     bundle exists in the new split siblings, so issue compact_bundles
+ *     for those nodes
+ * 4.  Abort if node is a leaf and started splitting (interaction 6)
+ * 5.  The bundle may have been completely flushed by step 2, if so abort
+ * 6.  Build iterators
+ * 7.  Release read lock
+ * 8.  Perform compaction
+ * 9.  Build filter
+ * 10. Clean up
+ * 11. Reacquire read lock
+ * 12. For each newly split sibling replace bundle with new branch unless
+ *        a. node if leaf which has split, in which case discard (interaction 6)
+ *        b. node is internal and bundle has been flushed
+ */
+void
+trunk_compact_bundle(void *arg, void *scratch_buf)
+{
+   platform_status           rc;
+   trunk_compact_bundle_req *req          = arg;
+   trunk_task_scratch       *task_scratch = scratch_buf;
+   compact_bundle_scratch   *scratch      = &task_scratch->compact_bundle;
+   trunk_handle             *spl          = req->spl;
+   threadid                  tid;
+
+   /*
+    * 1. Acquire node read lock
+    */
+   page_handle *node = trunk_node_get(spl, req->addr);
+
+   /*
+    * 2. Flush if node is full (acquires write lock)
+    */
+   uint16 height = trunk_height(spl, node);
+   if (height != 0 && trunk_node_is_full(spl, node)) {
+      trunk_node_claim(spl, &node);
+      trunk_node_lock(spl, node);
+      rc = STATUS_OK;
+      while (SUCCESS(rc) && trunk_node_is_full(spl, node)) {
+         rc = trunk_flush_fullest(spl, node);
+      }
+      trunk_node_unlock(spl, node);
+      trunk_node_unclaim(spl, node);
+   }
+
+   // timers for stats if enabled
+   uint64 compaction_start, pack_start;
+
+   if (spl->cfg.use_stats) {
+      tid              = platform_get_tid();
+      compaction_start = platform_get_timestamp();
+      spl->stats[tid].compactions[height]++;
+   }
+
+   /*
+    * 3. If the node has split before this call (interaction 4), this
+    *    bundle was copied to the new sibling[s], so issue compact_bundles for
+    *    those nodes
+    */
+   if (req->generation < trunk_generation(spl, node)) {
+      if (height != 0) {
+         debug_assert(trunk_next_addr(spl, node) != 0);
+         trunk_compact_bundle_req *next_req =
+            TYPED_MALLOC(spl->heap_id, next_req);
+         memmove(next_req, req, sizeof(trunk_compact_bundle_req));
+         next_req->addr = trunk_next_addr(spl, node);
+         debug_assert(next_req->addr != 0);
+
+         req->generation = trunk_generation(spl, node);
+
+         trunk_default_log_if_enabled(spl,
+                                      "compact_bundle split from %lu to %lu\n",
+                                      req->addr,
+                                      next_req->addr);
+         rc = trunk_enqueue_compact_req(
+            spl, trunk_compact_bundle, next_req, FALSE);
+         platform_assert_status_ok(rc);
+      } else {
+         /*
+          * 4. Abort if node is a splitting leaf (interaction 6)
+          */
+         trunk_node_unget(spl, &node);
+         trunk_default_log_if_enabled(
+            spl, "compact_bundle abort leaf split %lu\n", req->addr);
+         platform_free(spl->heap_id, req);
+         if (spl->cfg.use_stats) {
+            spl->stats[tid].compactions_aborted_leaf_split[height]++;
+            spl->stats[tid].compaction_time_wasted_ns[height] +=
+               platform_timestamp_elapsed(compaction_start);
+         }
+         return;
+      }
+   }
+
+   // store the generation of the node so we can detect splits after compaction
+   uint64 start_generation = trunk_generation(spl, node);
+
+   /*
+    * 5. The bundle may have been completely flushed by 2., if so abort
+    *       -- note this cannot happen in leaves (if the bundle isn't live, the
+    *          generation number would change and it would be caught by step 4
+    *          above).
+    */
+   if (!trunk_bundle_live(spl, node, req->bundle_no)) {
+      debug_assert(height != 0);
+      trunk_node_unget(spl, &node);
+      trunk_default_log_if_enabled(
+         spl, "compact_bundle abort flushed %lu\n", req->addr);
+      platform_free(spl->heap_id, req);
+      if (spl->cfg.use_stats) {
+         spl->stats[tid].compactions_aborted_flushed[height]++;
+         spl->stats[tid].compaction_time_wasted_ns[height] +=
+            platform_timestamp_elapsed(compaction_start);
+      }
+      return;
+   }
+
+   trunk_bundle *bundle       = trunk_get_bundle(spl, node, req->bundle_no);
+   uint16 bundle_start_branch = trunk_bundle_start_branch(spl, node, bundle);
+   uint16 bundle_end_branch   = trunk_bundle_end_branch(spl, node, bundle);
+   uint16 num_branches        = trunk_bundle_branch_count(spl, node, bundle);
+
+   /*
+    * Update and delete messages need to be kept around until/unless they have
+    * been applied all the way down to the very last branch tree.  Even once it
+    * reaches the leaf, it isn't going to be applied to the last branch tree
+    * unless the compaction includes the oldest B-tree in the leaf (the start
+    * branch).
+    */
+   merge_behavior merge_mode;
+   if (height == 0 && bundle_start_branch == trunk_start_branch(spl, node)) {
+      merge_mode = MERGE_FULL;
+   } else {
+      merge_mode = MERGE_INTERMEDIATE;
+   }
+
+   platform_stream_handle stream;
+   rc = trunk_open_log_stream_if_enabled(spl, &stream);
+   platform_assert_status_ok(rc);
+   trunk_log_stream_if_enabled(spl,
+                               &stream,
+                               "compact_bundle addr %lu bundle %hu\n",
+                               req->addr,
+                               req->bundle_no);
+
+   /*
+    * 6. Build iterators
+    */
+   platform_assert(num_branches <= ARRAY_SIZE(scratch->skip_itor));
+   trunk_btree_skiperator *skip_itor_arr = scratch->skip_itor;
+   iterator              **itor_arr      = scratch->itor_arr;
+
+   save_pivots_to_compact_bundle_scratch(spl, node, scratch);
+
+   /*
+    * Any range tombstone added after this point is newer than all the
+    * branches of the bundle, see trunk_delete_range.
+    */
+   rc = trunk_range_tombstone_snapshot(spl,
+                                       &scratch->range_tombstones,
+                                       trunk_min_key(spl, node),
+                                       trunk_max_key(spl, node));
+   platform_assert_status_ok(rc);
+
+   uint64 output_generation = 0;
+   uint16 tree_offset       = 0;
+   for (uint16 branch_no = bundle_start_branch; branch_no != bundle_end_branch;
+        branch_no        = trunk_add_branch_number(spl, branch_no, 1))
+   {
+      /*
+       * We are iterating from oldest to newest branch
+       */
+      trunk_btree_skiperator *skip_itor = &skip_itor_arr[tree_offset];
+      trunk_btree_skiperator_init(spl,
+                                  skip_itor,
+                                  node,
+                                  branch_no,
+                                  scratch->saved_pivot_keys,
+                                  &scratch->range_tombstones);
+      itor_arr[tree_offset] = trunk_range_tombstone_iterator_init(
+         spl,
+         &scratch->tombstone_itor[tree_offset],
+         &skip_itor->super,
+         &scratch->range_tombstones,
+         skip_itor->branch.generation,
+         FALSE);
+      output_generation = MAX(output_generation, skip_itor->branch.generation);
+      tree_offset++;
+   }
+   trunk_log_node_if_enabled(&stream, spl, node);
+
+   /*
+    * 7. Release read lock
+    */
+   trunk_node_unget(spl, &node);
+
+   /*
+    * 8. Perform compaction
+    */
+   merge_iterator *merge_itor;
+   rc = merge_iterator_create(spl->heap_id,
+                              spl->cfg.data_cfg,
+                              num_branches,
+                              itor_arr,
+                              merge_mode,
+                              &merge_itor);
+   platform_assert_status_ok(rc);
+   btree_pack_req pack_req;
+   trunk_btree_pack_req_init(spl, &merge_itor->super, &pack_req);
+   req->fp_arr = pack_req.fingerprint_arr;
+   if (spl->cfg.use_stats) {
+      pack_start = platform_get_timestamp();
+   }
+
+   platform_status pack_status = btree_pack(&pack_req);
+   if (!SUCCESS(pack_status)) {
+      platform_default_log("btree_pack failed: %s\n",
+                           platform_status_to_string(pack_status));
+      trunk_compact_bundle_cleanup_iterators(
+         spl, &merge_itor, num_branches, skip_itor_arr);
+      trunk_range_tombstone_set_deinit(spl, &scratch->range_tombstones);
+      btree_pack_req_deinit(&pack_req, spl->heap_id);
+      platform_free(spl->heap_id, req);
+      goto out;
+   }
+
+   if (spl->cfg.use_stats) {
+      spl->stats[tid].compaction_pack_time_ns[height] +=
+         platform_timestamp_elapsed(pack_start);
+   }
+
+   trunk_branch new_branch;
+   new_branch.root_addr     = pack_req.root_addr;
+   new_branch.generation    = output_generation;
+   uint64 num_tuples        = pack_req.num_tuples;
+   req->fp_arr                     = pack_req.fingerprint_arr;
+   req->prefix_fp_arr              = pack_req.prefix_fingerprint_arr;
+   pack_req.fingerprint_arr        = NULL;
+   pack_req.prefix_fingerprint_arr = NULL;
+   btree_pack_req_deinit(&pack_req, spl->heap_id);
+
+   trunk_log_stream_if_enabled(
+      spl, &stream, "output: %lu\n", new_branch.root_addr);
+
+   if (spl->cfg.use_stats) {
+      if (num_tuples == 0) {
+         spl->stats[tid].compactions_empty[height]++;
+      }
+      spl->stats[tid].compaction_tuples[height] += num_tuples;
+      if (num_tuples > spl->stats[tid].compaction_max_tuples[height]) {
+         spl->stats[tid].compaction_max_tuples[height] = num_tuples;
+      }
+   }
+
+   /*
+    * 10. Clean up
+    */
+   trunk_compact_bundle_cleanup_iterators(
+      spl, &merge_itor, num_branches, skip_itor_arr);
+   bool applied_tombstones = scratch->range_tombstones.num_tombstones != 0;
+   trunk_range_tombstone_set_deinit(spl, &scratch->range_tombstones);
+
+   deinit_saved_pivots_in_scratch(scratch);
+
+   /*
+    * 11. Reacquire read lock
+    */
+   node = trunk_node_get(spl, req->addr);
+   platform_assert(node != NULL);
+
+   /*
+    * 12. For each newly split sibling replace bundle with new branch
+    */
+   uint64 addr             = req->addr;
+   uint64 num_replacements = 0;
+   uint64 generation;
+   do {
+      platform_assert(node != NULL);
+      trunk_node_claim(spl, &node);
+      trunk_node_lock(spl, node);
+
+      trunk_log_node_if_enabled(&stream, spl, node);
+
+      /*
+       * 12a. ...unless node is a leaf which has split, in which case discard
+       *      (interaction 6)
+       *
+       *      For leaves, the split will cover the compaction and we do not
+       *      need to look for the bundle in the split siblings, so simply
+       *      exit.
+       */
+      if (height == 0 && req->generation < trunk_generation(spl, node)) {
+         trunk_log_stream_if_enabled(
+            spl, &stream, "compact_bundle discard split %lu\n", req->addr);
+         if (spl->cfg.use_stats) {
+            spl->stats[tid].compactions_discarded_leaf_split[height]++;
+            spl->stats[tid].compaction_time_wasted_ns[height] +=
+               platform_timestamp_elapsed(compaction_start);
+         }
+         trunk_node_unlock(spl, node);
+         trunk_node_unclaim(spl, node);
+         trunk_node_unget(spl, &node);
+
+         if (num_tuples != 0) {
+            trunk_dec_ref(spl, &new_branch, FALSE);
+         }
+         platform_free(spl->heap_id, req->fp_arr);
+         if (req->prefix_fp_arr != NULL) {
+            platform_free(spl->heap_id, req->prefix_fp_arr);
+         }
+         platform_free(spl->heap_id, req);
+         goto out;
+      }
+
+      if (trunk_bundle_live(spl, node, req->bundle_no)) {
+         if (num_tuples != 0) {
+            trunk_replace_bundle_branches(spl, node, &new_branch, req);
+            num_replacements++;
+            trunk_log_stream_if_enabled(spl,
+                                        &stream,
+                                        "inserted %lu into %lu\n",
+                                        new_branch.root_addr,
+                                        addr);
+         } else {
+            trunk_replace_bundle_branches(spl, node, NULL, req);
+            trunk_log_stream_if_enabled(
+               spl, &stream, "compact_bundle empty %lu\n", addr);
+         }
+      } else {
+         /*
+          * 12b. ...unless node is internal and bundle has been flushed
+          */
+         platform_assert(height != 0);
+         trunk_log_stream_if_enabled(
+            spl, &stream, "compact_bundle discarded flushed %lu\n", addr);
+      }
+
+      addr       = trunk_next_addr(spl, node);
+      generation = trunk_generation(spl, node);
+      trunk_log_node_if_enabled(&stream, spl, node);
+      debug_assert(trunk_verify_node(spl, node));
+
+      if (num_replacements != 0 && num_tuples != 0
+          && start_generation == generation) {
+         key max_key = trunk_max_key(spl, node);
+         trunk_zap_branch_range(
+            spl, &new_branch, max_key, max_key, PAGE_TYPE_BRANCH);
+      }
+
+      trunk_node_unlock(spl, node);
+      trunk_node_unclaim(spl, node);
+      trunk_node_unget(spl, &node);
+      if (start_generation != generation) {
+         debug_assert(height != 0);
+         debug_assert(addr != 0);
+         node = trunk_node_get(spl, addr);
+      }
+   } while (start_generation != generation);
+
+   if (spl->cfg.use_stats) {
+      if (req->type == TRUNK_COMPACTION_TYPE_SPACE_REC) {
+         spl->stats[tid].space_rec_tuples_reclaimed[height] +=
+            req->tuples_reclaimed;
+      }
+      if (req->type == TRUNK_COMPACTION_TYPE_SINGLE_LEAF_SPLIT) {
+         spl->stats[tid].single_leaf_tuples += num_tuples;
+         if (num_tuples > spl->stats[tid].single_leaf_max_tuples) {
+            spl->stats[tid].single_leaf_max_tuples = num_tuples;
+         }
+      }
+   }
+   if (num_replacements == 0) {
+      if (num_tuples != 0) {
+         trunk_dec_ref(spl, &new_branch, FALSE);
+      }
+      if (spl->cfg.use_stats) {
+         spl->stats[tid].compactions_discarded_flushed[height]++;
+         spl->stats[tid].compaction_time_wasted_ns[height] +=
+            platform_timestamp_elapsed(compaction_start);
+      }
+      platform_free(spl->heap_id, req->fp_arr);
+      if (req->prefix_fp_arr != NULL) {
+         platform_free(spl->heap_id, req->prefix_fp_arr);
+      }
+      platform_free(spl->heap_id, req);
+   } else {
+      if (spl->cfg.use_stats) {
+         compaction_start = platform_timestamp_elapsed(compaction_start);
+         spl->stats[tid].compaction_time_ns[height] += compaction_start;
+         if (compaction_start > spl->stats[tid].compaction_time_max_ns[height])
+         {
+            spl->stats[tid].compaction_time_max_ns[height] = compaction_start;
+         }
+      }
+      if (applied_tombstones) {
+         // the tombstones may have nothing left to delete
+         spl->range_tombstones_dirty = TRUE;
+      }
+      trunk_log_stream_if_enabled(spl,
+                                  &stream,
+                                  "enqueuing build filter %lu-%u\n",
+                                  req->addr,
+                                  req->bundle_no);
+      trunk_enqueue_compact_req(spl, trunk_bundle_build_filters, req, TRUE);
+   }
+out:
+   trunk_log_stream_if_enabled(spl, &stream, "\n");
+   trunk_close_log_stream_if_enabled(spl, &stream);
+}
+
+
+bool
+trunk_flush_node(trunk_handle *spl, uint64 addr, void *arg)
+{
+   page_handle *node = trunk_node_get(spl, addr);
+   trunk_node_claim(spl, &node);
+   trunk_node_lock(spl, node);
+
+   if (trunk_height(spl, node) != 0) {
+      for (uint16 pivot_no = 0; pivot_no < trunk_num_children(spl, node);
+           pivot_no++) {
+         trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
+         if (trunk_pivot_branch_count(spl, node, pdata) != 0) {
+            platform_status rc = trunk_flush(spl, node, pdata, FALSE);
+            platform_assert_status_ok(rc);
+         }
+      }
+   }
+
+   trunk_node_unlock(spl, node);
+   trunk_node_unclaim(spl, node);
+   trunk_node_unget(spl, &node);
+
+   task_perform_all(spl->ts);
+
+   node = trunk_node_get(spl, addr);
+   trunk_node_claim(spl, &node);
+   trunk_node_lock(spl, node);
+
+   if (trunk_height(spl, node) == 1) {
+      for (uint16 pivot_no = 0; pivot_no < trunk_num_children(spl, node);
+           pivot_no++) {
+         trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
+         page_handle      *leaf  = trunk_node_get(spl, pdata->addr);
+         trunk_node_claim(spl, &leaf);
+         trunk_node_lock(spl, leaf);
+         trunk_split_leaf(spl, node, leaf, pivot_no);
+      }
+   }
+
+   trunk_node_unlock(spl, node);
+   trunk_node_unclaim(spl, node);
+   trunk_node_unget(spl, &node);
+
+   task_perform_all(spl->ts);
+
+   return TRUE;
+}
+
+
+void
+trunk_force_flush(trunk_handle *spl)
+{
+   page_handle    *lock_page;
+   uint64          generation;
+   platform_status rc = memtable_maybe_rotate_and_get_insert_lock(
+      spl->mt_ctxt, 0, &generation, &lock_page);
+   platform_assert_status_ok(rc);
+   task_perform_all(spl->ts);
+   memtable_unget_insert_lock(spl->mt_ctxt, lock_page);
+   task_perform_all(spl->ts);
+   trunk_for_each_node(spl, trunk_flush_node, NULL);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ * Splitting functions
+ *-----------------------------------------------------------------------------
+ */
+
+static inline bool
+trunk_needs_split(trunk_handle *spl, page_handle *node)
+{
+   if (trunk_is_leaf(spl, node)) {
+      uint64 num_tuples = trunk_pivot_num_tuples(spl, node, 0);
+      uint64 kv_bytes   = trunk_pivot_kv_bytes(spl, node, 0);
+      return num_tuples > spl->cfg.max_tuples_per_node
+             || kv_bytes > spl->cfg.max_kv_bytes_per_node
+             || trunk_logical_branch_count(spl, node)
+                   > spl->cfg.max_branches_per_node;
+   }
+   return trunk_num_children(spl, node) > spl->cfg.fanout;
+}
+
+int
+trunk_split_index(trunk_handle *spl,
+                  page_handle  *parent,
+                  page_handle  *child,
+                  uint64        pivot_no)
+{
+   platform_stream_handle stream;
+   platform_status        rc = trunk_open_log_stream_if_enabled(spl, &stream);
+   platform_assert_status_ok(rc);
+   trunk_log_stream_if_enabled(spl,
+                               &stream,
+                               "split index %lu with parent %lu\n",
+                               child->disk_addr,
+                               parent->disk_addr);
+   trunk_log_node_if_enabled(&stream, spl, parent);
+   trunk_log_node_if_enabled(&stream, spl, child);
+   page_handle *left_node           = child;
+   uint16       target_num_children = trunk_num_children(spl, left_node) / 2;
+   uint16       height              = trunk_height(spl, left_node);
+
+   if (spl->cfg.use_stats)
+      spl->stats[platform_get_tid()].index_splits++;
+
+   // allocate right node and write lock it
+   page_handle *right_node = trunk_alloc(spl, height);
+   uint64       right_addr = right_node->disk_addr;
+
+   // ALEX: Maybe worth figuring out the real page size
+   memmove(right_node->data, left_node->data, trunk_page_size(&spl->cfg));
+   trunk_pivot_data *right_start_pivot =
+      trunk_get_pivot_data(spl, right_node, 0);
+   trunk_pivot_data *left_split_pivot =
+      trunk_get_pivot_data(spl, left_node, target_num_children);
+   uint16 pivots_to_copy =
+      trunk_num_pivot_keys(spl, left_node) - target_num_children;
+   size_t bytes_to_copy = pivots_to_copy * trunk_pivot_size(spl);
+   memmove(right_start_pivot, left_split_pivot, bytes_to_copy);
+
+   uint16 start_filter = trunk_start_sb_filter(spl, left_node);
+   uint16 end_filter   = trunk_end_sb_filter(spl, left_node);
+   for (uint16 filter_no = start_filter; filter_no != end_filter;
+        filter_no        = trunk_add_subbundle_filter_number(spl, filter_no, 1))
+   {
+      routing_filter *filter = trunk_get_sb_filter(spl, left_node, filter_no);
+      trunk_inc_filter(spl, filter);
+   }
+
+   // set the headers appropriately
+   trunk_hdr *left_hdr  = (trunk_hdr *)left_node->data;
+   trunk_hdr *right_hdr = (trunk_hdr *)right_node->data;
+
+   right_hdr->num_pivot_keys = left_hdr->num_pivot_keys - target_num_children;
+   left_hdr->num_pivot_keys  = target_num_children + 1;
+
+   right_hdr->next_addr = left_hdr->next_addr;
+   left_hdr->next_addr  = right_addr;
+
+   left_hdr->generation++;
+   trunk_reset_start_branch(spl, right_node);
+   trunk_reset_start_branch(spl, left_node);
+
+   // fix the entries in the reclamation queue
+   uint16 right_num_children = trunk_num_children(spl, right_node);
+   for (uint16 pivot_no = 0; pivot_no < right_num_children; pivot_no++) {
+      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, right_node, pivot_no);
+      if (pdata->srq_idx != -1 && spl->cfg.reclaim_threshold != UINT64_MAX) {
+         // platform_default_log("Deleting %12lu-%lu (index %lu) from SRQ\n",
+         //       left_node->disk_addr, pdata->generation, pdata->srq_idx);
+         srq_data data_to_reinsert = srq_delete(&spl->srq, pdata->srq_idx);
+         data_to_reinsert.addr     = right_addr;
+         // platform_default_log("Reinserting %12lu-%lu into SRQ\n",
+         //       right_addr, pdata->generation);
+         pdata->srq_idx = srq_insert(&spl->srq, data_to_reinsert);
+      }
+   }
+
+   // add right child to parent
+   rc = trunk_add_pivot(spl, parent, right_node, pivot_no + 1);
+   platform_assert(SUCCESS(rc));
+   trunk_pivot_recount_num_tuples_and_kv_bytes(spl, parent, pivot_no);
+   trunk_pivot_recount_num_tuples_and_kv_bytes(spl, parent, pivot_no + 1);
+
+   trunk_log_stream_if_enabled(
+      spl, &stream, "----------------------------------------\n");
+   trunk_log_node_if_enabled(&stream, spl, parent);
+   trunk_log_node_if_enabled(&stream, spl, left_node);
+   trunk_log_node_if_enabled(&stream, spl, right_node);
+   trunk_close_log_stream_if_enabled(spl, &stream);
+
+   trunk_node_unlock(spl, right_node);
+   trunk_node_unclaim(spl, right_node);
+   trunk_node_unget(spl, &right_node);
+
+   return 0;
+}
+
+/*
+ * Estimate the number of unique keys in the pivot
+ */
+static inline uint64
+trunk_pivot_estimate_unique_keys(trunk_handle     *spl,
+                                 page_handle      *node,
+                                 trunk_pivot_data *pdata)
+{
+   routing_filter filter[MAX_FILTERS];
+   uint64         filter_no = 0;
+   filter[filter_no++]      = pdata->filter;
+
+   uint64 num_sb_fp     = 0;
+   uint64 num_sb_unique = 0;
+   for (uint16 sb_filter_no = trunk_start_sb_filter(spl, node);
+        sb_filter_no != trunk_end_sb_filter(spl, node);
+        sb_filter_no = trunk_add_subbundle_filter_number(spl, sb_filter_no, 1))
+   {
+      routing_filter *sb_filter = trunk_get_sb_filter(spl, node, sb_filter_no);
+      num_sb_fp += sb_filter->num_fingerprints;
+      num_sb_unique += sb_filter->num_unique;
+      filter[filter_no++] = *sb_filter;
+   }
+
+   uint32 num_unique = routing_filter_estimate_unique_fp(
+      spl->cc, &spl->cfg.filter_cfg, spl->heap_id, filter, filter_no);
+
+   num_unique = routing_filter_estimate_unique_keys_from_count(
+      &spl->cfg.filter_cfg, num_unique);
+
+   uint64 num_leaf_sb_fp = 0;
+   for (uint16 bundle_no = pdata->start_bundle;
+        bundle_no != trunk_end_bundle(spl, node);
+        bundle_no = trunk_add_bundle_number(spl, bundle_no, 1))
+   {
+      trunk_bundle *bundle = trunk_get_bundle(spl, node, bundle_no);
+      num_leaf_sb_fp += bundle->num_tuples;
+   }
+   uint64 est_num_leaf_sb_unique = num_sb_unique * num_leaf_sb_fp / num_sb_fp;
+   uint64 est_num_non_leaf_sb_unique = num_sb_fp - est_num_leaf_sb_unique;
+
+   // platform_error_log("num_unique %u sb_fp %lu sb_unique %lu num_leaf_sb_fp
+   // %lu\n",
+   //       num_unique, num_sb_fp, num_sb_unique, num_leaf_sb_fp);
+   // platform_error_log("est_leaf_sb_fp %lu est_non_leaf_sb_unique %lu\n",
+   //       est_num_leaf_sb_unique, est_num_non_leaf_sb_unique);
+   uint64 est_leaf_unique = num_unique - est_num_non_leaf_sb_unique;
+   return est_leaf_unique;
+}
+
+/*
+ *----------------------------------------------------------------------
+ * trunk_single_leaf_threshold --
+ *
+ *      Returns an upper bound for the number of estimated tuples for which a
+ *      leaf split can output a single leaf.
+ *----------------------------------------------------------------------
+ */
+static inline uint64
+trunk_single_leaf_threshold(trunk_handle *spl)
+{
+   return TRUNK_SINGLE_LEAF_THRESHOLD_PCT * spl->cfg.max_tuples_per_node / 100;
+}
+
+/*
+ *----------------------------------------------------------------------
+ * split_leaf splits a trunk leaf logically. It determines pivots to split
+ * on, uses them to split the leaf and adds them to its parent. It then
+ * issues compact_bundle jobs on each leaf to perform the actual compaction.
+ *
+ * Must be called with a lock on both the parent and child
+ * Returns with lock on parent and releases child and all new leaves
+ * The algorithm tries to downgrade to a claim as much as possible throughout
+ *
+ * The main loop starts with the current leaf (initially the original leaf),
+ * then uses the rough iterator to find the next pivot. It copies the current
+ * leaf to a new leaf, and sets the end key of the current leaf and start key
+ * of the new leaf to the pivot. It then issues a compact_bundle job on the
+ * current leaf and releases it. Finally, the loop continues with the new
+ * leaf as current.
+ *
+ * Algorithm:
+ * 1. Create a rough merge iterator on all the branches
+ * 2. Use rough merge iterator to determine pivots for new leaves
+ * 3. Clear old bundles from leaf and put all branches in a new bundle
+ * 4. Create new leaf, adjust min/max keys and other metadata
+ * 5. Add new leaf to parent
+ * 6. Issue compact_bundle for last_leaf and release
+ * 7. Repeat 4-6 on new leaf
+ * 8. Clean up
+ *----------------------------------------------------------------------
+ */
+void
+trunk_split_leaf(trunk_handle *spl,
+                 page_handle  *parent,
+                 page_handle  *leaf,
+                 uint16        child_idx)
+{
+   const threadid      tid = platform_get_tid();
+   trunk_task_scratch *task_scratch =
+      task_system_get_thread_scratch(spl->ts, tid);
+   split_leaf_scratch *scratch      = &task_scratch->split_leaf;
+   uint64              num_branches = trunk_branch_count(spl, leaf);
+   uint64              start_branch = trunk_start_branch(spl, leaf);
+
+   trunk_node_unlock(spl, parent);
+   trunk_node_unlock(spl, leaf);
+
+   platform_stream_handle stream;
+   platform_status        rc = trunk_open_log_stream_if_enabled(spl, &stream);
+   platform_assert_status_ok(rc);
+   trunk_log_stream_if_enabled(
+      spl, &stream, "split_leaf addr %lu\n", leaf->disk_addr);
+
+   uint64 split_start;
+   if (spl->cfg.use_stats) {
+      spl->stats[tid].leaf_splits++;
+      split_start = platform_get_timestamp();
+   }
+
+   trunk_pivot_data *pdata = trunk_get_pivot_data(spl, leaf, 0);
+   uint64            estimated_unique_keys =
+      trunk_pivot_estimate_unique_keys(spl, leaf, pdata);
+   uint64 num_tuples = trunk_pivot_num_tuples(spl, leaf, 0);
+   if (estimated_unique_keys > num_tuples * 19 / 20) {
+      estimated_unique_keys = num_tuples;
+   }
+   trunk_compaction_type comp_type = TRUNK_COMPACTION_TYPE_LEAF_SPLIT;
+   uint64                kv_bytes  = trunk_pivot_kv_bytes(spl, leaf, 0);
+   uint64                estimated_unique_kv_bytes =
+      estimated_unique_keys * kv_bytes / num_tuples;
+   uint64 target_num_leaves =
+      estimated_unique_kv_bytes / spl->cfg.target_leaf_kv_bytes;
+   if (target_num_leaves <= 1) {
+      if (estimated_unique_keys > trunk_single_leaf_threshold(spl)) {
+         target_num_leaves = 2;
+      } else {
+         target_num_leaves = 1;
+         comp_type         = TRUNK_COMPACTION_TYPE_SINGLE_LEAF_SPLIT;
+         if (spl->cfg.use_stats) {
+            spl->stats[tid].single_leaf_splits++;
+         }
+      }
+   }
+   uint64 target_leaf_kv_bytes = kv_bytes / target_num_leaves;
+   uint16 num_leaves;
+
+   // copy pivot (in parent) of leaf
+   key_buffer_init_from_key(
+      &scratch->pivot[0], spl->heap_id, trunk_min_key(spl, leaf));
+
+   uint64 leaf0_num_tuples = estimated_unique_keys;
+   uint64 leaf0_kv_bytes   = estimated_unique_kv_bytes;
+
+   if (target_num_leaves != 1) {
+      /*
+       * 1. Create a rough merge iterator on all the branches
+       *
+       *    A rough merge iterator is a merge iterator on height 1
+       * btree iterators. It uses height 1 pivots as a proxy for
+       * a count of tuples.
+       *
+       *    This count is an estimate with multiple sources of error:
+       *       -- Last leaves in each btree are not counted
+       *          (there is no upper bound pivot)
+       *       -- A selected pivot from a branch may be between pivots for other
+       *          branches
+       *       -- min_key may be between pivots
+       *       -- updates and deletes may be resolved resulting in fewer output
+       *          tuples
+       */
+      platform_assert(num_branches <= ARRAY_SIZE(scratch->btree_itor));
+      btree_iterator *rough_btree_itor = scratch->btree_itor;
+      iterator      **rough_itor       = scratch->rough_itor;
+
+      key             pivot0 = trunk_get_pivot(spl, leaf, 0);
+      key             pivot1 = trunk_get_pivot(spl, leaf, 1);
+      platform_status rc1, rc2;
+      KEY_CREATE_LOCAL_COPY(rc1, min_key, spl->heap_id, pivot0);
+      KEY_CREATE_LOCAL_COPY(rc2, max_key, spl->heap_id, pivot1);
+      platform_assert_status_ok(rc1);
+      platform_assert_status_ok(rc2);
+
+      for (uint64 branch_offset = 0; branch_offset < num_branches;
+           branch_offset++) {
+         uint64 branch_no =
+            trunk_add_branch_number(spl, start_branch, branch_offset);
+         debug_assert(branch_no != trunk_end_branch(spl, leaf));
+         trunk_branch *branch = trunk_get_branch(spl, leaf, branch_no);
+         btree_iterator_init(spl->cc,
+                             &spl->cfg.btree_cfg,
+                             &rough_btree_itor[branch_offset],
+                             branch->root_addr,
+                             PAGE_TYPE_BRANCH,
+                             min_key,
+                             max_key,
+                             TRUE,
+                             1);
+         rough_itor[branch_offset] = &rough_btree_itor[branch_offset].super;
+      }
+
+      merge_iterator *rough_merge_itor;
+      platform_status rc = merge_iterator_create(spl->heap_id,
+                                                 spl->cfg.data_cfg,
+                                                 num_branches,
+                                                 rough_itor,
+                                                 MERGE_RAW,
+                                                 &rough_merge_itor);
+      platform_assert_status_ok(rc);
+
+      /*
+       * 2. Use rough merge iterator to determine pivots for new leaves
+       */
+      bool at_end;
+      rc = iterator_at_end(&rough_merge_itor->super, &at_end);
+      platform_assert_status_ok(rc);
+
+      uint64 rough_count_kv_bytes;
+      uint64 rough_count_num_tuples;
+      for (num_leaves = 0; !at_end; num_leaves++) {
+         rough_count_num_tuples = 0;
+         rough_count_kv_bytes   = 0;
+         while (!at_end
+                && (rough_count_kv_bytes < target_leaf_kv_bytes
+                    || num_leaves == target_num_leaves - 1))
+         {
+            key     curr_key;
+            message pivot_data_message;
+            iterator_get_curr(
+               &rough_merge_itor->super, &curr_key, &pivot_data_message);
+
+            const btree_pivot_data *pivot_data =
+               message_data(pivot_data_message);
+            rough_count_num_tuples += pivot_data->stats.num_kvs;
+            rough_count_kv_bytes +=
+               pivot_data->stats.key_bytes + pivot_data->stats.message_bytes;
+            iterator_advance(&rough_merge_itor->super);
+            iterator_at_end(&rough_merge_itor->super, &at_end);
+         }
+
+         if (num_leaves == 0) {
+            leaf0_num_tuples = rough_count_num_tuples;
+            leaf0_kv_bytes   = rough_count_kv_bytes;
+         }
+
+         if (!at_end) {
+            key     curr_key;
+            message dummy_data;
+            iterator_get_curr(&rough_merge_itor->super, &curr_key, &dummy_data);
+            debug_assert(key_length(curr_key) <= trunk_max_key_size(spl));
+            // copy new pivot (in parent) of new leaf
+            key_buffer_init_from_key(
+               &scratch->pivot[num_leaves + 1], spl->heap_id, curr_key);
+         }
+      }
+
+      // clean up the iterators
+      rc = merge_iterator_destroy(spl->heap_id, &rough_merge_itor);
+      platform_assert_status_ok(rc);
+      for (uint64 i = 0; i < num_branches; i++) {
+         btree_iterator_deinit(&rough_btree_itor[i]);
+      }
+   } else {
+      num_leaves = 1;
+   }
+
+   // copy max key of last new leaf (max key of leaf)
+   key_buffer_init_from_key(
+      &scratch->pivot[num_leaves], spl->heap_id, trunk_max_key(spl, leaf));
+
+   platform_assert(num_leaves + trunk_num_pivot_keys(spl, parent)
+                   <= spl->cfg.max_pivot_keys);
+
+   /*
+    * 3. Clear old bundles from leaf and put all branches in a new bundle
+    */
+   trunk_node_lock(spl, parent);
+   trunk_log_node_if_enabled(&stream, spl, parent);
+   trunk_node_lock(spl, leaf);
+   trunk_log_node_if_enabled(&stream, spl, leaf);
+
+   uint16 bundle_no = trunk_leaf_rebundle_all_branches(
+      spl, leaf, leaf0_num_tuples, leaf0_kv_bytes, FALSE);
+   trunk_inc_generation(spl, leaf);
+   uint64 last_next_addr = trunk_next_addr(spl, leaf);
+
+   for (uint16 leaf_no = 0; leaf_no < num_leaves; leaf_no++) {
+      /*
+       * 4. Create new leaf, adjust min/max keys and other metadata
+       *
+       *    Have lock on leaf (original leaf or last iteration) and parent
+       *    This loop :
+       *    1. allocates new_leaf
+       *    2. copies leaf to new_leaf
+       *    3. sets min_key and max_key on new_leaf
+       *    4. sets next_addr on leaf
+       *    5. incs all branches ref counts
+       *    6. sets new_leaf tuple_count
+       *    7. adds new_leaf to parent
+       */
+
+      page_handle *new_leaf;
+      if (leaf_no != 0) {
+         // allocate a new leaf
+         new_leaf = trunk_alloc(spl, 0);
+
+         // copy leaf to new leaf
+         memmove(new_leaf->data, leaf->data, trunk_page_size(&spl->cfg));
+      } else {
+         // just going to edit the min/max keys, etc. of original leaf
+         new_leaf = leaf;
+      }
+
+      /* Adjust max key first so that we always have ordered pivots (enforced by
+       * trunk_set_pivot in debug mode) */
+      // adjust max key
+      trunk_set_pivot(
+         spl, new_leaf, 1, key_buffer_key(&scratch->pivot[leaf_no + 1]));
+      // adjust min key
+      trunk_set_pivot(
+         spl, new_leaf, 0, key_buffer_key(&scratch->pivot[leaf_no]));
+
+      // set new_leaf tuple_count
+      trunk_bundle *bundle = trunk_get_bundle(spl, new_leaf, bundle_no);
+      uint64        new_leaf_num_tuples[TRUNK_MAX_PIVOTS];
+      uint64        new_leaf_kv_bytes[TRUNK_MAX_PIVOTS];
+      trunk_tuples_in_bundle(
+         spl, new_leaf, bundle, new_leaf_num_tuples, new_leaf_kv_bytes);
+      trunk_pivot_clear_counts(spl, new_leaf, 0);
+      trunk_pivot_set_bundle_counts(
+         spl, new_leaf, 0, new_leaf_num_tuples[0], new_leaf_kv_bytes[0]);
+
+      if (leaf_no != 0) {
+         // set next_addr of leaf
+         trunk_set_next_addr(spl, leaf, new_leaf->disk_addr);
+
+         // inc the refs of all the branches
+         for (uint16 branch_no = trunk_start_branch(spl, new_leaf);
+              branch_no != trunk_end_branch(spl, new_leaf);
+              branch_no = trunk_add_branch_number(spl, branch_no, 1))
+         {
+            trunk_branch *branch  = trunk_get_branch(spl, new_leaf, branch_no);
+            key           min_key = trunk_min_key(spl, new_leaf);
+            trunk_inc_intersection(spl, branch, min_key, FALSE);
+         }
+
+         // inc the refs of all the filters
+         trunk_bundle *bundle = trunk_get_bundle(spl, new_leaf, bundle_no);
+         uint16 start_filter = trunk_bundle_start_filter(spl, new_leaf, bundle);
+         uint16 end_filter   = trunk_bundle_end_filter(spl, new_leaf, bundle);
+         for (uint16 filter_no = start_filter; filter_no != end_filter;
+              filter_no = trunk_add_subbundle_filter_number(spl, filter_no, 1))
+         {
+            routing_filter *filter =
+               trunk_get_sb_filter(spl, new_leaf, filter_no);
+            trunk_inc_filter(spl, filter);
+         }
+
+         /*
+          * 5. Add new leaf to parent
+          */
+         platform_status rc =
+            trunk_add_pivot(spl, parent, new_leaf, child_idx + leaf_no);
+         platform_assert(SUCCESS(rc));
+
+         /*
+          * 6. Issue compact_bundle for leaf and release
+          */
+         trunk_compact_bundle_req *req = TYPED_ZALLOC(spl->heap_id, req);
+         req->spl                      = spl;
+         req->addr                     = leaf->disk_addr;
+         req->type                     = comp_type;
+         req->bundle_no                = bundle_no;
+         req->generation               = trunk_generation(spl, leaf);
+         req->max_pivot_generation     = trunk_pivot_generation(spl, leaf);
+         req->pivot_generation[0]      = trunk_pivot_generation(spl, leaf) - 1;
+         req->input_pivot_tuple_count[0] = trunk_pivot_num_tuples(spl, leaf, 0);
+         req->input_pivot_kv_byte_count[0] = trunk_pivot_kv_bytes(spl, leaf, 0);
+
+         trunk_default_log_if_enabled(spl,
+                                      "enqueuing compact_bundle %lu-%u\n",
+                                      req->addr,
+                                      req->bundle_no);
+         rc = trunk_enqueue_compact_req(spl, trunk_compact_bundle, req, FALSE);
+         platform_assert(SUCCESS(rc));
+
+         trunk_log_node_if_enabled(&stream, spl, leaf);
+
+         debug_assert(trunk_verify_node(spl, leaf));
+         trunk_node_unlock(spl, leaf);
+         trunk_node_unclaim(spl, leaf);
+         trunk_node_unget(spl, &leaf);
+      }
+
+      leaf = new_leaf;
+   }
+
+   for (uint16 leaf_no = 0; leaf_no <= num_leaves; leaf_no++) {
+      key_buffer_deinit(&scratch->pivot[leaf_no]);
+   }
+
+   // set next_addr of leaf (from last iteration)
+   trunk_set_next_addr(spl, leaf, last_next_addr);
+   trunk_compact_bundle_req *req = TYPED_ZALLOC(spl->heap_id, req);
+   req->spl                      = spl;
+   req->addr                     = leaf->disk_addr;
+   // req->height already 0
+   req->bundle_no                    = bundle_no;
+   req->generation                   = trunk_generation(spl, leaf);
+   req->max_pivot_generation         = trunk_pivot_generation(spl, leaf);
+   req->pivot_generation[0]          = trunk_pivot_generation(spl, leaf) - 1;
+   req->input_pivot_tuple_count[0]   = trunk_pivot_num_tuples(spl, leaf, 0);
+   req->input_pivot_kv_byte_count[0] = trunk_pivot_kv_bytes(spl, leaf, 0);
+   req->type                         = comp_type;
+
+   // issue compact_bundle for leaf and release
+   trunk_default_log_if_enabled(
+      spl, "enqueuing compact_bundle %lu-%u\n", req->addr, req->bundle_no);
+   rc = trunk_enqueue_compact_req(spl, trunk_compact_bundle, req, FALSE);
+   platform_assert(SUCCESS(rc));
+
+   trunk_log_node_if_enabled(&stream, spl, parent);
+   trunk_log_node_if_enabled(&stream, spl, leaf);
+
+   debug_assert(trunk_verify_node(spl, leaf));
+   trunk_node_unlock(spl, leaf);
+   trunk_node_unclaim(spl, leaf);
+   trunk_node_unget(spl, &leaf);
+
+   /*
+    * 8. Clean up
+    */
+   trunk_close_log_stream_if_enabled(spl, &stream);
+
+   if (spl->cfg.use_stats) {
+      // Doesn't include the original leaf
+      spl->stats[tid].leaf_splits_leaves_created += num_leaves - 1;
+      uint64 split_time = platform_timestamp_elapsed(split_start);
+      spl->stats[tid].leaf_split_time_ns += split_time;
+      platform_timestamp_elapsed(split_start);
+      if (split_time > spl->stats[tid].leaf_split_max_time_ns) {
+         spl->stats[tid].leaf_split_max_time_ns = split_time;
+      }
+   }
+}
+
+
+int
+trunk_split_root(trunk_handle *spl, page_handle *root)
+{
+   trunk_hdr *root_hdr = (trunk_hdr *)root->data;
+
+   // allocate a new child node
+   page_handle *child     = trunk_alloc(spl, root_hdr->height);
+   trunk_hdr   *child_hdr = (trunk_hdr *)child->data;
+
+   // copy root to child, fix up root, then split
+   memmove(child_hdr, root_hdr, trunk_page_size(&spl->cfg));
+   // num_pivot_keys is changed by add_pivot_new_root below
+   root_hdr->height++;
+   debug_assert(root_hdr->next_addr == 0);
+   // leave generation and pivot_generation
+   root_hdr->start_branch      = 0;
+   root_hdr->start_frac_branch = 0;
+   root_hdr->end_branch        = 0;
+   root_hdr->start_bundle      = 0;
+   root_hdr->end_bundle        = 0;
+   root_hdr->start_subbundle   = 0;
+   root_hdr->end_subbundle     = 0;
+   root_hdr->start_sb_filter   = 0;
+   root_hdr->end_sb_filter     = 0;
+
+   trunk_add_pivot_new_root(spl, root, child);
+
+   trunk_split_index(spl, root, child, 0);
+
+   trunk_node_unlock(spl, child);
+   trunk_node_unclaim(spl, child);
+   trunk_node_unget(spl, &child);
+
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ * Snapshots
+ *
+ *      A trunk_snapshot is a read-only view of the data as of its creation,
+ *      which later inserts, flushes and compactions do not change. It holds
+ *      no data of its own, only the branches the view is made of, each
+ *      pinned with btree_inc_ref_range over the key range it is live in, so
+ *      that compaction cannot free them:
+ *         -- the compacted memtables which have not been incorporated yet,
+ *            pinned over the whole key space,
+ *         -- the branches of each pivot of each node, pinned over the range
+ *            of the pivot, a leaf being a node with a single pivot.
+ *      It also holds a reference to each routing filter of those branches.
+ *
+ *      The snapshot has the shape of the trunk, so each branch is in it
+ *      once: the pivots of a node are contiguous in trunk_snapshot->pivot,
+ *      and each pivot holds its branches and the range of the pivots of its
+ *      child.
+ *
+ *      trunk_snapshot_create retires the current memtable behind a barrier,
+ *      copying the range tombstones in place, and waits for the retired
+ *      memtables to be compacted, so only packed branches are pinned and the
+ *      memtables are recycled as usual. It then reads the root before any
+ *      newer memtable is incorporated, and takes read locks on its children
+ *      before releasing it. Nothing can be flushed out of the root while
+ *      those are held, so memtables are incorporated as usual during the
+ *      rest of the walk, which goes depth first through each child holding
+ *      read locks on the path to the current node, so no flush or split can
+ *      move data across it.
+ *
+ *      Lookups and range iterators read the branches of the pivots on the
+ *      path to the leaf covering their key, newest first. Lookups skip the
+ *      branches their filters rule out, as trunk_pivot_lookup does.
+ *-----------------------------------------------------------------------------
+ */
+
+/*
+ * A key stored in trunk_snapshot->keys.
+ */
+typedef struct trunk_snapshot_key {
+   key_type kind;
+   uint64   offset;
+   uint64   length;
+} trunk_snapshot_key;
+
+/*
+ * A branch the snapshot holds a reference to over [start_key, end_key].
+ */
+typedef struct trunk_snapshot_pin {
+   trunk_branch       branch;
+   trunk_snapshot_key start_key;
+   trunk_snapshot_key end_key;
+} trunk_snapshot_pin;
+
+/*
+ * A branch of the snapshot and the filters which route lookups to it,
+ * trunk_snapshot->filter[filter_start, filter_end). The branch may hold a key
+ * if one of them finds its value for the key, or any value at all for the
+ * branch of a compacted subbundle, whose value is TRUNK_SNAPSHOT_ANY_VALUE.
+ * A branch without filters may hold any key.
+ */
+typedef struct trunk_snapshot_branch {
+   trunk_branch branch;
+   uint64       filter_start;
+   uint64       filter_end;
+   uint16       value;
+} trunk_snapshot_branch;
+
+#define TRUNK_SNAPSHOT_ANY_VALUE ((uint16)-1)
+
+/*
+ * A pivot of a node of the trunk at the time of the snapshot. It covers the
+ * keys from its min_key to the min_key of the next pivot of the node, or to
+ * the end of the node if it is the last one. Its branches, newest first, are
+ * trunk_snapshot->branch[branch_start, branch_end), and the pivots of its
+ * child are trunk_snapshot->pivot[child_start, child_end), which is empty if
+ * the node is a leaf.
+ */
+typedef struct trunk_snapshot_pivot {
+   trunk_snapshot_key min_key;
+   uint64             branch_start;
+   uint64             branch_end;
+   uint64             child_start;
+   uint64             child_end;
+} trunk_snapshot_pivot;
+
+struct trunk_snapshot {
+   trunk_handle *spl;
+
+   // range tombstones in place when the snapshot was taken
+   trunk_range_tombstone_set range_tombstones;
+
+   // compacted memtables, newest first
+   uint64       num_memtable_branches;
+   trunk_branch memtable_branch[TRUNK_NUM_MEMTABLES];
+
+   // the pivots of the root come first
+   uint64                num_root_pivots;
+   uint64                num_pivots;
+   uint64                max_pivots;
+   trunk_snapshot_pivot *pivot;
+
+   uint64                 num_branches;
+   uint64                 max_branches;
+   trunk_snapshot_branch *branch;
+
+   uint64          num_filters;
+   uint64          max_filters;
+   routing_filter *filter;
+
+   uint64              num_pins;
+   uint64              max_pins;
+   trunk_snapshot_pin *pin;
+
+   // the bytes of the keys of the pivots and pins
+   writable_buffer keys;
+};
+
+/*
+ * Grows *array, of *capacity entries of entry_size bytes, to hold at least
+ * needed entries.
+ */
+static platform_status
+trunk_snapshot_reserve(trunk_snapshot *snapshot,
+                       void          **array,
+                       uint64         *capacity,
+                       uint64          needed,
+                       uint64          entry_size)
+{
+   if (needed <= *capacity) {
+      return STATUS_OK;
+   }
+   uint64 new_capacity = MAX(MAX(2 * *capacity, needed), 64);
+   void  *new_array    = platform_realloc(
+      snapshot->spl->heap_id, *array, new_capacity * entry_size);
+   if (new_array == NULL) {
+      return STATUS_NO_MEMORY;
+   }
+   *array    = new_array;
+   *capacity = new_capacity;
+   return STATUS_OK;
+}
+
+static platform_status
+trunk_snapshot_add_key(trunk_snapshot *snapshot, key k, trunk_snapshot_key *sk)
+{
+   sk->kind   = k.kind;
+   sk->offset = writable_buffer_length(&snapshot->keys);
+   sk->length = key_length(k);
+   if (!key_is_user_key(k)) {
+      return STATUS_OK;
+   }
+   platform_status rc =
+      writable_buffer_resize(&snapshot->keys, sk->offset + sk->length);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   char *data = writable_buffer_data(&snapshot->keys);
+   key_copy_contents(data + sk->offset, k);
+   return STATUS_OK;
+}
+
+static key
+trunk_snapshot_get_key(trunk_snapshot *snapshot, trunk_snapshot_key *sk)
+{
+   if (sk->kind == NEGATIVE_INFINITY) {
+      return NEGATIVE_INFINITY_KEY;
+   } else if (sk->kind == POSITIVE_INFINITY) {
+      return POSITIVE_INFINITY_KEY;
+   }
+   const char *data = writable_buffer_data(&snapshot->keys);
+   return key_create(sk->length, data + sk->offset);
+}
+
+/*
+ * Takes a reference to branch over [start_key, end_key]. The caller must hold
+ * a read lock on the node the branch is in.
+ */
+static platform_status
+trunk_snapshot_pin_branch(trunk_snapshot     *snapshot,
+                          trunk_branch       *branch,
+                          trunk_snapshot_key *start_key,
+                          trunk_snapshot_key *end_key)
+{
+   platform_status rc = trunk_snapshot_reserve(snapshot,
+                                               (void **)&snapshot->pin,
+                                               &snapshot->max_pins,
+                                               snapshot->num_pins + 1,
+                                               sizeof(*snapshot->pin));
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   trunk_inc_branch_range(snapshot->spl,
+                          branch,
+                          trunk_snapshot_get_key(snapshot, start_key),
+                          trunk_snapshot_get_key(snapshot, end_key));
+   trunk_snapshot_pin *pin = &snapshot->pin[snapshot->num_pins++];
+   pin->branch             = *branch;
+   pin->start_key          = *start_key;
+   pin->end_key            = *end_key;
+   return STATUS_OK;
+}
 
-   /*
-    * 6. Build iterators
-    */
-   platform_assert(num_branches <= ARRAY_SIZE(scratch->skip_itor));
-   trunk_btree_skiperator *skip_itor_arr = scratch->skip_itor;
-   iterator              **itor_arr      = scratch->itor_arr;
+/*
+ * Takes a reference to filter and adds it to the snapshot. A filter without
+ * pages is left out, so the branches it routes to are read for every key.
+ */
+static platform_status
+trunk_snapshot_add_filter(trunk_snapshot *snapshot, routing_filter *filter)
+{
+   if (filter->addr == 0) {
+      return STATUS_OK;
+   }
+   platform_status rc = trunk_snapshot_reserve(snapshot,
+                                               (void **)&snapshot->filter,
+                                               &snapshot->max_filters,
+                                               snapshot->num_filters + 1,
+                                               sizeof(*snapshot->filter));
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   trunk_inc_filter(snapshot->spl, filter);
+   snapshot->filter[snapshot->num_filters++] = *filter;
+   return STATUS_OK;
+}
 
-   save_pivots_to_compact_bundle_scratch(spl, node, scratch);
+/*
+ * Adds branch, with the filters added since filter_start, to the snapshot,
+ * pinned over [start_key, end_key]. The caller must hold a read lock on the
+ * node the branch is in.
+ */
+static platform_status
+trunk_snapshot_add_branch(trunk_snapshot     *snapshot,
+                          trunk_branch       *branch,
+                          trunk_snapshot_key *start_key,
+                          trunk_snapshot_key *end_key,
+                          uint64              filter_start,
+                          uint16              value)
+{
+   if (branch->root_addr == 0) {
+      return STATUS_OK;
+   }
+   platform_status rc = trunk_snapshot_reserve(snapshot,
+                                               (void **)&snapshot->branch,
+                                               &snapshot->max_branches,
+                                               snapshot->num_branches + 1,
+                                               sizeof(*snapshot->branch));
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   rc = trunk_snapshot_pin_branch(snapshot, branch, start_key, end_key);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   trunk_snapshot_branch *sbranch = &snapshot->branch[snapshot->num_branches++];
+   sbranch->branch                = *branch;
+   sbranch->filter_start          = filter_start;
+   sbranch->filter_end            = snapshot->num_filters;
+   sbranch->value                 = value;
+   return STATUS_OK;
+}
 
-   uint16 tree_offset = 0;
-   for (uint16 branch_no = bundle_start_branch; branch_no != bundle_end_branch;
-        branch_no        = trunk_add_branch_number(spl, branch_no, 1))
-   {
-      /*
-       * We are iterating from oldest to newest branch
-       */
-      trunk_btree_skiperator_init(spl,
-                                  &skip_itor_arr[tree_offset],
-                                  node,
-                                  branch_no,
-                                  scratch->saved_pivot_keys);
-      itor_arr[tree_offset] = &skip_itor_arr[tree_offset].super;
-      tree_offset++;
+/*
+ * Adds the branches of the pivot, newest first, with their filters: those of
+ * its bundles, then its whole branches, in the order trunk_pivot_lookup reads
+ * them.
+ */
+static platform_status
+trunk_snapshot_add_pivot_branches(trunk_snapshot     *snapshot,
+                                  page_handle        *node,
+                                  trunk_pivot_data   *pdata,
+                                  trunk_snapshot_key *start_key,
+                                  trunk_snapshot_key *end_key)
+{
+   trunk_handle   *spl = snapshot->spl;
+   platform_status rc;
+   uint16          num_bundles = trunk_pivot_bundle_count(spl, node, pdata);
+   for (uint16 bundle_off = 0; bundle_off != num_bundles; bundle_off++) {
+      uint16 bundle_no = trunk_subtract_bundle_number(
+         spl, trunk_end_bundle(spl, node), bundle_off + 1);
+      trunk_bundle *bundle   = trunk_get_bundle(spl, node, bundle_no);
+      uint16        sb_count = trunk_bundle_subbundle_count(spl, node, bundle);
+      for (uint16 sb_off = 0; sb_off != sb_count; sb_off++) {
+         uint16 sb_no = trunk_subtract_subbundle_number(
+            spl, bundle->end_subbundle, sb_off + 1);
+         trunk_subbundle *sb        = trunk_get_subbundle(spl, node, sb_no);
+         bool             compacted = sb->state == SB_STATE_COMPACTED;
+         uint16           filter_count =
+            compacted ? trunk_subbundle_filter_count(spl, node, sb) : 1;
+         uint64 filter_start = snapshot->num_filters;
+         for (uint16 filter_no = 0; filter_no != filter_count; filter_no++) {
+            rc = trunk_snapshot_add_filter(
+               snapshot, trunk_subbundle_filter(spl, node, sb, filter_no));
+            if (!SUCCESS(rc)) {
+               return rc;
+            }
+         }
+         uint16 value = trunk_subbundle_branch_count(spl, node, sb);
+         while (value-- != 0) {
+            uint16 branch_no =
+               trunk_add_branch_number(spl, sb->start_branch, value);
+            rc = trunk_snapshot_add_branch(
+               snapshot,
+               trunk_get_branch(spl, node, branch_no),
+               start_key,
+               end_key,
+               filter_start,
+               compacted ? TRUNK_SNAPSHOT_ANY_VALUE : value);
+            if (!SUCCESS(rc)) {
+               return rc;
+            }
+         }
+      }
    }
-   trunk_log_node_if_enabled(&stream, spl, node);
 
-   /*
-    * 7. Release read lock
-    */
-   trunk_node_unget(spl, &node);
+   if (!trunk_branch_is_whole(spl, node, pdata->start_branch)) {
+      return STATUS_OK;
+   }
+   uint64 filter_start = snapshot->num_filters;
+   rc                  = trunk_snapshot_add_filter(snapshot, &pdata->filter);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   uint16 value = trunk_subtract_branch_number(
+      spl, trunk_start_frac_branch(spl, node), pdata->start_branch);
+   while (value-- != 0) {
+      uint16 branch_no =
+         trunk_add_branch_number(spl, pdata->start_branch, value);
+      rc = trunk_snapshot_add_branch(snapshot,
+                                     trunk_get_branch(spl, node, branch_no),
+                                     start_key,
+                                     end_key,
+                                     filter_start,
+                                     value);
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+   }
+   return STATUS_OK;
+}
 
-   /*
-    * 8. Perform compaction
-    */
-   merge_iterator *merge_itor;
-   rc = merge_iterator_create(spl->heap_id,
-                              spl->cfg.data_cfg,
-                              num_branches,
-                              itor_arr,
-                              merge_mode,
-                              &merge_itor);
-   platform_assert_status_ok(rc);
-   btree_pack_req pack_req;
-   trunk_btree_pack_req_init(spl, &merge_itor->super, &pack_req);
-   req->fp_arr = pack_req.fingerprint_arr;
-   if (spl->cfg.use_stats) {
-      pack_start = platform_get_timestamp();
+/*
+ * Adds the pivots of node, with their branches, to the snapshot and sets
+ * *start to the first of them. path_len is the number of branches on the
+ * path from the root to node. The caller must hold a read lock on node.
+ */
+static platform_status
+trunk_snapshot_add_pivots(trunk_snapshot *snapshot,
+                          page_handle    *node,
+                          uint64          path_len,
+                          uint64         *start)
+{
+   trunk_handle   *spl        = snapshot->spl;
+   uint16          num_pivots = trunk_num_children(spl, node);
+   platform_status rc =
+      trunk_snapshot_reserve(snapshot,
+                             (void **)&snapshot->pivot,
+                             &snapshot->max_pivots,
+                             snapshot->num_pivots + num_pivots,
+                             sizeof(*snapshot->pivot));
+   if (!SUCCESS(rc)) {
+      return rc;
    }
+   *start = snapshot->num_pivots;
 
-   platform_status pack_status = btree_pack(&pack_req);
-   if (!SUCCESS(pack_status)) {
-      platform_default_log("btree_pack failed: %s\n",
-                           platform_status_to_string(pack_status));
-      trunk_compact_bundle_cleanup_iterators(
-         spl, &merge_itor, num_branches, skip_itor_arr);
-      btree_pack_req_deinit(&pack_req, spl->heap_id);
-      platform_free(spl->heap_id, req);
-      goto out;
+   trunk_snapshot_key start_key, end_key;
+   rc = trunk_snapshot_add_key(snapshot, trunk_min_key(spl, node), &end_key);
+   if (!SUCCESS(rc)) {
+      return rc;
    }
+   for (uint16 pivot_no = 0; pivot_no < num_pivots; pivot_no++) {
+      start_key = end_key;
+      rc        = trunk_snapshot_add_key(
+         snapshot, trunk_get_pivot(spl, node, pivot_no + 1), &end_key);
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
 
-   if (spl->cfg.use_stats) {
-      spl->stats[tid].compaction_pack_time_ns[height] +=
-         platform_timestamp_elapsed(pack_start);
+      trunk_snapshot_pivot *pivot = &snapshot->pivot[snapshot->num_pivots];
+      ZERO_CONTENTS(pivot);
+      pivot->min_key          = start_key;
+      pivot->branch_start     = snapshot->num_branches;
+      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
+      rc                      = trunk_snapshot_add_pivot_branches(
+         snapshot, node, pdata, &start_key, &end_key);
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+      pivot->branch_end = snapshot->num_branches;
+      uint64 num_branches = snapshot->num_memtable_branches + path_len
+                            + pivot->branch_end - pivot->branch_start;
+      platform_assert(num_branches <= TRUNK_RANGE_ITOR_MAX_BRANCHES,
+                      "snapshot leaf has too many branches (%lu).",
+                      num_branches);
+      snapshot->num_pivots++;
    }
+   return STATUS_OK;
+}
 
-   trunk_branch new_branch;
-   new_branch.root_addr     = pack_req.root_addr;
-   uint64 num_tuples        = pack_req.num_tuples;
-   req->fp_arr              = pack_req.fingerprint_arr;
-   pack_req.fingerprint_arr = NULL;
-   btree_pack_req_deinit(&pack_req, spl->heap_id);
+static platform_status
+trunk_snapshot_add_node(trunk_snapshot *snapshot,
+                        page_handle    *node,
+                        uint64          parent,
+                        uint64          path_len);
 
-   trunk_log_stream_if_enabled(
-      spl, &stream, "output: %lu\n", new_branch.root_addr);
+/*
+ * Adds the subtree of the child of snapshot->pivot[parent], which the caller
+ * holds a read lock on.
+ */
+static platform_status
+trunk_snapshot_add_child(trunk_snapshot *snapshot,
+                         page_handle    *child,
+                         uint64          parent,
+                         uint64          path_len)
+{
+   trunk_snapshot_pivot *pivot = &snapshot->pivot[parent];
+   path_len += pivot->branch_end - pivot->branch_start;
+   return trunk_snapshot_add_node(snapshot, child, parent, path_len);
+}
 
-   if (spl->cfg.use_stats) {
-      if (num_tuples == 0) {
-         spl->stats[tid].compactions_empty[height]++;
-      }
-      spl->stats[tid].compaction_tuples[height] += num_tuples;
-      if (num_tuples > spl->stats[tid].compaction_max_tuples[height]) {
-         spl->stats[tid].compaction_max_tuples[height] = num_tuples;
+/*
+ * Adds the subtree of node, the child of snapshot->pivot[parent], to the
+ * snapshot. path_len is the number of branches on the path from the root to
+ * node. The caller holds read locks on node and all its ancestors below the
+ * root.
+ */
+static platform_status
+trunk_snapshot_add_node(trunk_snapshot *snapshot,
+                        page_handle    *node,
+                        uint64          parent,
+                        uint64          path_len)
+{
+   trunk_handle   *spl = snapshot->spl;
+   uint64          start;
+   platform_status rc =
+      trunk_snapshot_add_pivots(snapshot, node, path_len, &start);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   snapshot->pivot[parent].child_start = start;
+   snapshot->pivot[parent].child_end   = snapshot->num_pivots;
+   if (trunk_is_leaf(spl, node)) {
+      return STATUS_OK;
+   }
+
+   uint16 num_children = trunk_num_children(spl, node);
+   for (uint16 pivot_no = 0; pivot_no < num_children; pivot_no++) {
+      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
+      page_handle      *child = trunk_node_get(spl, pdata->addr);
+      rc                      = trunk_snapshot_add_child(
+         snapshot, child, start + pivot_no, path_len);
+      trunk_node_unget(spl, &child);
+      if (!SUCCESS(rc)) {
+         return rc;
       }
    }
+   return STATUS_OK;
+}
 
-   /*
-    * 10. Clean up
-    */
-   trunk_compact_bundle_cleanup_iterators(
-      spl, &merge_itor, num_branches, skip_itor_arr);
+/*
+ * Waits until the memtables older than generation have been compacted and
+ * returns with the lookup lock held.
+ */
+static page_handle *
+trunk_snapshot_wait_for_memtables(trunk_handle *spl, uint64 generation)
+{
+   uint64 wait = 1;
+   while (TRUE) {
+      page_handle *lock_page = memtable_get_lookup_lock(spl->mt_ctxt);
+      uint64       retired   = memtable_generation_retired(spl->mt_ctxt);
+      bool         compacted = TRUE;
+      for (uint64 mt_gen = retired + 1; mt_gen < generation; mt_gen++) {
+         memtable *mt = trunk_get_memtable(spl, mt_gen);
+         compacted    = compacted && memtable_ok_to_lookup_compacted(mt);
+      }
+      if (compacted) {
+         return lock_page;
+      }
+      memtable_unget_lookup_lock(spl->mt_ctxt, lock_page);
+      if (task_system_use_bg_threads(spl->ts)
+          || !SUCCESS(task_perform_one(spl->ts)))
+      {
+         platform_sleep(wait);
+         wait = wait > 2048 ? wait : 2 * wait;
+      }
+   }
+}
 
-   deinit_saved_pivots_in_scratch(scratch);
+void
+trunk_snapshot_release(trunk_snapshot *snapshot)
+{
+   trunk_handle *spl = snapshot->spl;
+   for (uint64 i = 0; i < snapshot->num_pins; i++) {
+      trunk_snapshot_pin *pin = &snapshot->pin[i];
+      trunk_zap_branch_range(spl,
+                             &pin->branch,
+                             trunk_snapshot_get_key(snapshot, &pin->start_key),
+                             trunk_snapshot_get_key(snapshot, &pin->end_key),
+                             PAGE_TYPE_BRANCH);
+   }
+   for (uint64 i = 0; i < snapshot->num_filters; i++) {
+      trunk_dec_filter(spl, &snapshot->filter[i]);
+   }
+   trunk_range_tombstone_set_deinit(spl, &snapshot->range_tombstones);
+   writable_buffer_deinit(&snapshot->keys);
+   if (snapshot->pivot != NULL) {
+      platform_free(spl->heap_id, snapshot->pivot);
+   }
+   if (snapshot->branch != NULL) {
+      platform_free(spl->heap_id, snapshot->branch);
+   }
+   if (snapshot->filter != NULL) {
+      platform_free(spl->heap_id, snapshot->filter);
+   }
+   if (snapshot->pin != NULL) {
+      platform_free(spl->heap_id, snapshot->pin);
+   }
+   platform_free(spl->heap_id, snapshot);
+}
 
-   /*
-    * 11. Reacquire read lock
-    */
-   node = trunk_node_get(spl, req->addr);
-   platform_assert(node != NULL);
+/*
+ *-----------------------------------------------------------------------------
+ * trunk_snapshot_create --
+ *
+ *      Takes a snapshot of the data inserted so far. Inserts are held off
+ *      only while the current memtable is retired, and incorporation only
+ *      while the root is read.
+ *
+ * Results:
+ *      STATUS_OK and the snapshot, or an error status.
+ *
+ * Side effects:
+ *      The branches of the snapshot are not freed until it is released.
+ *-----------------------------------------------------------------------------
+ */
+platform_status
+trunk_snapshot_create(trunk_handle *spl, trunk_snapshot **out_snapshot)
+{
+   trunk_snapshot *snapshot = TYPED_ZALLOC(spl->heap_id, snapshot);
+   if (snapshot == NULL) {
+      return STATUS_NO_MEMORY;
+   }
+   snapshot->spl = spl;
+   writable_buffer_init(&snapshot->keys, spl->heap_id);
 
    /*
-    * 12. For each newly split sibling replace bundle with new branch
+    * Everything written so far is either in a memtable older than mt_gen or
+    * deleted by one of the range tombstones in place at the barrier. If
+    * newer memtables are incorporated while waiting for the older ones to be
+    * compacted, the trunk holds writes from after the barrier, so start over.
     */
-   uint64 addr             = req->addr;
-   uint64 num_replacements = 0;
-   uint64 generation;
-   do {
-      platform_assert(node != NULL);
-      trunk_node_claim(spl, &node);
-      trunk_node_lock(spl, node);
+   platform_status rc;
+   page_handle    *mt_lookup_lock_page;
+   uint64          mt_gen;
+   uint64          retired;
+   while (TRUE) {
+      memtable_barrier barrier;
+      mt_gen = memtable_begin_barrier(spl->mt_ctxt, &barrier);
+      rc     = trunk_range_tombstone_snapshot(spl,
+                                              &snapshot->range_tombstones,
+                                              NEGATIVE_INFINITY_KEY,
+                                              POSITIVE_INFINITY_KEY);
+      memtable_end_barrier(spl->mt_ctxt, &barrier);
+      if (!SUCCESS(rc)) {
+         trunk_snapshot_release(snapshot);
+         return rc;
+      }
 
-      trunk_log_node_if_enabled(&stream, spl, node);
+      mt_lookup_lock_page = trunk_snapshot_wait_for_memtables(spl, mt_gen);
+      retired             = memtable_generation_retired(spl->mt_ctxt);
+      if (retired + 1 <= mt_gen) {
+         break;
+      }
+      memtable_unget_lookup_lock(spl->mt_ctxt, mt_lookup_lock_page);
+      trunk_range_tombstone_set_deinit(spl, &snapshot->range_tombstones);
+   }
 
-      /*
-       * 12a. ...unless node is a leaf which has split, in which case discard
-       *      (interaction 6)
-       *
-       *      For leaves, the split will cover the compaction and we do not
-       *      need to look for the bundle in the split siblings, so simply
-       *      exit.
-       */
-      if (height == 0 && req->generation < trunk_generation(spl, node)) {
-         trunk_log_stream_if_enabled(
-            spl, &stream, "compact_bundle discard split %lu\n", req->addr);
-         if (spl->cfg.use_stats) {
-            spl->stats[tid].compactions_discarded_leaf_split[height]++;
-            spl->stats[tid].compaction_time_wasted_ns[height] +=
-               platform_timestamp_elapsed(compaction_start);
-         }
-         trunk_node_unlock(spl, node);
-         trunk_node_unclaim(spl, node);
-         trunk_node_unget(spl, &node);
+   trunk_snapshot_key start_key, end_key;
+   trunk_snapshot_add_key(snapshot, NEGATIVE_INFINITY_KEY, &start_key);
+   trunk_snapshot_add_key(snapshot, POSITIVE_INFINITY_KEY, &end_key);
+   rc = STATUS_OK;
+   while (SUCCESS(rc) && mt_gen-- > retired + 1) {
+      trunk_compacted_memtable *cmt = trunk_get_compacted_memtable(spl, mt_gen);
+      trunk_branch              branch = cmt->branch;
+      if (branch.root_addr == 0) {
+         continue;
+      }
+      branch.generation = trunk_data_generation(spl, mt_gen);
+      rc = trunk_snapshot_pin_branch(snapshot, &branch, &start_key, &end_key);
+      if (SUCCESS(rc)) {
+         snapshot->memtable_branch[snapshot->num_memtable_branches++] = branch;
+      }
+   }
 
-         if (num_tuples != 0) {
-            trunk_dec_ref(spl, &new_branch, FALSE);
-         }
-         platform_free(spl->heap_id, req->fp_arr);
-         platform_free(spl->heap_id, req);
-         goto out;
+   // the root read lock holds off memtable incorporation, and the read locks
+   // on its children hold off flushes out of it once it is released
+   page_handle *root = trunk_node_get(spl, spl->root_addr);
+   memtable_unget_lookup_lock(spl->mt_ctxt, mt_lookup_lock_page);
+   page_handle *child[TRUNK_MAX_PIVOTS];
+   uint16       num_children = 0;
+   uint64       root_start;
+   if (SUCCESS(rc)) {
+      rc = trunk_snapshot_add_pivots(snapshot, root, 0, &root_start);
+      snapshot->num_root_pivots = snapshot->num_pivots;
+   }
+   if (SUCCESS(rc) && !trunk_is_leaf(spl, root)) {
+      num_children = trunk_num_children(spl, root);
+      debug_assert(num_children <= TRUNK_MAX_PIVOTS);
+      for (uint16 pivot_no = 0; pivot_no < num_children; pivot_no++) {
+         trunk_pivot_data *pdata = trunk_get_pivot_data(spl, root, pivot_no);
+         child[pivot_no]         = trunk_node_get(spl, pdata->addr);
+      }
+   }
+   trunk_node_unget(spl, &root);
+   for (uint16 pivot_no = 0; pivot_no < num_children; pivot_no++) {
+      if (SUCCESS(rc)) {
+         rc = trunk_snapshot_add_child(
+            snapshot, child[pivot_no], root_start + pivot_no, 0);
       }
+      trunk_node_unget(spl, &child[pivot_no]);
+   }
+   if (!SUCCESS(rc)) {
+      trunk_snapshot_release(snapshot);
+      return rc;
+   }
 
-      if (trunk_bundle_live(spl, node, req->bundle_no)) {
-         if (num_tuples != 0) {
-            trunk_replace_bundle_branches(spl, node, &new_branch, req);
-            num_replacements++;
-            trunk_log_stream_if_enabled(spl,
-                                        &stream,
-                                        "inserted %lu into %lu\n",
-                                        new_branch.root_addr,
-                                        addr);
-         } else {
-            trunk_replace_bundle_branches(spl, node, NULL, req);
-            trunk_log_stream_if_enabled(
-               spl, &stream, "compact_bundle empty %lu\n", addr);
-         }
+   *out_snapshot = snapshot;
+   return STATUS_OK;
+}
+
+/*
+ * Returns the pivot among snapshot->pivot[start, end), the pivots of a node,
+ * covering target, or if comp is less_than, the key just before it.
+ */
+static uint64
+trunk_snapshot_find_pivot(trunk_snapshot *snapshot,
+                          uint64          start,
+                          uint64          end,
+                          key             target,
+                          lookup_type     comp)
+{
+   debug_assert(comp == less_than || comp == less_than_or_equal);
+   uint64 lo = start;
+   uint64 hi = end;
+   while (hi - lo > 1) {
+      uint64 mid = lo + (hi - lo) / 2;
+      key    min_key =
+         trunk_snapshot_get_key(snapshot, &snapshot->pivot[mid].min_key);
+      int cmp = trunk_key_compare(snapshot->spl, min_key, target);
+      if (cmp < 0 || (cmp == 0 && comp == less_than_or_equal)) {
+         lo = mid;
       } else {
-         /*
-          * 12b. ...unless node is internal and bundle has been flushed
-          */
-         platform_assert(height != 0);
-         trunk_log_stream_if_enabled(
-            spl, &stream, "compact_bundle discarded flushed %lu\n", addr);
+         hi = mid;
       }
+   }
+   return lo;
+}
 
-      addr       = trunk_next_addr(spl, node);
-      generation = trunk_generation(spl, node);
-      trunk_log_node_if_enabled(&stream, spl, node);
-      debug_assert(trunk_verify_node(spl, node));
+/*
+ * Copies the branches covering the leaf containing target, or the leaf
+ * before it if comp is less_than, newest first, into branch. Returns the max
+ * key of that leaf and sets *leaf_min_key to its min key.
+ */
+static key
+trunk_snapshot_collect_branches(trunk_snapshot *snapshot,
+                                key             target,
+                                lookup_type     comp,
+                                trunk_branch   *branch,
+                                uint64         *num_branches,
+                                key            *leaf_min_key)
+{
+   memmove(branch,
+           snapshot->memtable_branch,
+           snapshot->num_memtable_branches * sizeof(*branch));
+   *num_branches = snapshot->num_memtable_branches;
 
-      if (num_replacements != 0 && num_tuples != 0
-          && start_generation == generation) {
-         key max_key = trunk_max_key(spl, node);
-         trunk_zap_branch_range(
-            spl, &new_branch, max_key, max_key, PAGE_TYPE_BRANCH);
+   key    leaf_max_key = POSITIVE_INFINITY_KEY;
+   uint64 start        = 0;
+   uint64 end          = snapshot->num_root_pivots;
+   while (TRUE) {
+      uint64 pivot_no =
+         trunk_snapshot_find_pivot(snapshot, start, end, target, comp);
+      trunk_snapshot_pivot *pivot = &snapshot->pivot[pivot_no];
+      if (pivot_no + 1 < end) {
+         leaf_max_key = trunk_snapshot_get_key(snapshot, &pivot[1].min_key);
       }
-
-      trunk_node_unlock(spl, node);
-      trunk_node_unclaim(spl, node);
-      trunk_node_unget(spl, &node);
-      if (start_generation != generation) {
-         debug_assert(height != 0);
-         debug_assert(addr != 0);
-         node = trunk_node_get(spl, addr);
+      for (uint64 i = pivot->branch_start; i < pivot->branch_end; i++) {
+         branch[(*num_branches)++] = snapshot->branch[i].branch;
       }
-   } while (start_generation != generation);
+      if (pivot->child_start == pivot->child_end) {
+         *leaf_min_key = trunk_snapshot_get_key(snapshot, &pivot->min_key);
+         return leaf_max_key;
+      }
+      start = pivot->child_start;
+      end   = pivot->child_end;
+   }
+}
 
-   if (spl->cfg.use_stats) {
-      if (req->type == TRUNK_COMPACTION_TYPE_SPACE_REC) {
-         spl->stats[tid].space_rec_tuples_reclaimed[height] +=
-            req->tuples_reclaimed;
+/*
+ * Returns FALSE if the filters of sbranch rule target out. The values found
+ * by the last filter probed are kept in *filter_no and *found_values, as the
+ * branches routed to by a filter are consecutive.
+ */
+static bool
+trunk_snapshot_branch_may_hold(trunk_snapshot        *snapshot,
+                               trunk_snapshot_branch *sbranch,
+                               key                    target,
+                               uint64                *filter_no,
+                               uint64                *found_values)
+{
+   trunk_handle *spl = snapshot->spl;
+   if (sbranch->filter_start == sbranch->filter_end) {
+      return TRUE;
+   }
+   for (uint64 i = sbranch->filter_start; i < sbranch->filter_end; i++) {
+      if (i != *filter_no) {
+         platform_status rc = routing_filter_lookup(spl->cc,
+                                                    trunk_routing_cfg(spl),
+                                                    &snapshot->filter[i],
+                                                    target,
+                                                    found_values);
+         platform_assert_status_ok(rc);
+         *filter_no = i;
       }
-      if (req->type == TRUNK_COMPACTION_TYPE_SINGLE_LEAF_SPLIT) {
-         spl->stats[tid].single_leaf_tuples += num_tuples;
-         if (num_tuples > spl->stats[tid].single_leaf_max_tuples) {
-            spl->stats[tid].single_leaf_max_tuples = num_tuples;
-         }
+      if (sbranch->value == TRUNK_SNAPSHOT_ANY_VALUE
+             ? *found_values != 0
+             : routing_filter_is_value_found(*found_values, sbranch->value))
+      {
+         return TRUE;
       }
    }
-   if (num_replacements == 0) {
-      if (num_tuples != 0) {
-         trunk_dec_ref(spl, &new_branch, FALSE);
+   return FALSE;
+}
+
+/*
+ * Looks target up in the snapshot. Like trunk_lookup, a deleted key gives a
+ * null result.
+ */
+platform_status
+trunk_snapshot_lookup(trunk_snapshot    *snapshot,
+                      key                target,
+                      merge_accumulator *result)
+{
+   trunk_handle *spl = snapshot->spl;
+   merge_accumulator_set_to_null(result);
+
+   // data older than tombstone_gen is range deleted
+   uint64 tombstone_gen = trunk_range_tombstone_set_generation(
+      spl, &snapshot->range_tombstones, target);
+
+   platform_status rc;
+   bool            local_found;
+   for (uint64 i = 0; i < snapshot->num_memtable_branches; i++) {
+      rc = trunk_btree_lookup_and_merge(spl,
+                                        &snapshot->memtable_branch[i],
+                                        tombstone_gen,
+                                        target,
+                                        result,
+                                        &local_found);
+      if (!SUCCESS(rc)) {
+         return rc;
       }
-      if (spl->cfg.use_stats) {
-         spl->stats[tid].compactions_discarded_flushed[height]++;
-         spl->stats[tid].compaction_time_wasted_ns[height] +=
-            platform_timestamp_elapsed(compaction_start);
+      if (merge_accumulator_is_definitive(result)) {
+         goto out;
       }
-      platform_free(spl->heap_id, req->fp_arr);
-      platform_free(spl->heap_id, req);
-   } else {
-      if (spl->cfg.use_stats) {
-         compaction_start = platform_timestamp_elapsed(compaction_start);
-         spl->stats[tid].compaction_time_ns[height] += compaction_start;
-         if (compaction_start > spl->stats[tid].compaction_time_max_ns[height])
+   }
+
+   uint64 filter_no    = UINT64_MAX;
+   uint64 found_values = 0;
+   uint64 start        = 0;
+   uint64 end          = snapshot->num_root_pivots;
+   while (start != end) {
+      uint64 pivot_no = trunk_snapshot_find_pivot(
+         snapshot, start, end, target, less_than_or_equal);
+      trunk_snapshot_pivot *pivot = &snapshot->pivot[pivot_no];
+      for (uint64 i = pivot->branch_start; i < pivot->branch_end; i++) {
+         trunk_snapshot_branch *sbranch = &snapshot->branch[i];
+         if (!trunk_snapshot_branch_may_hold(
+                snapshot, sbranch, target, &filter_no, &found_values))
          {
-            spl->stats[tid].compaction_time_max_ns[height] = compaction_start;
+            continue;
+         }
+         rc = trunk_btree_lookup_and_merge(spl,
+                                           &sbranch->branch,
+                                           tombstone_gen,
+                                           target,
+                                           result,
+                                           &local_found);
+         if (!SUCCESS(rc)) {
+            return rc;
+         }
+         if (merge_accumulator_is_definitive(result)) {
+            goto out;
          }
       }
-      trunk_log_stream_if_enabled(spl,
-                                  &stream,
-                                  "enqueuing build filter %lu-%u\n",
-                                  req->addr,
-                                  req->bundle_no);
-      task_enqueue(
-         spl->ts, TASK_TYPE_NORMAL, trunk_bundle_build_filters, req, TRUE);
+      start = pivot->child_start;
+      end   = pivot->child_end;
    }
+
 out:
-   trunk_log_stream_if_enabled(spl, &stream, "\n");
-   trunk_close_log_stream_if_enabled(spl, &stream);
+   if (!merge_accumulator_is_null(result)
+       && !merge_accumulator_is_definitive(result))
+   {
+      data_merge_tuples_final(spl->cfg.data_cfg, target, result);
+   }
+
+   /* Normalize DELETE messages to return a null merge_accumulator */
+   if (!merge_accumulator_is_null(result)
+       && merge_accumulator_message_class(result) == MESSAGE_TYPE_DELETE)
+   {
+      merge_accumulator_set_to_null(result);
+   }
+   return STATUS_OK;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ * Range functions and iterators
+ *
+ *      trunk_node_iterator
+ *      trunk_iterator
+ *-----------------------------------------------------------------------------
+ */
+void
+trunk_range_iterator_get_curr(iterator *itor, key *curr_key, message *data);
+platform_status
+trunk_range_iterator_at_end(iterator *itor, bool *at_end);
+platform_status
+trunk_range_iterator_advance(iterator *itor);
+static void
+trunk_range_iterator_unload(trunk_range_iterator *range_itor);
+
+const static iterator_ops trunk_range_iterator_ops = {
+   .get_curr = trunk_range_iterator_get_curr,
+   .at_end   = trunk_range_iterator_at_end,
+   .advance  = trunk_range_iterator_advance,
+   .seek     = trunk_range_iterator_seek,
+};
+
+/*
+ * Sets leaf_min_key, the start of the leaf being iterated, rebuild_key, where
+ * the iterator continues once it is done with the leaf, and local_max_key,
+ * where it stops in the leaf, given the min and max keys of the leaf.
+ *
+ * Reverse iterators walk the leaf down from local_max_key and stop at
+ * rebuild_key, which is then the max key of the leaves left.
+ */
+static platform_status
+trunk_range_iterator_set_leaf(trunk_handle         *spl,
+                              trunk_range_iterator *range_itor,
+                              key                   leaf_min_key,
+                              key                   leaf_max_key)
+{
+   platform_status rc = key_buffer_init_from_key(
+      &range_itor->leaf_min_key, spl->heap_id, leaf_min_key);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+
+   key min_key       = key_buffer_key(&range_itor->min_key);
+   key max_key       = key_buffer_key(&range_itor->max_key);
+   key local_max_key = trunk_key_compare(spl, leaf_max_key, max_key) < 0
+                          ? leaf_max_key
+                          : max_key;
+   key rebuild_key   = local_max_key;
+   if (range_itor->reverse) {
+      rebuild_key = trunk_key_compare(spl, min_key, leaf_min_key) < 0
+                       ? leaf_min_key
+                       : min_key;
+   }
+   key_buffer_init_from_key(
+      &range_itor->rebuild_key, spl->heap_id, rebuild_key);
+   key_buffer_init_from_key(
+      &range_itor->local_max_key, spl->heap_id, local_max_key);
+   return STATUS_OK;
+}
+
+/*
+ * Returns FALSE if the routing filters of node rule out that branch_no, a
+ * branch of pdata, holds keys with the given prefix in the range of pdata.
+ * whole_values are the values found for the prefix in the filter of pdata.
+ */
+static bool
+trunk_branch_may_have_prefix(trunk_handle     *spl,
+                             page_handle      *node,
+                             trunk_pivot_data *pdata,
+                             uint64            whole_values,
+                             uint16            branch_no,
+                             key               prefix)
+{
+   if (!trunk_branch_in_range(
+          spl, branch_no, pdata->start_branch, trunk_end_branch(spl, node)))
+   {
+      return TRUE;
+   }
+   if (trunk_branch_is_whole(spl, node, branch_no)) {
+      uint16 value =
+         trunk_subtract_branch_number(spl, branch_no, pdata->start_branch);
+      return routing_filter_is_value_found(whole_values, value);
+   }
+
+   routing_config *cfg = &spl->cfg.filter_cfg;
+   for (uint16 sb_no = trunk_pivot_start_subbundle(spl, node, pdata);
+        sb_no != trunk_end_subbundle(spl, node);
+        sb_no = trunk_add_subbundle_number(spl, sb_no, 1))
+   {
+      trunk_subbundle *sb = trunk_get_subbundle(spl, node, sb_no);
+      if (!trunk_branch_in_range(
+             spl, branch_no, sb->start_branch, sb->end_branch))
+      {
+         continue;
+      }
+      uint64          found_values;
+      platform_status rc;
+      if (sb->state == SB_STATE_COMPACTED) {
+         uint16 filter_count = trunk_subbundle_filter_count(spl, node, sb);
+         for (uint16 filter_no = 0; filter_no != filter_count; filter_no++) {
+            routing_filter *filter =
+               trunk_subbundle_filter(spl, node, sb, filter_no);
+            rc = routing_filter_lookup(
+               spl->cc, cfg, filter, prefix, &found_values);
+            platform_assert_status_ok(rc);
+            if (found_values) {
+               return TRUE;
+            }
+         }
+         return FALSE;
+      }
+      routing_filter *filter = trunk_subbundle_filter(spl, node, sb, 0);
+      rc = routing_filter_lookup(spl->cc, cfg, filter, prefix, &found_values);
+      platform_assert_status_ok(rc);
+      uint16 value =
+         trunk_subtract_branch_number(spl, branch_no, sb->start_branch);
+      return routing_filter_is_value_found(found_values, value);
+   }
+   return TRUE;
+}
+
+/*
+ * Collects the branches of pdata, newest first, blocking them from being
+ * freed. If prefix is not null, the branches the routing filters rule out
+ * holding keys with it are left out.
+ */
+static void
+trunk_range_iterator_collect_pivot_branches(trunk_handle         *spl,
+                                            trunk_range_iterator *range_itor,
+                                            page_handle          *node,
+                                            trunk_pivot_data     *pdata,
+                                            uint16                num_branches,
+                                            key                   prefix)
+{
+   uint64 whole_values = 0;
+   if (!key_is_null(prefix)) {
+      platform_status rc = routing_filter_lookup(spl->cc,
+                                                 &spl->cfg.filter_cfg,
+                                                 &pdata->filter,
+                                                 prefix,
+                                                 &whole_values);
+      platform_assert_status_ok(rc);
+   }
+
+   for (uint16 branch_offset = 0; branch_offset != num_branches;
+        branch_offset++)
+   {
+      platform_assert(
+         (range_itor->num_branches < TRUNK_RANGE_ITOR_MAX_BRANCHES),
+         "range_itor->num_branches=%lu should be < "
+         " TRUNK_RANGE_ITOR_MAX_BRANCHES (%d).",
+         range_itor->num_branches,
+         TRUNK_RANGE_ITOR_MAX_BRANCHES);
+
+      debug_assert(range_itor->num_branches < ARRAY_SIZE(range_itor->branch));
+      uint16 branch_no = trunk_subtract_branch_number(
+         spl, trunk_end_branch(spl, node), branch_offset + 1);
+      if (!key_is_null(prefix)
+          && !trunk_branch_may_have_prefix(
+             spl, node, pdata, whole_values, branch_no, prefix))
+      {
+         continue;
+      }
+      range_itor->branch[range_itor->num_branches] =
+         *trunk_get_branch(spl, node, branch_no);
+      range_itor->compacted[range_itor->num_branches] = TRUE;
+      uint64 root_addr = range_itor->branch[range_itor->num_branches].root_addr;
+      btree_block_dec_ref(spl->cc, &spl->cfg.btree_cfg, root_addr);
+      range_itor->num_branches++;
+   }
 }
 
+/*
+ * Collects the branches of the memtables and of the path to the leaf
+ * containing target, or to the leaf before it if comp is less_than, newest
+ * first, blocking them from being freed. If prefix is not null, all the keys
+ * iterated have it, and the trunk branches which the routing filters rule
+ * out holding keys with it are left out.
+ */
+static platform_status
+trunk_range_iterator_collect_branches(trunk_handle         *spl,
+                                      trunk_range_iterator *range_itor,
+                                      key                   target,
+                                      lookup_type           comp,
+                                      key                   prefix)
+{
+   /*
+    * The tombstones are copied first, so that none deleting tuples of the
+    * branches collected can be retired in between.
+    */
+   trunk_range_tombstone_set range_tombstones;
+   platform_status           rc = trunk_range_tombstone_snapshot(
+      spl, &range_tombstones, NEGATIVE_INFINITY_KEY, POSITIVE_INFINITY_KEY);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+
+   // grab the lookup lock
+   page_handle *mt_lookup_lock_page = memtable_get_lookup_lock(spl->mt_ctxt);
+
+   // memtables
+   // Note this iteration is in descending generation order
+   range_itor->memtable_start_gen = memtable_generation(spl->mt_ctxt);
+   range_itor->memtable_end_gen   = memtable_generation_retired(spl->mt_ctxt);
+   range_itor->num_memtable_branches =
+      range_itor->memtable_start_gen - range_itor->memtable_end_gen;
+   for (uint64 mt_gen = range_itor->memtable_start_gen;
+        mt_gen != range_itor->memtable_end_gen;
+        mt_gen--)
+   {
+      platform_assert(
+         (range_itor->num_branches < TRUNK_RANGE_ITOR_MAX_BRANCHES),
+         "range_itor->num_branches=%lu should be < "
+         " TRUNK_RANGE_ITOR_MAX_BRANCHES (%d).",
+         range_itor->num_branches,
+         TRUNK_RANGE_ITOR_MAX_BRANCHES);
+      debug_assert(range_itor->num_branches < ARRAY_SIZE(range_itor->branch));
+
+      bool   compacted;
+      uint64 root_addr =
+         trunk_memtable_root_addr_for_lookup(spl, mt_gen, &compacted);
+      range_itor->compacted[range_itor->num_branches] = compacted;
+      if (compacted) {
+         btree_block_dec_ref(spl->cc, &spl->cfg.btree_cfg, root_addr);
+      } else {
+         trunk_memtable_inc_ref(spl, mt_gen);
+      }
 
-bool
-trunk_flush_node(trunk_handle *spl, uint64 addr, void *arg)
-{
-   page_handle *node = trunk_node_get(spl, addr);
-   trunk_node_claim(spl, &node);
-   trunk_node_lock(spl, node);
+      range_itor->branch[range_itor->num_branches].root_addr = root_addr;
+      range_itor->branch[range_itor->num_branches].generation =
+         trunk_data_generation(spl, mt_gen);
 
-   if (trunk_height(spl, node) != 0) {
-      for (uint16 pivot_no = 0; pivot_no < trunk_num_children(spl, node);
-           pivot_no++) {
-         trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
-         if (trunk_pivot_branch_count(spl, node, pdata) != 0) {
-            platform_status rc = trunk_flush(spl, node, pdata, FALSE);
-            platform_assert_status_ok(rc);
-         }
-      }
+      range_itor->num_branches++;
    }
 
-   trunk_node_unlock(spl, node);
-   trunk_node_unclaim(spl, node);
-   trunk_node_unget(spl, &node);
-
-   task_perform_all(spl->ts);
+   page_handle *node = trunk_node_get(spl, spl->root_addr);
+   memtable_unget_lookup_lock(spl->mt_ctxt, mt_lookup_lock_page);
 
-   node = trunk_node_get(spl, addr);
-   trunk_node_claim(spl, &node);
-   trunk_node_lock(spl, node);
+   // index btrees
+   uint16 height = trunk_height(spl, node);
+   for (uint16 h = height; h > 0; h--) {
+      uint16 pivot_no = trunk_find_pivot(spl, node, target, comp);
+      debug_assert(pivot_no < trunk_num_children(spl, node));
+      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
+      trunk_range_iterator_collect_pivot_branches(
+         spl,
+         range_itor,
+         node,
+         pdata,
+         trunk_pivot_branch_count(spl, node, pdata),
+         prefix);
 
-   if (trunk_height(spl, node) == 1) {
-      for (uint16 pivot_no = 0; pivot_no < trunk_num_children(spl, node);
-           pivot_no++) {
-         trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
-         page_handle      *leaf  = trunk_node_get(spl, pdata->addr);
-         trunk_node_claim(spl, &leaf);
-         trunk_node_lock(spl, leaf);
-         trunk_split_leaf(spl, node, leaf, pivot_no);
-      }
+      page_handle *child = trunk_node_get(spl, pdata->addr);
+      trunk_node_unget(spl, &node);
+      node = child;
    }
 
-   trunk_node_unlock(spl, node);
-   trunk_node_unclaim(spl, node);
-   trunk_node_unget(spl, &node);
-
-   task_perform_all(spl->ts);
+   // leaf btrees
+   trunk_range_iterator_collect_pivot_branches(
+      spl,
+      range_itor,
+      node,
+      trunk_get_pivot_data(spl, node, 0),
+      trunk_branch_count(spl, node),
+      prefix);
 
-   return TRUE;
-}
+   // have a leaf, use to get rebuild key
+   rc = trunk_range_iterator_set_leaf(
+      spl, range_itor, trunk_min_key(spl, node), trunk_max_key(spl, node));
 
+   trunk_node_unget(spl, &node);
 
-void
-trunk_force_flush(trunk_handle *spl)
-{
-   page_handle    *lock_page;
-   uint64          generation;
-   platform_status rc = memtable_maybe_rotate_and_get_insert_lock(
-      spl->mt_ctxt, &generation, &lock_page);
-   platform_assert_status_ok(rc);
-   task_perform_all(spl->ts);
-   memtable_unget_insert_lock(spl->mt_ctxt, lock_page);
-   task_perform_all(spl->ts);
-   trunk_for_each_node(spl, trunk_flush_node, NULL);
+   if (SUCCESS(rc)) {
+      rc = trunk_range_tombstone_set_copy(
+         spl,
+         &range_itor->range_tombstones,
+         &range_tombstones,
+         key_buffer_key(&range_itor->leaf_min_key),
+         key_buffer_key(&range_itor->local_max_key),
+         NULL,
+         NULL);
+   }
+   trunk_range_tombstone_set_deinit(spl, &range_tombstones);
+   return rc;
 }
 
-
 /*
- *-----------------------------------------------------------------------------
- * Splitting functions
- *-----------------------------------------------------------------------------
+ * Collects the branches of the snapshot covering the leaf containing target,
+ * or the leaf before it if comp is less_than, newest first. The snapshot
+ * keeps them alive.
  */
+static platform_status
+trunk_range_iterator_collect_snapshot_branches(trunk_handle         *spl,
+                                               trunk_range_iterator *range_itor,
+                                               key                   target,
+                                               lookup_type           comp)
+{
+   trunk_snapshot *snapshot          = range_itor->snapshot;
+   range_itor->memtable_start_gen    = 0;
+   range_itor->memtable_end_gen      = 0;
+   range_itor->num_memtable_branches = 0;
+
+   key leaf_min_key;
+   key leaf_max_key =
+      trunk_snapshot_collect_branches(snapshot,
+                                      target,
+                                      comp,
+                                      range_itor->branch,
+                                      &range_itor->num_branches,
+                                      &leaf_min_key);
+   for (uint64 i = 0; i < range_itor->num_branches; i++) {
+      range_itor->compacted[i] = TRUE;
+   }
+   platform_status rc = trunk_range_iterator_set_leaf(
+      spl, range_itor, leaf_min_key, leaf_max_key);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   return trunk_range_tombstone_set_copy(
+      spl,
+      &range_itor->range_tombstones,
+      &snapshot->range_tombstones,
+      key_buffer_key(&range_itor->leaf_min_key),
+      key_buffer_key(&range_itor->local_max_key),
+      NULL,
+      NULL);
+}
 
-static inline bool
-trunk_needs_split(trunk_handle *spl, page_handle *node)
+/*
+ * Returns the prefix every key in [min_key, max_key) of range_itor has: the
+ * prefix of a prefix iterator, or else the prefix of min_key if max_key has
+ * it too, since the keys with a prefix are contiguous. Returns NULL_KEY if
+ * there is none.
+ */
+static key
+trunk_range_iterator_scan_prefix(trunk_handle         *spl,
+                                 trunk_range_iterator *range_itor)
 {
-   if (trunk_is_leaf(spl, node)) {
-      uint64 num_tuples = trunk_pivot_num_tuples(spl, node, 0);
-      uint64 kv_bytes   = trunk_pivot_kv_bytes(spl, node, 0);
-      return num_tuples > spl->cfg.max_tuples_per_node
-             || kv_bytes > spl->cfg.max_kv_bytes_per_node
-             || trunk_logical_branch_count(spl, node)
-                   > spl->cfg.max_branches_per_node;
+   if (range_itor->has_prefix) {
+      return key_buffer_key(&range_itor->prefix);
    }
-   return trunk_num_children(spl, node) > spl->cfg.fanout;
+   key    min_key = key_buffer_key(&range_itor->min_key);
+   uint64 prefix_length =
+      data_key_prefix_length(spl->cfg.data_cfg, min_key);
+   if (prefix_length == 0) {
+      return NULL_KEY;
+   }
+   key prefix  = key_create(prefix_length, key_data(min_key));
+   key max_key = key_buffer_key(&range_itor->max_key);
+   if (!data_key_has_prefix(spl->cfg.data_cfg, max_key, prefix)) {
+      return NULL_KEY;
+   }
+   return prefix;
 }
 
-int
-trunk_split_index(trunk_handle *spl,
-                  page_handle  *parent,
-                  page_handle  *child,
-                  uint64        pivot_no)
+/*
+ * Loads the branches of the leaf containing min_key, or of the leaf before
+ * it if comp is less_than, reading from range_itor->snapshot if it is not
+ * NULL and from the current state of spl otherwise, and positions the merge
+ * iterator at min_key. With less_than, min_key is moved back to the start of
+ * the leaf first.
+ *
+ * Reverse iterators instead load the leaf holding the keys just below
+ * max_key and position the merge iterator at the largest of them.
+ *
+ * When all the keys in the range share a prefix, branches which the routing
+ * filters rule out holding it are not loaded.
+ */
+static platform_status
+trunk_range_iterator_load(trunk_handle         *spl,
+                          trunk_range_iterator *range_itor,
+                          key                   min_key,
+                          key                   max_key,
+                          uint64                num_tuples,
+                          lookup_type           comp)
 {
-   platform_stream_handle stream;
-   platform_status        rc = trunk_open_log_stream_if_enabled(spl, &stream);
-   platform_assert_status_ok(rc);
-   trunk_log_stream_if_enabled(spl,
-                               &stream,
-                               "split index %lu with parent %lu\n",
-                               child->disk_addr,
-                               parent->disk_addr);
-   trunk_log_node_if_enabled(&stream, spl, parent);
-   trunk_log_node_if_enabled(&stream, spl, child);
-   page_handle *left_node           = child;
-   uint16       target_num_children = trunk_num_children(spl, left_node) / 2;
-   uint16       height              = trunk_height(spl, left_node);
-
-   if (spl->cfg.use_stats)
-      spl->stats[platform_get_tid()].index_splits++;
-
-   // allocate right node and write lock it
-   page_handle *right_node = trunk_alloc(spl, height);
-   uint64       right_addr = right_node->disk_addr;
+   debug_assert(!key_is_null(min_key));
+   debug_assert(!key_is_null(max_key));
 
-   // ALEX: Maybe worth figuring out the real page size
-   memmove(right_node->data, left_node->data, trunk_page_size(&spl->cfg));
-   trunk_pivot_data *right_start_pivot =
-      trunk_get_pivot_data(spl, right_node, 0);
-   trunk_pivot_data *left_split_pivot =
-      trunk_get_pivot_data(spl, left_node, target_num_children);
-   uint16 pivots_to_copy =
-      trunk_num_pivot_keys(spl, left_node) - target_num_children;
-   size_t bytes_to_copy = pivots_to_copy * trunk_pivot_size(spl);
-   memmove(right_start_pivot, left_split_pivot, bytes_to_copy);
+   range_itor->spl          = spl;
+   range_itor->super.ops    = &trunk_range_iterator_ops;
+   range_itor->num_branches = 0;
+   range_itor->num_tuples   = num_tuples;
+   key_buffer_init_from_key(&range_itor->min_key, spl->heap_id, min_key);
+   key_buffer_init_from_key(&range_itor->max_key, spl->heap_id, max_key);
 
-   uint16 start_filter = trunk_start_sb_filter(spl, left_node);
-   uint16 end_filter   = trunk_end_sb_filter(spl, left_node);
-   for (uint16 filter_no = start_filter; filter_no != end_filter;
-        filter_no        = trunk_add_subbundle_filter_number(spl, filter_no, 1))
+   if (trunk_key_compare(spl, max_key, min_key) <= 0) {
+      range_itor->at_end = TRUE;
+      return STATUS_OK;
+   }
+   if (range_itor->has_prefix
+       && !data_key_has_prefix(
+          spl->cfg.data_cfg, min_key, key_buffer_key(&range_itor->prefix)))
    {
-      routing_filter *filter = trunk_get_sb_filter(spl, left_node, filter_no);
-      trunk_inc_filter(spl, filter);
+      // the keys with the prefix all sort before min_key
+      range_itor->at_end = TRUE;
+      return STATUS_OK;
    }
 
-   // set the headers appropriately
-   trunk_hdr *left_hdr  = (trunk_hdr *)left_node->data;
-   trunk_hdr *right_hdr = (trunk_hdr *)right_node->data;
-
-   right_hdr->num_pivot_keys = left_hdr->num_pivot_keys - target_num_children;
-   left_hdr->num_pivot_keys  = target_num_children + 1;
+   range_itor->at_end = FALSE;
 
-   right_hdr->next_addr = left_hdr->next_addr;
-   left_hdr->next_addr  = right_addr;
+   ZERO_ARRAY(range_itor->compacted);
+   ZERO_CONTENTS(&range_itor->range_tombstones);
+   ZERO_ARRAY(range_itor->branch);
 
-   left_hdr->generation++;
-   trunk_reset_start_branch(spl, right_node);
-   trunk_reset_start_branch(spl, left_node);
+   key target = key_buffer_key(&range_itor->min_key);
+   key prefix = NULL_KEY;
+   if (comp != less_than) {
+      prefix = trunk_range_iterator_scan_prefix(spl, range_itor);
+   }
+   if (range_itor->reverse) {
+      target = key_buffer_key(&range_itor->max_key);
+      comp   = less_than;
+   }
+   platform_status rc;
+   if (range_itor->snapshot == NULL) {
+      rc = trunk_range_iterator_collect_branches(
+         spl, range_itor, target, comp, prefix);
+   } else {
+      rc = trunk_range_iterator_collect_snapshot_branches(
+         spl, range_itor, target, comp);
+   }
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   if (comp == less_than && !range_itor->reverse) {
+      rc = key_buffer_copy_key(&range_itor->min_key,
+                               key_buffer_key(&range_itor->leaf_min_key));
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+   }
 
-   // fix the entries in the reclamation queue
-   uint16 right_num_children = trunk_num_children(spl, right_node);
-   for (uint16 pivot_no = 0; pivot_no < right_num_children; pivot_no++) {
-      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, right_node, pivot_no);
-      if (pdata->srq_idx != -1 && spl->cfg.reclaim_threshold != UINT64_MAX) {
-         // platform_default_log("Deleting %12lu-%lu (index %lu) from SRQ\n",
-         //       left_node->disk_addr, pdata->generation, pdata->srq_idx);
-         srq_data data_to_reinsert = srq_delete(&spl->srq, pdata->srq_idx);
-         data_to_reinsert.addr     = right_addr;
-         // platform_default_log("Reinserting %12lu-%lu into SRQ\n",
-         //       right_addr, pdata->generation);
-         pdata->srq_idx = srq_insert(&spl->srq, data_to_reinsert);
+   // reverse iterators stop at rebuild_key
+   key local_min_key = range_itor->reverse
+                          ? key_buffer_key(&range_itor->rebuild_key)
+                          : key_buffer_key(&range_itor->min_key);
+   key local_max_key = key_buffer_key(&range_itor->local_max_key);
+   for (uint64 i = 0; i < range_itor->num_branches; i++) {
+      uint64          branch_no  = range_itor->num_branches - i - 1;
+      btree_iterator *btree_itor = &range_itor->btree_itor[branch_no];
+      trunk_branch   *branch     = &range_itor->branch[branch_no];
+      if (range_itor->compacted[branch_no] && range_itor->reverse) {
+         trunk_branch_iterator_init_reverse(
+            spl, btree_itor, branch, local_min_key, local_max_key);
+         range_itor->itor[i] = &btree_itor->super;
+      } else if (range_itor->compacted[branch_no]) {
+         bool do_prefetch =
+            range_itor->compacted[branch_no] && num_tuples > TRUNK_PREFETCH_MIN
+               ? TRUE
+               : FALSE;
+         trunk_branch_iterator_init(spl,
+                                    btree_itor,
+                                    branch,
+                                    local_min_key,
+                                    local_max_key,
+                                    do_prefetch,
+                                    FALSE);
+         range_itor->itor[i] = &btree_itor->super;
+      } else {
+         memtable_iterator *mt_itor = &range_itor->memtable_itor[branch_no];
+         platform_status    rc      = trunk_memtable_iterator_init(
+            spl,
+            mt_itor,
+            range_itor->memtable_start_gen - branch_no,
+            local_min_key,
+            local_max_key,
+            range_itor->reverse,
+            FALSE);
+         if (!SUCCESS(rc)) {
+            return rc;
+         }
+         range_itor->itor[i] = memtable_iterator_get(mt_itor);
       }
+      range_itor->itor[i] = trunk_range_tombstone_iterator_init(
+         spl,
+         &range_itor->tombstone_itor[branch_no],
+         range_itor->itor[i],
+         &range_itor->range_tombstones,
+         branch->generation,
+         range_itor->reverse);
    }
 
-   // add right child to parent
-   rc = trunk_add_pivot(spl, parent, right_node, pivot_no + 1);
-   platform_assert(SUCCESS(rc));
-   trunk_pivot_recount_num_tuples_and_kv_bytes(spl, parent, pivot_no);
-   trunk_pivot_recount_num_tuples_and_kv_bytes(spl, parent, pivot_no + 1);
+   if (range_itor->reverse) {
+      return merge_iterator_create_reverse(spl->heap_id,
+                                           spl->cfg.data_cfg,
+                                           range_itor->num_branches,
+                                           range_itor->itor,
+                                           MERGE_FULL,
+                                           &range_itor->merge_itor);
+   }
+   return merge_iterator_create(spl->heap_id,
+                                spl->cfg.data_cfg,
+                                range_itor->num_branches,
+                                range_itor->itor,
+                                MERGE_FULL,
+                                &range_itor->merge_itor);
+}
 
-   trunk_log_stream_if_enabled(
-      spl, &stream, "----------------------------------------\n");
-   trunk_log_node_if_enabled(&stream, spl, parent);
-   trunk_log_node_if_enabled(&stream, spl, left_node);
-   trunk_log_node_if_enabled(&stream, spl, right_node);
-   trunk_close_log_stream_if_enabled(spl, &stream);
+/*
+ * Initializes range_itor at min_key, moving on to later leaves while the
+ * leaf containing min_key has nothing left. Reverse iterators start below
+ * max_key and move on to earlier leaves instead.
+ */
+static platform_status
+trunk_range_iterator_init_internal(trunk_handle         *spl,
+                                   trunk_range_iterator *range_itor,
+                                   key                   min_key,
+                                   key                   max_key,
+                                   uint64                num_tuples)
+{
+   platform_status rc = trunk_range_iterator_load(
+      spl, range_itor, min_key, max_key, num_tuples, less_than_or_equal);
+   if (!SUCCESS(rc) || range_itor->at_end) {
+      return rc;
+   }
+
+   bool at_end;
+   iterator_at_end(&range_itor->merge_itor->super, &at_end);
+
+   /*
+    * if the merge itor is already exhausted, and there are more keys in the
+    * db/range, move to next leaf. Once the range is exhausted rebuild_key is
+    * max_key (min_key for reverse iterators), so this leaves the iterator at
+    * end with its bounds set.
+    */
+   if (at_end) {
+      KEY_CREATE_LOCAL_COPY(rc,
+                            rebuild_key,
+                            spl->heap_id,
+                            key_buffer_key(&range_itor->rebuild_key));
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+      trunk_range_iterator_unload(range_itor);
+      if (range_itor->reverse) {
+         return trunk_range_iterator_init_internal(
+            spl, range_itor, min_key, rebuild_key, num_tuples);
+      }
+      return trunk_range_iterator_init_internal(
+         spl, range_itor, rebuild_key, max_key, num_tuples);
+   }
 
-   trunk_node_unlock(spl, right_node);
-   trunk_node_unclaim(spl, right_node);
-   trunk_node_unget(spl, &right_node);
+   return STATUS_OK;
+}
 
-   return 0;
+platform_status
+trunk_range_iterator_init(trunk_handle         *spl,
+                          trunk_range_iterator *range_itor,
+                          key                   min_key,
+                          key                   max_key,
+                          uint64                num_tuples)
+{
+   range_itor->snapshot   = NULL;
+   range_itor->reverse    = FALSE;
+   range_itor->has_prefix = FALSE;
+   return trunk_range_iterator_init_internal(
+      spl, range_itor, min_key, max_key, num_tuples);
 }
 
 /*
- * Estimate the number of unique keys in the pivot
+ * Initializes a range iterator returning the keys in [min_key, max_key) in
+ * descending order, starting at the largest key < max_key.
  */
-static inline uint64
-trunk_pivot_estimate_unique_keys(trunk_handle     *spl,
-                                 page_handle      *node,
-                                 trunk_pivot_data *pdata)
+platform_status
+trunk_range_iterator_init_reverse(trunk_handle         *spl,
+                                  trunk_range_iterator *range_itor,
+                                  key                   min_key,
+                                  key                   max_key,
+                                  uint64                num_tuples)
 {
-   routing_filter filter[MAX_FILTERS];
-   uint64         filter_no = 0;
-   filter[filter_no++]      = pdata->filter;
+   range_itor->snapshot   = NULL;
+   range_itor->reverse    = TRUE;
+   range_itor->has_prefix = FALSE;
+   return trunk_range_iterator_init_internal(
+      spl, range_itor, min_key, max_key, num_tuples);
+}
 
-   uint64 num_sb_fp     = 0;
-   uint64 num_sb_unique = 0;
-   for (uint16 sb_filter_no = trunk_start_sb_filter(spl, node);
-        sb_filter_no != trunk_end_sb_filter(spl, node);
-        sb_filter_no = trunk_add_subbundle_filter_number(spl, sb_filter_no, 1))
-   {
-      routing_filter *sb_filter = trunk_get_sb_filter(spl, node, sb_filter_no);
-      num_sb_fp += sb_filter->num_fingerprints;
-      num_sb_unique += sb_filter->num_unique;
-      filter[filter_no++] = *sb_filter;
+/*
+ * Ends a prefix iterator once it gets to a key without the prefix, which
+ * sorts after all the keys with it. The iterator is left at end with that
+ * key as its bounds.
+ */
+static platform_status
+trunk_range_iterator_check_prefix(trunk_range_iterator *range_itor)
+{
+   if (!range_itor->has_prefix || range_itor->at_end) {
+      return STATUS_OK;
    }
-
-   uint32 num_unique = routing_filter_estimate_unique_fp(
-      spl->cc, &spl->cfg.filter_cfg, spl->heap_id, filter, filter_no);
-
-   num_unique = routing_filter_estimate_unique_keys_from_count(
-      &spl->cfg.filter_cfg, num_unique);
-
-   uint64 num_leaf_sb_fp = 0;
-   for (uint16 bundle_no = pdata->start_bundle;
-        bundle_no != trunk_end_bundle(spl, node);
-        bundle_no = trunk_add_bundle_number(spl, bundle_no, 1))
+   trunk_handle *spl = range_itor->spl;
+   key           curr_key;
+   message       msg;
+   iterator_get_curr(&range_itor->merge_itor->super, &curr_key, &msg);
+   if (data_key_has_prefix(
+          spl->cfg.data_cfg, curr_key, key_buffer_key(&range_itor->prefix)))
    {
-      trunk_bundle *bundle = trunk_get_bundle(spl, node, bundle_no);
-      num_leaf_sb_fp += bundle->num_tuples;
+      return STATUS_OK;
    }
-   uint64 est_num_leaf_sb_unique = num_sb_unique * num_leaf_sb_fp / num_sb_fp;
-   uint64 est_num_non_leaf_sb_unique = num_sb_fp - est_num_leaf_sb_unique;
 
-   // platform_error_log("num_unique %u sb_fp %lu sb_unique %lu num_leaf_sb_fp
-   // %lu\n",
-   //       num_unique, num_sb_fp, num_sb_unique, num_leaf_sb_fp);
-   // platform_error_log("est_leaf_sb_fp %lu est_non_leaf_sb_unique %lu\n",
-   //       est_num_leaf_sb_unique, est_num_non_leaf_sb_unique);
-   uint64 est_leaf_unique = num_unique - est_num_non_leaf_sb_unique;
-   return est_leaf_unique;
+   platform_status rc;
+   KEY_CREATE_LOCAL_COPY(rc, end_key, spl->heap_id, curr_key);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   trunk_range_iterator_unload(range_itor);
+   return trunk_range_iterator_load(spl,
+                                    range_itor,
+                                    end_key,
+                                    end_key,
+                                    range_itor->num_tuples,
+                                    less_than_or_equal);
 }
 
 /*
- *----------------------------------------------------------------------
- * trunk_single_leaf_threshold --
- *
- *      Returns an upper bound for the number of estimated tuples for which a
- *      leaf split can output a single leaf.
- *----------------------------------------------------------------------
+ * Initializes a range iterator returning the keys whose prefix (see
+ * data_config.key_prefix_length) is prefix, which must be its own prefix.
+ * The trunk branches which the routing filters rule out holding keys with
+ * the prefix are not read.
  */
-static inline uint64
-trunk_single_leaf_threshold(trunk_handle *spl)
+platform_status
+trunk_range_iterator_init_prefix(trunk_handle         *spl,
+                                 trunk_range_iterator *range_itor,
+                                 key                   prefix,
+                                 uint64                num_tuples)
 {
-   return TRUNK_SINGLE_LEAF_THRESHOLD_PCT * spl->cfg.max_tuples_per_node / 100;
+   if (!data_key_has_prefix(spl->cfg.data_cfg, prefix, prefix)) {
+      return STATUS_BAD_PARAM;
+   }
+   platform_status rc =
+      key_buffer_init_from_key(&range_itor->prefix, spl->heap_id, prefix);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   range_itor->snapshot   = NULL;
+   range_itor->reverse    = FALSE;
+   range_itor->has_prefix = TRUE;
+   rc = trunk_range_iterator_init_internal(spl,
+                                           range_itor,
+                                           key_buffer_key(&range_itor->prefix),
+                                           POSITIVE_INFINITY_KEY,
+                                           num_tuples);
+   if (!SUCCESS(rc)) {
+      key_buffer_deinit(&range_itor->prefix);
+      return rc;
+   }
+   return trunk_range_iterator_check_prefix(range_itor);
 }
 
 /*
- *----------------------------------------------------------------------
- * split_leaf splits a trunk leaf logically. It determines pivots to split
- * on, uses them to split the leaf and adds them to its parent. It then
- * issues compact_bundle jobs on each leaf to perform the actual compaction.
- *
- * Must be called with a lock on both the parent and child
- * Returns with lock on parent and releases child and all new leaves
- * The algorithm tries to downgrade to a claim as much as possible throughout
- *
- * The main loop starts with the current leaf (initially the original leaf),
- * then uses the rough iterator to find the next pivot. It copies the current
- * leaf to a new leaf, and sets the end key of the current leaf and start key
- * of the new leaf to the pivot. It then issues a compact_bundle job on the
- * current leaf and releases it. Finally, the loop continues with the new
- * leaf as current.
- *
- * Algorithm:
- * 1. Create a rough merge iterator on all the branches
- * 2. Use rough merge iterator to determine pivots for new leaves
- * 3. Clear old bundles from leaf and put all branches in a new bundle
- * 4. Create new leaf, adjust min/max keys and other metadata
- * 5. Add new leaf to parent
- * 6. Issue compact_bundle for last_leaf and release
- * 7. Repeat 4-6 on new leaf
- * 8. Clean up
- *----------------------------------------------------------------------
+ * Initializes a range iterator over [min_key, max_key) of snapshot. It must
+ * be deinitialized before the snapshot is released.
  */
-void
-trunk_split_leaf(trunk_handle *spl,
-                 page_handle  *parent,
-                 page_handle  *leaf,
-                 uint16        child_idx)
+platform_status
+trunk_snapshot_range_iterator_init(trunk_snapshot       *snapshot,
+                                   trunk_range_iterator *range_itor,
+                                   key                   min_key,
+                                   key                   max_key,
+                                   uint64                num_tuples)
 {
-   const threadid      tid = platform_get_tid();
-   trunk_task_scratch *task_scratch =
-      task_system_get_thread_scratch(spl->ts, tid);
-   split_leaf_scratch *scratch      = &task_scratch->split_leaf;
-   uint64              num_branches = trunk_branch_count(spl, leaf);
-   uint64              start_branch = trunk_start_branch(spl, leaf);
-
-   trunk_node_unlock(spl, parent);
-   trunk_node_unlock(spl, leaf);
-
-   platform_stream_handle stream;
-   platform_status        rc = trunk_open_log_stream_if_enabled(spl, &stream);
-   platform_assert_status_ok(rc);
-   trunk_log_stream_if_enabled(
-      spl, &stream, "split_leaf addr %lu\n", leaf->disk_addr);
+   range_itor->snapshot   = snapshot;
+   range_itor->reverse    = FALSE;
+   range_itor->has_prefix = FALSE;
+   return trunk_range_iterator_init_internal(
+      snapshot->spl, range_itor, min_key, max_key, num_tuples);
+}
 
-   uint64 split_start;
-   if (spl->cfg.use_stats) {
-      spl->stats[tid].leaf_splits++;
-      split_start = platform_get_timestamp();
-   }
+void
+trunk_range_iterator_get_curr(iterator *itor, key *curr_key, message *data)
+{
+   debug_assert(itor != NULL);
+   trunk_range_iterator *range_itor = (trunk_range_iterator *)itor;
+   iterator_get_curr(&range_itor->merge_itor->super, curr_key, data);
+}
 
-   trunk_pivot_data *pdata = trunk_get_pivot_data(spl, leaf, 0);
-   uint64            estimated_unique_keys =
-      trunk_pivot_estimate_unique_keys(spl, leaf, pdata);
-   uint64 num_tuples = trunk_pivot_num_tuples(spl, leaf, 0);
-   if (estimated_unique_keys > num_tuples * 19 / 20) {
-      estimated_unique_keys = num_tuples;
+/*
+ * Moves on to the next leaf once the merge iterator is exhausted, which is
+ * the leaf before the current one for reverse iterators.
+ */
+static platform_status
+trunk_range_iterator_next_leaf(trunk_range_iterator *range_itor)
+{
+   key next_min_key = key_buffer_key(&range_itor->rebuild_key);
+   key next_max_key = key_buffer_key(&range_itor->max_key);
+   if (range_itor->reverse) {
+      next_min_key = key_buffer_key(&range_itor->min_key);
+      next_max_key = key_buffer_key(&range_itor->rebuild_key);
    }
-   trunk_compaction_type comp_type = TRUNK_COMPACTION_TYPE_LEAF_SPLIT;
-   uint64                kv_bytes  = trunk_pivot_kv_bytes(spl, leaf, 0);
-   uint64                estimated_unique_kv_bytes =
-      estimated_unique_keys * kv_bytes / num_tuples;
-   uint64 target_num_leaves =
-      estimated_unique_kv_bytes / spl->cfg.target_leaf_kv_bytes;
-   if (target_num_leaves <= 1) {
-      if (estimated_unique_keys > trunk_single_leaf_threshold(spl)) {
-         target_num_leaves = 2;
-      } else {
-         target_num_leaves = 1;
-         comp_type         = TRUNK_COMPACTION_TYPE_SINGLE_LEAF_SPLIT;
-         if (spl->cfg.use_stats) {
-            spl->stats[tid].single_leaf_splits++;
-         }
-      }
+   platform_status rc;
+   KEY_CREATE_LOCAL_COPY(rc, min_key, range_itor->spl->heap_id, next_min_key);
+   if (!SUCCESS(rc)) {
+      return rc;
    }
-   uint64 target_leaf_kv_bytes = kv_bytes / target_num_leaves;
-   uint16 num_leaves;
-
-   // copy pivot (in parent) of leaf
-   key_buffer_init_from_key(
-      &scratch->pivot[0], spl->heap_id, trunk_min_key(spl, leaf));
-
-   uint64 leaf0_num_tuples = estimated_unique_keys;
-   uint64 leaf0_kv_bytes   = estimated_unique_kv_bytes;
-
-   if (target_num_leaves != 1) {
-      /*
-       * 1. Create a rough merge iterator on all the branches
-       *
-       *    A rough merge iterator is a merge iterator on height 1
-       * btree iterators. It uses height 1 pivots as a proxy for
-       * a count of tuples.
-       *
-       *    This count is an estimate with multiple sources of error:
-       *       -- Last leaves in each btree are not counted
-       *          (there is no upper bound pivot)
-       *       -- A selected pivot from a branch may be between pivots for other
-       *          branches
-       *       -- min_key may be between pivots
-       *       -- updates and deletes may be resolved resulting in fewer output
-       *          tuples
-       */
-      platform_assert(num_branches <= ARRAY_SIZE(scratch->btree_itor));
-      btree_iterator *rough_btree_itor = scratch->btree_itor;
-      iterator      **rough_itor       = scratch->rough_itor;
-
-      key             pivot0 = trunk_get_pivot(spl, leaf, 0);
-      key             pivot1 = trunk_get_pivot(spl, leaf, 1);
-      platform_status rc1, rc2;
-      KEY_CREATE_LOCAL_COPY(rc1, min_key, spl->heap_id, pivot0);
-      KEY_CREATE_LOCAL_COPY(rc2, max_key, spl->heap_id, pivot1);
-      platform_assert_status_ok(rc1);
-      platform_assert_status_ok(rc2);
-
-      for (uint64 branch_offset = 0; branch_offset < num_branches;
-           branch_offset++) {
-         uint64 branch_no =
-            trunk_add_branch_number(spl, start_branch, branch_offset);
-         debug_assert(branch_no != trunk_end_branch(spl, leaf));
-         trunk_branch *branch = trunk_get_branch(spl, leaf, branch_no);
-         btree_iterator_init(spl->cc,
-                             &spl->cfg.btree_cfg,
-                             &rough_btree_itor[branch_offset],
-                             branch->root_addr,
-                             PAGE_TYPE_BRANCH,
-                             min_key,
-                             max_key,
-                             TRUE,
-                             1);
-         rough_itor[branch_offset] = &rough_btree_itor[branch_offset].super;
-      }
-
-      merge_iterator *rough_merge_itor;
-      platform_status rc = merge_iterator_create(spl->heap_id,
-                                                 spl->cfg.data_cfg,
-                                                 num_branches,
-                                                 rough_itor,
-                                                 MERGE_RAW,
-                                                 &rough_merge_itor);
-      platform_assert_status_ok(rc);
-
-      /*
-       * 2. Use rough merge iterator to determine pivots for new leaves
-       */
+   KEY_CREATE_LOCAL_COPY(rc, max_key, range_itor->spl->heap_id, next_max_key);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   trunk_range_iterator_unload(range_itor);
+   rc = trunk_range_iterator_init_internal(range_itor->spl,
+                                           range_itor,
+                                           min_key,
+                                           max_key,
+                                           range_itor->num_tuples);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   if (!range_itor->at_end) {
       bool at_end;
-      rc = iterator_at_end(&rough_merge_itor->super, &at_end);
-      platform_assert_status_ok(rc);
+      iterator_at_end(&range_itor->merge_itor->super, &at_end);
+      platform_assert(!at_end);
+   }
+   return STATUS_OK;
+}
 
-      uint64 rough_count_kv_bytes;
-      uint64 rough_count_num_tuples;
-      for (num_leaves = 0; !at_end; num_leaves++) {
-         rough_count_num_tuples = 0;
-         rough_count_kv_bytes   = 0;
-         while (!at_end
-                && (rough_count_kv_bytes < target_leaf_kv_bytes
-                    || num_leaves == target_num_leaves - 1))
-         {
-            key     curr_key;
-            message pivot_data_message;
-            iterator_get_curr(
-               &rough_merge_itor->super, &curr_key, &pivot_data_message);
+platform_status
+trunk_range_iterator_advance(iterator *itor)
+{
+   debug_assert(itor != NULL);
+   trunk_range_iterator *range_itor = (trunk_range_iterator *)itor;
+   iterator_advance(&range_itor->merge_itor->super);
+   range_itor->num_tuples++;
+   bool at_end;
+   iterator_at_end(&range_itor->merge_itor->super, &at_end);
+   // robj: shouldn't this be a while loop, like in the init function?
+   if (at_end) {
+      platform_status rc = trunk_range_iterator_next_leaf(range_itor);
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+   }
 
-            const btree_pivot_data *pivot_data =
-               message_data(pivot_data_message);
-            rough_count_num_tuples += pivot_data->stats.num_kvs;
-            rough_count_kv_bytes +=
-               pivot_data->stats.key_bytes + pivot_data->stats.message_bytes;
-            iterator_advance(&rough_merge_itor->super);
-            iterator_at_end(&rough_merge_itor->super, &at_end);
-         }
+   return trunk_range_iterator_check_prefix(range_itor);
+}
 
-         if (num_leaves == 0) {
-            leaf0_num_tuples = rough_count_num_tuples;
-            leaf0_kv_bytes   = rough_count_kv_bytes;
-         }
+/*
+ * Repositions range_itor at the first key >= target, which may be anywhere
+ * below max_key, or at the largest key < target, which may be anywhere above
+ * min_key, for reverse iterators. Within the current leaf this reuses the
+ * branch iterators and the merge iterator instead of collecting the branches
+ * again.
+ */
+platform_status
+trunk_range_iterator_seek(iterator *itor, key target)
+{
+   debug_assert(itor != NULL);
+   trunk_range_iterator *range_itor = (trunk_range_iterator *)itor;
+   trunk_handle         *spl        = range_itor->spl;
 
-         if (!at_end) {
-            key     curr_key;
-            message dummy_data;
-            iterator_get_curr(&rough_merge_itor->super, &curr_key, &dummy_data);
-            debug_assert(key_length(curr_key) <= trunk_max_key_size(spl));
-            // copy new pivot (in parent) of new leaf
-            key_buffer_init_from_key(
-               &scratch->pivot[num_leaves + 1], spl->heap_id, curr_key);
+   // target may point into the current tuple
+   platform_status rc;
+   KEY_CREATE_LOCAL_COPY(rc, seek_key, spl->heap_id, target);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   // prefix iterators start at their prefix
+   if (range_itor->has_prefix
+       && trunk_key_compare(
+             spl, seek_key, key_buffer_key(&range_itor->prefix))
+             < 0)
+   {
+      seek_key = key_buffer_key(&range_itor->prefix);
+   }
+
+   bool in_leaf = FALSE;
+   if (!range_itor->at_end && range_itor->reverse) {
+      in_leaf =
+         trunk_key_compare(
+            spl, key_buffer_key(&range_itor->rebuild_key), seek_key)
+            < 0
+         && trunk_key_compare(
+               spl, seek_key, key_buffer_key(&range_itor->local_max_key))
+               <= 0;
+   } else if (!range_itor->at_end) {
+      in_leaf =
+         trunk_key_compare(
+            spl, key_buffer_key(&range_itor->leaf_min_key), seek_key)
+            <= 0
+         && trunk_key_compare(
+               spl, seek_key, key_buffer_key(&range_itor->local_max_key))
+               < 0;
+   }
+   if (in_leaf) {
+      rc = iterator_seek(&range_itor->merge_itor->super, seek_key);
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+      bool at_end;
+      iterator_at_end(&range_itor->merge_itor->super, &at_end);
+      if (at_end) {
+         rc = trunk_range_iterator_next_leaf(range_itor);
+         if (!SUCCESS(rc)) {
+            return rc;
          }
       }
+      return trunk_range_iterator_check_prefix(range_itor);
+   }
 
-      // clean up the iterators
-      rc = merge_iterator_destroy(spl->heap_id, &rough_merge_itor);
-      platform_assert_status_ok(rc);
-      for (uint64 i = 0; i < num_branches; i++) {
-         btree_iterator_deinit(&rough_btree_itor[i]);
+   if (range_itor->reverse) {
+      KEY_CREATE_LOCAL_COPY(
+         rc, min_key, spl->heap_id, key_buffer_key(&range_itor->min_key));
+      if (!SUCCESS(rc)) {
+         return rc;
       }
-   } else {
-      num_leaves = 1;
+      trunk_range_iterator_unload(range_itor);
+      return trunk_range_iterator_init_internal(
+         spl, range_itor, min_key, seek_key, range_itor->num_tuples);
    }
+   KEY_CREATE_LOCAL_COPY(
+      rc, max_key, spl->heap_id, key_buffer_key(&range_itor->max_key));
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   trunk_range_iterator_unload(range_itor);
+   rc = trunk_range_iterator_init_internal(
+      spl, range_itor, seek_key, max_key, range_itor->num_tuples);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
+   return trunk_range_iterator_check_prefix(range_itor);
+}
 
-   // copy max key of last new leaf (max key of leaf)
-   key_buffer_init_from_key(
-      &scratch->pivot[num_leaves], spl->heap_id, trunk_max_key(spl, leaf));
-
-   platform_assert(num_leaves + trunk_num_pivot_keys(spl, parent)
-                   <= spl->cfg.max_pivot_keys);
-
-   /*
-    * 3. Clear old bundles from leaf and put all branches in a new bundle
-    */
-   trunk_node_lock(spl, parent);
-   trunk_log_node_if_enabled(&stream, spl, parent);
-   trunk_node_lock(spl, leaf);
-   trunk_log_node_if_enabled(&stream, spl, leaf);
-
-   uint16 bundle_no = trunk_leaf_rebundle_all_branches(
-      spl, leaf, leaf0_num_tuples, leaf0_kv_bytes, FALSE);
-   trunk_inc_generation(spl, leaf);
-   uint64 last_next_addr = trunk_next_addr(spl, leaf);
+/*
+ * Moves range_itor back to the largest key smaller than its current one.
+ * The branches of the current leaf are searched for the candidate, which is
+ * then sought to, so each step costs about as much as a seek; earlier leaves
+ * are loaded as needed. Moving back from the smallest key leaves the
+ * iterator at end. Reverse and prefix iterators cannot move back.
+ */
+platform_status
+trunk_range_iterator_prev(trunk_range_iterator *range_itor)
+{
+   trunk_handle *spl = range_itor->spl;
+   debug_assert(!range_itor->at_end);
+   if (range_itor->reverse || range_itor->has_prefix) {
+      return STATUS_BAD_PARAM;
+   }
 
-   for (uint16 leaf_no = 0; leaf_no < num_leaves; leaf_no++) {
-      /*
-       * 4. Create new leaf, adjust min/max keys and other metadata
-       *
-       *    Have lock on leaf (original leaf or last iteration) and parent
-       *    This loop :
-       *    1. allocates new_leaf
-       *    2. copies leaf to new_leaf
-       *    3. sets min_key and max_key on new_leaf
-       *    4. sets next_addr on leaf
-       *    5. incs all branches ref counts
-       *    6. sets new_leaf tuple_count
-       *    7. adds new_leaf to parent
-       */
+   iterator *merge_itor = &range_itor->merge_itor->super;
+   key       curr_key;
+   message   msg;
+   iterator_get_curr(merge_itor, &curr_key, &msg);
 
-      page_handle *new_leaf;
-      if (leaf_no != 0) {
-         // allocate a new leaf
-         new_leaf = trunk_alloc(spl, 0);
+   DECLARE_AUTO_KEY_BUFFER(target, spl->heap_id);
+   DECLARE_AUTO_KEY_BUFFER(prev, spl->heap_id);
+   platform_status rc = key_buffer_copy_key(&target, curr_key);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
 
-         // copy leaf to new leaf
-         memmove(new_leaf->data, leaf->data, trunk_page_size(&spl->cfg));
-      } else {
-         // just going to edit the min/max keys, etc. of original leaf
-         new_leaf = leaf;
+   while (TRUE) {
+      bool found;
+      rc = iterator_prev_key(
+         merge_itor, key_buffer_key(&target), &prev, &found);
+      if (!SUCCESS(rc)) {
+         return rc;
       }
-
-      /* Adjust max key first so that we always have ordered pivots (enforced by
-       * trunk_set_pivot in debug mode) */
-      // adjust max key
-      trunk_set_pivot(
-         spl, new_leaf, 1, key_buffer_key(&scratch->pivot[leaf_no + 1]));
-      // adjust min key
-      trunk_set_pivot(
-         spl, new_leaf, 0, key_buffer_key(&scratch->pivot[leaf_no]));
-
-      // set new_leaf tuple_count
-      trunk_bundle *bundle = trunk_get_bundle(spl, new_leaf, bundle_no);
-      uint64        new_leaf_num_tuples[TRUNK_MAX_PIVOTS];
-      uint64        new_leaf_kv_bytes[TRUNK_MAX_PIVOTS];
-      trunk_tuples_in_bundle(
-         spl, new_leaf, bundle, new_leaf_num_tuples, new_leaf_kv_bytes);
-      trunk_pivot_clear_counts(spl, new_leaf, 0);
-      trunk_pivot_set_bundle_counts(
-         spl, new_leaf, 0, new_leaf_num_tuples[0], new_leaf_kv_bytes[0]);
-
-      if (leaf_no != 0) {
-         // set next_addr of leaf
-         trunk_set_next_addr(spl, leaf, new_leaf->disk_addr);
-
-         // inc the refs of all the branches
-         for (uint16 branch_no = trunk_start_branch(spl, new_leaf);
-              branch_no != trunk_end_branch(spl, new_leaf);
-              branch_no = trunk_add_branch_number(spl, branch_no, 1))
-         {
-            trunk_branch *branch  = trunk_get_branch(spl, new_leaf, branch_no);
-            key           min_key = trunk_min_key(spl, new_leaf);
-            trunk_inc_intersection(spl, branch, min_key, FALSE);
+      if (found
+          && trunk_key_compare(spl,
+                               key_buffer_key(&range_itor->leaf_min_key),
+                               key_buffer_key(&prev))
+                <= 0)
+      {
+         rc = iterator_seek(merge_itor, key_buffer_key(&prev));
+         if (!SUCCESS(rc)) {
+            return rc;
          }
-
-         // inc the refs of all the filters
-         trunk_bundle *bundle = trunk_get_bundle(spl, new_leaf, bundle_no);
-         uint16 start_filter = trunk_bundle_start_filter(spl, new_leaf, bundle);
-         uint16 end_filter   = trunk_bundle_end_filter(spl, new_leaf, bundle);
-         for (uint16 filter_no = start_filter; filter_no != end_filter;
-              filter_no = trunk_add_subbundle_filter_number(spl, filter_no, 1))
-         {
-            routing_filter *filter =
-               trunk_get_sb_filter(spl, new_leaf, filter_no);
-            trunk_inc_filter(spl, filter);
+         bool at_end;
+         iterator_at_end(merge_itor, &at_end);
+         if (!at_end) {
+            iterator_get_curr(merge_itor, &curr_key, &msg);
+            if (trunk_key_compare(spl, curr_key, key_buffer_key(&target))
+                < 0)
+            {
+               return STATUS_OK;
+            }
          }
+         // the messages of prev merge into a delete, keep going back
+         rc = key_buffer_copy_key(&target, key_buffer_key(&prev));
+         if (!SUCCESS(rc)) {
+            return rc;
+         }
+         continue;
+      }
 
-         /*
-          * 5. Add new leaf to parent
-          */
-         platform_status rc =
-            trunk_add_pivot(spl, parent, new_leaf, child_idx + leaf_no);
-         platform_assert(SUCCESS(rc));
+      // nothing left in this leaf, so continue in the leaf before it
+      KEY_CREATE_LOCAL_COPY(
+         rc, max_key, spl->heap_id, key_buffer_key(&range_itor->max_key));
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+      key leaf_min_key = key_buffer_key(&range_itor->leaf_min_key);
+      if (key_is_negative_infinity(leaf_min_key)) {
+         trunk_range_iterator_unload(range_itor);
+         return trunk_range_iterator_load(spl,
+                                          range_itor,
+                                          max_key,
+                                          max_key,
+                                          range_itor->num_tuples,
+                                          less_than_or_equal);
+      }
+      rc = key_buffer_copy_key(&target, leaf_min_key);
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+      trunk_range_iterator_unload(range_itor);
+      rc = trunk_range_iterator_load(spl,
+                                     range_itor,
+                                     key_buffer_key(&target),
+                                     max_key,
+                                     range_itor->num_tuples,
+                                     less_than);
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+      merge_itor = &range_itor->merge_itor->super;
+   }
+}
 
-         /*
-          * 6. Issue compact_bundle for leaf and release
-          */
-         trunk_compact_bundle_req *req = TYPED_ZALLOC(spl->heap_id, req);
-         req->spl                      = spl;
-         req->addr                     = leaf->disk_addr;
-         req->type                     = comp_type;
-         req->bundle_no                = bundle_no;
-         req->generation               = trunk_generation(spl, leaf);
-         req->max_pivot_generation     = trunk_pivot_generation(spl, leaf);
-         req->pivot_generation[0]      = trunk_pivot_generation(spl, leaf) - 1;
-         req->input_pivot_tuple_count[0] = trunk_pivot_num_tuples(spl, leaf, 0);
-         req->input_pivot_kv_byte_count[0] = trunk_pivot_kv_bytes(spl, leaf, 0);
+platform_status
+trunk_range_iterator_at_end(iterator *itor, bool *at_end)
+{
+   debug_assert(itor != NULL);
+   trunk_range_iterator *range_itor = (trunk_range_iterator *)itor;
+
+   *at_end = range_itor->at_end;
+   return STATUS_OK;
+}
+
+/*
+ * Releases what range_itor holds for the leaf being iterated, leaving only
+ * what survives moving to another leaf.
+ */
+static void
+trunk_range_iterator_unload(trunk_range_iterator *range_itor)
+{
+   // If the iterator is at end, then only its bounds are left
+   if (range_itor->at_end) {
+      key_buffer_deinit(&range_itor->min_key);
+      key_buffer_deinit(&range_itor->max_key);
+      return;
+   }
+   trunk_handle *spl = range_itor->spl;
+   merge_iterator_destroy(range_itor->spl->heap_id, &range_itor->merge_itor);
+   for (uint64 i = 0; i < range_itor->num_branches; i++) {
+      btree_iterator *btree_itor = &range_itor->btree_itor[i];
+      if (range_itor->compacted[i]) {
+         uint64 root_addr = btree_itor->root_addr;
+         trunk_branch_iterator_deinit(spl, btree_itor, FALSE);
+         if (range_itor->snapshot == NULL) {
+            btree_unblock_dec_ref(spl->cc, &spl->cfg.btree_cfg, root_addr);
+         }
+      } else {
+         uint64 mt_gen = range_itor->memtable_start_gen - i;
+         trunk_memtable_iterator_deinit(
+            spl, &range_itor->memtable_itor[i], mt_gen, FALSE);
+         trunk_memtable_dec_ref(spl, mt_gen);
+      }
+   }
 
-         trunk_default_log_if_enabled(spl,
-                                      "enqueuing compact_bundle %lu-%u\n",
-                                      req->addr,
-                                      req->bundle_no);
-         rc = task_enqueue(
-            spl->ts, TASK_TYPE_NORMAL, trunk_compact_bundle, req, FALSE);
-         platform_assert(SUCCESS(rc));
+   key_buffer_deinit(&range_itor->min_key);
+   key_buffer_deinit(&range_itor->max_key);
+   key_buffer_deinit(&range_itor->leaf_min_key);
+   key_buffer_deinit(&range_itor->local_max_key);
+   key_buffer_deinit(&range_itor->rebuild_key);
+   trunk_range_tombstone_set_deinit(spl, &range_itor->range_tombstones);
+}
 
-         trunk_log_node_if_enabled(&stream, spl, leaf);
+void
+trunk_range_iterator_deinit(trunk_range_iterator *range_itor)
+{
+   trunk_range_iterator_unload(range_itor);
+   if (range_itor->has_prefix) {
+      key_buffer_deinit(&range_itor->prefix);
+   }
+}
 
-         debug_assert(trunk_verify_node(spl, leaf));
-         trunk_node_unlock(spl, leaf);
-         trunk_node_unclaim(spl, leaf);
-         trunk_node_unget(spl, &leaf);
+/*
+ * Given a node addr and pivot generation, find the pivot with that generation
+ * among the node and its split descendents
+ *
+ * Returns node with a write loc
+ */
+trunk_pivot_data *
+trunk_find_pivot_from_generation(trunk_handle *spl,
+                                 page_handle  *leaf,
+                                 uint64        pivot_generation)
+{
+   uint16 num_children = trunk_num_children(spl, leaf);
+   for (uint16 pivot_no = 0; pivot_no < num_children; pivot_no++) {
+      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, leaf, pivot_no);
+      if (pivot_generation == pdata->generation) {
+         return pdata;
       }
-
-      leaf = new_leaf;
    }
+   return NULL;
+}
 
-   for (uint16 leaf_no = 0; leaf_no <= num_leaves; leaf_no++) {
-      key_buffer_deinit(&scratch->pivot[leaf_no]);
+platform_status
+trunk_compact_leaf(trunk_handle *spl, page_handle *leaf)
+{
+   const threadid tid = platform_get_tid();
+
+   platform_stream_handle stream;
+   platform_status        rc = trunk_open_log_stream_if_enabled(spl, &stream);
+   platform_assert_status_ok(rc);
+   trunk_log_stream_if_enabled(
+      spl, &stream, "compact_leaf addr %lu\n", leaf->disk_addr);
+   trunk_log_node_if_enabled(&stream, spl, leaf);
+
+   uint64 sr_start;
+   if (spl->cfg.use_stats) {
+      spl->stats[tid].space_recs[0]++;
+      sr_start = platform_get_timestamp();
    }
 
-   // set next_addr of leaf (from last iteration)
-   trunk_set_next_addr(spl, leaf, last_next_addr);
+   // Clear old bundles from leaf and put all branches in a new bundle
+   uint64 num_tuples = trunk_pivot_num_tuples(spl, leaf, 0);
+   uint64 kv_bytes   = trunk_pivot_kv_bytes(spl, leaf, 0);
+   uint16 bundle_no =
+      trunk_leaf_rebundle_all_branches(spl, leaf, num_tuples, kv_bytes, TRUE);
+   trunk_inc_generation(spl, leaf);
+
+   // Issue compact_bundle for leaf and release
    trunk_compact_bundle_req *req = TYPED_ZALLOC(spl->heap_id, req);
    req->spl                      = spl;
    req->addr                     = leaf->disk_addr;
@@ -5583,22 +8799,16 @@ trunk_split_leaf(trunk_handle *spl,
    req->pivot_generation[0]          = trunk_pivot_generation(spl, leaf) - 1;
    req->input_pivot_tuple_count[0]   = trunk_pivot_num_tuples(spl, leaf, 0);
    req->input_pivot_kv_byte_count[0] = trunk_pivot_kv_bytes(spl, leaf, 0);
-   req->type                         = comp_type;
+   req->type                         = TRUNK_COMPACTION_TYPE_SPACE_REC;
 
-   // issue compact_bundle for leaf and release
    trunk_default_log_if_enabled(
       spl, "enqueuing compact_bundle %lu-%u\n", req->addr, req->bundle_no);
-   rc =
-      task_enqueue(spl->ts, TASK_TYPE_NORMAL, trunk_compact_bundle, req, FALSE);
+   rc = trunk_enqueue_compact_req(spl, trunk_compact_bundle, req, FALSE);
    platform_assert(SUCCESS(rc));
 
-   trunk_log_node_if_enabled(&stream, spl, parent);
    trunk_log_node_if_enabled(&stream, spl, leaf);
 
    debug_assert(trunk_verify_node(spl, leaf));
-   trunk_node_unlock(spl, leaf);
-   trunk_node_unclaim(spl, leaf);
-   trunk_node_unget(spl, &leaf);
 
    /*
     * 8. Clean up
@@ -5607,610 +8817,1018 @@ trunk_split_leaf(trunk_handle *spl,
 
    if (spl->cfg.use_stats) {
       // Doesn't include the original leaf
-      spl->stats[tid].leaf_splits_leaves_created += num_leaves - 1;
-      uint64 split_time = platform_timestamp_elapsed(split_start);
-      spl->stats[tid].leaf_split_time_ns += split_time;
-      platform_timestamp_elapsed(split_start);
-      if (split_time > spl->stats[tid].leaf_split_max_time_ns) {
-         spl->stats[tid].leaf_split_max_time_ns = split_time;
+      uint64 sr_time = platform_timestamp_elapsed(sr_start);
+      spl->stats[tid].space_rec_time_ns[0] += sr_time;
+   }
+
+   return STATUS_OK;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Space reclamation
+ *-----------------------------------------------------------------------------
+ */
+bool
+trunk_should_reclaim_space(trunk_handle *spl)
+{
+   if (spl->cfg.reclaim_threshold == UINT64_MAX) {
+      return FALSE;
+   }
+   if (spl->cfg.reclaim_threshold == 0) {
+      return TRUE;
+   }
+   uint64 in_use         = allocator_in_use(spl->al);
+   bool   should_reclaim = in_use > spl->cfg.reclaim_threshold;
+   return should_reclaim;
+}
+
+platform_status
+trunk_reclaim_space(trunk_handle *spl)
+{
+   platform_assert(spl->cfg.reclaim_threshold != UINT64_MAX);
+   while (TRUE) {
+      // platform_default_log("Extract from SRQ\n");
+      srq_data space_rec = srq_extract_max(&spl->srq);
+      if (!srq_data_found(&space_rec)) {
+         return STATUS_NOT_FOUND;
+      }
+      page_handle *node = trunk_node_get(spl, space_rec.addr);
+      trunk_node_claim(spl, &node);
+      trunk_pivot_data *pdata = trunk_find_pivot_from_generation(
+         spl, node, space_rec.pivot_generation);
+      if (pdata == NULL) {
+         trunk_node_unclaim(spl, node);
+         trunk_node_unget(spl, &node);
+         continue;
+      }
+      pdata->srq_idx = -1;
+
+      // platform_default_log("Space rec: %lu-%u\n",
+      //       node->disk_addr, trunk_pdata_to_pivot_index(spl, node,
+      //       pdata));
+
+      trunk_node_lock(spl, node);
+      if (trunk_is_leaf(spl, node)) {
+         trunk_compact_leaf(spl, node);
+      } else {
+         uint64 sr_start;
+         if (spl->cfg.use_stats) {
+            sr_start = platform_get_timestamp();
+         }
+         platform_status rc = trunk_flush(spl, node, pdata, TRUE);
+         if (spl->cfg.use_stats) {
+            const threadid tid    = platform_get_tid();
+            uint16         height = trunk_height(spl, node);
+            spl->stats[tid].space_recs[height]++;
+            spl->stats[tid].space_rec_time_ns[height] +=
+               platform_timestamp_elapsed(sr_start);
+         }
+         if (!SUCCESS(rc)) {
+            trunk_node_unlock(spl, node);
+            trunk_node_unclaim(spl, node);
+            trunk_node_unget(spl, &node);
+            continue;
+         }
+      }
+      trunk_node_unlock(spl, node);
+      trunk_node_unclaim(spl, node);
+      trunk_node_unget(spl, &node);
+      return STATUS_OK;
+   }
+}
+
+void
+trunk_maybe_reclaim_space(trunk_handle *spl)
+{
+   while (trunk_should_reclaim_space(spl)) {
+      platform_status rc = trunk_reclaim_space(spl);
+      if (STATUS_IS_EQ(rc, STATUS_NOT_FOUND)) {
+         break;
+      }
+   }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Main Splinter API functions
+ *
+ *      insert
+ *      lookup
+ *      range
+ *-----------------------------------------------------------------------------
+ */
+
+/*
+ *-----------------------------------------------------------------------------
+ * Write throttle
+ *
+ *      A token bucket in front of trunk_insert. As memtables waiting for
+ *      incorporation and queued compactions pile up, inserts are slowed down
+ *      gradually, instead of running at full speed until memtable rotation
+ *      blocks outright.
+ *
+ *      The backlog is turned into a pressure between 0 and
+ *      TRUNK_THROTTLE_SCALE. While there is no pressure, inserts are not
+ *      throttled and the bucket tracks the unthrottled insert rate, the
+ *      base_rate. Under pressure p, once base_rate is known, tokens are added
+ *      at base_rate * (1 - p / SCALE) per second (but no less than
+ *      TRUNK_THROTTLE_MIN_RATE) and each insert takes one.
+ *-----------------------------------------------------------------------------
+ */
+static uint64
+trunk_throttle_pressure_between(uint64 backlog, uint64 soft, uint64 hard)
+{
+   if (backlog <= soft || hard <= soft) {
+      return 0;
+   }
+   return MIN(backlog - soft, hard - soft) * TRUNK_THROTTLE_SCALE
+          / (hard - soft);
+}
+
+static uint64
+trunk_throttle_pressure(trunk_handle *spl)
+{
+   uint64 mt_pressure =
+      trunk_throttle_pressure_between(memtable_backlog(spl->mt_ctxt),
+                                      TRUNK_THROTTLE_MEMTABLE_SOFT,
+                                      spl->cfg.mt_cfg.max_memtables - 1);
+   uint64 task_pressure = trunk_throttle_pressure_between(
+      task_outstanding_tasks(spl->ts, TASK_TYPE_NORMAL),
+      spl->cfg.throttle_soft_tasks,
+      spl->cfg.throttle_hard_tasks);
+   return MAX(mt_pressure, task_pressure);
+}
+
+/*
+ * Re-evaluates the pressure and refills the bucket, at most once per
+ * TRUNK_THROTTLE_INTERVAL_NS and by one thread at a time.
+ */
+static void
+trunk_throttle_refill(trunk_handle *spl, timestamp now)
+{
+   trunk_write_throttle *thr = &spl->throttle;
+   if (now < thr->last_refill + TRUNK_THROTTLE_INTERVAL_NS
+       || !__sync_bool_compare_and_swap(&thr->refilling, FALSE, TRUE))
+   {
+      return;
+   }
+   if (now < thr->last_refill + TRUNK_THROTTLE_INTERVAL_NS) {
+      // someone else refilled in the meantime
+      __sync_lock_release(&thr->refilling);
+      return;
+   }
+
+   uint64 total_inserts = 0;
+   for (threadid i = 0; i < task_get_max_tid(spl->ts); i++) {
+      total_inserts += thr->per_thread[i].inserts;
+   }
+   uint64 inserts = total_inserts - thr->inserts;
+   thr->inserts   = total_inserts;
+
+   timestamp elapsed  = now - thr->last_refill;
+   uint64    pressure = trunk_throttle_pressure(spl);
+
+   /*
+    * An unthrottled interval measures the base rate, unless inserts were
+    * idle for a while, in which case it says nothing about the capacity.
+    */
+   if (thr->rate == 0 && elapsed < 10 * TRUNK_THROTTLE_INTERVAL_NS) {
+      uint64 observed = inserts * SEC_TO_NSEC(1) / elapsed;
+      thr->base_rate  = thr->base_rate == 0
+                           ? observed
+                           : (7 * thr->base_rate + observed) / 8;
+   }
+
+   /*
+    * Until the base rate has been measured, e.g. with a backlog left over at
+    * mount, there is no rate to throttle down from, so inserts run freely.
+    */
+   if (pressure == 0 || thr->base_rate == 0) {
+      thr->tokens = 0;
+      thr->rate   = 0;
+   } else {
+      uint64 rate = thr->base_rate * (TRUNK_THROTTLE_SCALE - pressure)
+                    / TRUNK_THROTTLE_SCALE;
+      rate        = MAX(rate, TRUNK_THROTTLE_MIN_RATE);
+      int64 burst = rate * TRUNK_THROTTLE_INTERVAL_NS / SEC_TO_NSEC(1) + 1;
+      elapsed     = MIN(elapsed, TRUNK_THROTTLE_INTERVAL_NS);
+      int64 tokens =
+         __sync_add_and_fetch(&thr->tokens, rate * elapsed / SEC_TO_NSEC(1));
+      if (tokens > burst) {
+         __sync_fetch_and_sub(&thr->tokens, tokens - burst);
       }
+      thr->rate = rate;
+   }
+   thr->last_refill = now;
+   thr->pressure    = pressure;
+   __sync_lock_release(&thr->refilling);
+}
+
+/*
+ * The inserts a thread may make unthrottled before it reads the clock
+ * again: as many as all threads together make until the next refill is due.
+ * A thread inserting alone at the base rate reads it about once per refill.
+ */
+static uint64
+trunk_throttle_clock_skip(trunk_write_throttle *thr, timestamp now)
+{
+   timestamp next_refill = thr->last_refill + TRUNK_THROTTLE_INTERVAL_NS;
+   if (thr->rate != 0 || next_refill <= now) {
+      return 0;
+   }
+   timestamp remaining = MIN(next_refill - now, TRUNK_THROTTLE_INTERVAL_NS);
+   return thr->base_rate * remaining / SEC_TO_NSEC(1);
+}
+
+/*
+ * Called before each insert: waits for a token while throttled.
+ * Foreground-only task systems run queued tasks while they wait, since
+ * those are what relieves the pressure.
+ */
+static void
+trunk_throttle_insert(trunk_handle *spl, threadid tid)
+{
+   trunk_write_throttle *thr = &spl->throttle;
+   if (!spl->cfg.use_write_throttle) {
+      return;
+   }
+
+   thr->per_thread[tid].inserts++;
+   if (thr->rate == 0 && thr->per_thread[tid].clock_skip != 0) {
+      thr->per_thread[tid].clock_skip--;
+      return;
+   }
+
+   timestamp now = platform_get_timestamp();
+   trunk_throttle_refill(spl, now);
+   thr->per_thread[tid].clock_skip = trunk_throttle_clock_skip(thr, now);
+
+   timestamp wait_start = now;
+   bool      waited     = FALSE;
+   while (thr->rate != 0 && __sync_sub_and_fetch(&thr->tokens, 1) < 0) {
+      __sync_fetch_and_add(&thr->tokens, 1);
+      waited = TRUE;
+      if (task_system_use_bg_threads(spl->ts)
+          || !SUCCESS(task_perform_one(spl->ts)))
+      {
+         platform_sleep(TRUNK_THROTTLE_SLEEP_NS);
+      }
+      trunk_throttle_refill(spl, platform_get_timestamp());
+   }
+
+   if (waited && spl->cfg.use_stats) {
+      timestamp wait_time = platform_timestamp_elapsed(wait_start);
+      spl->stats[tid].throttled_inserts++;
+      spl->stats[tid].throttle_wait_time_ns += wait_time;
+      if (wait_time > spl->stats[tid].throttle_wait_time_max_ns) {
+         spl->stats[tid].throttle_wait_time_max_ns = wait_time;
+      }
+   }
+}
+
+platform_status
+trunk_insert(trunk_handle *spl, key tuple_key, message data)
+{
+   timestamp      ts;
+   const threadid tid = platform_get_tid();
+   if (spl->cfg.use_stats) {
+      ts = platform_get_timestamp();
    }
-}
-
 
-int
-trunk_split_root(trunk_handle *spl, page_handle *root)
-{
-   trunk_hdr *root_hdr = (trunk_hdr *)root->data;
+   if (trunk_max_key_size(spl) < key_length(tuple_key)) {
+      return STATUS_BAD_PARAM;
+   }
 
-   // allocate a new child node
-   page_handle *child     = trunk_alloc(spl, root_hdr->height);
-   trunk_hdr   *child_hdr = (trunk_hdr *)child->data;
+   trunk_throttle_insert(spl, tid);
 
-   // copy root to child, fix up root, then split
-   memmove(child_hdr, root_hdr, trunk_page_size(&spl->cfg));
-   // num_pivot_keys is changed by add_pivot_new_root below
-   root_hdr->height++;
-   debug_assert(root_hdr->next_addr == 0);
-   // leave generation and pivot_generation
-   root_hdr->start_branch      = 0;
-   root_hdr->start_frac_branch = 0;
-   root_hdr->end_branch        = 0;
-   root_hdr->start_bundle      = 0;
-   root_hdr->end_bundle        = 0;
-   root_hdr->start_subbundle   = 0;
-   root_hdr->end_subbundle     = 0;
-   root_hdr->start_sb_filter   = 0;
-   root_hdr->end_sb_filter     = 0;
+   if (message_class(data) == MESSAGE_TYPE_DELETE) {
+      data = DELETE_MESSAGE;
+   }
 
-   trunk_add_pivot_new_root(spl, root, child);
+   platform_status rc = trunk_memtable_insert(spl, tuple_key, data);
+   if (!SUCCESS(rc)) {
+      goto out;
+   }
 
-   trunk_split_index(spl, root, child, 0);
+   if (!task_system_use_bg_threads(spl->ts)) {
+      task_perform_one(spl->ts);
+   }
 
-   trunk_node_unlock(spl, child);
-   trunk_node_unclaim(spl, child);
-   trunk_node_unget(spl, &child);
+   if (spl->cfg.use_stats) {
+      switch (message_class(data)) {
+         case MESSAGE_TYPE_INSERT:
+            spl->stats[tid].insertions++;
+            platform_histo_insert(spl->stats[tid].insert_latency_histo,
+                                  platform_timestamp_elapsed(ts));
+            break;
+         case MESSAGE_TYPE_UPDATE:
+            spl->stats[tid].updates++;
+            platform_histo_insert(spl->stats[tid].update_latency_histo,
+                                  platform_timestamp_elapsed(ts));
+            break;
+         case MESSAGE_TYPE_DELETE:
+            spl->stats[tid].deletions++;
+            platform_histo_insert(spl->stats[tid].delete_latency_histo,
+                                  platform_timestamp_elapsed(ts));
+            break;
+         default:
+            platform_assert(0);
+      }
+   }
 
-   return 0;
+out:
+   return rc;
 }
 
-
 /*
  *-----------------------------------------------------------------------------
- * Range functions and iterators
+ * trunk_delete_range --
  *
- *      trunk_node_iterator
- *      trunk_iterator
+ *      Deletes the keys in [start_key, end_key) by adding a range tombstone,
+ *      see "Range tombstones" above.
+ *
+ *      The tombstone is added inside a memtable barrier, so it is newer than
+ *      every tuple inserted before the call and older than every tuple
+ *      inserted after it. In particular, a branch newer than the tombstone
+ *      can only exist once the tombstone has been added, so a compaction
+ *      which snapshots the tombstones after picking its branches sees every
+ *      tombstone newer than any of them.
+ *
+ *      Range deletes are not written to the log.
  *-----------------------------------------------------------------------------
  */
-void
-trunk_range_iterator_get_curr(iterator *itor, key *curr_key, message *data);
-platform_status
-trunk_range_iterator_at_end(iterator *itor, bool *at_end);
 platform_status
-trunk_range_iterator_advance(iterator *itor);
-void
-trunk_range_iterator_deinit(trunk_range_iterator *range_itor);
-
-const static iterator_ops trunk_range_iterator_ops = {
-   .get_curr = trunk_range_iterator_get_curr,
-   .at_end   = trunk_range_iterator_at_end,
-   .advance  = trunk_range_iterator_advance,
-};
-
-platform_status
-trunk_range_iterator_init(trunk_handle         *spl,
-                          trunk_range_iterator *range_itor,
-                          key                   min_key,
-                          key                   max_key,
-                          uint64                num_tuples)
+trunk_delete_range(trunk_handle *spl, key start_key, key end_key)
 {
-   debug_assert(!key_is_null(min_key));
-   debug_assert(!key_is_null(max_key));
-
-   range_itor->spl          = spl;
-   range_itor->super.ops    = &trunk_range_iterator_ops;
-   range_itor->num_branches = 0;
-   range_itor->num_tuples   = num_tuples;
-   key_buffer_init_from_key(&range_itor->min_key, spl->heap_id, min_key);
-   key_buffer_init_from_key(&range_itor->max_key, spl->heap_id, max_key);
-
-   if (trunk_key_compare(spl, max_key, min_key) <= 0) {
-      range_itor->at_end = TRUE;
+   if ((key_is_user_key(start_key)
+        && trunk_max_key_size(spl) < key_length(start_key))
+       || (key_is_user_key(end_key)
+           && trunk_max_key_size(spl) < key_length(end_key)))
+   {
+      return STATUS_BAD_PARAM;
+   }
+   if (trunk_key_compare(spl, start_key, end_key) >= 0) {
       return STATUS_OK;
    }
 
-   range_itor->at_end = FALSE;
+   memtable_barrier barrier;
+   uint64 mt_gen = memtable_begin_barrier(spl->mt_ctxt, &barrier);
+   platform_status rc = STATUS_OK;
+   if (spl->cfg.use_log) {
+      rc = trunk_log_range_delete(spl, mt_gen, start_key, end_key);
+   }
+   if (SUCCESS(rc)) {
+      rc = trunk_add_range_tombstone(
+         spl, trunk_data_generation(spl, mt_gen), start_key, end_key);
+   }
+   memtable_end_barrier(spl->mt_ctxt, &barrier);
+   return rc;
+}
 
-   ZERO_ARRAY(range_itor->compacted);
+/*
+ *-----------------------------------------------------------------------------
+ * Bulk load
+ *
+ *      trunk_bulk_load_runs builds the trunk directly from sorted runs of
+ *      tuples, bypassing the log, the memtable and compaction. Each run is
+ *      cut into leaf-sized pieces, each of which is packed into a branch with
+ *      btree_pack, given a routing filter and installed in a new leaf as a
+ *      single compacted bundle, i.e. in the state a leaf is in after its
+ *      bundles have been compacted. The runs are packed in parallel, one per
+ *      task, and once they are all done their leaves are stitched into index
+ *      nodes bottom-up, and the topmost index node replaces the contents of
+ *      the root.
+ *
+ *      Only an empty trunk can be bulk loaded. Inserts are held off by a
+ *      memtable barrier for the duration of the load, and lookups see the
+ *      empty trunk until the root is replaced.
+ *-----------------------------------------------------------------------------
+ */
 
-   // grab the lookup lock
-   page_handle *mt_lookup_lock_page = memtable_get_lookup_lock(spl->mt_ctxt);
+/*
+ * Passes the tuples of the input through until the current run has filled a
+ * leaf, checking that the keys are strictly increasing.
+ */
+typedef struct trunk_bulk_load_iterator {
+   iterator        super;
+   trunk_handle   *spl;
+   iterator       *itor;
+   key_buffer      prev_key;
+   bool            has_prev_key;
+   uint64          num_tuples; // in the current run
+   uint64          kv_bytes;   // in the current run
+   platform_status rc;
+} trunk_bulk_load_iterator;
 
-   // memtables
-   ZERO_ARRAY(range_itor->branch);
-   // Note this iteration is in descending generation order
-   range_itor->memtable_start_gen = memtable_generation(spl->mt_ctxt);
-   range_itor->memtable_end_gen   = memtable_generation_retired(spl->mt_ctxt);
-   range_itor->num_memtable_branches =
-      range_itor->memtable_start_gen - range_itor->memtable_end_gen;
-   for (uint64 mt_gen = range_itor->memtable_start_gen;
-        mt_gen != range_itor->memtable_end_gen;
-        mt_gen--)
-   {
-      platform_assert(
-         (range_itor->num_branches < TRUNK_RANGE_ITOR_MAX_BRANCHES),
-         "range_itor->num_branches=%lu should be < "
-         " TRUNK_RANGE_ITOR_MAX_BRANCHES (%d).",
-         range_itor->num_branches,
-         TRUNK_RANGE_ITOR_MAX_BRANCHES);
-      debug_assert(range_itor->num_branches < ARRAY_SIZE(range_itor->branch));
+static void
+trunk_bulk_load_iterator_get_curr(iterator *itor, key *curr_key, message *msg)
+{
+   trunk_bulk_load_iterator *bl_itor = (trunk_bulk_load_iterator *)itor;
+   iterator_get_curr(bl_itor->itor, curr_key, msg);
+}
 
-      bool   compacted;
-      uint64 root_addr =
-         trunk_memtable_root_addr_for_lookup(spl, mt_gen, &compacted);
-      range_itor->compacted[range_itor->num_branches] = compacted;
-      if (compacted) {
-         btree_block_dec_ref(spl->cc, &spl->cfg.btree_cfg, root_addr);
-      } else {
-         trunk_memtable_inc_ref(spl, mt_gen);
-      }
+static platform_status
+trunk_bulk_load_iterator_at_end(iterator *itor, bool *at_end)
+{
+   trunk_bulk_load_iterator *bl_itor = (trunk_bulk_load_iterator *)itor;
+   trunk_handle             *spl     = bl_itor->spl;
+   if (!SUCCESS(bl_itor->rc)
+       || bl_itor->num_tuples >= spl->cfg.max_tuples_per_node
+       || bl_itor->kv_bytes >= spl->cfg.target_leaf_kv_bytes)
+   {
+      *at_end = TRUE;
+      return STATUS_OK;
+   }
+   return iterator_at_end(bl_itor->itor, at_end);
+}
 
-      range_itor->branch[range_itor->num_branches].root_addr = root_addr;
+/*
+ * Checks that the current tuple of the input, if any, can be loaded.
+ */
+static platform_status
+trunk_bulk_load_iterator_check(trunk_bulk_load_iterator *bl_itor)
+{
+   trunk_handle   *spl = bl_itor->spl;
+   bool            at_end;
+   platform_status rc = iterator_at_end(bl_itor->itor, &at_end);
+   if (!SUCCESS(rc) || at_end) {
+      return rc;
+   }
 
-      range_itor->num_branches++;
+   key     curr_key;
+   message msg;
+   iterator_get_curr(bl_itor->itor, &curr_key, &msg);
+   if (trunk_max_key_size(spl) < key_length(curr_key)) {
+      return STATUS_BAD_PARAM;
+   }
+   if (bl_itor->has_prev_key
+       && trunk_key_compare(
+             spl, key_buffer_key(&bl_itor->prev_key), curr_key)
+             >= 0)
+   {
+      return STATUS_BAD_PARAM;
    }
+   return STATUS_OK;
+}
 
-   page_handle *node = trunk_node_get(spl, spl->root_addr);
-   memtable_unget_lookup_lock(spl->mt_ctxt, mt_lookup_lock_page);
+static platform_status
+trunk_bulk_load_iterator_advance(iterator *itor)
+{
+   trunk_bulk_load_iterator *bl_itor = (trunk_bulk_load_iterator *)itor;
 
-   // index btrees
-   uint16 height = trunk_height(spl, node);
-   for (uint16 h = height; h > 0; h--) {
-      uint16 pivot_no = trunk_find_pivot(
-         spl, node, key_buffer_key(&range_itor->min_key), less_than_or_equal);
-      debug_assert(pivot_no < trunk_num_children(spl, node));
-      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
+   key     curr_key;
+   message msg;
+   iterator_get_curr(bl_itor->itor, &curr_key, &msg);
+   bl_itor->num_tuples++;
+   bl_itor->kv_bytes += key_length(curr_key) + message_length(msg);
+   platform_status rc = key_buffer_copy_key(&bl_itor->prev_key, curr_key);
+   bl_itor->has_prev_key = TRUE;
+   if (SUCCESS(rc)) {
+      rc = iterator_advance(bl_itor->itor);
+   }
+   if (SUCCESS(rc)) {
+      rc = trunk_bulk_load_iterator_check(bl_itor);
+   }
+   bl_itor->rc = rc;
+   return rc;
+}
 
-      for (uint16 branch_offset = 0;
-           branch_offset != trunk_pivot_branch_count(spl, node, pdata);
-           branch_offset++)
-      {
-         platform_assert(
-            (range_itor->num_branches < TRUNK_RANGE_ITOR_MAX_BRANCHES),
-            "range_itor->num_branches=%lu should be < "
-            " TRUNK_RANGE_ITOR_MAX_BRANCHES (%d).",
-            range_itor->num_branches,
-            TRUNK_RANGE_ITOR_MAX_BRANCHES);
-
-         debug_assert(range_itor->num_branches
-                      < ARRAY_SIZE(range_itor->branch));
-         uint16 branch_no = trunk_subtract_branch_number(
-            spl, trunk_end_branch(spl, node), branch_offset + 1);
-         range_itor->branch[range_itor->num_branches] =
-            *trunk_get_branch(spl, node, branch_no);
-         range_itor->compacted[range_itor->num_branches] = TRUE;
-         uint64 root_addr =
-            range_itor->branch[range_itor->num_branches].root_addr;
-         btree_block_dec_ref(spl->cc, &spl->cfg.btree_cfg, root_addr);
-         range_itor->num_branches++;
-      }
+const static iterator_ops trunk_bulk_load_iterator_ops = {
+   .get_curr = trunk_bulk_load_iterator_get_curr,
+   .at_end   = trunk_bulk_load_iterator_at_end,
+   .advance  = trunk_bulk_load_iterator_advance,
+};
 
-      page_handle *child = trunk_node_get(spl, pdata->addr);
-      trunk_node_unget(spl, &node);
-      node = child;
-   }
+static void
+trunk_bulk_load_iterator_init(trunk_handle             *spl,
+                              trunk_bulk_load_iterator *bl_itor,
+                              iterator                 *itor)
+{
+   ZERO_CONTENTS(bl_itor);
+   bl_itor->super.ops = &trunk_bulk_load_iterator_ops;
+   bl_itor->spl       = spl;
+   bl_itor->itor      = itor;
+   key_buffer_init(&bl_itor->prev_key, spl->heap_id);
+   bl_itor->rc = trunk_bulk_load_iterator_check(bl_itor);
+}
 
-   // leaf btrees
-   for (uint16 branch_offset = 0;
-        branch_offset != trunk_branch_count(spl, node);
-        branch_offset++)
-   {
-      uint16 branch_no = trunk_subtract_branch_number(
-         spl, trunk_end_branch(spl, node), branch_offset + 1);
-      range_itor->branch[range_itor->num_branches] =
-         *trunk_get_branch(spl, node, branch_no);
-      uint64 root_addr = range_itor->branch[range_itor->num_branches].root_addr;
-      btree_block_dec_ref(spl->cc, &spl->cfg.btree_cfg, root_addr);
-      range_itor->compacted[range_itor->num_branches] = TRUE;
-      range_itor->num_branches++;
-   }
+static void
+trunk_bulk_load_iterator_deinit(trunk_bulk_load_iterator *bl_itor)
+{
+   key_buffer_deinit(&bl_itor->prev_key);
+}
 
-   // have a leaf, use to get rebuild key
-   key rebuild_key =
-      trunk_key_compare(spl, trunk_max_key(spl, node), max_key) < 0
-         ? trunk_max_key(spl, node)
-         : max_key;
-   key_buffer_init_from_key(
-      &range_itor->rebuild_key, spl->heap_id, rebuild_key);
-   if (trunk_key_compare(spl, max_key, rebuild_key) < 0) {
-      key_buffer_init_from_key(
-         &range_itor->local_max_key, spl->heap_id, max_key);
-   } else {
-      key_buffer_init_from_key(
-         &range_itor->local_max_key, spl->heap_id, rebuild_key);
+/*
+ * Packs the next leaf's worth of the input and returns it in a new leaf
+ * whose min pivot is its first key. Sets *out_leaf to NULL once the input is
+ * exhausted.
+ */
+static platform_status
+trunk_bulk_load_leaf(trunk_handle             *spl,
+                     trunk_bulk_load_iterator *bl_itor,
+                     uint64                    generation,
+                     page_handle             **out_leaf)
+{
+   *out_leaf = NULL;
+   if (!SUCCESS(bl_itor->rc)) {
+      return bl_itor->rc;
+   }
+   bool            at_end;
+   platform_status rc = iterator_at_end(bl_itor->itor, &at_end);
+   if (!SUCCESS(rc) || at_end) {
+      return rc;
    }
 
-   trunk_node_unget(spl, &node);
+   key     first_key;
+   message msg;
+   iterator_get_curr(bl_itor->itor, &first_key, &msg);
+   key_buffer min_key;
+   rc = key_buffer_init_from_key(&min_key, spl->heap_id, first_key);
+   if (!SUCCESS(rc)) {
+      return rc;
+   }
 
-   for (uint64 i = 0; i < range_itor->num_branches; i++) {
-      uint64          branch_no  = range_itor->num_branches - i - 1;
-      btree_iterator *btree_itor = &range_itor->btree_itor[branch_no];
-      trunk_branch   *branch     = &range_itor->branch[branch_no];
-      if (range_itor->compacted[branch_no]) {
-         bool do_prefetch =
-            range_itor->compacted[branch_no] && num_tuples > TRUNK_PREFETCH_MIN
-               ? TRUE
-               : FALSE;
-         trunk_branch_iterator_init(spl,
-                                    btree_itor,
-                                    branch,
-                                    key_buffer_key(&range_itor->min_key),
-                                    key_buffer_key(&range_itor->local_max_key),
-                                    do_prefetch,
-                                    FALSE);
-      } else {
-         uint64 mt_root_addr = branch->root_addr;
-         bool   is_live      = branch_no == 0;
-         trunk_memtable_iterator_init(
-            spl,
-            btree_itor,
-            mt_root_addr,
-            key_buffer_key(&range_itor->min_key),
-            key_buffer_key(&range_itor->local_max_key),
-            is_live,
-            FALSE);
-      }
-      range_itor->itor[i] = &btree_itor->super;
+   bl_itor->num_tuples = 0;
+   bl_itor->kv_bytes   = 0;
+   btree_pack_req req;
+   btree_pack_req_init(&req,
+                       spl->cc,
+                       &spl->cfg.btree_cfg,
+                       &bl_itor->super,
+                       spl->cfg.max_tuples_per_node,
+                       spl->cfg.filter_cfg.hash,
+                       spl->cfg.filter_cfg.seed,
+                       spl->heap_id);
+   rc = btree_pack(&req);
+   if (!SUCCESS(rc)) {
+      goto out;
    }
-
-   platform_status rc = merge_iterator_create(spl->heap_id,
-                                              spl->cfg.data_cfg,
-                                              range_itor->num_branches,
-                                              range_itor->itor,
-                                              MERGE_FULL,
-                                              &range_itor->merge_itor);
+   trunk_branch new_branch = {.root_addr  = req.root_addr,
+                              .generation = generation};
+   rc                      = bl_itor->rc;
    if (!SUCCESS(rc)) {
-      return rc;
+      if (new_branch.root_addr != 0) {
+         trunk_dec_ref(spl, &new_branch, FALSE);
+      }
+      goto out;
    }
+   platform_assert(req.num_tuples > 0);
 
-   bool at_end;
-   iterator_at_end(&range_itor->merge_itor->super, &at_end);
-
-   /*
-    * if the merge itor is already exhausted, and there are more keys in the
-    * db/range, move to next leaf
-    */
-   if (at_end) {
-      KEY_CREATE_LOCAL_COPY(rc,
-                            local_max_key,
-                            spl->heap_id,
-                            key_buffer_key(&range_itor->local_max_key));
-      if (!SUCCESS(rc)) {
-         return rc;
-      }
-      KEY_CREATE_LOCAL_COPY(rc,
-                            rebuild_key,
-                            spl->heap_id,
-                            key_buffer_key(&range_itor->rebuild_key));
-      if (!SUCCESS(rc)) {
-         return rc;
-      }
-      trunk_range_iterator_deinit(range_itor);
-      if (1 && trunk_key_compare(spl, local_max_key, POSITIVE_INFINITY_KEY) != 0
-          && trunk_key_compare(spl, local_max_key, max_key) < 0)
-      {
-         rc = trunk_range_iterator_init(
-            spl, range_itor, rebuild_key, max_key, range_itor->num_tuples);
-         if (!SUCCESS(rc)) {
-            return rc;
-         }
-         iterator_at_end(&range_itor->merge_itor->super, &at_end);
-      }
+   routing_filter empty_filter = {0};
+   routing_filter filter;
+   rc = trunk_filter_add(spl,
+                         &empty_filter,
+                         &filter,
+                         req.fingerprint_arr,
+                         req.prefix_fingerprint_arr,
+                         req.num_tuples,
+                         0);
+   if (!SUCCESS(rc)) {
+      trunk_dec_ref(spl, &new_branch, FALSE);
+      goto out;
    }
 
-   range_itor->at_end = at_end;
+   page_handle *leaf = trunk_alloc(spl, 0);
+   trunk_hdr   *hdr  = (trunk_hdr *)leaf->data;
+   memset(hdr, 0, trunk_page_size(&spl->cfg));
+   trunk_set_initial_pivots(spl, leaf);
+   trunk_inc_pivot_generation(spl, leaf);
+   trunk_set_pivot(spl, leaf, 0, key_buffer_key(&min_key));
+
+   uint16           bundle_no = trunk_get_new_bundle(spl, leaf);
+   trunk_bundle    *bundle    = trunk_get_bundle(spl, leaf, bundle_no);
+   trunk_subbundle *sb        = trunk_get_new_subbundle(spl, leaf, 1);
+   trunk_branch    *branch    = trunk_get_new_branch(spl, leaf);
+   *branch                    = new_branch;
+   bundle->start_subbundle    = trunk_subbundle_no(spl, leaf, sb);
+   bundle->end_subbundle      = trunk_end_subbundle(spl, leaf);
+   bundle->num_tuples         = req.num_tuples;
+   bundle->num_kv_bytes       = req.key_bytes + req.message_bytes;
+   sb->start_branch           = trunk_branch_no(spl, leaf, branch);
+   sb->end_branch             = trunk_end_branch(spl, leaf);
+   *trunk_subbundle_filter(spl, leaf, sb, 0) = filter;
+   trunk_pivot_set_bundle_counts(
+      spl, leaf, 0, bundle->num_tuples, bundle->num_kv_bytes);
+   *out_leaf = leaf;
 
+out:
+   btree_pack_req_deinit(&req, spl->heap_id);
+   key_buffer_deinit(&min_key);
    return rc;
 }
 
-void
-trunk_range_iterator_get_curr(iterator *itor, key *curr_key, message *data)
-{
-   debug_assert(itor != NULL);
-   trunk_range_iterator *range_itor = (trunk_range_iterator *)itor;
-   iterator_get_curr(&range_itor->merge_itor->super, curr_key, data);
-}
+/*
+ * Stitches the nodes produced by a bulk load into index nodes. Holds the
+ * rightmost node at each height, whose max pivot is set when its successor
+ * arrives.
+ */
+typedef struct trunk_bulk_load_builder {
+   trunk_handle *spl;
+   uint16        height; // height of the highest node so far
+   page_handle  *last[TRUNK_MAX_HEIGHT];
+} trunk_bulk_load_builder;
 
-platform_status
-trunk_range_iterator_advance(iterator *itor)
+static void
+trunk_bulk_load_release(trunk_handle *spl, page_handle **node)
 {
-   debug_assert(itor != NULL);
-   trunk_range_iterator *range_itor = (trunk_range_iterator *)itor;
-   iterator_advance(&range_itor->merge_itor->super);
-   range_itor->num_tuples++;
-   bool at_end;
-   iterator_at_end(&range_itor->merge_itor->super, &at_end);
-   platform_status rc;
-   // robj: shouldn't this be a while loop, like in the init function?
-   if (at_end) {
-      KEY_CREATE_LOCAL_COPY(rc,
-                            rebuild_key,
-                            range_itor->spl->heap_id,
-                            key_buffer_key(&range_itor->rebuild_key));
-      if (!SUCCESS(rc)) {
-         return rc;
-      }
-      KEY_CREATE_LOCAL_COPY(rc,
-                            max_key,
-                            range_itor->spl->heap_id,
-                            key_buffer_key(&range_itor->max_key));
-      if (!SUCCESS(rc)) {
-         return rc;
-      }
-      trunk_range_iterator_deinit(range_itor);
-      rc = trunk_range_iterator_init(range_itor->spl,
-                                     range_itor,
-                                     rebuild_key,
-                                     max_key,
-                                     range_itor->num_tuples);
-      if (!SUCCESS(rc)) {
-         return rc;
-      }
-      if (!range_itor->at_end) {
-         iterator_at_end(&range_itor->merge_itor->super, &at_end);
-         platform_assert(!at_end);
-      }
-   }
-
-   return STATUS_OK;
+   trunk_node_unlock(spl, *node);
+   trunk_node_unclaim(spl, *node);
+   trunk_node_unget(spl, node);
 }
 
-platform_status
-trunk_range_iterator_at_end(iterator *itor, bool *at_end)
+/*
+ * Returns a new index node of the given height whose only child is child.
+ */
+static page_handle *
+trunk_bulk_load_new_index(trunk_handle *spl, uint16 height, page_handle *child)
 {
-   debug_assert(itor != NULL);
-   trunk_range_iterator *range_itor = (trunk_range_iterator *)itor;
-
-   *at_end = range_itor->at_end;
-   return STATUS_OK;
+   platform_assert(height < TRUNK_MAX_HEIGHT);
+   page_handle *node = trunk_alloc(spl, height);
+   trunk_hdr   *hdr  = (trunk_hdr *)node->data;
+   memset(hdr, 0, trunk_page_size(&spl->cfg));
+   hdr->height = height;
+   trunk_add_pivot_new_root(spl, node, child);
+   trunk_inc_pivot_generation(spl, node);
+   trunk_set_pivot(spl, node, 0, trunk_get_pivot(spl, child, 0));
+   return node;
 }
 
-void
-trunk_range_iterator_deinit(trunk_range_iterator *range_itor)
+/*
+ * Adds node, whose pivots start where those of the previous node of the same
+ * height end, as the rightmost node at its height.
+ */
+static void
+trunk_bulk_load_add_node(trunk_bulk_load_builder *builder, page_handle *node)
 {
-   // If the iterator is at end, then it has already been deinitialized
-   if (range_itor->at_end) {
+   trunk_handle *spl    = builder->spl;
+   uint16        height = trunk_height(spl, node);
+   page_handle  *prev   = builder->last[height];
+   builder->last[height] = node;
+   if (prev == NULL) {
+      // the first node at each height has no predecessor to the left
+      trunk_set_pivot(spl, node, 0, NEGATIVE_INFINITY_KEY);
+      builder->height = MAX(builder->height, height);
       return;
    }
-   trunk_handle *spl = range_itor->spl;
-   merge_iterator_destroy(range_itor->spl->heap_id, &range_itor->merge_itor);
-   for (uint64 i = 0; i < range_itor->num_branches; i++) {
-      btree_iterator *btree_itor = &range_itor->btree_itor[i];
-      if (range_itor->compacted[i]) {
-         uint64 root_addr = btree_itor->root_addr;
-         trunk_branch_iterator_deinit(spl, btree_itor, FALSE);
-         btree_unblock_dec_ref(spl->cc, &spl->cfg.btree_cfg, root_addr);
-      } else {
-         uint64 mt_gen = range_itor->memtable_start_gen - i;
-         trunk_memtable_iterator_deinit(spl, btree_itor, mt_gen, FALSE);
-         trunk_memtable_dec_ref(spl, mt_gen);
-      }
+
+   trunk_set_pivot(
+      spl, prev, trunk_num_children(spl, prev), trunk_get_pivot(spl, node, 0));
+   trunk_set_next_addr(spl, prev, node->disk_addr);
+   page_handle *parent = builder->last[height + 1];
+   if (parent == NULL) {
+      parent = trunk_bulk_load_new_index(spl, height + 1, prev);
+      trunk_bulk_load_add_node(builder, parent);
    }
+   trunk_bulk_load_release(spl, &prev);
 
-   key_buffer_deinit(&range_itor->min_key);
-   key_buffer_deinit(&range_itor->max_key);
-   key_buffer_deinit(&range_itor->local_max_key);
-   key_buffer_deinit(&range_itor->rebuild_key);
+   uint16 num_children = trunk_num_children(spl, parent);
+   if (num_children < spl->cfg.fanout) {
+      platform_status rc = trunk_add_pivot(spl, parent, node, num_children);
+      platform_assert_status_ok(rc);
+   } else {
+      trunk_bulk_load_add_node(
+         builder, trunk_bulk_load_new_index(spl, height + 1, node));
+   }
 }
 
 /*
- * Given a node addr and pivot generation, find the pivot with that generation
- * among the node and its split descendents
- *
- * Returns node with a write loc
+ * Releases the nodes held by the builder, except for the topmost one, which
+ * is returned. There is always at least one index node above the leaves.
  */
-trunk_pivot_data *
-trunk_find_pivot_from_generation(trunk_handle *spl,
-                                 page_handle  *leaf,
-                                 uint64        pivot_generation)
+static page_handle *
+trunk_bulk_load_finish(trunk_bulk_load_builder *builder)
 {
-   uint16 num_children = trunk_num_children(spl, leaf);
-   for (uint16 pivot_no = 0; pivot_no < num_children; pivot_no++) {
-      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, leaf, pivot_no);
-      if (pivot_generation == pdata->generation) {
-         return pdata;
-      }
+   trunk_handle *spl = builder->spl;
+   if (builder->height == 0) {
+      trunk_bulk_load_add_node(
+         builder, trunk_bulk_load_new_index(spl, 1, builder->last[0]));
    }
-   return NULL;
-}
-
-platform_status
-trunk_compact_leaf(trunk_handle *spl, page_handle *leaf)
-{
-   const threadid tid = platform_get_tid();
-
-   platform_stream_handle stream;
-   platform_status        rc = trunk_open_log_stream_if_enabled(spl, &stream);
-   platform_assert_status_ok(rc);
-   trunk_log_stream_if_enabled(
-      spl, &stream, "compact_leaf addr %lu\n", leaf->disk_addr);
-   trunk_log_node_if_enabled(&stream, spl, leaf);
-
-   uint64 sr_start;
-   if (spl->cfg.use_stats) {
-      spl->stats[tid].space_recs[0]++;
-      sr_start = platform_get_timestamp();
+   for (uint16 height = 0; height < builder->height; height++) {
+      trunk_bulk_load_release(spl, &builder->last[height]);
    }
+   return builder->last[builder->height];
+}
 
-   // Clear old bundles from leaf and put all branches in a new bundle
-   uint64 num_tuples = trunk_pivot_num_tuples(spl, leaf, 0);
-   uint64 kv_bytes   = trunk_pivot_kv_bytes(spl, leaf, 0);
-   uint16 bundle_no =
-      trunk_leaf_rebundle_all_branches(spl, leaf, num_tuples, kv_bytes, TRUE);
-   trunk_inc_generation(spl, leaf);
-
-   // Issue compact_bundle for leaf and release
-   trunk_compact_bundle_req *req = TYPED_ZALLOC(spl->heap_id, req);
-   req->spl                      = spl;
-   req->addr                     = leaf->disk_addr;
-   // req->height already 0
-   req->bundle_no                    = bundle_no;
-   req->generation                   = trunk_generation(spl, leaf);
-   req->max_pivot_generation         = trunk_pivot_generation(spl, leaf);
-   req->pivot_generation[0]          = trunk_pivot_generation(spl, leaf) - 1;
-   req->input_pivot_tuple_count[0]   = trunk_pivot_num_tuples(spl, leaf, 0);
-   req->input_pivot_kv_byte_count[0] = trunk_pivot_kv_bytes(spl, leaf, 0);
-   req->type                         = TRUNK_COMPACTION_TYPE_SPACE_REC;
-
-   trunk_default_log_if_enabled(
-      spl, "enqueuing compact_bundle %lu-%u\n", req->addr, req->bundle_no);
-   rc =
-      task_enqueue(spl->ts, TASK_TYPE_NORMAL, trunk_compact_bundle, req, FALSE);
-   platform_assert(SUCCESS(rc));
-
-   trunk_log_node_if_enabled(&stream, spl, leaf);
+/*
+ * Drops the branch and filter of a leaf built by trunk_bulk_load_leaf which
+ * did not make it into the trunk.
+ */
+static void
+trunk_bulk_load_drop_leaf(trunk_handle *spl, uint64 addr)
+{
+   page_handle  *leaf = trunk_node_get(spl, addr);
+   trunk_branch *branch =
+      trunk_get_branch(spl, leaf, trunk_start_branch(spl, leaf));
+   trunk_dec_ref(spl, branch, FALSE);
+   trunk_subbundle *sb =
+      trunk_get_subbundle(spl, leaf, trunk_start_subbundle(spl, leaf));
+   trunk_dec_filter(spl, trunk_subbundle_filter(spl, leaf, sb, 0));
+   trunk_node_unget(spl, &leaf);
+}
 
-   debug_assert(trunk_verify_node(spl, leaf));
+struct trunk_bulk_load_ctxt;
 
-   /*
-    * 8. Clean up
-    */
-   trunk_close_log_stream_if_enabled(spl, &stream);
+/*
+ * A run of a bulk load and the leaves it has been packed into so far.
+ */
+typedef struct trunk_bulk_load_run {
+   struct trunk_bulk_load_ctxt *ctxt;
+   trunk_bulk_load_iterator     itor;
+   uint64                       num_leaves;
+   uint64                       max_leaves;
+   uint64                      *leaf_addr;
+   platform_status              rc;
+} trunk_bulk_load_run;
 
-   if (spl->cfg.use_stats) {
-      // Doesn't include the original leaf
-      uint64 sr_time = platform_timestamp_elapsed(sr_start);
-      spl->stats[tid].space_rec_time_ns[0] += sr_time;
-   }
+typedef struct trunk_bulk_load_ctxt {
+   trunk_handle       *spl;
+   uint64              generation; // of the loaded tuples
+   volatile uint64     runs_pending;
+   uint64              num_runs;
+   trunk_bulk_load_run run[];
+} trunk_bulk_load_ctxt;
 
+static platform_status
+trunk_bulk_load_run_add_leaf(trunk_bulk_load_run *run, page_handle *leaf)
+{
+   trunk_handle *spl  = run->ctxt->spl;
+   uint64        addr = leaf->disk_addr;
+   trunk_bulk_load_release(spl, &leaf);
+   if (run->num_leaves == run->max_leaves) {
+      uint64  max_leaves = MAX(2 * run->max_leaves, 64);
+      uint64 *leaf_addr  = platform_realloc(
+         spl->heap_id, run->leaf_addr, max_leaves * sizeof(*leaf_addr));
+      if (leaf_addr == NULL) {
+         trunk_bulk_load_drop_leaf(spl, addr);
+         return STATUS_NO_MEMORY;
+      }
+      run->leaf_addr  = leaf_addr;
+      run->max_leaves = max_leaves;
+   }
+   run->leaf_addr[run->num_leaves++] = addr;
    return STATUS_OK;
 }
 
 /*
- *-----------------------------------------------------------------------------
- * Space reclamation
- *-----------------------------------------------------------------------------
+ * Packs run into leaves, recording their addresses in key order.
  */
-bool
-trunk_should_reclaim_space(trunk_handle *spl)
+static void
+trunk_bulk_load_pack_run(trunk_bulk_load_run *run)
 {
-   if (spl->cfg.reclaim_threshold == UINT64_MAX) {
-      return FALSE;
-   }
-   if (spl->cfg.reclaim_threshold == 0) {
-      return TRUE;
-   }
-   uint64 in_use         = allocator_in_use(spl->al);
-   bool   should_reclaim = in_use > spl->cfg.reclaim_threshold;
-   return should_reclaim;
+   trunk_bulk_load_ctxt *ctxt = run->ctxt;
+   platform_status       rc;
+   page_handle          *leaf;
+   do {
+      rc = trunk_bulk_load_leaf(ctxt->spl, &run->itor, ctxt->generation, &leaf);
+      if (leaf != NULL) {
+         rc = trunk_bulk_load_run_add_leaf(run, leaf);
+      }
+   } while (SUCCESS(rc) && leaf != NULL);
+   run->rc = rc;
 }
 
-platform_status
-trunk_reclaim_space(trunk_handle *spl)
+static void
+trunk_bulk_load_run_task(void *arg, void *scratch)
 {
-   platform_assert(spl->cfg.reclaim_threshold != UINT64_MAX);
-   while (TRUE) {
-      // platform_default_log("Extract from SRQ\n");
-      srq_data space_rec = srq_extract_max(&spl->srq);
-      if (!srq_data_found(&space_rec)) {
-         return STATUS_NOT_FOUND;
-      }
-      page_handle *node = trunk_node_get(spl, space_rec.addr);
-      trunk_node_claim(spl, &node);
-      trunk_pivot_data *pdata = trunk_find_pivot_from_generation(
-         spl, node, space_rec.pivot_generation);
-      if (pdata == NULL) {
-         trunk_node_unclaim(spl, node);
-         trunk_node_unget(spl, &node);
-         continue;
-      }
-      pdata->srq_idx = -1;
-
-      // platform_default_log("Space rec: %lu-%u\n",
-      //       node->disk_addr, trunk_pdata_to_pivot_index(spl, node,
-      //       pdata));
+   trunk_bulk_load_run *run = (trunk_bulk_load_run *)arg;
+   trunk_bulk_load_pack_run(run);
+   __sync_fetch_and_sub(&run->ctxt->runs_pending, 1);
+}
 
-      trunk_node_lock(spl, node);
-      if (trunk_is_leaf(spl, node)) {
-         trunk_compact_leaf(spl, node);
-      } else {
-         uint64 sr_start;
-         if (spl->cfg.use_stats) {
-            sr_start = platform_get_timestamp();
-         }
-         platform_status rc = trunk_flush(spl, node, pdata, TRUE);
-         if (spl->cfg.use_stats) {
-            const threadid tid    = platform_get_tid();
-            uint16         height = trunk_height(spl, node);
-            spl->stats[tid].space_recs[height]++;
-            spl->stats[tid].space_rec_time_ns[height] +=
-               platform_timestamp_elapsed(sr_start);
-         }
-         if (!SUCCESS(rc)) {
-            trunk_node_unlock(spl, node);
-            trunk_node_unclaim(spl, node);
-            trunk_node_unget(spl, &node);
-            continue;
+/*
+ * Checks that the runs were packed and that each one's keys are all larger
+ * than those of the runs before it.
+ */
+static platform_status
+trunk_bulk_load_check_runs(trunk_bulk_load_ctxt *ctxt)
+{
+   trunk_handle        *spl  = ctxt->spl;
+   trunk_bulk_load_run *prev = NULL;
+   for (uint64 run_no = 0; run_no < ctxt->num_runs; run_no++) {
+      trunk_bulk_load_run *run = &ctxt->run[run_no];
+      if (!SUCCESS(run->rc)) {
+         return run->rc;
+      }
+      if (run->num_leaves == 0) {
+         continue;
+      }
+      if (prev != NULL) {
+         page_handle *leaf = trunk_node_get(spl, run->leaf_addr[0]);
+         int          cmp  = trunk_key_compare(spl,
+                                        key_buffer_key(&prev->itor.prev_key),
+                                        trunk_get_pivot(spl, leaf, 0));
+         trunk_node_unget(spl, &leaf);
+         if (cmp >= 0) {
+            return STATUS_BAD_PARAM;
          }
       }
-      trunk_node_unlock(spl, node);
-      trunk_node_unclaim(spl, node);
-      trunk_node_unget(spl, &node);
-      return STATUS_OK;
+      prev = run;
    }
+   return STATUS_OK;
 }
 
-void
-trunk_maybe_reclaim_space(trunk_handle *spl)
+static inline bool
+trunk_bulk_load_node_is_empty(trunk_handle *spl, page_handle *node)
 {
-   while (trunk_should_reclaim_space(spl)) {
-      platform_status rc = trunk_reclaim_space(spl);
-      if (STATUS_IS_EQ(rc, STATUS_NOT_FOUND)) {
-         break;
-      }
+   return trunk_start_branch(spl, node) == trunk_end_branch(spl, node)
+          && trunk_start_bundle(spl, node) == trunk_end_bundle(spl, node);
+}
+
+/*
+ * Returns TRUE if the trunk is still a root with a single leaf and neither
+ * holds any branches, as created by trunk_create.
+ */
+static bool
+trunk_bulk_load_trunk_is_empty(trunk_handle *spl)
+{
+   page_handle *root = trunk_node_get(spl, spl->root_addr);
+   bool         is_empty =
+      trunk_height(spl, root) == 1 && trunk_num_children(spl, root) == 1
+      && trunk_bulk_load_node_is_empty(spl, root);
+   if (is_empty) {
+      uint64       leaf_addr = trunk_get_pivot_data(spl, root, 0)->addr;
+      page_handle *leaf      = trunk_node_get(spl, leaf_addr);
+      is_empty               = trunk_bulk_load_node_is_empty(spl, leaf);
+      trunk_node_unget(spl, &leaf);
    }
+   trunk_node_unget(spl, &root);
+   return is_empty;
 }
 
 /*
  *-----------------------------------------------------------------------------
- * Main Splinter API functions
+ * trunk_bulk_load_runs --
  *
- *      insert
- *      lookup
- *      range
+ *      Loads the tuples of the num_runs iterators in runs into an empty
+ *      trunk, see "Bulk load" above. The keys of each run must be strictly
+ *      increasing, and smaller than those of the runs after it. Each tuple
+ *      is written once, into the branch of its leaf.
+ *
+ *      The first run is packed by the calling thread and the others by
+ *      tasks, so their iterators are consumed on background threads when
+ *      the task system has them.
+ *
+ *      The loaded tuples are older than any range delete or write issued
+ *      after the call. They are not written to the log, so with a log the
+ *      call takes a checkpoint before it returns, which recovery starts
+ *      from.
+ *
+ * Results:
+ *      STATUS_INVALID_STATE if the trunk is not empty, STATUS_BAD_PARAM if
+ *      keys are out of order or too long, in which case nothing is loaded.
  *-----------------------------------------------------------------------------
  */
-
 platform_status
-trunk_insert(trunk_handle *spl, key tuple_key, message data)
+trunk_bulk_load_runs(trunk_handle *spl, uint64 num_runs, iterator **runs)
 {
-   timestamp      ts;
-   const threadid tid = platform_get_tid();
-   if (spl->cfg.use_stats) {
-      ts = platform_get_timestamp();
+   if (num_runs == 0) {
+      return STATUS_OK;
    }
 
-   if (trunk_max_key_size(spl) < key_length(tuple_key)) {
-      return STATUS_BAD_PARAM;
+   memtable_barrier barrier;
+   uint64 mt_gen = memtable_begin_barrier(spl->mt_ctxt, &barrier);
+   if (barrier.finalized
+       || memtable_generation_retired(spl->mt_ctxt) + 1 != mt_gen
+       || !trunk_bulk_load_trunk_is_empty(spl))
+   {
+      memtable_end_barrier(spl->mt_ctxt, &barrier);
+      return STATUS_INVALID_STATE;
    }
 
-   if (message_class(data) == MESSAGE_TYPE_DELETE) {
-      data = DELETE_MESSAGE;
+   trunk_bulk_load_ctxt *ctxt =
+      TYPED_FLEXIBLE_STRUCT_ZALLOC(spl->heap_id, ctxt, run, num_runs);
+   if (ctxt == NULL) {
+      memtable_end_barrier(spl->mt_ctxt, &barrier);
+      return STATUS_NO_MEMORY;
+   }
+   ctxt->spl          = spl;
+   ctxt->generation   = trunk_data_generation(spl, mt_gen);
+   ctxt->runs_pending = num_runs - 1;
+   ctxt->num_runs     = num_runs;
+   for (uint64 run_no = 0; run_no < num_runs; run_no++) {
+      ctxt->run[run_no].ctxt = ctxt;
+      trunk_bulk_load_iterator_init(
+         spl, &ctxt->run[run_no].itor, runs[run_no]);
+   }
+
+   // X. Pack the runs into leaves
+   for (uint64 run_no = 1; run_no < num_runs; run_no++) {
+      platform_status rc = task_enqueue(spl->ts,
+                                        TASK_TYPE_NORMAL,
+                                        trunk_bulk_load_run_task,
+                                        &ctxt->run[run_no],
+                                        FALSE);
+      if (!SUCCESS(rc)) {
+         trunk_bulk_load_run_task(&ctxt->run[run_no], NULL);
+      }
    }
+   trunk_bulk_load_pack_run(&ctxt->run[0]);
+   uint64 wait = 1;
+   while (ctxt->runs_pending != 0) {
+      if (task_system_use_bg_threads(spl->ts)
+          || !SUCCESS(task_perform_one(spl->ts)))
+      {
+         platform_sleep(wait);
+         wait = wait > 2048 ? wait : 2 * wait;
+      }
+   }
+
+   // X. Stitch the leaves into index nodes and replace the root
+   platform_status rc = trunk_bulk_load_check_runs(ctxt);
+   if (SUCCESS(rc)) {
+      trunk_bulk_load_builder builder;
+      ZERO_CONTENTS(&builder);
+      builder.spl = spl;
+      for (uint64 run_no = 0; run_no < num_runs; run_no++) {
+         trunk_bulk_load_run *run = &ctxt->run[run_no];
+         for (uint64 leaf_no = 0; leaf_no < run->num_leaves; leaf_no++) {
+            page_handle *leaf = trunk_node_get(spl, run->leaf_addr[leaf_no]);
+            trunk_node_claim(spl, &leaf);
+            trunk_node_lock(spl, leaf);
+            trunk_bulk_load_add_node(&builder, leaf);
+         }
+      }
 
-   platform_status rc = trunk_memtable_insert(spl, tuple_key, data);
-   if (!SUCCESS(rc)) {
-      goto out;
+      if (builder.last[0] != NULL) {
+         page_handle *top  = trunk_bulk_load_finish(&builder);
+         page_handle *root = trunk_node_get(spl, spl->root_addr);
+         trunk_node_claim(spl, &root);
+         trunk_node_lock(spl, root);
+         memmove(root->data, top->data, trunk_page_size(&spl->cfg));
+         trunk_bulk_load_release(spl, &root);
+         trunk_bulk_load_release(spl, &top);
+
+         // later writes and range deletes must be newer than the loaded data
+         spl->generation_base++;
+
+         // the loaded data is not in the log, so recovery must start from a
+         // checkpoint which holds it
+         if (spl->cfg.use_log) {
+            trunk_checkpoint_now(spl, mt_gen);
+         }
+      }
+   } else {
+      for (uint64 run_no = 0; run_no < num_runs; run_no++) {
+         trunk_bulk_load_run *run = &ctxt->run[run_no];
+         for (uint64 leaf_no = 0; leaf_no < run->num_leaves; leaf_no++) {
+            trunk_bulk_load_drop_leaf(spl, run->leaf_addr[leaf_no]);
+         }
+      }
    }
 
-   if (!task_system_use_bg_threads(spl->ts)) {
-      task_perform_one(spl->ts);
+   for (uint64 run_no = 0; run_no < num_runs; run_no++) {
+      trunk_bulk_load_run *run = &ctxt->run[run_no];
+      trunk_bulk_load_iterator_deinit(&run->itor);
+      if (run->leaf_addr != NULL) {
+         platform_free(spl->heap_id, run->leaf_addr);
+      }
    }
+   platform_free(spl->heap_id, ctxt);
+   memtable_end_barrier(spl->mt_ctxt, &barrier);
+   return rc;
+}
 
-   if (spl->cfg.use_stats) {
-      switch (message_class(data)) {
-         case MESSAGE_TYPE_INSERT:
-            spl->stats[tid].insertions++;
-            platform_histo_insert(spl->stats[tid].insert_latency_histo,
-                                  platform_timestamp_elapsed(ts));
-            break;
-         case MESSAGE_TYPE_UPDATE:
-            spl->stats[tid].updates++;
-            platform_histo_insert(spl->stats[tid].update_latency_histo,
-                                  platform_timestamp_elapsed(ts));
-            break;
-         case MESSAGE_TYPE_DELETE:
-            spl->stats[tid].deletions++;
-            platform_histo_insert(spl->stats[tid].delete_latency_histo,
-                                  platform_timestamp_elapsed(ts));
+/*
+ *-----------------------------------------------------------------------------
+ * trunk_sync --
+ *
+ *      Waits until all inserts which completed before the call are durable
+ *      in the log. Concurrent callers share a group commit.
+ *
+ * Results:
+ *      STATUS_INVALID_STATE if the trunk has no log, otherwise the status of
+ *      the log flush.
+ *-----------------------------------------------------------------------------
+ */
+platform_status
+trunk_sync(trunk_handle *spl)
+{
+   if (!spl->cfg.use_log) {
+      return STATUS_INVALID_STATE;
+   }
+
+   // a checkpoint may switch logs, and frees the old one once no thread
+   // syncing it remains, see trunk_checkpoint_switch_log
+   uint64      wait = 1;
+   uint64      slot;
+   log_handle *log;
+   while (TRUE) {
+      uint64 epoch = spl->log_epoch;
+      if (epoch % 2 == 0) {
+         slot = epoch / 2 % 2;
+         __sync_fetch_and_add(&spl->log_syncs[slot], 1);
+         log = __atomic_load_n(&spl->log, __ATOMIC_ACQUIRE);
+         if (spl->log_epoch == epoch) {
             break;
-         default:
-            platform_assert(0);
+         }
+         __sync_fetch_and_sub(&spl->log_syncs[slot], 1);
       }
+      platform_sleep(wait);
+      wait = wait > 2048 ? wait : 2 * wait;
    }
-
-out:
+   platform_status rc = log_sync(log);
+   __sync_fetch_and_sub(&spl->log_syncs[slot], 1);
    return rc;
 }
 
@@ -6220,6 +9838,7 @@ trunk_filter_lookup(trunk_handle      *spl,
                     routing_filter    *filter,
                     routing_config    *cfg,
                     uint16             start_branch,
+                    uint64             tombstone_gen,
                     key                target,
                     merge_accumulator *data)
 {
@@ -6244,8 +9863,8 @@ trunk_filter_lookup(trunk_handle      *spl,
       trunk_branch   *branch = trunk_get_branch(spl, node, branch_no);
       bool            local_found;
       platform_status rc;
-      rc =
-         trunk_btree_lookup_and_merge(spl, branch, target, data, &local_found);
+      rc = trunk_btree_lookup_and_merge(
+         spl, branch, tombstone_gen, target, data, &local_found);
       platform_assert_status_ok(rc);
       if (spl->cfg.use_stats) {
          spl->stats[tid].branch_lookups[height]++;
@@ -6267,6 +9886,7 @@ bool
 trunk_compacted_subbundle_lookup(trunk_handle      *spl,
                                  page_handle       *node,
                                  trunk_subbundle   *sb,
+                                 uint64             tombstone_gen,
                                  key                target,
                                  merge_accumulator *data)
 {
@@ -6286,7 +9906,6 @@ trunk_compacted_subbundle_lookup(trunk_handle      *spl,
       }
       uint64          found_values;
       routing_filter *filter = trunk_subbundle_filter(spl, node, sb, filter_no);
-      debug_assert(filter->addr != 0);
       platform_status rc = routing_filter_lookup(
          spl->cc, &spl->cfg.filter_cfg, filter, target, &found_values);
       platform_assert_status_ok(rc);
@@ -6296,7 +9915,7 @@ trunk_compacted_subbundle_lookup(trunk_handle      *spl,
          bool            local_found;
          platform_status rc;
          rc = trunk_btree_lookup_and_merge(
-            spl, branch, target, data, &local_found);
+            spl, branch, tombstone_gen, target, data, &local_found);
          platform_assert_status_ok(rc);
          if (spl->cfg.use_stats) {
             spl->stats[tid].branch_lookups[height]++;
@@ -6319,6 +9938,7 @@ bool
 trunk_bundle_lookup(trunk_handle      *spl,
                     page_handle       *node,
                     trunk_bundle      *bundle,
+                    uint64             tombstone_gen,
                     key                target,
                     merge_accumulator *data)
 {
@@ -6329,14 +9949,19 @@ trunk_bundle_lookup(trunk_handle      *spl,
       trunk_subbundle *sb = trunk_get_subbundle(spl, node, sb_no);
       bool             should_continue;
       if (sb->state == SB_STATE_COMPACTED) {
-         should_continue =
-            trunk_compacted_subbundle_lookup(spl, node, sb, target, data);
+         should_continue = trunk_compacted_subbundle_lookup(
+            spl, node, sb, tombstone_gen, target, data);
       } else {
          routing_filter *filter = trunk_subbundle_filter(spl, node, sb, 0);
          routing_config *cfg    = &spl->cfg.filter_cfg;
-         debug_assert(filter->addr != 0);
-         should_continue = trunk_filter_lookup(
-            spl, node, filter, cfg, sb->start_branch, target, data);
+         should_continue = trunk_filter_lookup(spl,
+                                               node,
+                                               filter,
+                                               cfg,
+                                               sb->start_branch,
+                                               tombstone_gen,
+                                               target,
+                                               data);
       }
       if (!should_continue) {
          return should_continue;
@@ -6349,6 +9974,7 @@ bool
 trunk_pivot_lookup(trunk_handle      *spl,
                    page_handle       *node,
                    trunk_pivot_data  *pdata,
+                   uint64             tombstone_gen,
                    key                target,
                    merge_accumulator *data)
 {
@@ -6360,15 +9986,21 @@ trunk_pivot_lookup(trunk_handle      *spl,
       debug_assert(trunk_bundle_live(spl, node, bundle_no));
       trunk_bundle *bundle = trunk_get_bundle(spl, node, bundle_no);
       bool          should_continue =
-         trunk_bundle_lookup(spl, node, bundle, target, data);
+         trunk_bundle_lookup(spl, node, bundle, tombstone_gen, target, data);
       if (!should_continue) {
          return should_continue;
       }
    }
 
    routing_config *cfg = &spl->cfg.filter_cfg;
-   return trunk_filter_lookup(
-      spl, node, &pdata->filter, cfg, pdata->start_branch, target, data);
+   return trunk_filter_lookup(spl,
+                              node,
+                              &pdata->filter,
+                              cfg,
+                              pdata->start_branch,
+                              tombstone_gen,
+                              target,
+                              data);
 }
 
 // If any change is made in here, please make similar change in
@@ -6385,13 +10017,16 @@ trunk_lookup(trunk_handle *spl, key target, merge_accumulator *result)
 
    merge_accumulator_set_to_null(result);
 
+   // data older than tombstone_gen is range deleted
+   uint64 tombstone_gen = trunk_range_tombstone_generation(spl, target);
+
    bool         found_in_memtable   = FALSE;
    page_handle *mt_lookup_lock_page = memtable_get_lookup_lock(spl->mt_ctxt);
    uint64       mt_gen_start        = memtable_generation(spl->mt_ctxt);
    uint64       mt_gen_end          = memtable_generation_retired(spl->mt_ctxt);
    for (uint64 mt_gen = mt_gen_start; mt_gen != mt_gen_end; mt_gen--) {
       platform_status rc;
-      rc = trunk_memtable_lookup(spl, mt_gen, target, result);
+      rc = trunk_memtable_lookup(spl, mt_gen, tombstone_gen, target, result);
       platform_assert_status_ok(rc);
       if (merge_accumulator_is_definitive(result)) {
          found_in_memtable = TRUE;
@@ -6412,7 +10047,7 @@ trunk_lookup(trunk_handle *spl, key target, merge_accumulator *result)
       debug_assert(pivot_no < trunk_num_children(spl, node));
       trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
       bool              should_continue =
-         trunk_pivot_lookup(spl, node, pdata, target, result);
+         trunk_pivot_lookup(spl, node, pdata, tombstone_gen, target, result);
       if (!should_continue) {
          goto found_final_answer_early;
       }
@@ -6423,7 +10058,8 @@ trunk_lookup(trunk_handle *spl, key target, merge_accumulator *result)
 
    // look in leaf
    trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, 0);
-   bool should_continue = trunk_pivot_lookup(spl, node, pdata, target, result);
+   bool              should_continue =
+      trunk_pivot_lookup(spl, node, pdata, tombstone_gen, target, result);
    if (!should_continue) {
       goto found_final_answer_early;
    }
@@ -6434,30 +10070,428 @@ trunk_lookup(trunk_handle *spl, key target, merge_accumulator *result)
    if (!merge_accumulator_is_null(result)) {
       data_merge_tuples_final(spl->cfg.data_cfg, target, result);
    }
-found_final_answer_early:
+found_final_answer_early:
+
+   if (found_in_memtable) {
+      // release memtable lookup lock
+      memtable_unget_lookup_lock(spl->mt_ctxt, mt_lookup_lock_page);
+   } else {
+      trunk_node_unget(spl, &node);
+   }
+   if (spl->cfg.use_stats) {
+      threadid tid = platform_get_tid();
+      if (!merge_accumulator_is_null(result)) {
+         spl->stats[tid].lookups_found++;
+      } else {
+         spl->stats[tid].lookups_not_found++;
+      }
+   }
+
+   /* Normalize DELETE messages to return a null merge_accumulator */
+   if (!merge_accumulator_is_null(result)
+       && merge_accumulator_message_class(result) == MESSAGE_TYPE_DELETE)
+   {
+      merge_accumulator_set_to_null(result);
+   }
+
+   return STATUS_OK;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Batched lookups
+ *
+ *      trunk_lookup_batch answers a batch of point lookups with a single
+ *      walk of the trunk. The keys are sorted, so the keys routed to a given
+ *      pivot form a contiguous run; each trunk node is then got once per
+ *      batch rather than once per key, and each routing filter is probed
+ *      once for the whole run via routing_filter_lookup_batch.
+ *
+ *      The per-batch state lives in a trunk_lookup_batch_ctxt. keys and
+ *      results are indexed in sorted order; done[i] is set once results[i]
+ *      holds a definitive answer.
+ *-----------------------------------------------------------------------------
+ */
+typedef struct trunk_lookup_batch_ctxt {
+   trunk_handle      *spl;
+   threadid           tid;
+   key                keys[TRUNK_LOOKUP_BATCH_MAX];
+   merge_accumulator *results[TRUNK_LOOKUP_BATCH_MAX];
+   uint64             tombstone_gen[TRUNK_LOOKUP_BATCH_MAX];
+   uint64             order[TRUNK_LOOKUP_BATCH_MAX];
+   bool               done[TRUNK_LOOKUP_BATCH_MAX];
+   bool               sb_pending[TRUNK_LOOKUP_BATCH_MAX];
+
+   // scratch for probing one filter with a run of keys
+   key    probe_keys[TRUNK_LOOKUP_BATCH_MAX];
+   uint64 probe_key_no[TRUNK_LOOKUP_BATCH_MAX];
+   uint64 found_values[TRUNK_LOOKUP_BATCH_MAX];
+   uint64 probe_scratch[TRUNK_LOOKUP_BATCH_MAX];
+} trunk_lookup_batch_ctxt;
+
+static int
+trunk_lookup_batch_compare(const void *a, const void *b, void *arg)
+{
+   trunk_lookup_batch_ctxt *ctxt = (trunk_lookup_batch_ctxt *)arg;
+   return trunk_key_compare(ctxt->spl,
+                            ctxt->probe_keys[*(const uint64 *)a],
+                            ctxt->probe_keys[*(const uint64 *)b]);
+}
+
+/*
+ * Gathers the keys in [start, end) which are still live (and, if
+ * sb_pending_only, still pending in the current subbundle) into the probe
+ * arrays, and probes filter with them. Returns the number of keys probed.
+ */
+static uint64
+trunk_lookup_batch_probe(trunk_lookup_batch_ctxt *ctxt,
+                         routing_filter          *filter,
+                         uint16                   height,
+                         uint64                   start,
+                         uint64                   end,
+                         bool                     sb_pending_only)
+{
+   trunk_handle *spl       = ctxt->spl;
+   uint64        num_probe = 0;
+   for (uint64 i = start; i < end; i++) {
+      if (ctxt->done[i] || (sb_pending_only && !ctxt->sb_pending[i])) {
+         continue;
+      }
+      ctxt->probe_keys[num_probe]   = ctxt->keys[i];
+      ctxt->probe_key_no[num_probe] = i;
+      num_probe++;
+   }
+   if (num_probe == 0) {
+      return 0;
+   }
+
+   platform_status rc = routing_filter_lookup_batch(spl->cc,
+                                                    &spl->cfg.filter_cfg,
+                                                    filter,
+                                                    num_probe,
+                                                    ctxt->probe_keys,
+                                                    ctxt->found_values,
+                                                    ctxt->probe_scratch);
+   platform_assert_status_ok(rc);
+   if (spl->cfg.use_stats) {
+      spl->stats[ctxt->tid].filter_lookups[height] += num_probe;
+   }
+   return num_probe;
+}
+
+/*
+ * Looks up key i of the batch in branch, marking it done if the answer
+ * becomes definitive. Returns TRUE if the key was found in the branch.
+ */
+static bool
+trunk_lookup_batch_branch(trunk_lookup_batch_ctxt *ctxt,
+                          trunk_branch            *branch,
+                          uint16                   height,
+                          uint64                   i)
+{
+   trunk_handle   *spl = ctxt->spl;
+   bool            local_found;
+   platform_status rc = trunk_btree_lookup_and_merge(spl,
+                                                     branch,
+                                                     ctxt->tombstone_gen[i],
+                                                     ctxt->keys[i],
+                                                     ctxt->results[i],
+                                                     &local_found);
+   platform_assert_status_ok(rc);
+   if (spl->cfg.use_stats) {
+      spl->stats[ctxt->tid].branch_lookups[height]++;
+   }
+   if (local_found) {
+      if (merge_accumulator_is_definitive(ctxt->results[i])) {
+         ctxt->done[i] = TRUE;
+      }
+   } else if (spl->cfg.use_stats) {
+      spl->stats[ctxt->tid].filter_false_positives[height]++;
+   }
+   return local_found;
+}
+
+/*
+ * Batched analogue of trunk_filter_lookup for the keys in [start, end).
+ */
+static void
+trunk_filter_lookup_batch(trunk_lookup_batch_ctxt *ctxt,
+                          page_handle             *node,
+                          routing_filter          *filter,
+                          uint16                   start_branch,
+                          uint64                   start,
+                          uint64                   end)
+{
+   trunk_handle *spl    = ctxt->spl;
+   uint16        height = trunk_height(spl, node);
+   uint64        num_probe =
+      trunk_lookup_batch_probe(ctxt, filter, height, start, end, FALSE);
+
+   for (uint64 j = 0; j < num_probe; j++) {
+      uint64 i            = ctxt->probe_key_no[j];
+      uint64 found_values = ctxt->found_values[j];
+      uint16 next_value =
+         routing_filter_get_next_value(found_values, ROUTING_NOT_FOUND);
+      while (next_value != ROUTING_NOT_FOUND && !ctxt->done[i]) {
+         uint16 branch_no =
+            trunk_add_branch_number(spl, start_branch, next_value);
+         trunk_branch *branch = trunk_get_branch(spl, node, branch_no);
+         trunk_lookup_batch_branch(ctxt, branch, height, i);
+         next_value = routing_filter_get_next_value(found_values, next_value);
+      }
+   }
+}
+
+/*
+ * Batched analogue of trunk_compacted_subbundle_lookup for the keys in
+ * [start, end). A key stops probing the subbundle's filters at the first
+ * filter that reports it.
+ */
+static void
+trunk_compacted_subbundle_lookup_batch(trunk_lookup_batch_ctxt *ctxt,
+                                       page_handle             *node,
+                                       trunk_subbundle         *sb,
+                                       uint64                   start,
+                                       uint64                   end)
+{
+   trunk_handle *spl = ctxt->spl;
+   debug_assert(sb->state == SB_STATE_COMPACTED);
+   debug_assert(trunk_subbundle_branch_count(spl, node, sb) == 1);
+   uint16        height = trunk_height(spl, node);
+   trunk_branch *branch = trunk_get_branch(spl, node, sb->start_branch);
+
+   for (uint64 i = start; i < end; i++) {
+      ctxt->sb_pending[i] = TRUE;
+   }
+
+   uint16 filter_count = trunk_subbundle_filter_count(spl, node, sb);
+   for (uint16 filter_no = 0; filter_no != filter_count; filter_no++) {
+      routing_filter *filter = trunk_subbundle_filter(spl, node, sb, filter_no);
+      uint64 num_probe =
+         trunk_lookup_batch_probe(ctxt, filter, height, start, end, TRUE);
+      if (num_probe == 0) {
+         break;
+      }
+      for (uint64 j = 0; j < num_probe; j++) {
+         if (ctxt->found_values[j]) {
+            uint64 i            = ctxt->probe_key_no[j];
+            ctxt->sb_pending[i] = FALSE;
+            trunk_lookup_batch_branch(ctxt, branch, height, i);
+         }
+      }
+   }
+}
+
+/*
+ * Batched analogue of trunk_pivot_lookup for the keys in [start, end).
+ */
+static void
+trunk_pivot_lookup_batch(trunk_lookup_batch_ctxt *ctxt,
+                         page_handle             *node,
+                         trunk_pivot_data        *pdata,
+                         uint64                   start,
+                         uint64                   end)
+{
+   trunk_handle *spl = ctxt->spl;
+
+   // first check in bundles, newest first
+   uint16 num_bundles = trunk_pivot_bundle_count(spl, node, pdata);
+   for (uint16 bundle_off = 0; bundle_off != num_bundles; bundle_off++) {
+      uint16 bundle_no = trunk_subtract_bundle_number(
+         spl, trunk_end_bundle(spl, node), bundle_off + 1);
+      debug_assert(trunk_bundle_live(spl, node, bundle_no));
+      trunk_bundle *bundle   = trunk_get_bundle(spl, node, bundle_no);
+      uint16        sb_count = trunk_bundle_subbundle_count(spl, node, bundle);
+      for (uint16 sb_off = 0; sb_off != sb_count; sb_off++) {
+         uint16 sb_no = trunk_subtract_subbundle_number(
+            spl, bundle->end_subbundle, sb_off + 1);
+         trunk_subbundle *sb = trunk_get_subbundle(spl, node, sb_no);
+         if (sb->state == SB_STATE_COMPACTED) {
+            trunk_compacted_subbundle_lookup_batch(ctxt, node, sb, start, end);
+         } else {
+            routing_filter *filter = trunk_subbundle_filter(spl, node, sb, 0);
+            trunk_filter_lookup_batch(
+               ctxt, node, filter, sb->start_branch, start, end);
+         }
+      }
+   }
+
+   trunk_filter_lookup_batch(
+      ctxt, node, &pdata->filter, pdata->start_branch, start, end);
+}
+
+static bool
+trunk_lookup_batch_any_live(trunk_lookup_batch_ctxt *ctxt,
+                            uint64                   start,
+                            uint64                   end)
+{
+   for (uint64 i = start; i < end; i++) {
+      if (!ctxt->done[i]) {
+         return TRUE;
+      }
+   }
+   return FALSE;
+}
+
+/*
+ * Looks up the keys in [start, end), all of which fall within node, in the
+ * subtree rooted at node. The caller holds a read lock on node.
+ */
+static void
+trunk_lookup_batch_node(trunk_lookup_batch_ctxt *ctxt,
+                        page_handle             *node,
+                        uint64                   start,
+                        uint64                   end)
+{
+   trunk_handle *spl = ctxt->spl;
+
+   if (trunk_height(spl, node) == 0) {
+      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, 0);
+      trunk_pivot_lookup_batch(ctxt, node, pdata, start, end);
+      return;
+   }
+
+   uint64 run_start = start;
+   while (run_start < end) {
+      uint16 pivot_no = trunk_find_pivot(
+         spl, node, ctxt->keys[run_start], less_than_or_equal);
+      debug_assert(pivot_no < trunk_num_children(spl, node));
+      key    next_pivot = trunk_get_pivot(spl, node, pivot_no + 1);
+      uint64 run_end    = run_start + 1;
+      while (run_end < end
+             && trunk_key_compare(spl, ctxt->keys[run_end], next_pivot) < 0)
+      {
+         run_end++;
+      }
+
+      trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
+      trunk_pivot_lookup_batch(ctxt, node, pdata, run_start, run_end);
+      if (trunk_lookup_batch_any_live(ctxt, run_start, run_end)) {
+         page_handle *child = trunk_node_get(spl, pdata->addr);
+         trunk_lookup_batch_node(ctxt, child, run_start, run_end);
+         trunk_node_unget(spl, &child);
+      }
+      run_start = run_end;
+   }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * trunk_lookup_batch --
+ *
+ *      Looks up num_keys keys, storing the result for keys[i] in results[i]
+ *      exactly as trunk_lookup would. num_keys must be at most
+ *      TRUNK_LOOKUP_BATCH_MAX.
+ *
+ *      The memtables are searched under a single acquisition of the lookup
+ *      lock, and the trunk is then walked once for the whole batch. Unlike
+ *      trunk_lookup, which releases each parent after getting its child, the
+ *      batch holds read locks on the whole path to the current node, since
+ *      it returns to the parent to route the next run of keys.
+ *
+ * Results:
+ *      STATUS_OK, or STATUS_NO_MEMORY if the batch context can't be
+ *      allocated.
+ *
+ * Side effects:
+ *      None.
+ *-----------------------------------------------------------------------------
+ */
+platform_status
+trunk_lookup_batch(trunk_handle       *spl,
+                   uint64              num_keys,
+                   key                *keys,
+                   merge_accumulator **results)
+{
+   platform_assert(num_keys <= TRUNK_LOOKUP_BATCH_MAX);
+   if (num_keys == 0) {
+      return STATUS_OK;
+   }
+
+   trunk_lookup_batch_ctxt *ctxt = TYPED_MALLOC(spl->heap_id, ctxt);
+   if (ctxt == NULL) {
+      return STATUS_NO_MEMORY;
+   }
+   ctxt->spl = spl;
+   ctxt->tid = platform_get_tid();
+
+   // sort the batch, using probe_keys to hold the keys in caller order
+   for (uint64 i = 0; i < num_keys; i++) {
+      ctxt->probe_keys[i] = keys[i];
+      ctxt->order[i]      = i;
+   }
+   uint64 tmp;
+   platform_sort_slow(ctxt->order,
+                      num_keys,
+                      sizeof(ctxt->order[0]),
+                      trunk_lookup_batch_compare,
+                      ctxt,
+                      &tmp);
+   for (uint64 i = 0; i < num_keys; i++) {
+      ctxt->keys[i]    = keys[ctxt->order[i]];
+      ctxt->results[i] = results[ctxt->order[i]];
+      ctxt->done[i]    = FALSE;
+      ctxt->tombstone_gen[i] =
+         trunk_range_tombstone_generation(spl, ctxt->keys[i]);
+      merge_accumulator_set_to_null(ctxt->results[i]);
+   }
+
+   // look in memtables
+   bool         any_live            = FALSE;
+   page_handle *mt_lookup_lock_page = memtable_get_lookup_lock(spl->mt_ctxt);
+   uint64       mt_gen_start        = memtable_generation(spl->mt_ctxt);
+   uint64       mt_gen_end          = memtable_generation_retired(spl->mt_ctxt);
+   for (uint64 i = 0; i < num_keys; i++) {
+      for (uint64 mt_gen = mt_gen_start; mt_gen != mt_gen_end; mt_gen--) {
+         platform_status rc;
+         rc = trunk_memtable_lookup(spl,
+                                    mt_gen,
+                                    ctxt->tombstone_gen[i],
+                                    ctxt->keys[i],
+                                    ctxt->results[i]);
+         platform_assert_status_ok(rc);
+         if (merge_accumulator_is_definitive(ctxt->results[i])) {
+            ctxt->done[i] = TRUE;
+            break;
+         }
+      }
+      any_live = any_live || !ctxt->done[i];
+   }
 
-   if (found_in_memtable) {
-      // release memtable lookup lock
+   if (any_live) {
+      // hold root read lock to prevent memtable flush
+      page_handle *root = trunk_node_get(spl, spl->root_addr);
       memtable_unget_lookup_lock(spl->mt_ctxt, mt_lookup_lock_page);
+      trunk_lookup_batch_node(ctxt, root, 0, num_keys);
+      trunk_node_unget(spl, &root);
    } else {
-      trunk_node_unget(spl, &node);
+      memtable_unget_lookup_lock(spl->mt_ctxt, mt_lookup_lock_page);
    }
-   if (spl->cfg.use_stats) {
-      threadid tid = platform_get_tid();
-      if (!merge_accumulator_is_null(result)) {
-         spl->stats[tid].lookups_found++;
-      } else {
-         spl->stats[tid].lookups_not_found++;
+
+   for (uint64 i = 0; i < num_keys; i++) {
+      merge_accumulator *result = ctxt->results[i];
+      if (!ctxt->done[i] && !merge_accumulator_is_null(result)) {
+         debug_assert(merge_accumulator_message_class(result)
+                      == MESSAGE_TYPE_UPDATE);
+         data_merge_tuples_final(spl->cfg.data_cfg, ctxt->keys[i], result);
+      }
+      if (spl->cfg.use_stats) {
+         if (!merge_accumulator_is_null(result)) {
+            spl->stats[ctxt->tid].lookups_found++;
+         } else {
+            spl->stats[ctxt->tid].lookups_not_found++;
+         }
       }
-   }
 
-   /* Normalize DELETE messages to return a null merge_accumulator */
-   if (!merge_accumulator_is_null(result)
-       && merge_accumulator_message_class(result) == MESSAGE_TYPE_DELETE)
-   {
-      merge_accumulator_set_to_null(result);
+      /* Normalize DELETE messages to return a null merge_accumulator */
+      if (!merge_accumulator_is_null(result)
+          && merge_accumulator_message_class(result) == MESSAGE_TYPE_DELETE)
+      {
+         merge_accumulator_set_to_null(result);
+      }
    }
 
+   platform_free(spl->heap_id, ctxt);
    return STATUS_OK;
 }
 
@@ -6597,6 +10631,8 @@ trunk_lookup_async(trunk_handle      *spl,    // IN
          case async_state_start:
          {
             merge_accumulator_set_to_null(result);
+            ctxt->tombstone_gen =
+               trunk_range_tombstone_generation(spl, target);
             trunk_async_set_state(ctxt, async_state_lookup_memtable);
             // fallthrough
          }
@@ -6607,7 +10643,8 @@ trunk_lookup_async(trunk_handle      *spl,    // IN
             uint64 mt_gen_end   = memtable_generation_retired(spl->mt_ctxt);
             for (uint64 mt_gen = mt_gen_start; mt_gen != mt_gen_end; mt_gen--) {
                platform_status rc;
-               rc = trunk_memtable_lookup(spl, mt_gen, target, result);
+               rc = trunk_memtable_lookup(
+                  spl, mt_gen, ctxt->tombstone_gen, target, result);
                platform_assert_status_ok(rc);
                if (merge_accumulator_is_definitive(result)) {
                   trunk_async_set_state(ctxt,
@@ -6615,6 +10652,12 @@ trunk_lookup_async(trunk_handle      *spl,    // IN
                   break;
                }
             }
+            if (ctxt->state == async_state_found_final_answer_early) {
+               // Memtable hit; no need to descend the trunk
+               break;
+            }
+            // Retries and the IO callback resume at the root get
+            trunk_async_set_state(ctxt, async_state_get_root_reentrant);
             // fallthrough
          }
          case async_state_get_root_reentrant:
@@ -6659,6 +10702,14 @@ trunk_lookup_async(trunk_handle      *spl,    // IN
          }
          case async_state_trunk_node_lookup:
          {
+            if (node == NULL) {
+               // The root was loaded by async IO, see trunk_async_callback
+               debug_assert(ctxt->was_async);
+               trunk_node_async_done(spl, ctxt);
+               ctxt->trunk_node = node = ctxt->cache_ctxt.page;
+               memtable_unget_lookup_lock(spl->mt_ctxt, ctxt->mt_lock_page);
+               ctxt->mt_lock_page = NULL;
+            }
             ctxt->height = trunk_height(spl, node);
             uint16 pivot_no =
                trunk_find_pivot(spl, node, target, less_than_or_equal);
@@ -6705,7 +10756,8 @@ trunk_lookup_async(trunk_handle      *spl,    // IN
          {
             ctxt->value = ROUTING_NOT_FOUND;
             if (ctxt->filter->addr == 0) {
-               platform_assert(ctxt->lookup_state == async_lookup_state_pivot);
+               // empty filter, see trunk_build_filters
+               ctxt->found_values = 0;
                trunk_async_set_state(ctxt, async_state_next_in_node);
                break;
             }
@@ -6798,7 +10850,6 @@ trunk_lookup_async(trunk_handle      *spl,    // IN
                   }
                   branch_no = trunk_add_branch_number(
                      spl, ctxt->sb->start_branch, ctxt->value);
-                  branch_no = ctxt->sb->start_branch + ctxt->value;
                   break;
                case async_lookup_state_compacted_subbundle:
                   debug_assert(ctxt->sb != NULL);
@@ -6815,6 +10866,13 @@ trunk_lookup_async(trunk_handle      *spl,    // IN
                   platform_assert(0);
             }
             ctxt->branch = trunk_get_branch(spl, node, branch_no);
+            if (ctxt->branch->generation < ctxt->tombstone_gen) {
+               // range deleted, as in trunk_btree_lookup_and_merge
+               trunk_apply_range_tombstone(spl, target, result);
+               trunk_async_set_state(ctxt,
+                                     async_state_found_final_answer_early);
+               continue;
+            }
             btree_ctxt_init(&ctxt->btree_ctxt,
                             &ctxt->cache_ctxt,
                             trunk_btree_async_callback);
@@ -7011,54 +11069,1111 @@ trunk_lookup_async(trunk_handle      *spl,    // IN
                }
             }
 
-            res  = async_success;
-            done = TRUE;
-            break;
+            res  = async_success;
+            done = TRUE;
+            break;
+         }
+         default:
+            platform_assert(0);
+      }
+   } while (!done);
+#if TRUNK_DEBUG
+   cache_enable_sync_get(spl->cc, TRUE);
+#endif
+
+   return res;
+}
+
+
+platform_status
+trunk_range(trunk_handle  *spl,
+            key            start_key,
+            uint64         num_tuples,
+            tuple_function func,
+            void          *arg)
+{
+   trunk_range_iterator *range_itor = TYPED_MALLOC(spl->heap_id, range_itor);
+   platform_status       rc         = trunk_range_iterator_init(
+      spl, range_itor, start_key, POSITIVE_INFINITY_KEY, num_tuples);
+   if (!SUCCESS(rc)) {
+      goto destroy_range_itor;
+   }
+
+   bool at_end;
+   iterator_at_end(&range_itor->super, &at_end);
+
+   for (int i = 0; i < num_tuples && !at_end; i++) {
+      key     curr_key;
+      message data;
+      iterator_get_curr(&range_itor->super, &curr_key, &data);
+      func(curr_key, data, arg);
+      iterator_advance(&range_itor->super);
+      iterator_at_end(&range_itor->super, &at_end);
+   }
+
+destroy_range_itor:
+   trunk_range_iterator_deinit(range_itor);
+   platform_free(spl->heap_id, range_itor);
+   return rc;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ * Crash recovery
+ *
+ *      When the log is enabled, the on-disk image of the trunk at mount (or
+ *      create) time, the checkpoint, is kept intact until unmount:
+ *
+ *      1. trunk pages are updated in place, so the cache defers their
+ *         writeback until trunk_prepare_for_shutdown,
+ *      2. the allocator persists its ref counts and pins every extent in use,
+ *         so that the extents the checkpoint refers to are not reused even
+ *         once they are freed, see allocator_checkpoint,
+ *      3. the super block records the root, the mini allocator meta tail and
+ *         range tombstones of the checkpoint together with the log and the
+ *         first memtable generation which is not in the checkpoint.
+ *
+ *      The cache also defers the writeback of log pages, so that a page
+ *      sealed by a log sync is never overwritten by a later, unsealed version
+ *      of it, which would end the replay early.
+ *
+ *      So after a crash, trunk_mount finds the checkpoint and replays the log
+ *      entries of the memtables which followed it. The log extents are free
+ *      in the persisted ref counts, so recovery claims them before reading.
+ *      The replay is split by key range across threads, so that each key is
+ *      replayed by a single thread in generation order. The replayed
+ *      updates are written to the new log, which is synced before the super
+ *      block moves to it, so a crash during recovery simply recovers again.
+ *
+ *      A range delete is logged with the generation of the memtable it
+ *      came after, and the replay adds its tombstone before replaying the
+ *      updates, so that it deletes the older ones, see trunk_replay_log.
+ *
+ *      Bulk loads are not logged, so trunk_bulk_load_runs takes a
+ *      checkpoint before it returns, see trunk_checkpoint_now. A database
+ *      whose unmount was interrupted is lost. Only one trunk per allocator
+ *      is recoverable.
+ *-----------------------------------------------------------------------------
+ */
+
+/*
+ * Makes the current on-disk image of the trunk the checkpoint recovery starts
+ * from. The trunk pages must all be clean.
+ */
+static void
+trunk_checkpoint_start(trunk_handle *spl,
+                       uint64        meta_tail,
+                       uint64        range_tombstone_addr)
+{
+   platform_status rc = allocator_checkpoint(spl->al);
+   platform_assert_status_ok(rc);
+   cache_defer_writeback(spl->cc, PAGE_TYPE_TRUNK, TRUE);
+   cache_defer_writeback(spl->cc, PAGE_TYPE_LOG, TRUE);
+   spl->checkpoint.meta_tail            = meta_tail;
+   spl->checkpoint.range_tombstone_addr = range_tombstone_addr;
+   spl->checkpoint.generation_base      = spl->generation_base;
+   ZERO_CONTENTS(&spl->checkpoint.journal);
+}
+
+typedef struct trunk_recompact_arg {
+   trunk_compact_bundle_req **req;
+   uint64                     num_reqs;
+} trunk_recompact_arg;
+
+/*
+ * Adds a compact_bundle request for each bundle of the node to arg, or only
+ * counts them if arg->req is NULL. The requests are those a flush into the
+ * node would issue now.
+ */
+static bool
+trunk_node_recompact_bundles(trunk_handle *spl, uint64 addr, void *arg)
+{
+   trunk_recompact_arg *recompact = (trunk_recompact_arg *)arg;
+   page_handle         *node      = trunk_node_get(spl, addr);
+   for (uint16 bundle_no = trunk_start_bundle(spl, node);
+        bundle_no != trunk_end_bundle(spl, node);
+        bundle_no = trunk_add_bundle_number(spl, bundle_no, 1))
+   {
+      if (recompact->req == NULL) {
+         recompact->num_reqs++;
+         continue;
+      }
+      trunk_compact_bundle_req *req = TYPED_ZALLOC(spl->heap_id, req);
+      platform_assert(req != NULL);
+      req->spl                  = spl;
+      req->addr                 = addr;
+      req->height               = trunk_height(spl, node);
+      req->bundle_no            = bundle_no;
+      req->type                 = TRUNK_COMPACTION_TYPE_FLUSH;
+      req->generation           = trunk_generation(spl, node);
+      req->max_pivot_generation = trunk_pivot_generation(spl, node);
+      uint16 num_children       = trunk_num_children(spl, node);
+      for (uint16 pivot_no = 0; pivot_no < num_children; pivot_no++) {
+         trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
+         req->pivot_generation[pivot_no] = pdata->generation;
+      }
+      trunk_tuples_in_bundle(spl,
+                             node,
+                             trunk_get_bundle(spl, node, bundle_no),
+                             req->input_pivot_tuple_count,
+                             req->input_pivot_kv_byte_count);
+      recompact->req[recompact->num_reqs++] = req;
+   }
+   trunk_node_unget(spl, &node);
+   return TRUE;
+}
+
+/*
+ * The checkpoint may hold bundles whose compaction or filters were still to
+ * come, and those jobs are lost in a crash. Since the filters of a node are
+ * built in bundle order, one lost job would hold up the node for good, so
+ * recovery compacts every bundle again. The requests are gathered before any
+ * is issued, as the jobs may split the nodes being walked.
+ */
+static void
+trunk_recompact_bundles(trunk_handle *spl)
+{
+   trunk_recompact_arg recompact = {0};
+   trunk_for_each_node(spl, trunk_node_recompact_bundles, &recompact);
+   if (recompact.num_reqs == 0) {
+      return;
+   }
+   recompact.req =
+      TYPED_ARRAY_MALLOC(spl->heap_id, recompact.req, recompact.num_reqs);
+   platform_assert(recompact.req != NULL);
+   recompact.num_reqs = 0;
+   trunk_for_each_node(spl, trunk_node_recompact_bundles, &recompact);
+   for (uint64 i = 0; i < recompact.num_reqs; i++) {
+      platform_status rc = trunk_enqueue_compact_req(
+         spl, trunk_compact_bundle, recompact.req[i], FALSE);
+      platform_assert_status_ok(rc);
+   }
+   platform_free(spl->heap_id, recompact.req);
+}
+
+typedef struct trunk_replay_range {
+   trunk_handle       *spl;
+   shard_log_iterator *itor;
+   uint64             *entry; // indices into itor, in generation order
+   uint64              num_entries;
+   platform_thread     thread;
+   bool                has_thread;
+   platform_status     rc;
+} trunk_replay_range;
+
+static void
+trunk_replay_range_thread(void *arg)
+{
+   trunk_replay_range *range = (trunk_replay_range *)arg;
+
+   range->rc = STATUS_OK;
+   for (uint64 i = 0; i < range->num_entries; i++) {
+      key     tuple_key;
+      message msg;
+      shard_log_iterator_get_entry(
+         range->itor, range->entry[i], &tuple_key, &msg);
+      range->rc = trunk_insert(range->spl, tuple_key, msg);
+      if (!SUCCESS(range->rc)) {
+         return;
+      }
+   }
+}
+
+static int
+trunk_replay_key_compare(const void *a, const void *b, void *arg)
+{
+   trunk_handle *spl = (trunk_handle *)arg;
+   return trunk_key_compare(spl, *(key *)a, *(key *)b);
+}
+
+/*
+ * Returns the number of splitters less than or equal to tuple_key, which is
+ * the replay range of tuple_key.
+ */
+static uint64
+trunk_replay_find_range(trunk_handle *spl,
+                        key          *splitter,
+                        uint64        num_splitters,
+                        key           tuple_key)
+{
+   uint64 lo = 0;
+   uint64 hi = num_splitters;
+   while (lo < hi) {
+      uint64 mid = lo + (hi - lo) / 2;
+      if (trunk_key_compare(spl, splitter[mid], tuple_key) <= 0) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   return lo;
+}
+
+/*
+ * Returns the index of the first entry of the log with a memtable generation
+ * of at least log_generation.
+ */
+static uint64
+trunk_replay_start(shard_log_iterator *itor, uint64 log_generation)
+{
+   key     tuple_key;
+   message msg;
+   uint64  start = 0;
+   while (start < itor->num_entries) {
+      uint64 generation =
+         shard_log_iterator_get_entry(itor, start, &tuple_key, &msg);
+      if (trunk_log_memtable_generation(generation) >= log_generation) {
+         break;
+      }
+      start++;
+   }
+   return start;
+}
+
+/*
+ * Adds the tombstones of the range deletes in the log with a memtable
+ * generation of at least log_generation, which must be done for all the logs
+ * before their updates are replayed.
+ *
+ * The range deletes are logged again too, as they are not in the checkpoint
+ * a crash during or after the recovery recovers from. They are logged with
+ * the first memtable generation of this mount, so they delete only the data
+ * of the checkpoint when replayed.
+ *
+ * The generation_base of the mount is that of the crashed one, so it is
+ * raised until the replayed updates are at least as new as the tombstones.
+ */
+static platform_status
+trunk_replay_range_deletes(trunk_handle       *spl,
+                           shard_log_iterator *itor,
+                           uint64              log_generation,
+                           uint64              log_generation_base)
+{
+   uint64 mt_gen = memtable_generation(spl->mt_ctxt);
+   for (uint64 i = trunk_replay_start(itor, log_generation);
+        i < itor->num_entries;
+        i++)
+   {
+      key     tuple_key;
+      message msg;
+      uint64  generation =
+         shard_log_iterator_get_entry(itor, i, &tuple_key, &msg);
+      if (!trunk_log_is_range_delete(generation)) {
+         continue;
+      }
+      key start_key, end_key;
+      trunk_log_range_delete_keys(msg, &start_key, &end_key);
+      uint64 tombstone_gen =
+         log_generation_base + trunk_log_memtable_generation(generation);
+      if (trunk_data_generation(spl, mt_gen) < tombstone_gen) {
+         spl->generation_base = tombstone_gen - mt_gen;
+      }
+      platform_status rc =
+         trunk_add_range_tombstone(spl, tombstone_gen, start_key, end_key);
+      if (SUCCESS(rc)) {
+         rc = trunk_log_range_delete(spl, mt_gen, start_key, end_key);
+      }
+      if (!SUCCESS(rc)) {
+         return rc;
+      }
+   }
+   return STATUS_OK;
+}
+
+/*
+ * Replays the updates in the log with a memtable generation of at least
+ * log_generation, skipping those deleted by a range delete, see
+ * trunk_replay_range_deletes. The key ranges are chosen from a sample of the
+ * keys, and all but the first are replayed by threads of their own.
+ */
+static platform_status
+trunk_replay_log(trunk_handle       *spl,
+                 shard_log_iterator *itor,
+                 uint64              log_generation,
+                 uint64              log_generation_base)
+{
+   key     tuple_key;
+   message msg;
+   uint64  start       = trunk_replay_start(itor, log_generation);
+   uint64  num_entries = itor->num_entries - start;
+   if (num_entries == 0) {
+      return STATUS_OK;
+   }
+
+   uint64 num_ranges = spl->cfg.num_replay_threads;
+   if (num_ranges == 0) {
+      num_ranges = task_system_num_bg_threads(spl->ts, TASK_TYPE_NORMAL);
+   }
+   num_ranges = MIN(num_ranges, TRUNK_MAX_REPLAY_THREADS);
+   num_ranges = MIN(num_ranges, num_entries);
+   num_ranges = MAX(num_ranges, 1);
+
+   uint64 *entry    = TYPED_ARRAY_MALLOC(spl->heap_id, entry, num_entries);
+   uint8  *range_of = TYPED_ARRAY_MALLOC(spl->heap_id, range_of, num_entries);
+   if (entry == NULL || range_of == NULL) {
+      platform_free(spl->heap_id, entry);
+      platform_free(spl->heap_id, range_of);
+      return STATUS_NO_MEMORY;
+   }
+
+   // choose the splitters from an even sample of the keys
+   key splitter[TRUNK_MAX_REPLAY_THREADS];
+   if (num_ranges > 1) {
+      uint64 num_samples = MIN(num_ranges * TRUNK_REPLAY_SAMPLES, num_entries);
+      key   *sample = TYPED_ARRAY_MALLOC(spl->heap_id, sample, 2 * num_samples);
+      if (sample == NULL) {
+         platform_free(spl->heap_id, entry);
+         platform_free(spl->heap_id, range_of);
+         return STATUS_NO_MEMORY;
+      }
+      for (uint64 i = 0; i < num_samples; i++) {
+         uint64 idx = start + i * num_entries / num_samples;
+         shard_log_iterator_get_entry(itor, idx, &sample[i], &msg);
+      }
+      platform_sort_slow(sample,
+                         num_samples,
+                         sizeof(*sample),
+                         trunk_replay_key_compare,
+                         spl,
+                         &sample[num_samples]);
+      for (uint64 r = 1; r < num_ranges; r++) {
+         splitter[r - 1] = sample[r * num_samples / num_ranges];
+      }
+      platform_free(spl->heap_id, sample);
+   }
+
+   // bucket the entries by range, keeping them in generation order
+   trunk_replay_range range[TRUNK_MAX_REPLAY_THREADS];
+   ZERO_ARRAY(range);
+   for (uint64 i = 0; i < num_entries; i++) {
+      uint64 generation =
+         shard_log_iterator_get_entry(itor, start + i, &tuple_key, &msg);
+      // skip the range deletes and the updates they came after
+      uint64 data_generation =
+         log_generation_base + trunk_log_memtable_generation(generation);
+      if (trunk_log_is_range_delete(generation)
+          || data_generation < trunk_range_tombstone_generation(spl, tuple_key))
+      {
+         range_of[i] = UINT8_MAX;
+         continue;
+      }
+      uint64 r = trunk_replay_find_range(
+         spl, splitter, num_ranges - 1, tuple_key);
+      range_of[i] = r;
+      range[r].num_entries++;
+   }
+   uint64 offset = 0;
+   for (uint64 r = 0; r < num_ranges; r++) {
+      range[r].spl         = spl;
+      range[r].itor        = itor;
+      range[r].entry       = &entry[offset];
+      offset              += range[r].num_entries;
+      range[r].num_entries = 0;
+   }
+   for (uint64 i = 0; i < num_entries; i++) {
+      if (range_of[i] == UINT8_MAX) {
+         continue;
+      }
+      trunk_replay_range *curr = &range[range_of[i]];
+      curr->entry[curr->num_entries++] = start + i;
+   }
+   platform_free(spl->heap_id, range_of);
+
+   for (uint64 r = 1; r < num_ranges; r++) {
+      platform_status rc = task_thread_create("splinter_replay",
+                                              trunk_replay_range_thread,
+                                              &range[r],
+                                              trunk_get_scratch_size(),
+                                              spl->ts,
+                                              spl->heap_id,
+                                              &range[r].thread);
+      if (SUCCESS(rc)) {
+         range[r].has_thread = TRUE;
+      } else {
+         trunk_replay_range_thread(&range[r]);
+      }
+   }
+   trunk_replay_range_thread(&range[0]);
+
+   platform_status rc = STATUS_OK;
+   for (uint64 r = 0; r < num_ranges; r++) {
+      if (range[r].has_thread) {
+         platform_thread_join(range[r].thread);
+      }
+      if (SUCCESS(rc) && !SUCCESS(range[r].rc)) {
+         rc = range[r].rc;
+      }
+   }
+   platform_free(spl->heap_id, entry);
+   spl->log_entries_replayed += num_entries;
+   platform_default_log(
+      "Replayed %lu log entries in %lu ranges\n", num_entries, num_ranges);
+   return rc;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Checkpoints
+ *
+ *      Without more, recovery would replay the log of the whole mount. So
+ *      every checkpoint_interval memtables, a checkpoint moves the image
+ *      recovery starts from forward in the background, and drops the log
+ *      which led up to it. It goes through three phases:
+ *
+ *      1. trunk_checkpoint_switch_log starts a new log behind a memtable
+ *         barrier, so that the old one holds exactly the memtables before
+ *         the barrier. The super block records both logs.
+ *      2. Once those memtables are incorporated, trunk_checkpoint_capture
+ *         quiesces the trunk, see trunk_quiesce, and captures its image: the
+ *         range tombstones, the allocator ref counts and a copy of each dirty
+ *         trunk page. The other pages of the image are written back first,
+ *         since they may be discarded once freed. Trunk pages are updated
+ *         in place, so their homes may still hold the previous image, and
+ *         the copies go to a redo journal instead, see trunk_journal_hdr.
+ *      3. trunk_checkpoint_write, a background task, writes the journal and
+ *         then moves the super block to the new image and the new log alone.
+ *         Only then does it write the journaled pages to their homes, free
+ *         the old log and journal, and let the allocator reuse the extents
+ *         the old image alone referred to.
+ *
+ *      Recovery from an image with a journal first copies the journaled
+ *      pages to their homes and restores the captured ref counts. The image
+ *      may hold range tombstones which are newer than logged updates, so
+ *      replay skips the updates they delete. Compactions in flight at the
+ *      capture are redone, see trunk_recompact_bundles.
+ *-----------------------------------------------------------------------------
+ */
+
+/*
+ * Waits until no thread holds a trunk claim, and keeps threads from taking
+ * new ones until trunk_unquiesce, see trunk_modify_try_begin. Gives up after
+ * TRUNK_QUIESCE_MAX_WAIT_NS, since a thread in the middle of an operation
+ * may wait for the claims of one which is held off.
+ */
+static void
+trunk_unquiesce(trunk_handle *spl)
+{
+   __sync_fetch_and_and(&spl->modifiers, ~TRUNK_QUIESCED);
+}
+
+static bool
+trunk_quiesce(trunk_handle *spl)
+{
+   platform_assert(spl->modifier[platform_get_tid()].claims == 0);
+   __sync_fetch_and_or(&spl->modifiers, TRUNK_QUIESCED);
+   timestamp start = platform_get_timestamp();
+   uint64    wait  = 1;
+   while (spl->modifiers != TRUNK_QUIESCED) {
+      if (platform_timestamp_elapsed(start) > TRUNK_QUIESCE_MAX_WAIT_NS) {
+         trunk_unquiesce(spl);
+         return FALSE;
+      }
+      platform_sleep(wait);
+      wait = wait > 2048 ? wait : 2 * wait;
+   }
+   return TRUE;
+}
+
+/*
+ * The first page of each journal extent is its header.
+ */
+static inline uint64
+trunk_journal_pages_per_extent(trunk_handle *spl)
+{
+   return trunk_pages_per_extent(&spl->cfg) - 1;
+}
+
+static inline uint64
+trunk_journal_page_addr(trunk_handle  *spl,
+                        trunk_journal *journal,
+                        uint64         page_no)
+{
+   uint64 pages_per_extent = trunk_journal_pages_per_extent(spl);
+   return journal->extent[page_no / pages_per_extent]
+          + (1 + page_no % pages_per_extent) * trunk_page_size(&spl->cfg);
+}
+
+static void
+trunk_journal_write_page(trunk_handle *spl, uint64 addr, const void *data)
+{
+   page_handle *page = cache_alloc(spl->cc, addr, PAGE_TYPE_MISC);
+   memmove(page->data, data, trunk_page_size(&spl->cfg));
+   cache_mark_dirty(spl->cc, page);
+   cache_unlock(spl->cc, page);
+   cache_unclaim(spl->cc, page);
+   cache_unget(spl->cc, page);
+}
+
+/*
+ * Allocates the extents of a journal for up to num_pages pages.
+ */
+static void
+trunk_journal_alloc(trunk_handle *spl, trunk_journal *journal, uint64 num_pages)
+{
+   uint64 pages_per_extent = trunk_journal_pages_per_extent(spl);
+   platform_assert(sizeof(trunk_journal_hdr) + pages_per_extent * sizeof(uint64)
+                   <= trunk_page_size(&spl->cfg));
+   journal->num_extents = (num_pages + pages_per_extent - 1) / pages_per_extent;
+   journal->extent =
+      TYPED_ARRAY_MALLOC(spl->heap_id, journal->extent, journal->num_extents);
+   journal->home_addr =
+      TYPED_ARRAY_MALLOC(spl->heap_id, journal->home_addr, num_pages);
+   platform_assert(journal->extent != NULL && journal->home_addr != NULL);
+   for (uint64 extent_no = 0; extent_no < journal->num_extents; extent_no++) {
+      platform_status rc = allocator_alloc(
+         spl->al, &journal->extent[extent_no], PAGE_TYPE_MISC);
+      platform_assert_status_ok(rc);
+   }
+}
+
+static void
+trunk_journal_free(trunk_handle *spl, trunk_journal *journal)
+{
+   for (uint64 extent_no = 0; extent_no < journal->num_extents; extent_no++) {
+      trunk_free_misc_extent(spl, journal->extent[extent_no]);
+   }
+   platform_free(spl->heap_id, journal->extent);
+   platform_free(spl->heap_id, journal->home_addr);
+   ZERO_CONTENTS(journal);
+}
+
+/*
+ * Writes the headers of a journal of num_pages pages, after which it is
+ * complete.
+ */
+static void
+trunk_journal_write_headers(trunk_handle  *spl,
+                            trunk_journal *journal,
+                            uint64         num_pages)
+{
+   uint64 page_size        = trunk_page_size(&spl->cfg);
+   uint64 pages_per_extent = trunk_journal_pages_per_extent(spl);
+   for (uint64 extent_no = 0; extent_no < journal->num_extents; extent_no++) {
+      page_handle *page =
+         cache_alloc(spl->cc, journal->extent[extent_no], PAGE_TYPE_MISC);
+      memset(page->data, 0, page_size);
+      trunk_journal_hdr *hdr = (trunk_journal_hdr *)page->data;
+      if (extent_no + 1 < journal->num_extents) {
+         hdr->next_addr = journal->extent[extent_no + 1];
+      }
+      uint64 start_page = extent_no * pages_per_extent;
+      hdr->num_pages    = MIN(pages_per_extent, num_pages - start_page);
+      memmove(hdr->home_addr,
+              &journal->home_addr[start_page],
+              hdr->num_pages * sizeof(uint64));
+      hdr->checksum =
+         platform_checksum128(page->data + sizeof(checksum128),
+                              page_size - sizeof(checksum128),
+                              TRUNK_JOURNAL_CSUM_SEED);
+      cache_mark_dirty(spl->cc, page);
+      cache_unlock(spl->cc, page);
+      cache_unclaim(spl->cc, page);
+      cache_unget(spl->cc, page);
+   }
+   journal->head_addr = journal->extent[0];
+}
+
+/*
+ * Claims the extents of journal, which are free in the ref counts it holds,
+ * as well as in those of the last allocator checkpoint.
+ */
+static void
+trunk_journal_claim(trunk_handle *spl, trunk_journal *journal)
+{
+   for (uint64 i = 0; i < journal->num_extents; i++) {
+      bool claimed =
+         allocator_claim(spl->al, journal->extent[i], PAGE_TYPE_MISC);
+      platform_assert(claimed);
+   }
+}
+
+/*
+ * Redoes the journal at head_addr in recovery: restores the ref counts it
+ * holds and writes its trunk pages to their homes. Leaves its extents in
+ * journal, free, to be claimed until the recovered trunk is durable.
+ */
+static void
+trunk_journal_redo(trunk_handle *spl, uint64 head_addr, trunk_journal *journal)
+{
+   uint64 page_size     = trunk_page_size(&spl->cfg);
+   uint64 num_ref_pages = 0;
+   ZERO_CONTENTS(journal);
+   for (uint64 addr = head_addr; addr != 0;) {
+      bool claimed = allocator_claim(spl->al, addr, PAGE_TYPE_MISC);
+      platform_assert(claimed);
+      page_handle *page = cache_get(spl->cc, addr, TRUE, PAGE_TYPE_MISC);
+      trunk_journal_hdr *hdr = (trunk_journal_hdr *)page->data;
+      platform_assert(platform_checksum_is_equal(
+         hdr->checksum,
+         platform_checksum128(page->data + sizeof(checksum128),
+                              page_size - sizeof(checksum128),
+                              TRUNK_JOURNAL_CSUM_SEED)));
+      for (uint64 i = 0; i < hdr->num_pages; i++) {
+         if (hdr->home_addr[i] == 0) {
+            num_ref_pages++;
          }
-         default:
-            platform_assert(0);
       }
-   } while (!done);
-#if TRUNK_DEBUG
-   cache_enable_sync_get(spl->cc, TRUE);
-#endif
+      journal->num_extents++;
+      addr = hdr->next_addr;
+      cache_unget(spl->cc, page);
+   }
+
+   journal->head_addr = head_addr;
+   journal->extent =
+      TYPED_ARRAY_MALLOC(spl->heap_id, journal->extent, journal->num_extents);
+   uint64 ref_counts_size = num_ref_pages * page_size;
+   char  *ref_counts =
+      TYPED_ARRAY_MALLOC(spl->heap_id, ref_counts, ref_counts_size);
+   platform_assert(journal->extent != NULL && ref_counts != NULL);
+
+   // X. Restore the ref counts, so that the homes are allocated
+   uint64 extent_no = 0;
+   uint64 ref_page  = 0;
+   for (uint64 addr = head_addr; addr != 0; extent_no++) {
+      journal->extent[extent_no] = addr;
+      page_handle *page = cache_get(spl->cc, addr, TRUE, PAGE_TYPE_MISC);
+      trunk_journal_hdr *hdr = (trunk_journal_hdr *)page->data;
+      for (uint64 i = 0; i < hdr->num_pages; i++) {
+         if (hdr->home_addr[i] == 0) {
+            uint64       page_addr = addr + (i + 1) * page_size;
+            page_handle *src =
+               cache_get(spl->cc, page_addr, TRUE, PAGE_TYPE_MISC);
+            memmove(ref_counts + ref_page++ * page_size, src->data, page_size);
+            cache_unget(spl->cc, src);
+         }
+      }
+      addr = hdr->next_addr;
+      cache_unget(spl->cc, page);
+   }
+   platform_status rc =
+      allocator_restore(spl->al, ref_counts, ref_counts_size);
+   platform_assert_status_ok(rc);
+   platform_free(spl->heap_id, ref_counts);
+   trunk_journal_claim(spl, journal);
+
+   // X. Copy the trunk pages to their homes
+   for (extent_no = 0; extent_no < journal->num_extents; extent_no++) {
+      uint64       addr = journal->extent[extent_no];
+      page_handle *page = cache_get(spl->cc, addr, TRUE, PAGE_TYPE_MISC);
+      trunk_journal_hdr *hdr = (trunk_journal_hdr *)page->data;
+      for (uint64 i = 0; i < hdr->num_pages; i++) {
+         if (hdr->home_addr[i] == 0) {
+            continue;
+         }
+         uint64       page_addr = addr + (i + 1) * page_size;
+         page_handle *src =
+            cache_get(spl->cc, page_addr, TRUE, PAGE_TYPE_MISC);
+         page_handle *node = trunk_node_get(spl, hdr->home_addr[i]);
+         trunk_node_claim(spl, &node);
+         trunk_node_lock(spl, node);
+         memmove(node->data, src->data, page_size);
+         trunk_node_unlock(spl, node);
+         trunk_node_unclaim(spl, node);
+         trunk_node_unget(spl, &node);
+         cache_unget(spl->cc, src);
+      }
+      cache_unget(spl->cc, page);
+   }
+   cache_flush(spl->cc);
 
-   return res;
+   // the image is in place, so the journal is only needed again if recovery
+   // crashes, which recovers from it again
+   for (extent_no = 0; extent_no < journal->num_extents; extent_no++) {
+      trunk_free_misc_extent(spl, journal->extent[extent_no]);
+   }
 }
 
+static inline void
+trunk_checkpoint_set_state(trunk_handle          *spl,
+                           trunk_checkpoint_state from,
+                           trunk_checkpoint_state to)
+{
+   bool success =
+      __sync_bool_compare_and_swap(&spl->checkpoint_state, from, to);
+   platform_assert(success);
+}
 
-platform_status
-trunk_range(trunk_handle  *spl,
-            key            start_key,
-            uint64         num_tuples,
-            tuple_function func,
-            void          *arg)
+/*
+ * Starts a new log for the memtables from generation on. The caller holds a
+ * memtable barrier at generation.
+ */
+static void
+trunk_checkpoint_new_log(trunk_handle *spl, uint64 generation)
+{
+   // trunk_sync may still be syncing the old log, see
+   // trunk_checkpoint_write
+   log_handle *log = log_create(spl->cc, spl->cfg.log_cfg, spl->heap_id);
+   spl->prev_log   = spl->log;
+   __sync_fetch_and_add(&spl->log_epoch, 1);
+   __atomic_store_n(&spl->log, log, __ATOMIC_RELEASE);
+   platform_status rc = log_sync(spl->prev_log);
+   platform_assert_status_ok(rc);
+   __sync_fetch_and_add(&spl->log_epoch, 1);
+
+   spl->switch_generation = generation;
+   trunk_set_super_block(spl, TRUE, FALSE, FALSE);
+}
+
+/*
+ * Phase 1: starts a new log for the memtables from the next one on. Gives up
+ * if an insert holds up the memtable barrier, to try again later.
+ */
+static void
+trunk_checkpoint_switch_log(trunk_handle *spl)
 {
-   trunk_range_iterator *range_itor = TYPED_MALLOC(spl->heap_id, range_itor);
-   platform_status       rc         = trunk_range_iterator_init(
-      spl, range_itor, start_key, POSITIVE_INFINITY_KEY, num_tuples);
+   memtable_barrier barrier;
+   uint64           generation;
+   if (!memtable_try_begin_barrier(spl->mt_ctxt, &barrier, &generation)) {
+      trunk_checkpoint_set_state(
+         spl, TRUNK_CHECKPOINT_BUSY, TRUNK_CHECKPOINT_IDLE);
+      return;
+   }
+
+   trunk_checkpoint_new_log(spl, generation);
+   memtable_end_barrier(spl->mt_ctxt, &barrier);
+   trunk_checkpoint_set_state(
+      spl, TRUNK_CHECKPOINT_BUSY, TRUNK_CHECKPOINT_SWITCHED);
+}
+
+static bool
+trunk_checkpoint_count_page(void *arg, uint64 addr, const char *data)
+{
+   uint64 *num_pages = (uint64 *)arg;
+   (*num_pages)++;
+   return FALSE;
+}
+
+typedef struct trunk_checkpoint_copy_arg {
+   trunk_handle *spl;
+   uint64        max_pages;
+} trunk_checkpoint_copy_arg;
+
+static bool
+trunk_checkpoint_copy_page(void *arg, uint64 addr, const char *data)
+{
+   trunk_checkpoint_copy_arg *copy_arg = (trunk_checkpoint_copy_arg *)arg;
+   trunk_handle              *spl      = copy_arg->spl;
+   trunk_journal             *journal  = &spl->next_checkpoint.journal;
+   platform_assert(journal->num_pages < copy_arg->max_pages);
+   journal->home_addr[journal->num_pages] = addr;
+   trunk_journal_write_page(
+      spl, trunk_journal_page_addr(spl, journal, journal->num_pages), data);
+   journal->num_pages++;
+   return FALSE;
+}
+
+static void
+trunk_checkpoint_write(void *arg, void *scratch);
+
+/*
+ * Phase 2: captures the image of the trunk, once the memtables in the old log
+ * are all incorporated. Gives up if the trunk does not quiesce, to try again
+ * later.
+ */
+static void
+trunk_checkpoint_capture(trunk_handle *spl)
+{
+   // most of the branches and filters go out before the trunk is held off
+   platform_status rc = cache_sync(spl->cc);
+   platform_assert_status_ok(rc);
+   if (!trunk_quiesce(spl)) {
+      trunk_checkpoint_set_state(
+         spl, TRUNK_CHECKPOINT_BUSY, TRUNK_CHECKPOINT_SWITCHED);
+      return;
+   }
+   // the rest must be durable before the trunk moves on, as freeing an
+   // extent which the image refers to discards its dirty pages
+   rc = cache_sync(spl->cc);
+   platform_assert_status_ok(rc);
+
+   trunk_checkpoint *checkpoint = &spl->next_checkpoint;
+   ZERO_CONTENTS(checkpoint);
+   trunk_range_tombstone_set range_tombstones;
+   rc = trunk_range_tombstone_snapshot(
+      spl, &range_tombstones, NEGATIVE_INFINITY_KEY, POSITIVE_INFINITY_KEY);
+   platform_assert_status_ok(rc);
+   checkpoint->range_tombstone_addr =
+      trunk_range_tombstones_write(spl, &range_tombstones);
+   trunk_range_tombstone_set_deinit(spl, &range_tombstones);
+
+   trunk_journal *journal = &checkpoint->journal;
+   rc                     = allocator_capture(
+      spl->al, &journal->ref_counts, &journal->ref_counts_size);
+   platform_assert_status_ok(rc);
+   checkpoint->meta_tail       = mini_meta_tail(&spl->mini);
+   checkpoint->log_generation  = spl->memtables_incorporated;
+   checkpoint->generation_base =
+      spl->generation_base + memtable_generation(spl->mt_ctxt) + 1;
+
+   uint64 num_pages = 0;
+   cache_for_each_dirty(
+      spl->cc, PAGE_TYPE_TRUNK, trunk_checkpoint_count_page, &num_pages);
+   uint64 num_ref_pages =
+      journal->ref_counts_size / trunk_page_size(&spl->cfg);
+   trunk_journal_alloc(spl, journal, num_pages + num_ref_pages);
+   trunk_checkpoint_copy_arg copy_arg = {.spl = spl, .max_pages = num_pages};
+   cache_for_each_dirty(
+      spl->cc, PAGE_TYPE_TRUNK, trunk_checkpoint_copy_page, &copy_arg);
+   trunk_unquiesce(spl);
+
+   rc = task_enqueue(
+      spl->ts, TASK_TYPE_NORMAL, trunk_checkpoint_write, spl, FALSE);
    if (!SUCCESS(rc)) {
-      goto destroy_range_itor;
+      trunk_checkpoint_write(spl, NULL);
    }
+}
 
-   bool at_end;
-   iterator_at_end(&range_itor->super, &at_end);
+static void
+trunk_checkpoint_exclude_log_extent(void *arg, uint64 extent_addr)
+{
+   allocator_capture_exclude((allocator *)arg, extent_addr);
+}
 
-   for (int i = 0; i < num_tuples && !at_end; i++) {
-      key     curr_key;
-      message data;
-      iterator_get_curr(&range_itor->super, &curr_key, &data);
-      func(curr_key, data, arg);
-      iterator_advance(&range_itor->super);
-      iterator_at_end(&range_itor->super, &at_end);
+static void
+trunk_checkpoint_count_log_extent(void *arg, uint64 extent_addr)
+{
+   uint64 *num_extents = (uint64 *)arg;
+   (*num_extents)++;
+}
+
+static void
+trunk_checkpoint_exclude_extent(trunk_handle *spl, uint64 extent_addr)
+{
+   allocator_capture_exclude(spl->al, extent_addr);
+}
+
+static int
+trunk_checkpoint_addr_compare(const void *a, const void *b, void *arg)
+{
+   uint64 addr_a = *(const uint64 *)a;
+   uint64 addr_b = *(const uint64 *)b;
+   return addr_a < addr_b ? -1 : addr_a > addr_b;
+}
+
+/*
+ * Returns TRUE if the dirty trunk page at addr is in the journal, so that
+ * phase 3 writes it to its home.
+ */
+static bool
+trunk_checkpoint_is_journaled(void *arg, uint64 addr, const char *data)
+{
+   trunk_journal *journal = (trunk_journal *)arg;
+   uint64         lo      = 0;
+   uint64         hi      = journal->num_pages;
+   while (lo < hi) {
+      uint64 mid = lo + (hi - lo) / 2;
+      if (journal->home_addr[mid] == addr) {
+         return TRUE;
+      }
+      if (journal->home_addr[mid] < addr) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
    }
+   return FALSE;
+}
 
-destroy_range_itor:
-   trunk_range_iterator_deinit(range_itor);
-   platform_free(spl->heap_id, range_itor);
-   return rc;
+/*
+ * Phase 3: makes the captured image the one recovery starts from, and drops
+ * what only the previous one needed.
+ */
+static void
+trunk_checkpoint_write(void *arg, void *scratch)
+{
+   trunk_handle  *spl     = (trunk_handle *)arg;
+   trunk_journal *journal = &spl->next_checkpoint.journal;
+
+   // the logs, the old journal and the old range tombstones are all dropped
+   // in recovery from the image, which claims the logs first
+   log_for_each_extent(
+      spl->prev_log, trunk_checkpoint_exclude_log_extent, spl->al);
+   log_for_each_extent(spl->log, trunk_checkpoint_exclude_log_extent, spl->al);
+   for (uint64 i = 0; i < spl->checkpoint.journal.num_extents; i++) {
+      allocator_capture_exclude(spl->al, spl->checkpoint.journal.extent[i]);
+   }
+   if (spl->checkpoint.journal.head_addr != 0) {
+      trunk_range_tombstones_for_each_extent(
+         spl,
+         spl->checkpoint.range_tombstone_addr,
+         trunk_checkpoint_exclude_extent);
+   }
+
+   uint64 page_size     = trunk_page_size(&spl->cfg);
+   uint64 num_ref_pages = journal->ref_counts_size / page_size;
+   for (uint64 i = 0; i < num_ref_pages; i++) {
+      uint64 page_no              = journal->num_pages + i;
+      journal->home_addr[page_no] = 0;
+      trunk_journal_write_page(
+         spl,
+         trunk_journal_page_addr(spl, journal, page_no),
+         (const char *)journal->ref_counts + i * page_size);
+   }
+   trunk_journal_write_headers(
+      spl, journal, journal->num_pages + num_ref_pages);
+   platform_status rc = cache_sync(spl->cc);
+   platform_assert_status_ok(rc);
+
+   trunk_checkpoint old_checkpoint = spl->checkpoint;
+   log_handle      *prev_log       = spl->prev_log;
+   spl->checkpoint                  = spl->next_checkpoint;
+   spl->prev_log                    = NULL;
+   ZERO_CONTENTS(&spl->next_checkpoint);
+   trunk_set_super_block(spl, TRUE, FALSE, FALSE);
+
+   // write the journaled pages home, unless they are being updated again
+   journal = &spl->checkpoint.journal;
+   uint64 tmp;
+   platform_sort_slow(journal->home_addr,
+                      journal->num_pages,
+                      sizeof(uint64),
+                      trunk_checkpoint_addr_compare,
+                      NULL,
+                      &tmp);
+   cache_for_each_dirty(
+      spl->cc, PAGE_TYPE_TRUNK, trunk_checkpoint_is_journaled, journal);
+
+   // wait for the syncs of the old log to finish, see trunk_sync
+   uint64 slot = (spl->log_epoch / 2 + 1) % 2;
+   uint64 wait = 1;
+   while (spl->log_syncs[slot] != 0) {
+      platform_sleep(wait);
+      wait = wait > 2048 ? wait : 2 * wait;
+   }
+   uint64 num_log_extents = 0;
+   log_for_each_extent(
+      prev_log, trunk_checkpoint_count_log_extent, &num_log_extents);
+   log_release(prev_log);
+   platform_free(spl->heap_id, prev_log);
+   spl->log_extents_freed += num_log_extents;
+   spl->checkpoints_written++;
+
+   if (old_checkpoint.journal.head_addr != 0) {
+      trunk_range_tombstones_for_each_extent(
+         spl, old_checkpoint.range_tombstone_addr, trunk_free_misc_extent);
+   }
+   trunk_journal_free(spl, &old_checkpoint.journal);
+   allocator_capture_commit(spl->al);
+   trunk_checkpoint_set_state(
+      spl, TRUNK_CHECKPOINT_BUSY, TRUNK_CHECKPOINT_IDLE);
+}
+
+/*
+ * Called after incorporating memtables. Starts a checkpoint once
+ * checkpoint_interval memtables have been incorporated since the last one,
+ * and captures its image once its old log is incorporated.
+ */
+static void
+trunk_checkpoint_maybe_start(trunk_handle *spl)
+{
+   if (!spl->cfg.use_log) {
+      return;
+   }
+   uint64 interval = spl->cfg.checkpoint_interval;
+   if (interval == 0) {
+      interval = TRUNK_DEFAULT_CHECKPOINT_INTERVAL;
+   }
+   if (spl->checkpoint_state == TRUNK_CHECKPOINT_IDLE
+       && spl->memtables_incorporated - spl->checkpoint.log_generation
+             >= interval
+       && __sync_bool_compare_and_swap(&spl->checkpoint_state,
+                                       TRUNK_CHECKPOINT_IDLE,
+                                       TRUNK_CHECKPOINT_BUSY))
+   {
+      trunk_checkpoint_switch_log(spl);
+   }
+   if (spl->checkpoint_state == TRUNK_CHECKPOINT_SWITCHED
+       && spl->memtables_incorporated >= spl->switch_generation
+       && __sync_bool_compare_and_swap(&spl->checkpoint_state,
+                                       TRUNK_CHECKPOINT_SWITCHED,
+                                       TRUNK_CHECKPOINT_BUSY))
+   {
+      trunk_checkpoint_capture(spl);
+   }
+}
+
+/*
+ * Waits for the background checkpoint tasks to make progress, performing
+ * them if there are no background threads.
+ */
+static void
+trunk_checkpoint_wait(trunk_handle *spl, uint64 *wait)
+{
+   if (task_system_num_bg_threads(spl->ts, TASK_TYPE_NORMAL) == 0) {
+      task_perform_one(spl->ts);
+   } else {
+      platform_sleep(*wait);
+      *wait = *wait > 2048 ? *wait : 2 * *wait;
+   }
+}
+
+/*
+ * Takes a checkpoint and waits until recovery starts from it. The caller
+ * holds a memtable barrier at generation, and the memtables before it are
+ * all incorporated, so the checkpoint holds everything written so far.
+ */
+static void
+trunk_checkpoint_now(trunk_handle *spl, uint64 generation)
+{
+   // a checkpoint which has already switched logs is simply captured now
+   uint64 wait = 1;
+   while (TRUE) {
+      uint32 state = spl->checkpoint_state;
+      if (state == TRUNK_CHECKPOINT_IDLE
+          && __sync_bool_compare_and_swap(&spl->checkpoint_state,
+                                          TRUNK_CHECKPOINT_IDLE,
+                                          TRUNK_CHECKPOINT_BUSY))
+      {
+         trunk_checkpoint_new_log(spl, generation);
+         break;
+      }
+      if (state == TRUNK_CHECKPOINT_SWITCHED
+          && __sync_bool_compare_and_swap(&spl->checkpoint_state,
+                                          TRUNK_CHECKPOINT_SWITCHED,
+                                          TRUNK_CHECKPOINT_BUSY))
+      {
+         break;
+      }
+      trunk_checkpoint_wait(spl, &wait);
+   }
+
+   // the capture falls back to SWITCHED if the trunk does not quiesce
+   while (TRUE) {
+      trunk_checkpoint_capture(spl);
+      wait = 1;
+      while (spl->checkpoint_state == TRUNK_CHECKPOINT_BUSY) {
+         trunk_checkpoint_wait(spl, &wait);
+      }
+      if (!__sync_bool_compare_and_swap(&spl->checkpoint_state,
+                                        TRUNK_CHECKPOINT_SWITCHED,
+                                        TRUNK_CHECKPOINT_BUSY))
+      {
+         return;
+      }
+   }
 }
 
+/*
+ * Waits for a checkpoint in progress to reach a point where it can wait, and
+ * keeps the checkpoint from going on, before the trunk is shut down.
+ */
+static void
+trunk_checkpoint_block(trunk_handle *spl)
+{
+   uint64 wait = 1;
+   while (TRUE) {
+      uint32 state = spl->checkpoint_state;
+      if ((state == TRUNK_CHECKPOINT_IDLE
+           || state == TRUNK_CHECKPOINT_SWITCHED)
+          && __sync_bool_compare_and_swap(
+             &spl->checkpoint_state, state, TRUNK_CHECKPOINT_BLOCKED))
+      {
+         return;
+      }
+      trunk_checkpoint_wait(spl, &wait);
+   }
+}
 
 /*
  *-----------------------------------------------------------------------------
@@ -7087,6 +12202,8 @@ trunk_create(trunk_config     *cfg,
    spl->ts      = ts;
 
    srq_init(&spl->srq, platform_get_module_id(), hid);
+   platform_spinlock_init(
+      &spl->range_tombstone_lock, platform_get_module_id(), hid);
 
    // get a free node for the root
    //    we don't use the mini allocator for this, since the root doesn't
@@ -7094,6 +12211,7 @@ trunk_create(trunk_config     *cfg,
    platform_status rc =
       allocator_alloc(spl->al, &spl->root_addr, PAGE_TYPE_TRUNK);
    platform_assert_status_ok(rc);
+   trunk_modify_begin(spl);
    page_handle *root = cache_alloc(spl->cc, spl->root_addr, PAGE_TYPE_TRUNK);
    trunk_hdr   *root_hdr = (trunk_hdr *)root->data;
    ZERO_CONTENTS(root_hdr);
@@ -7111,19 +12229,6 @@ trunk_create(trunk_config     *cfg,
              PAGE_TYPE_TRUNK,
              FALSE);
 
-   // set up the memtable context
-   memtable_config *mt_cfg = &spl->cfg.mt_cfg;
-   spl->mt_ctxt            = memtable_context_create(
-      spl->heap_id, cc, mt_cfg, trunk_memtable_flush_virtual, spl);
-
-   // set up the log
-   if (spl->cfg.use_log) {
-      spl->log = log_create(cc, spl->cfg.log_cfg, spl->heap_id);
-   }
-
-   // ALEX: For now we assume an init means destroying any present super blocks
-   trunk_set_super_block(spl, FALSE, FALSE, TRUE);
-
    // set up the initial leaf
    page_handle *leaf     = trunk_alloc(spl, 0);
    trunk_hdr   *leaf_hdr = (trunk_hdr *)leaf->data;
@@ -7144,6 +12249,27 @@ trunk_create(trunk_config     *cfg,
    trunk_node_unclaim(spl, root);
    trunk_node_unget(spl, &root);
 
+   if (spl->cfg.use_log) {
+      // the empty trunk is the first checkpoint, see "Crash recovery"
+      cache_flush(spl->cc);
+      trunk_checkpoint_start(spl, mini_meta_tail(&spl->mini), 0);
+   }
+
+   // set up the memtable context
+   memtable_config *mt_cfg = &spl->cfg.mt_cfg;
+   spl->mt_ctxt            = memtable_context_create(
+      spl->heap_id, cc, mt_cfg, trunk_memtable_flush_virtual, spl);
+   spl->memtables_incorporated = memtable_generation(spl->mt_ctxt);
+
+   // set up the log
+   if (spl->cfg.use_log) {
+      spl->log = log_create(cc, spl->cfg.log_cfg, spl->heap_id);
+      spl->checkpoint.log_generation = memtable_generation(spl->mt_ctxt);
+   }
+
+   // ALEX: For now we assume an init means destroying any present super blocks
+   trunk_set_super_block(spl, spl->cfg.use_log, FALSE, TRUE);
+
    if (spl->cfg.use_stats) {
       spl->stats = TYPED_ARRAY_ZALLOC(spl->heap_id, spl->stats, MAX_THREADS);
       platform_assert(spl->stats);
@@ -7193,25 +12319,91 @@ trunk_mount(trunk_config     *cfg,
    spl->ts      = ts;
 
    srq_init(&spl->srq, platform_get_module_id(), hid);
-
-   // find the unmounted super block
-   spl->root_addr                      = 0;
-   uint64             meta_tail        = 0;
-   uint64             latest_timestamp = 0;
+   platform_spinlock_init(
+      &spl->range_tombstone_lock, platform_get_module_id(), hid);
+
+   // find the unmounted super block, or the checkpoint if we crashed
+   spl->root_addr                          = 0;
+   uint64             meta_tail            = 0;
+   uint64             latest_timestamp     = 0;
+   uint64             range_tombstone_addr = 0;
+   bool               recover              = FALSE;
+   uint64             old_log_addr         = 0;
+   uint64             old_log_magic        = 0;
+   uint64             old_log_generation   = 0;
+   uint64             old_log_generation_base = 0;
+   uint64             prev_log_addr           = 0;
+   uint64             prev_log_magic          = 0;
+   uint64             journal_addr            = 0;
    page_handle       *super_page;
    trunk_super_block *super = trunk_get_super_block_if_valid(spl, &super_page);
    if (super != NULL) {
-      if (super->unmounted && super->timestamp > latest_timestamp) {
-         spl->root_addr   = super->root_addr;
-         meta_tail        = super->meta_tail;
-         latest_timestamp = super->timestamp;
+      bool recoverable =
+         cfg->use_log && super->checkpointed && super->log_addr != 0;
+      if ((super->unmounted || recoverable)
+          && super->timestamp > latest_timestamp) {
+         spl->root_addr       = super->root_addr;
+         meta_tail            = super->meta_tail;
+         latest_timestamp     = super->timestamp;
+         spl->generation_base = super->generation_base;
+         range_tombstone_addr = super->range_tombstone_addr;
+         recover              = !super->unmounted;
+         old_log_addr         = super->log_addr;
+         old_log_magic        = super->log_magic;
+         old_log_generation   = super->log_generation;
+         old_log_generation_base = super->log_generation_base;
+         prev_log_addr           = super->prev_log_addr;
+         prev_log_magic          = super->prev_log_magic;
+         journal_addr            = super->journal_addr;
       }
       trunk_release_super_block(spl, super_page);
    }
    if (spl->root_addr == 0) {
+      platform_spinlock_destroy(&spl->range_tombstone_lock);
       platform_free(hid, spl);
       return (trunk_handle *)NULL;
    }
+
+   // no checkpoint may start until the trunk is recovered
+   spl->checkpoint_state = TRUNK_CHECKPOINT_BLOCKED;
+   trunk_journal journal;
+   ZERO_CONTENTS(&journal);
+   if (recover && journal_addr != 0) {
+      trunk_journal_redo(spl, journal_addr, &journal);
+   }
+
+   shard_log_iterator old_log, prev_log;
+   if (spl->cfg.use_log) {
+      trunk_checkpoint_start(spl, meta_tail, range_tombstone_addr);
+   }
+   if (recover) {
+      // claims the journal and the old logs, which are free in the checkpoint
+      trunk_journal_claim(spl, &journal);
+      platform_status rc;
+      if (prev_log_addr != 0) {
+         rc = shard_log_iterator_init_recovered(
+            cc,
+            (shard_log_config *)cfg->log_cfg,
+            hid,
+            prev_log_addr,
+            prev_log_magic,
+            &prev_log);
+         platform_assert_status_ok(rc);
+      }
+      rc = shard_log_iterator_init_recovered(cc,
+                                             (shard_log_config *)cfg->log_cfg,
+                                             hid,
+                                             old_log_addr,
+                                             old_log_magic,
+                                             &old_log);
+      platform_assert_status_ok(rc);
+   }
+
+   // the replay below needs all the tombstones
+   spl->retiring_range_tombstones = TRUE;
+   trunk_range_tombstones_read(spl, range_tombstone_addr);
+   trunk_range_tombstones_for_each_extent(
+      spl, range_tombstone_addr, trunk_free_misc_extent);
    uint64 meta_head = spl->root_addr + trunk_page_size(&spl->cfg);
 
    // get a free node for the root
@@ -7221,6 +12413,7 @@ trunk_mount(trunk_config     *cfg,
    memtable_config *mt_cfg = &spl->cfg.mt_cfg;
    spl->mt_ctxt            = memtable_context_create(
       spl->heap_id, cc, mt_cfg, trunk_memtable_flush_virtual, spl);
+   spl->memtables_incorporated = memtable_generation(spl->mt_ctxt);
 
    // The trunk uses an unkeyed mini allocator
    mini_init(&spl->mini,
@@ -7233,9 +12426,42 @@ trunk_mount(trunk_config     *cfg,
              FALSE);
    if (spl->cfg.use_log) {
       spl->log = log_create(cc, spl->cfg.log_cfg, spl->heap_id);
+      spl->checkpoint.log_generation = memtable_generation(spl->mt_ctxt);
+   }
+
+   if (recover) {
+      trunk_recompact_bundles(spl);
+      platform_status rc;
+      if (prev_log_addr != 0) {
+         rc = trunk_replay_range_deletes(
+            spl, &prev_log, old_log_generation, old_log_generation_base);
+         platform_assert_status_ok(rc);
+      }
+      rc = trunk_replay_range_deletes(
+         spl, &old_log, old_log_generation, old_log_generation_base);
+      platform_assert_status_ok(rc);
+      if (prev_log_addr != 0) {
+         rc = trunk_replay_log(
+            spl, &prev_log, old_log_generation, old_log_generation_base);
+         platform_assert_status_ok(rc);
+      }
+      rc = trunk_replay_log(
+         spl, &old_log, old_log_generation, old_log_generation_base);
+      platform_assert_status_ok(rc);
+      // the replayed updates must be durable before the old log is dropped
+      rc = log_sync(spl->log);
+      platform_assert_status_ok(rc);
    }
 
-   trunk_set_super_block(spl, FALSE, FALSE, FALSE);
+   trunk_set_super_block(spl, spl->cfg.use_log, FALSE, FALSE);
+
+   if (recover) {
+      trunk_journal_free(spl, &journal);
+      if (prev_log_addr != 0) {
+         shard_log_iterator_deinit(hid, &prev_log);
+      }
+      shard_log_iterator_deinit(hid, &old_log);
+   }
 
    if (spl->cfg.use_stats) {
       spl->stats = TYPED_ARRAY_ZALLOC(spl->heap_id, spl->stats, MAX_THREADS);
@@ -7259,6 +12485,8 @@ trunk_mount(trunk_config     *cfg,
          platform_assert_status_ok(rc);
       }
    }
+   spl->checkpoint_state          = TRUNK_CHECKPOINT_IDLE;
+   spl->retiring_range_tombstones = FALSE;
    return spl;
 }
 
@@ -7288,9 +12516,19 @@ trunk_prepare_for_shutdown(trunk_handle *spl)
    // destroy memtable context (and its memtables)
    memtable_context_destroy(spl->heap_id, spl->mt_ctxt);
 
-   // release the log
+   // release the logs and what the checkpoint needed beyond the trunk
    if (spl->cfg.use_log) {
+      log_release(spl->log);
       platform_free(spl->heap_id, spl->log);
+      if (spl->prev_log != NULL) {
+         log_release(spl->prev_log);
+         platform_free(spl->heap_id, spl->prev_log);
+      }
+      if (spl->checkpoint.journal.head_addr != 0) {
+         trunk_range_tombstones_for_each_extent(
+            spl, spl->checkpoint.range_tombstone_addr, trunk_free_misc_extent);
+      }
+      trunk_journal_free(spl, &spl->checkpoint.journal);
    }
 
    // release the trunk mini allocator
@@ -7298,6 +12536,10 @@ trunk_prepare_for_shutdown(trunk_handle *spl)
 
    // flush all dirty pages in the cache
    cache_flush(spl->cc);
+   if (spl->cfg.use_log) {
+      cache_defer_writeback(spl->cc, PAGE_TYPE_TRUNK, FALSE);
+      cache_defer_writeback(spl->cc, PAGE_TYPE_LOG, FALSE);
+   }
 }
 
 bool
@@ -7344,11 +12586,15 @@ void
 trunk_destroy(trunk_handle *spl)
 {
    srq_deinit(&spl->srq);
+   trunk_checkpoint_block(spl);
 
    trunk_prepare_for_shutdown(spl);
 
    trunk_for_each_node(spl, trunk_node_destroy, NULL);
 
+   trunk_range_tombstones_free(spl, spl->range_tombstones);
+   platform_spinlock_destroy(&spl->range_tombstone_lock);
+
    mini_unkeyed_dec_ref(spl->cc, spl->mini.meta_head, PAGE_TYPE_TRUNK, FALSE);
 
    // clear out this splinter table from the meta page.
@@ -7377,8 +12623,11 @@ trunk_unmount(trunk_handle **spl_in)
 {
    trunk_handle *spl = *spl_in;
    srq_deinit(&spl->srq);
+   trunk_checkpoint_block(spl);
    trunk_set_super_block(spl, FALSE, TRUE, FALSE);
    trunk_prepare_for_shutdown(spl);
+   trunk_range_tombstones_free(spl, spl->range_tombstones);
+   platform_spinlock_destroy(&spl->range_tombstone_lock);
    if (spl->cfg.use_stats) {
       for (uint64 i = 0; i < MAX_THREADS; i++) {
          platform_histo_destroy(spl->heap_id,
@@ -8154,10 +13403,10 @@ trunk_print_memtable(platform_log_handle *log_handle, trunk_handle *spl)
    for (uint64 mt_gen = mt_gen_start; mt_gen != mt_gen_end; mt_gen--) {
       memtable *mt = trunk_get_memtable(spl, mt_gen);
       platform_log(log_handle,
-                   "Memtable root_addr=%lu: gen %lu ref_count %u state %d\n",
+                   "Memtable shards=%lu: gen %lu ref_count %lu state %d\n",
+                   mt->num_shards,
                    mt_gen,
-                   mt->root_addr,
-                   allocator_get_ref(spl->al, mt->root_addr),
+                   memtable_get_ref(spl->mt_ctxt, mt),
                    mt->state);
 
       memtable_print(log_handle, spl->cc, mt);
@@ -8311,6 +13560,13 @@ trunk_print_insertion_stats(platform_log_handle *log_handle, trunk_handle *spl)
       global->updates                     += spl->stats[thr_i].updates;
       global->deletions                   += spl->stats[thr_i].deletions;
       global->discarded_deletes           += spl->stats[thr_i].discarded_deletes;
+      global->throttled_inserts           += spl->stats[thr_i].throttled_inserts;
+      global->throttle_wait_time_ns       += spl->stats[thr_i].throttle_wait_time_ns;
+      if (spl->stats[thr_i].throttle_wait_time_max_ns >
+          global->throttle_wait_time_max_ns) {
+         global->throttle_wait_time_max_ns =
+            spl->stats[thr_i].throttle_wait_time_max_ns;
+      }
 
       global->memtable_flushes            += spl->stats[thr_i].memtable_flushes;
       global->memtable_flush_wait_time_ns += spl->stats[thr_i].memtable_flush_wait_time_ns;
@@ -8365,6 +13621,14 @@ trunk_print_insertion_stats(platform_log_handle *log_handle, trunk_handle *spl)
    platform_log(log_handle, "------------------------------------------------------------------------------------\n");
    platform_log(log_handle, "| root stalls:       %10lu\n", global->memtable_flush_root_full);
    platform_log(log_handle, "------------------------------------------------------------------------------------\n");
+   platform_log(log_handle, "| throttled inserts: %10lu\n", global->throttled_inserts);
+   platform_log(log_handle, "| throttle wait (ns): avg %10lu max %10lu\n",
+                global->throttled_inserts == 0 ? 0 : global->throttle_wait_time_ns / global->throttled_inserts,
+                global->throttle_wait_time_max_ns);
+   platform_log(log_handle, "| throttle pressure: %10lu / %d\n", spl->throttle.pressure, TRUNK_THROTTLE_SCALE);
+   platform_log(log_handle, "| throttle rate:     %10lu inserts/s (base %lu inserts/s)\n",
+                spl->throttle.rate, spl->throttle.base_rate);
+   platform_log(log_handle, "------------------------------------------------------------------------------------\n");
    platform_log(log_handle, "\n");
 
    platform_log(log_handle, "Latency Histogram Statistics\n");
@@ -8634,12 +13898,8 @@ trunk_print_lookup(trunk_handle        *spl,
          spl, mt_gen, &memtable_is_compacted);
       platform_status rc;
 
-      rc = btree_lookup(spl->cc,
-                        &spl->cfg.btree_cfg,
-                        root_addr,
-                        PAGE_TYPE_MEMTABLE,
-                        target,
-                        &data);
+      merge_accumulator_set_to_null(&data);
+      rc = trunk_memtable_lookup(spl, mt_gen, 0, target, &data);
       platform_assert_status_ok(rc);
       if (!merge_accumulator_is_null(&data)) {
          char    key_str[128];
@@ -8655,11 +13915,14 @@ trunk_print_lookup(trunk_handle        *spl,
             mt_gen,
             memtable_is_compacted,
             message_str);
-         btree_print_lookup(spl->cc,
-                            &spl->cfg.btree_cfg,
-                            root_addr,
-                            PAGE_TYPE_MEMTABLE,
-                            target);
+         if (root_addr != 0) {
+            btree_print_lookup(spl->cc,
+                               &spl->cfg.btree_cfg,
+                               root_addr,
+                               memtable_is_compacted ? PAGE_TYPE_BRANCH
+                                                     : PAGE_TYPE_MEMTABLE,
+                               target);
+         }
       }
    }
 
@@ -8671,7 +13934,7 @@ trunk_print_lookup(trunk_handle        *spl,
       debug_assert(pivot_no < trunk_num_children(spl, node));
       trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, pivot_no);
       merge_accumulator_set_to_null(&data);
-      trunk_pivot_lookup(spl, node, pdata, target, &data);
+      trunk_pivot_lookup(spl, node, pdata, 0, target, &data);
       if (!merge_accumulator_is_null(&data)) {
          char key_str[128];
          char message_str[128];
@@ -8694,7 +13957,7 @@ trunk_print_lookup(trunk_handle        *spl,
             bool            local_found;
             merge_accumulator_set_to_null(&data);
             rc = trunk_btree_lookup_and_merge(
-               spl, branch, target, &data, &local_found);
+               spl, branch, 0, target, &data, &local_found);
             platform_assert_status_ok(rc);
             if (local_found) {
                char key_str[128];
@@ -8723,7 +13986,7 @@ trunk_print_lookup(trunk_handle        *spl,
    trunk_print_locked_node(Platform_default_log_handle, spl, node);
    trunk_pivot_data *pdata = trunk_get_pivot_data(spl, node, 0);
    merge_accumulator_set_to_null(&data);
-   trunk_pivot_lookup(spl, node, pdata, target, &data);
+   trunk_pivot_lookup(spl, node, pdata, 0, target, &data);
    if (!merge_accumulator_is_null(&data)) {
       char key_str[128];
       char message_str[128];
@@ -8746,7 +14009,7 @@ trunk_print_lookup(trunk_handle        *spl,
          bool            local_found;
          merge_accumulator_set_to_null(&data);
          rc = trunk_btree_lookup_and_merge(
-            spl, branch, target, &data, &local_found);
+            spl, branch, 0, target, &data, &local_found);
          platform_assert_status_ok(rc);
          if (local_found) {
             char key_str[128];
@@ -8951,6 +14214,9 @@ trunk_config_init(trunk_config        *trunk_cfg,
    trunk_cfg->use_stats               = use_stats;
    trunk_cfg->verbose_logging_enabled = verbose_logging;
    trunk_cfg->log_handle              = log_handle;
+   trunk_cfg->use_write_throttle      = TRUE;
+   trunk_cfg->throttle_soft_tasks     = TRUNK_THROTTLE_DEFAULT_SOFT_TASKS;
+   trunk_cfg->throttle_hard_tasks     = TRUNK_THROTTLE_DEFAULT_HARD_TASKS;
 
    // Inline what we would get from trunk_pivot_size(trunk_handle *).
    trunk_pivot_size = data_cfg->max_key_size + sizeof(trunk_pivot_data);
@@ -9024,6 +14290,10 @@ trunk_config_init(trunk_config        *trunk_cfg,
    filter_cfg->log_index_size = 31 - __builtin_clz(filter_cfg->index_size);
 
    uint64 filter_max_fingerprints = trunk_cfg->max_tuples_per_node;
+   if (trunk_cfg->data_cfg->key_prefix_length != NULL) {
+      // filters also hold the fingerprints of key prefixes
+      filter_max_fingerprints *= 2;
+   }
    uint64 filter_quotient_size = 64 - __builtin_clzll(filter_max_fingerprints);
    uint64 filter_fingerprint_size =
       filter_remainder_size + filter_quotient_size;
@@ -44,6 +44,20 @@ _Static_assert(TRUNK_MAX_HEIGHT == MINI_MAX_BATCHES,
  */
 #define TRUNK_RANGE_ITOR_MAX_BRANCHES 256
 
+/*
+ * Max number of keys looked up together by trunk_lookup_batch. Larger
+ * batches are split by the caller.
+ */
+#define TRUNK_LOOKUP_BATCH_MAX 512
+
+/*
+ * At any time, one Memtable is "active" for inserts / updates.
+ * At any time, the most # of Memtables that can be active or in one of these
+ * states, such as, compaction, incorporation, reclamation, is given by this
+ * limit.
+ */
+#define TRUNK_NUM_MEMTABLES (4)
+
 
 /*
  *----------------------------------------------------------------------
@@ -70,6 +84,17 @@ typedef struct trunk_config {
    data_config    *data_cfg;
    bool            use_log;
    log_config     *log_cfg;
+   // threads replaying the log in crash recovery, see trunk_mount; 0 to use
+   // as many as there are normal background threads
+   uint64 num_replay_threads;
+   // memtables incorporated between background checkpoints, see
+   // trunk_checkpoint_maybe_start; 0 for TRUNK_DEFAULT_CHECKPOINT_INTERVAL
+   uint64 checkpoint_interval;
+
+   // write throttle, see trunk_throttle_insert()
+   bool   use_write_throttle;
+   uint64 throttle_soft_tasks; // queued compactions before throttling starts
+   uint64 throttle_hard_tasks; // queued compactions at maximum throttling
 
    // verbose logging
    bool                 verbose_logging_enabled;
@@ -125,6 +150,11 @@ typedef struct trunk_stats {
    uint64 root_compaction_time_max_ns;
 
    uint64 discarded_deletes;
+
+   uint64 throttled_inserts;
+   uint64 throttle_wait_time_ns;
+   uint64 throttle_wait_time_max_ns;
+
    uint64 index_splits;
    uint64 leaf_splits;
    uint64 leaf_splits_leaves_created;
@@ -157,17 +187,101 @@ typedef struct trunk_stats {
 
 // splinter refers to btrees as branches
 typedef struct trunk_branch {
-   uint64 root_addr; // root address of point btree
+   uint64 root_addr;  // root address of point btree
+   uint64 generation; // data generation of the newest memtable in the branch
 } trunk_branch;
 
 typedef struct trunk_handle             trunk_handle;
 typedef struct trunk_compact_bundle_req trunk_compact_bundle_req;
 
+/*
+ * A range tombstone deletes the keys in [start_key, end_key) from all the
+ * data older than its generation, i.e. from every memtable and branch whose
+ * data generation is smaller (see trunk_delete_range).
+ */
+typedef struct trunk_range_tombstone {
+   uint64     generation;
+   key_buffer start_key;
+   key_buffer end_key;
+} trunk_range_tombstone;
+
+typedef struct trunk_range_tombstone_set {
+   uint64                 num_tombstones;
+   trunk_range_tombstone *tombstone;
+} trunk_range_tombstone_set;
+
+/*
+ * Skips the tuples of an iterator over a branch or memtable which are deleted
+ * by the range tombstones in set.
+ */
+typedef struct trunk_range_tombstone_iterator {
+   iterator                   super;
+   trunk_handle              *spl;
+   iterator                  *itor;
+   trunk_range_tombstone_set *set;
+   uint64                     generation;
+   bool                       reverse; // itor returns descending keys
+} trunk_range_tombstone_iterator;
+
 typedef struct trunk_memtable_args {
    trunk_handle *spl;
    uint64        generation;
 } trunk_memtable_args;
 
+/*
+ * Token bucket state of the write throttle. pressure, from 0 to
+ * TRUNK_THROTTLE_SCALE, measures the compaction and incorporation backlog.
+ */
+typedef struct trunk_write_throttle {
+   volatile bool   refilling;   // held by the thread refilling the bucket
+   volatile uint64 pressure;    // as of the last refill
+   volatile int64  tokens;      // inserts allowed before the next refill
+   uint64          inserts;     // by all threads, as of the last refill
+   uint64          base_rate;   // unthrottled inserts per second
+   volatile uint64 rate;        // throttled inserts per second, 0 if not
+   timestamp       last_refill;
+
+   struct {
+      volatile uint64 inserts;    // by this thread, ever
+      uint64          clock_skip; // inserts until it next reads the clock
+   } PLATFORM_CACHELINE_ALIGNED per_thread[MAX_THREADS];
+} trunk_write_throttle;
+
+/*
+ * The redo journal of a background checkpoint, see trunk_journal_hdr.
+ */
+typedef struct trunk_journal {
+   uint64      head_addr;   // 0 if there is none
+   uint64     *extent;      // base addresses of its extents
+   uint64      num_extents;
+   uint64     *home_addr;   // of its pages, 0 for ref count pages
+   uint64      num_pages;   // trunk pages it holds, which come first
+   const void *ref_counts;  // of the image, see allocator_capture
+   uint64      ref_counts_size;
+} trunk_journal;
+
+/*
+ * The durable image of the trunk which crash recovery starts from, and the
+ * log which brings it up to date, see trunk_mount and "Checkpoints".
+ */
+typedef struct trunk_checkpoint {
+   uint64        meta_tail;
+   uint64        range_tombstone_addr;
+   uint64        log_generation;  // first memtable generation not in the image
+   uint64        generation_base; // of a mount recovering from the image
+   trunk_journal journal;         // pages of the image not at their homes
+} trunk_checkpoint;
+
+/*
+ * States of the background checkpoint, see trunk_checkpoint_maybe_start.
+ */
+typedef enum trunk_checkpoint_state {
+   TRUNK_CHECKPOINT_IDLE = 0,
+   TRUNK_CHECKPOINT_BUSY,      // switching logs or writing the image out
+   TRUNK_CHECKPOINT_SWITCHED,  // waiting for the old log's memtables
+   TRUNK_CHECKPOINT_BLOCKED,   // by mount, unmount or a forced flush
+} trunk_checkpoint_state;
+
 typedef struct trunk_compacted_memtable {
    trunk_branch              branch;
    routing_filter            filter;
@@ -198,6 +312,8 @@ struct trunk_handle {
    // task system
    task_system *ts; // ALEX: currently not durable
 
+   trunk_write_throttle throttle;
+
    // stats
    trunk_stats *stats;
 
@@ -216,12 +332,46 @@ struct trunk_handle {
    // space rec queue
    srq srq;
 
+   // range deletes, see "Range tombstones" in trunk.c
+   uint64                              generation_base;
+   platform_spinlock                   range_tombstone_lock; // writers
+   trunk_range_tombstone_set *volatile range_tombstones;     // NULL if none
+   volatile bool                       range_tombstones_dirty;
+   volatile bool                       retiring_range_tombstones;
+
+   // crash recovery, see trunk_mount, and checkpoints, see "Checkpoints"
+   trunk_checkpoint checkpoint;
+   trunk_checkpoint next_checkpoint; // being written out
+   volatile uint32  checkpoint_state;
+   uint64           switch_generation;     // first memtable in the new log
+   volatile uint64  memtables_incorporated; // under the root lock
+   log_handle      *prev_log;              // until the checkpoint is durable
+   volatile uint64  log_epoch;             // odd while switching logs
+   volatile uint64  log_syncs[2];          // in trunk_sync, by epoch
+   volatile uint64  modifiers; // threads with trunk claims, see trunk_quiesce
+   uint64           checkpoints_written;  // since the mount
+   uint64           log_extents_freed;    // by those checkpoints
+   uint64           log_entries_replayed; // by the mount
+   struct {
+      uint64 claims;
+   } PLATFORM_CACHELINE_ALIGNED modifier[MAX_THREADS];
+
+   struct {
+      volatile uint64 seq; // odd while reading range_tombstones
+   } PLATFORM_CACHELINE_ALIGNED range_tombstone_reader[MAX_THREADS];
+
    trunk_compacted_memtable compacted_memtable[/*cfg.mt_cfg.max_memtables*/];
 };
 
+/*
+ * A consistent read-only view of the data, see trunk_snapshot_create.
+ */
+typedef struct trunk_snapshot trunk_snapshot;
+
 typedef struct trunk_range_iterator {
    iterator        super;
    trunk_handle   *spl;
+   trunk_snapshot *snapshot; // NULL when iterating the current data
    uint64          num_tuples;
    uint64          num_branches;
    uint64          num_memtable_branches;
@@ -229,14 +379,26 @@ typedef struct trunk_range_iterator {
    uint64          memtable_end_gen;
    bool            compacted[TRUNK_RANGE_ITOR_MAX_BRANCHES];
    merge_iterator *merge_itor;
+   bool            reverse; // keys are returned in descending order
    bool            at_end;
+   bool            has_prefix; // only keys with prefix are returned
+   key_buffer      prefix;
    key_buffer      min_key;
    key_buffer      max_key;
+   key_buffer      leaf_min_key;
    key_buffer      local_max_key;
    key_buffer      rebuild_key;
    btree_iterator  btree_itor[TRUNK_RANGE_ITOR_MAX_BRANCHES];
    trunk_branch    branch[TRUNK_RANGE_ITOR_MAX_BRANCHES];
 
+   // iterators of the memtables which have not been compacted yet
+   memtable_iterator memtable_itor[TRUNK_NUM_MEMTABLES];
+
+   // range tombstones intersecting [min_key, max_key), and the iterators
+   // applying them to the branches
+   trunk_range_tombstone_set      range_tombstones;
+   trunk_range_tombstone_iterator tombstone_itor[TRUNK_RANGE_ITOR_MAX_BRANCHES];
+
    // used for merge iterator construction
    iterator *itor[TRUNK_RANGE_ITOR_MAX_BRANCHES];
 } trunk_range_iterator;
@@ -307,7 +469,8 @@ typedef struct trunk_async_ctxt {
       routing_async_ctxt filter_ctxt; // Filter async context
       btree_async_ctxt   btree_ctxt;  // Btree async context
    };
-   cache_async_ctxt cache_ctxt; // Async cache context
+   cache_async_ctxt cache_ctxt;    // Async cache context
+   uint64           tombstone_gen; // Older data is range deleted
 } trunk_async_ctxt;
 
 
@@ -322,9 +485,24 @@ typedef struct trunk_async_ctxt {
 platform_status
 trunk_insert(trunk_handle *spl, key tuple_key, message data);
 
+platform_status
+trunk_delete_range(trunk_handle *spl, key start_key, key end_key);
+
+platform_status
+trunk_bulk_load_runs(trunk_handle *spl, uint64 num_runs, iterator **runs);
+
+platform_status
+trunk_sync(trunk_handle *spl);
+
 platform_status
 trunk_lookup(trunk_handle *spl, key target, merge_accumulator *result);
 
+platform_status
+trunk_lookup_batch(trunk_handle       *spl,
+                   uint64              num_keys,
+                   key                *keys,
+                   merge_accumulator **results);
+
 static inline bool
 trunk_lookup_found(merge_accumulator *result)
 {
@@ -342,8 +520,41 @@ trunk_range_iterator_init(trunk_handle         *spl,
                           key                   min_key,
                           key                   max_key,
                           uint64                num_tuples);
+platform_status
+trunk_range_iterator_init_reverse(trunk_handle         *spl,
+                                  trunk_range_iterator *range_itor,
+                                  key                   min_key,
+                                  key                   max_key,
+                                  uint64                num_tuples);
+platform_status
+trunk_range_iterator_init_prefix(trunk_handle         *spl,
+                                 trunk_range_iterator *range_itor,
+                                 key                   prefix,
+                                 uint64                num_tuples);
 void
 trunk_range_iterator_deinit(trunk_range_iterator *range_itor);
+platform_status
+trunk_range_iterator_seek(iterator *itor, key target);
+platform_status
+trunk_range_iterator_prev(trunk_range_iterator *range_itor);
+
+platform_status
+trunk_snapshot_create(trunk_handle *spl, trunk_snapshot **snapshot);
+
+void
+trunk_snapshot_release(trunk_snapshot *snapshot);
+
+platform_status
+trunk_snapshot_lookup(trunk_snapshot    *snapshot,
+                      key                target,
+                      merge_accumulator *result);
+
+platform_status
+trunk_snapshot_range_iterator_init(trunk_snapshot       *snapshot,
+                                   trunk_range_iterator *range_itor,
+                                   key                   min_key,
+                                   key                   max_key,
+                                   uint64                num_tuples);
 
 typedef void (*tuple_function)(key tuple_key, message value, void *arg);
 platform_status
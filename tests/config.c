@@ -55,6 +55,7 @@ config_set_defaults(master_config *cfg)
       .filter_index_size        = TEST_CONFIG_DEFAULT_FILTER_INDEX_SIZE,
       .use_log                  = FALSE,
       .memtable_capacity        = MiB_TO_B(TEST_CONFIG_DEFAULT_MEMTABLE_CAPACITY_MB),
+      .memtable_num_shards      = 1,
       .fanout                   = TEST_CONFIG_DEFAULT_FANOUT,
       .max_branches_per_node    = TEST_CONFIG_DEFAULT_MAX_BRANCHES_PER_NODE,
       .use_stats                = FALSE,
@@ -92,6 +93,8 @@ config_usage()
    platform_error_log("\t--db-capacity-mib (%d)\n",
                       (int)(TEST_CONFIG_DEFAULT_DISK_SIZE_GB * KiB));
    platform_error_log("\t--libaio-queue-depth\n");
+   platform_error_log("\t--set-io_uring\n");
+   platform_error_log("\t--set-io_uring-sqpoll\n");
    platform_error_log("\t--cache-capacity-gib (%d)\n",
                       TEST_CONFIG_DEFAULT_CACHE_SIZE_GB);
    platform_error_log("\t--cache-capacity-mib (%d)\n",
@@ -100,6 +103,8 @@ config_usage()
    platform_error_log("\t--memtable-capacity-gib\n");
    platform_error_log("\t--memtable-capacity-mib (%d)\n",
                       TEST_CONFIG_DEFAULT_MEMTABLE_CAPACITY_MB);
+   platform_error_log("\t--memtable-skiplist\n");
+   platform_error_log("\t--memtable-shards (1)\n");
    platform_error_log("\t--rough-count-height\n");
    platform_error_log("\t--filter-remainder-size\n");
    platform_error_log("\t--fanout (%d)\n", TEST_CONFIG_DEFAULT_FANOUT);
@@ -211,11 +216,31 @@ config_parse(master_config *cfg, const uint8 num_config, int argc, char *argv[])
          config_set_mib("db-capacity", cfg, allocator_capacity) {}
          config_set_gib("db-capacity", cfg, allocator_capacity) {}
          config_set_uint64("libaio-queue-depth", cfg, io_async_queue_depth) {}
+         config_has_option("set-io_uring")
+         {
+            for (uint8 cfg_idx = 0; cfg_idx < num_config; cfg_idx++) {
+               cfg[cfg_idx].io_use_uring = TRUE;
+            }
+         }
+         config_has_option("set-io_uring-sqpoll")
+         {
+            for (uint8 cfg_idx = 0; cfg_idx < num_config; cfg_idx++) {
+               cfg[cfg_idx].io_use_uring    = TRUE;
+               cfg[cfg_idx].io_uring_sqpoll = TRUE;
+            }
+         }
          config_set_mib("cache-capacity", cfg, cache_capacity) {}
          config_set_gib("cache-capacity", cfg, cache_capacity) {}
          config_set_string("cache-debug-log", cfg, cache_logfile) {}
          config_set_mib("memtable-capacity", cfg, memtable_capacity) {}
          config_set_gib("memtable-capacity", cfg, memtable_capacity) {}
+         config_has_option("memtable-skiplist")
+         {
+            for (uint8 cfg_idx = 0; cfg_idx < num_config; cfg_idx++) {
+               cfg[cfg_idx].memtable_use_skiplist = TRUE;
+            }
+         }
+         config_set_uint64("memtable-shards", cfg, memtable_num_shards) {}
          config_set_uint64("rough-count-height", cfg, btree_rough_count_height)
          {}
          config_set_uint64("filter-remainder-size", cfg, filter_remainder_size)
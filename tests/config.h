@@ -52,6 +52,8 @@ typedef struct master_config {
    int    io_flags;
    uint32 io_perms;
    uint64 io_async_queue_depth;
+   bool   io_use_uring;
+   bool   io_uring_sqpoll;
 
    // allocator
    uint64 allocator_capacity;
@@ -73,6 +75,8 @@ typedef struct master_config {
 
    // splinter
    uint64               memtable_capacity;
+   bool                 memtable_use_skiplist;
+   uint64               memtable_num_shards;
    uint64               fanout;
    uint64               max_branches_per_node;
    uint64               use_stats;
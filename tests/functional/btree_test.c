@@ -82,7 +82,7 @@ test_btree_insert(test_memtable_context *ctxt, key tuple_key, message data)
    uint64          generation;
    page_handle    *lock_page = NULL;
    platform_status rc        = memtable_maybe_rotate_and_get_insert_lock(
-      ctxt->mt_ctxt, &generation, &lock_page);
+      ctxt->mt_ctxt, 0, &generation, &lock_page);
    if (!SUCCESS(rc)) {
       return rc;
    }
@@ -96,6 +96,7 @@ test_btree_insert(test_memtable_context *ctxt, key tuple_key, message data)
    uint64 dummy_leaf_generation;
    rc = memtable_insert(ctxt->mt_ctxt,
                         &ctxt->mt_ctxt->mt[generation],
+                        0,
                         ctxt->heap_id,
                         tuple_key,
                         data,
@@ -142,7 +143,7 @@ test_memtable_lookup(test_memtable_context *ctxt,
                      message                expected_data)
 {
    btree_config *btree_cfg = test_memtable_context_btree_config(ctxt);
-   uint64        root_addr = ctxt->mt_ctxt->mt[mt_no].root_addr;
+   uint64        root_addr = memtable_root_addr(&ctxt->mt_ctxt->mt[mt_no]);
    cache        *cc        = ctxt->cc;
    return test_btree_lookup(
       cc, btree_cfg, ctxt->heap_id, root_addr, target, expected_data);
@@ -530,7 +531,7 @@ test_memtable_async_lookup(test_memtable_context   *ctxt,
                                   btree_cfg,
                                   async_ctxt,
                                   async_lookup,
-                                  mt->root_addr,
+                                  memtable_root_addr(mt),
                                   expected_found,
                                   correct);
 }
@@ -620,9 +621,10 @@ test_btree_basic(cache             *cc,
          }
       }
       btree_test_run_pending(
-         cc, mt->cfg, mt->root_addr, async_lookup, async_ctxt, TRUE);
+         cc, mt->cfg, memtable_root_addr(mt), async_lookup, async_ctxt, TRUE);
    }
-   btree_test_wait_pending(cc, mt->cfg, mt->root_addr, async_lookup, TRUE);
+   btree_test_wait_pending(
+      cc, mt->cfg, memtable_root_addr(mt), async_lookup, TRUE);
    platform_default_log("btree positive lookup time per tuple %luns\n",
                         platform_timestamp_elapsed(start_time) / num_inserts);
    platform_default_log("%lu%% lookups were async\n",
@@ -230,6 +230,8 @@ test_config_init(trunk_config           *splinter_cfg,  // OUT
                   master_cfg->io_perms,
                   master_cfg->io_async_queue_depth,
                   master_cfg->io_filename);
+   io_cfg->use_uring    = master_cfg->io_use_uring;
+   io_cfg->uring_sqpoll = master_cfg->io_uring_sqpoll;
 
    rc_allocator_config_init(
       allocator_cfg, io_cfg, master_cfg->allocator_capacity);
@@ -257,6 +259,10 @@ test_config_init(trunk_config           *splinter_cfg,  // OUT
                      master_cfg->use_stats,
                      master_cfg->verbose_logging_enabled,
                      master_cfg->log_handle);
+   if (master_cfg->memtable_use_skiplist) {
+      splinter_cfg->mt_cfg.type = MEMTABLE_TYPE_SKIPLIST;
+   }
+   splinter_cfg->mt_cfg.num_shards = master_cfg->memtable_num_shards;
 
    gen->type             = MESSAGE_TYPE_INSERT;
    gen->min_payload_size = GENERATOR_MIN_PAYLOAD_SIZE;
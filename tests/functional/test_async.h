@@ -16,8 +16,9 @@
 #include "cache.h"
 #include "pcq.h"
 
-// Per thread max async inflight. This is limited by clockcache
-#define TEST_MAX_ASYNC_INFLIGHT MAX_READ_REFCOUNT
+// Per thread max async inflight. This is limited by clockcache, as every
+// parked context holds refs on hot pages, see CC_RC_WIDTH
+#define TEST_MAX_ASYNC_INFLIGHT 64
 
 // A single async context
 typedef struct {
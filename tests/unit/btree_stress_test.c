@@ -73,6 +73,15 @@ pack_tests(cache           *cc,
            uint64           root_addr,
            uint64           nkvs);
 
+static uint64
+get_branch_extents(cache        *cc,
+                   btree_config *cfg,
+                   uint64        root_addr,
+                   uint64       *extents);
+
+static int
+extent_addr_compare(const void *a, const void *b, void *arg);
+
 static key
 gen_key(btree_config *cfg, uint64 i, uint8 *buffer, size_t length);
 
@@ -271,6 +280,67 @@ CTEST2(btree_stress, test_random_inserts_concurrent)
    platform_free(hid, threads);
 }
 
+/*
+ * On an empty device, the extents of a packed branch are laid out back to
+ * back. The only holes between them are the extents of the branch's mini
+ * allocator meta pages.
+ */
+CTEST2(btree_stress, test_packed_branch_extents_contiguous)
+{
+   int nkvs = 100000;
+
+   mini_allocator mini;
+   uint64         root_addr = btree_create(
+      (cache *)&data->cc, &data->dbtree_cfg, &mini, PAGE_TYPE_MEMTABLE);
+   insert_tests((cache *)&data->cc,
+                &data->dbtree_cfg,
+                data->hid,
+                &data->test_scratch,
+                &mini,
+                root_addr,
+                0,
+                nkvs);
+
+   uint64 packed_root_addr = pack_tests(
+      (cache *)&data->cc, &data->dbtree_cfg, data->hid, root_addr, nkvs);
+   ASSERT_NOT_EQUAL(0, packed_root_addr, "Pack failed.\n");
+
+   uint64 num_extents = get_branch_extents(
+      (cache *)&data->cc, &data->dbtree_cfg, packed_root_addr, NULL);
+   ASSERT_TRUE(num_extents > 1);
+   uint64 *extents = TYPED_ARRAY_MALLOC(data->hid, extents, num_extents);
+   get_branch_extents(
+      (cache *)&data->cc, &data->dbtree_cfg, packed_root_addr, extents);
+   uint64 tmp;
+   platform_sort_slow(
+      extents, num_extents, sizeof(*extents), extent_addr_compare, NULL, &tmp);
+
+   /*
+    * The holes are the extents mini_init set aside for the batches of the
+    * levels the branch does not have, after its root extent, and the meta
+    * extents, one per many data extents.
+    */
+   uint64 extent_size = btree_extent_size(&data->dbtree_cfg);
+   uint64 num_gaps    = 0;
+   for (uint64 i = 1; i < num_extents; i++) {
+      ASSERT_TRUE(extents[i - 1] < extents[i]);
+      if (extents[i] != extents[i - 1] + extent_size) {
+         num_gaps++;
+      }
+   }
+   uint64 num_holes =
+      (extents[num_extents - 1] - extents[0]) / extent_size + 1 - num_extents;
+   ASSERT_TRUE(num_gaps * 64 < num_extents,
+               "num_gaps=%lu, num_extents=%lu\n",
+               num_gaps,
+               num_extents);
+   ASSERT_TRUE(num_holes <= MINI_MAX_BATCHES + num_gaps,
+               "num_holes=%lu, num_gaps=%lu\n",
+               num_holes,
+               num_gaps);
+   platform_free(data->hid, extents);
+}
+
 /*
  * ********************************************************************************
  * Define minions and helper functions used by this test suite.
@@ -327,6 +397,53 @@ insert_tests(cache           *cc,
    platform_free(hid, msgbuf);
 }
 
+/*
+ * Walks each level of the branch at root_addr in key order, and returns the
+ * number of extents its nodes are in. If extents is not NULL, also stores
+ * the address of each of those extents in it.
+ */
+static uint64
+get_branch_extents(cache        *cc,
+                   btree_config *cfg,
+                   uint64        root_addr,
+                   uint64       *extents)
+{
+   uint64 extent_size = btree_extent_size(cfg);
+   uint64 num_extents = 0;
+   uint64 level_addr  = root_addr;
+   while (level_addr != 0) {
+      uint64 addr        = level_addr;
+      uint64 prev_extent = 0;
+      level_addr         = 0;
+      while (addr != 0) {
+         page_handle *page = cache_get(cc, addr, TRUE, PAGE_TYPE_BRANCH);
+         btree_hdr   *hdr  = (btree_hdr *)page->data;
+         if (prev_extent == 0 && hdr->height != 0) {
+            level_addr = btree_get_child_addr(cfg, hdr, 0);
+         }
+         uint64 extent = addr - addr % extent_size;
+         if (extent != prev_extent) {
+            if (extents != NULL) {
+               extents[num_extents] = extent;
+            }
+            num_extents++;
+            prev_extent = extent;
+         }
+         addr = hdr->next_addr;
+         cache_unget(cc, page);
+      }
+   }
+   return num_extents;
+}
+
+static int
+extent_addr_compare(const void *a, const void *b, void *arg)
+{
+   uint64 addr_a = *(const uint64 *)a;
+   uint64 addr_b = *(const uint64 *)b;
+   return addr_a < addr_b ? -1 : addr_a > addr_b;
+}
+
 static key
 gen_key(btree_config *cfg, uint64 i, uint8 *buffer, size_t length)
 {
@@ -0,0 +1,360 @@
+// Copyright 2021 VMware, Inc.
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * -----------------------------------------------------------------------------
+ * merge_test.c --
+ *
+ *  Checks the output of merge iterators over up to hundreds of in-memory
+ *  inputs against a reference merge: keys found in several inputs, keys
+ *  which share their first 8 bytes or differ only in trailing zero bytes,
+ *  every merge mode, forward and reverse, with and without cached key
+ *  prefixes.
+ * -----------------------------------------------------------------------------
+ */
+#include "splinterdb/public_platform.h"
+#include "splinterdb/default_data_config.h"
+#include "unit_tests.h"
+#include "ctest.h" // This is required for all test-case files.
+
+#include "platform.h"
+#include "merge.h"
+#include "../functional/random.h"
+
+#define NUM_KEYS          4000
+#define MAX_TEST_KEY_SIZE 24
+#define NUM_KEY_PREFIXES  4
+// Inputs hold none or one in 1 to one in MAX_SPARSITY of the keys
+#define MAX_SPARSITY 32
+
+typedef struct test_key {
+   uint64 length;
+   char   data[MAX_TEST_KEY_SIZE];
+} test_key;
+
+/*
+ * Iterates over the keys of one input, given by their index in the sorted
+ * keys, in ascending or descending order. The value of each key is its
+ * index and the index of the input. Like inputs reading their own pages, it
+ * returns its own copy of the key.
+ */
+typedef struct array_iterator {
+   iterator        super;
+   const test_key *keys;
+   const uint32   *key_nos;
+   uint32          num_keys;
+   uint32          pos; // of the current key, in iteration order
+   bool            reverse;
+   uint64          input;
+   char            key_data[MAX_TEST_KEY_SIZE];
+   uint64          value;
+} array_iterator;
+
+// Function Prototypes
+
+static int
+custom_key_compare(const data_config *cfg, slice key1, slice key2);
+
+static void
+generate_keys(random_state *rs, test_key *keys, uint32 *num_keys);
+
+static void
+check_merge(test_key        *keys,
+            uint32           num_keys,
+            random_state    *rs,
+            data_config     *cfg,
+            int              num_inputs,
+            merge_behavior   merge_mode,
+            bool             reverse,
+            platform_heap_id hid);
+
+/*
+ * Global data declaration macro:
+ */
+CTEST_DATA(merge)
+{
+   platform_heap_handle hh;
+   platform_heap_id     hid;
+   random_state         rs;
+   test_key            *keys;
+   uint32               num_keys;
+   data_config          lex_cfg;
+   data_config          custom_cfg;
+};
+
+// Optional setup function for suite, called before every test in suite
+CTEST_SETUP(merge)
+{
+   Platform_default_log_handle = fopen("/tmp/unit_test.stdout", "a+");
+   Platform_error_log_handle   = fopen("/tmp/unit_test.stderr", "a+");
+
+   platform_status rc = platform_heap_create(
+      platform_get_module_id(), 256 * MiB, &data->hh, &data->hid);
+   platform_assert_status_ok(rc);
+
+   random_init(&data->rs, 42, 0);
+   data->keys = TYPED_ARRAY_MALLOC(data->hid, data->keys, NUM_KEYS);
+   ASSERT_TRUE(data->keys != NULL);
+   generate_keys(&data->rs, data->keys, &data->num_keys);
+
+   default_data_config_init(MAX_TEST_KEY_SIZE, &data->lex_cfg);
+   ASSERT_TRUE(data_key_compare_is_lexicographic(&data->lex_cfg));
+   // same order, but merge iterators don't know it, so compare whole keys
+   data->custom_cfg             = data->lex_cfg;
+   data->custom_cfg.key_compare = custom_key_compare;
+   ASSERT_FALSE(data_key_compare_is_lexicographic(&data->custom_cfg));
+}
+
+// Optional teardown function for suite, called after every test in suite
+CTEST_TEARDOWN(merge)
+{
+   platform_free(data->hid, data->keys);
+   platform_heap_destroy(&data->hh);
+}
+
+/*
+ * Every merge mode, forward and reverse, of numbers of inputs from one to
+ * nearly MAX_MERGE_ARITY, which are not all powers of two.
+ */
+CTEST2(merge, test_merge_modes)
+{
+   int            num_inputs[] = {1, 2, 3, 17, 128, 333, MAX_MERGE_ARITY - 1};
+   merge_behavior modes[]      = {MERGE_RAW, MERGE_INTERMEDIATE, MERGE_FULL};
+   data_config   *cfgs[]       = {&data->lex_cfg, &data->custom_cfg};
+
+   for (uint64 i = 0; i < ARRAY_SIZE(num_inputs); i++) {
+      for (uint64 m = 0; m < ARRAY_SIZE(modes); m++) {
+         for (uint64 c = 0; c < ARRAY_SIZE(cfgs); c++) {
+            for (int reverse = 0; reverse < 2; reverse++) {
+               CTEST_LOG("%d inputs, mode %lu, cfg %lu, reverse %d\n",
+                         num_inputs[i],
+                         m,
+                         c,
+                         reverse);
+               check_merge(data->keys,
+                           data->num_keys,
+                           &data->rs,
+                           cfgs[c],
+                           num_inputs[i],
+                           modes[m],
+                           reverse,
+                           data->hid);
+            }
+         }
+      }
+   }
+}
+
+static int
+custom_key_compare(const data_config *cfg, slice key1, slice key2)
+{
+   return slice_lex_cmp(key1, key2);
+}
+
+static void
+array_iterator_get_curr(iterator *itor, key *curr_key, message *msg)
+{
+   array_iterator *aitor = (array_iterator *)itor;
+   debug_assert(aitor->pos < aitor->num_keys);
+   uint32 i      = aitor->reverse ? aitor->num_keys - 1 - aitor->pos
+                                  : aitor->pos;
+   uint32          key_no = aitor->key_nos[i];
+   const test_key *k      = &aitor->keys[key_no];
+   memcpy(aitor->key_data, k->data, k->length);
+   aitor->value = aitor->input << 32 | key_no;
+   *curr_key    = key_create(k->length, aitor->key_data);
+   *msg = message_create(MESSAGE_TYPE_INSERT,
+                         slice_create(sizeof(aitor->value), &aitor->value));
+}
+
+static platform_status
+array_iterator_at_end(iterator *itor, bool *at_end)
+{
+   array_iterator *aitor = (array_iterator *)itor;
+   *at_end               = aitor->pos == aitor->num_keys;
+   return STATUS_OK;
+}
+
+static platform_status
+array_iterator_advance(iterator *itor)
+{
+   array_iterator *aitor = (array_iterator *)itor;
+   debug_assert(aitor->pos < aitor->num_keys);
+   aitor->pos++;
+   return STATUS_OK;
+}
+
+static void
+array_iterator_print(iterator *itor)
+{
+   array_iterator *aitor = (array_iterator *)itor;
+   platform_default_log("array_iterator input %lu pos %u of %u\n",
+                        aitor->input,
+                        aitor->pos,
+                        aitor->num_keys);
+}
+
+const static iterator_ops array_iterator_ops = {
+   .get_curr = array_iterator_get_curr,
+   .at_end   = array_iterator_at_end,
+   .advance  = array_iterator_advance,
+   .print    = array_iterator_print,
+};
+
+static int
+test_key_compare(const void *a, const void *b, void *arg)
+{
+   const test_key *key_a = a;
+   const test_key *key_b = b;
+   return slice_lex_cmp(slice_create(key_a->length, key_a->data),
+                        slice_create(key_b->length, key_b->data));
+}
+
+/*
+ * Generates sorted, distinct keys, most of which start with one of a few
+ * 8-byte prefixes. Tails are drawn from few byte values, zero among them,
+ * so that keys also differ only in their length or their trailing zeros.
+ * Short keys are the start of a prefix.
+ */
+static void
+generate_keys(random_state *rs, test_key *keys, uint32 *num_keys)
+{
+   char prefixes[NUM_KEY_PREFIXES][sizeof(uint64)];
+   random_bytes(rs, (char *)prefixes, sizeof(prefixes));
+   // keys of 4 to 8 bytes of this prefix differ only in their trailing zeros
+   memset(&prefixes[0][4], 0, 4);
+
+   for (uint32 i = 0; i < NUM_KEYS; i++) {
+      const char *prefix = prefixes[random_next_uint32(rs) % NUM_KEY_PREFIXES];
+      test_key   *k      = &keys[i];
+      if (random_next_uint32(rs) % 8 == 0) {
+         k->length = 1 + random_next_uint32(rs) % sizeof(uint64);
+      } else {
+         k->length = sizeof(uint64) + 1
+                     + random_next_uint32(rs)
+                          % (MAX_TEST_KEY_SIZE - sizeof(uint64));
+      }
+      for (uint64 j = 0; j < k->length; j++) {
+         k->data[j] = j < sizeof(uint64) ? prefix[j]
+                                         : random_next_uint32(rs) % 3;
+      }
+   }
+
+   test_key temp;
+   platform_sort_slow(
+      keys, NUM_KEYS, sizeof(*keys), test_key_compare, NULL, &temp);
+   *num_keys = 1;
+   for (uint32 i = 1; i < NUM_KEYS; i++) {
+      if (test_key_compare(&keys[*num_keys - 1], &keys[i], NULL) != 0) {
+         keys[(*num_keys)++] = keys[i];
+      }
+   }
+}
+
+/*
+ * Merges num_inputs random subsets of keys and checks the result against
+ * the expected one: every key in order, once per input holding it, newest
+ * input first, for MERGE_RAW, and otherwise once, with the value of the
+ * newest input, as the default data config keeps the newest message.
+ */
+static void
+check_merge(test_key        *keys,
+            uint32           num_keys,
+            random_state    *rs,
+            data_config     *cfg,
+            int              num_inputs,
+            merge_behavior   merge_mode,
+            bool             reverse,
+            platform_heap_id hid)
+{
+   array_iterator *inputs   = TYPED_ARRAY_ZALLOC(hid, inputs, num_inputs);
+   iterator      **itor_arr = TYPED_ARRAY_MALLOC(hid, itor_arr, num_inputs);
+   uint32         *key_nos  = TYPED_ARRAY_MALLOC(
+      hid, key_nos, (uint64)num_inputs * num_keys);
+   bool *has_key = TYPED_ARRAY_ZALLOC(
+      hid, has_key, (uint64)num_inputs * num_keys);
+   ASSERT_TRUE(inputs != NULL && itor_arr != NULL && key_nos != NULL
+               && has_key != NULL);
+
+   for (int i = 0; i < num_inputs; i++) {
+      uint32 sparsity = random_next_uint32(rs) % (MAX_SPARSITY + 1);
+      inputs[i]       = (array_iterator){
+               .super.ops = &array_iterator_ops,
+               .keys      = keys,
+               .key_nos   = &key_nos[(uint64)i * num_keys],
+               .reverse   = reverse,
+               .input     = i,
+      };
+      for (uint32 k = 0; k < num_keys; k++) {
+         if (sparsity != 0 && random_next_uint32(rs) % sparsity == 0) {
+            key_nos[(uint64)i * num_keys + inputs[i].num_keys++] = k;
+            has_key[(uint64)i * num_keys + k]                     = TRUE;
+         }
+      }
+      itor_arr[i] = &inputs[i].super;
+   }
+
+   merge_iterator *merge_itor;
+   platform_status rc;
+   if (reverse) {
+      rc = merge_iterator_create_reverse(
+         hid, cfg, num_inputs, itor_arr, merge_mode, &merge_itor);
+   } else {
+      rc = merge_iterator_create(
+         hid, cfg, num_inputs, itor_arr, merge_mode, &merge_itor);
+   }
+   ASSERT_TRUE(SUCCESS(rc));
+   iterator *itor = &merge_itor->super;
+
+   uint64 num_tuples = 0;
+   for (uint32 n = 0; n < num_keys; n++) {
+      uint32 k = reverse ? num_keys - 1 - n : n;
+      for (int i = num_inputs - 1; i >= 0; i--) {
+         if (!has_key[(uint64)i * num_keys + k]) {
+            continue;
+         }
+
+         bool at_end;
+         rc = iterator_at_end(itor, &at_end);
+         ASSERT_TRUE(SUCCESS(rc));
+         ASSERT_FALSE(at_end, "merge ended before key %u input %d\n", k, i);
+
+         key     curr_key;
+         message msg;
+         iterator_get_curr(itor, &curr_key, &msg);
+         slice expected_key = slice_create(keys[k].length, keys[k].data);
+         ASSERT_EQUAL(0,
+                      slice_lex_cmp(key_slice(curr_key), expected_key),
+                      "tuple %lu: expected key %u\n",
+                      num_tuples,
+                      k);
+         uint64 value;
+         ASSERT_EQUAL(sizeof(value), message_length(msg));
+         memcpy(&value, message_data(msg), sizeof(value));
+         ASSERT_EQUAL((uint64)i << 32 | k,
+                      value,
+                      "tuple %lu: expected key %u input %d\n",
+                      num_tuples,
+                      k,
+                      i);
+
+         rc = iterator_advance(itor);
+         ASSERT_TRUE(SUCCESS(rc));
+         num_tuples++;
+         if (merge_mode != MERGE_RAW) {
+            // the older inputs are merged into this tuple
+            break;
+         }
+      }
+   }
+   bool at_end;
+   rc = iterator_at_end(itor, &at_end);
+   ASSERT_TRUE(SUCCESS(rc));
+   ASSERT_TRUE(at_end, "merge not ended after %lu tuples\n", num_tuples);
+
+   merge_iterator_destroy(hid, &merge_itor);
+   platform_free(hid, has_key);
+   platform_free(hid, key_nos);
+   platform_free(hid, itor_arr);
+   platform_free(hid, inputs);
+}
@@ -0,0 +1,374 @@
+// Copyright 2021 VMware, Inc.
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * -----------------------------------------------------------------------------
+ * rc_allocator_test.c --
+ *
+ *  Exercises the search for free extents of the rc_allocator: extents freed
+ *  anywhere are found again, searches wrap around the disk, capacities which
+ *  are not a multiple of 64 extents, and concurrent allocs and frees.
+ * -----------------------------------------------------------------------------
+ */
+#include <fcntl.h>
+
+#include "splinterdb/public_platform.h"
+#include "unit_tests.h"
+#include "ctest.h" // This is required for all test-case files.
+
+#include "platform.h"
+#include "rc_allocator.h"
+
+#define TEST_EXTENT_SIZE LAIO_DEFAULT_EXTENT_SIZE
+
+// Extents of the super block and the ref counts, allocated by init
+#define NUM_RESERVED_EXTENTS 2
+
+#define NUM_CONCURRENT_THREADS 8
+#define EXTENTS_PER_THREAD     64
+#define ROUNDS_PER_THREAD      2000
+
+typedef struct alloc_thread_params {
+   allocator *al;
+   threadid   tid;
+   uint8     *owner; // by extent, tid + 1 while the thread holds it
+   uint64     num_duplicates;
+   uint64     num_failures;
+} alloc_thread_params;
+
+// Function Prototypes
+
+static void
+init_allocator(rc_allocator        *al,
+               rc_allocator_config *cfg,
+               io_config           *io_cfg,
+               uint64               num_extents,
+               platform_heap_handle hh,
+               platform_heap_id     hid);
+
+static uint64
+alloc_extent(allocator *al, uint64 hint_extent, platform_status *rc);
+
+static void
+free_extent(allocator *al, uint64 extent_no);
+
+static uint64
+fill_allocator(allocator *al, uint64 num_extents, bool *allocated);
+
+static void
+alloc_thread(void *arg);
+
+/*
+ * Global data declaration macro:
+ */
+CTEST_DATA(rc_allocator)
+{
+   platform_heap_handle hh;
+   platform_heap_id     hid;
+   io_config            io_cfg;
+   rc_allocator_config  allocator_cfg;
+   rc_allocator         al;
+};
+
+// Optional setup function for suite, called before every test in suite
+CTEST_SETUP(rc_allocator)
+{
+   Platform_default_log_handle = fopen("/tmp/unit_test.stdout", "a+");
+   Platform_error_log_handle   = fopen("/tmp/unit_test.stderr", "a+");
+
+   platform_status rc = platform_heap_create(
+      platform_get_module_id(), 256 * MiB, &data->hh, &data->hid);
+   platform_assert_status_ok(rc);
+
+   // The allocator does no IO until it is mounted or unmounted
+   io_config_init(&data->io_cfg,
+                  LAIO_DEFAULT_PAGE_SIZE,
+                  TEST_EXTENT_SIZE,
+                  O_RDWR | O_CREAT,
+                  0755,
+                  256,
+                  "rc_allocator_test.db");
+}
+
+// Optional teardown function for suite, called after every test in suite
+CTEST_TEARDOWN(rc_allocator)
+{
+   platform_heap_destroy(&data->hh);
+}
+
+/*
+ * Fills the disk, frees scattered extents and checks that exactly those are
+ * allocated again, whatever word or summary word they are in.
+ */
+CTEST2(rc_allocator, test_refind_scattered_free_extents)
+{
+   const uint64 num_extents = 3 * 64 * 64 + 37;
+   init_allocator(&data->al,
+                  &data->allocator_cfg,
+                  &data->io_cfg,
+                  num_extents,
+                  data->hh,
+                  data->hid);
+   allocator *al        = (allocator *)&data->al;
+   bool      *allocated = TYPED_ARRAY_ZALLOC(data->hid, allocated, num_extents);
+   uint64     num_allocated = fill_allocator(al, num_extents, allocated);
+   ASSERT_EQUAL(num_extents - NUM_RESERVED_EXTENTS, num_allocated);
+
+   uint64 num_freed = 0;
+   for (uint64 extent_no = NUM_RESERVED_EXTENTS; extent_no < num_extents;
+        extent_no += 97)
+   {
+      free_extent(al, extent_no);
+      allocated[extent_no] = FALSE;
+      num_freed++;
+   }
+   // and the last extent of the disk
+   free_extent(al, num_extents - 1);
+   allocated[num_extents - 1] = FALSE;
+   num_freed++;
+
+   for (uint64 i = 0; i < num_freed; i++) {
+      platform_status rc;
+      uint64          extent_no = alloc_extent(al, 0, &rc);
+      ASSERT_TRUE(SUCCESS(rc));
+      ASSERT_FALSE(allocated[extent_no], "extent_no=%lu", extent_no);
+      allocated[extent_no] = TRUE;
+   }
+   platform_status rc;
+   alloc_extent(al, 0, &rc);
+   ASSERT_FALSE(SUCCESS(rc));
+
+   platform_free(data->hid, allocated);
+   rc_allocator_deinit(&data->al);
+}
+
+/*
+ * A search which starts in the middle of a summary word, with the only free
+ * extents before the start in that same summary word, wraps around the disk
+ * to find them: first in an earlier word, then earlier in the start word.
+ */
+CTEST2(rc_allocator, test_wrap_around_start_summary_word)
+{
+   const uint64 num_extents = 3 * 64 * 64 + 100;
+   init_allocator(&data->al,
+                  &data->allocator_cfg,
+                  &data->io_cfg,
+                  num_extents,
+                  data->hh,
+                  data->hid);
+   allocator *al        = (allocator *)&data->al;
+   bool      *allocated = TYPED_ARRAY_ZALLOC(data->hid, allocated, num_extents);
+   fill_allocator(al, num_extents, allocated);
+
+   // words 66 and 104 of the free map are both in summary word 1
+   const uint64 start_extent = 64 * 104 + 10;
+   uint64       free_extents[] = {64 * 66 + 3, 64 * 104 + 1};
+   for (uint64 i = 0; i < ARRAY_SIZE(free_extents); i++) {
+      free_extent(al, free_extents[i]);
+      platform_status rc;
+      uint64          extent_no = alloc_extent(al, start_extent, &rc);
+      ASSERT_TRUE(SUCCESS(rc));
+      ASSERT_EQUAL(free_extents[i], extent_no);
+   }
+
+   // an extent after the start is preferred over one before it
+   free_extent(al, free_extents[0]);
+   free_extent(al, start_extent + 5);
+   platform_status rc;
+   ASSERT_EQUAL(start_extent + 5, alloc_extent(al, start_extent, &rc));
+   ASSERT_EQUAL(free_extents[0], alloc_extent(al, start_extent, &rc));
+   alloc_extent(al, start_extent, &rc);
+   ASSERT_FALSE(SUCCESS(rc));
+
+   platform_free(data->hid, allocated);
+   rc_allocator_deinit(&data->al);
+}
+
+/*
+ * Capacities which end partway through a word or a summary word: the whole
+ * disk is allocated, nothing past its end, and it is all found again once
+ * freed.
+ */
+CTEST2(rc_allocator, test_capacity_not_multiple_of_64)
+{
+   const uint64 capacities[] = {65, 127, 64 * 64 - 1, 64 * 64 + 1, 9001};
+   for (uint64 c = 0; c < ARRAY_SIZE(capacities); c++) {
+      uint64 num_extents = capacities[c];
+      init_allocator(&data->al,
+                     &data->allocator_cfg,
+                     &data->io_cfg,
+                     num_extents,
+                     data->hh,
+                     data->hid);
+      allocator *al = (allocator *)&data->al;
+      bool      *allocated =
+         TYPED_ARRAY_ZALLOC(data->hid, allocated, num_extents);
+      for (uint64 round = 0; round < 2; round++) {
+         uint64 num_allocated = fill_allocator(al, num_extents, allocated);
+         ASSERT_EQUAL(num_extents - NUM_RESERVED_EXTENTS,
+                      num_allocated,
+                      "num_extents=%lu round=%lu",
+                      num_extents,
+                      round);
+         for (uint64 extent_no = NUM_RESERVED_EXTENTS; extent_no < num_extents;
+              extent_no++)
+         {
+            free_extent(al, extent_no);
+            allocated[extent_no] = FALSE;
+         }
+      }
+      platform_free(data->hid, allocated);
+      rc_allocator_deinit(&data->al);
+   }
+}
+
+/*
+ * Threads allocate and free extents of a disk which is just big enough for
+ * them all, so that extents are reused over and over. No extent is ever
+ * handed to two threads at once.
+ */
+CTEST2(rc_allocator, test_concurrent_alloc_free)
+{
+   const uint64 num_extents =
+      NUM_CONCURRENT_THREADS * EXTENTS_PER_THREAD + NUM_RESERVED_EXTENTS + 7;
+   init_allocator(&data->al,
+                  &data->allocator_cfg,
+                  &data->io_cfg,
+                  num_extents,
+                  data->hh,
+                  data->hid);
+   uint8 *owner = TYPED_ARRAY_ZALLOC(data->hid, owner, num_extents);
+
+   alloc_thread_params params[NUM_CONCURRENT_THREADS];
+   platform_thread     threads[NUM_CONCURRENT_THREADS];
+   for (uint64 i = 0; i < NUM_CONCURRENT_THREADS; i++) {
+      params[i] = (alloc_thread_params){
+         .al = (allocator *)&data->al, .tid = i + 1, .owner = owner};
+      platform_status rc = platform_thread_create(
+         &threads[i], FALSE, alloc_thread, &params[i], data->hid);
+      ASSERT_TRUE(SUCCESS(rc));
+   }
+   for (uint64 i = 0; i < NUM_CONCURRENT_THREADS; i++) {
+      platform_thread_join(threads[i]);
+   }
+   for (uint64 i = 0; i < NUM_CONCURRENT_THREADS; i++) {
+      ASSERT_EQUAL(0, params[i].num_duplicates, "thread %lu", i);
+      ASSERT_EQUAL(0, params[i].num_failures, "thread %lu", i);
+   }
+
+   // everything was freed
+   allocator *al        = (allocator *)&data->al;
+   bool      *allocated = TYPED_ARRAY_ZALLOC(data->hid, allocated, num_extents);
+   ASSERT_EQUAL(num_extents - NUM_RESERVED_EXTENTS,
+                fill_allocator(al, num_extents, allocated));
+   platform_free(data->hid, allocated);
+   platform_free(data->hid, owner);
+   rc_allocator_deinit(&data->al);
+}
+
+/*
+ * ********************************************************************************
+ * Define minions and helper functions here, after all test cases are
+ * enumerated.
+ * ********************************************************************************
+ */
+
+static void
+init_allocator(rc_allocator        *al,
+               rc_allocator_config *cfg,
+               io_config           *io_cfg,
+               uint64               num_extents,
+               platform_heap_handle hh,
+               platform_heap_id     hid)
+{
+   rc_allocator_config_init(cfg, io_cfg, num_extents * TEST_EXTENT_SIZE);
+   platform_status rc =
+      rc_allocator_init(al, cfg, NULL, hh, hid, platform_get_module_id());
+   platform_assert_status_ok(rc);
+}
+
+/*
+ * Allocates an extent with the search starting at hint_extent, or at the
+ * thread's cursor if hint_extent is 0, and returns its number.
+ */
+static uint64
+alloc_extent(allocator *al, uint64 hint_extent, platform_status *rc)
+{
+   uint64 addr = 0;
+   if (hint_extent == 0) {
+      *rc = allocator_alloc(al, &addr, PAGE_TYPE_MISC);
+   } else {
+      // alloc_near searches from the extent after the hint
+      *rc = allocator_alloc_near(
+         al, (hint_extent - 1) * TEST_EXTENT_SIZE, &addr, PAGE_TYPE_MISC);
+   }
+   return addr / TEST_EXTENT_SIZE;
+}
+
+static void
+free_extent(allocator *al, uint64 extent_no)
+{
+   uint64 addr = extent_no * TEST_EXTENT_SIZE;
+   uint8  ref  = allocator_dec_ref(al, addr, PAGE_TYPE_MISC);
+   platform_assert(ref == AL_NO_REFS);
+   ref = allocator_dec_ref(al, addr, PAGE_TYPE_MISC);
+   platform_assert(ref == AL_FREE);
+}
+
+/*
+ * Allocates until the disk is full, marking the extents in allocated.
+ * Returns the number allocated, or 0 if an extent is allocated twice or is
+ * past the end of the disk.
+ */
+static uint64
+fill_allocator(allocator *al, uint64 num_extents, bool *allocated)
+{
+   uint64 num_allocated = 0;
+   while (TRUE) {
+      platform_status rc;
+      uint64          extent_no = alloc_extent(al, 0, &rc);
+      if (!SUCCESS(rc)) {
+         return num_allocated;
+      }
+      if (extent_no >= num_extents || allocated[extent_no]) {
+         return 0;
+      }
+      allocated[extent_no] = TRUE;
+      num_allocated++;
+   }
+}
+
+static void
+alloc_thread(void *arg)
+{
+   alloc_thread_params *params = (alloc_thread_params *)arg;
+   platform_set_tid(params->tid);
+
+   uint64 extent[EXTENTS_PER_THREAD];
+   for (uint64 round = 0; round < ROUNDS_PER_THREAD; round++) {
+      // vary how many are held, so that the threads go out of step
+      uint64 num_held = 1 + (round * (params->tid + 1)) % EXTENTS_PER_THREAD;
+      for (uint64 i = 0; i < num_held; i++) {
+         platform_status rc;
+         extent[i] = alloc_extent(params->al, 0, &rc);
+         if (!SUCCESS(rc)) {
+            params->num_failures++;
+            num_held = i;
+            break;
+         }
+         if (!__sync_bool_compare_and_swap(
+                &params->owner[extent[i]], 0, params->tid + 1))
+         {
+            params->num_duplicates++;
+         }
+      }
+      for (uint64 i = 0; i < num_held; i++) {
+         if (!__sync_bool_compare_and_swap(
+                &params->owner[extent[i]], params->tid + 1, 0))
+         {
+            params->num_duplicates++;
+         }
+         free_extent(params->al, extent[i]);
+      }
+   }
+}
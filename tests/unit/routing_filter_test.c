@@ -0,0 +1,262 @@
+// Copyright 2021 VMware, Inc.
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * -----------------------------------------------------------------------------
+ * routing_filter_test.c --
+ *
+ *  Checks the bucket decode and remainder scan kernels of the routing filter
+ *  which the running CPU supports against the generic ones, and the generic
+ *  ones against a bit-by-bit reference, on random encodings and buckets.
+ * -----------------------------------------------------------------------------
+ */
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "splinterdb/public_platform.h"
+#include "unit_tests.h"
+#include "ctest.h" // This is required for all test-case files.
+
+#include "platform.h"
+#include "routing_filter.h"
+#include "../functional/random.h"
+
+#define NUM_ENCODINGS     2000
+#define MAX_ENCODING_SIZE 256
+
+#define NUM_SCANS       20000
+#define MAX_SCAN_COUNT  100
+#define MAX_VALUE_SIZE  6
+#define NUM_REMAINDERS  4
+
+// Function Prototypes
+
+static void
+random_encoding(random_state *rs,
+                char         *encoding,
+                uint64        encoding_size,
+                uint64       *set_bits);
+
+static void
+reference_bucket_bounds(const uint64 *set_bits,
+                        uint64        bucket_offset,
+                        uint64       *start,
+                        uint64       *end);
+
+static uint64
+reference_scan(const uint32 *remainders_and_values,
+               uint32        count,
+               uint32        remainder,
+               uint32        value_size);
+
+/*
+ * Global data declaration macro:
+ */
+CTEST_DATA(routing_filter)
+{
+   routing_kernel_list kernels;
+   random_state        rs;
+   // encodings end where this page does, and reading past them faults
+   char  *guarded_page;
+   uint64 page_size;
+};
+
+// Optional setup function for suite, called before every test in suite
+CTEST_SETUP(routing_filter)
+{
+   Platform_default_log_handle = fopen("/tmp/unit_test.stdout", "a+");
+   Platform_error_log_handle   = fopen("/tmp/unit_test.stderr", "a+");
+
+   data->page_size    = sysconf(_SC_PAGESIZE);
+   data->guarded_page = mmap(NULL,
+                             2 * data->page_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS,
+                             -1,
+                             0);
+   ASSERT_TRUE(data->guarded_page != MAP_FAILED);
+   int err = mprotect(
+      data->guarded_page + data->page_size, data->page_size, PROT_NONE);
+   ASSERT_EQUAL(0, err);
+
+   routing_get_kernels(&data->kernels);
+   random_init(&data->rs, 42, 0);
+   CTEST_LOG("%u bucket bound and %u scan kernels\n",
+             data->kernels.num_bucket_bounds,
+             data->kernels.num_scans);
+}
+
+// Optional teardown function for suite, called after every test in suite
+CTEST_TEARDOWN(routing_filter)
+{
+   munmap(data->guarded_page, 2 * data->page_size);
+}
+
+/*
+ * Every bucket of random encodings, from bucket 0 to the last, sparse enough
+ * that buckets span several words and of sizes which leave a partial word at
+ * the tail, whose set bits close the last buckets.
+ */
+CTEST2(routing_filter, test_bucket_bounds)
+{
+   uint64 set_bits[MAX_ENCODING_SIZE * 8];
+   uint64 num_spanning = 0;
+   uint64 num_tail     = 0;
+
+   for (uint64 i = 0; i < NUM_ENCODINGS; i++) {
+      uint64 encoding_size =
+         1 + random_next_uint64(&data->rs) % MAX_ENCODING_SIZE;
+      char *encoding = data->guarded_page + data->page_size - encoding_size;
+      random_encoding(&data->rs, encoding, encoding_size, set_bits);
+
+      uint64 num_buckets = 0;
+      while (set_bits[num_buckets] != UINT64_MAX) {
+         num_buckets++;
+      }
+      if (set_bits[num_buckets - 1] / 64 == encoding_size / 8
+          && encoding_size % 8 != 0)
+      {
+         num_tail++;
+      }
+
+      for (uint64 bucket = 0; bucket < num_buckets; bucket++) {
+         uint64 ref_start, ref_end;
+         reference_bucket_bounds(set_bits, bucket, &ref_start, &ref_end);
+         if (bucket != 0 && set_bits[bucket - 1] / 64 != set_bits[bucket] / 64)
+         {
+            num_spanning++;
+         }
+
+         for (uint32 k = 0; k < data->kernels.num_bucket_bounds; k++) {
+            uint64 start = UINT64_MAX;
+            uint64 end   = UINT64_MAX;
+            data->kernels.bucket_bounds[k](
+               encoding, encoding_size, bucket, &start, &end);
+            ASSERT_EQUAL(ref_start,
+                         start,
+                         "kernel %s, encoding %lu, size %lu, bucket %lu\n",
+                         data->kernels.bucket_bounds_name[k],
+                         i,
+                         encoding_size,
+                         bucket);
+            ASSERT_EQUAL(ref_end,
+                         end,
+                         "kernel %s, encoding %lu, size %lu, bucket %lu\n",
+                         data->kernels.bucket_bounds_name[k],
+                         i,
+                         encoding_size,
+                         bucket);
+         }
+      }
+   }
+
+   // The random encodings must have exercised the interesting cases
+   ASSERT_TRUE(num_spanning > NUM_ENCODINGS);
+   ASSERT_TRUE(num_tail > NUM_ENCODINGS / 8);
+}
+
+/*
+ * Random buckets of remainders and values, of counts below, at and above the
+ * vector widths and with leftover entries, with few distinct remainders so
+ * that most scans match several entries.
+ */
+CTEST2(routing_filter, test_scan)
+{
+   uint32 remainders_and_values[MAX_SCAN_COUNT];
+
+   for (uint64 i = 0; i < NUM_SCANS; i++) {
+      uint32 count      = random_next_uint32(&data->rs) % (MAX_SCAN_COUNT + 1);
+      uint32 value_size = 1 + random_next_uint32(&data->rs) % MAX_VALUE_SIZE;
+      for (uint32 j = 0; j < count; j++) {
+         uint32 remainder = random_next_uint32(&data->rs) % NUM_REMAINDERS;
+         uint32 value     = random_next_uint32(&data->rs) % (1U << value_size);
+         remainders_and_values[j] = remainder << value_size | value;
+      }
+
+      for (uint32 remainder = 0; remainder <= NUM_REMAINDERS; remainder++) {
+         uint64 expected = reference_scan(
+            remainders_and_values, count, remainder, value_size);
+         for (uint32 k = 0; k < data->kernels.num_scans; k++) {
+            uint64 found = data->kernels.scan[k](
+               remainders_and_values, count, remainder, value_size);
+            ASSERT_EQUAL(expected,
+                         found,
+                         "kernel %s, scan %lu, count %u, value_size %u, "
+                         "remainder %u\n",
+                         data->kernels.scan_name[k],
+                         i,
+                         count,
+                         value_size,
+                         remainder);
+         }
+      }
+   }
+}
+
+/*
+ * Fills encoding with bits of a random density, at least one of them set,
+ * and set_bits with their positions, terminated by UINT64_MAX.
+ */
+static void
+random_encoding(random_state *rs,
+                char         *encoding,
+                uint64        encoding_size,
+                uint64       *set_bits)
+{
+   // one in 2 to one in 256 bits set
+   uint32 sparsity = 2U << random_next_uint32(rs) % 8;
+
+   memset(encoding, 0, encoding_size);
+   for (uint64 bit = 0; bit < 8 * encoding_size; bit++) {
+      if (random_next_uint32(rs) % sparsity == 0) {
+         encoding[bit / 8] |= 1 << bit % 8;
+      }
+   }
+   // half the time, close the last bucket in the last byte
+   if (random_next_uint32(rs) % 2 == 0) {
+      uint64 bit = 8 * (encoding_size - 1) + random_next_uint32(rs) % 8;
+      encoding[bit / 8] |= 1 << bit % 8;
+   }
+   if (encoding[0] == 0) {
+      encoding[0] = 1;
+   }
+
+   uint64 num_set = 0;
+   for (uint64 bit = 0; bit < 8 * encoding_size; bit++) {
+      if (encoding[bit / 8] & (1 << bit % 8)) {
+         set_bits[num_set++] = bit;
+      }
+   }
+   set_bits[num_set] = UINT64_MAX;
+}
+
+/*
+ * Bucket i holds the clear bits between set bits i - 1 and i, numbered by
+ * their index among all clear bits.
+ */
+static void
+reference_bucket_bounds(const uint64 *set_bits,
+                        uint64        bucket_offset,
+                        uint64       *start,
+                        uint64       *end)
+{
+   *start = bucket_offset == 0 ? 0 : set_bits[bucket_offset - 1] + 1;
+   *start -= bucket_offset;
+   *end = set_bits[bucket_offset] - bucket_offset;
+}
+
+static uint64
+reference_scan(const uint32 *remainders_and_values,
+               uint32        count,
+               uint32        remainder,
+               uint32        value_size)
+{
+   uint64 found_values = 0;
+   for (uint32 i = 0; i < count; i++) {
+      if (remainders_and_values[i] >> value_size == remainder) {
+         uint32 value = remainders_and_values[i] & ((1U << value_size) - 1);
+         found_values |= 1ULL << value;
+      }
+   }
+   return found_values;
+}
@@ -27,6 +27,8 @@
 #include <stdlib.h> // Needed for system calls; e.g. free
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "splinterdb/splinterdb.h"
 #include "splinterdb/data.h"
@@ -37,6 +39,7 @@
 #include "test_data.h"
 #include "ctest.h" // This is required for all test-case files.
 #include "btree.h" // for MAX_INLINE_MESSAGE_SIZE
+#include "io.h"    // for io_uring_available
 
 #define TEST_MAX_KEY_SIZE 13
 
@@ -65,14 +68,85 @@ insert_keys(splinterdb *kvsb, const int minkey, int numkeys, const int incr);
 static int
 check_current_tuple(splinterdb_iterator *it, const int expected_i);
 
+static int
+check_memtable_overwrites_and_deletes(splinterdb *kvsb);
+
+static int
+check_range_deleted_keys(splinterdb *kvsb, int num_keys);
+
+static bool
+bulk_load_next(void *arg, slice *key, slice *value);
+
+static int
+check_bulk_loaded_keys(splinterdb *kvsb, int num_keys, int overwritten);
+
+static int
+check_snapshot_keys(splinterdb          *kvsb,
+                    splinterdb_snapshot *snapshot,
+                    int                  num_keys,
+                    const char          *val_fmt);
+
+#define SEEK_TEST_NUM_KEYS 400000
+
+static int
+insert_seek_test_keys(splinterdb *kvsb);
+
+static bool
+seek_key_present(int i);
+
+static int
+check_seek_and_prev(splinterdb_iterator *it);
+
+static int
+check_reverse_iterator(splinterdb *kvsb);
+
+#define PREFIX_TEST_NUM_GROUPS     100
+#define PREFIX_TEST_KEYS_PER_GROUP 2000
+#define PREFIX_TEST_PREFIX_LENGTH  5
+
+static uint64
+fixed_key_prefix_length(const data_config *cfg, slice key);
+
+static int
+insert_prefix_test_keys(splinterdb *kvsb);
+
+static int
+check_prefix_iterator(splinterdb *kvsb, int group);
+
+#define CRASH_TEST_NUM_KEYS        20000
+#define CRASH_TEST_DELETE_START    5000 // of the range deletes
+#define CRASH_TEST_DELETE_LENGTH   1000
+#define CRASH_TEST_REINSERTED_KEY  5500 // after the range deletes
+
+static int
+crash_recovery_child(const splinterdb_config *cfg);
+
+static int
+check_crash_recovered_keys(splinterdb *kvsb);
+
+static int
+bulk_load_crash_child(const splinterdb_config *cfg, int num_keys);
+
 static int
 custom_key_comparator(const data_config *cfg, slice key1, slice key2);
 
+static void
+lookup_async_count_cb(int rc, splinterdb_lookup_result *result, void *arg);
+
 typedef struct {
    data_config super;
    uint64      num_comparisons;
 } comparison_counting_data_config;
 
+typedef struct {
+   int  start;
+   int  num_keys;
+   int  next;
+   int  swap_at;
+   char key_buf[TEST_MAX_KEY_SIZE + 1];
+   char val_buf[TEST_MAX_VALUE_SIZE];
+} bulk_load_generator;
+
 /*
  * Global data declaration macro:
  *
@@ -854,134 +928,2117 @@ CTEST2(splinterdb_quick, test_iterator_init_bug)
 }
 
 /*
- * ********************************************************************************
- * Define minions and helper functions here, after all test cases are
- * enumerated.
- * ********************************************************************************
+ * Test case to exercise the async lookup API. Issue more lookups than the
+ * handle has contexts for, so that some calls must be retried after polling,
+ * and verify that every lookup's callback fires exactly once with the right
+ * result.
  */
+CTEST2(splinterdb_quick, test_lookup_async)
+{
+#define TEST_ASYNC_NUM_LOOKUPS 256
+   const int num_inserts = 200;
+   const int num_lookups = TEST_ASYNC_NUM_LOOKUPS;
 
-static void
-create_default_cfg(splinterdb_config *out_cfg, data_config *default_data_cfg)
+   int rc = insert_keys(data->kvsb, 0, num_inserts, 1);
+   ASSERT_EQUAL(0, rc);
+
+   splinterdb_lookup_async_handle *handle = NULL;
+   rc = splinterdb_lookup_async_handle_create(
+      data->kvsb, SPLINTERDB_LOOKUP_ASYNC_MAX_INFLIGHT + 1, &handle);
+   ASSERT_EQUAL(EINVAL, rc);
+   rc = splinterdb_lookup_async_handle_create(data->kvsb, 8, &handle);
+   ASSERT_EQUAL(0, rc);
+
+   // the limit holds over all of a thread's handles
+   splinterdb_lookup_async_handle *other = NULL;
+
+   rc = splinterdb_lookup_async_handle_create(
+      data->kvsb, SPLINTERDB_LOOKUP_ASYNC_MAX_INFLIGHT - 7, &other);
+   ASSERT_EQUAL(EINVAL, rc);
+   rc = splinterdb_lookup_async_handle_create(
+      data->kvsb, SPLINTERDB_LOOKUP_ASYNC_MAX_INFLIGHT - 8, &other);
+   ASSERT_EQUAL(0, rc);
+   splinterdb_lookup_async_handle_destroy(other);
+
+   splinterdb_lookup_result results[TEST_ASYNC_NUM_LOOKUPS];
+   int                      completions[TEST_ASYNC_NUM_LOOKUPS];
+   memset(completions, 0, sizeof(completions));
+
+   for (int i = 0; i < num_lookups; i++) {
+      char key[TEST_INSERT_KEY_LENGTH] = {0};
+      snprintf(key, sizeof(key), key_fmt, i);
+
+      splinterdb_lookup_result_init(data->kvsb, &results[i], 0, NULL);
+      do {
+         rc = splinterdb_lookup_async(handle,
+                                      slice_create(sizeof(key), key),
+                                      &results[i],
+                                      lookup_async_count_cb,
+                                      &completions[i]);
+         if (rc == EAGAIN) {
+            splinterdb_lookup_async_poll(handle);
+         }
+      } while (rc == EAGAIN);
+      ASSERT_EQUAL(0, rc);
+   }
+   splinterdb_lookup_async_wait(handle);
+   ASSERT_EQUAL(0, splinterdb_lookup_async_poll(handle));
+   splinterdb_lookup_async_handle_destroy(handle);
+
+   for (int i = 0; i < num_lookups; i++) {
+      ASSERT_EQUAL(1, completions[i], "i=%d", i);
+      if (i < num_inserts) {
+         char val[TEST_INSERT_VAL_LENGTH] = {0};
+         snprintf(val, sizeof(val), val_fmt, i);
+
+         slice value;
+         ASSERT_TRUE(splinterdb_lookup_found(&results[i]));
+         rc = splinterdb_lookup_result_value(&results[i], &value);
+         ASSERT_EQUAL(0, rc);
+         ASSERT_EQUAL(sizeof(val), slice_length(value));
+         ASSERT_EQUAL(0, memcmp(val, slice_data(value), sizeof(val)));
+      } else {
+         ASSERT_FALSE(splinterdb_lookup_found(&results[i]));
+      }
+      splinterdb_lookup_result_deinit(&results[i]);
+   }
+}
+
+/*
+ * Test case to verify that splinterdb_lookup_batch() returns the same results
+ * as individual lookups. Use a small memtable so that most of the data has
+ * been flushed into the trunk, and include deleted, missing and repeated
+ * keys in the batch.
+ */
+CTEST2(splinterdb_quick, test_lookup_batch)
 {
-   *out_cfg = (splinterdb_config){.filename   = TEST_DB_NAME,
-                                  .cache_size = 64 * Mega,
-                                  .disk_size  = 127 * Mega,
-                                  .data_cfg   = default_data_cfg};
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_capacity = MiB_TO_B(1);
+   int rc                      = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+
+#define TEST_BATCH_NUM_KEYS 600
+   const int num_inserts = 40000;
+   char      key_buf[TEST_MAX_KEY_SIZE + 1];
+   char      val_buf[TEST_MAX_VALUE_SIZE];
+
+   for (int i = 0; i < num_inserts; i++) {
+      snprintf(key_buf, sizeof(key_buf), "bkey-%08d", i);
+      snprintf(val_buf, sizeof(val_buf), "bval-%08d", i);
+      rc = splinterdb_insert(data->kvsb,
+                             slice_create(strlen(key_buf), key_buf),
+                             slice_create(strlen(val_buf), val_buf));
+      ASSERT_EQUAL(0, rc);
+   }
+   for (int i = 0; i < num_inserts; i += 7) {
+      snprintf(key_buf, sizeof(key_buf), "bkey-%08d", i);
+      rc = splinterdb_delete(data->kvsb,
+                             slice_create(strlen(key_buf), key_buf));
+      ASSERT_EQUAL(0, rc);
+   }
+
+   // Keys in a scattered order, some past the end, with some repeats
+   static char              batch_keys[TEST_BATCH_NUM_KEYS][TEST_MAX_KEY_SIZE];
+   slice                    keys[TEST_BATCH_NUM_KEYS];
+   splinterdb_lookup_result results[TEST_BATCH_NUM_KEYS];
+   for (int i = 0; i < TEST_BATCH_NUM_KEYS; i++) {
+      int k = (i * 7919) % (num_inserts + num_inserts / 10);
+      if (i % 50 == 0 && i > 0) {
+         k = ((i - 1) * 7919) % (num_inserts + num_inserts / 10);
+      }
+      snprintf(key_buf, sizeof(key_buf), "bkey-%08d", k);
+      memcpy(batch_keys[i], key_buf, strlen(key_buf));
+      keys[i] = slice_create(strlen(key_buf), batch_keys[i]);
+      splinterdb_lookup_result_init(data->kvsb, &results[i], 0, NULL);
+   }
+
+   rc = splinterdb_lookup_batch(data->kvsb, TEST_BATCH_NUM_KEYS, keys, results);
+   ASSERT_EQUAL(0, rc);
+
+   splinterdb_lookup_result expected;
+   splinterdb_lookup_result_init(data->kvsb, &expected, 0, NULL);
+   for (int i = 0; i < TEST_BATCH_NUM_KEYS; i++) {
+      rc = splinterdb_lookup(data->kvsb, keys[i], &expected);
+      ASSERT_EQUAL(0, rc);
+      bool found = splinterdb_lookup_found(&expected);
+      ASSERT_EQUAL(found, splinterdb_lookup_found(&results[i]), "i=%d", i);
+      if (found) {
+         slice expected_value, value;
+         rc = splinterdb_lookup_result_value(&expected, &expected_value);
+         ASSERT_EQUAL(0, rc);
+         rc = splinterdb_lookup_result_value(&results[i], &value);
+         ASSERT_EQUAL(0, rc);
+         ASSERT_TRUE(slice_lex_cmp(expected_value, value) == 0, "i=%d", i);
+      }
+      splinterdb_lookup_result_deinit(&results[i]);
+   }
+   splinterdb_lookup_result_deinit(&expected);
 }
 
 /*
- * Helper function to insert n-keys (num_inserts), using pre-formatted
- * key and value strings.
- *
- * Returns: Return code: rc == 0 => success; anything else => failure
+ * With sequential inserts, the bundles compacted into a node hold no keys of
+ * its pivots but the last, so a pivot which had no filter is left with whole
+ * branches and an empty one. A flush carries that empty filter into a
+ * subbundle of the child, and a leaf split copies it to the new leaves. Look
+ * up keys spread over those inserted so far after every insert, individually,
+ * in a batch and asynchronously, so that each lookup path goes through such
+ * filters while they are live.
  */
-static int
-insert_some_keys(const int num_inserts, splinterdb *kvsb)
+CTEST2(splinterdb_quick, test_lookups_with_empty_filters)
 {
-   int rc = 0;
-   // insert keys backwards, just for kicks
-   for (int i = num_inserts - 1; i >= 0; i--) {
-      char key[TEST_INSERT_KEY_LENGTH] = {0};
-      char val[TEST_INSERT_VAL_LENGTH] = {0};
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_capacity     = KiB_TO_B(96);
+   data->cfg.fanout                = 4;
+   data->cfg.max_branches_per_node = 8;
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
 
-      ASSERT_EQUAL(KEY_FMT_LENGTH, snprintf(key, sizeof(key), key_fmt, i));
-      ASSERT_EQUAL(VAL_FMT_LENGTH, snprintf(val, sizeof(val), val_fmt, i));
+   splinterdb_lookup_async_handle *handle = NULL;
+   rc = splinterdb_lookup_async_handle_create(data->kvsb, 4, &handle);
+   ASSERT_EQUAL(0, rc);
 
-      rc = splinterdb_insert(
-         kvsb, slice_create(sizeof(key), key), slice_create(sizeof(val), val));
+#define TEST_EMPTY_FILTER_NUM_PROBES 4
+   const int num_inserts = 60000;
+   char      key_buf[TEST_MAX_KEY_SIZE + 1];
+   char      val_buf[TEST_MAX_VALUE_SIZE];
+   char      probe_keys[TEST_EMPTY_FILTER_NUM_PROBES][TEST_MAX_KEY_SIZE + 1];
+   int       probe_ids[TEST_EMPTY_FILTER_NUM_PROBES];
+   slice     keys[TEST_EMPTY_FILTER_NUM_PROBES];
+   splinterdb_lookup_result results[3][TEST_EMPTY_FILTER_NUM_PROBES];
+   int                      completions[TEST_EMPTY_FILTER_NUM_PROBES];
+
+   for (int i = 0; i < num_inserts; i++) {
+      snprintf(key_buf, sizeof(key_buf), "ek-%08d", i);
+      snprintf(val_buf, sizeof(val_buf), "ev-%08d", i);
+      rc = splinterdb_insert(data->kvsb,
+                             slice_create(strlen(key_buf), key_buf),
+                             slice_create(strlen(val_buf), val_buf));
+      ASSERT_EQUAL(0, rc);
+
+      memset(completions, 0, sizeof(completions));
+      for (int p = 0; p < TEST_EMPTY_FILTER_NUM_PROBES; p++) {
+         probe_ids[p] = i * p / TEST_EMPTY_FILTER_NUM_PROBES;
+         snprintf(
+            probe_keys[p], sizeof(probe_keys[p]), "ek-%08d", probe_ids[p]);
+         keys[p] = slice_create(strlen(probe_keys[p]), probe_keys[p]);
+         for (int r = 0; r < 3; r++) {
+            splinterdb_lookup_result_init(data->kvsb, &results[r][p], 0, NULL);
+         }
+         rc = splinterdb_lookup(data->kvsb, keys[p], &results[0][p]);
+         ASSERT_EQUAL(0, rc);
+         rc = splinterdb_lookup_async(handle,
+                                      keys[p],
+                                      &results[2][p],
+                                      lookup_async_count_cb,
+                                      &completions[p]);
+         ASSERT_EQUAL(0, rc);
+      }
+      rc = splinterdb_lookup_batch(
+         data->kvsb, TEST_EMPTY_FILTER_NUM_PROBES, keys, results[1]);
       ASSERT_EQUAL(0, rc);
+      splinterdb_lookup_async_wait(handle);
+
+      for (int p = 0; p < TEST_EMPTY_FILTER_NUM_PROBES; p++) {
+         ASSERT_EQUAL(1, completions[p]);
+         snprintf(val_buf, sizeof(val_buf), "ev-%08d", probe_ids[p]);
+         for (int r = 0; r < 3; r++) {
+            ASSERT_TRUE(splinterdb_lookup_found(&results[r][p]),
+                        "i=%d, probe %d, lookup %d",
+                        i,
+                        probe_ids[p],
+                        r);
+            slice value;
+            rc = splinterdb_lookup_result_value(&results[r][p], &value);
+            ASSERT_EQUAL(0, rc);
+            ASSERT_EQUAL(strlen(val_buf), slice_length(value));
+            ASSERT_STREQN(val_buf, slice_data(value), slice_length(value));
+            splinterdb_lookup_result_deinit(&results[r][p]);
+         }
+      }
    }
+   splinterdb_lookup_async_handle_destroy(handle);
+}
 
-   return rc;
+/*
+ * Alternate runs of sequential inserts, which leave pivots with empty filters
+ * as in test_lookups_with_empty_filters, with inserts scattered over the keys
+ * before them. A flush then carries an empty filter and filters of the
+ * scattered keys into the same bundle of a child, whose compaction makes a
+ * subbundle with an empty filter 0 and more after it. Look up keys spread
+ * over the sequential ones asynchronously after every insert, so that the
+ * lookups go through such subbundles while they are live.
+ */
+CTEST2(splinterdb_quick, test_lookup_async_with_empty_filters)
+{
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_capacity     = KiB_TO_B(128);
+   data->cfg.fanout                = 4;
+   data->cfg.max_branches_per_node = 4;
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+
+#define TEST_EMPTY_FILTER_NUM_ASYNC 8
+   splinterdb_lookup_async_handle *handle = NULL;
+   rc = splinterdb_lookup_async_handle_create(
+      data->kvsb, TEST_EMPTY_FILTER_NUM_ASYNC, &handle);
+   ASSERT_EQUAL(0, rc);
+
+   const int num_rounds    = 8;
+   const int num_seq       = 10000;
+   const int num_scattered = 1000;
+   int       num_inserted  = 0;
+   char      key_buf[TEST_MAX_KEY_SIZE + 1];
+   char      val_buf[TEST_MAX_VALUE_SIZE];
+   char      probe_keys[TEST_EMPTY_FILTER_NUM_ASYNC][TEST_MAX_KEY_SIZE + 1];
+   int       probe_ids[TEST_EMPTY_FILTER_NUM_ASYNC];
+   splinterdb_lookup_result results[TEST_EMPTY_FILTER_NUM_ASYNC];
+   int                      completions[TEST_EMPTY_FILTER_NUM_ASYNC];
+
+   for (int round = 0; round < num_rounds; round++) {
+      for (int i = 0; i < num_seq + num_scattered; i++) {
+         if (i < num_seq) {
+            snprintf(key_buf, sizeof(key_buf), "ek-%08d", num_inserted);
+            snprintf(val_buf, sizeof(val_buf), "ev-%08d", num_inserted);
+            num_inserted++;
+         } else {
+            int k = (i - num_seq) * 7919 % num_inserted;
+            snprintf(key_buf, sizeof(key_buf), "ek-%08d.%d", k, round);
+            snprintf(val_buf, sizeof(val_buf), "ev-%08d.%d", k, round);
+         }
+         rc = splinterdb_insert(data->kvsb,
+                                slice_create(strlen(key_buf), key_buf),
+                                slice_create(strlen(val_buf), val_buf));
+         ASSERT_EQUAL(0, rc);
+
+         memset(completions, 0, sizeof(completions));
+         for (int p = 0; p < TEST_EMPTY_FILTER_NUM_ASYNC; p++) {
+            probe_ids[p] = (num_inserted - 1) * p / TEST_EMPTY_FILTER_NUM_ASYNC;
+            snprintf(
+               probe_keys[p], sizeof(probe_keys[p]), "ek-%08d", probe_ids[p]);
+            splinterdb_lookup_result_init(data->kvsb, &results[p], 0, NULL);
+            rc = splinterdb_lookup_async(
+               handle,
+               slice_create(strlen(probe_keys[p]), probe_keys[p]),
+               &results[p],
+               lookup_async_count_cb,
+               &completions[p]);
+            ASSERT_EQUAL(0, rc);
+         }
+         splinterdb_lookup_async_wait(handle);
+
+         for (int p = 0; p < TEST_EMPTY_FILTER_NUM_ASYNC; p++) {
+            ASSERT_EQUAL(1, completions[p]);
+            ASSERT_TRUE(splinterdb_lookup_found(&results[p]),
+                        "round %d, i=%d, probe %d",
+                        round,
+                        i,
+                        probe_ids[p]);
+            snprintf(val_buf, sizeof(val_buf), "ev-%08d", probe_ids[p]);
+            slice value;
+            rc = splinterdb_lookup_result_value(&results[p], &value);
+            ASSERT_EQUAL(0, rc);
+            ASSERT_EQUAL(strlen(val_buf), slice_length(value));
+            ASSERT_STREQN(val_buf, slice_data(value), slice_length(value));
+            splinterdb_lookup_result_deinit(&results[p]);
+         }
+      }
+   }
+   splinterdb_lookup_async_handle_destroy(handle);
 }
 
 /*
- * Helper function to insert n-keys (num_inserts), using pre-formatted
- * key and value strings. Allows user to specify start value and increment
- * between keys. This can be used to load either fully sequential keys
- * or some with defined gaps.
- *
- * Parameters:
- *  kvsb    - SplinterDB handle
- *  minkey  - Start key to insert
- *  numkeys - # of keys to insert
- *  incr    - Increment between keys (default is 1)
- *
- * Returns: Return code: rc == 0 => success; anything else => failure
+ * Like test_lookup_async_with_empty_filters, but update each scattered key
+ * shortly after inserting it. Updates are not definitive, so lookups of
+ * updated keys go on past their first matching branch, through subbundles
+ * whose branches wrap around the end of the node's branch array. Updated
+ * keys must have a ref count of 2, and sequential keys of 1.
  */
-static int
-insert_keys(splinterdb *kvsb, const int minkey, int numkeys, const int incr)
+CTEST2(splinterdb_quick, test_lookup_async_with_updates)
 {
-   int rc = -1;
+   splinterdb_close(&data->kvsb);
+   data->cfg.data_cfg              = test_data_config;
+   data->cfg.memtable_capacity     = KiB_TO_B(128);
+   data->cfg.disk_size             = 1024 * Mega;
+   data->cfg.fanout                = 4;
+   data->cfg.max_branches_per_node = 4;
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
 
-   // Minimally, error check input arguments
-   if (!kvsb || (numkeys <= 0) || (incr < 0))
-      return rc;
+#define TEST_UPDATES_NUM_ASYNC 8
+   splinterdb_lookup_async_handle *handle = NULL;
+   rc = splinterdb_lookup_async_handle_create(
+      data->kvsb, TEST_UPDATES_NUM_ASYNC, &handle);
+   ASSERT_EQUAL(0, rc);
+
+   const int   num_rounds    = 8;
+   const int   num_seq       = 10000;
+   const int   num_scattered = 1000;
+   const int   update_lag    = 200;
+   int         num_inserted  = 0;
+   char        key_buf[TEST_MAX_KEY_SIZE + 1];
+   data_handle msg       = {.ref_count = 1};
+   slice       msg_slice = slice_create(sizeof(msg), &msg);
+   char        probe_keys[TEST_UPDATES_NUM_ASYNC][TEST_MAX_KEY_SIZE + 1];
+   int         expected_ref_counts[TEST_UPDATES_NUM_ASYNC];
+   splinterdb_lookup_result results[TEST_UPDATES_NUM_ASYNC];
+   int                      completions[TEST_UPDATES_NUM_ASYNC];
+
+   for (int round = 0; round < num_rounds; round++) {
+      // scattered keys of this round fall between all sequential ones
+      int range = num_inserted + num_seq;
+      for (int i = 0; i < num_seq + num_scattered; i++) {
+         if (i < num_seq) {
+            snprintf(key_buf, sizeof(key_buf), "ek-%08d", num_inserted);
+            num_inserted++;
+         } else {
+            int k = (i - num_seq) * 7919 % range;
+            snprintf(key_buf, sizeof(key_buf), "ek-%08d.%d", k, round);
+         }
+         rc = splinterdb_insert(
+            data->kvsb, slice_create(strlen(key_buf), key_buf), msg_slice);
+         ASSERT_EQUAL(0, rc);
+
+         int num_updated = i - num_seq - update_lag + 1;
+         if (num_updated > 0) {
+            int k = (num_updated - 1) * 7919 % range;
+            snprintf(key_buf, sizeof(key_buf), "ek-%08d.%d", k, round);
+            rc = splinterdb_update(
+               data->kvsb, slice_create(strlen(key_buf), key_buf), msg_slice);
+            ASSERT_EQUAL(0, rc);
+         }
+
+         memset(completions, 0, sizeof(completions));
+         for (int p = 0; p < TEST_UPDATES_NUM_ASYNC; p++) {
+            if (p % 2 == 0 || num_updated <= 0) {
+               int k = (num_inserted - 1) * p / TEST_UPDATES_NUM_ASYNC;
+               snprintf(probe_keys[p], sizeof(probe_keys[p]), "ek-%08d", k);
+               expected_ref_counts[p] = 1;
+            } else {
+               int u = (num_updated - 1) * p / TEST_UPDATES_NUM_ASYNC;
+               int k = u * 7919 % range;
+               snprintf(
+                  probe_keys[p], sizeof(probe_keys[p]), "ek-%08d.%d", k, round);
+               expected_ref_counts[p] = 2;
+            }
+            splinterdb_lookup_result_init(data->kvsb, &results[p], 0, NULL);
+            rc = splinterdb_lookup_async(
+               handle,
+               slice_create(strlen(probe_keys[p]), probe_keys[p]),
+               &results[p],
+               lookup_async_count_cb,
+               &completions[p]);
+            ASSERT_EQUAL(0, rc);
+         }
+         splinterdb_lookup_async_wait(handle);
+
+         for (int p = 0; p < TEST_UPDATES_NUM_ASYNC; p++) {
+            ASSERT_EQUAL(1, completions[p]);
+            ASSERT_TRUE(splinterdb_lookup_found(&results[p]),
+                        "round %d, i=%d, key %s",
+                        round,
+                        i,
+                        probe_keys[p]);
+            slice value;
+            rc = splinterdb_lookup_result_value(&results[p], &value);
+            ASSERT_EQUAL(0, rc);
+            const data_handle *found = slice_data(value);
+            ASSERT_EQUAL(expected_ref_counts[p],
+                         found->ref_count,
+                         "round %d, i=%d, key %s",
+                         round,
+                         i,
+                         probe_keys[p]);
+            splinterdb_lookup_result_deinit(&results[p]);
+         }
+      }
+   }
+   splinterdb_lookup_async_handle_destroy(handle);
+}
 
-   // insert keys forwards, starting from minkey value
-   for (int kctr = minkey; numkeys; kctr += incr, numkeys--) {
-      char key[TEST_INSERT_KEY_LENGTH] = {0};
-      char val[TEST_INSERT_VAL_LENGTH] = {0};
+/*
+ * Test splinterdb_sync() and splinterdb_insert_sync(): sync requires the log,
+ * and synced inserts remain visible to lookups.
+ */
+CTEST2(splinterdb_quick, test_insert_sync)
+{
+   int rc = splinterdb_sync(data->kvsb);
+   ASSERT_EQUAL(EINVAL, rc);
 
-      snprintf(key, sizeof(key), key_fmt, kctr);
-      snprintf(val, sizeof(val), val_fmt, kctr);
+   splinterdb_close(&data->kvsb);
+   data->cfg.use_log                    = TRUE;
+   data->cfg.log_group_commit_window_us = 10;
+   rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+
+   const int num_inserts = 2000;
+   char      key_buf[TEST_MAX_KEY_SIZE + 1];
+   char      val_buf[TEST_MAX_VALUE_SIZE];
+
+   for (int i = 0; i < num_inserts; i++) {
+      snprintf(key_buf, sizeof(key_buf), "skey-%08d", i);
+      snprintf(val_buf, sizeof(val_buf), "sval-%08d", i);
+      slice key   = slice_create(strlen(key_buf), key_buf);
+      slice value = slice_create(strlen(val_buf), val_buf);
+      if (i % 10 == 0) {
+         rc = splinterdb_insert_sync(data->kvsb, key, value);
+      } else {
+         rc = splinterdb_insert(data->kvsb, key, value);
+      }
+      ASSERT_EQUAL(0, rc);
+   }
+   rc = splinterdb_sync(data->kvsb);
+   ASSERT_EQUAL(0, rc);
 
-      rc = splinterdb_insert(
-         kvsb, slice_create(sizeof(key), key), slice_create(sizeof(val), val));
+   splinterdb_lookup_result result;
+   splinterdb_lookup_result_init(data->kvsb, &result, 0, NULL);
+   for (int i = 0; i < num_inserts; i++) {
+      snprintf(key_buf, sizeof(key_buf), "skey-%08d", i);
+      snprintf(val_buf, sizeof(val_buf), "sval-%08d", i);
+      rc = splinterdb_lookup(
+         data->kvsb, slice_create(strlen(key_buf), key_buf), &result);
+      ASSERT_EQUAL(0, rc);
+      ASSERT_TRUE(splinterdb_lookup_found(&result));
+      slice value;
+      rc = splinterdb_lookup_result_value(&result, &value);
       ASSERT_EQUAL(0, rc);
+      ASSERT_EQUAL(strlen(val_buf), slice_length(value));
+      ASSERT_STREQN(val_buf, slice_data(value), slice_length(value));
    }
-   return rc;
+   splinterdb_lookup_result_deinit(&result);
 }
 
 /*
- * Work horse routine to check if the current tuple pointed to by the
- * iterator is the expected one, as indicated by its index,
- * expected_i. We use pre-constructed key / value formats to verify
- * if the current tuple is of the expected format.
- *
- * Returns: Return code: rc == 0 => success; anything else => failure
+ * Same data round-trip through the device as with libaio, using the io_uring
+ * engine. Where io_uring is unavailable, the engine falls back to libaio, so
+ * there is nothing to test.
  */
-static int
-check_current_tuple(splinterdb_iterator *it, const int expected_i)
+CTEST2(splinterdb_quick, test_io_uring)
 {
-   int rc = 0;
+   splinterdb_stats stats;
+   splinterdb_stats_get(data->kvsb, &stats);
+   ASSERT_FALSE(stats.io_uring);
+   if (!io_uring_available()) {
+      CTEST_LOG("io_uring is unavailable, skipping test_io_uring.\n");
+      return;
+   }
 
-   char expected_key[TEST_INSERT_KEY_LENGTH] = {0};
-   char expected_val[TEST_INSERT_VAL_LENGTH] = {0};
-   ASSERT_EQUAL(
-      KEY_FMT_LENGTH,
-      snprintf(expected_key, sizeof(expected_key), key_fmt, expected_i));
-   ASSERT_EQUAL(
-      VAL_FMT_LENGTH,
-      snprintf(expected_val, sizeof(expected_val), val_fmt, expected_i));
+   splinterdb_close(&data->kvsb);
+   data->cfg.io_use_uring      = TRUE;
+   data->cfg.memtable_capacity = MiB_TO_B(1);
+   int rc                      = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   splinterdb_stats_get(data->kvsb, &stats);
+   ASSERT_TRUE(stats.io_uring);
+
+   const int num_inserts = 20000;
+   char      key_buf[TEST_MAX_KEY_SIZE + 1];
+   char      val_buf[TEST_MAX_VALUE_SIZE];
+
+   for (int i = 0; i < num_inserts; i++) {
+      snprintf(key_buf, sizeof(key_buf), "ukey-%08d", i);
+      snprintf(val_buf, sizeof(val_buf), "uval-%08d", i);
+      rc = splinterdb_insert(data->kvsb,
+                             slice_create(strlen(key_buf), key_buf),
+                             slice_create(strlen(val_buf), val_buf));
+      ASSERT_EQUAL(0, rc);
+   }
 
-   slice key, value;
+   // Reopen with a cold cache, so that lookups read back from the device
+   splinterdb_close(&data->kvsb);
+   rc = splinterdb_open(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   splinterdb_stats_get(data->kvsb, &stats);
+   ASSERT_TRUE(stats.io_uring);
+
+   // Async lookups go through the engine's async read path
+   splinterdb_lookup_async_handle *handle = NULL;
+   rc = splinterdb_lookup_async_handle_create(data->kvsb, 8, &handle);
+   ASSERT_EQUAL(0, rc);
+   splinterdb_lookup_result results[TEST_ASYNC_NUM_LOOKUPS];
+   int                      completions[TEST_ASYNC_NUM_LOOKUPS];
+   static char              keys[TEST_ASYNC_NUM_LOOKUPS][TEST_MAX_KEY_SIZE];
+   memset(completions, 0, sizeof(completions));
+   for (int i = 0; i < TEST_ASYNC_NUM_LOOKUPS; i++) {
+      int k = i * (num_inserts / TEST_ASYNC_NUM_LOOKUPS);
+      snprintf(key_buf, sizeof(key_buf), "ukey-%08d", k);
+      memcpy(keys[i], key_buf, strlen(key_buf));
+      splinterdb_lookup_result_init(data->kvsb, &results[i], 0, NULL);
+      do {
+         rc = splinterdb_lookup_async(handle,
+                                      slice_create(strlen(key_buf), keys[i]),
+                                      &results[i],
+                                      lookup_async_count_cb,
+                                      &completions[i]);
+         if (rc == EAGAIN) {
+            splinterdb_lookup_async_poll(handle);
+         }
+      } while (rc == EAGAIN);
+      ASSERT_EQUAL(0, rc);
+   }
+   splinterdb_lookup_async_wait(handle);
+   splinterdb_lookup_async_handle_destroy(handle);
+   for (int i = 0; i < TEST_ASYNC_NUM_LOOKUPS; i++) {
+      ASSERT_EQUAL(1, completions[i], "i=%d", i);
+      ASSERT_TRUE(splinterdb_lookup_found(&results[i]), "i=%d", i);
+      splinterdb_lookup_result_deinit(&results[i]);
+   }
 
-   splinterdb_iterator_get_current(it, &key, &value);
+   splinterdb_lookup_result result;
+   splinterdb_lookup_result_init(data->kvsb, &result, 0, NULL);
+   for (int i = 0; i < num_inserts; i++) {
+      snprintf(key_buf, sizeof(key_buf), "ukey-%08d", i);
+      snprintf(val_buf, sizeof(val_buf), "uval-%08d", i);
+      rc = splinterdb_lookup(
+         data->kvsb, slice_create(strlen(key_buf), key_buf), &result);
+      ASSERT_EQUAL(0, rc);
+      ASSERT_TRUE(splinterdb_lookup_found(&result), "i=%d", i);
+      slice value;
+      rc = splinterdb_lookup_result_value(&result, &value);
+      ASSERT_EQUAL(0, rc);
+      ASSERT_EQUAL(strlen(val_buf), slice_length(value));
+      ASSERT_STREQN(val_buf, slice_data(value), slice_length(value));
+   }
+   splinterdb_lookup_result_deinit(&result);
+}
 
-   ASSERT_EQUAL(TEST_INSERT_KEY_LENGTH, slice_length(key));
-   ASSERT_EQUAL(TEST_INSERT_VAL_LENGTH, slice_length(value));
+/*
+ * Inserts across many small memtables, faster than the background threads
+ * compact them, so that the write throttle comes into play, first with it
+ * enabled (the default) and then disabled. Only the first round may delay
+ * inserts, and all data must remain visible either way.
+ */
+CTEST2(splinterdb_quick, test_write_throttle)
+{
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_capacity         = MiB_TO_B(1);
+   data->cfg.use_stats                 = TRUE;
+   data->cfg.num_memtable_bg_threads   = 1;
+   data->cfg.num_normal_bg_threads     = 1;
+   data->cfg.write_throttle_soft_tasks = 1;
+   data->cfg.write_throttle_hard_tasks = 4;
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
 
-   int key_cmp = memcmp(expected_key, slice_data(key), slice_length(key));
-   int val_cmp = memcmp(expected_val, slice_data(value), slice_length(value));
-   ASSERT_EQUAL(0, key_cmp);
-   ASSERT_EQUAL(0, val_cmp);
+   const int num_inserts = 400000;
+   char      key_buf[TEST_MAX_KEY_SIZE + 1];
+   char      val_buf[TEST_MAX_VALUE_SIZE];
+
+   for (int round = 0; round < 2; round++) {
+      if (round == 1) {
+         splinterdb_close(&data->kvsb);
+         data->cfg.disable_write_throttle = TRUE;
+         rc = splinterdb_open(&data->cfg, &data->kvsb);
+         ASSERT_EQUAL(0, rc);
+      }
+      for (int i = 0; i < num_inserts; i++) {
+         snprintf(key_buf, sizeof(key_buf), "tk%d-%08d", round, i);
+         snprintf(val_buf, sizeof(val_buf), "tval-%d-%08d", round, i);
+         rc = splinterdb_insert(data->kvsb,
+                                slice_create(strlen(key_buf), key_buf),
+                                slice_create(strlen(val_buf), val_buf));
+         ASSERT_EQUAL(0, rc);
+      }
+
+      // The stats start over when the database is reopened
+      splinterdb_stats stats;
+      splinterdb_stats_get(data->kvsb, &stats);
+      if (round == 0) {
+         ASSERT_NOT_EQUAL(0, stats.throttled_inserts);
+         ASSERT_NOT_EQUAL(0, stats.throttle_wait_ns);
+      } else {
+         ASSERT_EQUAL(0, stats.throttled_inserts);
+         ASSERT_EQUAL(0, stats.throttle_wait_ns);
+      }
+   }
 
-   return rc;
+   splinterdb_lookup_result result;
+   splinterdb_lookup_result_init(data->kvsb, &result, 0, NULL);
+   for (int round = 0; round < 2; round++) {
+      for (int i = 0; i < num_inserts; i += 7) {
+         snprintf(key_buf, sizeof(key_buf), "tk%d-%08d", round, i);
+         snprintf(val_buf, sizeof(val_buf), "tval-%d-%08d", round, i);
+         rc = splinterdb_lookup(
+            data->kvsb, slice_create(strlen(key_buf), key_buf), &result);
+         ASSERT_EQUAL(0, rc);
+         ASSERT_TRUE(splinterdb_lookup_found(&result), "i=%d", i);
+         slice value;
+         rc = splinterdb_lookup_result_value(&result, &value);
+         ASSERT_EQUAL(0, rc);
+         ASSERT_EQUAL(strlen(val_buf), slice_length(value));
+         ASSERT_STREQN(val_buf, slice_data(value), slice_length(value));
+      }
+   }
+   splinterdb_lookup_result_deinit(&result);
 }
 
-// A user-specified spy comparator
-static int
-custom_key_comparator(const data_config *cfg, slice key1, slice key2)
+/*
+ * Exercise the skiplist memtable backend: overwrites and deletes of keys in
+ * the same and in older memtables, lookups, and an iterator across several
+ * memtables and the trunk.
+ */
+CTEST2(splinterdb_quick, test_skiplist_memtable)
 {
-   platform_assert(slice_data(key1) != NULL);
-   platform_assert(slice_data(key2) != NULL);
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_use_skiplist = TRUE;
+   data->cfg.memtable_capacity     = MiB_TO_B(1);
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
 
-   int r = slice_lex_cmp(key1, key2);
+   check_memtable_overwrites_and_deletes(data->kvsb);
+}
 
-   // record that this spy was called
-   comparison_counting_data_config *ccfg =
-      (comparison_counting_data_config *)cfg;
-   ccfg->num_comparisons += 1;
-   return r;
+/*
+ * Sharded memtables, of both types: each shard is rotated, compacted and
+ * incorporated along with the others, and lookups and iterators must see
+ * the keys of all the shards.
+ */
+CTEST2(splinterdb_quick, test_sharded_btree_memtable)
+{
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_num_shards = 4;
+   data->cfg.memtable_capacity   = MiB_TO_B(1);
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+
+   check_memtable_overwrites_and_deletes(data->kvsb);
+}
+
+CTEST2(splinterdb_quick, test_sharded_skiplist_memtable)
+{
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_use_skiplist = TRUE;
+   data->cfg.memtable_num_shards   = 7;
+   data->cfg.memtable_capacity     = MiB_TO_B(1);
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+
+   check_memtable_overwrites_and_deletes(data->kvsb);
+}
+
+CTEST2(splinterdb_quick, test_too_many_memtable_shards)
+{
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_num_shards = 17;
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_NOT_EQUAL(0, rc);
+
+   // Re-open for the teardown
+   data->cfg.memtable_num_shards = 0;
+   rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+}
+
+/*
+ * Range deletes over keys in the memtables and the trunk: the deleted keys
+ * must stay deleted, and keys re-inserted after the delete must be visible,
+ * through lookups, iterators, later compactions and a close and reopen.
+ */
+CTEST2(splinterdb_quick, test_delete_range)
+{
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_capacity = MiB_TO_B(1);
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+
+   const int num_keys = 30000;
+   char      key_buf[TEST_MAX_KEY_SIZE + 1];
+   char      end_buf[TEST_MAX_KEY_SIZE + 1];
+   char      val_buf[TEST_MAX_VALUE_SIZE];
+   for (int i = 0; i < num_keys; i++) {
+      snprintf(key_buf, sizeof(key_buf), "rk%08d", i);
+      snprintf(val_buf, sizeof(val_buf), "rval-%08d", i);
+      rc = splinterdb_insert(data->kvsb,
+                             slice_create(strlen(key_buf), key_buf),
+                             slice_create(strlen(val_buf), val_buf));
+      ASSERT_EQUAL(0, rc);
+   }
+
+   // Delete [rk00010000, rk00020000) and everything below rk00005000
+   snprintf(key_buf, sizeof(key_buf), "rk%08d", 10000);
+   snprintf(end_buf, sizeof(end_buf), "rk%08d", 20000);
+   rc = splinterdb_delete_range(data->kvsb,
+                                slice_create(strlen(key_buf), key_buf),
+                                slice_create(strlen(end_buf), end_buf));
+   ASSERT_EQUAL(0, rc);
+   snprintf(end_buf, sizeof(end_buf), "rk%08d", 5000);
+   rc = splinterdb_delete_range(
+      data->kvsb, NULL_SLICE, slice_create(strlen(end_buf), end_buf));
+   ASSERT_EQUAL(0, rc);
+
+   // An empty range deletes nothing
+   rc = splinterdb_delete_range(data->kvsb,
+                                slice_create(strlen(end_buf), end_buf),
+                                slice_create(strlen(end_buf), end_buf));
+   ASSERT_EQUAL(0, rc);
+
+   // Re-insert one of the deleted keys
+   snprintf(key_buf, sizeof(key_buf), "rk%08d", 15000);
+   snprintf(val_buf, sizeof(val_buf), "new-%08d", 15000);
+   rc = splinterdb_insert(data->kvsb,
+                          slice_create(strlen(key_buf), key_buf),
+                          slice_create(strlen(val_buf), val_buf));
+   ASSERT_EQUAL(0, rc);
+
+   check_range_deleted_keys(data->kvsb, num_keys);
+
+   // Push the deleted data through compactions with more inserts, enough
+   // for the tombstones to be left with nothing to delete and retired
+   for (int i = num_keys; i < 10 * num_keys; i++) {
+      snprintf(key_buf, sizeof(key_buf), "rk%08d", i);
+      snprintf(val_buf, sizeof(val_buf), "rval-%08d", i);
+      rc = splinterdb_insert(data->kvsb,
+                             slice_create(strlen(key_buf), key_buf),
+                             slice_create(strlen(val_buf), val_buf));
+      ASSERT_EQUAL(0, rc);
+   }
+   check_range_deleted_keys(data->kvsb, 10 * num_keys);
+
+   splinterdb_close(&data->kvsb);
+   rc = splinterdb_open(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   check_range_deleted_keys(data->kvsb, 10 * num_keys);
+}
+
+/*
+ * Bulk loads keys "bk%08d" into a fresh database, then checks that they are
+ * found, that later writes and range deletes shadow them, and that they
+ * survive compactions and a reopen. A small memtable and fanout give the
+ * loaded trunk a few levels of index nodes.
+ */
+CTEST2(splinterdb_quick, test_bulk_load)
+{
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_capacity = MiB_TO_B(1);
+   data->cfg.fanout            = 4;
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+
+   // Out of order keys load nothing
+   const int           num_keys = 400000;
+   bulk_load_generator gen      = {.num_keys = num_keys, .swap_at = 150000};
+   rc = splinterdb_bulk_load(data->kvsb, bulk_load_next, &gen);
+   ASSERT_EQUAL(EINVAL, rc);
+   splinterdb_iterator *it = NULL;
+   rc = splinterdb_iterator_init(data->kvsb, &it, NULL_SLICE);
+   ASSERT_EQUAL(0, rc);
+   ASSERT_FALSE(splinterdb_iterator_valid(it));
+   splinterdb_iterator_deinit(it);
+
+   gen = (bulk_load_generator){.num_keys = num_keys, .swap_at = -1};
+   rc  = splinterdb_bulk_load(data->kvsb, bulk_load_next, &gen);
+   ASSERT_EQUAL(0, rc);
+   check_bulk_loaded_keys(data->kvsb, num_keys, 0);
+
+   // Only an empty database can be bulk loaded
+   gen = (bulk_load_generator){.num_keys = num_keys, .swap_at = -1};
+   rc  = splinterdb_bulk_load(data->kvsb, bulk_load_next, &gen);
+   ASSERT_EQUAL(EINVAL, rc);
+
+   // Overwrite every 10th key, delete [bk00100000, bk00110000)
+   char key_buf[TEST_MAX_KEY_SIZE + 1];
+   char end_buf[TEST_MAX_KEY_SIZE + 1];
+   char val_buf[TEST_MAX_VALUE_SIZE];
+   for (int i = 0; i < num_keys; i += 10) {
+      snprintf(key_buf, sizeof(key_buf), "bk%08d", i);
+      snprintf(val_buf, sizeof(val_buf), "new-%08d", i);
+      rc = splinterdb_insert(data->kvsb,
+                             slice_create(strlen(key_buf), key_buf),
+                             slice_create(strlen(val_buf), val_buf));
+      ASSERT_EQUAL(0, rc);
+   }
+   snprintf(key_buf, sizeof(key_buf), "bk%08d", 100000);
+   snprintf(end_buf, sizeof(end_buf), "bk%08d", 110000);
+   rc = splinterdb_delete_range(data->kvsb,
+                                slice_create(strlen(key_buf), key_buf),
+                                slice_create(strlen(end_buf), end_buf));
+   ASSERT_EQUAL(0, rc);
+   check_bulk_loaded_keys(data->kvsb, num_keys, 10);
+
+   splinterdb_close(&data->kvsb);
+   rc = splinterdb_open(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   check_bulk_loaded_keys(data->kvsb, num_keys, 10);
+}
+
+/*
+ * Bulk loads disjoint runs of keys in parallel. Runs which are out of order
+ * load nothing, empty runs are allowed.
+ */
+CTEST2(splinterdb_quick, test_bulk_load_runs)
+{
+#define NUM_BULK_LOAD_RUNS 8
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_capacity = MiB_TO_B(1);
+   data->cfg.fanout            = 4;
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+
+   const int           num_runs     = NUM_BULK_LOAD_RUNS;
+   const int           keys_per_run = 50000;
+   bulk_load_generator gen[NUM_BULK_LOAD_RUNS];
+   void               *run_args[NUM_BULK_LOAD_RUNS];
+   for (int run_no = 0; run_no < num_runs; run_no++) {
+      gen[run_no] = (bulk_load_generator){.start    = run_no * keys_per_run,
+                                          .num_keys = keys_per_run,
+                                          .swap_at  = -1};
+      run_args[run_no] = &gen[run_no];
+   }
+
+   // The first key of run 5 is the last key of run 4
+   gen[5].start--;
+   rc = splinterdb_bulk_load_runs(
+      data->kvsb, num_runs, bulk_load_next, run_args);
+   ASSERT_EQUAL(EINVAL, rc);
+   splinterdb_iterator *it = NULL;
+   rc = splinterdb_iterator_init(data->kvsb, &it, NULL_SLICE);
+   ASSERT_EQUAL(0, rc);
+   ASSERT_FALSE(splinterdb_iterator_valid(it));
+   splinterdb_iterator_deinit(it);
+
+   // Run 3 is empty and run 4 makes up for it
+   for (int run_no = 0; run_no < num_runs; run_no++) {
+      gen[run_no].next = 0;
+   }
+   gen[5].start++;
+   gen[3].num_keys = 0;
+   gen[4].start    = 3 * keys_per_run;
+   gen[4].num_keys = 2 * keys_per_run;
+   rc              = splinterdb_bulk_load_runs(
+      data->kvsb, num_runs, bulk_load_next, run_args);
+   ASSERT_EQUAL(0, rc);
+   check_bulk_loaded_keys(data->kvsb, num_runs * keys_per_run, 0);
+
+   splinterdb_close(&data->kvsb);
+   rc = splinterdb_open(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   check_bulk_loaded_keys(data->kvsb, num_runs * keys_per_run, 0);
+}
+
+/*
+ * A snapshot keeps seeing the data as of its creation while the keys are
+ * overwritten, deleted and range deleted, and new keys are added, even once
+ * the old versions have been compacted away.
+ */
+CTEST2(splinterdb_quick, test_snapshot)
+{
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_capacity = MiB_TO_B(1);
+   data->cfg.fanout            = 4;
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+
+   // A snapshot of an empty database stays empty
+   splinterdb_snapshot *empty = NULL;
+   rc = splinterdb_snapshot_create(data->kvsb, &empty);
+   ASSERT_EQUAL(0, rc);
+
+   const int num_keys = 100000;
+   char      key_buf[TEST_MAX_KEY_SIZE + 1];
+   char      end_buf[TEST_MAX_KEY_SIZE + 1];
+   char      val_buf[TEST_MAX_VALUE_SIZE];
+   for (int i = 0; i < num_keys; i++) {
+      snprintf(key_buf, sizeof(key_buf), "sn%08d", i);
+      snprintf(val_buf, sizeof(val_buf), "old-%08d", i);
+      rc = splinterdb_insert(data->kvsb,
+                             slice_create(strlen(key_buf), key_buf),
+                             slice_create(strlen(val_buf), val_buf));
+      ASSERT_EQUAL(0, rc);
+   }
+
+   splinterdb_snapshot *snapshot = NULL;
+   rc = splinterdb_snapshot_create(data->kvsb, &snapshot);
+   ASSERT_EQUAL(0, rc);
+   check_snapshot_keys(data->kvsb, snapshot, num_keys, "old-%08d");
+
+   // Overwrite every key twice, then delete every 3rd key and a range
+   for (int round = 0; round < 2; round++) {
+      for (int i = 0; i < num_keys + 1000; i++) {
+         snprintf(key_buf, sizeof(key_buf), "sn%08d", i);
+         snprintf(val_buf, sizeof(val_buf), "new-%08d", i);
+         rc = splinterdb_insert(data->kvsb,
+                                slice_create(strlen(key_buf), key_buf),
+                                slice_create(strlen(val_buf), val_buf));
+         ASSERT_EQUAL(0, rc);
+      }
+   }
+   for (int i = 0; i < num_keys; i += 3) {
+      snprintf(key_buf, sizeof(key_buf), "sn%08d", i);
+      rc = splinterdb_delete(data->kvsb,
+                             slice_create(strlen(key_buf), key_buf));
+      ASSERT_EQUAL(0, rc);
+   }
+   snprintf(key_buf, sizeof(key_buf), "sn%08d", 20000);
+   snprintf(end_buf, sizeof(end_buf), "sn%08d", 30000);
+   rc = splinterdb_delete_range(data->kvsb,
+                                slice_create(strlen(key_buf), key_buf),
+                                slice_create(strlen(end_buf), end_buf));
+   ASSERT_EQUAL(0, rc);
+
+   check_snapshot_keys(data->kvsb, snapshot, num_keys, "old-%08d");
+   check_snapshot_keys(data->kvsb, empty, 0, "old-%08d");
+
+   // The current data is unaffected by the snapshot
+   splinterdb_snapshot *current = NULL;
+   rc = splinterdb_snapshot_create(data->kvsb, &current);
+   ASSERT_EQUAL(0, rc);
+   splinterdb_lookup_result result;
+   splinterdb_lookup_result_init(data->kvsb, &result, 0, NULL);
+   for (int i = 0; i < num_keys + 1000; i += 7) {
+      bool deleted = i < num_keys && (i % 3 == 0 || (20000 <= i && i < 30000));
+      snprintf(key_buf, sizeof(key_buf), "sn%08d", i);
+      slice target = slice_create(strlen(key_buf), key_buf);
+      rc           = splinterdb_lookup(data->kvsb, target, &result);
+      ASSERT_EQUAL(0, rc);
+      ASSERT_EQUAL(!deleted, splinterdb_lookup_found(&result), "i=%d", i);
+      rc = splinterdb_snapshot_lookup(current, target, &result);
+      ASSERT_EQUAL(0, rc);
+      ASSERT_EQUAL(!deleted, splinterdb_lookup_found(&result), "i=%d", i);
+   }
+   splinterdb_lookup_result_deinit(&result);
+
+   splinterdb_snapshot_release(current);
+   splinterdb_snapshot_release(snapshot);
+   splinterdb_snapshot_release(empty);
+
+   splinterdb_close(&data->kvsb);
+   rc = splinterdb_open(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+}
+
+/*
+ * Seeks one iterator back and forth over keys spread across several trunk
+ * leaves and the memtable, with point and range deletes, then walks it
+ * backwards from the last key to the first with prev. Live and snapshot
+ * iterators behave the same.
+ */
+CTEST2(splinterdb_quick, test_iterator_seek_and_prev)
+{
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_capacity = MiB_TO_B(1);
+   data->cfg.fanout            = 4;
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   insert_seek_test_keys(data->kvsb);
+
+   splinterdb_iterator *it = NULL;
+   rc = splinterdb_iterator_init(data->kvsb, &it, NULL_SLICE);
+   ASSERT_EQUAL(0, rc);
+   check_seek_and_prev(it);
+   splinterdb_iterator_deinit(it);
+
+   splinterdb_snapshot *snapshot = NULL;
+   rc = splinterdb_snapshot_create(data->kvsb, &snapshot);
+   ASSERT_EQUAL(0, rc);
+   rc = splinterdb_snapshot_iterator_init(snapshot, &it, NULL_SLICE);
+   ASSERT_EQUAL(0, rc);
+   check_seek_and_prev(it);
+   splinterdb_iterator_deinit(it);
+   splinterdb_snapshot_release(snapshot);
+}
+
+/*
+ * Reverse iterators over the keys of test_iterator_seek_and_prev, with
+ * btree and sharded skiplist memtables: full descending scans, scans
+ * starting below given keys, and reverse seeks.
+ */
+CTEST2(splinterdb_quick, test_reverse_iterator)
+{
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_capacity = MiB_TO_B(1);
+   data->cfg.fanout            = 4;
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   insert_seek_test_keys(data->kvsb);
+   check_reverse_iterator(data->kvsb);
+}
+
+CTEST2(splinterdb_quick, test_reverse_iterator_sharded_skiplist)
+{
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_capacity     = MiB_TO_B(1);
+   data->cfg.memtable_use_skiplist = TRUE;
+   data->cfg.memtable_num_shards   = 3;
+   data->cfg.fanout                = 4;
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   insert_seek_test_keys(data->kvsb);
+   check_reverse_iterator(data->kvsb);
+}
+
+/*
+ * Prefix iterators with a fixed-length prefix extractor, over groups of keys
+ * sharing a prefix, each written at once so that most branches hold few
+ * prefixes: every group scans exactly its live keys, before and after
+ * reopening, and seeks stay within the prefix.
+ */
+CTEST2(splinterdb_quick, test_prefix_iterator)
+{
+   splinterdb_close(&data->kvsb);
+   data->default_data_cfg.super.key_prefix_length = fixed_key_prefix_length;
+   data->cfg.memtable_capacity                    = MiB_TO_B(1);
+   data->cfg.fanout                               = 4;
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   insert_prefix_test_keys(data->kvsb);
+
+   for (int g = 0; g <= PREFIX_TEST_NUM_GROUPS; g += 3) {
+      check_prefix_iterator(data->kvsb, g);
+   }
+
+   // prefix must be its own prefix
+   splinterdb_iterator *it = NULL;
+
+   rc = splinterdb_iterator_init_prefix(
+      data->kvsb, &it, slice_create(strlen("pf001-"), "pf001-"));
+   ASSERT_NOT_EQUAL(0, rc);
+
+   // a shorter prefix only has itself
+   rc = splinterdb_iterator_init_prefix(
+      data->kvsb, &it, slice_create(strlen("pf"), "pf"));
+   ASSERT_EQUAL(0, rc);
+   ASSERT_FALSE(splinterdb_iterator_valid(it));
+   ASSERT_EQUAL(0, splinterdb_iterator_status(it));
+   splinterdb_iterator_deinit(it);
+
+   splinterdb_close(&data->kvsb);
+   rc = splinterdb_open(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   for (int g = 1; g < PREFIX_TEST_NUM_GROUPS; g += 7) {
+      check_prefix_iterator(data->kvsb, g);
+   }
+}
+
+/*
+ * A child process opens a cleanly closed database, makes (and syncs) inserts,
+ * overwrites and deletes spanning several memtables, and exits without
+ * closing it. Reopening must recover all of them by replaying the log, on
+ * several threads, and the recovered database must survive a close and
+ * reopen.
+ */
+CTEST2(splinterdb_quick, test_crash_recovery)
+{
+   splinterdb_close(&data->kvsb);
+   data->cfg.use_log           = TRUE;
+   data->cfg.memtable_capacity = MiB_TO_B(1);
+   int rc                      = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+
+   char key_buf[TEST_MAX_KEY_SIZE + 1];
+   char val_buf[TEST_MAX_VALUE_SIZE];
+   for (int i = 0; i < CRASH_TEST_NUM_KEYS; i++) {
+      snprintf(key_buf, sizeof(key_buf), "ck%08d", i);
+      snprintf(val_buf, sizeof(val_buf), "old-%08d", i);
+      rc = splinterdb_insert(data->kvsb,
+                             slice_create(strlen(key_buf), key_buf),
+                             slice_create(strlen(val_buf), val_buf));
+      ASSERT_EQUAL(0, rc);
+   }
+   splinterdb_close(&data->kvsb);
+
+   pid_t pid = fork();
+   ASSERT_TRUE(pid >= 0);
+   if (pid == 0) {
+      _exit(crash_recovery_child(&data->cfg));
+   }
+   int status;
+   ASSERT_EQUAL(pid, waitpid(pid, &status, 0));
+   ASSERT_TRUE(WIFEXITED(status));
+   ASSERT_EQUAL(0, WEXITSTATUS(status));
+
+   data->cfg.log_replay_threads = 4;
+   rc = splinterdb_open(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   check_crash_recovered_keys(data->kvsb);
+
+   splinterdb_close(&data->kvsb);
+   rc = splinterdb_open(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   check_crash_recovered_keys(data->kvsb);
+}
+
+/*
+ * As test_crash_recovery, but with a checkpoint after every memtable, so
+ * that the child crashes with checkpoints behind it, and possibly one in
+ * progress. Recovery starts from the last one and replays less of the log.
+ */
+CTEST2(splinterdb_quick, test_crash_recovery_with_checkpoints)
+{
+   splinterdb_close(&data->kvsb);
+   data->cfg.use_log                 = TRUE;
+   data->cfg.memtable_capacity       = MiB_TO_B(1);
+   data->cfg.log_checkpoint_interval = 1;
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+
+   char key_buf[TEST_MAX_KEY_SIZE + 1];
+   char val_buf[TEST_MAX_VALUE_SIZE];
+   for (int i = 0; i < CRASH_TEST_NUM_KEYS; i++) {
+      snprintf(key_buf, sizeof(key_buf), "ck%08d", i);
+      snprintf(val_buf, sizeof(val_buf), "old-%08d", i);
+      rc = splinterdb_insert(data->kvsb,
+                             slice_create(strlen(key_buf), key_buf),
+                             slice_create(strlen(val_buf), val_buf));
+      ASSERT_EQUAL(0, rc);
+   }
+   // a checkpoint has dropped the log which led up to it
+   splinterdb_stats stats;
+   splinterdb_stats_get(data->kvsb, &stats);
+   ASSERT_TRUE(stats.checkpoints > 0);
+   ASSERT_TRUE(stats.log_extents_freed > 0);
+   splinterdb_close(&data->kvsb);
+
+   // crash twice, the second child recovering from the first crash before
+   // making its own writes
+   for (int round = 0; round < 2; round++) {
+      pid_t pid = fork();
+      ASSERT_TRUE(pid >= 0);
+      if (pid == 0) {
+         _exit(crash_recovery_child(&data->cfg));
+      }
+      int status;
+      ASSERT_EQUAL(pid, waitpid(pid, &status, 0));
+      ASSERT_TRUE(WIFEXITED(status));
+      ASSERT_EQUAL(0, WEXITSTATUS(status));
+   }
+
+   rc = splinterdb_open(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   // only the log since the second child's last checkpoint is replayed,
+   // which is less than the child wrote
+   splinterdb_stats_get(data->kvsb, &stats);
+   ASSERT_TRUE(stats.log_entries_replayed > 0);
+   ASSERT_TRUE(stats.log_entries_replayed < CRASH_TEST_NUM_KEYS);
+   check_crash_recovered_keys(data->kvsb);
+
+   splinterdb_close(&data->kvsb);
+   rc = splinterdb_open(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   check_crash_recovered_keys(data->kvsb);
+}
+
+/*
+ * A child process bulk loads a database with a log, overwrites and range
+ * deletes some of the loaded keys as test_bulk_load does, syncs and exits
+ * without closing it. The loaded keys are not in the log, so they must be in
+ * the checkpoint recovery starts from.
+ */
+CTEST2(splinterdb_quick, test_bulk_load_crash_recovery)
+{
+   splinterdb_close(&data->kvsb);
+   data->cfg.use_log           = TRUE;
+   data->cfg.memtable_capacity = MiB_TO_B(1);
+   data->cfg.fanout            = 4;
+   int rc                      = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   splinterdb_close(&data->kvsb);
+
+   const int num_keys = 200000;
+   pid_t     pid      = fork();
+   ASSERT_TRUE(pid >= 0);
+   if (pid == 0) {
+      _exit(bulk_load_crash_child(&data->cfg, num_keys));
+   }
+   int status;
+   ASSERT_EQUAL(pid, waitpid(pid, &status, 0));
+   ASSERT_TRUE(WIFEXITED(status));
+   ASSERT_EQUAL(0, WEXITSTATUS(status));
+
+   rc = splinterdb_open(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   check_bulk_loaded_keys(data->kvsb, num_keys, 10);
+
+   splinterdb_close(&data->kvsb);
+   rc = splinterdb_open(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+   check_bulk_loaded_keys(data->kvsb, num_keys, 10);
+}
+
+/*
+ * ********************************************************************************
+ * Define minions and helper functions here, after all test cases are
+ * enumerated.
+ * ********************************************************************************
+ */
+
+static void
+create_default_cfg(splinterdb_config *out_cfg, data_config *default_data_cfg)
+{
+   *out_cfg = (splinterdb_config){.filename   = TEST_DB_NAME,
+                                  .cache_size = 64 * Mega,
+                                  .disk_size  = 127 * Mega,
+                                  .data_cfg   = default_data_cfg};
+}
+
+/*
+ * Helper function to insert n-keys (num_inserts), using pre-formatted
+ * key and value strings.
+ *
+ * Returns: Return code: rc == 0 => success; anything else => failure
+ */
+static int
+insert_some_keys(const int num_inserts, splinterdb *kvsb)
+{
+   int rc = 0;
+   // insert keys backwards, just for kicks
+   for (int i = num_inserts - 1; i >= 0; i--) {
+      char key[TEST_INSERT_KEY_LENGTH] = {0};
+      char val[TEST_INSERT_VAL_LENGTH] = {0};
+
+      ASSERT_EQUAL(KEY_FMT_LENGTH, snprintf(key, sizeof(key), key_fmt, i));
+      ASSERT_EQUAL(VAL_FMT_LENGTH, snprintf(val, sizeof(val), val_fmt, i));
+
+      rc = splinterdb_insert(
+         kvsb, slice_create(sizeof(key), key), slice_create(sizeof(val), val));
+      ASSERT_EQUAL(0, rc);
+   }
+
+   return rc;
+}
+
+/*
+ * Helper function to insert n-keys (num_inserts), using pre-formatted
+ * key and value strings. Allows user to specify start value and increment
+ * between keys. This can be used to load either fully sequential keys
+ * or some with defined gaps.
+ *
+ * Parameters:
+ *  kvsb    - SplinterDB handle
+ *  minkey  - Start key to insert
+ *  numkeys - # of keys to insert
+ *  incr    - Increment between keys (default is 1)
+ *
+ * Returns: Return code: rc == 0 => success; anything else => failure
+ */
+static int
+insert_keys(splinterdb *kvsb, const int minkey, int numkeys, const int incr)
+{
+   int rc = -1;
+
+   // Minimally, error check input arguments
+   if (!kvsb || (numkeys <= 0) || (incr < 0))
+      return rc;
+
+   // insert keys forwards, starting from minkey value
+   for (int kctr = minkey; numkeys; kctr += incr, numkeys--) {
+      char key[TEST_INSERT_KEY_LENGTH] = {0};
+      char val[TEST_INSERT_VAL_LENGTH] = {0};
+
+      snprintf(key, sizeof(key), key_fmt, kctr);
+      snprintf(val, sizeof(val), val_fmt, kctr);
+
+      rc = splinterdb_insert(
+         kvsb, slice_create(sizeof(key), key), slice_create(sizeof(val), val));
+      ASSERT_EQUAL(0, rc);
+   }
+   return rc;
+}
+
+/*
+ * Inserts, overwrites and deletes keys across several memtables, then checks
+ * them with lookups and a full scan.
+ */
+static int
+check_memtable_overwrites_and_deletes(splinterdb *kvsb)
+{
+   int       rc;
+   const int num_inserts = 30000;
+   char      key_buf[TEST_MAX_KEY_SIZE + 1];
+   char      val_buf[TEST_MAX_VALUE_SIZE];
+
+   for (int i = 0; i < num_inserts; i++) {
+      snprintf(key_buf, sizeof(key_buf), "sk%08d", i);
+      snprintf(val_buf, sizeof(val_buf), "sval-%08d", i);
+      rc = splinterdb_insert(kvsb,
+                             slice_create(strlen(key_buf), key_buf),
+                             slice_create(strlen(val_buf), val_buf));
+      ASSERT_EQUAL(0, rc);
+      // Overwrite some keys while they are still in the active memtable
+      if (i % 3 == 0) {
+         snprintf(val_buf, sizeof(val_buf), "new-%08d", i);
+         rc = splinterdb_insert(kvsb,
+                                slice_create(strlen(key_buf), key_buf),
+                                slice_create(strlen(val_buf), val_buf));
+         ASSERT_EQUAL(0, rc);
+      }
+   }
+   // Delete some keys, most of which are in older memtables or the trunk
+   for (int i = 0; i < num_inserts; i += 5) {
+      snprintf(key_buf, sizeof(key_buf), "sk%08d", i);
+      rc = splinterdb_delete(kvsb,
+                             slice_create(strlen(key_buf), key_buf));
+      ASSERT_EQUAL(0, rc);
+   }
+
+   splinterdb_lookup_result result;
+   splinterdb_lookup_result_init(kvsb, &result, 0, NULL);
+   for (int i = 0; i < num_inserts; i++) {
+      snprintf(key_buf, sizeof(key_buf), "sk%08d", i);
+      rc = splinterdb_lookup(
+         kvsb, slice_create(strlen(key_buf), key_buf), &result);
+      ASSERT_EQUAL(0, rc);
+      if (i % 5 == 0) {
+         ASSERT_FALSE(splinterdb_lookup_found(&result), "i=%d", i);
+         continue;
+      }
+      ASSERT_TRUE(splinterdb_lookup_found(&result), "i=%d", i);
+      snprintf(val_buf,
+               sizeof(val_buf),
+               i % 3 == 0 ? "new-%08d" : "sval-%08d",
+               i);
+      slice value;
+      rc = splinterdb_lookup_result_value(&result, &value);
+      ASSERT_EQUAL(0, rc);
+      ASSERT_EQUAL(strlen(val_buf), slice_length(value));
+      ASSERT_STREQN(val_buf, slice_data(value), slice_length(value));
+   }
+   splinterdb_lookup_result_deinit(&result);
+
+   splinterdb_iterator *it = NULL;
+   rc = splinterdb_iterator_init(kvsb, &it, NULL_SLICE);
+   ASSERT_EQUAL(0, rc);
+   int expected = 1;
+   for (; splinterdb_iterator_valid(it); splinterdb_iterator_next(it)) {
+      slice key, value;
+      splinterdb_iterator_get_current(it, &key, &value);
+      snprintf(key_buf, sizeof(key_buf), "sk%08d", expected);
+      ASSERT_EQUAL(strlen(key_buf), slice_length(key));
+      ASSERT_STREQN(key_buf, slice_data(key), slice_length(key));
+      expected += expected % 5 == 4 ? 2 : 1;
+   }
+   ASSERT_EQUAL(0, splinterdb_iterator_status(it));
+   splinterdb_iterator_deinit(it);
+   ASSERT_EQUAL(num_inserts + 1, expected);
+   return 0;
+}
+
+/*
+ * Checks the keys left by test_delete_range with lookups and a full scan:
+ * [0, 5000) and [10000, 20000) are deleted, except for 15000 which was
+ * re-inserted.
+ */
+static int
+check_range_deleted_keys(splinterdb *kvsb, int num_keys)
+{
+   int  rc;
+   char key_buf[TEST_MAX_KEY_SIZE + 1];
+   char val_buf[TEST_MAX_VALUE_SIZE];
+
+   splinterdb_lookup_result result;
+   splinterdb_lookup_result_init(kvsb, &result, 0, NULL);
+   for (int i = 0; i < num_keys; i++) {
+      bool deleted = i < 5000 || (10000 <= i && i < 20000 && i != 15000);
+      snprintf(key_buf, sizeof(key_buf), "rk%08d", i);
+      rc = splinterdb_lookup(
+         kvsb, slice_create(strlen(key_buf), key_buf), &result);
+      ASSERT_EQUAL(0, rc);
+      ASSERT_EQUAL(!deleted, splinterdb_lookup_found(&result), "i=%d", i);
+      if (deleted) {
+         continue;
+      }
+      snprintf(val_buf,
+               sizeof(val_buf),
+               i == 15000 ? "new-%08d" : "rval-%08d",
+               i);
+      slice value;
+      rc = splinterdb_lookup_result_value(&result, &value);
+      ASSERT_EQUAL(0, rc);
+      ASSERT_EQUAL(strlen(val_buf), slice_length(value));
+      ASSERT_STREQN(val_buf, slice_data(value), slice_length(value));
+   }
+   splinterdb_lookup_result_deinit(&result);
+
+   splinterdb_iterator *it = NULL;
+   rc = splinterdb_iterator_init(kvsb, &it, NULL_SLICE);
+   ASSERT_EQUAL(0, rc);
+   int expected = 5000;
+   for (; splinterdb_iterator_valid(it); splinterdb_iterator_next(it)) {
+      slice key, value;
+      splinterdb_iterator_get_current(it, &key, &value);
+      snprintf(key_buf, sizeof(key_buf), "rk%08d", expected);
+      ASSERT_EQUAL(strlen(key_buf), slice_length(key));
+      ASSERT_STREQN(key_buf, slice_data(key), slice_length(key));
+      if (expected == 9999) {
+         expected = 15000;
+      } else if (expected == 15000) {
+         expected = 20000;
+      } else {
+         expected++;
+      }
+   }
+   ASSERT_EQUAL(0, splinterdb_iterator_status(it));
+   splinterdb_iterator_deinit(it);
+   ASSERT_EQUAL(num_keys, expected);
+   return 0;
+}
+
+/*
+ * Produces the keys "bk%08d" for start <= i < start + num_keys, swapping the
+ * keys at swap_at and swap_at + 1 unless swap_at is negative.
+ */
+static bool
+bulk_load_next(void *arg, slice *key, slice *value)
+{
+   bulk_load_generator *gen = (bulk_load_generator *)arg;
+   if (gen->next == gen->num_keys) {
+      return FALSE;
+   }
+   int i = gen->start + gen->next++;
+   if (gen->swap_at >= 0 && i == gen->swap_at) {
+      i++;
+   } else if (gen->swap_at >= 0 && i == gen->swap_at + 1) {
+      i--;
+   }
+   snprintf(gen->key_buf, sizeof(gen->key_buf), "bk%08d", i);
+   snprintf(gen->val_buf, sizeof(gen->val_buf), "bval-%08d", i);
+   *key   = slice_create(strlen(gen->key_buf), gen->key_buf);
+   *value = slice_create(strlen(gen->val_buf), gen->val_buf);
+   return TRUE;
+}
+
+/*
+ * Checks the keys left by test_bulk_load with lookups and a full scan. If
+ * overwritten is non-zero, every overwritten'th key has a new value and
+ * [100000, 110000) are deleted.
+ */
+static int
+check_bulk_loaded_keys(splinterdb *kvsb, int num_keys, int overwritten)
+{
+   int  rc;
+   char key_buf[TEST_MAX_KEY_SIZE + 1];
+   char val_buf[TEST_MAX_VALUE_SIZE];
+
+   splinterdb_lookup_result result;
+   splinterdb_lookup_result_init(kvsb, &result, 0, NULL);
+   for (int i = 0; i < num_keys; i++) {
+      bool deleted = overwritten != 0 && 100000 <= i && i < 110000;
+      snprintf(key_buf, sizeof(key_buf), "bk%08d", i);
+      rc = splinterdb_lookup(
+         kvsb, slice_create(strlen(key_buf), key_buf), &result);
+      ASSERT_EQUAL(0, rc);
+      ASSERT_EQUAL(!deleted, splinterdb_lookup_found(&result), "i=%d", i);
+      if (deleted) {
+         continue;
+      }
+      bool is_new = overwritten != 0 && i % overwritten == 0;
+      snprintf(
+         val_buf, sizeof(val_buf), is_new ? "new-%08d" : "bval-%08d", i);
+      slice value;
+      rc = splinterdb_lookup_result_value(&result, &value);
+      ASSERT_EQUAL(0, rc);
+      ASSERT_EQUAL(strlen(val_buf), slice_length(value));
+      ASSERT_STREQN(val_buf, slice_data(value), slice_length(value));
+   }
+   splinterdb_lookup_result_deinit(&result);
+
+   splinterdb_iterator *it = NULL;
+   rc = splinterdb_iterator_init(kvsb, &it, NULL_SLICE);
+   ASSERT_EQUAL(0, rc);
+   int expected = 0;
+   for (; splinterdb_iterator_valid(it); splinterdb_iterator_next(it)) {
+      slice key, value;
+      splinterdb_iterator_get_current(it, &key, &value);
+      snprintf(key_buf, sizeof(key_buf), "bk%08d", expected);
+      ASSERT_EQUAL(strlen(key_buf), slice_length(key));
+      ASSERT_STREQN(key_buf, slice_data(key), slice_length(key));
+      expected++;
+      if (overwritten != 0 && expected == 100000) {
+         expected = 110000;
+      }
+   }
+   ASSERT_EQUAL(0, splinterdb_iterator_status(it));
+   splinterdb_iterator_deinit(it);
+   ASSERT_EQUAL(num_keys, expected);
+   return 0;
+}
+
+/*
+ * Checks that snapshot holds keys sn00000000 up to num_keys, each with the
+ * value formatted by val_fmt, and nothing else.
+ */
+static int
+check_snapshot_keys(splinterdb          *kvsb,
+                    splinterdb_snapshot *snapshot,
+                    int                  num_keys,
+                    const char          *val_fmt)
+{
+   int  rc;
+   char key_buf[TEST_MAX_KEY_SIZE + 1];
+   char val_buf[TEST_MAX_VALUE_SIZE];
+
+   splinterdb_lookup_result result;
+   splinterdb_lookup_result_init(kvsb, &result, 0, NULL);
+   for (int i = 0; i < num_keys + 1000; i++) {
+      snprintf(key_buf, sizeof(key_buf), "sn%08d", i);
+      rc = splinterdb_snapshot_lookup(
+         snapshot, slice_create(strlen(key_buf), key_buf), &result);
+      ASSERT_EQUAL(0, rc);
+      ASSERT_EQUAL(i < num_keys, splinterdb_lookup_found(&result), "i=%d", i);
+      if (i >= num_keys) {
+         continue;
+      }
+      snprintf(val_buf, sizeof(val_buf), val_fmt, i);
+      slice value;
+      rc = splinterdb_lookup_result_value(&result, &value);
+      ASSERT_EQUAL(0, rc);
+      ASSERT_EQUAL(strlen(val_buf), slice_length(value));
+      ASSERT_STREQN(val_buf, slice_data(value), slice_length(value));
+   }
+   splinterdb_lookup_result_deinit(&result);
+
+   splinterdb_iterator *it = NULL;
+   rc = splinterdb_snapshot_iterator_init(snapshot, &it, NULL_SLICE);
+   ASSERT_EQUAL(0, rc);
+   int expected = 0;
+   for (; splinterdb_iterator_valid(it); splinterdb_iterator_next(it)) {
+      slice key, value;
+      splinterdb_iterator_get_current(it, &key, &value);
+      snprintf(key_buf, sizeof(key_buf), "sn%08d", expected);
+      snprintf(val_buf, sizeof(val_buf), val_fmt, expected);
+      ASSERT_EQUAL(strlen(key_buf), slice_length(key));
+      ASSERT_STREQN(key_buf, slice_data(key), slice_length(key));
+      ASSERT_EQUAL(strlen(val_buf), slice_length(value));
+      ASSERT_STREQN(val_buf, slice_data(value), slice_length(value));
+      expected++;
+   }
+   ASSERT_EQUAL(0, splinterdb_iterator_status(it));
+   splinterdb_iterator_deinit(it);
+   ASSERT_EQUAL(num_keys, expected);
+   return 0;
+}
+
+// Inserts the keys of test_iterator_seek_and_prev, see seek_key_present
+static int
+insert_seek_test_keys(splinterdb *kvsb)
+{
+   char key_buf[TEST_MAX_KEY_SIZE + 1];
+   char end_buf[TEST_MAX_KEY_SIZE + 1];
+   char val_buf[TEST_MAX_VALUE_SIZE];
+   int  rc;
+   for (int i = 0; i < SEEK_TEST_NUM_KEYS; i += 2) {
+      snprintf(key_buf, sizeof(key_buf), "sk%08d", i);
+      snprintf(val_buf, sizeof(val_buf), "sv-%08d", i);
+      rc = splinterdb_insert(kvsb,
+                             slice_create(strlen(key_buf), key_buf),
+                             slice_create(strlen(val_buf), val_buf));
+      ASSERT_EQUAL(0, rc);
+   }
+   for (int i = 4; i < SEEK_TEST_NUM_KEYS; i += 10) {
+      snprintf(key_buf, sizeof(key_buf), "sk%08d", i);
+      rc = splinterdb_delete(kvsb, slice_create(strlen(key_buf), key_buf));
+      ASSERT_EQUAL(0, rc);
+   }
+   snprintf(key_buf, sizeof(key_buf), "sk%08d", 20000);
+   snprintf(end_buf, sizeof(end_buf), "sk%08d", 24000);
+   rc = splinterdb_delete_range(kvsb,
+                                slice_create(strlen(key_buf), key_buf),
+                                slice_create(strlen(end_buf), end_buf));
+   ASSERT_EQUAL(0, rc);
+   return 0;
+}
+
+// Keys of test_iterator_seek_and_prev
+static bool
+seek_key_present(int i)
+{
+   return 0 <= i && i < SEEK_TEST_NUM_KEYS && i % 2 == 0 && i % 10 != 4
+          && !(20000 <= i && i < 24000);
+}
+
+static int
+check_seek_current(splinterdb_iterator *it, int expected)
+{
+   char  key_buf[TEST_MAX_KEY_SIZE + 1];
+   char  val_buf[TEST_MAX_VALUE_SIZE];
+   slice key, value;
+   ASSERT_TRUE(splinterdb_iterator_valid(it), "expected=%d", expected);
+   splinterdb_iterator_get_current(it, &key, &value);
+   snprintf(key_buf, sizeof(key_buf), "sk%08d", expected);
+   snprintf(val_buf, sizeof(val_buf), "sv-%08d", expected);
+   ASSERT_EQUAL(strlen(key_buf), slice_length(key));
+   ASSERT_STREQN(key_buf, slice_data(key), slice_length(key));
+   ASSERT_EQUAL(strlen(val_buf), slice_length(value));
+   ASSERT_STREQN(val_buf, slice_data(value), slice_length(value));
+   return 0;
+}
+
+static int
+check_seek_and_prev(splinterdb_iterator *it)
+{
+   char key_buf[TEST_MAX_KEY_SIZE + 1];
+
+   // Seeks in both directions, each followed by a short scan
+   for (int j = 0; j < 3000; j++) {
+      int target = (j * 7919) % (SEEK_TEST_NUM_KEYS + 100);
+      snprintf(key_buf, sizeof(key_buf), "sk%08d", target);
+      splinterdb_iterator_seek(it, slice_create(strlen(key_buf), key_buf));
+      int expected = target;
+      for (int n = 0; n < 4; n++) {
+         while (expected < SEEK_TEST_NUM_KEYS && !seek_key_present(expected)) {
+            expected++;
+         }
+         if (expected >= SEEK_TEST_NUM_KEYS) {
+            ASSERT_FALSE(splinterdb_iterator_valid(it), "target=%d", target);
+            break;
+         }
+         check_seek_current(it, expected);
+         splinterdb_iterator_next(it);
+         expected++;
+      }
+      ASSERT_EQUAL(0, splinterdb_iterator_status(it));
+   }
+
+   // Seeking to the current key stays put
+   splinterdb_iterator_seek(it, NULL_SLICE);
+   check_seek_current(it, 0);
+   slice key, value;
+   splinterdb_iterator_get_current(it, &key, &value);
+   splinterdb_iterator_seek(it, key);
+   check_seek_current(it, 0);
+
+   // Walk back from the last key to the first
+   int last = SEEK_TEST_NUM_KEYS - 1;
+   while (!seek_key_present(last)) {
+      last--;
+   }
+   snprintf(key_buf, sizeof(key_buf), "sk%08d", last);
+   splinterdb_iterator_seek(it, slice_create(strlen(key_buf), key_buf));
+   int num_seen = 0;
+   for (int expected = last; expected >= 0; expected--) {
+      if (!seek_key_present(expected)) {
+         continue;
+      }
+      check_seek_current(it, expected);
+      splinterdb_iterator_prev(it);
+      num_seen++;
+   }
+   ASSERT_FALSE(splinterdb_iterator_valid(it));
+   ASSERT_EQUAL(0, splinterdb_iterator_status(it));
+   ASSERT_TRUE(num_seen > 0);
+
+   // Mixing next and prev
+   snprintf(key_buf, sizeof(key_buf), "sk%08d", 24000);
+   splinterdb_iterator_seek(it, slice_create(strlen(key_buf), key_buf));
+   check_seek_current(it, 24000);
+   splinterdb_iterator_prev(it);
+   check_seek_current(it, 19998);
+   splinterdb_iterator_next(it);
+   check_seek_current(it, 24000);
+
+   // An exhausted iterator can be sought again
+   snprintf(key_buf, sizeof(key_buf), "sk%08d", SEEK_TEST_NUM_KEYS);
+   splinterdb_iterator_seek(it, slice_create(strlen(key_buf), key_buf));
+   ASSERT_FALSE(splinterdb_iterator_valid(it));
+   snprintf(key_buf, sizeof(key_buf), "sk%08d", 3);
+   splinterdb_iterator_seek(it, slice_create(strlen(key_buf), key_buf));
+   check_seek_current(it, 6);
+   ASSERT_EQUAL(0, splinterdb_iterator_status(it));
+   return 0;
+}
+
+/*
+ * Checks that a reverse iterator positioned below target returns the
+ * present keys below it, in descending order, for a few steps.
+ */
+static int
+check_reverse_scan(splinterdb_iterator *it, int target)
+{
+   int expected = target - 1;
+   for (int n = 0; n < 4; n++) {
+      while (expected >= 0 && !seek_key_present(expected)) {
+         expected--;
+      }
+      if (expected < 0) {
+         ASSERT_FALSE(splinterdb_iterator_valid(it), "target=%d", target);
+         break;
+      }
+      check_seek_current(it, expected);
+      splinterdb_iterator_next(it);
+      expected--;
+   }
+   ASSERT_EQUAL(0, splinterdb_iterator_status(it));
+   return 0;
+}
+
+static int
+check_reverse_iterator(splinterdb *kvsb)
+{
+   char                 key_buf[TEST_MAX_KEY_SIZE + 1];
+   splinterdb_iterator *it = NULL;
+
+   // Full descending scan
+   int rc = splinterdb_iterator_init_reverse(kvsb, &it, NULL_SLICE);
+   ASSERT_EQUAL(0, rc);
+   int expected = SEEK_TEST_NUM_KEYS - 1;
+   int num_seen = 0;
+   for (; splinterdb_iterator_valid(it); splinterdb_iterator_next(it)) {
+      while (!seek_key_present(expected)) {
+         expected--;
+      }
+      check_seek_current(it, expected);
+      expected--;
+      num_seen++;
+   }
+   ASSERT_EQUAL(0, splinterdb_iterator_status(it));
+   while (expected >= 0 && !seek_key_present(expected)) {
+      expected--;
+   }
+   ASSERT_EQUAL(-1, expected);
+   ASSERT_TRUE(num_seen > 0);
+   splinterdb_iterator_deinit(it);
+
+   // Scans starting below an end key
+   for (int j = 0; j < 100; j++) {
+      int target = (j * 7919) % (SEEK_TEST_NUM_KEYS + 100);
+      snprintf(key_buf, sizeof(key_buf), "sk%08d", target);
+      rc = splinterdb_iterator_init_reverse(
+         kvsb, &it, slice_create(strlen(key_buf), key_buf));
+      ASSERT_EQUAL(0, rc);
+      check_reverse_scan(it, target);
+      splinterdb_iterator_deinit(it);
+   }
+
+   // Reverse seeks in both directions on one iterator
+   rc = splinterdb_iterator_init_reverse(kvsb, &it, NULL_SLICE);
+   ASSERT_EQUAL(0, rc);
+   for (int j = 0; j < 3000; j++) {
+      int target = (j * 7919) % (SEEK_TEST_NUM_KEYS + 100);
+      snprintf(key_buf, sizeof(key_buf), "sk%08d", target);
+      splinterdb_iterator_seek(it, slice_create(strlen(key_buf), key_buf));
+      check_reverse_scan(it, target);
+   }
+   splinterdb_iterator_seek(it, NULL_SLICE);
+   check_reverse_scan(it, SEEK_TEST_NUM_KEYS);
+
+   // Nothing below the smallest key, and reverse iterators cannot move back
+   snprintf(key_buf, sizeof(key_buf), "sk%08d", 0);
+   splinterdb_iterator_seek(it, slice_create(strlen(key_buf), key_buf));
+   ASSERT_FALSE(splinterdb_iterator_valid(it));
+   ASSERT_EQUAL(0, splinterdb_iterator_status(it));
+   splinterdb_iterator_seek(it, NULL_SLICE);
+   splinterdb_iterator_prev(it);
+   ASSERT_NOT_EQUAL(0, splinterdb_iterator_status(it));
+   splinterdb_iterator_deinit(it);
+   return 0;
+}
+
+/*
+ * Work horse routine to check if the current tuple pointed to by the
+ * iterator is the expected one, as indicated by its index,
+ * expected_i. We use pre-constructed key / value formats to verify
+ * if the current tuple is of the expected format.
+ *
+ * Returns: Return code: rc == 0 => success; anything else => failure
+ */
+static int
+check_current_tuple(splinterdb_iterator *it, const int expected_i)
+{
+   int rc = 0;
+
+   char expected_key[TEST_INSERT_KEY_LENGTH] = {0};
+   char expected_val[TEST_INSERT_VAL_LENGTH] = {0};
+   ASSERT_EQUAL(
+      KEY_FMT_LENGTH,
+      snprintf(expected_key, sizeof(expected_key), key_fmt, expected_i));
+   ASSERT_EQUAL(
+      VAL_FMT_LENGTH,
+      snprintf(expected_val, sizeof(expected_val), val_fmt, expected_i));
+
+   slice key, value;
+
+   splinterdb_iterator_get_current(it, &key, &value);
+
+   ASSERT_EQUAL(TEST_INSERT_KEY_LENGTH, slice_length(key));
+   ASSERT_EQUAL(TEST_INSERT_VAL_LENGTH, slice_length(value));
+
+   int key_cmp = memcmp(expected_key, slice_data(key), slice_length(key));
+   int val_cmp = memcmp(expected_val, slice_data(value), slice_length(value));
+   ASSERT_EQUAL(0, key_cmp);
+   ASSERT_EQUAL(0, val_cmp);
+
+   return rc;
+}
+
+// A user-specified spy comparator
+static int
+custom_key_comparator(const data_config *cfg, slice key1, slice key2)
+{
+   platform_assert(slice_data(key1) != NULL);
+   platform_assert(slice_data(key2) != NULL);
+
+   int r = slice_lex_cmp(key1, key2);
+
+   // record that this spy was called
+   comparison_counting_data_config *ccfg =
+      (comparison_counting_data_config *)cfg;
+   ccfg->num_comparisons += 1;
+   return r;
+}
+
+// Async lookup callback that counts completions of each lookup
+static void
+lookup_async_count_cb(int rc, splinterdb_lookup_result *result, void *arg)
+{
+   platform_assert(rc == 0);
+   int *completions = (int *)arg;
+   (*completions)++;
+}
+
+// Prefix extractor for test_prefix_iterator: the first 5 bytes of the key
+static uint64
+fixed_key_prefix_length(const data_config *cfg, slice key)
+{
+   return MIN(slice_length(key), PREFIX_TEST_PREFIX_LENGTH);
+}
+
+static bool
+prefix_key_present(int group, int i)
+{
+   return i % 7 != 3 || group % 2 == 0;
+}
+
+/*
+ * Inserts the keys pf<group>-<i> one group after the other, then deletes
+ * every seventh key of the odd groups.
+ */
+static int
+insert_prefix_test_keys(splinterdb *kvsb)
+{
+   char key_buf[TEST_MAX_KEY_SIZE + 1];
+   char val_buf[TEST_MAX_VALUE_SIZE];
+   int  rc;
+   for (int g = 0; g < PREFIX_TEST_NUM_GROUPS; g++) {
+      for (int i = 0; i < PREFIX_TEST_KEYS_PER_GROUP; i++) {
+         snprintf(key_buf, sizeof(key_buf), "pf%03d-%06d", g, i);
+         snprintf(val_buf, sizeof(val_buf), "pv-%03d-%06d", g, i);
+         rc = splinterdb_insert(kvsb,
+                                slice_create(strlen(key_buf), key_buf),
+                                slice_create(strlen(val_buf), val_buf));
+         ASSERT_EQUAL(0, rc);
+      }
+   }
+   for (int g = 1; g < PREFIX_TEST_NUM_GROUPS; g += 2) {
+      for (int i = 3; i < PREFIX_TEST_KEYS_PER_GROUP; i += 7) {
+         snprintf(key_buf, sizeof(key_buf), "pf%03d-%06d", g, i);
+         rc = splinterdb_delete(kvsb, slice_create(strlen(key_buf), key_buf));
+         ASSERT_EQUAL(0, rc);
+      }
+   }
+   return 0;
+}
+
+/*
+ * Checks that the prefix iterator of group returns exactly its live keys,
+ * and seeks within, before and after them.
+ */
+static int
+check_prefix_iterator(splinterdb *kvsb, int group)
+{
+   char prefix_buf[TEST_MAX_KEY_SIZE + 1];
+   char key_buf[TEST_MAX_KEY_SIZE + 1];
+   char val_buf[TEST_MAX_VALUE_SIZE];
+   snprintf(prefix_buf, sizeof(prefix_buf), "pf%03d", group);
+
+   splinterdb_iterator *it = NULL;
+   int                  rc = splinterdb_iterator_init_prefix(
+      kvsb, &it, slice_create(strlen(prefix_buf), prefix_buf));
+   ASSERT_EQUAL(0, rc);
+
+   int num_keys =
+      group < PREFIX_TEST_NUM_GROUPS ? PREFIX_TEST_KEYS_PER_GROUP : 0;
+   int i = 0;
+   for (; splinterdb_iterator_valid(it); splinterdb_iterator_next(it)) {
+      while (!prefix_key_present(group, i)) {
+         i++;
+      }
+      ASSERT_TRUE(i < num_keys, "group=%d", group);
+      slice key, value;
+      splinterdb_iterator_get_current(it, &key, &value);
+      snprintf(key_buf, sizeof(key_buf), "pf%03d-%06d", group, i);
+      snprintf(val_buf, sizeof(val_buf), "pv-%03d-%06d", group, i);
+      ASSERT_EQUAL(strlen(key_buf), slice_length(key));
+      ASSERT_EQUAL(0, memcmp(key_buf, slice_data(key), slice_length(key)));
+      ASSERT_EQUAL(strlen(val_buf), slice_length(value));
+      ASSERT_EQUAL(0, memcmp(val_buf, slice_data(value), slice_length(value)));
+      i++;
+   }
+   ASSERT_EQUAL(0, splinterdb_iterator_status(it));
+   while (i < num_keys && !prefix_key_present(group, i)) {
+      i++;
+   }
+   ASSERT_EQUAL(num_keys, i, "group=%d", group);
+
+   if (num_keys != 0) {
+      // past the last key of the prefix
+      snprintf(key_buf, sizeof(key_buf), "pf%03d-999999", group);
+      splinterdb_iterator_seek(it, slice_create(strlen(key_buf), key_buf));
+      ASSERT_FALSE(splinterdb_iterator_valid(it));
+      ASSERT_EQUAL(0, splinterdb_iterator_status(it));
+
+      // back within the prefix
+      snprintf(key_buf, sizeof(key_buf), "pf%03d-%06d", group, 1003);
+      splinterdb_iterator_seek(it, slice_create(strlen(key_buf), key_buf));
+      ASSERT_TRUE(splinterdb_iterator_valid(it));
+      slice key, value;
+      splinterdb_iterator_get_current(it, &key, &value);
+      snprintf(key_buf,
+               sizeof(key_buf),
+               "pf%03d-%06d",
+               group,
+               prefix_key_present(group, 1003) ? 1003 : 1004);
+      ASSERT_EQUAL(0, memcmp(key_buf, slice_data(key), slice_length(key)));
+
+      // before the prefix
+      splinterdb_iterator_seek(it, slice_create(strlen("pa"), "pa"));
+      ASSERT_TRUE(splinterdb_iterator_valid(it));
+      splinterdb_iterator_get_current(it, &key, &value);
+      snprintf(key_buf, sizeof(key_buf), "pf%03d-%06d", group, 0);
+      ASSERT_EQUAL(0, memcmp(key_buf, slice_data(key), slice_length(key)));
+
+      splinterdb_iterator_prev(it);
+      ASSERT_NOT_EQUAL(0, splinterdb_iterator_status(it));
+   }
+   splinterdb_iterator_deinit(it);
+   return 0;
+}
+
+/*
+ * Runs in the child process of test_crash_recovery: inserts the keys
+ * [CRASH_TEST_NUM_KEYS, 2 * CRASH_TEST_NUM_KEYS), overwrites every third of
+ * the old keys and deletes the next ones, range deletes a run of the old and
+ * of the new keys and inserts one of them again, then syncs and returns
+ * without closing the database. Returns non-zero on failure, as the child
+ * must not use the ctest assertions.
+ */
+static int
+crash_recovery_child(const splinterdb_config *cfg)
+{
+   splinterdb *kvsb;
+   if (splinterdb_open(cfg, &kvsb) != 0) {
+      return 1;
+   }
+
+   char key_buf[TEST_MAX_KEY_SIZE + 1];
+   char val_buf[TEST_MAX_VALUE_SIZE];
+   for (int i = 0; i < 2 * CRASH_TEST_NUM_KEYS; i++) {
+      int rc;
+      snprintf(key_buf, sizeof(key_buf), "ck%08d", i);
+      slice key = slice_create(strlen(key_buf), key_buf);
+      if (i >= CRASH_TEST_NUM_KEYS || i % 3 == 0) {
+         snprintf(val_buf, sizeof(val_buf), "new-%08d", i);
+         rc = splinterdb_insert(
+            kvsb, key, slice_create(strlen(val_buf), val_buf));
+      } else if (i % 3 == 1) {
+         rc = splinterdb_delete(kvsb, key);
+      } else {
+         continue;
+      }
+      if (rc != 0) {
+         return 1;
+      }
+   }
+
+   char end_buf[TEST_MAX_KEY_SIZE + 1];
+   for (int i = CRASH_TEST_DELETE_START; i < 2 * CRASH_TEST_NUM_KEYS;
+        i += CRASH_TEST_NUM_KEYS)
+   {
+      snprintf(key_buf, sizeof(key_buf), "ck%08d", i);
+      snprintf(
+         end_buf, sizeof(end_buf), "ck%08d", i + CRASH_TEST_DELETE_LENGTH);
+      if (splinterdb_delete_range(kvsb,
+                                  slice_create(strlen(key_buf), key_buf),
+                                  slice_create(strlen(end_buf), end_buf))
+          != 0)
+      {
+         return 1;
+      }
+   }
+   snprintf(key_buf, sizeof(key_buf), "ck%08d", CRASH_TEST_REINSERTED_KEY);
+   snprintf(val_buf, sizeof(val_buf), "new-%08d", CRASH_TEST_REINSERTED_KEY);
+   if (splinterdb_insert(kvsb,
+                         slice_create(strlen(key_buf), key_buf),
+                         slice_create(strlen(val_buf), val_buf))
+       != 0)
+   {
+      return 1;
+   }
+   return splinterdb_sync(kvsb) == 0 ? 0 : 1;
+}
+
+/*
+ * The child of test_bulk_load_crash_recovery. Returns non-zero on failure.
+ */
+static int
+bulk_load_crash_child(const splinterdb_config *cfg, int num_keys)
+{
+   splinterdb *kvsb;
+   if (splinterdb_open(cfg, &kvsb) != 0) {
+      return 1;
+   }
+   bulk_load_generator gen = {.num_keys = num_keys, .swap_at = -1};
+   if (splinterdb_bulk_load(kvsb, bulk_load_next, &gen) != 0) {
+      return 1;
+   }
+
+   char key_buf[TEST_MAX_KEY_SIZE + 1];
+   char end_buf[TEST_MAX_KEY_SIZE + 1];
+   char val_buf[TEST_MAX_VALUE_SIZE];
+   for (int i = 0; i < num_keys; i += 10) {
+      snprintf(key_buf, sizeof(key_buf), "bk%08d", i);
+      snprintf(val_buf, sizeof(val_buf), "new-%08d", i);
+      if (splinterdb_insert(kvsb,
+                            slice_create(strlen(key_buf), key_buf),
+                            slice_create(strlen(val_buf), val_buf))
+          != 0)
+      {
+         return 1;
+      }
+   }
+   snprintf(key_buf, sizeof(key_buf), "bk%08d", 100000);
+   snprintf(end_buf, sizeof(end_buf), "bk%08d", 110000);
+   if (splinterdb_delete_range(kvsb,
+                               slice_create(strlen(key_buf), key_buf),
+                               slice_create(strlen(end_buf), end_buf))
+       != 0)
+   {
+      return 1;
+   }
+   return splinterdb_sync(kvsb) == 0 ? 0 : 1;
+}
+
+/*
+ * Checks the keys of test_crash_recovery, see crash_recovery_child.
+ */
+static int
+check_crash_recovered_keys(splinterdb *kvsb)
+{
+   int  rc;
+   char key_buf[TEST_MAX_KEY_SIZE + 1];
+   char val_buf[TEST_MAX_VALUE_SIZE];
+
+   splinterdb_lookup_result result;
+   splinterdb_lookup_result_init(kvsb, &result, 0, NULL);
+   for (int i = 0; i < 2 * CRASH_TEST_NUM_KEYS; i++) {
+      int  offset  = i % CRASH_TEST_NUM_KEYS - CRASH_TEST_DELETE_START;
+      bool new     = i >= CRASH_TEST_NUM_KEYS || i % 3 == 0
+                 || i == CRASH_TEST_REINSERTED_KEY;
+      bool deleted = (!new && i % 3 == 1)
+                     || (0 <= offset && offset < CRASH_TEST_DELETE_LENGTH
+                         && i != CRASH_TEST_REINSERTED_KEY);
+      snprintf(key_buf, sizeof(key_buf), "ck%08d", i);
+      rc = splinterdb_lookup(
+         kvsb, slice_create(strlen(key_buf), key_buf), &result);
+      ASSERT_EQUAL(0, rc);
+      ASSERT_EQUAL(!deleted, splinterdb_lookup_found(&result), "i=%d", i);
+      if (deleted) {
+         continue;
+      }
+      snprintf(val_buf, sizeof(val_buf), new ? "new-%08d" : "old-%08d", i);
+      slice value;
+      rc = splinterdb_lookup_result_value(&result, &value);
+      ASSERT_EQUAL(0, rc);
+      ASSERT_EQUAL(strlen(val_buf), slice_length(value));
+      ASSERT_STREQN(val_buf, slice_data(value), slice_length(value));
+   }
+   splinterdb_lookup_result_deinit(&result);
+   return 0;
 }
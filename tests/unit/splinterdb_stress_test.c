@@ -25,9 +25,15 @@
 static void *
 exec_worker_thread(void *w);
 
+static void *
+exec_overlapping_worker_thread(void *w);
+
 static void
 naive_range_delete(const splinterdb *kvsb, slice start_key, uint32 count);
 
+static void
+concurrent_overlapping_inserts(splinterdb *kvsb);
+
 // Configuration for each worker thread
 typedef struct {
    uint32_t    num_inserts;
@@ -109,6 +115,29 @@ CTEST2(splinterdb_stress, test_random_inserts_concurrent)
 }
 
 
+// All threads insert the same keys, in different orders, into skiplist
+// memtables, so that inserts of the same key race with each other.
+CTEST2(splinterdb_stress, test_skiplist_memtable_concurrent)
+{
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_use_skiplist = TRUE;
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+
+   concurrent_overlapping_inserts(data->kvsb);
+}
+
+// Concurrent inserts into a memtable split into shards with separate locks
+CTEST2(splinterdb_stress, test_sharded_memtable_concurrent)
+{
+   splinterdb_close(&data->kvsb);
+   data->cfg.memtable_num_shards = 8;
+   int rc = splinterdb_create(&data->cfg, &data->kvsb);
+   ASSERT_EQUAL(0, rc);
+
+   concurrent_overlapping_inserts(data->kvsb);
+}
+
 // Do some inserts, and then some range-deletes
 CTEST2(splinterdb_stress, test_naive_range_delete)
 {
@@ -188,6 +217,81 @@ exec_worker_thread(void *w)
 }
 
 
+// Inserts keys 0 .. num_inserts - 1, starting at a thread-specific offset
+static void *
+exec_overlapping_worker_thread(void *w)
+{
+   char key_buf[TEST_KEY_SIZE]     = {0};
+   char value_buf[TEST_VALUE_SIZE] = {0};
+
+   worker_config *wcfg        = (worker_config *)w;
+   uint32_t       num_inserts = wcfg->num_inserts;
+   splinterdb    *kvsb        = wcfg->kvsb;
+
+   splinterdb_register_thread(kvsb);
+
+   uint32_t start = (uint32_t)(platform_get_tid() * 7919) % num_inserts;
+   for (uint32_t i = 0; i < num_inserts; i++) {
+      uint32_t k = (start + i) % num_inserts;
+      snprintf(key_buf, sizeof(key_buf), "key-%010u", k);
+      snprintf(value_buf, sizeof(value_buf), "value-%lu", platform_get_tid());
+      int rc = splinterdb_insert(kvsb,
+                                 slice_create(TEST_KEY_SIZE, key_buf),
+                                 slice_create(TEST_VALUE_SIZE, value_buf));
+      ASSERT_EQUAL(0, rc);
+   }
+
+   splinterdb_deregister_thread(kvsb);
+   return 0;
+}
+
+// Runs overlapping workers on all threads, then checks every key is there
+static void
+concurrent_overlapping_inserts(splinterdb *kvsb)
+{
+   int           rc;
+   worker_config wcfg = {
+      .num_inserts = 200 * 1000,
+      .kvsb        = kvsb,
+   };
+
+   pthread_t thread_ids[num_threads];
+   for (int i = 0; i < num_threads; i++) {
+      rc = pthread_create(
+         &thread_ids[i], NULL, &exec_overlapping_worker_thread, &wcfg);
+      ASSERT_EQUAL(0, rc);
+   }
+   for (int i = 0; i < num_threads; i++) {
+      void *thread_rc;
+      rc = pthread_join(thread_ids[i], &thread_rc);
+      ASSERT_EQUAL(0, rc);
+      ASSERT_TRUE(thread_rc == 0);
+   }
+
+   char                     key_buf[TEST_KEY_SIZE] = {0};
+   splinterdb_lookup_result result;
+   splinterdb_lookup_result_init(kvsb, &result, 0, NULL);
+   for (uint32 i = 0; i < wcfg.num_inserts; i++) {
+      snprintf(key_buf, sizeof(key_buf), "key-%010u", i);
+      rc = splinterdb_lookup(
+         kvsb, slice_create(TEST_KEY_SIZE, key_buf), &result);
+      ASSERT_EQUAL(0, rc);
+      ASSERT_TRUE(splinterdb_lookup_found(&result), "i=%u", i);
+   }
+   splinterdb_lookup_result_deinit(&result);
+
+   uint32               count = 0;
+   splinterdb_iterator *it    = NULL;
+   rc = splinterdb_iterator_init(kvsb, &it, NULL_SLICE);
+   ASSERT_EQUAL(0, rc);
+   for (; splinterdb_iterator_valid(it); splinterdb_iterator_next(it)) {
+      count++;
+   }
+   ASSERT_EQUAL(0, splinterdb_iterator_status(it));
+   splinterdb_iterator_deinit(it);
+   ASSERT_EQUAL(wcfg.num_inserts, count);
+}
+
 // Do a "range delete" by collecting keys and then deleting them one at a time
 static void
 naive_range_delete(const splinterdb *kvsb, slice start_key, uint32 count)
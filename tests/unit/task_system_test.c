@@ -49,6 +49,33 @@ exec_one_thread_use_extern_apis(void *arg);
 static void
 exec_one_of_n_threads(void *arg);
 
+// State shared by the tasks of test_bg_threads_work_stealing
+typedef struct {
+   task_system    *tasks;
+   volatile uint64 num_run;
+   uint64          num_children;
+} bg_task_state;
+
+static void
+bg_task_count(void *arg, void *scratch);
+
+static void
+bg_task_spawn(void *arg, void *scratch);
+
+// Records the order in which tasks of test_task_priorities run
+typedef struct {
+   uint64        num_run;
+   task_priority order[NUM_TASK_PRIORITIES];
+} priority_task_state;
+
+typedef struct {
+   priority_task_state *state;
+   task_priority        priority;
+} priority_task_arg;
+
+static void
+priority_task_record(void *arg, void *scratch);
+
 /*
  * Global data declaration macro:
  */
@@ -329,6 +356,108 @@ CTEST2(task_system, test_multiple_threads)
    }
 }
 
+/*
+ * ------------------------------------------------------------------------
+ * Test execution of tasks by background threads. Some tasks enqueue more
+ * tasks from the worker threads, which land on the enqueuing worker's own
+ * deque and have to be stolen by the other workers to run in parallel.
+ * ------------------------------------------------------------------------
+ */
+CTEST2(task_system, test_bg_threads_work_stealing)
+{
+   // Replace the task system from setup with one using background threads.
+   task_system_destroy(data->hid, &data->tasks);
+   data->num_bg_threads[TASK_TYPE_NORMAL]   = 4;
+   data->num_bg_threads[TASK_TYPE_MEMTABLE] = 1;
+   platform_status rc = task_system_create(data->hid,
+                                           data->ioh,
+                                           &data->tasks,
+                                           TRUE, // Use statistics,
+                                           TRUE, // Use bg threads
+                                           data->num_bg_threads,
+                                           trunk_get_scratch_size());
+   ASSERT_TRUE(SUCCESS(rc));
+
+   bg_task_state state = {.tasks = data->tasks, .num_children = 10};
+
+   const uint64 num_spawn_tasks    = 100;
+   const uint64 num_memtable_tasks = 100;
+   for (uint64 i = 0; i < num_spawn_tasks; i++) {
+      rc = task_enqueue(
+         data->tasks, TASK_TYPE_NORMAL, bg_task_spawn, &state, FALSE);
+      ASSERT_TRUE(SUCCESS(rc));
+   }
+   for (uint64 i = 0; i < num_memtable_tasks; i++) {
+      rc = task_enqueue(
+         data->tasks, TASK_TYPE_MEMTABLE, bg_task_count, &state, i % 2);
+      ASSERT_TRUE(SUCCESS(rc));
+   }
+
+   task_perform_all(data->tasks);
+
+   uint64 exp_num_run = num_spawn_tasks * (1 + state.num_children)
+                        + num_memtable_tasks;
+   ASSERT_EQUAL(exp_num_run, state.num_run);
+}
+
+/*
+ * ------------------------------------------------------------------------
+ * Test that queued tasks are run most urgent priority class first,
+ * regardless of the order in which they were enqueued.
+ * ------------------------------------------------------------------------
+ */
+CTEST2(task_system, test_task_priorities)
+{
+   priority_task_state state = {0};
+   priority_task_arg   args[NUM_TASK_PRIORITIES];
+
+   // Enqueue from least to most urgent.
+   for (int i = 0; i < NUM_TASK_PRIORITIES; i++) {
+      args[i].state    = &state;
+      args[i].priority = NUM_TASK_PRIORITIES - 1 - i;
+      platform_status rc = task_enqueue_priority(data->tasks,
+                                                 TASK_TYPE_NORMAL,
+                                                 args[i].priority,
+                                                 priority_task_record,
+                                                 &args[i],
+                                                 FALSE);
+      ASSERT_TRUE(SUCCESS(rc));
+   }
+
+   task_perform_all(data->tasks);
+
+   ASSERT_EQUAL(NUM_TASK_PRIORITIES, state.num_run);
+   for (task_priority prio = 0; prio < NUM_TASK_PRIORITIES; prio++) {
+      ASSERT_EQUAL(prio, state.order[prio]);
+   }
+}
+
+static void
+priority_task_record(void *arg, void *scratch)
+{
+   priority_task_arg *parg = (priority_task_arg *)arg;
+   parg->state->order[parg->state->num_run++] = parg->priority;
+}
+
+static void
+bg_task_count(void *arg, void *scratch)
+{
+   bg_task_state *state = (bg_task_state *)arg;
+   __sync_fetch_and_add(&state->num_run, 1);
+}
+
+static void
+bg_task_spawn(void *arg, void *scratch)
+{
+   bg_task_state *state = (bg_task_state *)arg;
+   for (uint64 i = 0; i < state->num_children; i++) {
+      platform_status rc = task_enqueue(
+         state->tasks, TASK_TYPE_NORMAL, bg_task_count, state, FALSE);
+      platform_assert_status_ok(rc);
+   }
+   __sync_fetch_and_add(&state->num_run, 1);
+}
+
 /*
  * exec_one_thread_use_lower_apis() - Worker routine executed by a single
  * thread.